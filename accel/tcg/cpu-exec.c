@@ -284,6 +284,27 @@ hit:
     return tb;
 }
 
+#ifdef XBOX
+/* Blocks translated at most per pass of the execution loop */
+#define TB_WARMUP_BATCH 16
+
+/* Translate the blocks recorded in a previous run, see tb-warmup.c */
+static void tb_warmup_translate(CPUState *cpu)
+{
+    TCGTBCPUState s;
+    int budget = TB_WARMUP_BATCH;
+
+    while (budget > 0 && tb_warmup_next(cpu, &s)) {
+        if (!tb_htable_lookup(cpu, s)) {
+            mmap_lock();
+            tb_gen_code(cpu, s);
+            mmap_unlock();
+            budget--;
+        }
+    }
+}
+#endif
+
 static void log_cpu_exec(vaddr pc, CPUState *cpu,
                          const TranslationBlock *tb)
 {
@@ -418,6 +439,9 @@ const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
     if (tb == NULL) {
         return tcg_code_gen_epilogue;
     }
+#ifdef XBOX
+    qatomic_set(&tb->exec_count, tb->exec_count + 1);
+#endif
 
     if (qemu_loglevel_mask(CPU_LOG_TB_CPU | CPU_LOG_EXEC)) {
         log_cpu_exec(s.pc, cpu, tb);
@@ -672,6 +696,49 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     qemu_spin_unlock(&tb_next->jmp_lock);
 }
 
+#ifdef XBOX
+/* Blocks translated at most each time the vCPU is found halted */
+#define TB_HALTED_BATCH 64
+
+/*
+ * Translate while halted, the rest of the recorded blocks and then likely
+ * targets, see tb-warmup.c
+ */
+static void tb_halted_translate(CPUState *cpu)
+{
+    TCGTBCPUState s;
+    int budget = TB_HALTED_BATCH;
+
+    /* Returns here when the code buffer had to be flushed */
+    if (sigsetjmp(cpu->jmp_env, 0) != 0) {
+        cpu_exec_longjmp_cleanup(cpu);
+        cpu->exception_index = -1;
+        tb_speculate_done();
+        return;
+    }
+
+    while (budget > 0 && tb_warmup_pending() && !cpu_has_work(cpu) &&
+           !qatomic_read(&cpu->exit_request) && tb_warmup_next(cpu, &s)) {
+        if (!tb_htable_lookup(cpu, s)) {
+            mmap_lock();
+            tb_gen_code(cpu, s);
+            mmap_unlock();
+            budget--;
+        }
+    }
+
+    while (budget > 0 && tb_speculate_next(cpu, &s)) {
+        if (!tb_htable_lookup(cpu, s)) {
+            mmap_lock();
+            tb_gen_code(cpu, s);
+            mmap_unlock();
+            budget--;
+        }
+    }
+    tb_speculate_done();
+}
+#endif
+
 static inline bool cpu_handle_halt(CPUState *cpu)
 {
 #ifndef CONFIG_USER_ONLY
@@ -965,6 +1032,11 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
 
         while (!cpu_handle_interrupt(cpu, &last_tb)) {
             TranslationBlock *tb;
+#ifdef XBOX
+            if (unlikely(tb_warmup_pending())) {
+                tb_warmup_translate(cpu);
+            }
+#endif
             TCGTBCPUState s = cpu->cc->tcg_ops->get_tb_cpu_state(cpu);
             s.cflags = cpu->cflags_next_tb;
 
@@ -1019,6 +1091,9 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
             if (last_tb) {
                 tb_add_jump(last_tb, tb_exit, tb);
             }
+#ifdef XBOX
+            qatomic_set(&tb->exec_count, tb->exec_count + 1);
+#endif
 
             cpu_loop_exec_tb(cpu, tb, s.pc, &last_tb, &tb_exit);
 
@@ -1049,6 +1124,11 @@ int cpu_exec(CPUState *cpu)
     current_cpu = cpu;
 
     if (cpu_handle_halt(cpu)) {
+#ifdef XBOX
+        WITH_RCU_READ_LOCK_GUARD() {
+            tb_halted_translate(cpu);
+        }
+#endif
         return EXCP_HALTED;
     }
 
@@ -75,6 +75,16 @@ uint32_t curr_cflags(CPUState *cpu);
 
 void tb_check_watchpoint(CPUState *cpu, uintptr_t retaddr);
 
+/* See tb-warmup.c */
+void tb_warmup_record(CPUState *cpu, TCGTBCPUState s,
+                      const TranslationBlock *tb, const void *host_pc);
+void tb_warmup_flush(void);
+bool tb_warmup_pending(void);
+bool tb_warmup_next(CPUState *cpu, TCGTBCPUState *s);
+void tb_speculate_hint(const TranslationBlock *tb, vaddr dest);
+bool tb_speculate_next(CPUState *cpu, TCGTBCPUState *s);
+void tb_speculate_done(void);
+
 /**
  * get_page_addr_code_hostp()
  * @env: CPUArchState
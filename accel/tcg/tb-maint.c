@@ -788,6 +788,10 @@ void tb_flush__exclusive_or_serial(void)
         tcg_flush_jmp_cache(cpu);
     }
 
+#ifdef XBOX
+    tb_warmup_flush();
+#endif
+
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     qht_reset_size(&tb_ctx.inv_htable, CODE_GEN_HTABLE_SIZE);
     tb_remove_all();
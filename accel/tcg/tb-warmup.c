@@ -0,0 +1,380 @@
+/*
+ * Translation block warm-up
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/fast-hash.h"
+#include "qemu/thread.h"
+#include "hw/core/cpu.h"
+#include "accel/tcg/cpu-mmu-index.h"
+#include "accel/tcg/probe.h"
+#include "accel/tcg/tb-warmup.h"
+#include "exec/target_page.h"
+#include "exec/tlb-flags.h"
+#include "exec/translation-block.h"
+#include "internal-common.h"
+
+/* Records whose code was not found for this many runs in a row are dropped */
+#define TB_WARMUP_MAX_MISSES 4
+
+/* Most records kept for the next run, those executed most often first */
+#define TB_WARMUP_MAX_RECORDS 65536
+
+/* Starts with the record, so that it is also the hash table key */
+typedef struct TBWarmupEntry {
+    TBWarmupRecord record;
+    const TranslationBlock *tb; /* Latest translation, until a flush */
+    uint64_t exec_count;        /* Of the translations before it */
+} TBWarmupEntry;
+
+static struct {
+    QemuMutex lock;
+    bool recording;
+    bool pending;
+    GHashTable *records; /* Recorded this run, TBWarmupEntry set */
+    GArray *queue;       /* To translate, TBWarmupRecord */
+    guint queue_pos;
+    GArray *missed;      /* Queued but not found in memory */
+} tb_warmup;
+
+static guint tb_warmup_record_hash(gconstpointer key)
+{
+    const TBWarmupRecord *r = key;
+    return (guint)(r->pc ^ (r->pc >> 32) ^ r->cs_base) * 31 + r->flags;
+}
+
+static gboolean tb_warmup_record_equal(gconstpointer a, gconstpointer b)
+{
+    const TBWarmupRecord *ra = a, *rb = b;
+    return ra->pc == rb->pc && ra->cs_base == rb->cs_base &&
+           ra->flags == rb->flags;
+}
+
+static void __attribute__((constructor)) tb_warmup_init(void)
+{
+    qemu_mutex_init(&tb_warmup.lock);
+    tb_warmup.records = g_hash_table_new_full(
+        tb_warmup_record_hash, tb_warmup_record_equal, g_free, NULL);
+    tb_warmup.queue = g_array_new(false, false, sizeof(TBWarmupRecord));
+    tb_warmup.missed = g_array_new(false, false, sizeof(TBWarmupRecord));
+}
+
+void tb_warmup_start(const TBWarmupRecord *records, size_t num_records)
+{
+    qemu_mutex_lock(&tb_warmup.lock);
+    g_hash_table_remove_all(tb_warmup.records);
+    g_array_set_size(tb_warmup.queue, 0);
+    g_array_append_vals(tb_warmup.queue, records, num_records);
+    tb_warmup.queue_pos = 0;
+    g_array_set_size(tb_warmup.missed, 0);
+    qatomic_set(&tb_warmup.recording, true);
+    qatomic_set(&tb_warmup.pending, num_records > 0);
+    qemu_mutex_unlock(&tb_warmup.lock);
+}
+
+static void tb_warmup_keep(const TBWarmupRecord *r, int misses)
+{
+    if (misses > TB_WARMUP_MAX_MISSES ||
+        g_hash_table_contains(tb_warmup.records, r)) {
+        return;
+    }
+
+    TBWarmupEntry *e = g_new0(TBWarmupEntry, 1);
+    e->record = *r;
+    e->record.misses = misses;
+    g_hash_table_add(tb_warmup.records, e);
+}
+
+/*
+ * Adds up the executions of the entry's translation, which is only counted
+ * as long as its memory has not been reused.
+ */
+static void tb_warmup_retire(TBWarmupEntry *e)
+{
+    if (e->tb) {
+        e->exec_count += qatomic_read(&e->tb->exec_count);
+        e->tb = NULL;
+    }
+}
+
+/* Called before the code buffer is flushed */
+void tb_warmup_flush(void)
+{
+    GHashTableIter iter;
+    TBWarmupEntry *e;
+
+    qemu_mutex_lock(&tb_warmup.lock);
+    g_hash_table_iter_init(&iter, tb_warmup.records);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&e, NULL)) {
+        tb_warmup_retire(e);
+    }
+    qemu_mutex_unlock(&tb_warmup.lock);
+}
+
+static int tb_warmup_compare_exec_count(const void *a, const void *b)
+{
+    const TBWarmupEntry *ea = *(const TBWarmupEntry *const *)a;
+    const TBWarmupEntry *eb = *(const TBWarmupEntry *const *)b;
+
+    return ea->exec_count < eb->exec_count ? 1 :
+           ea->exec_count > eb->exec_count ? -1 : 0;
+}
+
+TBWarmupRecord *tb_warmup_stop(size_t *num_records)
+{
+    qemu_mutex_lock(&tb_warmup.lock);
+    qatomic_set(&tb_warmup.recording, false);
+    qatomic_set(&tb_warmup.pending, false);
+
+    for (guint i = 0; i < tb_warmup.missed->len; i++) {
+        const TBWarmupRecord *r =
+            &g_array_index(tb_warmup.missed, TBWarmupRecord, i);
+        tb_warmup_keep(r, r->misses + 1);
+    }
+    for (guint i = tb_warmup.queue_pos; i < tb_warmup.queue->len; i++) {
+        const TBWarmupRecord *r =
+            &g_array_index(tb_warmup.queue, TBWarmupRecord, i);
+        tb_warmup_keep(r, r->misses);
+    }
+    g_array_set_size(tb_warmup.queue, 0);
+    g_array_set_size(tb_warmup.missed, 0);
+
+    /*
+     * Blocks only translated by the warm-up or carried over from earlier
+     * runs have not been executed in this one and are the first to go.
+     */
+    guint n;
+    g_autofree TBWarmupEntry **entries = (TBWarmupEntry **)
+        g_hash_table_get_keys_as_array(tb_warmup.records, &n);
+    for (guint i = 0; i < n; i++) {
+        tb_warmup_retire(entries[i]);
+    }
+    if (n > TB_WARMUP_MAX_RECORDS) {
+        qsort(entries, n, sizeof(*entries), tb_warmup_compare_exec_count);
+        n = TB_WARMUP_MAX_RECORDS;
+    }
+
+    TBWarmupRecord *records = g_new(TBWarmupRecord, n);
+    for (guint i = 0; i < n; i++) {
+        records[i] = entries[i]->record;
+    }
+    g_hash_table_remove_all(tb_warmup.records);
+    qemu_mutex_unlock(&tb_warmup.lock);
+
+    *num_records = n;
+    return records;
+}
+
+/* Called from tb_gen_code() for every block it returns */
+void tb_warmup_record(CPUState *cpu, TCGTBCPUState s,
+                      const TranslationBlock *tb, const void *host_pc)
+{
+    if (!qatomic_read(&tb_warmup.recording) || tb_page_addr0(tb) == -1 ||
+        tb_page_addr1(tb) != -1 || tb_cflags(tb) != curr_cflags(cpu)) {
+        return;
+    }
+
+    TBWarmupRecord r = {
+        .pc = s.pc,
+        .cs_base = s.cs_base,
+        .code_hash = fast_hash(host_pc, tb->size),
+        .flags = s.flags,
+        .code_size = tb->size,
+    };
+
+    qemu_mutex_lock(&tb_warmup.lock);
+    if (tb_warmup.recording) {
+        TBWarmupEntry *e = g_hash_table_lookup(tb_warmup.records, &r);
+        if (e) {
+            /* Translated again, or its code has since been overwritten */
+            tb_warmup_retire(e);
+        } else {
+            e = g_new0(TBWarmupEntry, 1);
+            g_hash_table_add(tb_warmup.records, e);
+        }
+        e->record = r;
+        e->tb = tb;
+    }
+    qemu_mutex_unlock(&tb_warmup.lock);
+}
+
+bool tb_warmup_pending(void)
+{
+    return qatomic_read(&tb_warmup.pending);
+}
+
+static bool tb_warmup_check(CPUState *cpu, const TBWarmupRecord *r)
+{
+    void *host;
+
+    if ((r->pc & ~TARGET_PAGE_MASK) + r->code_size > TARGET_PAGE_SIZE) {
+        return false;
+    }
+
+    /* The page may well not be mapped yet, which must not fault */
+    int flags = probe_access_flags(cpu_env(cpu), r->pc, 1, MMU_INST_FETCH,
+                                   cpu_mmu_index(cpu, true), true, &host, 0);
+    if ((flags & (TLB_INVALID_MASK | TLB_MMIO)) || !host) {
+        return false;
+    }
+
+    return fast_hash(host, r->code_size) == r->code_hash;
+}
+
+/*
+ * Called by the vCPU, a few blocks at a time, until it returns false,
+ * translating each block it returns. The code of these has been checked to
+ * be the one recorded.
+ */
+bool tb_warmup_next(CPUState *cpu, TCGTBCPUState *s)
+{
+    bool found = false;
+
+    qemu_mutex_lock(&tb_warmup.lock);
+    while (tb_warmup.queue_pos < tb_warmup.queue->len) {
+        const TBWarmupRecord *r = &g_array_index(
+            tb_warmup.queue, TBWarmupRecord, tb_warmup.queue_pos++);
+
+        if (tb_warmup_check(cpu, r)) {
+            *s = (TCGTBCPUState){
+                .pc = r->pc,
+                .flags = r->flags,
+                .cflags = curr_cflags(cpu),
+                .cs_base = r->cs_base,
+            };
+            found = true;
+            break;
+        }
+        g_array_append_val(tb_warmup.missed, *r);
+    }
+    if (!found) {
+        qatomic_set(&tb_warmup.pending, false);
+    }
+    qemu_mutex_unlock(&tb_warmup.lock);
+
+    return found;
+}
+
+/*
+ * Speculative translation: the direct branch targets of translated blocks
+ * are queued, and translated while the vCPU is halted, before it executes
+ * them. Guest titles halt for a good part of every frame, which makes this
+ * translation time free, unlike translating on the miss. Targets of blocks
+ * translated this way are queued in turn, down to a small depth.
+ */
+#define TB_SPECULATE_QUEUE_SIZE 256
+#define TB_SPECULATE_MAX_DEPTH 4
+
+typedef struct TBSpeculateEntry {
+    vaddr pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    int depth;
+} TBSpeculateEntry;
+
+static bool tb_speculate_enabled;
+
+/* Queued and drained by the vCPU thread only */
+static __thread struct {
+    TBSpeculateEntry queue[TB_SPECULATE_QUEUE_SIZE];
+    unsigned int head, tail;
+    int depth; /* Of the block being translated speculatively, if any */
+} tb_speculate;
+
+void tb_speculate_set_enabled(bool enabled)
+{
+    qatomic_set(&tb_speculate_enabled, enabled);
+}
+
+/* Called by the translator for every target it chains to directly */
+void tb_speculate_hint(const TranslationBlock *tb, vaddr dest)
+{
+    if (!qatomic_read(&tb_speculate_enabled) ||
+        tb_speculate.depth >= TB_SPECULATE_MAX_DEPTH) {
+        return;
+    }
+
+    /* When full, the oldest targets are the least likely to be next */
+    if (tb_speculate.head - tb_speculate.tail == TB_SPECULATE_QUEUE_SIZE) {
+        tb_speculate.tail++;
+    }
+    tb_speculate.queue[tb_speculate.head++ % TB_SPECULATE_QUEUE_SIZE] =
+        (TBSpeculateEntry){
+            .pc = dest,
+            .cs_base = tb->cs_base,
+            .flags = tb->flags,
+            .depth = tb_speculate.depth + 1,
+        };
+}
+
+/* Translating must not fault, on the page of pc or the next one */
+static bool tb_speculate_check(CPUState *cpu, vaddr pc)
+{
+    int mmu_idx = cpu_mmu_index(cpu, true);
+    vaddr page = pc & TARGET_PAGE_MASK;
+    void *host;
+
+    for (int i = 0; i < 2; i++) {
+        int flags = probe_access_flags(cpu_env(cpu), page + i * TARGET_PAGE_SIZE,
+                                       1, MMU_INST_FETCH, mmu_idx, true, &host,
+                                       0);
+        if ((flags & (TLB_INVALID_MASK | TLB_MMIO)) || !host) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Returns the most recently queued block that can be translated safely, as
+ * long as the vCPU is idle with no work pending. Targets found already
+ * translated are to be skipped by the caller.
+ */
+bool tb_speculate_next(CPUState *cpu, TCGTBCPUState *s)
+{
+    tb_speculate.depth = 0;
+
+    while (tb_speculate.tail != tb_speculate.head) {
+        if (cpu_has_work(cpu) || qatomic_read(&cpu->exit_request)) {
+            return false;
+        }
+
+        TBSpeculateEntry e = tb_speculate.queue[--tb_speculate.head %
+                                                TB_SPECULATE_QUEUE_SIZE];
+        if (!tb_speculate_check(cpu, e.pc)) {
+            continue;
+        }
+
+        *s = (TCGTBCPUState){
+            .pc = e.pc,
+            .flags = e.flags,
+            .cflags = curr_cflags(cpu),
+            .cs_base = e.cs_base,
+        };
+        tb_speculate.depth = e.depth;
+        return true;
+    }
+
+    return false;
+}
+
+void tb_speculate_done(void)
+{
+    tb_speculate.depth = 0;
+}
@@ -34,6 +34,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/guest-random.h"
 #include "qemu/timer.h"
+#include "qemu/timeline.h"
 #include "exec/cputlb.h"
 #include "exec/hwaddr.h"
 #include "exec/tb-flush.h"
@@ -78,9 +79,11 @@ int tcg_cpu_exec(CPUState *cpu)
 {
     int ret;
     assert(tcg_enabled());
+    int64_t zone_start = timeline_begin();
     cpu_exec_start(cpu);
     ret = cpu_exec(cpu);
     cpu_exec_end(cpu);
+    timeline_end("cpu_exec", NULL, zone_start);
 
     return ret;
 }
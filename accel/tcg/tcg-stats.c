@@ -97,6 +97,20 @@ static void print_qht_statistics(struct qht_stats hst, GString *buf)
     g_free(hgram);
 }
 
+#ifdef XBOX
+#define TB_HOT_COUNT 16
+
+/* Copied out of the TB tree, which is only safe to walk under its lock */
+struct tb_hot_entry {
+    tb_page_addr_t phys_pc;
+    uint32_t exec_count;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t followed_jumps;
+    tb_page_addr_t succ[2]; /* Of the chained jumps, -1 if unchained */
+};
+#endif
+
 struct tb_tree_stats {
     size_t nb_tbs;
     size_t host_size;
@@ -105,8 +119,54 @@ struct tb_tree_stats {
     size_t direct_jmp_count;
     size_t direct_jmp2_count;
     size_t cross_page;
+#ifdef XBOX
+    size_t chained_jmp_count;
+    size_t superblock_count;
+    size_t followed_jmp_count;
+    uint64_t exec_count;
+    size_t nb_hot;
+    struct tb_hot_entry hot[TB_HOT_COUNT]; /* By decreasing exec_count */
+#endif
 };
 
+#ifdef XBOX
+static tb_page_addr_t tb_chained_dest(const TranslationBlock *tb, int n)
+{
+    uintptr_t dest = qatomic_read(&tb->jmp_dest[n]);
+    const TranslationBlock *tb_next = (const TranslationBlock *)(dest & ~1);
+
+    return tb_next ? tb_page_addr0(tb_next) : -1;
+}
+
+static void tb_tree_stats_hot(struct tb_tree_stats *tst,
+                              const TranslationBlock *tb)
+{
+    uint32_t count = qatomic_read(&tb->exec_count);
+    size_t i = tst->nb_hot;
+
+    if (!count ||
+        (i == TB_HOT_COUNT && count <= tst->hot[i - 1].exec_count)) {
+        return;
+    }
+    if (i == TB_HOT_COUNT) {
+        i--;
+    } else {
+        tst->nb_hot++;
+    }
+    for (; i > 0 && tst->hot[i - 1].exec_count < count; i--) {
+        tst->hot[i] = tst->hot[i - 1];
+    }
+    tst->hot[i] = (struct tb_hot_entry){
+        .phys_pc = tb_page_addr0(tb),
+        .exec_count = count,
+        .size = tb->size,
+        .icount = tb->icount,
+        .followed_jumps = tb->followed_jumps,
+        .succ = { tb_chained_dest(tb, 0), tb_chained_dest(tb, 1) },
+    };
+}
+#endif
+
 static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
 {
     const TranslationBlock *tb = value;
@@ -129,9 +189,55 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
             tst->direct_jmp2_count++;
         }
     }
+#ifdef XBOX
+    for (int i = 0; i < 2; i++) {
+        if (tb_chained_dest(tb, i) != -1) {
+            tst->chained_jmp_count++;
+        }
+    }
+    if (tb->followed_jumps) {
+        tst->superblock_count++;
+        tst->followed_jmp_count += tb->followed_jumps;
+    }
+    tst->exec_count += qatomic_read(&tb->exec_count);
+    tb_tree_stats_hot(tst, tb);
+#endif
     return false;
 }
 
+#ifdef XBOX
+static void dump_hot_info(const struct tb_tree_stats *tst, GString *buf)
+{
+    if (!tst->nb_hot) {
+        return;
+    }
+
+    /*
+     * TBs entered most often other than through chained jumps, that is the
+     * targets of indirect jumps and returns: the hot paths of the guest
+     * that chaining does not cover.
+     */
+    g_string_append_printf(buf, "\nHot unchained TBs:\n");
+    g_string_append_printf(buf, "%-18s %10s %6s %6s %5s  %s\n",
+                           "phys pc", "entries", "insns", "bytes", "jmps",
+                           "chained to");
+    for (size_t i = 0; i < tst->nb_hot; i++) {
+        const struct tb_hot_entry *e = &tst->hot[i];
+
+        g_string_append_printf(buf, "0x%016" PRIx64 " %10u %6u %6u %5u ",
+                               (uint64_t)e->phys_pc, e->exec_count, e->icount,
+                               e->size, e->followed_jumps);
+        for (int j = 0; j < 2; j++) {
+            if (e->succ[j] != -1) {
+                g_string_append_printf(buf, " 0x%" PRIx64,
+                                       (uint64_t)e->succ[j]);
+            }
+        }
+        g_string_append_c(buf, '\n');
+    }
+}
+#endif
+
 static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -198,12 +304,27 @@ static void dump_exec_info(GString *buf)
                            tst.direct_jmp2_count,
                            nb_tbs ? (tst.direct_jmp2_count * 100) / nb_tbs : 0);
 
+#ifdef XBOX
+    g_string_append_printf(buf, "chained jump count  %zu\n",
+                           tst.chained_jmp_count);
+    g_string_append_printf(buf, "superblock count    %zu (%zu%%) "
+                           "(followed jumps=%zu)\n",
+                           tst.superblock_count,
+                           nb_tbs ? (tst.superblock_count * 100) / nb_tbs : 0,
+                           tst.followed_jmp_count);
+    g_string_append_printf(buf, "unchained entries   %" PRIu64 "\n",
+                           tst.exec_count);
+#endif
+
     qht_statistics_init(&tb_ctx.htable, &hst);
     print_qht_statistics(hst, buf);
     qht_statistics_destroy(&hst);
 
     g_string_append_printf(buf, "\nStatistics:\n");
     tcg_dump_flush_info(buf);
+#ifdef XBOX
+    dump_hot_info(&tst, buf);
+#endif
 }
 
 void tcg_get_stats(AccelState *accel, GString *buf)
@@ -346,6 +346,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu, TCGTBCPUState s)
 
  restart_translate:
     trace_translate_block(tb, s.pc, tb->tc.ptr);
+#ifdef XBOX
+    tb->exec_count = 0;
+    tb->followed_jumps = 0;
+#endif
 
     gen_code_size = setjmp_gen_code(env, tb, s.pc, host_pc, &max_insns, &ti);
     if (unlikely(gen_code_size < 0)) {
@@ -568,6 +572,10 @@ recycle_tb:
         return existing_tb;
     }
 
+#ifdef XBOX
+    tb_warmup_record(cpu, s, tb, host_pc);
+#endif
+
 #if defined(CONFIG_VTUNE_JITPROFILING)
     if (iJIT_IsProfilingActive() == iJIT_SAMPLING_ON && !recycled) {
         iJIT_Method_Load *jmethod = g_malloc0(sizeof(iJIT_Method_Load));
@@ -0,0 +1,574 @@
+/*
+ * QEMU Block driver for Xbox disc images
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Presents an image as is, like "raw", but reads it through a mapping of the
+ * file and reads ahead the files of the XDVDFS filesystem on it: when the
+ * guest starts reading a file, the rest of it is faulted in by a worker
+ * thread so that it is in memory by the time the guest gets to it. Titles
+ * mostly load data by reading whole files sequentially, in requests small
+ * enough that each one waits on the disk otherwise.
+ *
+ * Images whose file cannot be mapped, such as compressed (qcow2) ones, which
+ * "file.driver" selects, are read in chunks kept in a cache instead. Files
+ * are read ahead into it by several requests at once, so that the chunks
+ * are decompressed in parallel, by the worker threads of the image driver.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/madvise.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+
+#define XISO_SECTOR_SIZE 2048
+#define XISO_VOLUME_SECTOR 32
+#define XISO_MAGIC "MICROSOFT*XBOX*MEDIA"
+#define XISO_DIRENT_SIZE 14 /* Without the name */
+#define XISO_ATTR_DIRECTORY 0x10
+
+#define XISO_MAX_DEPTH 32
+#define XISO_MAX_DIR_SIZE (16 * MiB)
+#define XISO_MAX_FILES 65536
+
+/* Reads past the start of a file that still count as opening it */
+#define XISO_OPEN_WINDOW (64 * KiB)
+#define XISO_READ_AHEAD_MAX (64 * MiB)
+
+#define XISO_CHUNK_SIZE (256 * KiB)
+#define XISO_CACHE_CHUNKS (2 * XISO_READ_AHEAD_MAX / XISO_CHUNK_SIZE)
+#define XISO_READ_AHEAD_WORKERS 4
+
+/*
+ * Offsets of the game partition in full disc images: none for images of
+ * the partition alone (extract-xiso), then XGD1, XGD2 and XGD3 discs.
+ */
+static const uint64_t xiso_partition_offsets[] = {
+    0, 0x18300000, 0x0FD90000, 0x02080000,
+};
+
+typedef struct XisoExtent {
+    uint64_t offset;
+    uint64_t size;
+    bool read_ahead; /* Scheduled already */
+} XisoExtent;
+
+typedef struct XisoChunk {
+    uint64_t index;
+    uint8_t *data;
+    int ret;
+    bool loading;
+    int refs;
+    CoQueue waiters; /* For the chunk to be loaded */
+    QTAILQ_ENTRY(XisoChunk) lru;
+} XisoChunk;
+
+typedef struct BDRVXisoState {
+    GMappedFile *map;
+    const uint8_t *data;
+    uint64_t size;
+
+    XisoExtent *extents; /* Of files, sorted by offset */
+    size_t num_extents;
+
+    /* When not mapped */
+    QemuMutex lock;
+    GHashTable *chunks; /* Index to XisoChunk */
+    QTAILQ_HEAD(, XisoChunk) lru; /* Least recently used first */
+
+    bool read_ahead_cancel;
+} BDRVXisoState;
+
+typedef struct XisoCopy {
+    QEMUIOVector *qiov;
+    const uint8_t *src;
+    size_t bytes;
+} XisoCopy;
+
+typedef struct XisoReadAhead {
+    BlockDriverState *bs;
+    const uint8_t *start;
+    size_t bytes;
+} XisoReadAhead;
+
+typedef struct XisoChunkReadAhead {
+    BlockDriverState *bs;
+    uint64_t next;
+    uint64_t end;
+    int workers;
+} XisoChunkReadAhead;
+
+static void xiso_scan_dir(BdrvChild *file, GArray *extents, uint64_t part,
+                          uint32_t sector, uint32_t size, int depth)
+{
+    if (depth > XISO_MAX_DEPTH || size == 0 || size > XISO_MAX_DIR_SIZE) {
+        return;
+    }
+
+    g_autofree uint8_t *dir = g_malloc(size);
+    if (bdrv_pread(file, part + (uint64_t)sector * XISO_SECTOR_SIZE, size,
+                   dir, 0) < 0) {
+        return;
+    }
+
+    /*
+     * Entries form a binary tree, but are packed in order with the rest of
+     * each sector padded with 0xff, so they can be read in a single pass.
+     */
+    uint32_t pos = 0;
+    while (pos + XISO_DIRENT_SIZE <= size && extents->len < XISO_MAX_FILES) {
+        if (lduw_le_p(dir + pos) == 0xffff) {
+            pos = ROUND_UP(pos + 1, XISO_SECTOR_SIZE);
+            continue;
+        }
+
+        uint32_t entry_sector = ldl_le_p(dir + pos + 4);
+        uint32_t entry_size = ldl_le_p(dir + pos + 8);
+        uint8_t attributes = dir[pos + 12];
+        uint8_t name_len = dir[pos + 13];
+        if (pos + XISO_DIRENT_SIZE + name_len > size) {
+            break;
+        }
+
+        if (attributes & XISO_ATTR_DIRECTORY) {
+            xiso_scan_dir(file, extents, part, entry_sector, entry_size,
+                          depth + 1);
+        } else if (entry_size) {
+            XisoExtent e = {
+                .offset = part + (uint64_t)entry_sector * XISO_SECTOR_SIZE,
+                .size = entry_size,
+            };
+            g_array_append_val(extents, e);
+        }
+
+        pos = ROUND_UP(pos + XISO_DIRENT_SIZE + name_len, 4);
+    }
+}
+
+static int xiso_extent_compare(gconstpointer a, gconstpointer b)
+{
+    const XisoExtent *ea = a, *eb = b;
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/* Lists the files of the filesystem, if the image has one */
+static void xiso_scan(BlockDriverState *bs)
+{
+    BDRVXisoState *s = bs->opaque;
+    uint8_t volume[XISO_SECTOR_SIZE];
+
+    for (int i = 0; i < ARRAY_SIZE(xiso_partition_offsets); i++) {
+        uint64_t part = xiso_partition_offsets[i];
+        if (bdrv_pread(bs->file,
+                       part + XISO_VOLUME_SECTOR * XISO_SECTOR_SIZE,
+                       sizeof(volume), volume, 0) < 0 ||
+            memcmp(volume, XISO_MAGIC, strlen(XISO_MAGIC))) {
+            continue;
+        }
+
+        GArray *extents = g_array_new(false, false, sizeof(XisoExtent));
+        xiso_scan_dir(bs->file, extents, part, ldl_le_p(volume + 20),
+                      ldl_le_p(volume + 24), 0);
+        g_array_sort(extents, xiso_extent_compare);
+        s->num_extents = extents->len;
+        s->extents = (XisoExtent *)g_array_free(extents, false);
+        return;
+    }
+}
+
+static void xiso_map(BlockDriverState *bs)
+{
+    BDRVXisoState *s = bs->opaque;
+    BlockDriverState *file = bs->file->bs;
+
+    if (strcmp(file->drv->format_name, "file")) {
+        return;
+    }
+
+    s->map = g_mapped_file_new(file->filename, false, NULL);
+    if (!s->map) {
+        return;
+    }
+    s->data = (const uint8_t *)g_mapped_file_get_contents(s->map);
+    s->size = g_mapped_file_get_length(s->map);
+}
+
+static int xiso_open(BlockDriverState *bs, QDict *options, int flags,
+                     Error **errp)
+{
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    bdrv_graph_rdlock_main_loop();
+    ret = bdrv_apply_auto_read_only(bs, NULL, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    int64_t len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get image size");
+        return len;
+    }
+    bs->total_sectors = DIV_ROUND_UP(len, BDRV_SECTOR_SIZE);
+
+    BDRVXisoState *s = bs->opaque;
+    s->size = len;
+    qemu_mutex_init(&s->lock);
+    s->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+
+    xiso_map(bs);
+    xiso_scan(bs);
+
+    return 0;
+}
+
+static int xiso_copy_func(void *opaque)
+{
+    XisoCopy *c = opaque;
+    qemu_iovec_from_buf(c->qiov, 0, c->src, c->bytes);
+    return 0;
+}
+
+static int xiso_read_ahead_func(void *opaque)
+{
+    XisoReadAhead *ra = opaque;
+    BDRVXisoState *s = ra->bs->opaque;
+    size_t page_size = qemu_real_host_page_size();
+    uintptr_t start = ROUND_DOWN((uintptr_t)ra->start, page_size);
+    uintptr_t end = (uintptr_t)ra->start + ra->bytes;
+
+    /* Only a hint, which is not honoured by every filesystem */
+    qemu_madvise((void *)start, end - start, QEMU_MADV_WILLNEED);
+
+    for (uintptr_t p = start; p < end; p += page_size) {
+        if (qatomic_read(&s->read_ahead_cancel)) {
+            break;
+        }
+        (void)*(volatile const uint8_t *)p;
+    }
+
+    return 0;
+}
+
+static void xiso_read_ahead_cb(void *opaque, int ret)
+{
+    XisoReadAhead *ra = opaque;
+
+    bdrv_dec_in_flight(ra->bs);
+    g_free(ra);
+}
+
+static void xiso_free_chunk(BDRVXisoState *s, XisoChunk *c)
+{
+    g_hash_table_remove(s->chunks, &c->index);
+    QTAILQ_REMOVE(&s->lru, c, lru);
+    g_free(c->data);
+    g_free(c);
+}
+
+/* Called with the lock held. Chunks in use stay, over the limit if need be */
+static void xiso_evict_chunks(BDRVXisoState *s)
+{
+    XisoChunk *c, *next;
+    guint num = g_hash_table_size(s->chunks);
+
+    QTAILQ_FOREACH_SAFE(c, &s->lru, lru, next) {
+        if (num <= XISO_CACHE_CHUNKS) {
+            break;
+        }
+        if (!c->refs) {
+            xiso_free_chunk(s, c);
+            num--;
+        }
+    }
+}
+
+/*
+ * Returns the chunk, referenced, once it is loaded. Its ret is that of the
+ * read of it, which is tried again by the next user if it failed.
+ */
+static XisoChunk * coroutine_fn GRAPH_RDLOCK
+xiso_get_chunk(BlockDriverState *bs, uint64_t index)
+{
+    BDRVXisoState *s = bs->opaque;
+    XisoChunk *c;
+
+    qemu_mutex_lock(&s->lock);
+    c = g_hash_table_lookup(s->chunks, &index);
+    if (c) {
+        c->refs++;
+        QTAILQ_REMOVE(&s->lru, c, lru);
+        QTAILQ_INSERT_TAIL(&s->lru, c, lru);
+        while (c->loading) {
+            qemu_co_queue_wait(&c->waiters, &s->lock);
+        }
+        qemu_mutex_unlock(&s->lock);
+        return c;
+    }
+
+    c = g_new0(XisoChunk, 1);
+    c->index = index;
+    c->loading = true;
+    c->refs = 1;
+    qemu_co_queue_init(&c->waiters);
+    g_hash_table_insert(s->chunks, &c->index, c);
+    QTAILQ_INSERT_TAIL(&s->lru, c, lru);
+    xiso_evict_chunks(s);
+    qemu_mutex_unlock(&s->lock);
+
+    /* The end of the last chunk past the image is left zeroed */
+    uint64_t offset = index * XISO_CHUNK_SIZE;
+    c->data = g_malloc0(XISO_CHUNK_SIZE);
+    int ret = bdrv_co_pread(bs->file, offset,
+                            MIN(XISO_CHUNK_SIZE, s->size - offset), c->data,
+                            0);
+
+    qemu_mutex_lock(&s->lock);
+    c->ret = ret < 0 ? ret : 0;
+    c->loading = false;
+    qemu_co_queue_restart_all(&c->waiters);
+    qemu_mutex_unlock(&s->lock);
+
+    return c;
+}
+
+static void xiso_put_chunk(BDRVXisoState *s, XisoChunk *c)
+{
+    qemu_mutex_lock(&s->lock);
+    if (!--c->refs && c->ret < 0) {
+        xiso_free_chunk(s, c);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void coroutine_fn xiso_chunk_read_ahead_entry(void *opaque)
+{
+    XisoChunkReadAhead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVXisoState *s = bs->opaque;
+
+    WITH_GRAPH_RDLOCK_GUARD() {
+        while (ra->next < ra->end && !qatomic_read(&s->read_ahead_cancel)) {
+            xiso_put_chunk(s, xiso_get_chunk(bs, ra->next++));
+        }
+    }
+
+    if (!--ra->workers) {
+        g_free(ra);
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+static void xiso_chunk_read_ahead(BlockDriverState *bs, uint64_t start,
+                                  uint64_t end)
+{
+    XisoChunkReadAhead *ra = g_new(XisoChunkReadAhead, 1);
+    *ra = (XisoChunkReadAhead){
+        .bs = bs,
+        .next = start / XISO_CHUNK_SIZE,
+        .end = DIV_ROUND_UP(end, XISO_CHUNK_SIZE),
+        .workers = XISO_READ_AHEAD_WORKERS,
+    };
+
+    for (int i = 0; i < XISO_READ_AHEAD_WORKERS; i++) {
+        Coroutine *co = qemu_coroutine_create(xiso_chunk_read_ahead_entry, ra);
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs), co);
+    }
+}
+
+static XisoExtent *xiso_find_extent(BDRVXisoState *s, uint64_t offset)
+{
+    size_t lo = 0, hi = s->num_extents;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->extents[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0 || offset >= s->extents[lo - 1].offset +
+                                s->extents[lo - 1].size) {
+        return NULL;
+    }
+    return &s->extents[lo - 1];
+}
+
+/* Reads ahead the rest of the file, if this read is the guest opening it */
+static void xiso_maybe_read_ahead(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVXisoState *s = bs->opaque;
+    XisoExtent *e = xiso_find_extent(s, offset);
+
+    if (!e || e->read_ahead || offset - e->offset >= XISO_OPEN_WINDOW) {
+        return;
+    }
+    e->read_ahead = true;
+
+    uint64_t start = offset + bytes;
+    uint64_t end = MIN(MIN(e->offset + e->size, s->size),
+                       start + XISO_READ_AHEAD_MAX);
+    if (start >= end) {
+        return;
+    }
+
+    if (!s->map) {
+        xiso_chunk_read_ahead(bs, start, end);
+        return;
+    }
+
+    XisoReadAhead *ra = g_new(XisoReadAhead, 1);
+    *ra = (XisoReadAhead){
+        .bs = bs,
+        .start = s->data + start,
+        .bytes = end - start,
+    };
+    bdrv_inc_in_flight(bs);
+    thread_pool_submit_aio(xiso_read_ahead_func, ra, xiso_read_ahead_cb, ra);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+xiso_co_preadv_cached(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                      QEMUIOVector *qiov)
+{
+    BDRVXisoState *s = bs->opaque;
+    size_t qiov_offset = 0;
+
+    while (bytes) {
+        uint64_t pos = offset % XISO_CHUNK_SIZE;
+        uint64_t n = MIN(bytes, XISO_CHUNK_SIZE - pos);
+        XisoChunk *c = xiso_get_chunk(bs, offset / XISO_CHUNK_SIZE);
+        int ret = c->ret;
+
+        if (!ret) {
+            qemu_iovec_from_buf(qiov, qiov_offset, c->data + pos, n);
+        }
+        xiso_put_chunk(s, c);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+xiso_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+               QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVXisoState *s = bs->opaque;
+
+    if (offset + bytes > s->size) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    xiso_maybe_read_ahead(bs, offset, bytes);
+
+    if (!s->map) {
+        return xiso_co_preadv_cached(bs, offset, bytes, qiov);
+    }
+
+    /* Page faults on the mapping block, so copy on a worker thread */
+    XisoCopy c = {
+        .qiov = qiov,
+        .src = s->data + offset,
+        .bytes = bytes,
+    };
+    return thread_pool_submit_co(xiso_copy_func, &c);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+xiso_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void xiso_drain_begin(BlockDriverState *bs)
+{
+    BDRVXisoState *s = bs->opaque;
+    qatomic_set(&s->read_ahead_cancel, true);
+}
+
+static void xiso_drain_end(BlockDriverState *bs)
+{
+    BDRVXisoState *s = bs->opaque;
+    qatomic_set(&s->read_ahead_cancel, false);
+}
+
+static void xiso_close(BlockDriverState *bs)
+{
+    BDRVXisoState *s = bs->opaque;
+
+    XisoChunk *c, *next;
+
+    QTAILQ_FOREACH_SAFE(c, &s->lru, lru, next) {
+        xiso_free_chunk(s, c);
+    }
+    g_hash_table_destroy(s->chunks);
+    qemu_mutex_destroy(&s->lock);
+
+    g_free(s->extents);
+    if (s->map) {
+        g_mapped_file_unref(s->map);
+    }
+}
+
+static BlockDriver bdrv_xiso = {
+    .format_name            = "xiso",
+    .instance_size          = sizeof(BDRVXisoState),
+    .bdrv_open              = xiso_open,
+    .bdrv_child_perm        = bdrv_default_perms,
+    .bdrv_co_preadv         = xiso_co_preadv,
+    .bdrv_co_getlength      = xiso_co_getlength,
+    .bdrv_drain_begin       = xiso_drain_begin,
+    .bdrv_drain_end         = xiso_drain_end,
+    .bdrv_close             = xiso_close,
+    .is_format              = true,
+};
+
+static void bdrv_xiso_init(void)
+{
+    bdrv_register(&bdrv_xiso);
+}
+
+block_init(bdrv_xiso_init);
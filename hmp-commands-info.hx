@@ -831,6 +831,67 @@ SRST
     Show SEV information.
 ERST
 
+#if defined(TARGET_I386)
+    {
+        .name       = "dsp-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the Xbox audio DSP cycle profile",
+    },
+#endif
+
+SRST
+  ``info dsp-profile``
+    Show the hottest instructions of the Xbox audio DSPs, see
+    ``x-dsp-profile``.
+ERST
+
+#if defined(TARGET_I386)
+    {
+        .name       = "apu-timing",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the Xbox audio frame time breakdown",
+    },
+#endif
+
+SRST
+  ``info apu-timing``
+    Show histograms of the time spent in each stage of an Xbox audio
+    frame, and the audio output underruns and overruns.
+ERST
+
+#if defined(TARGET_I386)
+    {
+        .name       = "nvnet-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the Xbox network controller statistics",
+    },
+#endif
+
+SRST
+  ``info nvnet-stats``
+    Show packet counters, delay histograms and ring occupancy of the Xbox
+    network controller.
+ERST
+
+#if defined(TARGET_I386)
+    {
+        .name       = "xemu-perf",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show Xbox performance telemetry",
+    },
+#endif
+
+SRST
+  ``info xemu-perf``
+    Show NV2A counters, renderer cache hit rates, device memory use, host
+    and device memory use by category and audio processor load, see
+    ``x-query-xemu-perf``.
+ERST
+
     {
         .name       = "replay",
         .args_type  = "",
@@ -324,7 +324,9 @@ static void cpu_common_initfn(Object *obj)
     QSIMPLEQ_INIT(&cpu->work_list);
     QTAILQ_INIT(&cpu->breakpoints);
     QTAILQ_INIT(&cpu->watchpoints);
-    QTAILQ_INIT(&cpu->mem_access_callbacks);
+    cpu->mem_access_callbacks = (IntervalTreeRoot){};
+    qemu_mutex_init(&cpu->mem_access_callbacks_lock);
+    QSIMPLEQ_INIT(&cpu->mem_access_callbacks_pending);
 
     cpu_exec_initfn(cpu);
 
@@ -357,6 +359,7 @@ static void cpu_common_finalize(Object *obj)
     }
     qemu_lockcnt_destroy(&cpu->in_ioctl_lock);
     qemu_mutex_destroy(&cpu->work_mutex);
+    qemu_mutex_destroy(&cpu->mem_access_callbacks_lock);
     qemu_cond_destroy(cpu->halt_cond);
     g_free(cpu->halt_cond);
     g_free(cpu->thread);
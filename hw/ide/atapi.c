@@ -30,6 +30,9 @@
 #include "scsi/constants.h"
 #include "ide-internal.h"
 #include "trace.h"
+#ifdef XBOX
+#include "ui/xemu-settings.h"
+#endif
 
 #define ATAPI_SECTOR_BITS (2 + BDRV_SECTOR_BITS)
 #define ATAPI_SECTOR_SIZE (1 << ATAPI_SECTOR_BITS)
@@ -419,6 +422,68 @@ eot:
     ide_set_inactive(s, false);
 }
 
+#ifdef XBOX
+/*
+ * Fast disc reads: the sectors of a command are read straight into the guest
+ * memory its PRDs describe, with one request, instead of through the I/O
+ * buffer in chunks of IDE_DMA_BUF_SECTORS / 4 sectors, each read only once
+ * the previous one is copied out. Titles that stream data issue large reads,
+ * which the block layer can then read ahead and split as it sees fit.
+ *
+ * PRDs too short for the whole command end it without an interrupt, like
+ * ide_dma_cb() does for disks, rather than transferring what fits.
+ */
+static void ide_atapi_cmd_read_dma_direct_cb(void *opaque, int ret)
+{
+    IDEState *s = opaque;
+
+    if (ret < 0) {
+        if (ide_handle_rw_error(s, -ret, ide_dma_cmd_to_retry(s->dma_cmd))) {
+            ide_dma_buf_commit(s, 0);
+            if (s->bus->error_status) {
+                s->bus->dma->aiocb = NULL;
+                return;
+            }
+            goto eot;
+        }
+    }
+
+    if (s->io_buffer_size > 0) {
+        ide_dma_buf_commit(s, s->sg.size);
+        s->lba += s->packet_transfer_size >> ATAPI_SECTOR_BITS;
+        s->packet_transfer_size = 0;
+        s->status = READY_STAT | SEEK_STAT;
+        s->nsector = (s->nsector & ~7) | ATAPI_INT_REASON_IO |
+                     ATAPI_INT_REASON_CD;
+        ide_bus_set_irq(s->bus);
+        goto eot;
+    }
+
+    if (s->bus->dma->ops->prepare_buf(s->bus->dma, s->packet_transfer_size) <
+        s->packet_transfer_size) {
+        s->status = READY_STAT | SEEK_STAT;
+        ide_dma_buf_commit(s, 0);
+        goto eot;
+    }
+
+    trace_ide_atapi_cmd_read_dma_cb_aio(
+        s, s->lba, s->packet_transfer_size >> ATAPI_SECTOR_BITS);
+    s->bus->dma->aiocb = dma_blk_read(s->blk, &s->sg,
+                                      (int64_t)s->lba << ATAPI_SECTOR_BITS,
+                                      BDRV_SECTOR_SIZE,
+                                      ide_atapi_cmd_read_dma_direct_cb, s);
+    return;
+
+eot:
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(s->blk), &s->acct);
+    } else {
+        block_acct_done(blk_get_stats(s->blk), &s->acct);
+    }
+    ide_set_inactive(s, false);
+}
+#endif
+
 /* start a CD-ROM read command with DMA */
 /* XXX: test if DMA is available */
 static void ide_atapi_cmd_read_dma(IDEState *s, int lba, int nb_sectors,
@@ -436,6 +501,12 @@ static void ide_atapi_cmd_read_dma(IDEState *s, int lba, int nb_sectors,
 
     /* XXX: check if BUSY_STAT should be set */
     s->status = READY_STAT | SEEK_STAT | DRQ_STAT | BUSY_STAT;
+#ifdef XBOX
+    if (g_config.perf.fast_disc_reads && sector_size == ATAPI_SECTOR_SIZE) {
+        ide_start_dma(s, ide_atapi_cmd_read_dma_direct_cb);
+        return;
+    }
+#endif
     ide_start_dma(s, ide_atapi_cmd_read_dma_cb);
 }
 
@@ -97,6 +97,9 @@ static void usb_ohci_exit(PCIDevice *dev)
         usb_bus_release(&s->bus);
     }
 
+#ifdef XBOX
+    ohci_unregister_instance(s);
+#endif
     timer_free(s->eof_timer);
 }
 
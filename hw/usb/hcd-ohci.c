@@ -37,6 +37,10 @@
 #include "hw/qdev-properties.h"
 #include "trace.h"
 #include "hcd-ohci.h"
+#ifdef XBOX
+#include "qemu/main-loop.h"
+#include "ui/xemu-settings.h"
+#endif
 
 /* This causes frames to occur 1000x slower */
 /*#define OHCI_TIME_WARP 1*/
@@ -1177,11 +1181,78 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head)
     return active;
 }
 
+#ifdef XBOX
+/*
+ * Once no transfer completes and no list needs service for a while, the
+ * frame timer is only run every few frames, each run processing the frames
+ * that ended since the last one in a row. Devices answer polls with NAKs
+ * when there is nothing new, so idle frames only walk the periodic list.
+ * Any register access, completion or input change returns to full rate.
+ */
+#define OHCI_IDLE_FRAMES 16
+#define OHCI_COALESCED_FRAMES 8
+
+static QLIST_HEAD(, OHCIState) ohci_instances =
+    QLIST_HEAD_INITIALIZER(ohci_instances);
+static QEMUBH *ohci_wake_bh;
+#endif
+
 /* set a timer for EOF */
 static void ohci_eof_timer(OHCIState *ohci)
 {
+#ifdef XBOX
+    if (ohci->coalesced) {
+        timer_mod(ohci->eof_timer,
+                  ohci->sof_time + usb_frame_time * OHCI_COALESCED_FRAMES);
+        return;
+    }
+#endif
     timer_mod(ohci->eof_timer, ohci->sof_time + usb_frame_time);
 }
+
+#ifdef XBOX
+static void ohci_full_rate(OHCIState *ohci)
+{
+    ohci->idle_frames = 0;
+    if (ohci->coalesced) {
+        ohci->coalesced = false;
+        if (timer_pending(ohci->eof_timer)) {
+            ohci_eof_timer(ohci);
+        }
+    }
+}
+
+static void ohci_update_idle(OHCIState *ohci, uint32_t old_done)
+{
+    if (!g_config.perf.coalesce_usb_frames || ohci->done != old_done ||
+        ohci->async_td ||
+        (ohci->status & (OHCI_STATUS_CLF | OHCI_STATUS_BLF)) ||
+        (ohci->intr & OHCI_INTR_SF)) {
+        ohci_full_rate(ohci);
+    } else if (++ohci->idle_frames >= OHCI_IDLE_FRAMES) {
+        ohci->coalesced = true;
+    }
+}
+
+static void ohci_wake_bh_cb(void *opaque)
+{
+    OHCIState *ohci;
+
+    QLIST_FOREACH(ohci, &ohci_instances, next) {
+        ohci_full_rate(ohci);
+    }
+}
+
+/* Returns every controller to full rate, may be called from any thread */
+void ohci_wake_all(void)
+{
+    QEMUBH *bh = qatomic_read(&ohci_wake_bh);
+
+    if (bh) {
+        qemu_bh_schedule(bh);
+    }
+}
+#endif
 /* Set a timer for EOF and generate a SOF event */
 static void ohci_sof(OHCIState *ohci)
 {
@@ -1211,16 +1282,15 @@ static void ohci_process_lists(OHCIState *ohci)
     }
 }
 
-/* Do frame processing on frame boundary */
-static void ohci_frame_boundary(void *opaque)
+/* Do frame processing on frame boundary, returns false if the bus stopped */
+static bool ohci_process_frame(OHCIState *ohci)
 {
-    OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
 
     if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
         trace_usb_ohci_hcca_read_error(ohci->hcca);
         ohci_die(ohci);
-        return;
+        return false;
     }
 
     /* Process all the lists at the end of the frame */
@@ -1240,7 +1310,7 @@ static void ohci_frame_boundary(void *opaque)
 
     /* Stop if UnrecoverableError happened or ohci_sof will crash */
     if (ohci->intr_status & OHCI_INTR_UE) {
-        return;
+        return false;
     }
 
     /* Frame boundary, so do EOF stuf here */
@@ -1274,7 +1344,37 @@ static void ohci_frame_boundary(void *opaque)
     /* Writeback HCCA */
     if (ohci_put_hcca(ohci, ohci->hcca, &hcca)) {
         ohci_die(ohci);
+        return false;
     }
+
+    return true;
+}
+
+static void ohci_frame_boundary(void *opaque)
+{
+    OHCIState *ohci = opaque;
+
+#ifdef XBOX
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    for (int i = 0; i < OHCI_COALESCED_FRAMES; i++) {
+        uint32_t old_done = ohci->done;
+
+        if (!ohci_process_frame(ohci)) {
+            timer_del(ohci->eof_timer);
+            return;
+        }
+        ohci_update_idle(ohci, old_done);
+
+        /* Catch up with the frames that ended since the last run */
+        if (!ohci->coalesced || ohci->sof_time + usb_frame_time > now) {
+            break;
+        }
+    }
+    ohci_eof_timer(ohci);
+#else
+    ohci_process_frame(ohci);
+#endif
 }
 
 /*
@@ -1289,6 +1389,10 @@ static int ohci_bus_start(OHCIState *ohci)
      * not ready to receive it and can meet some race conditions
      */
     ohci->sof_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+#ifdef XBOX
+    ohci->idle_frames = 0;
+    ohci->coalesced = false;
+#endif
     ohci_eof_timer(ohci);
 
     return 1;
@@ -1651,6 +1755,10 @@ static void ohci_mem_write(void *opaque,
         return;
     }
 
+#ifdef XBOX
+    ohci_full_rate(ohci);
+#endif
+
     if (addr >= 0x54 && addr < 0x54 + ohci->num_ports * 4) {
         /* HcRhPortStatus */
         trace_usb_ohci_mem_port_write(size, "HcRhPortStatus",
@@ -1854,6 +1962,9 @@ static void ohci_wakeup(USBPort *port1)
         port->ctrl &= ~OHCI_PORT_PSS;
         intr = OHCI_INTR_RHSC;
     }
+#ifdef XBOX
+    ohci_full_rate(s);
+#endif
     /* Note that the controller can be suspended even if this port is not */
     if (ohci_resume(s)) {
         /*
@@ -1871,6 +1982,9 @@ static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
 
     trace_usb_ohci_async_complete();
     ohci->async_complete = true;
+#ifdef XBOX
+    ohci_full_rate(ohci);
+#endif
     ohci_process_lists(ohci);
 }
 
@@ -1951,8 +2065,22 @@ void usb_ohci_init(OHCIState *ohci, DeviceState *dev, uint32_t num_ports,
 
     ohci->eof_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                    ohci_frame_boundary, ohci);
+
+#ifdef XBOX
+    if (!ohci_wake_bh) {
+        qatomic_set(&ohci_wake_bh, qemu_bh_new(ohci_wake_bh_cb, NULL));
+    }
+    QLIST_INSERT_HEAD(&ohci_instances, ohci, next);
+#endif
 }
 
+#ifdef XBOX
+void ohci_unregister_instance(OHCIState *ohci)
+{
+    QLIST_REMOVE(ohci, next);
+}
+#endif
+
 /*
  * A typical OHCI will stop operating and set itself into error state
  * (which can be queried by MMIO) to signal that it got an error.
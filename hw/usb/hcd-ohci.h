@@ -46,6 +46,12 @@ struct OHCIState {
 
     QEMUTimer *eof_timer;
     int64_t sof_time;
+#ifdef XBOX
+    /* Frames in a row without activity, and whether they are now coalesced */
+    int idle_frames;
+    bool coalesced;
+    QLIST_ENTRY(OHCIState) next;
+#endif
 
     /* OHCI state */
     /* Control partition */
@@ -120,5 +126,9 @@ void ohci_bus_stop(OHCIState *ohci);
 void ohci_stop_endpoints(OHCIState *ohci);
 void ohci_hard_reset(OHCIState *ohci);
 void ohci_sysbus_die(struct OHCIState *ohci);
+#ifdef XBOX
+void ohci_unregister_instance(OHCIState *ohci);
+void ohci_wake_all(void);
+#endif
 
 #endif
@@ -55,6 +55,7 @@
 #include "smbus.h"
 
 #include "qemu/option.h"
+#include "qemu/thread.h"
 #include "xbox.h"
 
 #include "block/block.h"
@@ -188,6 +189,96 @@ type_init(chihiro_register_types)
 #define COMMUNICATION_SECTORS    0x10000
 #define SECTOR_SIZE              512
 
+/*
+ * The filesystem image is copied into the board ram on a thread, so that the
+ * machine does not wait for all of it before starting. Images are mapped
+ * rather than read, and the mappings are kept, so loading the same image
+ * again is served from memory instead of the disk.
+ */
+
+typedef struct ChihiroMediaLoad {
+    GMappedFile *image;
+    uint8_t *dest;
+    size_t size;
+    QemuThread thread;
+} ChihiroMediaLoad;
+
+static ChihiroMediaLoad media_load;
+
+/* Mapped images, by path, size and modification time */
+static GHashTable *media_image_cache;
+
+static GMappedFile *get_media_image(const char *path, Error **errp)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        error_setg_errno(errp, errno, "cannot open media image %s", path);
+        return NULL;
+    }
+
+    g_autofree char *key = g_strdup_printf(
+        "%s:%" PRId64 ":%" PRId64, path, (int64_t)st.st_size,
+        (int64_t)st.st_mtime);
+
+    if (!media_image_cache) {
+        media_image_cache =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)g_mapped_file_unref);
+    }
+
+    GMappedFile *image = g_hash_table_lookup(media_image_cache, key);
+    if (!image) {
+        GError *err = NULL;
+        image = g_mapped_file_new(path, false, &err);
+        if (!image) {
+            error_setg(errp, "cannot map media image %s: %s", path,
+                       err->message);
+            g_error_free(err);
+            return NULL;
+        }
+        g_hash_table_insert(media_image_cache, g_steal_pointer(&key), image);
+    }
+
+    return g_mapped_file_ref(image);
+}
+
+static void *media_load_thread(void *opaque)
+{
+    ChihiroMediaLoad *l = opaque;
+    const uint8_t *src = (const uint8_t *)g_mapped_file_get_contents(l->image);
+
+    memcpy(l->dest, src, l->size);
+
+    g_mapped_file_unref(l->image);
+    l->image = NULL;
+
+    return NULL;
+}
+
+static void start_media_load(const char *path, uint8_t *dest,
+                             size_t dest_size)
+{
+    ChihiroMediaLoad *l = &media_load;
+
+    l->image = get_media_image(path, &error_fatal);
+    l->size = g_mapped_file_get_length(l->image);
+    if (l->size > dest_size) {
+        error_report("media image %s does not fit in board ram", path);
+        exit(1);
+    }
+
+    l->dest = dest;
+
+    if (l->size == 0) {
+        g_mapped_file_unref(l->image);
+        l->image = NULL;
+        return;
+    }
+
+    qemu_thread_create(&l->thread, "chihiro.media", media_load_thread, l,
+                       QEMU_THREAD_DETACHED);
+}
+
 static void chihiro_ide_interface_init(const char *rom_file,
                                        const char *filesystem_file)
 {
@@ -241,16 +332,9 @@ static void chihiro_ide_interface_init(const char *rom_file,
     }
 
     if (filesystem_file && (*filesystem_file != '\x00')) {
-        assert(access(filesystem_file, R_OK) == 0);
-
-        int filesystem_size = get_image_size(filesystem_file);
-        assert(filesystem_size < memory_region_size(filesystem));
-
-        fd = open(filesystem_file, O_RDONLY | O_BINARY);
-        assert(fd != -1);
-        rc = read(fd, memory_region_get_ram_ptr(rom), filesystem_size);
-        assert(rc == filesystem_size);
-        close(fd);
+        start_media_load(filesystem_file,
+                         memory_region_get_ram_ptr(filesystem),
+                         memory_region_size(filesystem));
     }
 
 #if 0 // FIXME
@@ -20,6 +20,9 @@
  */
 
 #include "apu_int.h"
+#include "hw/xbox/xbox_mem.h"
+#include "qemu/thread-stats.h"
+#include "ui/xemu-capture.h"
 
 MCPXAPUState *g_state; // Used via debug handlers
 
@@ -71,12 +74,15 @@ static void mcpx_apu_write(void *opaque, hwaddr addr, uint64_t val,
     trace_mcpx_apu_reg_write(addr, size, val);
 
     switch (addr) {
-    case NV_PAPU_ISTS:
+    case NV_PAPU_ISTS: {
+        /* Dispatched without the BQL, which updating the IRQ needs */
+        BQL_LOCK_GUARD();
         /* the bits of the interrupts to clear are written */
         qatomic_and(&d->regs[NV_PAPU_ISTS], ~val);
         update_irq(d);
         qemu_cond_broadcast(&d->cond);
         break;
+    }
     case NV_PAPU_FECTL:
     case NV_PAPU_SECTL:
         qatomic_set(&d->regs[addr], val);
@@ -103,6 +109,57 @@ static const MemoryRegionOps mcpx_apu_mmio_ops = {
     .write = mcpx_apu_write,
 };
 
+/* How long a target latency is kept before it is lowered again */
+#define MONITOR_TARGET_DECAY_MS 10000
+
+static uint32_t monitor_ring_used(MCPXAPUState *d)
+{
+    return qatomic_load_acquire(&d->monitor.head) -
+           qatomic_load_acquire(&d->monitor.tail);
+}
+
+static void monitor_ring_push(MCPXAPUState *d, const void *data, uint32_t len)
+{
+    uint32_t head = d->monitor.head;
+    uint32_t mask = d->monitor.ring_size - 1;
+    uint32_t chunk = MIN(len, d->monitor.ring_size - (head & mask));
+
+    assert(d->monitor.ring_size - monitor_ring_used(d) >= len);
+    memcpy(d->monitor.ring + (head & mask), data, chunk);
+    memcpy(d->monitor.ring, (const uint8_t *)data + chunk, len - chunk);
+    qatomic_store_release(&d->monitor.head, head + len);
+    qemu_sem_post(&d->monitor.data_ready);
+}
+
+static void monitor_ring_pop(MCPXAPUState *d, void *data, uint32_t len)
+{
+    uint32_t tail = d->monitor.tail;
+    uint32_t mask = d->monitor.ring_size - 1;
+    uint32_t chunk = MIN(len, d->monitor.ring_size - (tail & mask));
+
+    assert(monitor_ring_used(d) >= len);
+    memcpy(data, d->monitor.ring + (tail & mask), chunk);
+    memcpy((uint8_t *)data + chunk, d->monitor.ring, len - chunk);
+    qatomic_store_release(&d->monitor.tail, tail + len);
+}
+
+/* Adjusts the number of frames kept queued after a callback */
+static void monitor_update_target(MCPXAPUState *d, bool underrun)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int target = qatomic_read(&d->monitor.target_frames);
+
+    if (underrun) {
+        target = MIN(target + 1, d->monitor.max_target_frames);
+        d->monitor.last_underrun_ms = now;
+    } else if (now - d->monitor.last_underrun_ms >= MONITOR_TARGET_DECAY_MS) {
+        target = MAX(target - 1, d->monitor.min_target_frames);
+        d->monitor.last_underrun_ms = now;
+    }
+
+    qatomic_set(&d->monitor.target_frames, target);
+}
+
 static void se_frame(MCPXAPUState *d)
 {
     mcpx_apu_update_dsp_preference(d);
@@ -110,9 +167,10 @@ static void se_frame(MCPXAPUState *d)
     g_dbg.gp_realtime = d->gp.realtime;
     g_dbg.ep_realtime = d->ep.realtime;
 
-    qemu_spin_lock(&d->monitor.fifo_lock);
-    int num_bytes_free = fifo8_num_free(&d->monitor.fifo);
-    qemu_spin_unlock(&d->monitor.fifo_lock);
+    /* Room left up to the target latency, may be negative once lowered */
+    int num_bytes_free =
+        qatomic_read(&d->monitor.target_frames) *
+            (int)sizeof(d->monitor.frame_buf) - (int)monitor_ring_used(d);
 
     /* A rudimentary calculation to determine approximately how taxed the APU
      * thread is, by measuring how much time we spend waiting for FIFO to drain
@@ -120,12 +178,18 @@ static void se_frame(MCPXAPUState *d)
      * =1: thread is not sleeping and likely falling behind realtime
      * <1: thread is able to complete work on time
      */
-    if (num_bytes_free < sizeof(d->monitor.frame_buf)) {
-        int64_t sleep_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
-        qemu_cond_wait(&d->cond, &d->lock);
-        int64_t sleep_end = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
-        d->sleep_acc += (sleep_end - sleep_start);
-        return;
+    if (!d->monitor.batch_frames_left) {
+        /* Only start on a batch once there is room for all of it */
+        if (num_bytes_free <
+            (int)(d->monitor.batch * sizeof(d->monitor.frame_buf))) {
+            int64_t sleep_start = get_clock();
+            qemu_cond_wait(&d->cond, &d->lock);
+            int64_t sleep_ns = get_clock() - sleep_start;
+            d->sleep_acc += sleep_ns / SCALE_US;
+            mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_SLEEP, sleep_ns);
+            return;
+        }
+        d->monitor.batch_frames_left = d->monitor.batch;
     }
     int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     if (now - d->frame_count_time >= 1000) {
@@ -139,6 +203,7 @@ static void se_frame(MCPXAPUState *d)
         d->sleep_acc = 0;
     }
     d->frame_count++;
+    int64_t frame_start = get_clock();
 
     /* Buffer for all mixbins for this frame */
     float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME] = { 0 };
@@ -147,6 +212,8 @@ static void se_frame(MCPXAPUState *d)
     mcpx_apu_dsp_frame(d, mixbins);
 
     if ((d->ep_frame_div + 1) % 8 == 0) {
+        int64_t push_start = get_clock();
+
 #if 0
         FILE *fd = fopen("ep.pcm", "a+");
         assert(fd != NULL);
@@ -154,6 +221,12 @@ static void se_frame(MCPXAPUState *d)
         fclose(fd);
 #endif
 
+        /* Recorded ahead of the volume limit, which is a playback setting */
+        if (xemu_capture_is_active()) {
+            xemu_capture_audio((const int16_t (*)[2])d->monitor.frame_buf,
+                               ARRAY_SIZE(d->monitor.frame_buf));
+        }
+
         if (0 <= g_config.audio.volume_limit && g_config.audio.volume_limit < 1) {
             float f = pow(g_config.audio.volume_limit, M_E);
             for (int i = 0; i < 256; i++) {
@@ -162,75 +235,155 @@ static void se_frame(MCPXAPUState *d)
             }
         }
 
-        qemu_spin_lock(&d->monitor.fifo_lock);
-        num_bytes_free = fifo8_num_free(&d->monitor.fifo);
-        assert(num_bytes_free >= sizeof(d->monitor.frame_buf));
-        fifo8_push_all(&d->monitor.fifo, (uint8_t *)d->monitor.frame_buf,
-                       sizeof(d->monitor.frame_buf));
-        qemu_spin_unlock(&d->monitor.fifo_lock);
+        monitor_ring_push(d, d->monitor.frame_buf,
+                          sizeof(d->monitor.frame_buf));
         memset(d->monitor.frame_buf, 0, sizeof(d->monitor.frame_buf));
+        d->monitor.batch_frames_left--;
+        mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_MONITOR_PUSH,
+                              get_clock() - push_start);
     }
 
     d->ep_frame_div++;
 
+    mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_FRAME,
+                          get_clock() - frame_start);
     mcpx_debug_end_frame();
 }
 
-/* Note: only supports millisecond resolution on Windows */
-static void sleep_ns(int64_t ns)
+/* Waits until len bytes are queued, returns false if the VM was stopped */
+static bool monitor_wait_data(MCPXAPUState *s, uint32_t len)
 {
-#ifndef _WIN32
-        struct timespec sleep_delay, rem_delay;
-        sleep_delay.tv_sec = ns / 1000000000LL;
-        sleep_delay.tv_nsec = ns % 1000000000LL;
-        nanosleep(&sleep_delay, &rem_delay);
-#else
-        Sleep(ns / SCALE_MS);
-#endif
+    while (monitor_ring_used(s) < len) {
+        if (!runstate_is_running()) {
+            return false;
+        }
+        qemu_cond_broadcast(&s->cond);
+        qemu_sem_timedwait(&s->monitor.data_ready, 5);
+    }
+
+    return runstate_is_running();
+}
+
+/*
+ * Plays queued frames back at the given rate (input frames per output frame)
+ * with linear interpolation, carrying the position over between callbacks.
+ */
+static bool monitor_play_stretched(MCPXAPUState *s, int16_t (*out)[2],
+                                   int num_frames, double ratio)
+{
+    int in_frames = (int)(s->monitor.rc_pos + (num_frames - 1) * ratio);
+    uint32_t in_len = in_frames * sizeof(s->monitor.rc_buf[0]);
+
+    if (!monitor_wait_data(s, in_len)) {
+        return false;
+    }
+    if (in_frames > s->monitor.rc_buf_frames) {
+        s->monitor.rc_buf = g_realloc_n(s->monitor.rc_buf, in_frames,
+                                        sizeof(s->monitor.rc_buf[0]));
+        s->monitor.rc_buf_frames = in_frames;
+    }
+    monitor_ring_pop(s, s->monitor.rc_buf, in_len);
+
+    int16_t (*in)[2] = s->monitor.rc_buf;
+    int16_t *prev = s->monitor.rc_prev;
+    int16_t *cur = s->monitor.rc_cur;
+    double pos = s->monitor.rc_pos;
+    int k = 0;
+
+    for (int i = 0; i < num_frames; i++) {
+        while (pos >= 1.0) {
+            prev[0] = cur[0];
+            prev[1] = cur[1];
+            cur[0] = in[k][0];
+            cur[1] = in[k][1];
+            k++;
+            pos -= 1.0;
+        }
+        out[i][0] = prev[0] + pos * (cur[0] - prev[0]);
+        out[i][1] = prev[1] + pos * (cur[1] - prev[1]);
+        pos += ratio;
+    }
+    assert(k == in_frames);
+
+    s->monitor.rc_pos = pos;
+    return true;
 }
 
 static void monitor_sink_cb(void *opaque, uint8_t *stream, int free_b)
 {
     MCPXAPUState *s = MCPX_APU_DEVICE(opaque);
 
-    if (!runstate_is_running()) {
-        memset(stream, 0, free_b);
-        return;
+    /* Runs on a thread of SDL's */
+    thread_stats_register_self("sdl_audio");
+
+    /*
+     * Only count running short as an underrun if frames are coming in, a
+     * higher latency does not help if the APU is idle.
+     */
+    uint32_t used = monitor_ring_used(s);
+    bool underrun = used > 0 && used < free_b;
+    if (underrun) {
+        qatomic_inc(&g_dbg.timing.underruns);
+    } else if (used > qatomic_read(&s->monitor.target_frames) *
+                          sizeof(s->monitor.frame_buf)) {
+        /* More latency than wanted, after the target was lowered */
+        qatomic_inc(&g_dbg.timing.overruns);
     }
 
-    int avail = 0;
-    while (avail < free_b) {
-        qemu_spin_lock(&s->monitor.fifo_lock);
-        avail = fifo8_num_used(&s->monitor.fifo);
-        qemu_spin_unlock(&s->monitor.fifo_lock);
-        if (avail < free_b) {
-            sleep_ns(1000000);
-            qemu_cond_broadcast(&s->cond);
-        }
-        if (!runstate_is_running()) {
-            memset(stream, 0, free_b);
-            return;
+    /*
+     * When the APU falls behind and the queue drains below half of the
+     * target, stretch the output by up to audio.rate_control instead of
+     * running dry. The APU is paced by this queue, so there is no need to
+     * speed playback up when it is ahead.
+     */
+    float max_dev = MIN(g_config.audio.rate_control, 0.5f);
+    bool played;
+    if (max_dev > 0) {
+        double half = qatomic_read(&s->monitor.target_frames) *
+                      sizeof(s->monitor.frame_buf) / 2.0;
+        double lag = MAX(0.0, (half - used) / half);
+        played = monitor_play_stretched(s, (int16_t (*)[2])stream,
+                                        free_b / sizeof(s->monitor.rc_buf[0]),
+                                        1.0 - max_dev * lag);
+    } else {
+        played = monitor_wait_data(s, free_b);
+        if (played) {
+            monitor_ring_pop(s, stream, free_b);
         }
     }
 
-    int to_copy = MIN(free_b, avail);
-    while (to_copy > 0) {
-        uint32_t chunk_len = 0;
-        qemu_spin_lock(&s->monitor.fifo_lock);
-        chunk_len = fifo8_pop_buf(&s->monitor.fifo, stream, to_copy);
-        assert(chunk_len <= to_copy);
-        qemu_spin_unlock(&s->monitor.fifo_lock);
-        stream += chunk_len;
-        to_copy -= chunk_len;
+    if (!played) {
+        memset(stream, 0, free_b);
+        return;
     }
 
+    monitor_update_target(s, underrun);
+
     qemu_cond_broadcast(&s->cond);
 }
 
 static void monitor_init(MCPXAPUState *d)
 {
-    qemu_spin_init(&d->monitor.fifo_lock);
-    fifo8_create(&d->monitor.fifo, 3 * (256 * 2 * 2));
+    /*
+     * Keep room for the frames being played on top of a batch, and let the
+     * target latency grow up to four times that on underruns.
+     */
+    d->monitor.min_target_frames = MAX(3, d->monitor.batch + 2);
+    d->monitor.max_target_frames = 4 * d->monitor.min_target_frames;
+    d->monitor.target_frames = d->monitor.min_target_frames;
+    d->monitor.last_underrun_ms = 0;
+    d->monitor.ring_size = pow2ceil(d->monitor.max_target_frames *
+                                    sizeof(d->monitor.frame_buf));
+    d->monitor.ring = g_malloc0(d->monitor.ring_size);
+    xbox_mem_set(XBOX_MEM_APU, sizeof(*d) + d->monitor.ring_size);
+    d->monitor.head = 0;
+    d->monitor.tail = 0;
+    qemu_sem_init(&d->monitor.data_ready, 0);
+    d->monitor.rc_buf = NULL;
+    d->monitor.rc_buf_frames = 0;
+    d->monitor.rc_pos = 0.0;
+    memset(d->monitor.rc_prev, 0, sizeof(d->monitor.rc_prev));
+    memset(d->monitor.rc_cur, 0, sizeof(d->monitor.rc_cur));
 
     struct SDL_AudioSpec sdl_audio_spec = {
         .freq = 48000,
@@ -264,6 +417,8 @@ static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
 
     memory_region_init_io(&d->mmio, OBJECT(dev), &mcpx_apu_mmio_ops, d,
                           "mcpx-apu-mmio", 0x80000);
+    /* Registers are atomic, only interrupt acknowledgement takes the BQL */
+    memory_region_clear_global_locking(&d->mmio);
 
     memory_region_init_io(&d->vp.mmio, OBJECT(dev), &vp_ops, d,
                           "mcpx-apu-vp", 0x10000);
@@ -287,6 +442,8 @@ static void mcpx_apu_exitfn(PCIDevice *dev)
     qemu_cond_broadcast(&d->cond);
     qemu_thread_join(&d->apu_thread);
     mcpx_apu_vp_finalize(d);
+    mcpx_apu_dsp_finalize(d);
+    thread_stats_unregister_lock(&d->lock);
 }
 
 static void mcpx_apu_reset(MCPXAPUState *d)
@@ -485,6 +642,7 @@ static const TypeInfo mcpx_apu_info = {
     .name = "mcpx-apu",
     .parent = TYPE_PCI_DEVICE,
     .instance_size = sizeof(MCPXAPUState),
+    .instance_align = __alignof__(MCPXAPUState),
     .class_init = mcpx_apu_class_init,
     .interfaces =
         (InterfaceInfo[]){
@@ -551,14 +709,17 @@ void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
 
     d->set_irq = false;
     d->exiting = false;
+    d->monitor.batch = MAX(1, MIN(g_config.audio.frame_batch, 16));
+    d->monitor.batch_frames_left = 0;
 
     qemu_mutex_init(&d->lock);
+    thread_stats_register_lock("apu", &d->lock);
     qemu_cond_init(&d->cond);
     qemu_add_vm_change_state_handler(mcpx_apu_vm_state_change, d);
 
     mcpx_apu_vp_init(d);
+    monitor_init(d);
+
     qemu_thread_create(&d->apu_thread, "mcpx.apu_thread", mcpx_apu_frame_thread,
                        d, QEMU_THREAD_JOINABLE);
-
-    monitor_init(d);
 }
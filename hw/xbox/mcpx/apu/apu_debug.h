@@ -68,12 +68,56 @@ struct McpxApuDebugVp
 struct McpxApuDebugDsp
 {
     int cycles;
+    uint64_t image_hash;
+};
+
+/* A frame of 32 samples at 48 kHz */
+#define MCPX_APU_DEBUG_FRAME_BUDGET_NS 666667
+
+/*
+ * Where the APU thread spends each frame. VP worker time is that of the
+ * slowest worker and so part of the dispatch wait, the EP runs alongside the
+ * GP with audio.dsp_pipeline.
+ */
+typedef enum McpxApuDebugStage {
+    MCPX_APU_DEBUG_STAGE_VP_VOICE_LISTS, /* Walking lists, locking voices */
+    MCPX_APU_DEBUG_STAGE_VP_DISPATCH,    /* Waiting for the workers */
+    MCPX_APU_DEBUG_STAGE_VP_WORKER,
+    MCPX_APU_DEBUG_STAGE_VP_REDUCE,      /* Adding up the workers' mixbins */
+    MCPX_APU_DEBUG_STAGE_GP,
+    MCPX_APU_DEBUG_STAGE_EP,
+    MCPX_APU_DEBUG_STAGE_MONITOR_PUSH,
+    MCPX_APU_DEBUG_STAGE_SLEEP,          /* Waiting for room in the FIFO */
+    MCPX_APU_DEBUG_STAGE_FRAME,          /* All but the sleep */
+    MCPX_APU_DEBUG_STAGE__COUNT
+} McpxApuDebugStage;
+
+#define MCPX_APU_DEBUG_TIMING_BUCKETS 10
+
+struct McpxApuDebugStageTiming
+{
+    uint64_t frames; /* In which the stage ran */
+    uint64_t total_ns;
+    int64_t max_ns;
+    uint64_t blamed; /* Frames over budget in which this stage took longest */
+    uint64_t histogram[MCPX_APU_DEBUG_TIMING_BUCKETS];
+};
+
+/* Since the timings were last reset */
+struct McpxApuDebugTiming
+{
+    struct McpxApuDebugStageTiming stages[MCPX_APU_DEBUG_STAGE__COUNT];
+    uint64_t frames;
+    uint64_t over_budget;
+    uint64_t underruns; /* Callbacks that found less queued than they play */
+    uint64_t overruns;  /* Callbacks that found more queued than the target */
 };
 
 struct McpxApuDebug
 {
     struct McpxApuDebugVp vp;
     struct McpxApuDebugDsp gp, ep;
+    struct McpxApuDebugTiming timing;
     int frames_processed;
     float utilization;
     bool gp_realtime, ep_realtime;
@@ -92,6 +136,13 @@ void mcpx_apu_debug_toggle_mute(uint16_t v);
 bool mcpx_apu_debug_is_muted(uint16_t v);
 void mcpx_apu_debug_set_gp_realtime_enabled(bool enable);
 void mcpx_apu_debug_set_ep_realtime_enabled(bool enable);
+void mcpx_apu_debug_set_dsp_profiling(bool enable);
+bool mcpx_apu_debug_is_dsp_profiling(void);
+char *mcpx_apu_debug_get_dsp_profile(void);
+const char *mcpx_apu_debug_get_stage_name(McpxApuDebugStage stage);
+/* Upper bound of the histogram bucket, -1 for the last */
+int mcpx_apu_debug_get_timing_bucket_limit_us(int bucket);
+void mcpx_apu_debug_reset_timing(void);
 
 #ifdef __cplusplus
 }
@@ -33,7 +33,6 @@
 #include "qemu/main-loop.h"
 #include "qemu/thread.h"
 #include "system/runstate.h"
-#include "qemu/fifo8.h"
 #include "ui/xemu-settings.h"
 
 #include "trace.h"
@@ -101,8 +100,33 @@ typedef struct MCPXAPUState {
     struct {
         McpxApuDebugMonitorPoint point;
         int16_t frame_buf[256][2]; // 1 EP frame (0x400 bytes), 8 buffered
-        QemuSpin fifo_lock;
-        Fifo8 fifo;
+
+        /*
+         * Single producer (APU thread), single consumer (audio callback)
+         * ring of output frames. head and tail are free running byte
+         * counts, only written by the producer and consumer respectively.
+         */
+        uint8_t *ring;
+        uint32_t ring_size; // Power of two
+        uint32_t head;
+        uint32_t tail;
+        QemuSemaphore data_ready;
+
+        /* Frames kept queued, raised on underruns and slowly lowered */
+        int target_frames;
+        int min_target_frames;
+        int max_target_frames;
+        int64_t last_underrun_ms;
+
+        /* Rate control state of the consumer */
+        int16_t (*rc_buf)[2];
+        int rc_buf_frames;
+        double rc_pos; // Of the next output frame, between rc_prev/rc_cur
+        int16_t rc_prev[2];
+        int16_t rc_cur[2];
+
+        int batch; // Frames rendered per wakeup
+        int batch_frames_left;
     } monitor;
 } MCPXAPUState;
 
@@ -113,5 +137,6 @@ extern uint64_t g_dbg_muted_voices[4];
 
 void mcpx_debug_begin_frame(void);
 void mcpx_debug_end_frame(void);
+void mcpx_debug_stage_time(McpxApuDebugStage stage, int64_t ns);
 
 #endif
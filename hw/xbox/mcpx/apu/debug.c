@@ -20,6 +20,36 @@
  */
 
 #include "apu_int.h"
+#include "monitor/monitor.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc-i386.h"
+#include "qapi/type-helpers.h"
+
+#define DSP_PROFILE_TOP 32
+
+static const char *const stage_names[MCPX_APU_DEBUG_STAGE__COUNT] = {
+    [MCPX_APU_DEBUG_STAGE_VP_VOICE_LISTS] = "vp_voice_lists",
+    [MCPX_APU_DEBUG_STAGE_VP_DISPATCH] = "vp_dispatch_wait",
+    [MCPX_APU_DEBUG_STAGE_VP_WORKER] = "vp_worker",
+    [MCPX_APU_DEBUG_STAGE_VP_REDUCE] = "vp_reduce",
+    [MCPX_APU_DEBUG_STAGE_GP] = "gp",
+    [MCPX_APU_DEBUG_STAGE_EP] = "ep",
+    [MCPX_APU_DEBUG_STAGE_MONITOR_PUSH] = "monitor_push",
+    [MCPX_APU_DEBUG_STAGE_SLEEP] = "sleep",
+    [MCPX_APU_DEBUG_STAGE_FRAME] = "frame",
+};
+
+/* Finer around the frame budget, the last bucket is unbounded */
+static const int timing_bucket_limits_us[MCPX_APU_DEBUG_TIMING_BUCKETS - 1] = {
+    50, 100, 200, 400, 667, 1000, 2000, 4000, 8000,
+};
+
+/* Of the frame being processed, the EP's written by its thread if pipelined */
+static int64_t frame_stage_ns[MCPX_APU_DEBUG_STAGE__COUNT];
+static bool frame_stage_ran[MCPX_APU_DEBUG_STAGE__COUNT];
+static bool timing_reset_requested;
 
 struct McpxApuDebug g_dbg, g_dbg_cache;
 int g_dbg_voice_monitor = -1;
@@ -38,11 +68,91 @@ void mcpx_debug_begin_frame(void)
     }
 }
 
+void mcpx_debug_stage_time(McpxApuDebugStage stage, int64_t ns)
+{
+    frame_stage_ns[stage] += ns;
+    frame_stage_ran[stage] = true;
+}
+
+static int timing_bucket(int64_t ns)
+{
+    for (int i = 0; i < ARRAY_SIZE(timing_bucket_limits_us); i++) {
+        if (ns < timing_bucket_limits_us[i] * SCALE_US) {
+            return i;
+        }
+    }
+    return MCPX_APU_DEBUG_TIMING_BUCKETS - 1;
+}
+
+static void mcpx_debug_record_timing(void)
+{
+    struct McpxApuDebugTiming *timing = &g_dbg.timing;
+
+    if (qatomic_xchg(&timing_reset_requested, false)) {
+        memset(timing->stages, 0, sizeof(timing->stages));
+        timing->frames = 0;
+        timing->over_budget = 0;
+        qatomic_set(&timing->underruns, 0);
+        qatomic_set(&timing->overruns, 0);
+    }
+
+    for (int i = 0; i < MCPX_APU_DEBUG_STAGE__COUNT; i++) {
+        struct McpxApuDebugStageTiming *stage = &timing->stages[i];
+        if (!frame_stage_ran[i]) {
+            continue;
+        }
+        stage->frames++;
+        stage->total_ns += frame_stage_ns[i];
+        stage->max_ns = MAX(stage->max_ns, frame_stage_ns[i]);
+        stage->histogram[timing_bucket(frame_stage_ns[i])]++;
+    }
+    timing->frames++;
+
+    /*
+     * Blame the longest of the stages that make up the frame, the worker
+     * time is part of the dispatch wait.
+     */
+    if (frame_stage_ns[MCPX_APU_DEBUG_STAGE_FRAME] >
+        MCPX_APU_DEBUG_FRAME_BUDGET_NS) {
+        int longest = MCPX_APU_DEBUG_STAGE_VP_VOICE_LISTS;
+        for (int i = 0; i < MCPX_APU_DEBUG_STAGE_SLEEP; i++) {
+            if (i != MCPX_APU_DEBUG_STAGE_VP_WORKER &&
+                frame_stage_ns[i] > frame_stage_ns[longest]) {
+                longest = i;
+            }
+        }
+        timing->stages[longest].blamed++;
+        timing->over_budget++;
+    }
+
+    memset(frame_stage_ns, 0, sizeof(frame_stage_ns));
+    memset(frame_stage_ran, 0, sizeof(frame_stage_ran));
+}
+
 void mcpx_debug_end_frame(void)
 {
+    mcpx_debug_record_timing();
     g_dbg_cache = g_dbg;
 }
 
+const char *mcpx_apu_debug_get_stage_name(McpxApuDebugStage stage)
+{
+    assert(stage < MCPX_APU_DEBUG_STAGE__COUNT);
+    return stage_names[stage];
+}
+
+int mcpx_apu_debug_get_timing_bucket_limit_us(int bucket)
+{
+    assert(bucket < MCPX_APU_DEBUG_TIMING_BUCKETS);
+    return bucket < ARRAY_SIZE(timing_bucket_limits_us) ?
+               timing_bucket_limits_us[bucket] : -1;
+}
+
+void mcpx_apu_debug_reset_timing(void)
+{
+    qatomic_set(&timing_reset_requested, true);
+}
+
 void mcpx_apu_debug_set_gp_realtime_enabled(bool run)
 {
     g_state->gp.realtime = run;
@@ -84,3 +194,113 @@ void mcpx_apu_debug_toggle_mute(uint16_t v)
     assert(v < MCPX_HW_MAX_VOICES);
     g_dbg_muted_voices[v / 64] ^= (1LL << (v % 64));
 }
+
+void mcpx_apu_debug_set_dsp_profiling(bool enable)
+{
+    qemu_mutex_lock(&g_state->lock);
+    dsp_set_profiling(g_state->gp.dsp, enable);
+    dsp_set_profiling(g_state->ep.dsp, enable);
+    dsp_reset_profile(g_state->gp.dsp);
+    dsp_reset_profile(g_state->ep.dsp);
+    qemu_mutex_unlock(&g_state->lock);
+}
+
+bool mcpx_apu_debug_is_dsp_profiling(void)
+{
+    return dsp_is_profiling(g_state->gp.dsp);
+}
+
+static void dsp_profile_report_all(GString *buf)
+{
+    qemu_mutex_lock(&g_state->lock);
+    g_string_append(buf, "GP:\n");
+    dsp_profile_report(g_state->gp.dsp, buf, DSP_PROFILE_TOP);
+    g_string_append(buf, "EP:\n");
+    dsp_profile_report(g_state->ep.dsp, buf, DSP_PROFILE_TOP);
+    qemu_mutex_unlock(&g_state->lock);
+}
+
+char *mcpx_apu_debug_get_dsp_profile(void)
+{
+    GString *buf = g_string_new(NULL);
+    dsp_profile_report_all(buf);
+    return g_string_free(buf, false);
+}
+
+void qmp_x_dsp_profile(bool enable, Error **errp)
+{
+    if (!g_state) {
+        error_setg(errp, "No MCPX APU present");
+        return;
+    }
+
+    mcpx_apu_debug_set_dsp_profiling(enable);
+}
+
+HumanReadableText *qmp_x_query_dsp_profile(Error **errp)
+{
+    if (!g_state) {
+        error_setg(errp, "No MCPX APU present");
+        return NULL;
+    }
+
+    g_autoptr(GString) buf = g_string_new(NULL);
+    dsp_profile_report_all(buf);
+    return human_readable_text_from_str(buf);
+}
+
+HumanReadableText *qmp_x_query_apu_timing(Error **errp)
+{
+    if (!g_state) {
+        error_setg(errp, "No MCPX APU present");
+        return NULL;
+    }
+
+    const struct McpxApuDebugTiming *timing = &g_dbg_cache.timing;
+    g_autoptr(GString) buf = g_string_new(NULL);
+
+    g_string_append_printf(buf,
+                           "frames %" PRIu64 ", over the %.3f ms budget %"
+                           PRIu64 "\n",
+                           timing->frames,
+                           MCPX_APU_DEBUG_FRAME_BUDGET_NS / (double)SCALE_MS,
+                           timing->over_budget);
+    g_string_append_printf(buf,
+                           "fifo underruns %" PRIu64 ", overruns %" PRIu64
+                           "\n\n",
+                           qatomic_read(&timing->underruns),
+                           qatomic_read(&timing->overruns));
+
+    g_string_append_printf(buf, "%-16s %10s %10s %10s %8s  histogram (us)\n",
+                           "stage", "frames", "avg us", "max us", "blamed");
+    for (int i = 0; i < MCPX_APU_DEBUG_STAGE__COUNT; i++) {
+        const struct McpxApuDebugStageTiming *stage = &timing->stages[i];
+        g_string_append_printf(
+            buf, "%-16s %10" PRIu64 " %10.1f %10.1f %8" PRIu64 " ",
+            stage_names[i], stage->frames,
+            stage->frames ? stage->total_ns / (double)stage->frames / SCALE_US :
+                            0.0,
+            stage->max_ns / (double)SCALE_US, stage->blamed);
+        for (int b = 0; b < MCPX_APU_DEBUG_TIMING_BUCKETS; b++) {
+            if (b < ARRAY_SIZE(timing_bucket_limits_us)) {
+                g_string_append_printf(buf, " <%d:%" PRIu64,
+                                       timing_bucket_limits_us[b],
+                                       stage->histogram[b]);
+            } else {
+                g_string_append_printf(buf, " more:%" PRIu64,
+                                       stage->histogram[b]);
+            }
+        }
+        g_string_append_c(buf, '\n');
+    }
+
+    return human_readable_text_from_str(buf);
+}
+
+static void mcpx_apu_debug_register_hmp(void)
+{
+    monitor_register_hmp_info_hrt("dsp-profile", qmp_x_query_dsp_profile);
+    monitor_register_hmp_info_hrt("apu-timing", qmp_x_query_apu_timing);
+}
+
+type_init(mcpx_apu_debug_register_hmp);
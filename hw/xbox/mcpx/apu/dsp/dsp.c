@@ -71,6 +71,7 @@ void dsp_reset(DSPState* dsp)
 
 void dsp_destroy(DSPState* dsp)
 {
+    g_free(dsp->core.pc_cycles);
     free(dsp);
 }
 
@@ -151,12 +152,18 @@ void dsp_run(DSPState* dsp, int cycles)
     if (dsp->save_cycles <= 0) return;
 
     int dma_timer = 0;
+    dsp->core.is_spinning = false;
+    uint32_t (*execute_block)(dsp_core_t*, int32_t) =
+        dsp56k_tracing(&dsp->core) ? dsp56k_execute_block_traced : dsp56k_execute_block;
 
     while (dsp->save_cycles > 0)
     {
-        dsp56k_execute_instruction(&dsp->core);
-        dsp->save_cycles -= dsp->core.instr_cycle;
-        dsp->core.cycle_count++;
+        /* Step one instruction at a time while DMA is marked running, so it
+         * is reported stopped after the same number of instructions. A DMA
+         * start is a peripheral write, which ends the block it happens in. */
+        bool dma_running = dsp->dma.control & DMA_CONTROL_RUNNING;
+        dsp->save_cycles -= execute_block(&dsp->core,
+                                          dma_running ? 1 : dsp->save_cycles);
 
         if (dsp->dma.control & DMA_CONTROL_RUNNING) {
             dma_timer++;
@@ -169,6 +176,10 @@ void dsp_run(DSPState* dsp, int cycles)
         }
 
         if (dsp->core.is_idle) break;
+
+        /* Nothing changes the polled peripheral until we return, the
+         * block has already taken the rest of the budget */
+        if (dsp->core.is_spinning) break;
     }
 
     /* FIXME: DMA timing be done cleaner. Xbox enables running
@@ -190,6 +201,7 @@ void dsp_bootstrap(DSPState* dsp)
         }
     }
     memset(dsp->core.pram_opcache, 0, sizeof(dsp->core.pram_opcache));
+    dsp->core.pram_dirty = true;
 }
 
 void dsp_start_frame(DSPState* dsp)
@@ -197,46 +209,180 @@ void dsp_start_frame(DSPState* dsp)
     dsp->interrupts |= INTERRUPT_START_FRAME;
 }
 
-uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t address)
+static int dsp_space_id(char space)
 {
-    int space_id;
-
     switch (space) {
     case 'X':
-        space_id = DSP_SPACE_X;
-        break;
+        return DSP_SPACE_X;
     case 'Y':
-        space_id = DSP_SPACE_Y;
-        break;
+        return DSP_SPACE_Y;
     case 'P':
-        space_id = DSP_SPACE_P;
-        break;
+        return DSP_SPACE_P;
     default:
         assert(false);
-        return 0;
+        return -1;
     }
+}
 
-    return dsp56k_read_memory(&dsp->core, space_id, address);
+uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t address)
+{
+    return dsp56k_read_memory(&dsp->core, dsp_space_id(space), address);
 }
 
 void dsp_write_memory(DSPState* dsp, char space, uint32_t address, uint32_t value)
 {
-    int space_id;
+    dsp56k_write_memory(&dsp->core, dsp_space_id(space), address, value);
+}
 
-    switch (space) {
-    case 'X':
-        space_id = DSP_SPACE_X;
-        break;
-    case 'Y':
-        space_id = DSP_SPACE_Y;
-        break;
-    case 'P':
-        space_id = DSP_SPACE_P;
-        break;
-    default:
-        assert(false);
+/* Copies straight from X/Y RAM when the range allows it */
+void dsp_read_memory_block(DSPState* dsp, char space, uint32_t address,
+                           uint32_t *values, size_t count)
+{
+    int space_id = dsp_space_id(space);
+    uint32_t *ptr = dsp56k_memory_ptr(&dsp->core, space_id, address, count);
+
+    if (ptr) {
+        memcpy(values, ptr, count * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        values[i] = dsp56k_read_memory(&dsp->core, space_id, address + i);
+    }
+}
+
+/* Copies straight into X/Y RAM when the range allows it */
+void dsp_write_memory_block(DSPState* dsp, char space, uint32_t address,
+                            const uint32_t *values, size_t count)
+{
+    int space_id = dsp_space_id(space);
+    uint32_t *ptr = dsp56k_memory_ptr(&dsp->core, space_id, address, count);
+
+    if (ptr && !TRACE_DSP_DISASM_MEM) {
+        memcpy(ptr, values, count * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        dsp56k_write_memory(&dsp->core, space_id, address + i, values[i]);
+    }
+}
+
+/*
+ * Per P address cycle profiling. While enabled the core runs the traced
+ * execution functions, which account the cycles of every instruction to its
+ * address.
+ */
+void dsp_set_profiling(DSPState* dsp, bool enable)
+{
+    if (enable && !dsp->core.pc_cycles) {
+        dsp->core.pc_cycles = g_new0(uint64_t, DSP_PRAM_SIZE);
+    } else if (!enable) {
+        g_free(dsp->core.pc_cycles);
+        dsp->core.pc_cycles = NULL;
+    }
+}
+
+bool dsp_is_profiling(DSPState* dsp)
+{
+    return dsp->core.pc_cycles != NULL;
+}
+
+void dsp_reset_profile(DSPState* dsp)
+{
+    if (dsp->core.pc_cycles) {
+        memset(dsp->core.pc_cycles, 0, DSP_PRAM_SIZE * sizeof(uint64_t));
+    }
+}
+
+typedef struct DSPProfileEntry {
+    uint32_t address;
+    uint32_t end;       /* one past the last word, for spans */
+    uint64_t cycles;
+} DSPProfileEntry;
+
+static gint dsp_profile_entry_compare(gconstpointer a, gconstpointer b)
+{
+    const DSPProfileEntry *ea = a, *eb = b;
+
+    if (ea->cycles != eb->cycles) {
+        return ea->cycles < eb->cycles ? 1 : -1;
+    }
+    return ea->address < eb->address ? -1 : ea->address > eb->address;
+}
+
+/*
+ * Appends the `top` hottest instructions to `out`, with their disassembly,
+ * followed by the hottest spans of consecutively executed instructions,
+ * which is where the loops of the microcode are.
+ */
+void dsp_profile_report(DSPState* dsp, GString *out, int top)
+{
+    const uint64_t *pc_cycles = dsp->core.pc_cycles;
+
+    if (!pc_cycles) {
+        g_string_append(out, "  not profiling\n");
         return;
     }
 
-    dsp56k_write_memory(&dsp->core, space_id, address, value);
+    g_autoptr(GArray) insts = g_array_new(false, false,
+                                          sizeof(DSPProfileEntry));
+    g_autoptr(GArray) spans = g_array_new(false, false,
+                                          sizeof(DSPProfileEntry));
+    DSPProfileEntry span = { 0 };
+    uint64_t total = 0;
+
+    for (uint32_t addr = 0; addr < DSP_PRAM_SIZE;) {
+        uint16_t len = 1;
+
+        if (pc_cycles[addr]) {
+            DSPProfileEntry e = {
+                .address = addr,
+                .cycles = pc_cycles[addr],
+            };
+            dsp56k_disasm(&dsp->core, addr, &len);
+            e.end = addr + MAX(len, 1);
+            g_array_append_val(insts, e);
+            total += e.cycles;
+
+            if (!span.cycles) {
+                span.address = addr;
+            }
+            span.end = e.end;
+            span.cycles += e.cycles;
+        } else if (span.cycles) {
+            g_array_append_val(spans, span);
+            span.cycles = 0;
+        }
+        addr += MAX(len, 1);
+    }
+    if (span.cycles) {
+        g_array_append_val(spans, span);
+    }
+
+    g_string_append_printf(out, "  %" PRIu64 " cycles in %u instructions\n",
+                           total, insts->len);
+    if (!total) {
+        return;
+    }
+
+    g_array_sort(insts, dsp_profile_entry_compare);
+    g_string_append(out, "  Hottest instructions:\n");
+    for (int i = 0; i < MIN(top, (int)insts->len); i++) {
+        const DSPProfileEntry *e = &g_array_index(insts, DSPProfileEntry, i);
+        uint16_t len;
+        g_string_append_printf(out, "    p:%04x %6.2f%% %12" PRIu64 "  %s\n",
+                               e->address, 100.0 * e->cycles / total,
+                               e->cycles,
+                               dsp56k_disasm(&dsp->core, e->address, &len));
+    }
+
+    g_array_sort(spans, dsp_profile_entry_compare);
+    g_string_append(out, "  Hottest spans:\n");
+    for (int i = 0; i < MIN(top, (int)spans->len); i++) {
+        const DSPProfileEntry *e = &g_array_index(spans, DSPProfileEntry, i);
+        g_string_append_printf(out, "    p:%04x-%04x %6.2f%% %12" PRIu64 "\n",
+                               e->address, e->end - 1,
+                               100.0 * e->cycles / total, e->cycles);
+    }
 }
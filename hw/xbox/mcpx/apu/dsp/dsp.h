@@ -50,6 +50,15 @@ void dsp_start_frame(DSPState* dsp);
 
 uint32_t dsp_read_memory(DSPState* dsp, char space, uint32_t addr);
 void dsp_write_memory(DSPState* dsp, char space, uint32_t address, uint32_t value);
+void dsp_read_memory_block(DSPState* dsp, char space, uint32_t address,
+                           uint32_t *values, size_t count);
+void dsp_write_memory_block(DSPState* dsp, char space, uint32_t address,
+                            const uint32_t *values, size_t count);
+
+void dsp_set_profiling(DSPState* dsp, bool enable);
+bool dsp_is_profiling(DSPState* dsp);
+void dsp_reset_profile(DSPState* dsp);
+void dsp_profile_report(DSPState* dsp, GString *out, int top);
 
 void dsp_info(DSPState* dsp);
 void dsp_print_registers(DSPState* dsp);
@@ -33,6 +33,8 @@
 
 // #define DSP_COUNT_IPS     /* Count instruction per seconds */
 
+#define DSP_SPIN_MAX_LOOP 16 /* Longest loop checked for peripheral polling */
+
 
 /**********************************
  *  Defines
@@ -345,6 +347,87 @@ static const OpcodeEntry nonparallel_opcodes[] = {
 static bool matches_initialised;
 static uint32_t nonparallel_matches[ARRAY_SIZE(nonparallel_opcodes)][2];
 
+/*
+ * Two level decode table for the 20 bit non-parallel opcode space. The
+ * first level is indexed by opcode bits 8-19 and holds the index + 1 of the
+ * matching nonparallel_opcodes entry, when it does not depend on the low
+ * byte, or DECODE_L1_SPLIT | n, for the n-th block of 256 entries in the
+ * second level, indexed by the low byte. 0 is an undefined opcode. Most
+ * high bit patterns decode their low byte the same way, so second level
+ * blocks are shared and only a few dozen exist.
+ */
+#define DECODE_L1_BITS 12
+#define DECODE_L1_SPLIT 0x8000
+
+QEMU_BUILD_BUG_ON(ARRAY_SIZE(nonparallel_opcodes) >= 0xff);
+
+static uint16_t decode_l1[1 << DECODE_L1_BITS];
+static uint8_t *decode_l2;
+
+static uint8_t decode_match(const uint8_t *candidates, int num_candidates,
+                            uint32_t op)
+{
+    for (int i = 0; i < num_candidates; i++) {
+        int c = candidates[i];
+        if ((op & nonparallel_matches[c][0]) == nonparallel_matches[c][1] &&
+            (!nonparallel_opcodes[c].match_func ||
+             nonparallel_opcodes[c].match_func(op))) {
+            return c + 1;
+        }
+    }
+    return 0;
+}
+
+static void build_decode_table(void)
+{
+    uint8_t candidates[ARRAY_SIZE(nonparallel_opcodes)];
+    uint8_t block[256];
+    int num_l2 = 0;
+
+    for (uint32_t hi = 0; hi < ARRAY_SIZE(decode_l1); hi++) {
+        uint32_t op_hi = hi << 8;
+
+        /* Entries that can match some opcode with these high bits, in
+         * table order so the first match still wins */
+        int n = 0;
+        for (int i = 0; i < ARRAY_SIZE(nonparallel_opcodes); i++) {
+            uint32_t mask = nonparallel_matches[i][0] & ~BITMASK(8);
+            if ((op_hi & mask) == (nonparallel_matches[i][1] & mask)) {
+                candidates[n++] = i;
+            }
+        }
+
+        if (n == 0) {
+            decode_l1[hi] = 0;
+            continue;
+        }
+
+        /* The first candidate takes every low byte if it ignores it */
+        int first = candidates[0];
+        if (!(nonparallel_matches[first][0] & BITMASK(8)) &&
+            !nonparallel_opcodes[first].match_func) {
+            decode_l1[hi] = first + 1;
+            continue;
+        }
+
+        for (uint32_t lo = 0; lo < 256; lo++) {
+            block[lo] = decode_match(candidates, n, op_hi | lo);
+        }
+
+        int l2;
+        for (l2 = 0; l2 < num_l2; l2++) {
+            if (!memcmp(&decode_l2[l2 * 256], block, sizeof(block))) {
+                break;
+            }
+        }
+        if (l2 == num_l2) {
+            decode_l2 = g_realloc(decode_l2, ++num_l2 * 256);
+            memcpy(&decode_l2[l2 * 256], block, sizeof(block));
+        }
+        decode_l1[hi] = DECODE_L1_SPLIT | l2;
+    }
+}
+
 /**********************************
  *  Emulator kernel
  **********************************/
@@ -371,6 +454,8 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
             nonparallel_matches[i][0] = mask;
             nonparallel_matches[i][1] = match;
         }
+
+        build_decode_table();
     }
 
     /* Memory */
@@ -412,37 +497,18 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
     dsp->disasm_prev_inst_pc = 0xFFFFFFFF;
 }
 
-static const OpcodeEntry *lookup_opcode_slow(uint32_t op) {
-    for (int i = 0; i < ARRAY_SIZE(nonparallel_opcodes); i++) {
-        if ((op & nonparallel_matches[i][0]) == nonparallel_matches[i][1]) {
-            if (nonparallel_opcodes[i].match_func
-                && !nonparallel_opcodes[i].match_func(op)) continue;
-            return &nonparallel_opcodes[i];
-        }
-    }
-
-    fprintf(stderr, "op = %08x\n", op);
-    assert(false);
-    return NULL;
-}
-
 static const OpcodeEntry *lookup_opcode(uint32_t op) {
-    static struct opcache_entry {
-        uint32_t op;
-        const OpcodeEntry *entry;
-    } opcache[256];
-
-    uint8_t tag =
-        ((op >> 24) & 0xff) ^
-        ((op >> 16) & 0xff) ^
-        ((op >>  8) & 0xff) ^
-        ((op >>  0) & 0xff);
-    if (opcache[tag].op != op || opcache[tag].entry == NULL) {
-        opcache[tag].op = op;
-        opcache[tag].entry = lookup_opcode_slow(op);
+    uint16_t e = decode_l1[(op >> 8) & BITMASK(DECODE_L1_BITS)];
+    if (e & DECODE_L1_SPLIT) {
+        e = decode_l2[((e & ~DECODE_L1_SPLIT) << 8) | (op & 0xff)];
     }
 
-    return opcache[tag].entry;
+    if (!e) {
+        fprintf(stderr, "op = %08x\n", op);
+        assert(false);
+        return NULL;
+    }
+    return &nonparallel_opcodes[e - 1];
 }
 
 static uint16_t disasm_instruction(dsp_core_t* dsp, dsp_trace_disasm_t mode)
@@ -594,24 +660,97 @@ static const char* disasm_get_instruction_text(dsp_core_t* dsp)
     return dsp->disasm_str_instr2;
 }
 
-void dsp56k_execute_instruction(dsp_core_t* dsp)
+/*
+ * Disassembles the instruction at `address` without executing it. Returns
+ * the text, valid until the next disassembly, and its length in words.
+ */
+const char *dsp56k_disasm(dsp_core_t* dsp, uint32_t address, uint16_t *len)
+{
+    uint32_t pc = dsp->pc;
+    uint32_t prev_inst_pc = dsp->disasm_prev_inst_pc;
+    bool is_looping = dsp->disasm_is_looping;
+
+    dsp->pc = address;
+    *len = disasm_instruction(dsp, DSP_DISASM_MODE);
+    dsp->pc = pc;
+    dsp->disasm_prev_inst_pc = prev_inst_pc;
+    dsp->disasm_is_looping = is_looping;
+
+    return dsp->disasm_str_instr;
+}
+
+static void emu_unimplemented(dsp_core_t* dsp)
 {
-    trace_dsp56k_execute_instruction(dsp->is_gp, dsp->pc);
+    DPRINTF("%x - %s\n", dsp->cur_inst, lookup_opcode(dsp->cur_inst)->name);
+    emu_undefined(dsp);
+}
 
+/*
+ * Returns the decoded form of the instruction at a P memory address,
+ * decoding it on first use. Parallel move instructions resolve straight to
+ * their opcodes_parmove handler. Records are dropped by P memory writes.
+ */
+static const dsp_decoded_inst_t *dsp_decode_instruction(dsp_core_t* dsp,
+                                                        uint32_t address)
+{
+    dsp_decoded_inst_t *rec = &dsp->pram_opcache[address];
+    if (rec->func) {
+        return rec;
+    }
+
+    rec->inst = read_memory_p(dsp, address);
+    if (rec->inst < 0x100000) {
+        const OpcodeEntry *op = lookup_opcode(rec->inst);
+        rec->func = op->emu_func ? op->emu_func : emu_unimplemented;
+    } else {
+        rec->func = opcodes_parmove[(rec->inst>>20) & BITMASK(4)];
+    }
+
+    return rec;
+}
+
+/* True if dsp_postexecute_interrupts() has nothing to do this instruction */
+static bool dsp_interrupts_quiet(dsp_core_t* dsp)
+{
+    return dsp->interrupt_state != DSP_INTERRUPT_DISABLED &&
+           dsp->interrupt_counter == 0 &&
+           !(dsp->registers[DSP_REG_SR] & (1<<DSP_SR_T));
+}
+
+bool dsp56k_tracing(dsp_core_t* dsp)
+{
+    return dsp->pc_cycles || TRACE_DSP_DISASM ||
+           trace_event_get_state(TRACE_DSP56K_EXECUTE_INSTRUCTION) ||
+           trace_event_get_state(TRACE_DSP56K_EXECUTE_INSTRUCTION_DISASM);
+}
+
+/*
+ * Executes the instruction at the current PC. Instantiated with `traced`
+ * constant, so the untraced copy carries none of the disassembly, trace and
+ * profiling bookkeeping.
+ */
+static inline QEMU_ALWAYS_INLINE
+void dsp_execute_one(dsp_core_t* dsp, bool traced)
+{
     uint32_t disasm_return = 0;
-    dsp->disasm_memory_ptr = 0;
+    uint32_t pc = dsp->pc;
+
+    if (traced) {
+        trace_dsp56k_execute_instruction(dsp->is_gp, dsp->pc);
+        dsp->disasm_memory_ptr = 0;
+    }
 
     /* Decode and execute current instruction */
-    dsp->cur_inst = read_memory_p(dsp, dsp->pc);
+    const dsp_decoded_inst_t *rec = dsp_decode_instruction(dsp, dsp->pc);
+    dsp->cur_inst = rec->inst;
 
     /* Initialize instruction size and cycle counter */
     dsp->cur_inst_len = 1;
     dsp->instr_cycle = 2;
 
-    bool tracing = TRACE_DSP_DISASM || trace_event_get_state(TRACE_DSP56K_EXECUTE_INSTRUCTION_DISASM);
-
     /* Disasm current instruction ? (trace mode only) */
-    if (tracing) {
+    if (traced && (TRACE_DSP_DISASM ||
+            trace_event_get_state(TRACE_DSP56K_EXECUTE_INSTRUCTION_DISASM))) {
         disasm_return = disasm_instruction(dsp, DSP_TRACE_MODE);
         if (disasm_return) {
             const char *text = disasm_get_instruction_text(dsp);
@@ -625,25 +764,10 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
         }
     }
 
-    if (dsp->cur_inst < 0x100000) {
-        const OpcodeEntry *op = dsp->pram_opcache[dsp->pc];
-        if (op == NULL) {
-            op = lookup_opcode(dsp->cur_inst);
-            dsp->pram_opcache[dsp->pc] = op;
-        }
-        if (op->emu_func) {
-            op->emu_func(dsp);
-        } else {
-            DPRINTF("%x - %s\n", dsp->cur_inst, op->name);
-            emu_undefined(dsp);
-        }
-    } else {
-        /* Do parallel move read */
-        opcodes_parmove[(dsp->cur_inst>>20) & BITMASK(4)](dsp);
-    }
+    rec->func(dsp);
 
     /* Disasm current instruction ? (trace mode only) */
-    if (tracing && disasm_return) {
+    if (traced && disasm_return) {
         if (TRACE_DSP_DISASM_REG) {
             disasm_reg_compare(dsp);
         }
@@ -659,12 +783,17 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
         }
     }
 
+    if (traced && dsp->pc_cycles) {
+        dsp->pc_cycles[pc] += dsp->instr_cycle;
+    }
+
     /* Process the PC */
     dsp_postexecute_update_pc(dsp);
 
     /* Process Interrupts */
-    dsp_postexecute_interrupts(dsp);
-
+    if (!dsp_interrupts_quiet(dsp)) {
+        dsp_postexecute_interrupts(dsp);
+    }
 
     dsp->num_inst += dsp->instr_cycle;
 
@@ -682,6 +811,96 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
 #endif
 }
 
+void dsp56k_execute_instruction(dsp_core_t* dsp)
+{
+    dsp_execute_one(dsp, true);
+}
+
+/*
+ * Called after a jump back by at most DSP_SPIN_MAX_LOOP words. Detects
+ * microcode polling a peripheral: if the loop head is reached twice with
+ * identical registers and stack, no memory written and nothing to interrupt
+ * it, the core is in a fixed point. Peripherals only change from outside
+ * the core, so it will keep looping until the caller changes one.
+ */
+static bool dsp_check_spin(dsp_core_t* dsp)
+{
+    /* Only loops that read a peripheral wait on anything */
+    if (dsp->periph_reads == dsp->spin_periph_reads) {
+        return false;
+    }
+
+    if (dsp->pc == dsp->spin_pc &&
+        dsp->mem_writes == dsp->spin_mem_writes &&
+        !dsp->loop_rep && dsp_interrupts_quiet(dsp) &&
+        !memcmp(dsp->registers, dsp->spin_registers,
+                sizeof(dsp->registers)) &&
+        !memcmp(dsp->stack, dsp->spin_stack, sizeof(dsp->stack))) {
+        return true;
+    }
+
+    dsp->spin_pc = dsp->pc;
+    dsp->spin_mem_writes = dsp->mem_writes;
+    dsp->spin_periph_reads = dsp->periph_reads;
+    memcpy(dsp->spin_registers, dsp->registers, sizeof(dsp->registers));
+    memcpy(dsp->spin_stack, dsp->stack, sizeof(dsp->stack));
+    return false;
+}
+
+/*
+ * Run instructions back to back until at least `cycles` cycles have been
+ * spent, or until something outside the core needs to look at it: a
+ * peripheral was written (DMA, idle, interrupt control) or P memory was
+ * modified. Interrupt processing is skipped while nothing is pending or in
+ * flight, which it would have been a no-op for anyway. Instructions come
+ * from the pre-decoded pram_opcache, so a cached one is dispatched without
+ * going back to P memory. If the core is found spinning on a peripheral,
+ * is_spinning is set and the rest of the budget is reported spent. Always
+ * executes at least one instruction, returns the number of cycles spent.
+ */
+static inline QEMU_ALWAYS_INLINE
+uint32_t dsp_execute_block(dsp_core_t* dsp, int32_t cycles, bool traced)
+{
+    uint32_t spent = 0;
+
+    dsp->exit_block = false;
+
+    /* The caller may have changed peripherals since the last block */
+    dsp->spin_pc = -1;
+    dsp->spin_periph_reads = dsp->periph_reads;
+
+    do {
+        uint32_t prev_pc = dsp->pc;
+
+        dsp_execute_one(dsp, traced);
+        dsp->cycle_count++;
+        spent += dsp->instr_cycle;
+
+        if (dsp->pc <= prev_pc && prev_pc - dsp->pc < DSP_SPIN_MAX_LOOP &&
+            dsp_check_spin(dsp)) {
+            dsp->is_spinning = true;
+            if (traced && dsp->pc_cycles && (int32_t)spent < cycles) {
+                /* The skipped iterations would have been spent here */
+                dsp->pc_cycles[dsp->pc] += cycles - spent;
+            }
+            spent = MAX((int32_t)spent, cycles);
+            break;
+        }
+    } while ((int32_t)spent < cycles && !dsp->exit_block);
+
+    return spent;
+}
+
+uint32_t dsp56k_execute_block(dsp_core_t* dsp, int32_t cycles)
+{
+    return dsp_execute_block(dsp, cycles, false);
+}
+
+uint32_t dsp56k_execute_block_traced(dsp_core_t* dsp, int32_t cycles)
+{
+    return dsp_execute_block(dsp, cycles, true);
+}
+
 /**********************************
  *  Update the PC
 **********************************/
@@ -935,6 +1154,7 @@ uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address)
     if (space == DSP_SPACE_X) {
         if (address >= DSP_PERIPH_BASE) {
             assert(dsp->read_peripheral);
+            dsp->periph_reads++;
             return dsp->read_peripheral(dsp, address);
         } else if (address >= DSP_MIXBUFFER_BASE && address < DSP_MIXBUFFER_BASE+DSP_MIXBUFFER_SIZE) {
             return dsp->mixbuffer[address-DSP_MIXBUFFER_BASE];
@@ -959,6 +1179,32 @@ uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address)
     }
 }
 
+/*
+ * Returns a pointer to count words of X or Y RAM starting at address, or
+ * NULL if the range is not backed by a single RAM array (peripherals, P
+ * memory or out of bounds), in which case the words need to go through
+ * dsp56k_read_memory()/dsp56k_write_memory().
+ */
+uint32_t *dsp56k_memory_ptr(dsp_core_t* dsp, int space, uint32_t address, uint32_t count)
+{
+    if (space == DSP_SPACE_X) {
+        if (address >= DSP_MIXBUFFER_BASE &&
+            address + count <= DSP_MIXBUFFER_BASE + DSP_MIXBUFFER_SIZE) {
+            return &dsp->mixbuffer[address - DSP_MIXBUFFER_BASE];
+        } else if (address >= 0xc00 && address + count <= 0xc00 + DSP_MIXBUFFER_SIZE) {
+            return &dsp->mixbuffer[address - 0xc00];
+        } else if (address + count <= MIN(DSP_XRAM_SIZE, 0xc00)) {
+            return &dsp->xram[address];
+        }
+    } else if (space == DSP_SPACE_Y) {
+        if (address + count <= DSP_YRAM_SIZE) {
+            return &dsp->yram[address];
+        }
+    }
+
+    return NULL;
+}
+
 void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t value)
 {
     if (TRACE_DSP_DISASM_MEM)
@@ -972,10 +1218,13 @@ static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint3
     assert((value & 0xFF000000) == 0);
     assert((address & 0xFF000000) == 0);
 
+    dsp->mem_writes++;
+
     if (space == DSP_SPACE_X) {
         if (address >= DSP_PERIPH_BASE) {
             assert(dsp->write_peripheral);
             dsp->write_peripheral(dsp, address, value);
+            dsp->exit_block = true;
             return;
         } else if (address >= DSP_MIXBUFFER_BASE && address < DSP_MIXBUFFER_BASE+DSP_MIXBUFFER_SIZE) {
             dsp->mixbuffer[address-DSP_MIXBUFFER_BASE] = value;
@@ -991,7 +1240,9 @@ static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint3
     } else if (space == DSP_SPACE_P) {
         assert(address < DSP_PRAM_SIZE);
         stl_le_p(&dsp->pram[address], value);
-        dsp->pram_opcache[address] = NULL;
+        dsp->pram_opcache[address].func = NULL;
+        dsp->pram_dirty = true;
+        dsp->exit_block = true;
     } else {
         assert(false);
     }
@@ -45,6 +45,14 @@ typedef struct dsp_interrupt_s {
 
 typedef struct dsp_core_s dsp_core_t;
 
+typedef void (*dsp_emu_func_t)(dsp_core_t* dsp);
+
+/* A P memory word decoded down to the handler that executes it */
+typedef struct dsp_decoded_inst_s {
+    dsp_emu_func_t func;    /* NULL until decoded */
+    uint32_t inst;
+} dsp_decoded_inst_t;
+
 struct dsp_core_s {
     bool is_gp;
     bool is_idle;
@@ -63,7 +71,8 @@ struct dsp_core_s {
     uint32_t xram[DSP_XRAM_SIZE];
     uint32_t yram[DSP_YRAM_SIZE];
     uint32_t pram[DSP_PRAM_SIZE];
-    const void *pram_opcache[DSP_PRAM_SIZE];
+    dsp_decoded_inst_t pram_opcache[DSP_PRAM_SIZE];
+    bool pram_dirty;    /* P memory changed, cleared by the user */
 
     uint32_t mixbuffer[DSP_MIXBUFFER_SIZE];
 
@@ -84,6 +93,22 @@ struct dsp_core_s {
     int16_t interrupt_ipl[12];     /* store the current IPL for each interrupt */
     uint16_t interrupt_is_pending[12];  /* store if interrupt is pending for each interrupt */
 
+    /* Set to end dsp56k_execute_block() after the current instruction */
+    bool exit_block;
+
+    /* Polling loop detection, see dsp_check_spin() */
+    bool is_spinning;       /* stuck until a peripheral changes */
+    uint32_t mem_writes;    /* count of X, Y and P memory writes */
+    uint32_t periph_reads;  /* count of peripheral reads */
+    uint32_t spin_pc;       /* loop head of the snapshot, -1 if none */
+    uint32_t spin_mem_writes;
+    uint32_t spin_periph_reads;
+    uint32_t spin_registers[DSP_REG_MAX];
+    uint32_t spin_stack[2][16];
+
+    /* Cycles spent at each P address, NULL unless profiling */
+    uint64_t *pc_cycles;
+
     /* callbacks */
     uint32_t (*read_peripheral)(dsp_core_t* core, uint32_t address);
     void (*write_peripheral)(dsp_core_t* core, uint32_t address, uint32_t value);
@@ -138,9 +163,14 @@ struct dsp_core_s {
 /* Functions */
 void dsp56k_reset_cpu(dsp_core_t* dsp);		/* Set dsp_core to use */
 void dsp56k_execute_instruction(dsp_core_t* dsp);	/* Execute 1 instruction */
+uint32_t dsp56k_execute_block(dsp_core_t* dsp, int32_t cycles);
+uint32_t dsp56k_execute_block_traced(dsp_core_t* dsp, int32_t cycles);
+bool dsp56k_tracing(dsp_core_t* dsp);   /* Use the traced execution functions? */
+const char *dsp56k_disasm(dsp_core_t* dsp, uint32_t address, uint16_t *len);
 
 uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address);
 void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
+uint32_t *dsp56k_memory_ptr(dsp_core_t* dsp, int space, uint32_t address, uint32_t count);
 
 /* Interrupt relative functions */
 void dsp56k_add_interrupt(dsp_core_t* dsp, uint16_t inter);
@@ -127,13 +127,24 @@ static void dsp_dma_run(DSPDMAState *s)
             assert(false);
         }
 
-        uint32_t next_block = dsp56k_read_memory(s->core, block_space, block_addr);
-        uint32_t control = dsp56k_read_memory(s->core, block_space, block_addr+1);
-        uint32_t count = dsp56k_read_memory(s->core, block_space, block_addr+2);
-        uint32_t dsp_offset = dsp56k_read_memory(s->core, block_space, block_addr+3);
-        uint32_t scratch_offset = dsp56k_read_memory(s->core, block_space, block_addr+4);
-        uint32_t scratch_base = dsp56k_read_memory(s->core, block_space, block_addr+5);
-        uint32_t scratch_size = dsp56k_read_memory(s->core, block_space, block_addr+6)+1;
+        uint32_t desc[7];
+        const uint32_t *desc_ptr =
+            dsp56k_memory_ptr(s->core, block_space, block_addr, 7);
+        if (desc_ptr) {
+            memcpy(desc, desc_ptr, sizeof(desc));
+        } else {
+            for (int i = 0; i < 7; i++) {
+                desc[i] = dsp56k_read_memory(s->core, block_space, block_addr+i);
+            }
+        }
+
+        uint32_t next_block = desc[0];
+        uint32_t control = desc[1];
+        uint32_t count = desc[2];
+        uint32_t dsp_offset = desc[3];
+        uint32_t scratch_offset = desc[4];
+        uint32_t scratch_base = desc[5];
+        uint32_t scratch_size = desc[6]+1;
 
         s->next_block = next_block;
         if (s->next_block & NODE_POINTER_EOL) {
@@ -202,6 +213,11 @@ static void dsp_dma_run(DSPDMAState *s)
 
         size_t transfer_size = count * item_size;
 
+        /* X and Y RAM are accessed directly, P memory and anything else
+         * through the core so side effects are kept */
+        uint32_t *mem_ptr =
+            dsp56k_memory_ptr(s->core, mem_space, mem_address, count);
+
         // FIXME: Remove this intermediate buffer
         static uint8_t *scratch_buf = NULL;
         static ssize_t scratch_buf_size = -1;
@@ -219,8 +235,9 @@ static void dsp_dma_run(DSPDMAState *s)
                 // Interleave samples
                 for (int i = 0; i < block_count; i++) {
                     for (int ch = 0; ch < channel_count; ch++) {
-                        uint32_t v = dsp56k_read_memory(s->core,
-                            mem_space, mem_address+ch*block_count+i);
+                        uint32_t v = mem_ptr ? mem_ptr[ch*block_count+i] :
+                            dsp56k_read_memory(s->core,
+                                mem_space, mem_address+ch*block_count+i);
                         switch(item_size) {
                         case 2:
                             *(uint16_t*)(scratch_buf + i*2*channel_count + ch*2) = v >> 8;
@@ -236,7 +253,8 @@ static void dsp_dma_run(DSPDMAState *s)
                 }
             } else {
                 for (int i = 0; i < count; i++) {
-                    uint32_t v = dsp56k_read_memory(s->core, mem_space, mem_address+i);
+                    uint32_t v = mem_ptr ? mem_ptr[i] :
+                        dsp56k_read_memory(s->core, mem_space, mem_address+i);
                     switch(item_size) {
                     case 2:
                         *(uint16_t*)(scratch_buf + i*2) = v >> 8;
@@ -298,8 +316,13 @@ static void dsp_dma_run(DSPDMAState *s)
                     break;
                 }
 
-                dsp56k_write_memory(s->core, mem_space, mem_address+i, v);
+                if (mem_ptr) {
+                    mem_ptr[i] = v;
+                } else {
+                    dsp56k_write_memory(s->core, mem_space, mem_address+i, v);
+                }
             }
+            s->core->mem_writes++;
         }
 
         if (buffer_offset_writeback) {
@@ -20,6 +20,9 @@
  */
 
 #include "hw/xbox/mcpx/apu/apu_int.h"
+#include "qemu/fast-hash.h"
+#include "qemu/timeline.h"
+#include "qemu/timer.h"
 
 static const int16_t ep_silence[256][2] = { 0 };
 
@@ -44,6 +47,20 @@ void mcpx_apu_update_dsp_preference(MCPXAPUState *d)
     last_known_preference = g_config.audio.use_dsp;
 }
 
+/* Guest physical address of a page of a scatter-gather list */
+static uint32_t sge_page_address(MCPXAPUState *d, hwaddr sge_base,
+                                 unsigned int page_entry)
+{
+    hwaddr entry = sge_base + page_entry * 8;
+
+    /* The list lives in RAM, skip the address space dispatch */
+    if (entry + 4 <= memory_region_size(d->ram)) {
+        return ldl_le_p(&d->ram_ptr[entry]);
+    }
+
+    return ldl_le_phys(&address_space_memory, entry);
+}
+
 static void scatter_gather_rw(MCPXAPUState *d, hwaddr sge_base,
                               unsigned int max_sge, uint8_t *ptr, uint32_t addr,
                               size_t len, bool dir)
@@ -55,8 +72,7 @@ static void scatter_gather_rw(MCPXAPUState *d, hwaddr sge_base,
     while (len > 0) {
         assert(page_entry <= max_sge);
 
-        uint32_t prd_address = ldl_le_phys(&address_space_memory,
-                                           sge_base + page_entry * 8 + 0);
+        uint32_t prd_address = sge_page_address(d, sge_base, page_entry);
         // uint32_t prd_control = ldl_le_phys(&address_space_memory,
         //                                     sge_base + page_entry * 8 + 4);
 
@@ -136,10 +152,18 @@ static uint32_t circular_scatter_gather_rw(MCPXAPUState *d, hwaddr sge_base,
     return cur;
 }
 
-static void gp_fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
-                       size_t len, bool dir)
+typedef struct DeferredFifoWrite {
+    uint32_t index;
+    uint32_t len;
+    uint8_t data[];
+} DeferredFifoWrite;
+
+#define DEFERRED_FIFO_WRITE_SIZE(len) \
+    ROUND_UP(sizeof(DeferredFifoWrite) + (len), __alignof__(DeferredFifoWrite))
+
+static void gp_fifo_rw_now(MCPXAPUState *d, uint8_t *ptr, unsigned int index,
+                           size_t len, bool dir)
 {
-    MCPXAPUState *d = opaque;
     uint32_t base;
     uint32_t end;
     hwaddr cur_reg;
@@ -178,6 +202,37 @@ static void gp_fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
     SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
 }
 
+static void gp_fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
+                       size_t len, bool dir)
+{
+    MCPXAPUState *d = opaque;
+
+    if (dir && d->gp.defer_fifo_writes) {
+        GByteArray *buf = d->gp.deferred_fifo_writes;
+        guint off = buf->len;
+        g_byte_array_set_size(buf, off + DEFERRED_FIFO_WRITE_SIZE(len));
+        DeferredFifoWrite *w = (DeferredFifoWrite *)&buf->data[off];
+        w->index = index;
+        w->len = len;
+        memcpy(w->data, ptr, len);
+        return;
+    }
+
+    gp_fifo_rw_now(d, ptr, index, len, dir);
+}
+
+static void gp_flush_deferred_fifo_writes(MCPXAPUState *d)
+{
+    GByteArray *buf = d->gp.deferred_fifo_writes;
+
+    for (guint off = 0; off < buf->len;) {
+        DeferredFifoWrite *w = (DeferredFifoWrite *)&buf->data[off];
+        gp_fifo_rw_now(d, w->data, w->index, w->len, true);
+        off += DEFERRED_FIFO_WRITE_SIZE(w->len);
+    }
+    g_byte_array_set_size(buf, 0);
+}
+
 static bool ep_sink_samples(MCPXAPUState *d, uint8_t *ptr, size_t len)
 {
     if (d->monitor.point == MCPX_APU_DEBUG_MON_AC97) {
@@ -436,56 +491,131 @@ const MemoryRegionOps ep_ops = {
     .write = ep_write,
 };
 
-void mcpx_apu_dsp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME])
+/*
+ * Fingerprints the microcode loaded into a DSP whenever P memory has
+ * changed, so that known images (e.g. the DirectSound effects image) can be
+ * recognized.
+ */
+static void dsp_update_image_hash(DSPState *dsp, uint64_t *hash,
+                                  const char *name)
 {
-    /* Write VP results to the GP DSP MIXBUF */
-    for (int mixbin = 0; mixbin < NUM_MIXBINS; mixbin++) {
-        uint32_t base = GP_DSP_MIXBUF_BASE + mixbin * NUM_SAMPLES_PER_FRAME;
-        for (int sample = 0; sample < NUM_SAMPLES_PER_FRAME; sample++) {
-            dsp_write_memory(d->gp.dsp, 'X', base + sample,
-                             float_to_24b(mixbins[mixbin][sample]));
+    if (!dsp->core.pram_dirty) {
+        return;
+    }
+    dsp->core.pram_dirty = false;
+
+    uint64_t h = fast_hash((const uint8_t *)dsp->core.pram,
+                           sizeof(dsp->core.pram));
+    if (h != *hash) {
+        *hash = h;
+        trace_mcpx_apu_dsp_image(name, h);
+    }
+}
+
+static void ep_run_frame(MCPXAPUState *d)
+{
+    dsp_update_image_hash(d->ep.dsp, &d->ep.image_hash, "ep");
+    g_dbg.ep.image_hash = d->ep.image_hash;
+
+    dsp_start_frame(d->ep.dsp);
+    d->ep.dsp->core.is_idle = false;
+    d->ep.dsp->core.cycle_count = 0;
+    int64_t start_time = get_clock();
+    int64_t zone_start = timeline_begin();
+    do {
+        dsp_run(d->ep.dsp, 1000);
+    } while (!d->ep.dsp->core.is_idle &&
+             !d->ep.dsp->core.is_spinning && d->ep.realtime);
+    timeline_end("dsp_run", "EP", zone_start);
+    mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_EP, get_clock() - start_time);
+    g_dbg.ep.cycles = d->ep.dsp->core.cycle_count;
+}
+
+static void *ep_thread(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_event_wait(&d->ep.start);
+        qemu_event_reset(&d->ep.start);
+        if (qatomic_read(&d->ep.thread_exit)) {
+            break;
         }
+        ep_run_frame(d);
+        qemu_event_set(&d->ep.done);
     }
 
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void mcpx_apu_dsp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME])
+{
+    /* Write VP results to the GP DSP MIXBUF */
+    uint32_t mixbuf[NUM_MIXBINS * NUM_SAMPLES_PER_FRAME];
+    float_to_24b_block(&mixbins[0][0], mixbuf, ARRAY_SIZE(mixbuf));
+    dsp_write_memory_block(d->gp.dsp, 'X', GP_DSP_MIXBUF_BASE, mixbuf,
+                           ARRAY_SIZE(mixbuf));
+
     bool ep_enabled = (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPRST) &&
                       (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPDSPRST);
+    bool ep_due = ep_enabled && d->ep_frame_div % 8 == 0;
+
+    /*
+     * In pipelined mode the EP runs alongside the GP instead of after it.
+     * GP output FIFO writes are held back until the EP is done, so the EP
+     * consumes GP output up to the previous frame and the two never touch
+     * the same FIFO memory at once.
+     */
+    bool ep_async = ep_due && d->ep.pipelined;
+    if (ep_async) {
+        d->gp.defer_fifo_writes = true;
+        qemu_event_reset(&d->ep.done);
+        qemu_event_set(&d->ep.start);
+    }
 
     /* Run GP */
     if ((d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPRST) &&
         (d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPDSPRST)) {
+        dsp_update_image_hash(d->gp.dsp, &d->gp.image_hash, "gp");
+        g_dbg.gp.image_hash = d->gp.image_hash;
+
         dsp_start_frame(d->gp.dsp);
         d->gp.dsp->core.is_idle = false;
         d->gp.dsp->core.cycle_count = 0;
+        int64_t start_time = get_clock();
+        int64_t zone_start = timeline_begin();
         do {
             dsp_run(d->gp.dsp, 1000);
-        } while (!d->gp.dsp->core.is_idle && d->gp.realtime);
+        } while (!d->gp.dsp->core.is_idle &&
+                 !d->gp.dsp->core.is_spinning && d->gp.realtime);
+        timeline_end("dsp_run", "GP", zone_start);
+        mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_GP,
+                              get_clock() - start_time);
         g_dbg.gp.cycles = d->gp.dsp->core.cycle_count;
 
         if ((d->monitor.point == MCPX_APU_DEBUG_MON_GP) ||
             (d->monitor.point == MCPX_APU_DEBUG_MON_GP_OR_EP && !ep_enabled)) {
             int off = (d->ep_frame_div % 8) * NUM_SAMPLES_PER_FRAME;
+            uint32_t lr[2][NUM_SAMPLES_PER_FRAME];
+            dsp_read_memory_block(d->gp.dsp, 'X', 0x1400, &lr[0][0],
+                                  2 * NUM_SAMPLES_PER_FRAME);
             for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-                uint32_t l = dsp_read_memory(d->gp.dsp, 'X', 0x1400 + i);
-                d->monitor.frame_buf[off + i][0] = l >> 8;
-                uint32_t r =
-                    dsp_read_memory(d->gp.dsp, 'X', 0x1400 + 1 * 0x20 + i);
-                d->monitor.frame_buf[off + i][1] = r >> 8;
+                d->monitor.frame_buf[off + i][0] = lr[0][i] >> 8;
+                d->monitor.frame_buf[off + i][1] = lr[1][i] >> 8;
             }
         }
     }
 
     /* Run EP */
-    if ((d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPRST) &&
-        (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPDSPRST)) {
-        if (d->ep_frame_div % 8 == 0) {
-            dsp_start_frame(d->ep.dsp);
-            d->ep.dsp->core.is_idle = false;
-            d->ep.dsp->core.cycle_count = 0;
-            do {
-                dsp_run(d->ep.dsp, 1000);
-            } while (!d->ep.dsp->core.is_idle && d->ep.realtime);
-            g_dbg.ep.cycles = d->ep.dsp->core.cycle_count;
-        }
+    if (ep_async) {
+        qemu_event_wait(&d->ep.done);
+        d->gp.defer_fifo_writes = false;
+        gp_flush_deferred_fifo_writes(d);
+    } else if (ep_due) {
+        ep_run_frame(d);
     }
 }
 
@@ -523,4 +653,29 @@ void mcpx_apu_dsp_init(MCPXAPUState *d)
      * use the full audio pipeline or not.
      */
     mcpx_apu_update_dsp_preference(d);
+
+    d->gp.defer_fifo_writes = false;
+    d->gp.deferred_fifo_writes = g_byte_array_new();
+
+    d->ep.pipelined = g_config.audio.dsp_pipeline;
+    if (d->ep.pipelined) {
+        d->ep.thread_exit = false;
+        qemu_event_init(&d->ep.start, false);
+        qemu_event_init(&d->ep.done, false);
+        qemu_thread_create(&d->ep.thread, "mcpx.ep_thread", ep_thread, d,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void mcpx_apu_dsp_finalize(MCPXAPUState *d)
+{
+    if (d->ep.pipelined) {
+        qatomic_set(&d->ep.thread_exit, true);
+        qemu_event_set(&d->ep.start);
+        qemu_thread_join(&d->ep.thread);
+        qemu_event_destroy(&d->ep.start);
+        qemu_event_destroy(&d->ep.done);
+    }
+
+    g_byte_array_unref(d->gp.deferred_fifo_writes);
 }
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "hw/hw.h"
 #include "hw/pci/pci.h"
+#include "qemu/thread.h"
 #include "hw/xbox/mcpx/apu/apu_regs.h"
 
 #include "dsp.h"
@@ -38,6 +39,11 @@ typedef struct MCPXAPUGPState {
     MemoryRegion mmio;
     DSPState *dsp;
     uint32_t regs[0x10000];
+    uint64_t image_hash;
+
+    /* Output FIFO writes held back while the EP runs alongside the GP */
+    bool defer_fifo_writes;
+    GByteArray *deferred_fifo_writes;
 } MCPXAPUGPState;
 
 typedef struct MCPXAPUEPState {
@@ -45,12 +51,21 @@ typedef struct MCPXAPUEPState {
     MemoryRegion mmio;
     DSPState *dsp;
     uint32_t regs[0x10000];
+    uint64_t image_hash;
+
+    /* Pipelined mode, EP frames run on their own thread */
+    bool pipelined;
+    bool thread_exit;
+    QemuThread thread;
+    QemuEvent start;
+    QemuEvent done;
 } MCPXAPUEPState;
 
 extern const MemoryRegionOps gp_ops;
 extern const MemoryRegionOps ep_ops;
 
 void mcpx_apu_dsp_init(MCPXAPUState *d);
+void mcpx_apu_dsp_finalize(MCPXAPUState *d);
 void mcpx_apu_update_dsp_preference(MCPXAPUState *d);
 void mcpx_apu_dsp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME]);
 
@@ -24,24 +24,36 @@
 #include <stddef.h>
 #include <math.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "hw/xbox/mcpx/apu/apu_regs.h"
 
 #define HRTF_SAMPLES_PER_FRAME  NUM_SAMPLES_PER_FRAME
 #define HRTF_NUM_TAPS           31
+#define HRTF_NUM_TAPS_PADDED    32 /* Multiple of the vector width */
 #define HRTF_MAX_DELAY_SAMPLES  42
 #define HRTF_BUFLEN             (HRTF_NUM_TAPS + HRTF_MAX_DELAY_SAMPLES)
 #define HRTF_PARAM_SMOOTH_ALPHA 0.01f
 
+/*
+ * Coefficients are stored in reverse order and padded with a zero tap, and
+ * every input sample is written twice, HRTF_BUFLEN apart, so that the history
+ * needed for an output sample is always one contiguous run of the buffer.
+ */
 typedef struct {
     int buf_pos;
     struct {
-        float buf[HRTF_BUFLEN];
-        float hrir_coeff_cur[HRTF_NUM_TAPS];
-        float hrir_coeff_tar[HRTF_NUM_TAPS];
+        float buf[2 * HRTF_BUFLEN + 1];
+        float hrir_coeff_cur[HRTF_NUM_TAPS_PADDED];
+        float hrir_coeff_tar[HRTF_NUM_TAPS_PADDED];
     } ch[2];
     float itd_cur;
     float itd_tar;
-} HrtfFilter;
+} QEMU_ALIGNED(64) HrtfFilter;
 
 static inline void hrtf_filter_init(HrtfFilter *f)
 {
@@ -57,7 +69,9 @@ hrtf_filter_set_target_params(HrtfFilter *f, float hrir_coeff[2][HRTF_NUM_TAPS],
 
     for (int ch = 0; ch < 2; ch++) {
         float *coeff = f->ch[ch].hrir_coeff_tar;
-        memcpy(coeff, hrir_coeff[ch], sizeof(f->ch[ch].hrir_coeff_tar));
+        for (int k = 0; k < HRTF_NUM_TAPS; k++) {
+            coeff[HRTF_NUM_TAPS - 1 - k] = hrir_coeff[ch][k];
+        }
 
         // Normalize coefficients for unity filter gain
         float s = 0.0f;
@@ -79,14 +93,70 @@ static inline float hrtf_filter_smooth_param(float cur, float tar)
     return cur + HRTF_PARAM_SMOOTH_ALPHA * (tar - cur);
 }
 
+/* cur += HRTF_PARAM_SMOOTH_ALPHA * (tar - cur), over the padded taps */
+static inline void hrtf_filter_smooth_coeffs(float *restrict cur,
+                                             const float *restrict tar)
+{
+    int k = 0;
+
+#if defined(__SSE2__)
+    __m128 alpha = _mm_set1_ps(HRTF_PARAM_SMOOTH_ALPHA);
+    for (; k < HRTF_NUM_TAPS_PADDED; k += 4) {
+        __m128 c = _mm_loadu_ps(cur + k);
+        __m128 t = _mm_loadu_ps(tar + k);
+        _mm_storeu_ps(cur + k,
+                      _mm_add_ps(c, _mm_mul_ps(alpha, _mm_sub_ps(t, c))));
+    }
+#elif defined(__ARM_NEON)
+    for (; k < HRTF_NUM_TAPS_PADDED; k += 4) {
+        float32x4_t c = vld1q_f32(cur + k);
+        float32x4_t t = vld1q_f32(tar + k);
+        vst1q_f32(cur + k,
+                  vmlaq_n_f32(c, vsubq_f32(t, c), HRTF_PARAM_SMOOTH_ALPHA));
+    }
+#endif
+
+    for (; k < HRTF_NUM_TAPS_PADDED; k++) {
+        cur[k] = hrtf_filter_smooth_param(cur[k], tar[k]);
+    }
+}
+
+/* Dot product over the padded taps */
+static inline float hrtf_filter_dot(const float *coeff, const float *buf)
+{
+    int k = 0;
+    float acc = 0.0f;
+
+#if defined(__SSE2__)
+    __m128 sum = _mm_setzero_ps();
+    for (; k < HRTF_NUM_TAPS_PADDED; k += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(coeff + k),
+                                         _mm_loadu_ps(buf + k)));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    acc = _mm_cvtss_f32(sum);
+#elif defined(__ARM_NEON)
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (; k < HRTF_NUM_TAPS_PADDED; k += 4) {
+        sum = vmlaq_f32(sum, vld1q_f32(coeff + k), vld1q_f32(buf + k));
+    }
+    float32x2_t s2 = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    acc = vget_lane_f32(vpadd_f32(s2, s2), 0);
+#endif
+
+    for (; k < HRTF_NUM_TAPS_PADDED; k++) {
+        acc += coeff[k] * buf[k];
+    }
+
+    return acc;
+}
+
 static inline void hrtf_filter_step_parameters(HrtfFilter *f)
 {
     for (int ch = 0; ch < 2; ch++) {
-        float *coeff_cur = f->ch[ch].hrir_coeff_cur;
-        float *coeff_tar = f->ch[ch].hrir_coeff_tar;
-        for (int k = 0; k < HRTF_NUM_TAPS; k++) {
-            coeff_cur[k] = hrtf_filter_smooth_param(coeff_cur[k], coeff_tar[k]);
-        }
+        hrtf_filter_smooth_coeffs(f->ch[ch].hrir_coeff_cur,
+                                  f->ch[ch].hrir_coeff_tar);
     }
     f->itd_cur = hrtf_filter_smooth_param(f->itd_cur, f->itd_tar);
 }
@@ -104,6 +174,7 @@ static inline void hrtf_filter_process(HrtfFilter *f,
 
             // Push new sample
             buf[f->buf_pos] = in[n][ch];
+            buf[f->buf_pos + HRTF_BUFLEN] = in[n][ch];
 
             // Interaural time difference (channel delay)
             float d = f->itd_cur * (ch == 0 ? +1.0f : -1.0f);
@@ -113,18 +184,15 @@ static inline void hrtf_filter_process(HrtfFilter *f,
             int di = d;
             float dfrac = d - di;
 
-            // HRIR Convolution
-            float acc = 0.0f;
-            for (int k = 0; k < HRTF_NUM_TAPS; k++) {
-                int idx1 = (f->buf_pos - di - k + HRTF_BUFLEN) % HRTF_BUFLEN;
-                float s = buf[idx1];
-
-                // Linear interpolation for fractional part
-                if (dfrac > 0.0f) {
-                    int idx2 = (idx1 - 1 + HRTF_BUFLEN) % HRTF_BUFLEN;
-                    s = s * (1 - dfrac) + buf[idx2] * dfrac;
-                }
-                acc += coeff[k] * s;
+            // HRIR Convolution, the oldest tap first
+            const float *window =
+                &buf[f->buf_pos + HRTF_BUFLEN - di - (HRTF_NUM_TAPS - 1)];
+            float acc = hrtf_filter_dot(coeff, window);
+
+            // Linear interpolation for fractional part
+            if (dfrac > 0.0f) {
+                acc = acc * (1 - dfrac) +
+                      hrtf_filter_dot(coeff, window - 1) * dfrac;
             }
 
             out[n][ch] = acc;
@@ -0,0 +1,108 @@
+/*
+ * QEMU MCPX Audio Processing Unit implementation
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HW_XBOX_MCPX_VP_MIX_H
+#define HW_XBOX_MCPX_VP_MIX_H
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Mixing kernels used when fanning voices out to mixbins and when summing
+ * the mixbins of VP workers. Lengths need not be a multiple of the vector
+ * width, but are in practice.
+ */
+
+/* Splits interleaved stereo samples into one buffer per channel */
+static inline void mix_deinterleave(float (*src)[2], float *left,
+                                    float *right, int n)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_loadu_ps(src[i]);
+        __m128 b = _mm_loadu_ps(src[i + 2]);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4x2_t lr = vld2q_f32(src[i]);
+        vst1q_f32(left + i, lr.val[0]);
+        vst1q_f32(right + i, lr.val[1]);
+    }
+#endif
+
+    for (; i < n; i++) {
+        left[i] = src[i][0];
+        right[i] = src[i][1];
+    }
+}
+
+/* dst += src * gain */
+static inline void mix_accumulate_scaled(float *restrict dst,
+                                         const float *restrict src, float gain,
+                                         int n)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), s));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i,
+                  vmlaq_n_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gain));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+/* dst += src */
+static inline void mix_accumulate(float *restrict dst,
+                                  const float *restrict src, int n)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i,
+                      _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+    }
+#endif
+
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+#endif
@@ -20,7 +20,10 @@
  */
 
 #include "hw/xbox/mcpx/apu/apu_int.h"
+#include "qemu/processor.h"
+#include "qemu/timeline.h"
 #include "adpcm.h"
+#include "mix.h"
 
 static const struct {
     hwaddr top, current, next;
@@ -51,13 +54,23 @@ static void set_notify_status(MCPXAPUState *d, uint32_t v, int notifier,
     d->set_irq = true;
 }
 
+static void voice_reset_resampler(MCPXAPUVoiceFilter *filter)
+{
+    /* Start out with a single frame of silence as history */
+    memset(filter->interp_buf[0], 0, sizeof(filter->interp_buf[0]));
+    filter->interp_len = 1;
+    filter->interp_pos = 1.0;
+
+    if (filter->resampler) {
+        src_reset(filter->resampler);
+    }
+}
+
 static void voice_reset_filters(MCPXAPUState *d, uint16_t v)
 {
     assert(v < MCPX_HW_MAX_VOICES);
     memset(&d->vp.filters[v].svf, 0, sizeof(d->vp.filters[v].svf));
-    if (d->vp.filters[v].resampler) {
-        src_reset(d->vp.filters[v].resampler);
-    }
+    voice_reset_resampler(&d->vp.filters[v]);
 }
 
 static bool voice_should_mute(uint16_t v)
@@ -90,25 +103,98 @@ static float clampf(float v, float min, float max)
     }
 }
 
+static float attenuation_table[0x1000];
+
+static void init_attenuation_table(void)
+{
+    for (int vol = 0; vol < 0xFFF; vol++) {
+        attenuation_table[vol] = powf(10.0f, vol/(64.0 * -20.0f));
+    }
+    attenuation_table[0xFFF] = 0.0f;
+}
+
 static float attenuate(uint16_t vol)
 {
-    vol &= 0xFFF;
-    return (vol == 0xFFF) ? 0.0 : powf(10.0f, vol/(64.0 * -20.0f));
+    return attenuation_table[vol & 0xFFF];
+}
+
+/*
+ * Snapshot of the voice structure of the voice being processed by the current
+ * thread. It is read from guest memory once when processing of the voice
+ * begins, and modified registers are written back once it is done, instead of
+ * going through the memory API for every field access.
+ */
+typedef struct VoiceCtx {
+    uint16_t voice;
+    uint32_t regs[NV_PAVS_SIZE / 4];
+    uint32_t dirty; // Registers to be written back
+} VoiceCtx;
+
+QEMU_BUILD_BUG_ON(NV_PAVS_SIZE / 4 > 32);
+
+static __thread VoiceCtx *current_voice_ctx;
+
+static hwaddr voice_get_addr(MCPXAPUState *d, uint16_t voice_handle)
+{
+    return d->regs[NV_PAPU_VPVADDR] + voice_handle * NV_PAVS_SIZE;
+}
+
+static void voice_ctx_load(MCPXAPUState *d, VoiceCtx *ctx, uint16_t v)
+{
+    ctx->voice = v;
+    ctx->dirty = 0;
+    address_space_read(&address_space_memory, voice_get_addr(d, v),
+                       MEMTXATTRS_UNSPECIFIED, ctx->regs, sizeof(ctx->regs));
+    for (int i = 0; i < ARRAY_SIZE(ctx->regs); i++) {
+        ctx->regs[i] = le32_to_cpu(ctx->regs[i]);
+    }
+}
+
+static void voice_ctx_flush(MCPXAPUState *d, VoiceCtx *ctx)
+{
+    hwaddr voice = voice_get_addr(d, ctx->voice);
+
+    while (ctx->dirty) {
+        int i = ctz32(ctx->dirty);
+        stl_le_phys(&address_space_memory, voice + i * 4, ctx->regs[i]);
+        ctx->dirty &= ~(1U << i);
+    }
+}
+
+static uint32_t *voice_ctx_reg(uint16_t voice_handle, hwaddr offset)
+{
+    VoiceCtx *ctx = current_voice_ctx;
+    if (ctx && ctx->voice == voice_handle) {
+        assert(offset < NV_PAVS_SIZE && !(offset & 3));
+        return &ctx->regs[offset / 4];
+    }
+    return NULL;
 }
 
 static uint32_t voice_get_mask(MCPXAPUState *d, uint16_t voice_handle,
                                hwaddr offset, uint32_t mask)
 {
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR] + voice_handle * NV_PAVS_SIZE;
-    return (ldl_le_phys(&address_space_memory, voice + offset) & mask) >>
-           ctz32(mask);
+    uint32_t *reg = voice_ctx_reg(voice_handle, offset);
+    uint32_t v = reg ? *reg :
+                 ldl_le_phys(&address_space_memory,
+                             voice_get_addr(d, voice_handle) + offset);
+    return (v & mask) >> ctz32(mask);
 }
 
 static void voice_set_mask(MCPXAPUState *d, uint16_t voice_handle,
                            hwaddr offset, uint32_t mask, uint32_t val)
 {
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR]
-                    + voice_handle * NV_PAVS_SIZE;
+    uint32_t *reg = voice_ctx_reg(voice_handle, offset);
+    if (reg) {
+        uint32_t v = (*reg & ~mask) | ((val << ctz32(mask)) & mask);
+        if (v != *reg) {
+            *reg = v;
+            current_voice_ctx->dirty |= 1U << (offset / 4);
+        }
+        return;
+    }
+
+    hwaddr voice = voice_get_addr(d, voice_handle);
     uint32_t v = ldl_le_phys(&address_space_memory, voice + offset) & ~mask;
     stl_le_phys(&address_space_memory, voice + offset,
                 v | ((val << ctz32(mask)) & mask));
@@ -357,7 +443,7 @@ static void fe_method(MCPXAPUState *d, uint32_t method, uint32_t argument)
             // after updating filter parameters, however it may be possible to
             // update parameter targets for an active voice.
             assert(handle < HRTF_ENTRY_COUNT);
-            hrtf_filter_set_target_params(&d->vp.filters[current_voice].hrtf,
+            hrtf_filter_set_target_params(&d->vp.hrtf_filters[current_voice],
                                           d->vp.hrtf.entries[handle].hrir,
                                           d->vp.hrtf.entries[handle].itd);
         }
@@ -672,6 +758,48 @@ static hwaddr get_data_ptr(hwaddr sge_base, unsigned int max_sge, uint32_t addr)
     return prd_address + addr % TARGET_PAGE_SIZE;
 }
 
+/* Reads voice buffer data, which may span several scatter-gather pages */
+static void voice_read_sge(MCPXAPUState *d, uint32_t linear_addr, void *buf,
+                           size_t len)
+{
+    uint8_t *out = buf;
+
+    while (len) {
+        size_t chunk =
+            MIN(len, TARGET_PAGE_SIZE - linear_addr % TARGET_PAGE_SIZE);
+        hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF,
+                                   linear_addr);
+        address_space_read(&address_space_memory, addr,
+                           MEMTXATTRS_UNSPECIFIED, out, chunk);
+        out += chunk;
+        linear_addr += chunk;
+        len -= chunk;
+    }
+}
+
+static const int16_t *adpcm_cache_decode(MCPXAPUVoiceFilter *filter,
+                                         unsigned int block_index,
+                                         const uint8_t *block,
+                                         size_t block_size,
+                                         unsigned int channels)
+{
+    assert(block_size <= sizeof_field(MCPXAPUAdpcmCacheEntry, block));
+
+    if (!filter->adpcm_cache) {
+        filter->adpcm_cache = g_new0(MCPXAPUAdpcmCache, 1);
+    }
+
+    MCPXAPUAdpcmCacheEntry *entry =
+        &filter->adpcm_cache->entries[block_index % ADPCM_CACHE_BLOCKS];
+    if (entry->size != block_size || memcmp(entry->block, block, block_size)) {
+        memcpy(entry->block, block, block_size);
+        entry->size = block_size;
+        adpcm_decode_block(entry->decoded, block, block_size, channels);
+    }
+
+    return entry->decoded;
+}
+
 static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
                            uint32_t reg_a, uint32_t rr_reg, uint32_t rr_mask,
                            uint32_t lvl_reg, uint32_t lvl_mask,
@@ -882,8 +1010,8 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
     size_t block_size;
 
     int adpcm_block_index = -1;
-    uint32_t adpcm_block[36*2/4];
-    int16_t adpcm_decoded[65*2]; // FIXME: Move out of here
+    uint8_t adpcm_block[36*2];
+    const int16_t *adpcm_decoded = NULL;
 
     // FIXME: Only update if necessary
     struct McpxApuDebugVoice *dbg = &g_dbg.vp.v[v];
@@ -1019,18 +1147,12 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
                     memcpy(adpcm_block, &d->ram_ptr[addr],
                            block_size); // FIXME: Use idiomatic DMA function
                 } else {
-                    linear_addr += ba;
-                    for (unsigned int word_index = 0;
-                         word_index < (9 * samples_per_block); word_index++) {
-                        hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR],
-                                                   0xFFFFFFFF, linear_addr);
-                        adpcm_block[word_index] =
-                            ldl_le_phys(&address_space_memory, addr);
-                        linear_addr += 4;
-                    }
+                    voice_read_sge(d, ba + linear_addr, adpcm_block,
+                                   block_size);
                 }
-                adpcm_decode_block(adpcm_decoded, (uint8_t *)adpcm_block,
-                                   block_size, channels);
+                adpcm_decoded =
+                    adpcm_cache_decode(&d->vp.filters[v], block_index,
+                                       adpcm_block, block_size, channels);
                 adpcm_block_index = block_index;
             }
 
@@ -1116,9 +1238,9 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
     return sample_count;
 }
 
-static long voice_resample_callback(void *cb_data, float **data)
+/* Fills resample_buf with the next frame of interleaved stereo samples */
+static int voice_fetch_frame(MCPXAPUVoiceFilter *filter)
 {
-    MCPXAPUVoiceFilter *filter = cb_data;
     uint16_t v = filter->voice;
     assert(v < MCPX_HW_MAX_VOICES);
     MCPXAPUState *d = container_of(filter, MCPXAPUState, vp.filters[v]);
@@ -1146,18 +1268,34 @@ static long voice_resample_callback(void *cb_data, float **data)
         sample_count = NUM_SAMPLES_PER_FRAME;
     }
 
+    return sample_count;
+}
+
+static long voice_resample_callback(void *cb_data, float **data)
+{
+    MCPXAPUVoiceFilter *filter = cb_data;
+    int sample_count = voice_fetch_frame(filter);
+
+    if (filter->resampler_channels == 1) {
+        for (int i = 0; i < sample_count; i++) {
+            filter->resample_buf[i] = filter->resample_buf[2 * i];
+        }
+    }
+
     *data = filter->resample_buf;
     return sample_count;
 }
 
-static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
-                          int requested_num, float rate)
+static int voice_resample_sinc(MCPXAPUVoiceFilter *filter, float samples[][2],
+                               int requested_num, float rate,
+                               unsigned int channels)
 {
-    assert(v < MCPX_HW_MAX_VOICES);
-    MCPXAPUVoiceFilter *filter = &d->vp.filters[v];
+    if (filter->resampler && filter->resampler_channels != channels) {
+        src_delete(filter->resampler);
+        filter->resampler = NULL;
+    }
 
     if (filter->resampler == NULL) {
-        filter->voice = v;
         int err;
 
         /* Note: Using a sinc based resampler for quality. Unsure about
@@ -1165,9 +1303,10 @@ static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
          * which case using this resampler is overkill, but quality is good
          * so use it for now.
          */
-        // FIXME: Don't do 2ch resampling if this is a mono voice
+        filter->resampler_channels = channels;
         filter->resampler = src_callback_new(&voice_resample_callback,
-                                           SRC_SINC_FASTEST, 2, &err, filter);
+                                             SRC_SINC_FASTEST, channels, &err,
+                                             filter);
         if (filter->resampler == NULL) {
             fprintf(stderr, "src error: %s\n", src_strerror(err));
             assert(0);
@@ -1179,10 +1318,110 @@ static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
     if (count == -1) {
         DPRINTF("resample error\n");
     }
+
+    if (channels == 1 && count > 0) {
+        /* Expand in place, back to front */
+        float *mono = (float *)samples;
+        for (int i = count - 1; i >= 0; i--) {
+            samples[i][1] = samples[i][0] = mono[i];
+        }
+    }
+
+    return count;
+}
+
+static inline float interp_linear(float x0, float x1, float t)
+{
+    return x0 + t * (x1 - x0);
+}
+
+/* 4-point, 3rd-order Hermite (Catmull-Rom) interpolation between x0 and x1 */
+static inline float interp_hermite(float xm1, float x0, float x1, float x2,
+                                   float t)
+{
+    float c1 = 0.5f * (x1 - xm1);
+    float c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+    float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+    return ((c3 * t + c2) * t + c1) * t + x0;
+}
+
+static int voice_resample_interp(MCPXAPUVoiceFilter *filter,
+                                 float samples[][2], int requested_num,
+                                 float rate, unsigned int channels)
+{
+    float (*buf)[2] = filter->interp_buf;
+    int len = filter->interp_len;
+    double pos = filter->interp_pos;
+    double step = 1.0 / rate;
+    bool hermite = filter->resample_mode == CONFIG_AUDIO_VP_RESAMPLER_HERMITE;
+
+    for (int n = 0; n < requested_num;) {
+        int i = (int)pos;
+
+        if (i + 2 >= len) {
+            /* Out of input, keep the frame before pos as history and refill */
+            int drop = MIN(i - 1, len);
+            memmove(buf, buf + drop, (len - drop) * sizeof(buf[0]));
+            len -= drop;
+            pos -= drop;
+
+            int count = voice_fetch_frame(filter);
+            memcpy(buf + len, filter->resample_buf, count * sizeof(buf[0]));
+            len += count;
+            continue;
+        }
+
+        float t = pos - i;
+        for (int ch = 0; ch < channels; ch++) {
+            samples[n][ch] =
+                hermite ? interp_hermite(buf[i - 1][ch], buf[i][ch],
+                                         buf[i + 1][ch], buf[i + 2][ch], t) :
+                          interp_linear(buf[i][ch], buf[i + 1][ch], t);
+        }
+        if (channels == 1) {
+            samples[n][1] = samples[n][0];
+        }
+
+        pos += step;
+        n++;
+    }
+
+    filter->interp_len = len;
+    filter->interp_pos = pos;
+
+    return requested_num;
+}
+
+static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
+                          int requested_num, float rate, unsigned int channels)
+{
+    assert(v < MCPX_HW_MAX_VOICES);
+    MCPXAPUVoiceFilter *filter = &d->vp.filters[v];
+    int mode = g_config.audio.vp.resampler;
+
+    filter->voice = v;
+    if (filter->resample_mode != mode || !filter->interp_len) {
+        filter->resample_mode = mode;
+        voice_reset_resampler(filter);
+        if (mode != CONFIG_AUDIO_VP_RESAMPLER_SINC && filter->resampler) {
+            src_delete(filter->resampler);
+            filter->resampler = NULL;
+        }
+    }
+
+    int count;
+    if (mode == CONFIG_AUDIO_VP_RESAMPLER_SINC) {
+        count = voice_resample_sinc(filter, samples, requested_num, rate,
+                                    channels);
+    } else {
+        count = voice_resample_interp(filter, samples, requested_num, rate,
+                                      channels);
+    }
+
     if (count != requested_num) {
         DPRINTF("resample returned fewer than expected: %d\n", count);
 
-        if (count == 0)
+        if (count <= 0)
             return -1;
     }
 
@@ -1281,12 +1520,11 @@ static void get_multipass_samples(MCPXAPUState *d,
     dump_multipass_unused_debug_info(d, v);
 }
 
-static void voice_process(MCPXAPUState *d,
-                          float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
-                          float sample_buf[NUM_SAMPLES_PER_FRAME][2],
-                          uint16_t v, int voice_list)
+static void voice_process_frame(MCPXAPUState *d,
+                                float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
+                                float sample_buf[NUM_SAMPLES_PER_FRAME][2],
+                                uint16_t v, int voice_list)
 {
-    assert(v < MCPX_HW_MAX_VOICES);
     bool stereo = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
                                  NV_PAVS_VOICE_CFG_FMT_STEREO);
     unsigned int channels = stereo ? 2 : 1;
@@ -1341,7 +1579,8 @@ static void voice_process(MCPXAPUState *d,
             }
             int count =
                 voice_resample(d, v, &samples[sample_count],
-                               NUM_SAMPLES_PER_FRAME - sample_count, rate);
+                               NUM_SAMPLES_PER_FRAME - sample_count, rate,
+                               channels);
             if (count < 0) {
                 break;
             }
@@ -1456,12 +1695,16 @@ static void voice_process(MCPXAPUState *d,
             voice_get_mask(d, v, NV_PAVS_VOICE_CFG_HRTF_TARGET,
                            NV_PAVS_VOICE_CFG_HRTF_TARGET_HANDLE);
         if (hrtf_handle != HRTF_NULL_HANDLE) {
-            hrtf_filter_process(&d->vp.filters[v].hrtf, samples, samples);
+            hrtf_filter_process(&d->vp.hrtf_filters[v], samples, samples);
         }
     }
 
     // FIXME: ParaEQ
 
+    float channel_samples[2][NUM_SAMPLES_PER_FRAME];
+    mix_deinterleave(samples, channel_samples[0], channel_samples[1],
+                     NUM_SAMPLES_PER_FRAME);
+
     for (int b = 0; b < 8; b++) {
         float g = ea_value;
         float hr;
@@ -1472,9 +1715,11 @@ static void voice_process(MCPXAPUState *d,
             hr = 1 << d->vp.submix_headroom[bin[b]];
         }
         g *= attenuate(vol[b])/hr;
-        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-            mixbins[bin[b]][i] += g*samples[i][b % channels];
+        if (g == 0.0f) {
+            continue;
         }
+        mix_accumulate_scaled(mixbins[bin[b]], channel_samples[b % channels],
+                              g, NUM_SAMPLES_PER_FRAME);
     }
 
     if (d->monitor.point == MCPX_APU_DEBUG_MON_VP) {
@@ -1511,13 +1756,27 @@ static void voice_process(MCPXAPUState *d,
             g = fmax(g, attenuate(vol[b]) / hr);
         }
         g *= ea_value;
-        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-            sample_buf[i][0] += g*samples[i][0];
-            sample_buf[i][1] += g*samples[i][1];
-        }
+        mix_accumulate_scaled(&sample_buf[0][0], &samples[0][0], g,
+                              2 * NUM_SAMPLES_PER_FRAME);
     }
 }
 
+static void voice_process(MCPXAPUState *d,
+                          float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
+                          float sample_buf[NUM_SAMPLES_PER_FRAME][2],
+                          uint16_t v, int voice_list)
+{
+    assert(v < MCPX_HW_MAX_VOICES);
+
+    /* The voice is locked for processing, so guest writes cannot race us */
+    VoiceCtx ctx;
+    voice_ctx_load(d, &ctx, v);
+    current_voice_ctx = &ctx;
+    voice_process_frame(d, mixbins, sample_buf, v, voice_list);
+    current_voice_ctx = NULL;
+    voice_ctx_flush(d, &ctx);
+}
+
 static void get_voice_bin_src_dst(MCPXAPUState *d, int v,
                                   uint32_t *src, uint32_t *dst, uint32_t *clr)
 {
@@ -1578,63 +1837,78 @@ static void get_voice_bin_src_dst(MCPXAPUState *d, int v,
     }
 }
 
+/*
+ * A frame of voices takes tens of microseconds to process, less than waking a
+ * parked thread can take. Both sides of the hand-off spin for this long before
+ * parking.
+ */
+#define VOICE_WORK_SPIN_NS 50000
+
+/* Voices outside of multipass groups are claimed by workers in batches */
+#define VOICE_WORK_UNIT_BATCH 4
+
+static void voice_worker_wait(VoiceWorkDispatch *vwd, VoiceWorker *self,
+                              uint32_t generation)
+{
+    int64_t spin_deadline = get_clock() + VOICE_WORK_SPIN_NS;
+
+    while (qatomic_load_acquire(&vwd->generation) == generation) {
+        if (get_clock() < spin_deadline) {
+            cpu_relax();
+            continue;
+        }
+        qemu_event_reset(&self->wake);
+        if (qatomic_load_acquire(&vwd->generation) != generation) {
+            break;
+        }
+        qemu_event_wait(&self->wake);
+    }
+}
+
 static void *voice_worker_thread(void *arg)
 {
-    MCPXAPUState *d = arg;
+    VoiceWorker *self = arg;
+    MCPXAPUState *d = self->d;
     VoiceWorkDispatch *vwd = &d->vp.voice_work_dispatch;
+    uint32_t generation = 0;
 
     rcu_register_thread();
-    qemu_mutex_lock(&vwd->lock);
-
-    int worker_id = ctz64(vwd->workers_pending);
-    VoiceWorker *self = &d->vp.voice_work_dispatch.workers[worker_id];
-    self->queue_len = 0;
 
-    do {
-        int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
-        g_dbg.vp.workers[worker_id].num_voices = self->queue_len;
+    while (true) {
+        voice_worker_wait(vwd, self, generation);
+        generation = qatomic_load_acquire(&vwd->generation);
+        if (qatomic_read(&vwd->workers_should_exit)) {
+            break;
+        }
 
-        if (self->queue_len) {
-            qemu_mutex_unlock(&vwd->lock);
+        int64_t start_time = get_clock();
+        int64_t zone_start = timeline_begin();
 
-            // Process queued voices
-            memset(self->mixbins, 0, sizeof(self->mixbins));
-            if (d->monitor.point == MCPX_APU_DEBUG_MON_VP) {
+        // Claim units until there are none left, mixing into private bins
+        self->num_voices = 0;
+        int u;
+        while ((u = qatomic_fetch_inc(&vwd->next_unit)) < vwd->num_units) {
+            VoiceWorkUnit *unit = &vwd->units[u];
+            if (!self->num_voices) {
+                memset(self->mixbins, 0, sizeof(self->mixbins));
                 memset(self->sample_buf, 0, sizeof(self->sample_buf));
             }
-            for (int i = 0; i < self->queue_len; i++) {
+            for (int i = unit->start; i < unit->start + unit->len; i++) {
                 voice_process(d, self->mixbins, self->sample_buf,
-                              self->queue[i].voice, self->queue[i].list);
+                              vwd->queue[i].voice, vwd->queue[i].list);
             }
-
-            qemu_mutex_lock(&vwd->lock);
-
-            // Add voice contributions
-            for (int b = 0; b < NUM_MIXBINS; b++) {
-                for (int s = 0; s < NUM_SAMPLES_PER_FRAME; s++) {
-                    vwd->mixbins[b][s] += self->mixbins[b][s];
-                }
-            }
-            if (d->monitor.point == MCPX_APU_DEBUG_MON_VP) {
-                for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-                    d->vp.sample_buf[i][0] += self->sample_buf[i][0];
-                    d->vp.sample_buf[i][1] += self->sample_buf[i][1];
-                }
-            }
-
-            self->queue_len = 0;
+            self->num_voices += unit->len;
         }
 
-        vwd->workers_pending &= ~(1 << worker_id);
-        if (!vwd->workers_pending) {
-            qemu_cond_signal(&vwd->work_finished);
-        }
+        timeline_end("voice worker", NULL, zone_start);
+        self->time_ns = get_clock() - start_time;
+        g_dbg.vp.workers[self->id].num_voices = self->num_voices;
+        g_dbg.vp.workers[self->id].time_us = self->time_ns / SCALE_US;
 
-        int64_t end_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
-        g_dbg.vp.workers[worker_id].time_us = end_time - start_time;
-
-        qemu_cond_wait(&vwd->work_pending, &vwd->lock);
-    } while (!vwd->workers_should_exit);
+        if (qatomic_fetch_dec(&vwd->workers_remaining) == 1) {
+            qemu_event_set(&vwd->work_finished);
+        }
+    }
 
     rcu_unregister_thread();
     return NULL;
@@ -1676,10 +1950,12 @@ static void voice_work_release_voice_locks(MCPXAPUState *d)
 static void voice_work_schedule(MCPXAPUState *d)
 {
     VoiceWorkDispatch *vwd = &d->vp.voice_work_dispatch;
-    int next_worker_to_schedule = 0;
     bool group = false;
+    bool unit_open = false;
     uint32_t dirty = 0;
 
+    vwd->num_units = 0;
+
     for (int i = 0; i < vwd->queue_len; i++) {
         uint32_t src, dst, clr;
         get_voice_bin_src_dst(d, vwd->queue[i].voice, &src, &dst, &clr);
@@ -1705,20 +1981,33 @@ static void voice_work_schedule(MCPXAPUState *d)
             group = true;
         }
 
-        // Assign voice to worker
-        VoiceWorker *worker = &vwd->workers[next_worker_to_schedule];
-        worker->queue[worker->queue_len++] = vwd->queue[i];
-        vwd->workers_pending |= 1 << next_worker_to_schedule;
+        // Add voice to the current unit, or start a new one
+        if (!unit_open) {
+            vwd->units[vwd->num_units++] = (VoiceWorkUnit){ .start = i };
+        }
+        VoiceWorkUnit *unit = &vwd->units[vwd->num_units - 1];
+        unit->len++;
 
         dirty = (dirty & ~clr) | dst;
         if (clr & MULTIPASS_BIN_MASK) {
             group = false;
         }
 
-        if (!group) {
-            next_worker_to_schedule =
-                (next_worker_to_schedule + 1) % vwd->num_workers;
+        // Keep multipass groups on one worker
+        unit_open = group || unit->len < VOICE_WORK_UNIT_BATCH;
+    }
+}
+
+static void voice_work_wait_finished(VoiceWorkDispatch *vwd)
+{
+    int64_t spin_deadline = get_clock() + VOICE_WORK_SPIN_NS;
+
+    while (qatomic_load_acquire(&vwd->workers_remaining)) {
+        if (get_clock() < spin_deadline) {
+            cpu_relax();
+            continue;
         }
+        qemu_event_wait(&vwd->work_finished);
     }
 }
 
@@ -1730,31 +2019,51 @@ voice_work_dispatch(MCPXAPUState *d,
 
     int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
-    qemu_mutex_lock(&vwd->lock);
-
     if (vwd->queue_len) {
-        memset(vwd->mixbins, 0, sizeof(vwd->mixbins));
-
-        // Signal workers and wait for completion
         voice_work_schedule(d);
-        qemu_cond_broadcast(&vwd->work_pending);
-        qemu_cond_wait(&vwd->work_finished, &vwd->lock);
-        assert(!vwd->workers_pending);
+
+        // Hand out the frame and wait for workers to complete it
+        qatomic_set(&vwd->next_unit, 0);
+        qatomic_set(&vwd->workers_remaining, vwd->num_workers);
+        qemu_event_reset(&vwd->work_finished);
+        qatomic_store_release(&vwd->generation, vwd->generation + 1);
+        int64_t dispatch_start = get_clock();
+        for (int i = 0; i < vwd->num_workers; i++) {
+            qemu_event_set(&vwd->workers[i].wake);
+        }
+        voice_work_wait_finished(vwd);
+        int64_t reduce_start = get_clock();
+        mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_VP_DISPATCH,
+                              reduce_start - dispatch_start);
+
         voice_work_release_voice_locks(d);
         vwd->queue_len = 0;
 
         // Add voice contributions
-        for (int b = 0; b < NUM_MIXBINS; b++) {
-            for (int s = 0; s < NUM_SAMPLES_PER_FRAME; s++) {
-                mixbins[b][s] += vwd->mixbins[b][s];
+        int64_t max_worker_ns = 0;
+        for (int i = 0; i < vwd->num_workers; i++) {
+            max_worker_ns = MAX(max_worker_ns, vwd->workers[i].time_ns);
+        }
+        mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_VP_WORKER, max_worker_ns);
+        for (int i = 0; i < vwd->num_workers; i++) {
+            VoiceWorker *worker = &vwd->workers[i];
+            if (!worker->num_voices) {
+                continue;
+            }
+            mix_accumulate(&mixbins[0][0], &worker->mixbins[0][0],
+                           NUM_MIXBINS * NUM_SAMPLES_PER_FRAME);
+            if (d->monitor.point == MCPX_APU_DEBUG_MON_VP) {
+                mix_accumulate(&d->vp.sample_buf[0][0],
+                               &worker->sample_buf[0][0],
+                               2 * NUM_SAMPLES_PER_FRAME);
             }
         }
+        mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_VP_REDUCE,
+                              get_clock() - reduce_start);
     }
 
     int64_t end_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     g_dbg.vp.total_worker_time_us = end_time - start_time;
-
-    qemu_mutex_unlock(&vwd->lock);
 }
 
 static void voice_work_init(MCPXAPUState *d)
@@ -1763,44 +2072,48 @@ static void voice_work_init(MCPXAPUState *d)
 
     int num_workers = g_config.audio.vp.num_workers ?: SDL_GetCPUCount();
     vwd->num_workers = MAX(1, MIN(num_workers, MAX_VOICE_WORKERS));
-    vwd->workers = g_malloc0_n(vwd->num_workers, sizeof(VoiceWorker));
+    size_t workers_size = vwd->num_workers * sizeof(VoiceWorker);
+    vwd->workers = qemu_memalign(__alignof__(VoiceWorker), workers_size);
+    memset(vwd->workers, 0, workers_size);
     vwd->workers_should_exit = false;
-    vwd->workers_pending = 0;
+    vwd->generation = 0;
     vwd->queue_len = 0;
 
     g_dbg.vp.num_workers = vwd->num_workers;
 
-    qemu_mutex_init(&vwd->lock);
-    qemu_mutex_lock(&vwd->lock);
-    qemu_cond_init(&vwd->work_pending);
-    qemu_cond_init(&vwd->work_finished);
+    qemu_event_init(&vwd->work_finished, false);
     for (int i = 0; i < vwd->num_workers; i++) {
-        vwd->workers_pending |= 1 << i;
-        qemu_thread_create(&vwd->workers[i].thread, "mcpx.voice_worker",
-                           voice_worker_thread, d, QEMU_THREAD_JOINABLE);
+        VoiceWorker *worker = &vwd->workers[i];
+        worker->d = d;
+        worker->id = i;
+        qemu_event_init(&worker->wake, false);
+        qemu_thread_create(&worker->thread, "mcpx.voice_worker",
+                           voice_worker_thread, worker, QEMU_THREAD_JOINABLE);
     }
-    qemu_cond_wait(&vwd->work_finished, &vwd->lock);
-    assert(!vwd->workers_pending);
-    qemu_mutex_unlock(&vwd->lock);
 }
 
 static void voice_work_finalize(MCPXAPUState *d)
 {
     VoiceWorkDispatch *vwd = &d->vp.voice_work_dispatch;
 
-    qemu_mutex_lock(&vwd->lock);
-    vwd->workers_should_exit = true;
-    qemu_cond_broadcast(&vwd->work_pending);
-    qemu_mutex_unlock(&vwd->lock);
+    qatomic_set(&vwd->workers_should_exit, true);
+    qatomic_store_release(&vwd->generation, vwd->generation + 1);
+    for (int i = 0; i < vwd->num_workers; i++) {
+        qemu_event_set(&vwd->workers[i].wake);
+    }
     for (int i = 0; i < vwd->num_workers; i++) {
         qemu_thread_join(&vwd->workers[i].thread);
+        qemu_event_destroy(&vwd->workers[i].wake);
     }
-    g_free(vwd->workers);
+    qemu_event_destroy(&vwd->work_finished);
+    qemu_vfree(vwd->workers);
     vwd->workers = NULL;
 }
 
 void mcpx_apu_vp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME])
 {
+    int64_t start_time = get_clock();
+
     memset(d->vp.sample_buf, 0, sizeof(d->vp.sample_buf));
 
     /* Process all voices, mixing each into the affected MIXBINs */
@@ -1832,6 +2145,8 @@ void mcpx_apu_vp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_P
             d->regs[current] = d->regs[next];
         }
     }
+    mcpx_debug_stage_time(MCPX_APU_DEBUG_STAGE_VP_VOICE_LISTS,
+                          get_clock() - start_time);
     voice_work_dispatch(d, mixbins);
 
     if (d->monitor.point == MCPX_APU_DEBUG_MON_VP) {
@@ -1852,6 +2167,8 @@ void mcpx_apu_vp_frame(MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_P
 
 void mcpx_apu_vp_init(MCPXAPUState *d)
 {
+    init_attenuation_table();
+
     for (int i = 0; i < MCPX_HW_MAX_VOICES; i++) {
         qemu_spin_init(&d->vp.voice_spinlocks[i]);
     }
@@ -1862,6 +2179,11 @@ void mcpx_apu_vp_init(MCPXAPUState *d)
 void mcpx_apu_vp_finalize(MCPXAPUState *d)
 {
     voice_work_finalize(d);
+
+    for (int v = 0; v < ARRAY_SIZE(d->vp.filters); v++) {
+        g_free(d->vp.filters[v].adpcm_cache);
+        d->vp.filters[v].adpcm_cache = NULL;
+    }
 }
 
 void mcpx_apu_vp_reset(MCPXAPUState *d)
@@ -1872,7 +2194,7 @@ void mcpx_apu_vp_reset(MCPXAPUState *d)
     memset(d->vp.hrtf_submix, 0, sizeof(d->vp.hrtf_submix));
     memset(d->vp.submix_headroom, 0, sizeof(d->vp.submix_headroom));
     memset(d->vp.voice_locked, 0, sizeof(d->vp.voice_locked));
-    for (int v = 0; v < ARRAY_SIZE(d->vp.filters); v++) {
-        hrtf_filter_init(&d->vp.filters[v].hrtf);
+    for (int v = 0; v < ARRAY_SIZE(d->vp.hrtf_filters); v++) {
+        hrtf_filter_init(&d->vp.hrtf_filters[v]);
     }
 }
@@ -40,36 +40,78 @@ typedef struct MCPXAPUVPSSLData {
     int ssl_seg;
 } MCPXAPUVPSSLData;
 
+#define ADPCM_CACHE_BLOCKS 16
+
+/*
+ * Decoded ADPCM blocks of a voice, indexed by block number. Entries are
+ * validated against the raw block, so short loops are decoded only once.
+ */
+typedef struct MCPXAPUAdpcmCacheEntry {
+    uint32_t size; // Of the raw block in bytes, 0 if unused
+    uint8_t block[36 * 2];
+    int16_t decoded[65 * 2];
+} MCPXAPUAdpcmCacheEntry;
+
+typedef struct MCPXAPUAdpcmCache {
+    MCPXAPUAdpcmCacheEntry entries[ADPCM_CACHE_BLOCKS];
+} MCPXAPUAdpcmCache;
+
+/* Frames of input kept around for the interpolating resamplers */
+#define VOICE_INTERP_HISTORY 3
+
+#define VP_CACHE_LINE_SIZE 64
+
+/*
+ * Per-voice processing state. Voices are processed by different VP workers,
+ * so each is kept on cache lines of its own, with the small fields that are
+ * accessed for every voice ahead of the buffers. HRTF filter state is only
+ * needed by 3D voices and is kept apart, see MCPXAPUVPState.
+ */
 typedef struct MCPXAPUVoiceFilter {
     uint16_t voice;
-    float resample_buf[NUM_SAMPLES_PER_FRAME * 2];
+    int resample_mode; // CONFIG_AUDIO_VP_RESAMPLER_*
+    int resampler_channels;
+    int interp_len; // 0 until the resampler is first used
+    double interp_pos;
     SRC_STATE *resampler;
+    MCPXAPUAdpcmCache *adpcm_cache; // Allocated on first use
     sv_filter svf[2];
-    HrtfFilter hrtf;
-} MCPXAPUVoiceFilter;
+    float interp_buf[VOICE_INTERP_HISTORY + NUM_SAMPLES_PER_FRAME][2];
+    float resample_buf[NUM_SAMPLES_PER_FRAME * 2];
+} QEMU_ALIGNED(VP_CACHE_LINE_SIZE) MCPXAPUVoiceFilter;
 
 typedef struct VoiceWorkItem {
     int voice;
     int list;
 } VoiceWorkItem;
 
+/* Consecutive voices of the queue, processed in order by a single worker */
+typedef struct VoiceWorkUnit {
+    int start;
+    int len;
+} VoiceWorkUnit;
+
 typedef struct VoiceWorker {
     QemuThread thread;
+    MCPXAPUState *d;
+    int id;
+    QemuEvent wake;
+    int num_voices; // Processed in the current frame
+    int64_t time_ns; // Spent on the current frame
     float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
     float sample_buf[NUM_SAMPLES_PER_FRAME][2];
-    VoiceWorkItem queue[MCPX_HW_MAX_VOICES];
-    int queue_len;
-} VoiceWorker;
+} QEMU_ALIGNED(VP_CACHE_LINE_SIZE) VoiceWorker;
 
 typedef struct VoiceWorkDispatch {
-    QemuMutex lock;
     int num_workers;
     VoiceWorker *workers;
     bool workers_should_exit;
-    QemuCond work_pending;
-    uint64_t workers_pending;
-    QemuCond work_finished;
-    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+    uint32_t generation; // Incremented to hand a frame of work to workers
+    int next_unit; // Claimed by workers with an atomic increment
+    int workers_remaining;
+    QemuEvent work_finished;
+    VoiceWorkUnit units[MCPX_HW_MAX_VOICES];
+    int num_units;
     VoiceWorkItem queue[MCPX_HW_MAX_VOICES];
     int queue_len;
 } VoiceWorkDispatch;
@@ -78,6 +120,7 @@ typedef struct {
     MemoryRegion mmio;
     VoiceWorkDispatch voice_work_dispatch;
     MCPXAPUVoiceFilter filters[MCPX_HW_MAX_VOICES];
+    HrtfFilter hrtf_filters[MCPX_HW_MAX_3D_VOICES];
 
     // FIXME: Where are these stored?
     int ssl_base_page;
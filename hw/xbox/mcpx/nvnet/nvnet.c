@@ -30,12 +30,20 @@
 #include "qemu/bswap.h"
 #include "qemu/iov.h"
 #include "migration/vmstate.h"
+#include "monitor/monitor.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc-i386.h"
+#include "qapi/type-helpers.h"
+#include "qemu/timer.h"
+#include "ui/xemu-settings.h"
 #include "nvnet_regs.h"
+#include "nvnet_debug.h"
 
 #define IOPORT_SIZE 0x8
 #define MMIO_SIZE 0x400
 #define PHY_ADDR 1
 #define AUTONEG_DURATION_MS 250
+#define NVNET_TX_MAX_FRAGS 32
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> ctz32(mask))
 
@@ -53,6 +61,15 @@
 #define TYPE_NVNET "nvnet"
 OBJECT_DECLARE_SIMPLE_TYPE(NvNetState, NVNET)
 
+/* Receive filter, precomputed from the registers it depends on */
+typedef struct NvNetRxFilter {
+    bool accept_all;
+    bool mcast;
+    uint64_t mac; /* addresses as packed by mac_to_u64() */
+    uint64_t mcast_addr;
+    uint64_t mcast_mask;
+} NvNetRxFilter;
+
 typedef struct NvNetState {
     /*< private >*/
     PCIDevice parent_obj;
@@ -66,12 +83,22 @@ typedef struct NvNetState {
     uint8_t regs[MMIO_SIZE];
     uint32_t phy_regs[6];
 
-    uint32_t tx_dma_buf_offset;
     uint8_t tx_dma_buf[TX_ALLOC_BUFSIZE];
     uint8_t rx_dma_buf[RX_ALLOC_BUFSIZE];
 
     QEMUTimer *autoneg_timer;
 
+    /* RX interrupt moderation */
+    QEMUTimer *rx_irq_timer;
+    int64_t rx_irq_delay_ns;
+    bool rx_irq_pending; /* raise NVNET_IRQ_STATUS_RX when allowed */
+    bool rx_batch;       /* delivering queued packets */
+
+    NvNetRxFilter rx_filter;
+
+    NvNetStats stats;
+    int64_t rx_stall_start; /* when the RX ring filled up, realtime ns */
+
     /* Deprecated */
     uint8_t tx_ring_index;
     uint8_t rx_ring_index;
@@ -264,6 +291,16 @@ static void send_packet(NvNetState *s, const uint8_t *buf, size_t size)
     qemu_send_packet(nc, buf, size);
 }
 
+static void hist_add(NvNetHistogram *h, uint64_t value)
+{
+    int bucket = value ? MIN(64 - clz64(value), NVNET_HIST_BUCKETS - 1) : 0;
+
+    h->count++;
+    h->total += value;
+    h->max = MAX(h->max, value);
+    h->buckets[bucket]++;
+}
+
 static uint16_t get_tx_ring_size(NvNetState *s)
 {
     uint32_t ring_size = get_reg(s, NVNET_RING_SIZE);
@@ -395,14 +432,65 @@ static bool nvnet_can_receive(NetClientState *nc)
     return can_rx;
 }
 
+/*
+ * Raises the RX interrupt, at most once per rx_irq_delay_ns and once per
+ * batch of queued packets. Packets received in between share the next one.
+ */
+static void raise_rx_irq(NvNetState *s)
+{
+    if (s->rx_batch || timer_pending(s->rx_irq_timer)) {
+        s->rx_irq_pending = true;
+        return;
+    }
+
+    s->rx_irq_pending = false;
+    s->stats.rx_irqs++;
+    set_intr_status(s, NVNET_IRQ_STATUS_RX);
+
+    if (s->rx_irq_delay_ns) {
+        timer_mod(s->rx_irq_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->rx_irq_delay_ns);
+    }
+}
+
+static void rx_irq_timer(void *opaque)
+{
+    NvNetState *s = opaque;
+
+    if (s->rx_irq_pending) {
+        raise_rx_irq(s);
+    }
+}
+
+/*
+ * Delivers packets the net layer queued while the RX ring was full, as
+ * many as there are free descriptors, behind a single RX interrupt.
+ */
+static void flush_rx_queue(NvNetState *s)
+{
+    uint64_t rx_ring_full = s->stats.rx_ring_full;
+
+    s->rx_batch = true;
+    qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    s->rx_batch = false;
+
+    if (s->stats.rx_ring_full == rx_ring_full) {
+        /* Everything queued was delivered */
+        s->rx_stall_start = 0;
+    }
+
+    if (s->rx_irq_pending) {
+        raise_rx_irq(s);
+    }
+}
+
 static ssize_t dma_packet_to_guest(NvNetState *s, const uint8_t *buf,
                                    size_t size)
 {
     PCIDevice *d = PCI_DEVICE(s);
-    NetClientState *nc = qemu_get_queue(s->nic);
     ssize_t rval;
 
-    if (!nvnet_can_receive(nc)) {
+    if (!rx_enabled(s) || !dma_enabled(s) || !link_up(s)) {
         return -1;
     }
 
@@ -427,14 +515,19 @@ static ssize_t dma_packet_to_guest(NvNetState *s, const uint8_t *buf,
         desc.flags = NV_RX_BIT4 | NV_RX_DESCRIPTORVALID;
         store_ring_desc(s, cur_desc_addr, desc);
 
-        set_intr_status(s, NVNET_IRQ_STATUS_RX);
+        raise_rx_irq(s);
 
         advance_next_rx_ring_desc_addr(s);
 
         rval = size;
     } else {
+        /* Stays queued until the driver returns buffers */
         NVNET_DPRINTF("Could not find free buffer!\n");
-        rval = -1;
+        s->stats.rx_ring_full++;
+        if (!s->rx_stall_start) {
+            s->rx_stall_start = get_clock();
+        }
+        rval = 0;
     }
 
     set_dma_idle(s, true);
@@ -477,78 +570,161 @@ static uint32_t update_current_tx_ring_desc_addr(NvNetState *s)
     return cur_desc_addr;
 }
 
-static void advance_next_tx_ring_desc_addr(NvNetState *s)
+static uint32_t next_tx_ring_desc_addr(NvNetState *s, uint32_t desc_addr)
 {
     uint32_t base_desc_addr = get_reg(s, NVNET_TX_RING_PHYS_ADDR);
     uint32_t max_desc_addr =
         base_desc_addr + get_tx_ring_size(s) * sizeof(struct RingDesc);
-    uint32_t cur_desc_addr = get_reg(s, NVNET_TX_RING_CURRENT_DESC_PHYS_ADDR);
 
-    uint32_t next_desc_addr = cur_desc_addr + sizeof(struct RingDesc);
+    uint32_t next_desc_addr = desc_addr + sizeof(struct RingDesc);
     if (next_desc_addr >= max_desc_addr) {
         next_desc_addr = base_desc_addr;
     }
-    set_reg(s, NVNET_TX_RING_NEXT_DESC_PHYS_ADDR, next_desc_addr);
+    return next_desc_addr;
 }
 
-static void dma_packet_from_guest(NvNetState *s)
+static void advance_next_tx_ring_desc_addr(NvNetState *s)
 {
-    PCIDevice *d = PCI_DEVICE(s);
-    bool packet_sent = false;
-
-    if (!can_transmit(s)) {
-        return;
-    }
-
-    set_dma_idle(s, false);
+    uint32_t cur_desc_addr = get_reg(s, NVNET_TX_RING_CURRENT_DESC_PHYS_ADDR);
+    set_reg(s, NVNET_TX_RING_NEXT_DESC_PHYS_ADDR,
+            next_tx_ring_desc_addr(s, cur_desc_addr));
+}
 
+/*
+ * Counts the descriptors of the packet starting at the current TX ring
+ * position, returns 0 if the guest has not finished queueing it yet.
+ */
+static int get_tx_packet_num_descs(NvNetState *s, int max_descs)
+{
     uint32_t base_desc_addr = get_reg(s, NVNET_TX_RING_PHYS_ADDR);
+    uint32_t desc_addr = update_current_tx_ring_desc_addr(s);
 
-    for (int i = 0; i < get_tx_ring_size(s); i++) {
-        uint32_t cur_desc_addr = update_current_tx_ring_desc_addr(s);
-        struct RingDesc desc = load_ring_desc(s, cur_desc_addr);
-        uint16_t length = desc.length + 1;
+    for (int i = 0; i < max_descs; i++) {
+        struct RingDesc desc = load_ring_desc(s, desc_addr);
 
         NVNET_DPRINTF("TX: Looking at ring desc %zd (%x): "
                       "Buffer: 0x%x, Length: 0x%x, Flags: 0x%x\n",
-                      (cur_desc_addr - base_desc_addr) /
-                          sizeof(struct RingDesc),
-                      cur_desc_addr, desc.buffer_addr, length, desc.flags);
+                      (desc_addr - base_desc_addr) / sizeof(struct RingDesc),
+                      desc_addr, desc.buffer_addr, desc.length + 1,
+                      desc.flags);
 
         if (!(desc.flags & NV_TX_VALID)) {
-            break;
+            return 0;
         }
+        if (desc.flags & NV_TX_LASTPACKET) {
+            return i + 1;
+        }
+        desc_addr = next_tx_ring_desc_addr(s, desc_addr);
+    }
 
-        assert((s->tx_dma_buf_offset + length) <= sizeof(s->tx_dma_buf));
+    return 0;
+}
+
+/*
+ * Sends the packet made of the buffers of the `num_descs` descriptors
+ * starting at `desc_addr`. The buffers are mapped and handed to the net
+ * layer in place, if any of them cannot be, or there are too many, they are
+ * copied into tx_dma_buf instead.
+ */
+static void send_tx_packet(NvNetState *s, uint32_t desc_addr, int num_descs)
+{
+    PCIDevice *d = PCI_DEVICE(s);
+    NetClientState *nc = qemu_get_queue(s->nic);
+    struct iovec iov[NVNET_TX_MAX_FRAGS];
+    bool in_place = num_descs <= NVNET_TX_MAX_FRAGS;
+    int mapped = 0;
+    size_t size = 0;
+
+    for (uint32_t addr = desc_addr; in_place && mapped < num_descs;) {
+        struct RingDesc desc = load_ring_desc(s, addr);
+        dma_addr_t length = desc.length + 1;
 
         trace_nvnet_tx_dma(desc.buffer_addr, length);
-        pci_dma_read(d, desc.buffer_addr, &s->tx_dma_buf[s->tx_dma_buf_offset],
-                     length);
-        s->tx_dma_buf_offset += length;
-
-        bool is_last_packet = desc.flags & NV_TX_LASTPACKET;
-        if (is_last_packet) {
-            send_packet(s, s->tx_dma_buf, s->tx_dma_buf_offset);
-            s->tx_dma_buf_offset = 0;
-            packet_sent = true;
+        void *buf = pci_dma_map(d, desc.buffer_addr, &length,
+                                DMA_DIRECTION_TO_DEVICE);
+        if (!buf) {
+            in_place = false;
+            break;
         }
+        iov[mapped++] = (struct iovec){ .iov_base = buf, .iov_len = length };
+        in_place = length == desc.length + 1;
+        size += length;
+        addr = next_tx_ring_desc_addr(s, addr);
+    }
 
-        desc.flags &= ~(NV_TX_VALID | NV_TX_RETRYERROR | NV_TX_DEFERRED |
-                        NV_TX_CARRIERLOST | NV_TX_LATECOLLISION |
-                        NV_TX_UNDERFLOW | NV_TX_ERROR);
-        store_ring_desc(s, cur_desc_addr, desc);
+    if (in_place) {
+        trace_nvnet_packet_tx(size);
+        qemu_sendv_packet(nc, iov, mapped);
+    } else {
+        s->stats.tx_bounced++;
+        size = 0;
+        for (int i = 0; i < num_descs; i++) {
+            struct RingDesc desc = load_ring_desc(s, desc_addr);
+            uint16_t length = desc.length + 1;
+
+            assert((size + length) <= sizeof(s->tx_dma_buf));
+            pci_dma_read(d, desc.buffer_addr, &s->tx_dma_buf[size], length);
+            size += length;
+            desc_addr = next_tx_ring_desc_addr(s, desc_addr);
+        }
+        send_packet(s, s->tx_dma_buf, size);
+    }
 
-        advance_next_tx_ring_desc_addr(s);
+    s->stats.tx_packets++;
+    s->stats.tx_bytes += size;
 
-        if (is_last_packet) {
-            // FIXME
+    for (int i = 0; i < mapped; i++) {
+        pci_dma_unmap(d, iov[i].iov_base, iov[i].iov_len,
+                      DMA_DIRECTION_TO_DEVICE, iov[i].iov_len);
+    }
+}
+
+/*
+ * Transmits every complete packet queued in the TX ring. Descriptors of a
+ * packet are only handed back once all of it has been queued and sent. The
+ * TX interrupt is raised once for the whole batch.
+ */
+static void dma_packet_from_guest(NvNetState *s)
+{
+    int64_t kick_time = get_clock();
+    int packets_sent = 0;
+
+    s->stats.tx_kicks++;
+
+    if (!can_transmit(s)) {
+        return;
+    }
+
+    set_dma_idle(s, false);
+
+    int ring_size = get_tx_ring_size(s);
+    for (int i = 0; i < ring_size;) {
+        int num_descs = get_tx_packet_num_descs(s, ring_size - i);
+        if (!num_descs) {
             break;
         }
+
+        send_tx_packet(s, get_reg(s, NVNET_TX_RING_CURRENT_DESC_PHYS_ADDR),
+                       num_descs);
+        hist_add(&s->stats.tx_delay_us, (get_clock() - kick_time) / SCALE_US);
+        packets_sent++;
+
+        for (int j = 0; j < num_descs; j++) {
+            uint32_t cur_desc_addr = update_current_tx_ring_desc_addr(s);
+            struct RingDesc desc = load_ring_desc(s, cur_desc_addr);
+            desc.flags &= ~(NV_TX_VALID | NV_TX_RETRYERROR | NV_TX_DEFERRED |
+                            NV_TX_CARRIERLOST | NV_TX_LATECOLLISION |
+                            NV_TX_UNDERFLOW | NV_TX_ERROR);
+            store_ring_desc(s, cur_desc_addr, desc);
+            advance_next_tx_ring_desc_addr(s);
+        }
+        i += num_descs;
     }
 
     set_dma_idle(s, true);
 
-    if (packet_sent) {
+    if (packets_sent) {
+        hist_add(&s->stats.tx_batch, packets_sent);
         set_intr_status(s, NVNET_IRQ_STATUS_TX);
     }
 }
@@ -558,52 +734,68 @@ static bool is_packet_oversized(size_t size)
     return size > RX_ALLOC_BUFSIZE;
 }
 
-static bool receive_filter(NvNetState *s, const uint8_t *buf, int size)
+/* Packs a MAC address, in frame byte order, into the low 48 bits */
+static uint64_t mac_to_u64(const uint8_t *mac)
 {
-    if (size < 6) {
-        return false;
-    }
+    return ldl_le_p(mac) | ((uint64_t)lduw_le_p(mac + 4) << 32);
+}
+
+static uint64_t mac_regs_to_u64(NvNetState *s, hwaddr reg_a, hwaddr reg_b)
+{
+    return get_reg(s, reg_a) | ((uint64_t)(get_reg(s, reg_b) & 0xffff) << 32);
+}
+
+/* Recomputes rx_filter after a write to one of the registers it is from */
+static void update_rx_filter(NvNetState *s)
+{
+    NvNetRxFilter *f = &s->rx_filter;
+
+    /* FIXME: Confirm PFF_MYADDR filters mcast */
+    f->accept_all =
+        !(get_reg(s, NVNET_PACKET_FILTER) & NVNET_PACKET_FILTER_MYADDR);
+    f->mac = mac_regs_to_u64(s, NVNET_MAC_ADDR_A, NVNET_MAC_ADDR_B);
+    f->mcast_addr =
+        mac_regs_to_u64(s, NVNET_MULTICAST_ADDR_A, NVNET_MULTICAST_ADDR_B);
+    f->mcast_mask =
+        mac_regs_to_u64(s, NVNET_MULTICAST_MASK_A, NVNET_MULTICAST_MASK_B);
+    f->mcast = f->mcast_addr != MAKE_64BIT_MASK(0, 48);
+}
 
-    uint32_t rctl = get_reg(s, NVNET_PACKET_FILTER);
+static bool receive_filter(NvNetState *s, const uint8_t *dest)
+{
+    const NvNetRxFilter *f = &s->rx_filter;
+    uint64_t addr = mac_to_u64(dest);
 
     /* Broadcast */
-    if (is_broadcast_ether_addr(buf)) {
+    if (addr == MAKE_64BIT_MASK(0, 48)) {
         /* FIXME: bcast filtering */
         trace_nvnet_rx_filter_bcast_match();
         return true;
     }
 
-    if (!(rctl & NVNET_PACKET_FILTER_MYADDR)) {
-        /* FIXME: Confirm PFF_MYADDR filters mcast */
+    if (f->accept_all) {
         return true;
     }
 
     /* Multicast */
-    uint32_t addr[2];
-    addr[0] = cpu_to_le32(get_reg(s, NVNET_MULTICAST_ADDR_A));
-    addr[1] = cpu_to_le32(get_reg(s, NVNET_MULTICAST_ADDR_B));
-    if (!is_broadcast_ether_addr((uint8_t *)addr)) {
-        uint32_t dest_addr[2];
-        memcpy(dest_addr, buf, 6);
-        dest_addr[0] &= cpu_to_le32(get_reg(s, NVNET_MULTICAST_MASK_A));
-        dest_addr[1] &= cpu_to_le32(get_reg(s, NVNET_MULTICAST_MASK_B));
-
-        if (!memcmp(dest_addr, addr, 6)) {
-            trace_nvnet_rx_filter_mcast_match(MAC_ARG(dest_addr));
+    if (f->mcast) {
+        uint8_t masked[8];
+        stq_le_p(masked, addr & f->mcast_mask);
+
+        if ((addr & f->mcast_mask) == f->mcast_addr) {
+            trace_nvnet_rx_filter_mcast_match(MAC_ARG(masked));
             return true;
         } else {
-            trace_nvnet_rx_filter_mcast_mismatch(MAC_ARG(dest_addr));
+            trace_nvnet_rx_filter_mcast_mismatch(MAC_ARG(masked));
         }
     }
 
     /* Unicast */
-    addr[0] = cpu_to_le32(get_reg(s, NVNET_MAC_ADDR_A));
-    addr[1] = cpu_to_le32(get_reg(s, NVNET_MAC_ADDR_B));
-    if (!memcmp(buf, addr, 6)) {
-        trace_nvnet_rx_filter_ucast_match(MAC_ARG(buf));
+    if (addr == f->mac) {
+        trace_nvnet_rx_filter_ucast_match(MAC_ARG(dest));
         return true;
     } else {
-        trace_nvnet_rx_filter_ucast_mismatch(MAC_ARG(buf));
+        trace_nvnet_rx_filter_ucast_mismatch(MAC_ARG(dest));
     }
 
     return false;
@@ -614,20 +806,38 @@ static ssize_t nvnet_receive_iov(NetClientState *nc, const struct iovec *iov,
 {
     NvNetState *s = qemu_get_nic_opaque(nc);
     size_t size = iov_size(iov, iovcnt);
+    int64_t start = get_clock();
+    uint8_t dest[ETH_ALEN];
+    ssize_t rval;
 
     if (is_packet_oversized(size)) {
+        s->stats.rx_oversized++;
         trace_nvnet_rx_oversized(size);
         return size;
     }
 
-    iov_to_buf(iov, iovcnt, 0, s->rx_dma_buf, size);
-
-    if (!receive_filter(s, s->rx_dma_buf, size)) {
+    /* Most frames on a bridged LAN are not ours, check before copying */
+    if (iov_to_buf(iov, iovcnt, 0, dest, sizeof(dest)) < sizeof(dest) ||
+        !receive_filter(s, dest)) {
+        s->stats.rx_filter_dropped++;
         trace_nvnet_rx_filter_dropped();
         return size;
     }
 
-    return dma_packet_to_guest(s, s->rx_dma_buf, size);
+    iov_to_buf(iov, iovcnt, 0, s->rx_dma_buf, size);
+
+    rval = dma_packet_to_guest(s, s->rx_dma_buf, size);
+    if (rval > 0) {
+        /* Queued packets have waited at least since the ring filled up */
+        if (s->rx_batch && s->rx_stall_start) {
+            start = s->rx_stall_start;
+        }
+        s->stats.rx_packets++;
+        s->stats.rx_bytes += size;
+        hist_add(&s->stats.rx_delay_us, (get_clock() - start) / SCALE_US);
+    }
+
+    return rval;
 }
 
 static ssize_t nvnet_receive(NetClientState *nc, const uint8_t *buf,
@@ -839,11 +1049,11 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr, uint64_t val,
         if (val & NVNET_TX_RX_CONTROL_KICK) {
             dump_ring_descriptors(s);
             dma_packet_from_guest(s);
+            flush_rx_queue(s);
         }
 
         if (val & NVNET_TX_RX_CONTROL_RESET) {
             reset_descriptor_ring_pointers(s);
-            s->tx_dma_buf_offset = 0;
         }
 
         if (val & NVNET_TX_RX_CONTROL_BIT1) {
@@ -861,6 +1071,10 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr, uint64_t val,
     case NVNET_MII_STATUS:
         set_reg_ext(s, addr, get_reg_ext(s, addr, size) & ~val, size);
         update_irq(s);
+        if (addr == NVNET_IRQ_STATUS && (val & NVNET_IRQ_STATUS_RX)) {
+            /* The driver has taken packets and returned their buffers */
+            flush_rx_queue(s);
+        }
         break;
 
     case NVNET_IRQ_MASK:
@@ -868,6 +1082,17 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr, uint64_t val,
         update_irq(s);
         break;
 
+    case NVNET_PACKET_FILTER:
+    case NVNET_MAC_ADDR_A:
+    case NVNET_MAC_ADDR_B:
+    case NVNET_MULTICAST_ADDR_A:
+    case NVNET_MULTICAST_ADDR_B:
+    case NVNET_MULTICAST_MASK_A:
+    case NVNET_MULTICAST_MASK_B:
+        set_reg_ext(s, addr, val, size);
+        update_rx_filter(s);
+        break;
+
     default:
         set_reg_ext(s, addr, val, size);
         break;
@@ -921,6 +1146,14 @@ static void nvnet_realize(PCIDevice *pci_dev, Error **errp)
                           &dev->mem_reentrancy_guard, s);
 
     s->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, autoneg_timer, s);
+
+    s->rx_irq_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, rx_irq_timer, s);
+    s->rx_irq_delay_ns =
+        (int64_t)MAX(g_config.net.rx_irq_delay_us, 0) * SCALE_US;
+
+    object_property_add_uint64_ptr(OBJECT(s), "rx-filter-dropped",
+                                   &s->stats.rx_filter_dropped,
+                                   OBJ_PROP_FLAG_READ);
 }
 
 static void nvnet_uninit(PCIDevice *dev)
@@ -928,6 +1161,7 @@ static void nvnet_uninit(PCIDevice *dev)
     NvNetState *s = NVNET(dev);
     qemu_del_nic(s->nic);
     timer_free(s->autoneg_timer);
+    timer_free(s->rx_irq_timer);
 }
 
 // clang-format off
@@ -971,11 +1205,14 @@ static void nvnet_reset(void *opaque)
     or_reg(s, NVNET_TX_RX_CONTROL, NVNET_TX_RX_CONTROL_IDLE);
 
     reset_phy_regs(s);
+    update_rx_filter(s);
     memset(&s->tx_dma_buf, 0, sizeof(s->tx_dma_buf));
     memset(&s->rx_dma_buf, 0, sizeof(s->rx_dma_buf));
-    s->tx_dma_buf_offset = 0;
 
     timer_del(s->autoneg_timer);
+    timer_del(s->rx_irq_timer);
+    s->rx_irq_pending = false;
+    s->rx_stall_start = 0;
 
     if (qemu_get_queue(s->nic)->link_down) {
         update_regs_on_link_down(s);
@@ -1016,6 +1253,8 @@ static int nvnet_post_load(void *opaque, int version_id)
         s->rx_ring_index = 0;
     }
 
+    update_rx_filter(s);
+
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in PHY regs.
      * Alternatively, restart link negotiation if it was in progress. */
@@ -1029,10 +1268,25 @@ static int nvnet_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static int nvnet_pre_save(void *opaque)
+{
+    NvNetState *s = NVNET(opaque);
+
+    /* The moderation timer is not migrated, raise what it held back */
+    if (s->rx_irq_pending) {
+        s->rx_irq_pending = false;
+        timer_del(s->rx_irq_timer);
+        set_intr_status(s, NVNET_IRQ_STATUS_RX);
+    }
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_nvnet = {
     .name = "nvnet",
     .version_id = 2,
     .minimum_version_id = 1,
+    .pre_save = nvnet_pre_save,
     .post_load = nvnet_post_load,
     // clang-format off
     .fields = (VMStateField[]){
@@ -1085,9 +1339,130 @@ static const TypeInfo nvnet_info = {
         },
 };
 
+static NvNetState *nvnet_find(void)
+{
+    return (NvNetState *)object_resolve_path_type("", TYPE_NVNET, NULL);
+}
+
+static int count_ring_descs(NvNetState *s, uint32_t base_desc_addr,
+                            int ring_size, uint16_t flag)
+{
+    int count = 0;
+
+    for (int i = 0; i < ring_size; i++) {
+        struct RingDesc desc =
+            load_ring_desc(s, base_desc_addr + i * sizeof(struct RingDesc));
+        if (desc.flags & flag) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+bool nvnet_get_stats(NvNetStats *stats)
+{
+    NvNetState *s = nvnet_find();
+
+    if (!s) {
+        return false;
+    }
+
+    *stats = s->stats;
+
+    stats->tx_ring_size = get_tx_ring_size(s);
+    stats->rx_ring_size = get_rx_ring_size(s);
+    if (dma_enabled(s)) {
+        stats->tx_ring_pending =
+            count_ring_descs(s, get_reg(s, NVNET_TX_RING_PHYS_ADDR),
+                             stats->tx_ring_size, NV_TX_VALID);
+        stats->rx_ring_free =
+            count_ring_descs(s, get_reg(s, NVNET_RX_RING_PHYS_ADDR),
+                             stats->rx_ring_size, NV_RX_AVAIL);
+    }
+
+    return true;
+}
+
+void nvnet_reset_stats(void)
+{
+    NvNetState *s = nvnet_find();
+
+    if (s) {
+        memset(&s->stats, 0, sizeof(s->stats));
+    }
+}
+
+static void format_hist(GString *buf, const char *name, const char *unit,
+                        const NvNetHistogram *h)
+{
+    g_string_append_printf(buf, "%s: %" PRIu64 " samples", name, h->count);
+    if (!h->count) {
+        g_string_append_c(buf, '\n');
+        return;
+    }
+
+    g_string_append_printf(buf, ", avg %.1f %s, max %" PRIu64 " %s\n",
+                           (double)h->total / h->count, unit, h->max, unit);
+    for (int i = 0; i < NVNET_HIST_BUCKETS; i++) {
+        if (!h->buckets[i]) {
+            continue;
+        }
+        /* Each bucket is listed by its lower bound */
+        uint64_t lower = i ? UINT64_C(1) << (i - 1) : 0;
+        g_string_append_printf(buf, "  %8" PRIu64 "%s %s: %" PRIu64 "\n",
+                               lower, i == NVNET_HIST_BUCKETS - 1 ? "+" : "",
+                               unit, h->buckets[i]);
+    }
+}
+
+HumanReadableText *qmp_x_query_nvnet_stats(Error **errp)
+{
+    NvNetStats stats;
+
+    if (!nvnet_get_stats(&stats)) {
+        error_setg(errp, "No nForce ethernet controller present");
+        return NULL;
+    }
+
+    g_autoptr(GString) buf = g_string_new(NULL);
+    g_string_append_printf(buf,
+                           "TX: %" PRIu64 " packets, %" PRIu64 " bytes, "
+                           "%" PRIu64 " kicks, %" PRIu64 " bounced\n",
+                           stats.tx_packets, stats.tx_bytes, stats.tx_kicks,
+                           stats.tx_bounced);
+    g_string_append_printf(buf,
+                           "RX: %" PRIu64 " packets, %" PRIu64 " bytes, "
+                           "%" PRIu64 " irqs, %" PRIu64 " filtered, "
+                           "%" PRIu64 " oversized, %" PRIu64 " ring full\n",
+                           stats.rx_packets, stats.rx_bytes, stats.rx_irqs,
+                           stats.rx_filter_dropped, stats.rx_oversized,
+                           stats.rx_ring_full);
+    g_string_append_printf(buf,
+                           "TX ring: %d/%d pending, RX ring: %d/%d free\n",
+                           stats.tx_ring_pending, stats.tx_ring_size,
+                           stats.rx_ring_free, stats.rx_ring_size);
+    format_hist(buf, "TX kick to send", "us", &stats.tx_delay_us);
+    format_hist(buf, "RX receive to DMA", "us", &stats.rx_delay_us);
+    format_hist(buf, "TX packets per kick", "pkts", &stats.tx_batch);
+
+    return human_readable_text_from_str(buf);
+}
+
+void qmp_x_nvnet_reset_stats(Error **errp)
+{
+    if (!nvnet_find()) {
+        error_setg(errp, "No nForce ethernet controller present");
+        return;
+    }
+
+    nvnet_reset_stats();
+}
+
 static void nvnet_register(void)
 {
     type_register_static(&nvnet_info);
+    monitor_register_hmp_info_hrt("nvnet-stats", qmp_x_query_nvnet_stats);
 }
 
 type_init(nvnet_register)
@@ -0,0 +1,72 @@
+/*
+ * QEMU nForce Ethernet Controller statistics
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_MCPX_NVNET_DEBUG_H
+#define HW_XBOX_MCPX_NVNET_DEBUG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bucket 0 counts values of 0, bucket i values in [2^(i-1), 2^i), the last
+ * bucket everything larger.
+ */
+#define NVNET_HIST_BUCKETS 16
+
+typedef struct NvNetHistogram {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[NVNET_HIST_BUCKETS];
+} NvNetHistogram;
+
+typedef struct NvNetStats {
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_kicks;
+    uint64_t tx_bounced; /* copied rather than sent in place */
+
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_irqs;
+    uint64_t rx_oversized;
+    uint64_t rx_filter_dropped;
+    uint64_t rx_ring_full; /* packets left queued, no free descriptor */
+
+    NvNetHistogram tx_delay_us; /* guest TX kick to host send */
+    NvNetHistogram rx_delay_us; /* host receive to guest RX DMA */
+    NvNetHistogram tx_batch;    /* packets sent per TX kick */
+
+    /* Ring occupancy, sampled when the stats are read */
+    int tx_ring_size, tx_ring_pending; /* descriptors owned by the NIC */
+    int rx_ring_size, rx_ring_free;
+} NvNetStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool nvnet_get_stats(NvNetStats *stats);
+void nvnet_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -72,6 +72,7 @@
     _X(NV2A_PROF_FINISH_VERTEX_BUFFER_DIRTY) \
     _X(NV2A_PROF_FINISH_SURFACE_CREATE) \
     _X(NV2A_PROF_FINISH_SURFACE_DOWN) \
+    _X(NV2A_PROF_FINISH_SURFACE_READ) \
     _X(NV2A_PROF_FINISH_NEED_BUFFER_SPACE) \
     _X(NV2A_PROF_FINISH_FRAMEBUFFER_DIRTY) \
     _X(NV2A_PROF_FINISH_PRESENTING) \
@@ -79,41 +80,71 @@
     _X(NV2A_PROF_FINISH_FLUSH) \
     _X(NV2A_PROF_FINISH_STALLED) \
     _X(NV2A_PROF_CLEAR) \
+    _X(NV2A_PROF_CLEAR_LOAD_OP) \
     _X(NV2A_PROF_QUEUE_SUBMIT) \
     _X(NV2A_PROF_QUEUE_SUBMIT_AUX) \
+    _X(NV2A_PROF_QUEUE_SUBMIT_TRANSFER) \
+    _X(NV2A_PROF_FRAME_WAIT) \
+    _X(NV2A_PROF_TIMELINE_WAIT) \
+    _X(NV2A_PROF_BUFFER_RING_WAIT) \
+    _X(NV2A_PROF_BUFFER_RING_GROW) \
     _X(NV2A_PROF_PIPELINE_NOTDIRTY) \
     _X(NV2A_PROF_PIPELINE_GEN) \
+    _X(NV2A_PROF_PIPELINE_PRECOMPILED) \
     _X(NV2A_PROF_PIPELINE_BIND) \
     _X(NV2A_PROF_PIPELINE_RENDERPASSES) \
+    _X(NV2A_PROF_FRAMEBUFFER_GEN) \
+    _X(NV2A_PROF_RECORD_BATCH) \
+    _X(NV2A_PROF_RECORD_WAIT) \
+    _X(NV2A_PROF_RESIDENCY_EVICT) \
+    _X(NV2A_PROF_IMAGE_RECYCLED) \
+    _X(NV2A_PROF_IMAGE_UNPOOLED) \
     _X(NV2A_PROF_BEGIN_ENDS) \
+    _X(NV2A_PROF_BEGIN_ENDS_MERGED) \
     _X(NV2A_PROF_DRAW_ARRAYS) \
     _X(NV2A_PROF_INLINE_BUFFERS) \
     _X(NV2A_PROF_INLINE_ARRAYS) \
+    _X(NV2A_PROF_INLINE_ARRAYS_CPU_VSH) \
     _X(NV2A_PROF_INLINE_ELEMENTS) \
     _X(NV2A_PROF_QUERY) \
     _X(NV2A_PROF_SHADER_GEN) \
+    _X(NV2A_PROF_SHADER_NOT_READY) \
     _X(NV2A_PROF_SHADER_BIND) \
     _X(NV2A_PROF_SHADER_BIND_NOTDIRTY) \
     _X(NV2A_PROF_SHADER_UBO_DIRTY) \
     _X(NV2A_PROF_SHADER_UBO_NOTDIRTY) \
+    _X(NV2A_PROF_DESCRIPTOR_SET_REUSED) \
+    _X(NV2A_PROF_BINDLESS_TEXTURE_WRITE) \
     _X(NV2A_PROF_ATTR_BIND) \
+    _X(NV2A_PROF_VERTEX_ARRAY_CREATE) \
+    _X(NV2A_PROF_GL_STATE_CHANGED) \
+    _X(NV2A_PROF_GL_STATE_REDUNDANT) \
     _X(NV2A_PROF_TEX_UPLOAD) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_1) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_2) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_3) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_4) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY) \
+    _X(NV2A_PROF_GEOM_BUFFER_STREAMED) \
     _X(NV2A_PROF_SURF_SWIZZLE) \
     _X(NV2A_PROF_SURF_CREATE) \
     _X(NV2A_PROF_SURF_DOWNLOAD) \
+    _X(NV2A_PROF_SURF_DOWNLOAD_EARLY) \
+    _X(NV2A_PROF_SURF_DOWNLOAD_HOST_PACK) \
+    _X(NV2A_PROF_SURF_DOWNLOAD_READBACK) \
     _X(NV2A_PROF_SURF_UPLOAD) \
+    _X(NV2A_PROF_SURF_UPLOAD_SKIPPED) \
+    _X(NV2A_PROF_SURF_REINTERPRET) \
     _X(NV2A_PROF_SURF_TO_TEX) \
     _X(NV2A_PROF_SURF_TO_TEX_FALLBACK) \
+    _X(NV2A_PROF_DISPLAY_INTEROP) \
+    _X(NV2A_PROF_DISPLAY_VGA_FALLBACK) \
     _X(NV2A_PROF_QUEUE_SUBMIT_1) \
     _X(NV2A_PROF_QUEUE_SUBMIT_2) \
     _X(NV2A_PROF_QUEUE_SUBMIT_3) \
     _X(NV2A_PROF_QUEUE_SUBMIT_4) \
     _X(NV2A_PROF_QUEUE_SUBMIT_5) \
+    _X(NV2A_PROF_POLL_SLEEP) \
 
 enum NV2A_PROF_COUNTERS_ENUM {
     #define _X(x) x,
@@ -122,6 +153,109 @@ enum NV2A_PROF_COUNTERS_ENUM {
     NV2A_PROF__COUNT
 };
 
+/*
+ * GPU time is measured with timestamps by renderers which support it, per
+ * kind of work and per command buffer, which are attributed to the reason
+ * they were submitted for.
+ */
+#define NV2A_PROF_GPU_TIMERS_XMAC \
+    _X(NV2A_PROF_GPU_RENDER_PASS) \
+    _X(NV2A_PROF_GPU_COMPUTE) \
+    _X(NV2A_PROF_GPU_BLIT) \
+    _X(NV2A_PROF_GPU_DISPLAY) \
+    _X(NV2A_PROF_GPU_SUBMIT_SINGLE_TIME) \
+    _X(NV2A_PROF_GPU_SUBMIT_VERTEX_BUFFER_DIRTY) \
+    _X(NV2A_PROF_GPU_SUBMIT_SURFACE_CREATE) \
+    _X(NV2A_PROF_GPU_SUBMIT_SURFACE_DOWN) \
+    _X(NV2A_PROF_GPU_SUBMIT_SURFACE_READ) \
+    _X(NV2A_PROF_GPU_SUBMIT_NEED_BUFFER_SPACE) \
+    _X(NV2A_PROF_GPU_SUBMIT_FRAMEBUFFER_DIRTY) \
+    _X(NV2A_PROF_GPU_SUBMIT_PRESENTING) \
+    _X(NV2A_PROF_GPU_SUBMIT_FLIP_STALL) \
+    _X(NV2A_PROF_GPU_SUBMIT_FLUSH) \
+    _X(NV2A_PROF_GPU_SUBMIT_STALLED) \
+
+enum NV2A_PROF_GPU_TIMERS_ENUM {
+    #define _X(x) x,
+    NV2A_PROF_GPU_TIMERS_XMAC
+    #undef _X
+    NV2A_PROF_GPU__COUNT
+};
+
+/*
+ * Host time spent on work that commonly causes hitches, on whichever thread
+ * did it.
+ */
+#define NV2A_PROF_CPU_TIMERS_XMAC \
+    _X(NV2A_PROF_CPU_SHADER_GEN) \
+    _X(NV2A_PROF_CPU_SHADER_COMPILE) \
+    _X(NV2A_PROF_CPU_PIPELINE_CREATE) \
+    _X(NV2A_PROF_CPU_TEX_UPLOAD) \
+    _X(NV2A_PROF_CPU_SURF_DOWNLOAD) \
+
+enum NV2A_PROF_CPU_TIMERS_ENUM {
+    #define _X(x) x,
+    NV2A_PROF_CPU_TIMERS_XMAC
+    #undef _X
+    NV2A_PROF_CPU__COUNT
+};
+
+/* Renderer caches whose occupancy and hit rate are reported */
+#define NV2A_PROF_CACHES_XMAC \
+    _X(NV2A_PROF_CACHE_TEXTURE) \
+    _X(NV2A_PROF_CACHE_SHADER) \
+    _X(NV2A_PROF_CACHE_PIPELINE) \
+    _X(NV2A_PROF_CACHE_SHADER_MODULE) \
+    _X(NV2A_PROF_CACHE_SAMPLER) \
+    _X(NV2A_PROF_CACHE_FRAMEBUFFER) \
+    _X(NV2A_PROF_CACHE_COMPUTE_PIPELINE) \
+    _X(NV2A_PROF_CACHE_ELEMENT) \
+    _X(NV2A_PROF_CACHE_VERTEX_ARRAY) \
+
+enum NV2A_PROF_CACHES_ENUM {
+    #define _X(x) x,
+    NV2A_PROF_CACHES_XMAC
+    #undef _X
+    NV2A_PROF_CACHE__COUNT
+};
+
+/* Draws, by how their vertices are specified */
+#define NV2A_PROF_DRAW_KINDS_XMAC \
+    _X(NV2A_PROF_DRAW_KIND_ARRAYS) \
+    _X(NV2A_PROF_DRAW_KIND_ELEMENTS) \
+    _X(NV2A_PROF_DRAW_KIND_INLINE_ARRAY) \
+    _X(NV2A_PROF_DRAW_KIND_INLINE_BUFFER) \
+
+enum NV2A_PROF_DRAW_KINDS_ENUM {
+    #define _X(x) x,
+    NV2A_PROF_DRAW_KINDS_XMAC
+    #undef _X
+    NV2A_PROF_DRAW_KIND__COUNT
+};
+
+/* Kelvin methods that change state, by the state they change */
+#define NV2A_PROF_STATE_XMAC \
+    _X(NV2A_PROF_STATE_SURFACE) \
+    _X(NV2A_PROF_STATE_TEXTURE) \
+    _X(NV2A_PROF_STATE_TRANSFORM) \
+    _X(NV2A_PROF_STATE_LIGHTING) \
+    _X(NV2A_PROF_STATE_COMBINER) \
+    _X(NV2A_PROF_STATE_VERTEX_ARRAY) \
+    _X(NV2A_PROF_STATE_RENDER) \
+
+enum NV2A_PROF_STATE_ENUM {
+    #define _X(x) x,
+    NV2A_PROF_STATE_XMAC
+    #undef _X
+    NV2A_PROF_STATE__COUNT
+};
+
+/* Indexed by PRIM_TYPE_*, PRIM_TYPE_INVALID is unused */
+#define NV2A_PROF_PRIM_TYPES 11
+
+/* As LRU_EVICTION_AGE_BUCKETS */
+#define NV2A_PROF_CACHE_AGE_BUCKETS 16
+
 #define NV2A_PROF_NUM_FRAMES 300
 
 typedef struct NV2AStats {
@@ -131,8 +265,37 @@ typedef struct NV2AStats {
     struct {
         int mspf;
         int counters[NV2A_PROF__COUNT];
+        int gpu_us; // Of all command buffers, 0 when not measured
+        int gpu_timers[NV2A_PROF_GPU__COUNT]; // In us
+        int cpu_timers[NV2A_PROF_CPU__COUNT]; // In us
+        struct {
+            int methods; // Words processed by PGRAPH
+            int pushbuffer_bytes; // Including commands and jumps
+            int draws[NV2A_PROF_DRAW_KIND__COUNT];
+            int draw_vertices[NV2A_PROF_DRAW_KIND__COUNT];
+            int prim_draws[NV2A_PROF_PRIM_TYPES];
+            int prim_vertices[NV2A_PROF_PRIM_TYPES];
+            int state_changes[NV2A_PROF_STATE__COUNT];
+        } stream;
     } frame_working, frame_history[NV2A_PROF_NUM_FRAMES];
     unsigned int frame_ptr;
+    struct {
+        uint64_t budget;
+        uint64_t usage;
+        uint64_t texture_bytes;
+        uint64_t surface_bytes;
+        uint64_t invalid_surface_bytes;
+        uint64_t allocation_bytes;
+        uint32_t allocations;
+    } vram; // Filled in by renderers that track device memory
+    struct {
+        int used;
+        int capacity; // 0 for caches the renderer does not have
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t eviction_age[NV2A_PROF_CACHE_AGE_BUCKETS];
+    } caches[NV2A_PROF_CACHE__COUNT]; // Filled in by renderers at each flip
 } NV2AStats;
 
 #ifdef __cplusplus
@@ -141,16 +304,70 @@ extern "C" {
 
 extern NV2AStats g_nv2a_stats;
 
+struct Lru;
+
+typedef struct NV2AProfMethod {
+    unsigned int graphics_class;
+    unsigned int method; // The first of a range, such as all texture stages
+    const char *name; // NULL if unknown
+    unsigned int calls;
+    unsigned int words;
+} NV2AProfMethod;
+
 const char *nv2a_profile_get_counter_name(unsigned int cnt);
 int nv2a_profile_get_counter_value(unsigned int cnt);
+const char *nv2a_profile_get_gpu_timer_name(unsigned int timer);
+int nv2a_profile_get_gpu_timer_value(unsigned int timer);
+const char *nv2a_profile_get_cpu_timer_name(unsigned int timer);
+int nv2a_profile_get_cpu_timer_value(unsigned int timer);
+const char *nv2a_profile_get_cache_name(unsigned int cache);
+void nv2a_profile_update_cache(enum NV2A_PROF_CACHES_ENUM cache,
+                               const struct Lru *lru);
 void nv2a_profile_increment(void);
 void nv2a_profile_flip_stall(void);
+const char *nv2a_profile_get_draw_kind_name(unsigned int kind);
+const char *nv2a_profile_get_state_name(unsigned int state);
+const char *nv2a_profile_get_prim_type_name(unsigned int prim_type);
+void nv2a_profile_method(unsigned int graphics_class, unsigned int method,
+                         int words);
+/* Called by the pusher, which may run on its own thread */
+void nv2a_profile_add_pushbuffer_bytes(int bytes);
+
+/*
+ * Fills methods with those that took the most words of the last frame, most
+ * first, and returns how many there are.
+ */
+int nv2a_profile_get_top_methods(NV2AProfMethod *methods, int max);
+
+/*
+ * Measures a CPU timer, which is also recorded as a zone of the timeline when
+ * that is being recorded.
+ */
+int64_t nv2a_profile_cpu_time_begin(void);
+void nv2a_profile_cpu_time_end(enum NV2A_PROF_CPU_TIMERS_ENUM timer,
+                               const char *detail, int64_t start);
+
+/* Summary of the last hitch not yet taken, free with g_free */
+char *nv2a_profile_take_hitch_summary(void);
 
 static inline void nv2a_profile_inc_counter(enum NV2A_PROF_COUNTERS_ENUM cnt)
 {
     g_nv2a_stats.frame_working.counters[cnt] += 1;
 }
 
+static inline void nv2a_profile_add_gpu_time(enum NV2A_PROF_GPU_TIMERS_ENUM timer,
+                                             int us)
+{
+    g_nv2a_stats.frame_working.gpu_timers[timer] += us;
+}
+
+void nv2a_dbg_capture_start(const char *path, Error **errp);
+void nv2a_dbg_capture_stop(void);
+bool nv2a_dbg_capture_active(void);
+extern const char *nv2a_dbg_replay_path;
+extern int nv2a_dbg_replay_loops;
+extern const char *nv2a_dbg_shader_dump_dir;
+
 #ifdef CONFIG_RENDERDOC
 void nv2a_dbg_renderdoc_init(void);
 void *nv2a_dbg_renderdoc_get_api(void);
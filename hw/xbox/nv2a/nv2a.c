@@ -21,6 +21,8 @@
 
 #include "hw/xbox/nv2a/nv2a_int.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread-stats.h"
+#include "ui/xemu-settings.h"
 
 void nv2a_update_irq(NV2AState *d)
 {
@@ -53,6 +55,63 @@ void nv2a_update_irq(NV2AState *d)
     }
 }
 
+/*
+ * While waiting for the GPU, drivers read status registers such as the DMA
+ * get pointer or the PGRAPH interrupt state in a tight loop. Once the same
+ * register has read back the same value for a while without pause, the vCPU
+ * is put to sleep briefly with the BQL released, giving the PFIFO thread and
+ * the timers that will change the value the host CPU instead.
+ *
+ * Register reads come from the single vCPU only, with or without the BQL.
+ */
+#define NV2A_POLL_GAP_NS 20000
+#define NV2A_POLL_THRESHOLD 64
+#define NV2A_POLL_SLEEP_US 100
+
+void nv2a_poll_throttle(NV2AState *d, int block, hwaddr addr, uint64_t val)
+{
+    if (!d->poll.throttle) {
+        return;
+    }
+
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    NV2APollEntry *e = NULL;
+
+    for (int i = 0; i < NV2A_POLL_TRACK_SIZE; i++) {
+        if (d->poll.entries[i].block == block &&
+            d->poll.entries[i].addr == addr) {
+            e = &d->poll.entries[i];
+            break;
+        }
+    }
+
+    if (!e) {
+        e = &d->poll.entries[d->poll.next];
+        d->poll.next = (d->poll.next + 1) % NV2A_POLL_TRACK_SIZE;
+        *e = (NV2APollEntry){ .block = block, .addr = addr, .val = val };
+    } else if (e->val != val || now - e->last_ns > NV2A_POLL_GAP_NS) {
+        e->val = val;
+        e->count = 0;
+    }
+    e->last_ns = now;
+
+    if (++e->count < NV2A_POLL_THRESHOLD) {
+        return;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_POLL_SLEEP);
+    if (bql_locked()) {
+        bql_unlock();
+        g_usleep(NV2A_POLL_SLEEP_US);
+        bql_lock();
+    } else {
+        g_usleep(NV2A_POLL_SLEEP_US);
+    }
+
+    /* The sleep itself must not count as a pause in polling */
+    e->last_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
 DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
 {
     assert(dma_obj_address < memory_region_size(&d->ramin));
@@ -85,6 +144,18 @@ void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
     return d->vram_ptr + dma.address;
 }
 
+/*
+ * Direct writes through nv_dma_map() bypass the dirty log, this marks them
+ * so that snapshots taken from it include them.
+ */
+void nv_dma_mark_written(NV2AState *d, const void *ptr, hwaddr len)
+{
+    hwaddr addr = (const uint8_t *)ptr - d->vram_ptr;
+
+    assert(addr + len <= memory_region_size(d->vram));
+    memory_region_set_client_dirty(d->vram, addr, len, DIRTY_MEMORY_SNAPSHOT);
+}
+
 hwaddr nv_clip_gpu_tile_blit(NV2AState *d, hwaddr blit_base_address, hwaddr len)
 {
     const uint32_t *regs = d->pfb.regs;
@@ -193,6 +264,11 @@ int nv2a_get_screen_off(void)
     return g_nv2a->vga.sr[VGA_SEQ_CLOCK_MODE] & VGA_SR01_SCREEN_OFF;
 }
 
+unsigned int nv2a_get_flip_count(void)
+{
+    return qatomic_read(&g_nv2a_stats.frame_count);
+}
+
 static void nv2a_vga_gfx_update(void *opaque)
 {
     VGACommonState *vga = opaque;
@@ -232,11 +308,31 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_TEX);
     memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
 
+    /* RAMHT lookups are cached until the guest writes to RAMIN */
+    memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A);
+
+    /* Only cleared while capturing, see pgraph/capture.c */
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_CAPTURE);
+    memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A_CAPTURE);
+
     pgraph_init(d);
 
+    if (nv2a_dbg_replay_path) {
+        pgraph_replay_init(d, nv2a_dbg_replay_path, nv2a_dbg_replay_loops,
+                           &error_fatal);
+    }
+
+    /* Read by the threads without synchronization, so set before they start */
+    d->poll.throttle = g_config.perf.throttle_gpu_polling;
+    d->pfifo.pipelined = g_config.perf.pipeline_pfifo;
+
     /* fire up pfifo */
     qemu_thread_create(&d->pfifo.thread, "nv2a.pfifo_thread",
                        pfifo_thread, d, QEMU_THREAD_JOINABLE);
+    if (d->pfifo.pipelined) {
+        qemu_thread_create(&d->pfifo.pusher_thread, "nv2a.pusher_thread",
+                           pfifo_pusher_thread, d, QEMU_THREAD_JOINABLE);
+    }
 }
 
 static void nv2a_init_vga(NV2AState *d)
@@ -298,7 +394,11 @@ static void nv2a_reset(NV2AState *d)
     }
 
     memset(d->pfifo.regs, 0, sizeof(d->pfifo.regs));
+    pfifo_reset_method_ring(d);
+    pfifo_invalidate_ramht_cache(d);
     memset(d->pgraph.regs_, 0, sizeof(d->pgraph.regs_));
+    pgraph_invalidate_ctx_switch(&d->pgraph);
+    pgraph_invalidate_zpass_report_cache(&d->pgraph);
     memset(d->pvideo.regs, 0, sizeof(d->pvideo.regs));
 
     d->pcrtc.start = 0;
@@ -328,6 +428,10 @@ static void nv2a_reset(NV2AState *d)
         d->puserdac.palette[i*3+2] = i;
     }
 
+    /* A capture can't follow the guest across a reset */
+    pgraph_capture_finalize(d);
+    pgraph_replay_reset(d);
+
     nv2a_unlock_fifo(d);
 }
 
@@ -353,7 +457,16 @@ static void nv2a_realize(PCIDevice *dev, Error **errp)
                                     &d->block_mmio[i]);
     }
 
+    /*
+     * Status polling and DMA_PUT doorbell writes are dispatched without the
+     * BQL, these handlers only take it for the writes that update the IRQ.
+     */
+    memory_region_clear_global_locking(&d->block_mmio[NV_PFIFO]);
+    memory_region_clear_global_locking(&d->block_mmio[NV_PGRAPH]);
+    memory_region_clear_global_locking(&d->block_mmio[NV_USER]);
+
     qemu_mutex_init(&d->pfifo.lock);
+    thread_stats_register_lock("pfifo", &d->pfifo.lock);
     qemu_cond_init(&d->pfifo.fifo_cond);
     qemu_cond_init(&d->pfifo.fifo_idle_cond);
 }
@@ -367,8 +480,13 @@ static void nv2a_exitfn(PCIDevice *dev)
 
     qemu_cond_broadcast(&d->pfifo.fifo_cond);
     qemu_thread_join(&d->pfifo.thread);
+    if (d->pfifo.pipelined) {
+        qemu_thread_join(&d->pfifo.pusher_thread);
+    }
 
+    pgraph_capture_finalize(d);
     pgraph_destroy(&d->pgraph);
+    thread_stats_unregister_lock(&d->pfifo.lock);
 }
 
 static void nv2a_reset_hold(Object *obj, ResetType type)
@@ -421,12 +539,22 @@ static int nv2a_pre_load(void *opaque)
 {
     NV2AState *d = opaque;
     nv2a_lock_fifo(d);
+    pfifo_reset_method_ring(d);
     return 0;
 }
 
 static int nv2a_post_load(void *opaque, int version_id)
 {
     NV2AState *d = opaque;
+    pfifo_invalidate_ramht_cache(d);
+    pgraph_invalidate_ctx_switch(&d->pgraph);
+    pgraph_invalidate_zpass_report_cache(&d->pgraph);
+    bitmap_fill(d->pgraph.regs_dirty,
+                ARRAY_SIZE(d->pgraph.regs_) / sizeof(uint32_t));
+    d->pgraph.program_data_dirty = true;
+    memset(d->pgraph.vsh_constants_dirty, 1,
+           sizeof(d->pgraph.vsh_constants_dirty));
+    qatomic_set(&d->pgraph.flush_revalidate, g_config.perf.warm_restore);
     qatomic_set(&d->pgraph.flush_pending, true);
     nv2a_unlock_fifo(d);
     return 0;
@@ -442,6 +570,27 @@ const VMStateDescription vmstate_nv2a_pgraph_vertex_attributes = {
     }
 };
 
+static bool nv2a_pfifo_method_ring_needed(void *opaque)
+{
+    NV2AState *d = opaque;
+    return d->pfifo.ring.head != d->pfifo.ring.tail;
+}
+
+static const VMStateDescription vmstate_nv2a_pfifo_method_ring = {
+    .name = "nv2a/pfifo-method-ring",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = nv2a_pfifo_method_ring_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(pfifo.ring.head, NV2AState),
+        VMSTATE_UINT32(pfifo.ring.tail, NV2AState),
+        VMSTATE_UINT32(pfifo.ring.head_progress, NV2AState),
+        VMSTATE_UINT32_ARRAY(pfifo.ring.words, NV2AState,
+                             PFIFO_METHOD_RING_SIZE),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_nv2a = {
     .name = "nv2a",
     .version_id = 3,
@@ -566,6 +715,10 @@ static const VMStateDescription vmstate_nv2a = {
         VMSTATE_BOOL(pgraph.waiting_for_context_switch, NV2AState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_nv2a_pfifo_method_ring,
+        NULL
+    },
 };
 
 static void nv2a_class_init(ObjectClass *klass, const void *data)
@@ -27,7 +27,9 @@ int nv2a_get_framebuffer_surface(void);
 void nv2a_release_framebuffer_surface(void);
 void nv2a_set_surface_scale_factor(unsigned int scale);
 unsigned int nv2a_get_surface_scale_factor(void);
+void nv2a_set_optimistic_zpass_reports(bool enabled);
 const uint8_t *nv2a_get_dac_palette(void);
 int nv2a_get_screen_off(void);
+unsigned int nv2a_get_flip_count(void);
 
 #endif
@@ -60,6 +60,28 @@ enum FIFOEngine {
     ENGINE_DVD = 2,
 };
 
+typedef struct RAMHTEntry {
+    uint32_t handle;
+    hwaddr instance;
+    enum FIFOEngine engine;
+    unsigned int channel_id : 5;
+    bool valid;
+} RAMHTEntry;
+
+/*
+ * Direct-mapped cache of RAMHT lookups. Entries are tagged with the handle,
+ * channel and NV_PFIFO_RAMHT value they were looked up with, and the whole
+ * cache is dropped when the guest has written to RAMIN since the last kick.
+ */
+#define RAMHT_CACHE_SIZE 64 /* Must be a power of 2 */
+
+typedef struct RAMHTCacheEntry {
+    uint32_t handle;
+    uint32_t channel_id;
+    uint32_t ramht;
+    RAMHTEntry entry; /* entry.valid is clear for empty slots */
+} RAMHTCacheEntry;
+
 typedef struct DMAObject {
     unsigned int dma_class;
     unsigned int dma_target;
@@ -67,6 +89,30 @@ typedef struct DMAObject {
     hwaddr limit;
 } DMAObject;
 
+/*
+ * Decoded method stream between the PFIFO pusher and PGRAPH when the pusher
+ * runs on its own thread. Single producer (pusher), single consumer (PFIFO
+ * thread); head and tail are free-running word indices.
+ */
+#define PFIFO_METHOD_RING_SIZE (16 * 1024) /* Words, must be a power of 2 */
+
+typedef struct PFIFOMethodRing {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t head_progress; /* Parameters of the head entry already run */
+    uint32_t words[PFIFO_METHOD_RING_SIZE];
+} PFIFOMethodRing;
+
+#define NV2A_POLL_TRACK_SIZE 4
+
+typedef struct NV2APollEntry {
+    int block;
+    hwaddr addr;
+    uint64_t val;
+    unsigned int count;
+    int64_t last_ns;
+} NV2APollEntry;
+
 typedef struct NV2AState {
     /*< private >*/
     PCIDevice parent_obj;
@@ -103,6 +149,14 @@ typedef struct NV2AState {
         QemuCond fifo_idle_cond;
         bool fifo_kick;
         bool halt;
+
+        bool pipelined;
+        QemuThread pusher_thread;
+        bool pusher_kick;
+        PFIFOMethodRing ring;
+
+        bool ramht_cache_check_dirty;
+        RAMHTCacheEntry ramht_cache[RAMHT_CACHE_SIZE];
     } pfifo;
 
     struct {
@@ -150,6 +204,13 @@ typedef struct NV2AState {
         uint8_t palette[256*3];
     } puserdac;
 
+    /* Register reads the guest keeps repeating, only used by the vCPU */
+    struct {
+        bool throttle;
+        NV2APollEntry entries[NV2A_POLL_TRACK_SIZE];
+        unsigned int next;
+    } poll;
+
 } NV2AState;
 
 typedef struct NV2ABlockInfo {
@@ -182,6 +243,8 @@ void nv2a_reg_log_write(int block, hwaddr addr, unsigned int size, uint64_t val)
     trace_nv2a_reg_write(block_name, addr, size, val);
 }
 
+void nv2a_poll_throttle(NV2AState *d, int block, hwaddr addr, uint64_t val);
+
 #define DEFINE_PROTO(n) \
     uint64_t n##_read(void *opaque, hwaddr addr, unsigned int size); \
     void n##_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size);
@@ -210,6 +273,7 @@ DEFINE_PROTO(user)
 
 DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address);
 void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len);
+void nv_dma_mark_written(NV2AState *d, const void *ptr, hwaddr len);
 
 /**
  * Clips an image blit to fit into a GPU tile it overlaps.
@@ -20,14 +20,8 @@
  */
 
 #include "nv2a_int.h"
-
-typedef struct RAMHTEntry {
-    uint32_t handle;
-    hwaddr instance;
-    enum FIFOEngine engine;
-    unsigned int channel_id : 5;
-    bool valid;
-} RAMHTEntry;
+#include "qemu/timeline.h"
+#include "ui/xemu-settings.h"
 
 static void pfifo_run_pusher(NV2AState *d);
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle);
@@ -59,6 +53,7 @@ uint64_t pfifo_read(void *opaque, hwaddr addr, unsigned int size)
     qemu_mutex_unlock(&d->pfifo.lock);
 
     nv2a_reg_log_read(NV_PFIFO, addr, size, r);
+    nv2a_poll_throttle(d, NV_PFIFO, addr, r);
     return r;
 }
 
@@ -68,6 +63,8 @@ void pfifo_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
 
     nv2a_reg_log_write(NV_PFIFO, addr, size, val);
 
+    /* Dispatched without the BQL, which updating the IRQ needs */
+    BQL_LOCK_GUARD();
     qemu_mutex_lock(&d->pfifo.lock);
 
     switch (addr) {
@@ -92,6 +89,11 @@ void pfifo_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
 void pfifo_kick(NV2AState *d)
 {
     d->pfifo.fifo_kick = true;
+    d->pfifo.pusher_kick = true;
+    /* Guest RAMIN writes made before this kick must be visible to lookups */
+    d->pfifo.ramht_cache_check_dirty = true;
+    /* Likewise for VRAM the commands read */
+    pgraph_vram_mark_sync_pending(d);
     qemu_cond_broadcast(&d->pfifo.fifo_cond);
 }
 
@@ -248,6 +250,404 @@ static bool pfifo_pusher_should_stall(NV2AState *d)
            qatomic_read(&d->pgraph.waiting_for_nop);
 }
 
+/*
+ * Batched pushbuffer decode
+ *
+ * The pusher normally hands one method header's worth of parameters to the
+ * puller at a time, paying for a PFIFO/PGRAPH lock round trip and a full
+ * stall check for every method. When there is no partially processed command
+ * in flight, the span between DMA_GET and DMA_PUT is first scanned for a
+ * sequence of complete increasing/non-increasing method headers and their
+ * parameters, and the resulting run list is executed by PGRAPH under a single
+ * lock acquisition.
+ *
+ * Anything the scanner does not handle (jumps, calls, returns, object binds
+ * that need a RAMHT lookup, runs whose parameters have not been fully pushed
+ * yet) ends the scan and is left to the per-word path below.
+ */
+#define PFIFO_MAX_METHOD_RUNS 128
+
+typedef struct PFIFOMethodRun {
+    uint32_t header;
+    uint32_t method;
+    uint32_t subchannel;
+    uint32_t count;
+    uint32_t param_offset;
+    bool inc;
+} PFIFOMethodRun;
+
+static size_t pfifo_decode_method_runs(NV2AState *d, const uint8_t *dma,
+                                       uint32_t dma_get_v, uint32_t dma_end,
+                                       PFIFOMethodRun *runs, size_t max_runs)
+{
+    uint32_t engine_reg = d->pfifo.regs[NV_PFIFO_CACHE1_ENGINE];
+    size_t num_runs = 0;
+
+    while (num_runs < max_runs && dma_get_v < dma_end) {
+        uint32_t word = ldl_le_p((uint32_t *)(dma + dma_get_v));
+
+        bool inc;
+        if ((word & 0xe0030003) == 0) {
+            inc = true;
+        } else if ((word & 0xe0030003) == 0x40000000) {
+            inc = false;
+        } else {
+            break;
+        }
+
+        uint32_t method = word & 0x1ffc;
+        uint32_t subchannel = (word >> 13) & 7;
+        uint32_t count = (word >> 18) & 0x7ff;
+        uint32_t last_method = inc ? method + 4 * (count - 1) : method;
+
+        if (count == 0 || method < 0x100 ||
+            (method < 0x200 && last_method >= 0x180)) {
+            break;
+        }
+
+        if (GET_MASK(engine_reg, 3 << (4 * subchannel)) != ENGINE_GRAPHICS) {
+            break;
+        }
+
+        uint32_t words_left = (dma_end - dma_get_v) / 4 - 1;
+        if (count > words_left) {
+            break;
+        }
+
+        runs[num_runs++] = (PFIFOMethodRun){
+            .header = word,
+            .method = method,
+            .subchannel = subchannel,
+            .count = count,
+            .param_offset = dma_get_v + 4,
+            .inc = inc,
+        };
+        dma_get_v += 4 * (count + 1);
+    }
+
+    return num_runs;
+}
+
+static bool pfifo_puller_should_stall_locked(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->waiting_for_flip) {
+        if (!is_flip_stall_complete(d)) {
+            return true;
+        }
+        pg->waiting_for_flip = false;
+    }
+
+    return pg->waiting_for_nop || pg->waiting_for_context_switch ||
+           !can_fifo_access(d);
+}
+
+/*
+ * Returns the number of words consumed from the pushbuffer, 0 if nothing
+ * could be batched, or -1 if the puller is stalled.
+ */
+static ssize_t pfifo_run_pusher_batched(NV2AState *d, uint8_t *dma,
+                                        uint32_t dma_get_v, uint32_t dma_end)
+{
+    uint32_t *pull0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL0];
+    uint32_t *pull1 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL1];
+    uint32_t *dma_state = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_STATE];
+    uint32_t *dma_get = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET];
+    uint32_t *dma_dcount = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_DCOUNT];
+    uint32_t *status = &d->pfifo.regs[NV_PFIFO_CACHE1_STATUS];
+
+    if (!GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+        return -1;
+    }
+
+    PFIFOMethodRun runs[PFIFO_MAX_METHOD_RUNS];
+    size_t num_runs = pfifo_decode_method_runs(d, dma, dma_get_v, dma_end,
+                                               runs, ARRAY_SIZE(runs));
+    if (num_runs == 0) {
+        return 0;
+    }
+
+    if (pfifo_puller_should_stall(d)) {
+        return -1;
+    }
+
+    /* Progress through the run list, written back once PFIFO is relocked */
+    uint32_t pos = dma_get_v;
+    const PFIFOMethodRun *cur = NULL;
+    uint32_t cur_method = 0;
+    uint32_t cur_remaining = 0;
+    uint32_t dcount = 0;
+
+    *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+    SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, ENGINE_GRAPHICS);
+
+    qemu_mutex_unlock(&d->pfifo.lock);
+    qemu_mutex_lock(&d->pgraph.lock);
+
+    bool overrun = false;
+    for (size_t i = 0; i < num_runs && !overrun; i++) {
+        if (pfifo_puller_should_stall_locked(d)) {
+            break;
+        }
+
+        cur = &runs[i];
+        cur_method = cur->method;
+        cur_remaining = cur->count;
+        dcount = 0;
+        pos = cur->param_offset;
+
+        while (cur_remaining) {
+            if (dcount && pfifo_puller_should_stall_locked(d)) {
+                break;
+            }
+
+            uint32_t *word_ptr = (uint32_t *)(dma + pos);
+            size_t max_lookahead_words = (dma_end - pos) / 4;
+            int num_processed =
+                pgraph_method(d, cur->subchannel, cur_method,
+                              ldl_le_p(word_ptr), word_ptr, cur_remaining,
+                              max_lookahead_words, cur->inc);
+            assert(num_processed > 0);
+
+            d->pfifo.regs[NV_PFIFO_CACHE1_DMA_DATA_SHADOW] =
+                ldl_le_p(word_ptr + num_processed - 1);
+            pos += 4 * num_processed;
+            dcount += num_processed;
+            if (cur->inc) {
+                cur_method += 4 * num_processed;
+            }
+
+            if (num_processed > cur_remaining) {
+                /* PGRAPH squashed words beyond this run, resync */
+                cur_remaining = 0;
+                overrun = true;
+                break;
+            }
+            cur_remaining -= num_processed;
+        }
+
+        if (cur_remaining) {
+            break;
+        }
+    }
+
+    qemu_mutex_unlock(&d->pgraph.lock);
+    qemu_mutex_lock(&d->pfifo.lock);
+
+    if (cur == NULL) {
+        return -1;
+    }
+
+    d->pfifo.regs[NV_PFIFO_CACHE1_DMA_RSVD_SHADOW] = cur->header;
+    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD, cur_method >> 2);
+    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL,
+             cur->subchannel);
+    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
+             cur_remaining);
+    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE,
+             cur->inc ? NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC :
+                        NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_NON_INC);
+    *dma_dcount = dcount;
+    *dma_get = pos;
+
+    if (pos != dma_get_v) {
+        *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+    }
+
+    return (pos - dma_get_v) / 4;
+}
+
+
+/*
+ * Pipelined PFIFO
+ *
+ * With perf.pipeline_pfifo enabled, the pusher runs on its own thread and
+ * instead of executing methods directly it decodes them into a ring. The
+ * PFIFO thread consumes the ring and executes the methods in PGRAPH. Like
+ * CACHE1 on the real hardware, DMA_GET runs ahead of method execution by at
+ * most the size of the ring.
+ *
+ * Each entry is a two word header followed by its parameters, and never wraps
+ * around the end of the ring. Object handles are resolved through RAMHT when
+ * the entry is queued.
+ */
+#define PFIFO_RING_HEADER_WORDS 2
+#define PFIFO_RING_ENTRY_PAD    (1u << 31)
+#define PFIFO_RING_ENTRY_COUNT  0x1FFC0000
+
+void pfifo_reset_method_ring(NV2AState *d)
+{
+    d->pfifo.ring.head = 0;
+    d->pfifo.ring.tail = 0;
+    d->pfifo.ring.head_progress = 0;
+}
+
+static bool pfifo_method_ring_empty(NV2AState *d)
+{
+    return d->pfifo.ring.head == qatomic_load_acquire(&d->pfifo.ring.tail);
+}
+
+static ssize_t pfifo_queue_method(NV2AState *d, uint32_t method_entry,
+                                  uint32_t parameter, uint32_t *parameters,
+                                  size_t num_words_available)
+{
+    PFIFOMethodRing *ring = &d->pfifo.ring;
+    uint32_t *pull0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL0];
+    uint32_t *pull1 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL1];
+    uint32_t *engine_reg = &d->pfifo.regs[NV_PFIFO_CACHE1_ENGINE];
+    uint32_t *status = &d->pfifo.regs[NV_PFIFO_CACHE1_STATUS];
+
+    if (!GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+        return -1;
+    }
+
+    uint32_t method = method_entry & 0x1FFC;
+    uint32_t subchannel =
+        GET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
+    uint32_t channel_id = 0;
+    size_t count = num_words_available;
+
+    if (method == 0) {
+        RAMHTEntry entry = ramht_lookup(d, parameter);
+        assert(entry.valid);
+        assert(entry.engine == ENGINE_GRAPHICS);
+
+        /* the engine is bound to the subchannel */
+        assert(subchannel < 8);
+        SET_MASK(*engine_reg, 3 << (4*subchannel), entry.engine);
+        SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, entry.engine);
+
+        parameter = entry.instance;
+        channel_id = entry.channel_id;
+        count = 1;
+    } else if (method >= 0x100) {
+        if (method >= 0x180 && method < 0x200) {
+            RAMHTEntry entry = ramht_lookup(d, parameter);
+            assert(entry.valid);
+            parameter = entry.instance;
+            count = 1;
+        }
+
+        enum FIFOEngine engine = GET_MASK(*engine_reg, 3 << (4*subchannel));
+        assert(engine == ENGINE_GRAPHICS);
+        SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, engine);
+    } else {
+        assert(false);
+    }
+
+    uint32_t head = qatomic_load_acquire(&ring->head);
+    uint32_t tail = ring->tail;
+    uint32_t space = PFIFO_METHOD_RING_SIZE - (tail - head);
+    uint32_t pos = tail & (PFIFO_METHOD_RING_SIZE - 1);
+    uint32_t contiguous = PFIFO_METHOD_RING_SIZE - pos;
+
+    if (contiguous < PFIFO_RING_HEADER_WORDS + count &&
+        space > contiguous + PFIFO_RING_HEADER_WORDS) {
+        /* Entries never wrap, skip to the start of the ring */
+        ring->words[pos] = PFIFO_RING_ENTRY_PAD;
+        tail += contiguous;
+        space -= contiguous;
+        pos = 0;
+        contiguous = PFIFO_METHOD_RING_SIZE;
+    }
+
+    uint32_t avail = MIN(space, contiguous);
+    if (avail <= PFIFO_RING_HEADER_WORDS) {
+        qatomic_store_release(&ring->tail, tail);
+        return -1;
+    }
+    count = MIN(count, avail - PFIFO_RING_HEADER_WORDS);
+
+    uint32_t *entry = &ring->words[pos];
+    entry[0] = method_entry;
+    SET_MASK(entry[0], PFIFO_RING_ENTRY_COUNT, count);
+    entry[1] = channel_id;
+    stl_le_p(&entry[PFIFO_RING_HEADER_WORDS], parameter);
+    for (size_t i = 1; i < count; i++) {
+        entry[PFIFO_RING_HEADER_WORDS + i] = parameters[i];
+    }
+
+    qatomic_store_release(&ring->tail, tail + PFIFO_RING_HEADER_WORDS + count);
+
+    *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+    d->pfifo.fifo_kick = true;
+    qemu_cond_broadcast(&d->pfifo.fifo_cond);
+
+    return count;
+}
+
+static void pfifo_run_method_ring(NV2AState *d)
+{
+    PFIFOMethodRing *ring = &d->pfifo.ring;
+    uint32_t pull0 = d->pfifo.regs[NV_PFIFO_CACHE1_PULL0];
+
+    if (pfifo_method_ring_empty(d) ||
+        !GET_MASK(pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+        return;
+    }
+
+    bool retired = false;
+
+    qemu_mutex_unlock(&d->pfifo.lock);
+    qemu_mutex_lock(&d->pgraph.lock);
+
+    while (!pfifo_method_ring_empty(d) &&
+           !pfifo_puller_should_stall_locked(d)) {
+        uint32_t head = ring->head;
+        uint32_t pos = head & (PFIFO_METHOD_RING_SIZE - 1);
+        uint32_t *entry = &ring->words[pos];
+
+        if (entry[0] & PFIFO_RING_ENTRY_PAD) {
+            qatomic_store_release(&ring->head,
+                                  head + PFIFO_METHOD_RING_SIZE - pos);
+            retired = true;
+            continue;
+        }
+
+        uint32_t count = GET_MASK(entry[0], PFIFO_RING_ENTRY_COUNT);
+        uint32_t method = entry[0] & 0x1FFC;
+        uint32_t subchannel =
+            GET_MASK(entry[0], NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
+        bool inc = !GET_MASK(entry[0], NV_PFIFO_CACHE1_METHOD_TYPE);
+
+        if (method == 0) {
+            pgraph_context_switch(d, entry[1]);
+            if (d->pgraph.waiting_for_context_switch) {
+                break;
+            }
+        } else if (inc) {
+            method += 4 * ring->head_progress;
+        }
+
+        uint32_t *params =
+            &entry[PFIFO_RING_HEADER_WORDS + ring->head_progress];
+        uint32_t remaining = count - ring->head_progress;
+
+        /* No lookahead past the entry, following words are ring headers */
+        int num_processed =
+            pgraph_method(d, subchannel, method, ldl_le_p(params), params,
+                          remaining, remaining, inc);
+        assert(num_processed > 0);
+
+        ring->head_progress += MIN(num_processed, remaining);
+        if (ring->head_progress >= count) {
+            ring->head_progress = 0;
+            qatomic_store_release(&ring->head,
+                                  head + PFIFO_RING_HEADER_WORDS + count);
+            retired = true;
+        }
+    }
+
+    qemu_mutex_unlock(&d->pgraph.lock);
+    qemu_mutex_lock(&d->pfifo.lock);
+
+    if (retired) {
+        d->pfifo.pusher_kick = true;
+        qemu_cond_broadcast(&d->pfifo.fifo_cond);
+    }
+}
+
 static void pfifo_run_pusher(NV2AState *d)
 {
     uint32_t *push0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PUSH0];
@@ -266,6 +666,8 @@ static void pfifo_run_pusher(NV2AState *d)
         return;
     }
 
+    int64_t zone_start = timeline_begin();
+
     // TODO: should we become busy here??
     // NV_PFIFO_CACHE1_DMA_PUSH_STATE _BUSY
 
@@ -290,6 +692,7 @@ static void pfifo_run_pusher(NV2AState *d)
 
     hwaddr dma_len;
     uint8_t *dma = nv_dma_map(d, dma_instance, &dma_len);
+    int num_words = 0;
 
     while (!pfifo_pusher_should_stall(d)) {
         uint32_t dma_get_v = *dma_get;
@@ -302,6 +705,18 @@ static void pfifo_run_pusher(NV2AState *d)
             break;
         }
 
+        if (!d->pfifo.pipelined &&
+            !GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT)) {
+            ssize_t num_batched = pfifo_run_pusher_batched(
+                d, dma, dma_get_v, MIN(dma_put_v, dma_len));
+            if (num_batched < 0) {
+                break;
+            } else if (num_batched > 0) {
+                num_words += num_batched;
+                continue;
+            }
+        }
+
         size_t num_words_available = dma_put_v - dma_get_v;
         assert(num_words_available % 4 == 0);
         num_words_available /= 4;
@@ -335,15 +750,23 @@ static void pfifo_run_pusher(NV2AState *d)
 
             *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
 
-            ssize_t num_words_processed =
-                pfifo_run_puller(d, method_entry, word, word_ptr,
-                                 MIN(method_count, num_words_available),
-                                 num_words_available);
+            ssize_t num_words_processed;
+            if (d->pfifo.pipelined) {
+                num_words_processed =
+                    pfifo_queue_method(d, method_entry, word, word_ptr,
+                                       MIN(method_count, num_words_available));
+            } else {
+                num_words_processed =
+                    pfifo_run_puller(d, method_entry, word, word_ptr,
+                                     MIN(method_count, num_words_available),
+                                     num_words_available);
+            }
             if (num_words_processed < 0) {
                 break;
             }
 
             dma_get_v += (num_words_processed-1)*4;
+            num_words += num_words_processed;
 
             if (method_type == NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC) {
                 SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
@@ -356,6 +779,7 @@ static void pfifo_run_pusher(NV2AState *d)
         } else {
             /* no command active - this is the first word of a new one */
             d->pfifo.regs[NV_PFIFO_CACHE1_DMA_RSVD_SHADOW] = word;
+            num_words++;
 
             /* match all forms */
             if ((word & 0xe0000003) == 0x20000000) {
@@ -447,6 +871,9 @@ static void pfifo_run_pusher(NV2AState *d)
         // d->pfifo.pending_interrupts |= NV_PFIFO_INTR_0_DMA_PUSHER;
         // nv2a_update_irq(d);
     }
+
+    nv2a_profile_add_pushbuffer_bytes(num_words * 4);
+    timeline_end("pusher", NULL, zone_start);
 }
 
 void *pfifo_thread(void *arg)
@@ -463,8 +890,14 @@ void *pfifo_thread(void *arg)
 
         pgraph_process_pending(d);
 
-        if (!d->pfifo.halt) {
-            pfifo_run_pusher(d);
+        if (d->pgraph.replay) {
+            pgraph_replay_run(d);
+        } else if (!d->pfifo.halt) {
+            /* Also drains entries restored from a snapshot if not pipelined */
+            pfifo_run_method_ring(d);
+            if (!d->pfifo.pipelined && pfifo_method_ring_empty(d)) {
+                pfifo_run_pusher(d);
+            }
         }
 
         pgraph_process_pending_reports(d);
@@ -487,6 +920,31 @@ void *pfifo_thread(void *arg)
     return NULL;
 }
 
+void *pfifo_pusher_thread(void *arg)
+{
+    NV2AState *d = (NV2AState *)arg;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&d->pfifo.lock);
+    while (!d->exiting) {
+        d->pfifo.pusher_kick = false;
+
+        if (!d->pfifo.halt) {
+            pfifo_run_pusher(d);
+        }
+
+        if (!d->pfifo.pusher_kick && !d->exiting) {
+            qemu_cond_wait(&d->pfifo.fifo_cond, &d->pfifo.lock);
+        }
+    }
+    qemu_mutex_unlock(&d->pfifo.lock);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 {
     unsigned int ramht_size =
@@ -509,7 +967,12 @@ static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 }
 
 
-static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
+void pfifo_invalidate_ramht_cache(NV2AState *d)
+{
+    memset(d->pfifo.ramht_cache, 0, sizeof(d->pfifo.ramht_cache));
+}
+
+static RAMHTEntry ramht_lookup_uncached(NV2AState *d, uint32_t handle)
 {
     hwaddr ramht_size =
         1 << (GET_MASK(d->pfifo.regs[NV_PFIFO_RAMHT], NV_PFIFO_RAMHT_SIZE)+12);
@@ -536,3 +999,43 @@ static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
         .valid = entry_context & NV_RAMHT_STATUS,
     };
 }
+
+static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
+{
+    uint32_t ramht = d->pfifo.regs[NV_PFIFO_RAMHT];
+    uint32_t channel_id = GET_MASK(d->pfifo.regs[NV_PFIFO_CACHE1_PUSH1],
+                                   NV_PFIFO_CACHE1_PUSH1_CHID);
+
+    if (d->pfifo.ramht_cache_check_dirty) {
+        d->pfifo.ramht_cache_check_dirty = false;
+        hwaddr ramht_address =
+            GET_MASK(ramht, NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
+        hwaddr ramht_size =
+            1 << (GET_MASK(ramht, NV_PFIFO_RAMHT_SIZE) + 12);
+        if (memory_region_test_and_clear_dirty(&d->ramin, ramht_address,
+                                               ramht_size,
+                                               DIRTY_MEMORY_NV2A)) {
+            pfifo_invalidate_ramht_cache(d);
+        }
+    }
+
+    RAMHTCacheEntry *c =
+        &d->pfifo.ramht_cache[(handle ^ (handle >> 16)) &
+                              (RAMHT_CACHE_SIZE - 1)];
+    if (c->entry.valid && c->handle == handle &&
+        c->channel_id == channel_id && c->ramht == ramht) {
+        return c->entry;
+    }
+
+    RAMHTEntry entry = ramht_lookup_uncached(d, handle);
+    if (entry.valid) {
+        *c = (RAMHTCacheEntry){
+            .handle = handle,
+            .channel_id = channel_id,
+            .ramht = ramht,
+            .entry = entry,
+        };
+    }
+
+    return entry;
+}
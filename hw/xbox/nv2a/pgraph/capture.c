@@ -0,0 +1,868 @@
+/*
+ * QEMU Geforce NV2A command capture and replay
+ *
+ * Copyright (c) 2025 xemu Developers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A capture records the method stream seen by pgraph_method() so it can be
+ * fed back into PGRAPH later, without the guest, to benchmark renderers.
+ *
+ * Capture starts at the next FLIP_STALL with a snapshot of the PGRAPH state
+ * and all non-zero RAMIN/VRAM pages. Memory is then kept in sync with the
+ * DIRTY_MEMORY_NV2A_CAPTURE log: before any method which makes PGRAPH read
+ * guest memory (object binds, draws, clears, blits) the pages written since
+ * the last sync are appended to the stream. Capture stops at a frame
+ * boundary.
+ *
+ * Records are stored in host byte order and the state snapshot stores raw
+ * struct fields, so a capture is only replayable by a build with the same
+ * PGRAPHState layout for the recorded fields (sizes are checked on load).
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "system/runstate.h"
+#include "hw/xbox/nv2a/nv2a_int.h"
+#include "ui/xemu-notifications.h"
+
+#define NV2A_CAPTURE_MAGIC "NV2ACAP"
+#define NV2A_CAPTURE_VERSION 1
+#define NV2A_CAPTURE_PAGE_SIZE 4096
+
+/* Enough lookahead words to replay the BEGIN,DRAW_ARRAYS,END squash */
+#define NV2A_CAPTURE_LOOKAHEAD_WORDS 8
+
+enum {
+    NV2A_CAPTURE_RECORD_STATE = 1,
+    NV2A_CAPTURE_RECORD_MEMORY,
+    NV2A_CAPTURE_RECORD_METHOD,
+    NV2A_CAPTURE_RECORD_FRAME,
+};
+
+enum {
+    NV2A_CAPTURE_REGION_VRAM,
+    NV2A_CAPTURE_REGION_RAMIN,
+};
+
+typedef struct NV2ACaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t vram_size;
+    uint64_t ramin_size;
+} NV2ACaptureHeader;
+
+typedef struct NV2ACaptureRecord {
+    uint32_t type;
+    uint32_t length; /* of the payload following this header */
+} NV2ACaptureRecord;
+
+typedef struct NV2ACaptureMemory {
+    uint32_t region;
+    uint32_t offset;
+    /* uint8_t data[] */
+} NV2ACaptureMemory;
+
+typedef struct NV2ACaptureMethod {
+    uint32_t method;
+    uint32_t parameter;
+    uint32_t subchannel;
+    uint32_t inc;
+    uint32_t num_words_available;
+    uint32_t num_processed;
+    /* uint32_t words[], max_lookahead_words is the count */
+} NV2ACaptureMethod;
+
+typedef struct NV2ACaptureFrame {
+    uint64_t duration_us;
+    uint64_t pcrtc_start;
+} NV2ACaptureFrame;
+
+QEMU_BUILD_BUG_ON(sizeof(NV2ACaptureHeader) != 32);
+QEMU_BUILD_BUG_ON(sizeof(NV2ACaptureRecord) % 4);
+QEMU_BUILD_BUG_ON(sizeof(NV2ACaptureMemory) % 4);
+QEMU_BUILD_BUG_ON(sizeof(NV2ACaptureMethod) % 4);
+QEMU_BUILD_BUG_ON(sizeof(NV2ACaptureFrame) % 4);
+
+/* PGRAPHState fields making up the state snapshot */
+#define NV2A_CAPTURE_STATE_XMAC \
+    _X(context_surfaces_2d) \
+    _X(image_blit) \
+    _X(kelvin) \
+    _X(beta) \
+    _X(dma_color) \
+    _X(dma_zeta) \
+    _X(surface_color) \
+    _X(surface_zeta) \
+    _X(surface_type) \
+    _X(surface_shape) \
+    _X(last_surface_shape) \
+    _X(dma_a) \
+    _X(dma_b) \
+    _X(texture_matrix_enable) \
+    _X(dma_state) \
+    _X(dma_notifies) \
+    _X(dma_semaphore) \
+    _X(dma_report) \
+    _X(report_offset) \
+    _X(zpass_pixel_count_enable) \
+    _X(dma_vertex_a) \
+    _X(dma_vertex_b) \
+    _X(primitive_mode) \
+    _X(vertex_state_shader_v0) \
+    _X(program_data) \
+    _X(vsh_constants) \
+    _X(ltctxa) \
+    _X(ltctxb) \
+    _X(ltc1) \
+    _X(material_alpha) \
+    _X(light_infinite_half_vector) \
+    _X(light_infinite_direction) \
+    _X(light_local_position) \
+    _X(light_local_attenuation) \
+    _X(specular_params) \
+    _X(specular_power) \
+    _X(specular_params_back) \
+    _X(specular_power_back) \
+    _X(point_params) \
+    _X(compressed_attrs) \
+    _X(uniform_attrs) \
+    _X(swizzle_attrs) \
+    _X(regs_)
+
+/* VertexAttribute fields, the inline buffer is rebuilt while drawing */
+#define NV2A_CAPTURE_ATTR_STATE_XMAC \
+    _X(dma_select) \
+    _X(offset) \
+    _X(inline_value) \
+    _X(format) \
+    _X(size) \
+    _X(count) \
+    _X(stride) \
+    _X(needs_conversion)
+
+typedef struct PGRAPHCaptureState {
+    FILE *file;
+    char *path;
+    bool started;
+    bool stop_requested;
+    bool skip_method;
+    bool frame_end;
+    bool failed;
+    int64_t frame_start_us;
+    uint64_t num_frames;
+    uint64_t num_methods;
+} PGRAPHCaptureState;
+
+typedef struct PGRAPHReplayState {
+    char *path;
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    int loop;
+    int num_loops;
+    bool finished;
+    bool restore_pending;
+    int64_t frame_start_us;
+    GArray *frame_times;
+    uint64_t num_methods;
+    uint64_t num_mismatches;
+} PGRAPHReplayState;
+
+const char *nv2a_dbg_replay_path;
+int nv2a_dbg_replay_loops = 1;
+
+static void capture_write(PGRAPHCaptureState *cap, const void *data,
+                          size_t len)
+{
+    if (!cap->failed && fwrite(data, len, 1, cap->file) != 1) {
+        error_report("nv2a: failed to write capture %s", cap->path);
+        cap->failed = true;
+    }
+}
+
+static void capture_write_record(PGRAPHCaptureState *cap, uint32_t type,
+                                 const void *hdr, size_t hdr_len,
+                                 const void *data, size_t data_len)
+{
+    NV2ACaptureRecord rec = {
+        .type = type,
+        .length = hdr_len + data_len,
+    };
+    capture_write(cap, &rec, sizeof(rec));
+    capture_write(cap, hdr, hdr_len);
+    if (data_len) {
+        capture_write(cap, data, data_len);
+    }
+}
+
+static void capture_write_page(PGRAPHCaptureState *cap, uint32_t region,
+                               const uint8_t *ptr, hwaddr offset, hwaddr size)
+{
+    NV2ACaptureMemory mem = {
+        .region = region,
+        .offset = offset,
+    };
+    capture_write_record(cap, NV2A_CAPTURE_RECORD_MEMORY, &mem, sizeof(mem),
+                         ptr + offset,
+                         MIN(NV2A_CAPTURE_PAGE_SIZE, size - offset));
+}
+
+/* Writes out the pages of the region the guest wrote since the last sync */
+static void capture_sync_region(PGRAPHCaptureState *cap, uint32_t region,
+                                MemoryRegion *mr, const uint8_t *ptr)
+{
+    hwaddr size = memory_region_size(mr);
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+        mr, 0, size, DIRTY_MEMORY_NV2A_CAPTURE);
+    const hwaddr chunk = NV2A_CAPTURE_PAGE_SIZE * BITS_PER_LONG;
+
+    for (hwaddr addr = 0; addr < size; addr += chunk) {
+        hwaddr len = MIN(chunk, size - addr);
+        if (!memory_region_snapshot_get_dirty(mr, snap, addr, len)) {
+            continue;
+        }
+        for (hwaddr page = addr; page < addr + len;
+             page += NV2A_CAPTURE_PAGE_SIZE) {
+            if (memory_region_snapshot_get_dirty(
+                    mr, snap, page, MIN(NV2A_CAPTURE_PAGE_SIZE, size - page))) {
+                capture_write_page(cap, region, ptr, page, size);
+            }
+        }
+    }
+
+    g_free(snap);
+}
+
+static void capture_sync_memory(NV2AState *d, PGRAPHCaptureState *cap)
+{
+    capture_sync_region(cap, NV2A_CAPTURE_REGION_RAMIN, &d->ramin,
+                        d->ramin_ptr);
+    capture_sync_region(cap, NV2A_CAPTURE_REGION_VRAM, d->vram, d->vram_ptr);
+}
+
+/*
+ * Writes out all non-zero pages of the region. The log is cleared first, so
+ * pages the guest writes while they are read are written out again later.
+ */
+static void capture_dump_region(PGRAPHCaptureState *cap, uint32_t region,
+                                MemoryRegion *mr, const uint8_t *ptr)
+{
+    hwaddr size = memory_region_size(mr);
+
+    g_free(memory_region_snapshot_and_clear_dirty(mr, 0, size,
+                                                  DIRTY_MEMORY_NV2A_CAPTURE));
+
+    for (hwaddr offset = 0; offset < size; offset += NV2A_CAPTURE_PAGE_SIZE) {
+        if (!buffer_is_zero(ptr + offset,
+                            MIN(NV2A_CAPTURE_PAGE_SIZE, size - offset))) {
+            capture_write_page(cap, region, ptr, offset, size);
+        }
+    }
+}
+
+static void state_append(GByteArray *buf, const void *field, uint32_t size)
+{
+    g_byte_array_append(buf, (const guint8 *)&size, sizeof(size));
+    g_byte_array_append(buf, field, size);
+    if (size % 4) {
+        static const uint8_t pad[3];
+        g_byte_array_append(buf, pad, 4 - size % 4);
+    }
+}
+
+static void capture_write_state(PGRAPHState *pg, PGRAPHCaptureState *cap)
+{
+    GByteArray *buf = g_byte_array_new();
+
+#define _X(f) state_append(buf, &pg->f, sizeof(pg->f));
+    NV2A_CAPTURE_STATE_XMAC
+#undef _X
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attr = &pg->vertex_attributes[i];
+#define _X(f) state_append(buf, &attr->f, sizeof(attr->f));
+        NV2A_CAPTURE_ATTR_STATE_XMAC
+#undef _X
+    }
+
+    capture_write_record(cap, NV2A_CAPTURE_RECORD_STATE, buf->data, buf->len,
+                         NULL, 0);
+    g_byte_array_free(buf, true);
+}
+
+static void capture_begin(NV2AState *d, PGRAPHCaptureState *cap)
+{
+    NV2ACaptureHeader hdr = {
+        .magic = NV2A_CAPTURE_MAGIC,
+        .version = NV2A_CAPTURE_VERSION,
+        .page_size = NV2A_CAPTURE_PAGE_SIZE,
+        .vram_size = memory_region_size(d->vram),
+        .ramin_size = memory_region_size(&d->ramin),
+    };
+    capture_write(cap, &hdr, sizeof(hdr));
+    capture_write_state(&d->pgraph, cap);
+
+    capture_dump_region(cap, NV2A_CAPTURE_REGION_RAMIN, &d->ramin,
+                        d->ramin_ptr);
+    capture_dump_region(cap, NV2A_CAPTURE_REGION_VRAM, d->vram, d->vram_ptr);
+
+    cap->started = true;
+    cap->frame_start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+}
+
+static void capture_free(PGRAPHCaptureState *cap)
+{
+    g_free(cap->path);
+    g_free(cap);
+}
+
+static void capture_finish(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHCaptureState *cap = pg->capture;
+
+    qatomic_set(&pg->capture, NULL);
+
+    if (fclose(cap->file) != 0) {
+        cap->failed = true;
+    }
+
+    if (cap->failed) {
+        char *msg = g_strdup_printf("Failed to write capture %s", cap->path);
+        xemu_queue_error_message(msg);
+        g_free(msg);
+    } else if (!cap->started) {
+        /* Stopped before the first frame boundary, nothing was recorded */
+        unlink(cap->path);
+    } else {
+        fprintf(stderr,
+                "nv2a: saved capture %s (%" PRIu64 " frames, %" PRIu64
+                " methods)\n",
+                cap->path, cap->num_frames, cap->num_methods);
+        char *msg = g_strdup_printf("Saved NV2A capture: %" PRIu64 " frames",
+                                    cap->num_frames);
+        xemu_queue_notification(msg);
+        g_free(msg);
+    }
+
+    capture_free(cap);
+}
+
+void nv2a_dbg_capture_start(const char *path, Error **errp)
+{
+    PGRAPHState *pg = &g_nv2a->pgraph;
+
+    FILE *file = qemu_fopen(path, "wb");
+    if (!file) {
+        error_setg_errno(errp, errno, "Failed to open %s for writing", path);
+        return;
+    }
+
+    PGRAPHCaptureState *cap = g_malloc0(sizeof(*cap));
+    cap->file = file;
+    cap->path = g_strdup(path);
+
+    qemu_mutex_lock(&pg->lock);
+    if (pg->capture) {
+        qemu_mutex_unlock(&pg->lock);
+        fclose(file);
+        capture_free(cap);
+        error_setg(errp, "A capture is already in progress");
+        return;
+    }
+    qatomic_set(&pg->capture, cap);
+    qemu_mutex_unlock(&pg->lock);
+}
+
+void nv2a_dbg_capture_stop(void)
+{
+    NV2AState *d = g_nv2a;
+    PGRAPHState *pg = &d->pgraph;
+
+    qemu_mutex_lock(&pg->lock);
+    PGRAPHCaptureState *cap = pg->capture;
+    if (cap) {
+        if (cap->started) {
+            /* Let the current frame complete */
+            cap->stop_requested = true;
+        } else {
+            capture_finish(d);
+        }
+    }
+    qemu_mutex_unlock(&pg->lock);
+}
+
+bool nv2a_dbg_capture_active(void)
+{
+    return qatomic_read(&g_nv2a->pgraph.capture) != NULL;
+}
+
+void pgraph_capture_pre_method(NV2AState *d, unsigned int subchannel,
+                               unsigned int method)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHCaptureState *cap = pg->capture;
+
+    if (!cap->started) {
+        return;
+    }
+
+    uint32_t graphics_class =
+        GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE1 + subchannel * 4),
+                 NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+
+    bool reads_memory;
+    if (method == NV_SET_OBJECT) {
+        reads_memory = true;
+    } else if (graphics_class == NV_IMAGE_BLIT) {
+        reads_memory = method == NV09F_SIZE;
+    } else if (graphics_class == NV_KELVIN_PRIMITIVE) {
+        reads_memory = method == NV097_SET_BEGIN_END ||
+                       method == NV097_CLEAR_SURFACE;
+    } else {
+        reads_memory = false;
+    }
+
+    if (reads_memory) {
+        capture_sync_memory(d, cap);
+    }
+}
+
+void pgraph_capture_method(NV2AState *d, unsigned int subchannel,
+                           unsigned int method, uint32_t parameter,
+                           uint32_t *parameters, size_t num_words_available,
+                           size_t max_lookahead_words, bool inc,
+                           int num_processed)
+{
+    PGRAPHCaptureState *cap = d->pgraph.capture;
+
+    if (!cap->started) {
+        return;
+    }
+
+    if (cap->skip_method) {
+        /* FLIP_STALL that started the capture */
+        cap->skip_method = false;
+        return;
+    }
+
+    size_t num_words =
+        MAX(num_processed,
+            MIN(max_lookahead_words, NV2A_CAPTURE_LOOKAHEAD_WORDS));
+    NV2ACaptureMethod rec = {
+        .method = method,
+        .parameter = parameter,
+        .subchannel = subchannel,
+        .inc = inc,
+        .num_words_available = MIN(num_words_available, num_words),
+        .num_processed = num_processed,
+    };
+    capture_write_record(cap, NV2A_CAPTURE_RECORD_METHOD, &rec, sizeof(rec),
+                         parameters, num_words * sizeof(uint32_t));
+    cap->num_methods++;
+
+    if (cap->frame_end) {
+        int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        NV2ACaptureFrame frame = {
+            .duration_us = now - cap->frame_start_us,
+            .pcrtc_start = d->pcrtc.start,
+        };
+        capture_write_record(cap, NV2A_CAPTURE_RECORD_FRAME, &frame,
+                             sizeof(frame), NULL, 0);
+        cap->frame_start_us = now;
+        cap->frame_end = false;
+        cap->num_frames++;
+
+        if (cap->stop_requested || cap->failed) {
+            capture_finish(d);
+        }
+    }
+}
+
+void pgraph_capture_flip_stall(NV2AState *d)
+{
+    PGRAPHCaptureState *cap = d->pgraph.capture;
+
+    if (cap->started) {
+        cap->frame_end = true;
+    } else {
+        capture_begin(d, cap);
+        cap->skip_method = true;
+    }
+}
+
+void pgraph_capture_finalize(NV2AState *d)
+{
+    if (d->pgraph.capture) {
+        capture_finish(d);
+    }
+}
+
+static void state_restore(const uint8_t **p, const uint8_t *end, void *field,
+                          uint32_t size, bool *ok)
+{
+    uint32_t stored_size;
+    size_t padded = ROUND_UP(size, 4);
+
+    if (!*ok || end - *p < sizeof(stored_size)) {
+        *ok = false;
+        return;
+    }
+    memcpy(&stored_size, *p, sizeof(stored_size));
+    *p += sizeof(stored_size);
+    if (stored_size != size || end - *p < padded) {
+        *ok = false;
+        return;
+    }
+    memcpy(field, *p, size);
+    *p += padded;
+}
+
+static bool replay_restore_state(NV2AState *d, const uint8_t *p, size_t len)
+{
+    PGRAPHState *pg = &d->pgraph;
+    const uint8_t *end = p + len;
+    bool ok = true;
+
+#define _X(f) state_restore(&p, end, &pg->f, sizeof(pg->f), &ok);
+    NV2A_CAPTURE_STATE_XMAC
+#undef _X
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attr = &pg->vertex_attributes[i];
+#define _X(f) state_restore(&p, end, &attr->f, sizeof(attr->f), &ok);
+        NV2A_CAPTURE_ATTR_STATE_XMAC
+#undef _X
+    }
+
+    if (!ok || p != end) {
+        return false;
+    }
+
+    /* Everything the renderer may have cached is stale now */
+    bitmap_fill(pg->regs_dirty, ARRAY_SIZE(pg->regs_) / sizeof(uint32_t));
+    pg->program_data_dirty = true;
+    memset(pg->vsh_constants_dirty, 1, sizeof(pg->vsh_constants_dirty));
+    memset(pg->ltctxa_dirty, 1, sizeof(pg->ltctxa_dirty));
+    memset(pg->ltctxb_dirty, 1, sizeof(pg->ltctxb_dirty));
+    memset(pg->ltc1_dirty, 1, sizeof(pg->ltc1_dirty));
+    memset(pg->texture_dirty, 1, sizeof(pg->texture_dirty));
+    pg->surface_color.buffer_dirty = true;
+    pg->surface_zeta.buffer_dirty = true;
+    pgraph_invalidate_ctx_switch(pg);
+    pgraph_reset_inline_buffers(pg);
+    pgraph_reset_draw_arrays(pg);
+    pg->inline_buffer_attrs = 0;
+    pg->waiting_for_nop = false;
+    pg->waiting_for_flip = false;
+    pg->waiting_for_context_switch = false;
+
+    qatomic_set(&pg->flush_pending, true);
+
+    return true;
+}
+
+static bool replay_apply_memory(NV2AState *d, const uint8_t *p, size_t len)
+{
+    NV2ACaptureMemory mem;
+
+    if (len < sizeof(mem)) {
+        return false;
+    }
+    memcpy(&mem, p, sizeof(mem));
+    p += sizeof(mem);
+    len -= sizeof(mem);
+
+    uint8_t *base;
+    size_t size;
+    if (mem.region == NV2A_CAPTURE_REGION_VRAM) {
+        base = d->vram_ptr;
+        size = memory_region_size(d->vram);
+    } else if (mem.region == NV2A_CAPTURE_REGION_RAMIN) {
+        base = d->ramin_ptr;
+        size = memory_region_size(&d->ramin);
+    } else {
+        return false;
+    }
+
+    if (mem.offset > size || len > size - mem.offset) {
+        return false;
+    }
+
+    memcpy(base + mem.offset, p, len);
+    if (mem.region == NV2A_CAPTURE_REGION_VRAM) {
+        memory_region_set_dirty(d->vram, mem.offset, len);
+        pgraph_vram_mark_sync_pending(d);
+    }
+
+    return true;
+}
+
+static bool replay_method(NV2AState *d, PGRAPHReplayState *rp,
+                          const uint8_t *p, size_t len)
+{
+    PGRAPHState *pg = &d->pgraph;
+    NV2ACaptureMethod rec;
+
+    if (len < sizeof(rec) || (len - sizeof(rec)) % 4) {
+        return false;
+    }
+    memcpy(&rec, p, sizeof(rec));
+
+    uint32_t *words = (uint32_t *)(p + sizeof(rec));
+    size_t num_words = (len - sizeof(rec)) / 4;
+    if (rec.subchannel >= 8 || num_words == 0 ||
+        rec.num_words_available > num_words ||
+        rec.num_processed > num_words) {
+        return false;
+    }
+
+    int num_processed =
+        pgraph_method(d, rec.subchannel, rec.method, rec.parameter, words,
+                      rec.num_words_available, num_words, rec.inc);
+    if (num_processed != rec.num_processed) {
+        rp->num_mismatches++;
+    }
+    rp->num_methods++;
+
+    /* Nothing will acknowledge these without the guest running */
+    pg->waiting_for_flip = false;
+    pg->waiting_for_nop = false;
+
+    return true;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void replay_report(PGRAPHReplayState *rp)
+{
+    unsigned int num_frames = rp->frame_times->len;
+    int64_t *times = (int64_t *)rp->frame_times->data;
+
+    fprintf(stderr, "nv2a: replay of %s finished: %d loop(s), %u frames, %"
+            PRIu64 " methods\n", rp->path, rp->num_loops, num_frames,
+            rp->num_methods);
+
+    if (rp->num_mismatches) {
+        fprintf(stderr, "nv2a: warning: %" PRIu64 " methods consumed a "
+                "different number of words than at capture time\n",
+                rp->num_mismatches);
+    }
+
+    if (!num_frames) {
+        return;
+    }
+
+    int64_t total = 0;
+    for (unsigned int i = 0; i < num_frames; i++) {
+        total += times[i];
+    }
+    qsort(times, num_frames, sizeof(int64_t), compare_int64);
+
+    double avg_ms = total / 1000.0 / num_frames;
+    fprintf(stderr, "nv2a: frame time avg %.3f ms, min %.3f ms, "
+            "median %.3f ms, p99 %.3f ms, max %.3f ms (%.1f fps)\n",
+            avg_ms, times[0] / 1000.0, times[num_frames / 2] / 1000.0,
+            times[(num_frames - 1) * 99 / 100] / 1000.0,
+            times[num_frames - 1] / 1000.0, 1000.0 / avg_ms);
+}
+
+static void replay_restart(NV2AState *d, PGRAPHReplayState *rp)
+{
+    memset(d->vram_ptr, 0, memory_region_size(d->vram));
+    memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+    pgraph_vram_mark_sync_pending(d);
+    memset(d->ramin_ptr, 0, memory_region_size(&d->ramin));
+
+    rp->pos = sizeof(NV2ACaptureHeader);
+    rp->restore_pending = true;
+}
+
+static bool replay_open(NV2AState *d, PGRAPHReplayState *rp, Error **errp)
+{
+    GError *gerr = NULL;
+    gchar *data;
+    gsize size;
+
+    if (!g_file_get_contents(rp->path, &data, &size, &gerr)) {
+        error_setg(errp, "Failed to read capture %s: %s", rp->path,
+                   gerr->message);
+        g_error_free(gerr);
+        return false;
+    }
+    rp->data = (uint8_t *)data;
+    rp->size = size;
+
+    NV2ACaptureHeader hdr;
+    if (size < sizeof(hdr)) {
+        error_setg(errp, "Capture %s is truncated", rp->path);
+        return false;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+
+    if (memcmp(hdr.magic, NV2A_CAPTURE_MAGIC, sizeof(NV2A_CAPTURE_MAGIC))) {
+        error_setg(errp, "%s is not an NV2A capture", rp->path);
+        return false;
+    }
+    if (hdr.version != NV2A_CAPTURE_VERSION ||
+        hdr.page_size != NV2A_CAPTURE_PAGE_SIZE) {
+        error_setg(errp, "Capture %s has unsupported version %u", rp->path,
+                   hdr.version);
+        return false;
+    }
+    if (hdr.vram_size != memory_region_size(d->vram) ||
+        hdr.ramin_size != memory_region_size(&d->ramin)) {
+        error_setg(errp, "Capture %s was taken with %" PRIu64 " MiB of RAM, "
+                   "configure the same memory size to replay it", rp->path,
+                   hdr.vram_size / MiB);
+        return false;
+    }
+
+    return true;
+}
+
+void pgraph_replay_init(NV2AState *d, const char *path, int loops,
+                        Error **errp)
+{
+    PGRAPHReplayState *rp = g_malloc0(sizeof(*rp));
+    rp->path = g_strdup(path);
+    rp->num_loops = MAX(loops, 1);
+    rp->frame_times = g_array_new(false, false, sizeof(int64_t));
+
+    if (!replay_open(d, rp, errp)) {
+        g_free(rp->data);
+        g_free(rp->path);
+        g_array_free(rp->frame_times, true);
+        g_free(rp);
+        return;
+    }
+
+    replay_restart(d, rp);
+    d->pgraph.replay = rp;
+}
+
+void pgraph_replay_reset(NV2AState *d)
+{
+    PGRAPHReplayState *rp = d->pgraph.replay;
+
+    if (rp && !rp->finished) {
+        rp->loop = 0;
+        rp->num_methods = 0;
+        rp->num_mismatches = 0;
+        g_array_set_size(rp->frame_times, 0);
+        replay_restart(d, rp);
+    }
+}
+
+/* Replay up to the next frame boundary. Called from the PFIFO thread. */
+void pgraph_replay_run(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHReplayState *rp = pg->replay;
+
+    if (rp->finished) {
+        return;
+    }
+
+    qemu_mutex_unlock(&d->pfifo.lock);
+    qemu_mutex_lock(&pg->lock);
+
+    bool frame_done = false;
+    bool error = false;
+
+    while (!frame_done && !error && rp->pos < rp->size) {
+        NV2ACaptureRecord rec;
+        if (rp->size - rp->pos < sizeof(rec)) {
+            error = true;
+            break;
+        }
+        memcpy(&rec, rp->data + rp->pos, sizeof(rec));
+        const uint8_t *payload = rp->data + rp->pos + sizeof(rec);
+        if (rec.length > rp->size - rp->pos - sizeof(rec)) {
+            error = true;
+            break;
+        }
+        rp->pos += sizeof(rec) + ROUND_UP(rec.length, 4);
+
+        switch (rec.type) {
+        case NV2A_CAPTURE_RECORD_STATE:
+            error = !replay_restore_state(d, payload, rec.length);
+            /* Let the renderer flush before any methods are replayed */
+            frame_done = true;
+            break;
+        case NV2A_CAPTURE_RECORD_MEMORY:
+            error = !replay_apply_memory(d, payload, rec.length);
+            break;
+        case NV2A_CAPTURE_RECORD_METHOD:
+            if (rp->restore_pending) {
+                rp->restore_pending = false;
+                rp->frame_start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            }
+            error = !replay_method(d, rp, payload, rec.length);
+            break;
+        case NV2A_CAPTURE_RECORD_FRAME: {
+            NV2ACaptureFrame frame;
+            if (rec.length < sizeof(frame)) {
+                error = true;
+                break;
+            }
+            memcpy(&frame, payload, sizeof(frame));
+            /* Scan out the frame that was just presented */
+            d->pcrtc.start = frame.pcrtc_start;
+
+            int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            int64_t frame_time = now - rp->frame_start_us;
+            g_array_append_val(rp->frame_times, frame_time);
+            rp->frame_start_us = now;
+            frame_done = true;
+            break;
+        }
+        default:
+            /* Unknown records are skipped for forward compatibility */
+            break;
+        }
+    }
+
+    if (error) {
+        error_report("nv2a: capture %s is corrupt at offset %zu", rp->path,
+                     rp->pos);
+    }
+
+    if (error || rp->pos >= rp->size) {
+        if (!error && ++rp->loop < rp->num_loops) {
+            replay_restart(d, rp);
+        } else {
+            replay_report(rp);
+            rp->finished = true;
+            qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_UI);
+        }
+    }
+
+    qemu_mutex_unlock(&pg->lock);
+    qemu_mutex_lock(&d->pfifo.lock);
+
+    if (!rp->finished) {
+        d->pfifo.fifo_kick = true;
+    }
+}
@@ -64,6 +64,34 @@ void pgraph_gl_init_display(NV2AState *d)
         "uniform vec2 display_size;\n"
         "uniform float line_offset;\n"
         "layout(location = 0) out vec4 out_Color;\n"
+        /* pvideo_tex holds packed Y0 U Y1 V pixel pairs, one per texel */
+        "vec3 pvideo_yuv_to_rgb(float y, float u, float v)\n"
+        "{\n"
+        "    float c = y * 255.0 - 16.0;\n"
+        "    float d = u * 255.0 - 128.0;\n"
+        "    float e = v * 255.0 - 128.0;\n"
+        "    vec3 rgb = floor((vec3(298.0 * c + 409.0 * e,\n"
+        "                           298.0 * c - 100.0 * d - 208.0 * e,\n"
+        "                           298.0 * c + 516.0 * d) + 128.0) / 256.0);\n"
+        "    return clamp(rgb, 0.0, 255.0) / 255.0;\n"
+        "}\n"
+        "vec4 pvideo_texel(ivec2 p)\n"
+        "{\n"
+        "    ivec2 size = textureSize(pvideo_tex, 0) * ivec2(2, 1);\n"
+        "    p = clamp(p, ivec2(0), size - 1);\n"
+        "    vec4 pair = texelFetch(pvideo_tex, ivec2(p.x >> 1, p.y), 0);\n"
+        "    float y = (p.x & 1) != 0 ? pair.b : pair.r;\n"
+        "    return vec4(pvideo_yuv_to_rgb(y, pair.g, pair.a), 1.0);\n"
+        "}\n"
+        "vec4 pvideo_sample(vec2 pos)\n"
+        "{\n"
+        "    pos -= 0.5;\n"
+        "    ivec2 p = ivec2(floor(pos));\n"
+        "    vec2 f = fract(pos);\n"
+        "    return mix(mix(pvideo_texel(p), pvideo_texel(p + ivec2(1, 0)), f.x),\n"
+        "               mix(pvideo_texel(p + ivec2(0, 1)), pvideo_texel(p + ivec2(1, 1)), f.x),\n"
+        "               f.y);\n"
+        "}\n"
         "void main()\n"
         "{\n"
         "    vec2 texCoord = gl_FragCoord.xy/display_size;\n"
@@ -77,9 +105,9 @@ void pgraph_gl_init_display(NV2AState *d)
         "                           greaterThan(screenCoord, output_region.zw));\n"
         "        if (!any(clip) && (!pvideo_color_key_enable || out_Color.rgb == pvideo_color_key)) {\n"
         "            vec2 out_xy = (screenCoord - pvideo_pos.xy) * pvideo_scale.z;\n"
-        "            vec2 in_st = (pvideo_in_pos + out_xy * pvideo_scale.xy) / textureSize(pvideo_tex, 0);\n"
-        "            in_st.y *= -1.0;\n"
-        "            out_Color.rgba = texture(pvideo_tex, in_st);\n"
+        "            vec2 in_xy = pvideo_in_pos + out_xy * pvideo_scale.xy;\n"
+        "            in_xy.y = textureSize(pvideo_tex, 0).y - in_xy.y;\n"
+        "            out_Color.rgba = pvideo_sample(in_xy);\n"
         "        }\n"
         "    }\n"
         "}\n";
@@ -135,25 +163,6 @@ void pgraph_gl_finalize_display(PGRAPHState *pg)
     glo_set_current(g_nv2a_context_render);
 }
 
-static uint8_t *convert_texture_data__CR8YB8CB8YA8(const uint8_t *data,
-                                                   unsigned int width,
-                                                   unsigned int height,
-                                                   unsigned int pitch)
-{
-    uint8_t *converted_data = (uint8_t *)g_malloc(width * height * 4);
-    int x, y;
-    for (y = 0; y < height; y++) {
-        const uint8_t *line = &data[y * pitch];
-        const uint32_t row_offset = y * width;
-        for (x = 0; x < width; x++) {
-            uint8_t *pixel = &converted_data[(row_offset + x) * 4];
-            convert_yuy2_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
-            pixel[3] = 255;
-        }
-    }
-    return converted_data;
-}
-
 static float pvideo_calculate_scale(unsigned int din_dout,
                                            unsigned int output_size)
 {
@@ -262,12 +271,30 @@ static void render_display_pvideo_overlay(NV2AState *d)
     glBindTexture(GL_TEXTURE_2D, r->disp_rndr.pvideo_tex);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    uint8_t *tex_rgba = convert_texture_data__CR8YB8CB8YA8(
-        d->vram_ptr + base + offset, in_width, in_height, in_pitch);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, in_width, in_height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, tex_rgba);
-    g_free(tex_rgba);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    /*
+     * Upload the YUY2 data as is, one RGBA texel per pair of pixels, and let
+     * the display shader convert and filter it.
+     */
+    const uint8_t *data = d->vram_ptr + base + offset;
+    unsigned int pairs_width = (in_width + 1) / 2;
+    uint8_t *packed = NULL;
+    if (in_pitch % 4 == 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, in_pitch / 4);
+    } else {
+        packed = g_malloc(pairs_width * 4 * in_height);
+        for (int y = 0; y < in_height; y++) {
+            memcpy(&packed[y * pairs_width * 4], &data[y * in_pitch],
+                   pairs_width * 4);
+        }
+        data = packed;
+    }
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pairs_width, in_height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    g_free(packed);
     glUniform1i(r->disp_rndr.pvideo_tex_loc, 1);
     glUniform2f(r->disp_rndr.pvideo_in_pos_loc, in_s / 16.f, in_t / 8.f);
     glUniform4f(r->disp_rndr.pvideo_pos_loc,
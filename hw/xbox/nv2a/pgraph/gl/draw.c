@@ -46,25 +46,21 @@ void pgraph_gl_clear_surface(NV2AState *d, uint32_t parameter)
 
         if (parameter & NV097_CLEAR_SURFACE_Z) {
             gl_mask |= GL_DEPTH_BUFFER_BIT;
-            glDepthMask(GL_TRUE);
+            pgraph_gl_set_depth_mask(r, true);
             glClearDepth(gl_clear_depth);
         }
         if (parameter & NV097_CLEAR_SURFACE_STENCIL) {
             gl_mask |= GL_STENCIL_BUFFER_BIT;
-            glStencilMask(0xff);
+            pgraph_gl_set_stencil_mask(r, 0xff);
             glClearStencil(gl_clear_stencil);
         }
     }
     if (write_color) {
         gl_mask |= GL_COLOR_BUFFER_BIT;
-        glColorMask((parameter & NV097_CLEAR_SURFACE_R)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_G)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_B)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_A)
-                         ? GL_TRUE : GL_FALSE);
+        pgraph_gl_set_color_mask(r, parameter & NV097_CLEAR_SURFACE_R,
+                                 parameter & NV097_CLEAR_SURFACE_G,
+                                 parameter & NV097_CLEAR_SURFACE_B,
+                                 parameter & NV097_CLEAR_SURFACE_A);
 
         GLfloat rgba[4];
         pgraph_get_clear_color(pg, rgba);
@@ -104,20 +100,18 @@ void pgraph_gl_clear_surface(NV2AState *d, uint32_t parameter)
     pgraph_apply_scaling_factor(pg, &scissor_width, &scissor_height);
 
     /* FIXME: Respect window clip?!?! */
-    glEnable(GL_SCISSOR_TEST);
-    glScissor(xmin, ymin, scissor_width, scissor_height);
+    pgraph_gl_set_capability(r, GL_SCISSOR_TEST, true);
+    pgraph_gl_set_scissor(r, xmin, ymin, scissor_width, scissor_height);
 
     /* Dither */
     /* FIXME: Maybe also disable it here? + GL implementation dependent */
-    if (pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) & NV_PGRAPH_CONTROL_0_DITHERENABLE) {
-        glEnable(GL_DITHER);
-    } else {
-        glDisable(GL_DITHER);
-    }
+    pgraph_gl_set_capability(r, GL_DITHER,
+                             pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
+                                 NV_PGRAPH_CONTROL_0_DITHERENABLE);
 
     glClear(gl_mask);
 
-    glDisable(GL_SCISSOR_TEST);
+    pgraph_gl_set_capability(r, GL_SCISSOR_TEST, false);
 
     pgraph_gl_set_surface_dirty(pg, write_color, write_zeta);
 
@@ -151,6 +145,8 @@ void pgraph_gl_draw_begin(NV2AState *d)
 
     pgraph_gl_surface_update(d, true, true, depth_test || stencil_test);
 
+    r->draw_skipped = false;
+
     if (is_nop_draw) {
         return;
     }
@@ -158,36 +154,40 @@ void pgraph_gl_draw_begin(NV2AState *d)
     assert(r->color_binding || r->zeta_binding);
 
     pgraph_gl_bind_textures(d);
-    pgraph_gl_bind_shaders(pg);
+    if (!pgraph_gl_bind_shaders(pg)) {
+        NV2A_GL_DPRINTF(false, "Shaders not ready, skipping draw");
+        r->draw_skipped = true;
+        return;
+    }
 
-    glColorMask(mask_red, mask_green, mask_blue, mask_alpha);
-    glDepthMask(!!(control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE));
-    glStencilMask(GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
-                           NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
+    pgraph_gl_set_color_mask(r, mask_red, mask_green, mask_blue, mask_alpha);
+    pgraph_gl_set_depth_mask(r, control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE);
+    pgraph_gl_set_stencil_mask(
+        r, GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
+                    NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
 
     if (pgraph_reg_r(pg, NV_PGRAPH_BLEND) & NV_PGRAPH_BLEND_EN) {
-        glEnable(GL_BLEND);
+        pgraph_gl_set_capability(r, GL_BLEND, true);
         uint32_t sfactor = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND),
                                     NV_PGRAPH_BLEND_SFACTOR);
         uint32_t dfactor = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND),
                                     NV_PGRAPH_BLEND_DFACTOR);
         assert(sfactor < ARRAY_SIZE(pgraph_blend_factor_gl_map));
         assert(dfactor < ARRAY_SIZE(pgraph_blend_factor_gl_map));
-        glBlendFunc(pgraph_blend_factor_gl_map[sfactor],
-                    pgraph_blend_factor_gl_map[dfactor]);
+        pgraph_gl_set_blend_func(r, pgraph_blend_factor_gl_map[sfactor],
+                                 pgraph_blend_factor_gl_map[dfactor]);
 
         uint32_t equation = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND),
                                      NV_PGRAPH_BLEND_EQN);
         assert(equation < ARRAY_SIZE(pgraph_blend_equation_gl_map));
-        glBlendEquation(pgraph_blend_equation_gl_map[equation]);
+        pgraph_gl_set_blend_equation(r, pgraph_blend_equation_gl_map[equation]);
 
         uint32_t blend_color = pgraph_reg_r(pg, NV_PGRAPH_BLENDCOLOR);
         float gl_blend_color[4];
         pgraph_argb_pack32_to_rgba_float(blend_color, gl_blend_color);
-        glBlendColor(gl_blend_color[0], gl_blend_color[1], gl_blend_color[2],
-                     gl_blend_color[3]);
+        pgraph_gl_set_blend_color(r, gl_blend_color);
     } else {
-        glDisable(GL_BLEND);
+        pgraph_gl_set_capability(r, GL_BLEND, false);
     }
 
     /* Face culling */
@@ -196,42 +196,43 @@ void pgraph_gl_draw_begin(NV2AState *d)
         uint32_t cull_face = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
                                       NV_PGRAPH_SETUPRASTER_CULLCTRL);
         assert(cull_face < ARRAY_SIZE(pgraph_cull_face_gl_map));
-        glCullFace(pgraph_cull_face_gl_map[cull_face]);
-        glEnable(GL_CULL_FACE);
+        pgraph_gl_set_cull_face(r, pgraph_cull_face_gl_map[cull_face]);
+        pgraph_gl_set_capability(r, GL_CULL_FACE, true);
     } else {
-        glDisable(GL_CULL_FACE);
+        pgraph_gl_set_capability(r, GL_CULL_FACE, false);
     }
 
     /* Front-face select */
     /* Winding is reverse here because clip-space y-coordinates are inverted */
-    glFrontFace(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER)
-                    & NV_PGRAPH_SETUPRASTER_FRONTFACE
-                        ? GL_CW : GL_CCW);
+    pgraph_gl_set_front_face(r, pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
+                                        NV_PGRAPH_SETUPRASTER_FRONTFACE ?
+                                    GL_CW :
+                                    GL_CCW);
 
     /* Polygon offset is handled in geometry and fragment shaders explicitly */
-    glDisable(GL_POLYGON_OFFSET_FILL);
-    glDisable(GL_POLYGON_OFFSET_LINE);
-    glDisable(GL_POLYGON_OFFSET_POINT);
+    pgraph_gl_set_capability(r, GL_POLYGON_OFFSET_FILL, false);
+    pgraph_gl_set_capability(r, GL_POLYGON_OFFSET_LINE, false);
+    pgraph_gl_set_capability(r, GL_POLYGON_OFFSET_POINT, false);
 
     /* Depth testing */
     if (depth_test) {
-        glEnable(GL_DEPTH_TEST);
+        pgraph_gl_set_capability(r, GL_DEPTH_TEST, true);
 
         uint32_t depth_func = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0),
                                        NV_PGRAPH_CONTROL_0_ZFUNC);
         assert(depth_func < ARRAY_SIZE(pgraph_depth_func_gl_map));
-        glDepthFunc(pgraph_depth_func_gl_map[depth_func]);
+        pgraph_gl_set_depth_func(r, pgraph_depth_func_gl_map[depth_func]);
     } else {
-        glDisable(GL_DEPTH_TEST);
+        pgraph_gl_set_capability(r, GL_DEPTH_TEST, false);
     }
 
-    glEnable(GL_DEPTH_CLAMP);
+    pgraph_gl_set_capability(r, GL_DEPTH_CLAMP, true);
 
     /* Set first vertex convention to match Vulkan default */
-    glProvokingVertex(GL_FIRST_VERTEX_CONVENTION);
+    pgraph_gl_set_provoking_vertex(r, GL_FIRST_VERTEX_CONVENTION);
 
     if (stencil_test) {
-        glEnable(GL_STENCIL_TEST);
+        pgraph_gl_set_capability(r, GL_STENCIL_TEST, true);
 
         uint32_t stencil_func = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
                                     NV_PGRAPH_CONTROL_1_STENCIL_FUNC);
@@ -251,53 +252,52 @@ void pgraph_gl_draw_begin(NV2AState *d)
         assert(op_zfail < ARRAY_SIZE(pgraph_stencil_op_gl_map));
         assert(op_zpass < ARRAY_SIZE(pgraph_stencil_op_gl_map));
 
-        glStencilFunc(
+        pgraph_gl_set_stencil_func(
+            r,
             pgraph_stencil_func_gl_map[stencil_func],
             stencil_ref,
             func_mask);
 
-        glStencilOp(
+        pgraph_gl_set_stencil_op(
+            r,
             pgraph_stencil_op_gl_map[op_fail],
             pgraph_stencil_op_gl_map[op_zfail],
             pgraph_stencil_op_gl_map[op_zpass]);
 
     } else {
-        glDisable(GL_STENCIL_TEST);
+        pgraph_gl_set_capability(r, GL_STENCIL_TEST, false);
     }
 
     /* Dither */
     /* FIXME: GL implementation dependent */
-    if (pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
-            NV_PGRAPH_CONTROL_0_DITHERENABLE) {
-        glEnable(GL_DITHER);
-    } else {
-        glDisable(GL_DITHER);
-    }
+    pgraph_gl_set_capability(r, GL_DITHER,
+                             pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
+                                 NV_PGRAPH_CONTROL_0_DITHERENABLE);
 
-    glEnable(GL_PROGRAM_POINT_SIZE);
+    pgraph_gl_set_capability(r, GL_PROGRAM_POINT_SIZE, true);
 
     bool anti_aliasing = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_ANTIALIASING), NV_PGRAPH_ANTIALIASING_ENABLE);
 
     /* Edge Antialiasing */
     if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
                               NV_PGRAPH_SETUPRASTER_LINESMOOTHENABLE) {
-        glEnable(GL_LINE_SMOOTH);
-        glLineWidth(MIN(r->supported_smooth_line_width_range[1], pg->surface_scale_factor));
+        pgraph_gl_set_capability(r, GL_LINE_SMOOTH, true);
+        pgraph_gl_set_line_width(r, MIN(r->supported_smooth_line_width_range[1], pg->surface_scale_factor));
     } else {
-        glDisable(GL_LINE_SMOOTH);
-        glLineWidth(MIN(r->supported_aliased_line_width_range[1], pg->surface_scale_factor));
+        pgraph_gl_set_capability(r, GL_LINE_SMOOTH, false);
+        pgraph_gl_set_line_width(r, MIN(r->supported_aliased_line_width_range[1], pg->surface_scale_factor));
     }
     if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
                               NV_PGRAPH_SETUPRASTER_POLYSMOOTHENABLE) {
-        glEnable(GL_POLYGON_SMOOTH);
+        pgraph_gl_set_capability(r, GL_POLYGON_SMOOTH, true);
     } else {
-        glDisable(GL_POLYGON_SMOOTH);
+        pgraph_gl_set_capability(r, GL_POLYGON_SMOOTH, false);
     }
 
     unsigned int vp_width = pg->surface_binding_dim.width,
                  vp_height = pg->surface_binding_dim.height;
     pgraph_apply_scaling_factor(pg, &vp_width, &vp_height);
-    glViewport(0, 0, vp_width, vp_height);
+    pgraph_gl_set_viewport(r, 0, 0, vp_width, vp_height);
 
     /* Surface clip */
     /* FIXME: Consider moving to PSH w/ window clip */
@@ -312,8 +312,8 @@ void pgraph_gl_draw_begin(NV2AState *d)
     pgraph_apply_scaling_factor(pg, &xmin, &ymin);
     pgraph_apply_scaling_factor(pg, &scissor_width, &scissor_height);
 
-    glEnable(GL_SCISSOR_TEST);
-    glScissor(xmin, ymin, scissor_width, scissor_height);
+    pgraph_gl_set_capability(r, GL_SCISSOR_TEST, true);
+    pgraph_gl_set_scissor(r, xmin, ymin, scissor_width, scissor_height);
 
     /* Visibility testing */
     if (pg->zpass_pixel_count_enable) {
@@ -346,7 +346,7 @@ void pgraph_gl_draw_end(NV2AState *d)
         pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1) & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
     bool is_nop_draw = !(color_write || depth_test || stencil_test);
 
-    if (is_nop_draw) {
+    if (is_nop_draw || r->draw_skipped) {
         // FIXME: Check PGRAPH register 0x880.
         // HW uses bit 11 in 0x880 to enable or disable a color/zeta limit
         // check that will raise an exception in the case that a draw should
@@ -378,16 +378,111 @@ void pgraph_gl_draw_end(NV2AState *d)
     NV2A_GL_DGROUP_END();
 }
 
+/*
+ * Returns true if the bound program draws the quads (or quad strip) of the
+ * current primitive as a triangle list, see pgraph_glsl_expand_quads().
+ */
+static bool draw_expands_quads(PGRAPHGLState *r)
+{
+    enum ShaderPrimitiveMode mode = r->shader_binding->state.geom.primitive_mode;
+    return (mode == PRIM_TYPE_QUADS || mode == PRIM_TYPE_QUAD_STRIP) &&
+           r->shader_binding->gl_primitive_mode == GL_TRIANGLES;
+}
+
+static void draw_arrays(PGRAPHGLState *r, GLsizei count)
+{
+    if (draw_expands_quads(r)) {
+        GLsizei index_count = pgraph_gl_bind_quad_indices(
+            r, r->shader_binding->state.geom.primitive_mode, count);
+        glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, NULL);
+    } else {
+        glDrawArrays(r->shader_binding->gl_primitive_mode, 0, count);
+    }
+}
+
+/*
+ * Runs the vertex program of a small inline array on the CPU and draws the
+ * results with a program that passes them through, which is shared by every
+ * vertex program. Saves generating and switching programs for the many tiny
+ * draws of UI elements. Returns false if the draw is not eligible.
+ */
+static bool draw_inline_array_transformed(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    float vertices[PGRAPH_VSH_CPU_MAX_VERTICES][PGRAPH_VSH_CPU_OUTPUT_REGS][4];
+    unsigned int count = pgraph_vsh_cpu_transform_inline_array(pg, vertices);
+    if (!count) {
+        return false;
+    }
+
+    NV2A_GL_DPRINTF(false, "Inline Array (CPU transformed)");
+    nv2a_profile_inc_counter(NV2A_PROF_INLINE_ARRAYS_CPU_VSH);
+
+    pg->compressed_attrs = 0;
+    pg->vsh_pretransformed = true;
+    bool bound = pgraph_gl_bind_shaders(pg);
+    pg->vsh_pretransformed = false;
+    if (!bound) {
+        r->draw_skipped = true;
+        return true;
+    }
+
+    size_t size = count * sizeof(vertices[0]);
+    GLintptr offset = 0;
+    GLuint gl_buffer = r->gl_stream_buffer;
+    if (!pgraph_gl_stream_data(r, vertices, size, sizeof(float) * 4,
+                               &offset)) {
+        gl_buffer = r->gl_inline_array_buffer;
+        glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+        glBufferData(GL_ARRAY_BUFFER, size, vertices, GL_STREAM_DRAW);
+    }
+
+    /* Output register i is read from attribute i by the passthrough program */
+    VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES];
+    memset(sources, 0, sizeof(sources));
+    for (int i = 0; i < PGRAPH_VSH_CPU_OUTPUT_REGS; i++) {
+        sources[i] = (VertexAttribSource){
+            .gl_buffer = gl_buffer,
+            .offset = offset + i * sizeof(float) * 4,
+            .stride = sizeof(vertices[0]),
+            .gl_count = 4,
+            .gl_type = GL_FLOAT,
+            .gl_normalize = GL_FALSE,
+        };
+    }
+    pgraph_gl_bind_vertex_sources(pg, sources);
+
+    draw_arrays(r, count);
+    return true;
+}
+
 void pgraph_gl_flush_draw(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
     PGRAPHGLState *r = pg->gl_renderer_state;
 
-    if (!(r->color_binding || r->zeta_binding)) {
+    if (!(r->color_binding || r->zeta_binding) || r->draw_skipped) {
         return;
     }
     assert(r->shader_binding);
 
+    if (r->cpu_vertex_programs && pg->inline_array_length &&
+        draw_inline_array_transformed(d)) {
+        return;
+    }
+    if (r->shader_binding->state.vsh.pretransformed) {
+        /* Left bound by an earlier CPU transformed draw of this begin/end */
+        if (!pgraph_gl_bind_shaders(pg)) {
+            r->draw_skipped = true;
+            return;
+        }
+    }
+    bool expand_quads = draw_expands_quads(r);
+    enum ShaderPrimitiveMode primitive_mode =
+        r->shader_binding->state.geom.primitive_mode;
+
     if (pg->draw_arrays_length) {
         NV2A_GL_DPRINTF(false, "Draw Arrays");
         nv2a_profile_inc_counter(NV2A_PROF_DRAW_ARRAYS);
@@ -399,10 +494,27 @@ void pgraph_gl_flush_draw(NV2AState *d)
                                       pg->draw_arrays_max_count - 1,
                                       false, 0,
                                       pg->draw_arrays_max_count - 1);
-        glMultiDrawArrays(r->shader_binding->gl_primitive_mode,
-                          pg->draw_arrays_start,
-                          pg->draw_arrays_count,
-                          pg->draw_arrays_length);
+        if (expand_quads) {
+            GLsizei counts[ARRAY_SIZE(pg->draw_arrays_count)];
+            const void *offsets[ARRAY_SIZE(pg->draw_arrays_count)];
+            GLsizei max_count = 0;
+            for (int i = 0; i < pg->draw_arrays_length; i++) {
+                counts[i] = pgraph_glsl_get_quad_triangle_index_count(
+                    primitive_mode, pg->draw_arrays_count[i]);
+                offsets[i] = NULL;
+                max_count = MAX(max_count, pg->draw_arrays_count[i]);
+            }
+            pgraph_gl_bind_quad_indices(r, primitive_mode, max_count);
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts,
+                                          GL_UNSIGNED_INT, offsets,
+                                          pg->draw_arrays_length,
+                                          pg->draw_arrays_start);
+        } else {
+            glMultiDrawArrays(r->shader_binding->gl_primitive_mode,
+                              pg->draw_arrays_start,
+                              pg->draw_arrays_count,
+                              pg->draw_arrays_length);
+        }
     } else if (pg->inline_elements_length) {
         NV2A_GL_DPRINTF(false, "Inline Elements");
         nv2a_profile_inc_counter(NV2A_PROF_INLINE_ELEMENTS);
@@ -420,30 +532,58 @@ void pgraph_gl_flush_draw(NV2AState *d)
                 d, min_element, max_element, false, 0,
                 pg->inline_elements[pg->inline_elements_length - 1]);
 
-        VertexKey k;
-        memset(&k, 0, sizeof(VertexKey));
-        k.count = pg->inline_elements_length;
-        k.gl_type = GL_UNSIGNED_INT;
-        k.gl_normalize = GL_FALSE;
-        k.stride = sizeof(uint32_t);
-        uint64_t h = fast_hash((uint8_t*)pg->inline_elements,
-                               pg->inline_elements_length * 4);
-
-        LruNode *node = lru_lookup(&r->element_cache, h, &k);
-        VertexLruNode *found = container_of(node, VertexLruNode, node);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, found->gl_buffer);
-        if (!found->initialized) {
-            nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                         pg->inline_elements_length * 4,
-                         pg->inline_elements, GL_STATIC_DRAW);
-            found->initialized = true;
+        uint32_t *elements = pg->inline_elements;
+        unsigned int elements_length = pg->inline_elements_length;
+        if (expand_quads) {
+            elements_length = pgraph_glsl_get_quad_triangle_index_count(
+                primitive_mode, pg->inline_elements_length);
+            elements = g_malloc_n(MAX(elements_length, 1), sizeof(uint32_t));
+            for (int i = 0; i < elements_length; i++) {
+                elements[i] = pg->inline_elements[
+                    pgraph_glsl_get_quad_triangle_index(primitive_mode, i)];
+            }
+        }
+
+        uint64_t h = fast_hash((uint8_t*)elements, elements_length * 4);
+        uint64_t *seen = &r->element_hashes_seen
+            [h % ARRAY_SIZE(r->element_hashes_seen)];
+
+        // Only index lists which are drawn again are worth a buffer of their
+        // own, stream the others
+        GLintptr elements_offset = 0;
+        bool cached = lru_contains_hash(&r->element_cache, h) || *seen == h;
+        if (cached ||
+            !pgraph_gl_stream_data(r, elements, elements_length * 4,
+                                   sizeof(uint32_t), &elements_offset)) {
+            VertexKey k;
+            memset(&k, 0, sizeof(VertexKey));
+            k.count = elements_length;
+            k.gl_type = GL_UNSIGNED_INT;
+            k.gl_normalize = GL_FALSE;
+            k.stride = sizeof(uint32_t);
+
+            LruNode *node = lru_lookup(&r->element_cache, h, &k);
+            VertexLruNode *found = container_of(node, VertexLruNode, node);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, found->gl_buffer);
+            if (!found->initialized) {
+                nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements_length * 4,
+                             elements, GL_STATIC_DRAW);
+                found->initialized = true;
+            } else {
+                nv2a_profile_inc_counter(
+                    NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY);
+            }
         } else {
-            nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY);
+            *seen = h;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r->gl_stream_buffer);
         }
         glDrawElements(r->shader_binding->gl_primitive_mode,
-                       pg->inline_elements_length, GL_UNSIGNED_INT,
-                       (void *)0);
+                       elements_length, GL_UNSIGNED_INT,
+                       (void *)elements_offset);
+        if (elements != pg->inline_elements) {
+            g_free(elements);
+        }
     } else if (pg->inline_buffer_length) {
         NV2A_GL_DPRINTF(false, "Inline Buffer");
         nv2a_profile_inc_counter(NV2A_PROF_INLINE_BUFFERS);
@@ -451,38 +591,55 @@ void pgraph_gl_flush_draw(NV2AState *d)
 
         if (pg->compressed_attrs) {
             pg->compressed_attrs = 0;
-            pgraph_gl_bind_shaders(pg);
+            if (!pgraph_gl_bind_shaders(pg)) {
+                r->draw_skipped = true;
+                return;
+            }
         }
 
+        VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES];
+        memset(sources, 0, sizeof(sources));
+
         for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
             VertexAttribute *attr = &pg->vertex_attributes[i];
-            if (attr->inline_buffer_populated) {
-                nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_3);
-                glBindBuffer(GL_ARRAY_BUFFER, r->gl_inline_buffer[i]);
-                glBufferData(GL_ARRAY_BUFFER,
-                             pg->inline_buffer_length * sizeof(float) * 4,
-                             attr->inline_buffer, GL_STREAM_DRAW);
-                glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, 0, 0);
-                glEnableVertexAttribArray(i);
-                attr->inline_buffer_populated = false;
-                memcpy(attr->inline_value,
-                       attr->inline_buffer + (pg->inline_buffer_length - 1) * 4,
-                       sizeof(attr->inline_value));
-            } else {
-                glDisableVertexAttribArray(i);
-                glVertexAttrib4fv(i, attr->inline_value);
+            if (!(pg->inline_buffer_attrs & (1 << i))) {
+                continue;
             }
+
+            nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_3);
+            size_t size = pg->inline_buffer_length * sizeof(float) * 4;
+            GLintptr offset = 0;
+            GLuint gl_buffer = r->gl_stream_buffer;
+            if (!pgraph_gl_stream_data(r, attr->inline_buffer, size,
+                                       sizeof(float) * 4, &offset)) {
+                gl_buffer = r->gl_inline_buffer[i];
+                glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+                glBufferData(GL_ARRAY_BUFFER, size, attr->inline_buffer,
+                             GL_STREAM_DRAW);
+            }
+            sources[i] = (VertexAttribSource){
+                .gl_buffer = gl_buffer,
+                .offset = offset,
+                .stride = sizeof(float) * 4,
+                .gl_count = 4,
+                .gl_type = GL_FLOAT,
+                .gl_normalize = GL_FALSE,
+            };
+            memcpy(attr->inline_value,
+                   attr->inline_buffer + (pg->inline_buffer_length - 1) * 4,
+                   sizeof(attr->inline_value));
         }
 
-        glDrawArrays(r->shader_binding->gl_primitive_mode,
-                     0, pg->inline_buffer_length);
+        pgraph_gl_bind_vertex_sources(pg, sources);
+        pg->inline_buffer_attrs = 0;
+
+        draw_arrays(r, pg->inline_buffer_length);
     } else if (pg->inline_array_length) {
         NV2A_GL_DPRINTF(false, "Inline Array");
         nv2a_profile_inc_counter(NV2A_PROF_INLINE_ARRAYS);
 
         unsigned int index_count = pgraph_gl_bind_inline_array(d);
-        glDrawArrays(r->shader_binding->gl_primitive_mode,
-                     0, index_count);
+        draw_arrays(r, index_count);
     } else {
         NV2A_GL_DPRINTF(true, "EMPTY NV097_SET_BEGIN_END");
         NV2A_UNCONFIRMED("EMPTY NV097_SET_BEGIN_END");
@@ -26,11 +26,13 @@
 
 GloContext *g_nv2a_context_render;
 GloContext *g_nv2a_context_display;
+GloContext *g_nv2a_context_shader_loader;
 
 static void early_context_init(void)
 {
     g_nv2a_context_render = glo_context_create();
     g_nv2a_context_display = glo_context_create();
+    g_nv2a_context_shader_loader = glo_context_create();
 
     // Note: Due to use of shared contexts, this must happen after some other
     // context is created so the temporary context will not become the thread
@@ -61,6 +63,8 @@ static void pgraph_gl_init(NV2AState *d, Error **errp)
     /*  Internal RGB565 texture format */
     assert(glo_check_extension("GL_ARB_ES2_compatibility"));
 
+    pgraph_gl_invalidate_state_cache(r);
+
     glGetFloatv(GL_SMOOTH_LINE_WIDTH_RANGE, r->supported_smooth_line_width_range);
     glGetFloatv(GL_ALIASED_LINE_WIDTH_RANGE, r->supported_aliased_line_width_range);
 
@@ -78,6 +82,13 @@ static void pgraph_gl_init(NV2AState *d, Error **errp)
 
     r->supported_extensions.texture_filter_anisotropic =
         glo_check_extension("GL_EXT_texture_filter_anisotropic");
+    /* Compressed 3D textures, in the block order used by NV2A */
+    r->supported_extensions.texture_compression_vtc =
+        glo_check_extension("GL_NV_texture_compression_vtc");
+    r->supported_extensions.multi_bind =
+        glo_check_extension("GL_ARB_multi_bind");
+    r->supported_extensions.vertex_attrib_binding =
+        glo_check_extension("GL_ARB_vertex_attrib_binding");
 }
 
 static void pgraph_gl_finalize(NV2AState *d)
@@ -101,13 +112,28 @@ static void pgraph_gl_finalize(NV2AState *d)
 
 static void pgraph_gl_flip_stall(NV2AState *d)
 {
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+
     NV2A_GL_DFRAME_TERMINATOR();
     glFinish();
+
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_TEXTURE, &r->texture_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_SHADER, &r->shader_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_SHADER_MODULE,
+                              &r->shader_module_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_ELEMENT, &r->element_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_VERTEX_ARRAY,
+                              &r->vertex_array_cache);
 }
 
 static void pgraph_gl_flush(NV2AState *d)
 {
-    pgraph_gl_surface_flush(d);
+    if (qatomic_read(&d->pgraph.flush_revalidate)) {
+        pgraph_gl_surface_revalidate(d);
+        qatomic_set(&d->pgraph.flush_revalidate, false);
+    } else {
+        pgraph_gl_surface_flush(d);
+    }
     pgraph_gl_mark_textures_possibly_dirty(d, 0, memory_region_size(d->vram));
     pgraph_gl_update_entire_memory_buffer(d);
     /* FIXME: Flush more? */
@@ -208,6 +234,7 @@ static PGRAPHRenderer pgraph_gl_renderer = {
         .get_surface_scale_factor = pgraph_gl_get_surface_scale_factor,
         .get_framebuffer_surface = pgraph_gl_get_framebuffer_surface,
         .get_gpu_properties = pgraph_gl_get_gpu_properties,
+        .prewarm_shader_state = pgraph_gl_prewarm_shader_state,
     }
 };
 
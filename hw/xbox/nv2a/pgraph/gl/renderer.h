@@ -61,26 +61,35 @@ typedef struct SurfaceBinding {
     bool draw_dirty;
     bool download_pending;
     bool upload_pending;
+    int cpu_read_frame_time; // Last frame the CPU waited for a download
+    int cpu_read_frames; // Consecutive frames the CPU waited for a download
+
+    uint64_t vram_hash; // Of VRAM when last synchronized with the texture
+    bool vram_hash_valid;
 
     GLuint gl_buffer;
+    size_t gl_buffer_size; // Of the scaled texture, for memory accounting
     SurfaceFormatInfo fmt;
 } SurfaceBinding;
 
+#define NV2A_GL_SURFACE_READBACK_SLOTS 2
+
+typedef struct SurfaceReadback {
+    GLuint gl_buffer; // GL_PIXEL_PACK_BUFFER
+    size_t buffer_size;
+    GLsync fence;
+    SurfaceBinding *surface; // NULL if slot is free
+    int draw_time; // Surface draw_time when the readback was issued
+} SurfaceReadback;
+
 typedef struct TextureBinding {
     unsigned int refcnt;
     int draw_time;
     uint64_t data_hash;
     unsigned int scale;
-    unsigned int min_filter;
-    unsigned int mag_filter;
-    uint32_t lod_bias;
-    unsigned int addru;
-    unsigned int addrv;
-    unsigned int addrp;
-    uint32_t border_color;
-    bool border_color_set;
     GLenum gl_target;
     GLuint gl_texture;
+    size_t memory_size; // Estimated, for memory accounting
 } TextureBinding;
 
 typedef struct ShaderModuleCacheKey {
@@ -107,6 +116,12 @@ typedef struct ShaderModuleCacheEntry {
     GLuint gl_shader;
 } ShaderModuleCacheEntry;
 
+enum {
+    NV2A_GL_UNIFORM_BLOCK_VSH,
+    NV2A_GL_UNIFORM_BLOCK_PSH,
+    NV2A_GL_UNIFORM_BLOCK__COUNT
+};
+
 typedef struct ShaderBinding {
     LruNode node;
     bool initialized;
@@ -118,13 +133,21 @@ typedef struct ShaderBinding {
     ShaderState state;
     QemuThread *save_thread;
 
+    bool link_pending; // Linking in the background, see async_shaders
+    GLsync load_fence; // Program binary loaded on the shader loader context
     GLuint gl_program;
     GLenum gl_primitive_mode;
 
+    // Byte offsets into the std140 uniform blocks, -1 if unused
     struct {
         PshUniformLocs psh;
         VshUniformLocs vsh;
     } uniform_locs;
+    struct {
+        PshUniformLocs psh;
+        VshUniformLocs vsh;
+    } uniform_strides;
+    GLint uniform_block_sizes[NV2A_GL_UNIFORM_BLOCK__COUNT];
 } ShaderBinding;
 
 typedef struct VertexKey {
@@ -144,6 +167,38 @@ typedef struct VertexLruNode {
     GLuint gl_buffer;
 } VertexLruNode;
 
+/* Where an attribute is read from, gl_buffer is 0 if it uses its inline value */
+typedef struct VertexAttribSource {
+    GLuint gl_buffer;
+    GLintptr offset;
+    GLsizei stride;
+    GLint gl_count;
+    GLenum gl_type;
+    GLboolean gl_normalize;
+    bool integer;
+} VertexAttribSource;
+
+/* Attribute format layout, independent of buffer and base offset */
+typedef struct VertexArrayKey {
+    uint16_t enabled;
+    struct {
+        GLint gl_count;
+        GLenum gl_type;
+        GLboolean gl_normalize;
+        bool integer;
+        uint8_t binding;
+        GLuint relative_offset;
+    } attrs[NV2A_VERTEXSHADER_ATTRIBUTES];
+} VertexArrayKey;
+
+typedef struct VertexArrayLruNode {
+    LruNode node;
+    VertexArrayKey key;
+    bool initialized;
+
+    GLuint gl_vertex_array;
+} VertexArrayLruNode;
+
 typedef struct TextureKey {
     TextureShape state;
     hwaddr texture_vram_offset;
@@ -167,6 +222,30 @@ typedef struct QueryReport {
     GLuint *queries;
 } QueryReport;
 
+#define NV2A_GL_STREAM_BUFFER_SEGMENTS 4
+
+typedef struct GLStateCache {
+    uint32_t caps_known;
+    uint32_t caps_enabled;
+    GLboolean color_mask[4];
+    GLboolean depth_mask;
+    GLuint stencil_mask;
+    GLenum blend_sfactor, blend_dfactor;
+    GLenum blend_equation;
+    GLfloat blend_color[4];
+    GLenum cull_face;
+    GLenum front_face;
+    GLenum depth_func;
+    GLenum stencil_func;
+    GLint stencil_ref;
+    GLuint stencil_func_mask;
+    GLenum stencil_op[3];
+    GLenum provoking_vertex;
+    GLfloat line_width;
+    GLint viewport[4];
+    GLint scissor[4];
+} GLStateCache;
+
 typedef struct PGRAPHGLState {
     GLuint gl_framebuffer;
     GLuint gl_display_buffer;
@@ -180,29 +259,67 @@ typedef struct PGRAPHGLState {
     VertexLruNode *element_cache_entries;
     GLuint gl_inline_array_buffer;
     GLuint gl_memory_buffer;
+    uint8_t *gl_memory_buffer_map; // Persistent coherent mapping, if supported
+    bool gl_memory_buffer_in_use; // Read by draws since it was last written
+    uint32_t *gl_memory_buffer_vram_gens; // VRAM generations last copied in
+    bool gl_memory_buffer_pinned; // Guest VRAM itself, nothing is copied
+    unsigned long *gl_memory_buffer_committed; // Sparse pages backed, if sparse
+    GLint gl_memory_buffer_page_size; // Of sparse commitment
+    uint64_t gl_memory_buffer_resident; // Bytes allocated by the driver
     GLuint gl_vertex_array;
+    Lru vertex_array_cache;
+    VertexArrayLruNode *vertex_array_cache_entries;
+    GLint max_vertex_attrib_relative_offset;
     GLuint gl_inline_buffer[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLuint gl_inline_array_source; // Holds the inline array of the draw
+    GLintptr inline_array_source_offset;
+    uint64_t element_hashes_seen[1024]; // Streamed once, cached if repeated
+    GLuint gl_quad_index_buffers[2]; // Quads and quad strips as triangles
+    unsigned int quad_index_buffer_counts[2];
+
+    // Ring for per-draw data, fenced a segment at a time
+    GLuint gl_stream_buffer;
+    uint8_t *gl_stream_buffer_map; // Persistent mapping, if supported
+    size_t stream_buffer_offset;
+    int stream_buffer_segment;
+    GLsync stream_buffer_fences[NV2A_GL_STREAM_BUFFER_SEGMENTS];
+
+    GLStateCache state_cache; // Render context state, see state.c
 
     QTAILQ_HEAD(, SurfaceBinding) surfaces;
+    uint32_t *surface_vram_gens; // VRAM generations last checked by surfaces
     SurfaceBinding *color_binding, *zeta_binding;
     bool downloads_pending;
     QemuEvent downloads_complete;
     bool download_dirty_surfaces_pending;
     QemuEvent dirty_surfaces_download_complete; // common
+    SurfaceReadback surface_readbacks[NV2A_GL_SURFACE_READBACK_SLOTS];
+    int next_surface_readback;
 
     TextureBinding *texture_binding[NV2A_MAX_TEXTURES];
     Lru texture_cache;
     TextureLruNode *texture_cache_entries;
+    GHashTable *sampler_cache; // SamplerKey -> GL sampler object
+    GLenum texture_unit_targets[NV2A_MAX_TEXTURES];
 
     Lru shader_cache;
     ShaderBinding *shader_cache_entries;
     ShaderBinding *shader_binding;
     QemuMutex shader_cache_lock;
     QemuThread shader_disk_thread;
+    bool shader_preload_cancel;
+    int async_shaders; // CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_*
+    bool draw_skipped; // Shaders of the current draw are not linked yet
+    bool cpu_vertex_programs; // Transform tiny inline arrays on the CPU
 
     Lru shader_module_cache;
     ShaderModuleCacheEntry *shader_module_cache_entries;
 
+    GLuint gl_uniform_buffers[NV2A_GL_UNIFORM_BLOCK__COUNT];
+    GLint uniform_buffer_sizes[NV2A_GL_UNIFORM_BLOCK__COUNT];
+    uint8_t *uniform_block_data[NV2A_GL_UNIFORM_BLOCK__COUNT];
+    uint64_t uniform_buffer_hashes[NV2A_GL_UNIFORM_BLOCK__COUNT];
+
     unsigned int zpass_pixel_count_result;
     unsigned int gl_zpass_pixel_count_query_count;
     GLuint *gl_zpass_pixel_count_queries;
@@ -237,16 +354,23 @@ typedef struct PGRAPHGLState {
 
     struct supported_extensions {
         GLboolean texture_filter_anisotropic;
+        GLboolean texture_compression_vtc;
+        GLboolean multi_bind;
+        GLboolean vertex_attrib_binding;
     } supported_extensions;
 } PGRAPHGLState;
 
 extern GloContext *g_nv2a_context_render;
 extern GloContext *g_nv2a_context_display;
+extern GloContext *g_nv2a_context_shader_loader;
 
 unsigned int pgraph_gl_bind_inline_array(NV2AState *d);
-void pgraph_gl_bind_shaders(PGRAPHState *pg);
+bool pgraph_gl_bind_shaders(PGRAPHState *pg);
+void pgraph_gl_prewarm_shader_state(NV2AState *d, const ShaderState *state);
 void pgraph_gl_bind_textures(NV2AState *d);
 void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element, unsigned int max_element, bool inline_data, unsigned int inline_stride, unsigned int provoking_element);
+unsigned int pgraph_gl_bind_quad_indices(PGRAPHGLState *r, enum ShaderPrimitiveMode primitive_mode, unsigned int vertex_count);
+void pgraph_gl_bind_vertex_sources(PGRAPHState *pg, const VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES]);
 bool pgraph_gl_check_surface_to_texture_compatibility(const SurfaceBinding *surface, const TextureShape *shape);
 GLuint pgraph_gl_compile_shader(const char *vs_src, const char *fs_src);
 void pgraph_gl_download_dirty_surfaces(NV2AState *d);
@@ -260,9 +384,35 @@ void pgraph_gl_image_blit(NV2AState *d);
 void pgraph_gl_mark_textures_possibly_dirty(NV2AState *d, hwaddr addr, hwaddr size);
 void pgraph_gl_process_pending_reports(NV2AState *d);
 void pgraph_gl_surface_flush(NV2AState *d);
+void pgraph_gl_surface_revalidate(NV2AState *d);
 void pgraph_gl_surface_update(NV2AState *d, bool upload, bool color_write, bool zeta_write);
 void pgraph_gl_sync(NV2AState *d);
 void pgraph_gl_update_entire_memory_buffer(NV2AState *d);
+bool pgraph_gl_stream_data(PGRAPHGLState *r, const void *data, size_t size,
+                           size_t align, GLintptr *offset);
+void pgraph_gl_invalidate_state_cache(PGRAPHGLState *r);
+void pgraph_gl_set_capability(PGRAPHGLState *r, GLenum cap, bool enable);
+void pgraph_gl_set_color_mask(PGRAPHGLState *r, bool red, bool green,
+                              bool blue, bool alpha);
+void pgraph_gl_set_depth_mask(PGRAPHGLState *r, bool enable);
+void pgraph_gl_set_stencil_mask(PGRAPHGLState *r, GLuint mask);
+void pgraph_gl_set_blend_func(PGRAPHGLState *r, GLenum sfactor,
+                              GLenum dfactor);
+void pgraph_gl_set_blend_equation(PGRAPHGLState *r, GLenum mode);
+void pgraph_gl_set_blend_color(PGRAPHGLState *r, const GLfloat color[4]);
+void pgraph_gl_set_cull_face(PGRAPHGLState *r, GLenum mode);
+void pgraph_gl_set_front_face(PGRAPHGLState *r, GLenum mode);
+void pgraph_gl_set_depth_func(PGRAPHGLState *r, GLenum func);
+void pgraph_gl_set_stencil_func(PGRAPHGLState *r, GLenum func, GLint ref,
+                                GLuint mask);
+void pgraph_gl_set_stencil_op(PGRAPHGLState *r, GLenum sfail, GLenum dpfail,
+                              GLenum dppass);
+void pgraph_gl_set_provoking_vertex(PGRAPHGLState *r, GLenum mode);
+void pgraph_gl_set_line_width(PGRAPHGLState *r, GLfloat width);
+void pgraph_gl_set_viewport(PGRAPHGLState *r, GLint x, GLint y,
+                            GLsizei width, GLsizei height);
+void pgraph_gl_set_scissor(PGRAPHGLState *r, GLint x, GLint y, GLsizei width,
+                           GLsizei height);
 void pgraph_gl_init_display(NV2AState *d);
 void pgraph_gl_finalize_display(PGRAPHState *pg);
 void pgraph_gl_init_reports(NV2AState *d);
@@ -286,7 +436,6 @@ void pgraph_gl_surface_invalidate(NV2AState *d, SurfaceBinding *e);
 void pgraph_gl_unbind_surface(NV2AState *d, bool color);
 void pgraph_gl_upload_surface_data(NV2AState *d, SurfaceBinding *surface, bool force);
 void pgraph_gl_shader_cache_to_disk(ShaderBinding *snode);
-bool pgraph_gl_shader_load_from_memory(ShaderBinding *snode);
 void pgraph_gl_shader_write_cache_reload_list(PGRAPHState *pg);
 void pgraph_gl_set_surface_scale_factor(NV2AState *d, unsigned int scale);
 unsigned int pgraph_gl_get_surface_scale_factor(NV2AState *d);
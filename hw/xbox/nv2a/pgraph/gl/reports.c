@@ -54,6 +54,24 @@ static void process_pending_report(NV2AState *d, QueryReport *report)
     pgraph_write_zpass_pixel_cnt_report(d, report->parameter, r->zpass_pixel_count_result);
 }
 
+static bool is_report_available(QueryReport *report)
+{
+    if (report->clear) {
+        return true;
+    }
+
+    for (int i = 0; i < report->query_count; i++) {
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(report->queries[i], GL_QUERY_RESULT_AVAILABLE,
+                            &available);
+        if (!available) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void pgraph_gl_process_pending_reports(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
@@ -61,6 +79,10 @@ void pgraph_gl_process_pending_reports(NV2AState *d)
     QueryReport *report, *next;
 
     QSIMPLEQ_FOREACH_SAFE(report, &r->report_queue, entry, next) {
+        /* The guest already has a value, so don't stall on the GPU */
+        if (pg->optimistic_zpass_reports && !is_report_available(report)) {
+            break;
+        }
         process_pending_report(d, report);
         QSIMPLEQ_REMOVE_HEAD(&r->report_queue, entry);
         g_free(report);
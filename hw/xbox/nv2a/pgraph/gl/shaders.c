@@ -21,17 +21,29 @@
 
 #include "qemu/osdep.h"
 #include "qemu/fast-hash.h"
-#include "qemu/mstring.h"
 
 #include "xemu-version.h"
 #include "ui/xemu-settings.h"
+#include "ui/xemu-notifications.h"
 #include "hw/xbox/nv2a/pgraph/util.h"
+#include "hw/xbox/xbox_mem.h"
 #include "debug.h"
 #include "renderer.h"
 
-static GLenum get_gl_primitive_mode(enum ShaderPolygonMode polygon_mode, enum ShaderPrimitiveMode primitive_mode)
+/* The geometry state the program is generated for, see generate_shaders() */
+static GeomState get_program_geom_state(const ShaderState *state)
 {
-    switch (primitive_mode) {
+    GeomState geom = state->geom;
+    pgraph_glsl_expand_quads(&geom, pgraph_gl_get_gpu_properties());
+    return geom;
+}
+
+static GLenum get_gl_primitive_mode(const ShaderState *state)
+{
+    GeomState geom = get_program_geom_state(state);
+    enum ShaderPolygonMode polygon_mode = geom.polygon_front_mode;
+
+    switch (geom.primitive_mode) {
     case PRIM_TYPE_POINTS: return GL_POINTS;
     case PRIM_TYPE_LINES: return GL_LINES;
     case PRIM_TYPE_LINE_LOOP: return GL_LINE_LOOP;
@@ -58,7 +70,8 @@ static GLenum get_gl_primitive_mode(enum ShaderPolygonMode polygon_mode, enum Sh
 
 static GLuint create_gl_shader(GLenum gl_shader_type,
                                const char *code,
-                               const char *name)
+                               const char *name,
+                               bool deferred_check)
 {
     GLint compiled = 0;
 
@@ -70,6 +83,15 @@ static GLuint create_gl_shader(GLenum gl_shader_type,
     glShaderSource(shader, 1, &code, 0);
     glCompileShader(shader);
 
+    /*
+     * Querying the status would wait for the driver's compiler thread, so
+     * leave it to the link of the first program using the shader.
+     */
+    if (deferred_check) {
+        NV2A_GL_DGROUP_END();
+        return shader;
+    }
+
     /* Check it compiled */
     compiled = 0;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
@@ -91,77 +113,116 @@ static GLuint create_gl_shader(GLenum gl_shader_type,
     return shader;
 }
 
-static void set_texture_sampler_uniforms(ShaderBinding *binding)
+static void set_texture_sampler_uniforms(GLuint program)
 {
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
         char samplerName[16];
         snprintf(samplerName, sizeof(samplerName), "texSamp%d", i);
-        GLint texSampLoc =
-            glGetUniformLocation(binding->gl_program, samplerName);
+        GLint texSampLoc = glGetUniformLocation(program, samplerName);
         if (texSampLoc >= 0) {
             glUniform1i(texSampLoc, i);
         }
     }
 }
 
-static void update_shader_uniform_locs(ShaderBinding *binding)
+static void get_uniform_block_layout(GLuint program, const char *block_name,
+                                     GLuint block_binding,
+                                     const UniformInfo *info, size_t count,
+                                     int *offsets, int *strides, GLint *size)
 {
     char tmp[64];
 
-    for (int i = 0; i < ARRAY_SIZE(binding->uniform_locs.vsh); i++) {
-        const char *name = VshUniformInfo[i].name;
-        if (VshUniformInfo[i].count > 1) {
-            snprintf(tmp, sizeof(tmp), "%s[0]", name);
-            name = tmp;
-        }
-        binding->uniform_locs.vsh[i] = glGetUniformLocation(binding->gl_program, name);
+    for (int i = 0; i < count; i++) {
+        offsets[i] = -1;
+        strides[i] = 0;
+    }
+    *size = 0;
+
+    GLuint block_index = glGetUniformBlockIndex(program, block_name);
+    if (block_index == GL_INVALID_INDEX) {
+        return;
     }
 
-    for (int i = 0; i < ARRAY_SIZE(binding->uniform_locs.psh); i++) {
-        const char *name = PshUniformInfo[i].name;
-        if (PshUniformInfo[i].count > 1) {
+    /* Bindings are not kept across glProgramBinary, so always assign it */
+    glUniformBlockBinding(program, block_index, block_binding);
+    glGetActiveUniformBlockiv(program, block_index, GL_UNIFORM_BLOCK_DATA_SIZE,
+                              size);
+
+    for (int i = 0; i < count; i++) {
+        const char *name = info[i].name;
+        if (info[i].count > 1) {
             snprintf(tmp, sizeof(tmp), "%s[0]", name);
             name = tmp;
         }
-        binding->uniform_locs.psh[i] = glGetUniformLocation(binding->gl_program, name);
+
+        GLuint index;
+        glGetUniformIndices(program, 1, &name, &index);
+        if (index == GL_INVALID_INDEX) {
+            continue;
+        }
+        glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_OFFSET,
+                              &offsets[i]);
+        glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_ARRAY_STRIDE,
+                              &strides[i]);
     }
 }
 
+static void update_shader_uniform_locs(ShaderBinding *binding)
+{
+    get_uniform_block_layout(
+        binding->gl_program, "VshUniforms", NV2A_GL_UNIFORM_BLOCK_VSH,
+        VshUniformInfo, VshUniform__COUNT, binding->uniform_locs.vsh,
+        binding->uniform_strides.vsh,
+        &binding->uniform_block_sizes[NV2A_GL_UNIFORM_BLOCK_VSH]);
+    get_uniform_block_layout(
+        binding->gl_program, "PshUniforms", NV2A_GL_UNIFORM_BLOCK_PSH,
+        PshUniformInfo, PshUniform__COUNT, binding->uniform_locs.psh,
+        binding->uniform_strides.psh,
+        &binding->uniform_block_sizes[NV2A_GL_UNIFORM_BLOCK_PSH]);
+}
+
 static void shader_module_cache_entry_init(Lru *lru, LruNode *node,
                                            const void *key)
 {
+    PGRAPHGLState *r = container_of(lru, PGRAPHGLState, shader_module_cache);
     ShaderModuleCacheEntry *module =
         container_of(node, ShaderModuleCacheEntry, node);
     memcpy(&module->key, key, sizeof(ShaderModuleCacheKey));
 
     const char *kind_str;
-    MString *code;
+    ShaderCodeKey code_key;
+    memset(&code_key, 0, sizeof(code_key));
 
     switch (module->key.kind) {
     case GL_VERTEX_SHADER:
         kind_str = "vertex shader";
-        code = pgraph_glsl_gen_vsh(&module->key.vsh.state,
-                                   module->key.vsh.glsl_opts);
+        code_key.stage = SHADER_CODE_VERTEX;
+        memcpy(&code_key.vsh, &module->key.vsh, sizeof(code_key.vsh));
         break;
     case GL_GEOMETRY_SHADER:
         kind_str = "geometry shader";
-        code = pgraph_glsl_gen_geom(&module->key.geom.state,
-                                    module->key.geom.glsl_opts);
+        code_key.stage = SHADER_CODE_GEOMETRY;
+        memcpy(&code_key.geom, &module->key.geom, sizeof(code_key.geom));
         break;
     case GL_FRAGMENT_SHADER:
         kind_str = "fragment shader";
-        code = pgraph_glsl_gen_psh(&module->key.psh.state,
-                                   module->key.psh.glsl_opts);
+        code_key.stage = SHADER_CODE_FRAGMENT;
+        memcpy(&code_key.psh, &module->key.psh, sizeof(code_key.psh));
         break;
     default:
         assert(!"Invalid shader module kind");
-        kind_str = "unknown";
-        code = NULL;
+        return;
     }
 
-    module->gl_shader =
-        create_gl_shader(module->key.kind, mstring_get_str(code), kind_str);
-    mstring_unref(code);
+    int64_t start = nv2a_profile_cpu_time_begin();
+    g_autofree char *code = pgraph_glsl_get_shader_code(&code_key);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SHADER_GEN, kind_str, start);
+
+    start = nv2a_profile_cpu_time_begin();
+    module->gl_shader = create_gl_shader(
+        module->key.kind, code, kind_str,
+        r->async_shaders != CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_DISABLED);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SHADER_COMPILE, kind_str, start);
 }
 
 static void shader_module_cache_entry_post_evict(Lru *lru, LruNode *node)
@@ -194,13 +255,18 @@ static void generate_shaders(PGRAPHGLState *r, ShaderBinding *binding)
     GLuint program = glCreateProgram();
 
     ShaderState *state = &binding->state;
+    pgraph_glsl_dump_shader_state(state);
+    pgraph_glsl_record_shader_state(state);
+
     ShaderModuleCacheKey key;
 
-    bool need_geometry_shader = pgraph_glsl_need_geom(&state->geom);
+    /* Quads drawn as triangle lists share the triangle geometry shader */
+    GeomState geom = get_program_geom_state(state);
+    bool need_geometry_shader = pgraph_glsl_need_geom(&geom);
     if (need_geometry_shader) {
         memset(&key, 0, sizeof(key));
         key.kind = GL_GEOMETRY_SHADER;
-        key.geom.state = state->geom;
+        key.geom.state = geom;
         glAttachShader(program, get_shader_module_for_key(r, &key));
     }
 
@@ -218,10 +284,49 @@ static void generate_shaders(PGRAPHGLState *r, ShaderBinding *binding)
     glAttachShader(program, get_shader_module_for_key(r, &key));
 
     /* link the program */
+    int64_t start = nv2a_profile_cpu_time_begin();
     glLinkProgram(program);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SHADER_COMPILE, "link", start);
+
+    binding->gl_program = program;
+    binding->link_pending = true;
+}
+
+static bool check_shader_link_complete(ShaderBinding *binding)
+{
+    GLint complete = GL_FALSE;
+    glGetProgramiv(binding->gl_program, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete;
+}
+
+static void log_attached_shader_errors(GLuint program)
+{
+    GLuint shaders[3];
+    GLsizei count = 0;
+    glGetAttachedShaders(program, ARRAY_SIZE(shaders), &count, shaders);
+
+    for (int i = 0; i < count; i++) {
+        GLint compiled = 0;
+        glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compiled);
+        if (compiled) {
+            continue;
+        }
+
+        GLchar log[2048];
+        glGetShaderInfoLog(shaders[i], sizeof(log), NULL, log);
+        fprintf(stderr, "nv2a: shader compilation failed: %s\n", log);
+    }
+}
+
+static void finish_shader_link(ShaderBinding *binding)
+{
+    GLuint program = binding->gl_program;
+    ShaderState *state = &binding->state;
+
     GLint linked = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
     if(!linked) {
+        log_attached_shader_errors(program);
         GLchar log[2048];
         glGetProgramInfoLog(program, 2048, NULL, log);
         fprintf(stderr, "nv2a: shader linking failed: %s\n", log);
@@ -230,12 +335,11 @@ static void generate_shaders(PGRAPHGLState *r, ShaderBinding *binding)
 
     glUseProgram(program);
 
-    binding->gl_program = program;
-    binding->gl_primitive_mode = get_gl_primitive_mode(
-        state->geom.polygon_front_mode, state->geom.primitive_mode);
+    binding->link_pending = false;
+    binding->gl_primitive_mode = get_gl_primitive_mode(state);
     binding->initialized = true;
 
-    set_texture_sampler_uniforms(binding);
+    set_texture_sampler_uniforms(program);
 
     /* validate the program */
     GLint valid = 0;
@@ -255,24 +359,14 @@ static const char *shader_gl_vendor = NULL;
 
 static void shader_create_cache_folder(void)
 {
-    char *shader_path = g_strdup_printf("%sshaders", xemu_settings_get_base_path());
+    char *shader_path = g_strdup_printf("%sshaders", xemu_settings_get_cache_path());
     qemu_mkdir(shader_path);
     g_free(shader_path);
 }
 
 static char *shader_get_lru_cache_path(void)
 {
-    return g_strdup_printf("%s/shader_cache_list", xemu_settings_get_base_path());
-}
-
-static void shader_write_lru_list_entry_to_disk(Lru *lru, LruNode *node, void *opaque)
-{
-    FILE *lru_list_file = (FILE*) opaque;
-    size_t written = fwrite(&node->hash, sizeof(uint64_t), 1, lru_list_file);
-    if (written != 1) {
-        fprintf(stderr, "nv2a: Failed to write shader list entry %llx to disk\n",
-                (unsigned long long) node->hash);
-    }
+    return g_strdup_printf("%s/shader_cache_list", xemu_settings_get_cache_path());
 }
 
 void pgraph_gl_shader_write_cache_reload_list(PGRAPHState *pg)
@@ -286,17 +380,29 @@ void pgraph_gl_shader_write_cache_reload_list(PGRAPHState *pg)
     }
 
     char *shader_lru_path = shader_get_lru_cache_path();
+    qatomic_set(&r->shader_preload_cancel, true);
     qemu_thread_join(&r->shader_disk_thread);
 
-    FILE *lru_list = qemu_fopen(shader_lru_path, "wb");
-    g_free(shader_lru_path);
-    if (!lru_list) {
-        fprintf(stderr, "nv2a: Failed to open shader LRU cache for writing\n");
-        return;
+    /* Most recently used first, so they are preloaded in the same order */
+    GArray *hashes = g_array_new(false, false, sizeof(uint64_t));
+    LruNode *node;
+    QTAILQ_FOREACH(node, &r->shader_cache.global, next_global) {
+        if (!lru_is_node_in_use(&r->shader_cache, node)) {
+            continue;
+        }
+        g_array_append_val(hashes, node->hash);
     }
 
-    lru_visit_active(&r->shader_cache, shader_write_lru_list_entry_to_disk, lru_list);
-    fclose(lru_list);
+    /* Replaced whole, as other instances sharing the cache may read it */
+    GError *err = NULL;
+    if (!g_file_set_contents(shader_lru_path, hashes->data,
+                             hashes->len * sizeof(uint64_t), &err)) {
+        fprintf(stderr, "nv2a: Failed to write shader LRU cache: %s\n",
+                err->message);
+        g_error_free(err);
+    }
+    g_array_free(hashes, true);
+    g_free(shader_lru_path);
 
     lru_flush(&r->shader_cache);
 
@@ -304,67 +410,9 @@ void pgraph_gl_shader_write_cache_reload_list(PGRAPHState *pg)
     qemu_event_set(&r->shader_cache_writeback_complete);
 }
 
-bool pgraph_gl_shader_load_from_memory(ShaderBinding *binding)
-{
-    assert(glGetError() == GL_NO_ERROR);
-
-    if (!binding->program) {
-        return false;
-    }
-
-    GLuint gl_program = glCreateProgram();
-    glProgramBinary(gl_program, binding->program_format, binding->program,
-                    binding->program_size);
-    GLint gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        NV2A_DPRINTF(
-            "failed to load shader binary from disk: GL error code %d\n",
-            gl_error);
-        glDeleteProgram(gl_program);
-        return false;
-    }
-
-    GLint link_status = GL_FALSE;
-    glGetProgramiv(gl_program, GL_LINK_STATUS, &link_status);
-    if (!link_status) {
-        NV2A_DPRINTF(
-            "failed to load shader binary from disk: link status is FALSE\n");
-        glDeleteProgram(gl_program);
-        return false;
-    }
-
-    glUseProgram(gl_program);
-
-    g_free(binding->program);
-
-    binding->program = NULL;
-    binding->gl_program = gl_program;
-    binding->gl_primitive_mode =
-        get_gl_primitive_mode(binding->state.geom.polygon_front_mode,
-                              binding->state.geom.primitive_mode);
-    binding->initialized = true;
-
-    set_texture_sampler_uniforms(binding);
-
-    glValidateProgram(gl_program);
-    GLint valid = 0;
-    glGetProgramiv(gl_program, GL_VALIDATE_STATUS, &valid);
-    if (!valid) {
-        GLchar log[1024];
-        glGetProgramInfoLog(gl_program, 1024, NULL, log);
-        NV2A_DPRINTF("failed to load shader binary from disk: %s\n", log);
-        glDeleteProgram(gl_program);
-        return false;
-    }
-
-    update_shader_uniform_locs(binding);
-
-    return true;
-}
-
 static char *shader_get_bin_directory(uint64_t hash)
 {
-    const char *cfg_dir = xemu_settings_get_base_path();
+    const char *cfg_dir = xemu_settings_get_cache_path();
     char *shader_bin_dir =
         g_strdup_printf("%s/shaders/%04x", cfg_dir, (uint32_t)(hash >> 48));
     return shader_bin_dir;
@@ -376,102 +424,128 @@ static char *shader_get_binary_path(const char *shader_bin_dir, uint64_t hash)
     return g_strdup_printf("%s/%012" PRIx64, shader_bin_dir, hash & ~bin_mask);
 }
 
-static void shader_load_from_disk(PGRAPHState *pg, uint64_t hash)
+/*
+ * Runs on the shader loader thread, with g_nv2a_context_shader_loader current.
+ * The program is created in the shared namespace and published in the shader
+ * cache with a fence the render thread waits on before first use.
+ */
+static bool shader_load_from_disk(PGRAPHState *pg, uint64_t hash)
 {
     PGRAPHGLState *r = pg->gl_renderer_state;
 
-    char *shader_bin_dir = shader_get_bin_directory(hash);
-    char *shader_path = shader_get_binary_path(shader_bin_dir, hash);
-    char *cached_xemu_version = NULL;
-    char *cached_gl_vendor = NULL;
-    void *program_buffer = NULL;
-
-    uint64_t cached_xemu_version_len;
-    uint64_t gl_vendor_len;
-    GLenum program_binary_format;
-    ShaderState state;
-    size_t shader_size;
-
-    g_free(shader_bin_dir);
-
     qemu_mutex_lock(&r->shader_cache_lock);
     if (lru_contains_hash(&r->shader_cache, hash)) {
         qemu_mutex_unlock(&r->shader_cache_lock);
-        return;
+        return false;
     }
     qemu_mutex_unlock(&r->shader_cache_lock);
 
-    FILE *shader_file = qemu_fopen(shader_path, "rb");
+    char *shader_bin_dir = shader_get_bin_directory(hash);
+    char *shader_path = shader_get_binary_path(shader_bin_dir, hash);
+    g_free(shader_bin_dir);
+
+    GMappedFile *shader_file = g_mapped_file_new(shader_path, FALSE, NULL);
     if (!shader_file) {
         goto error;
     }
 
-    size_t nread;
-    #define READ_OR_ERR(data, data_len) \
+    const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(shader_file);
+    size_t data_len = g_mapped_file_get_length(shader_file);
+    size_t offset = 0;
+
+    uint64_t cached_xemu_version_len;
+    uint64_t gl_vendor_len;
+    GLenum program_binary_format;
+    ShaderState state;
+    size_t shader_size;
+
+    #define READ_OR_ERR(dst, dst_len) \
+        do { \
+            if (data_len - offset < (dst_len)) { \
+                goto error; \
+            } \
+            memcpy(dst, data + offset, dst_len); \
+            offset += (dst_len); \
+        } while (0)
+    #define MATCH_OR_ERR(str, str_len) \
         do { \
-            nread = fread(data, data_len, 1, shader_file); \
-            if (nread != 1) { \
-                fclose(shader_file); \
+            if ((str_len) != strlen(str) + 1 || \
+                data_len - offset < (str_len) || \
+                memcmp(data + offset, str, str_len) != 0) { \
                 goto error; \
             } \
+            offset += (str_len); \
         } while (0)
 
     READ_OR_ERR(&cached_xemu_version_len, sizeof(cached_xemu_version_len));
-
-    cached_xemu_version = g_malloc(cached_xemu_version_len +1);
-    READ_OR_ERR(cached_xemu_version, cached_xemu_version_len);
-    if (strcmp(cached_xemu_version, xemu_version) != 0) {
-        fclose(shader_file);
-        goto error;
-    }
-
+    MATCH_OR_ERR(xemu_version, cached_xemu_version_len);
     READ_OR_ERR(&gl_vendor_len, sizeof(gl_vendor_len));
-
-    cached_gl_vendor = g_malloc(gl_vendor_len);
-    READ_OR_ERR(cached_gl_vendor, gl_vendor_len);
-    if (strcmp(cached_gl_vendor, shader_gl_vendor) != 0) {
-        fclose(shader_file);
-        goto error;
-    }
-
+    MATCH_OR_ERR(shader_gl_vendor, gl_vendor_len);
     READ_OR_ERR(&program_binary_format, sizeof(program_binary_format));
     READ_OR_ERR(&state, sizeof(state));
     READ_OR_ERR(&shader_size, sizeof(shader_size));
+    if (data_len - offset < shader_size) {
+        goto error;
+    }
 
-    program_buffer = g_malloc(shader_size);
-    READ_OR_ERR(program_buffer, shader_size);
-
+    #undef MATCH_OR_ERR
     #undef READ_OR_ERR
 
-    fclose(shader_file);
-    g_free(shader_path);
-    g_free(cached_xemu_version);
-    g_free(cached_gl_vendor);
+    /* The driver reads the binary straight out of the mapping */
+    GLuint gl_program = glCreateProgram();
+    glProgramBinary(gl_program, program_binary_format, data + offset,
+                    shader_size);
+    g_mapped_file_unref(shader_file);
+    shader_file = NULL;
+
+    GLint link_status = GL_FALSE;
+    GLint gl_error = glGetError();
+    if (gl_error == GL_NO_ERROR) {
+        glGetProgramiv(gl_program, GL_LINK_STATUS, &link_status);
+    }
+    if (!link_status) {
+        NV2A_DPRINTF("failed to load shader binary from disk: GL error %d, "
+                     "link status %d\n", gl_error, link_status);
+        glDeleteProgram(gl_program);
+        goto error;
+    }
+
+    glUseProgram(gl_program);
+    set_texture_sampler_uniforms(gl_program);
+    glUseProgram(0);
 
     qemu_mutex_lock(&r->shader_cache_lock);
     LruNode *node = lru_lookup(&r->shader_cache, hash, &state);
     ShaderBinding *binding = container_of(node, ShaderBinding, node);
 
     /* If we happened to regenerate this shader already, then we may as well use the new one */
-    if (binding->initialized) {
+    if (binding->initialized || binding->link_pending) {
         qemu_mutex_unlock(&r->shader_cache_lock);
-        return;
+        glDeleteProgram(gl_program);
+        g_free(shader_path);
+        return false;
     }
 
-    binding->program_format = program_binary_format;
-    binding->program_size = shader_size;
-    binding->program = program_buffer;
+    binding->gl_program = gl_program;
+    binding->gl_primitive_mode = get_gl_primitive_mode(&binding->state);
+    update_shader_uniform_locs(binding);
+    binding->load_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
     binding->cached = true;
+    binding->initialized = true;
     qemu_mutex_unlock(&r->shader_cache_lock);
-    return;
+
+    g_free(shader_path);
+    return true;
 
 error:
     /* Delete the shader so it won't be loaded again */
+    if (shader_file) {
+        g_mapped_file_unref(shader_file);
+    }
     qemu_unlink(shader_path);
     g_free(shader_path);
-    g_free(program_buffer);
-    g_free(cached_xemu_version);
-    g_free(cached_gl_vendor);
+    return false;
 }
 
 static void *shader_reload_lru_from_disk(void *arg)
@@ -481,19 +555,49 @@ static void *shader_reload_lru_from_disk(void *arg)
     }
 
     PGRAPHState *pg = (PGRAPHState*) arg;
+    PGRAPHGLState *r = pg->gl_renderer_state;
     char *shader_lru_path = shader_get_lru_cache_path();
 
-    FILE *lru_shaders_list = qemu_fopen(shader_lru_path, "rb");
+    gchar *contents;
+    gsize contents_len;
+    bool have_list =
+        g_file_get_contents(shader_lru_path, &contents, &contents_len, NULL);
     g_free(shader_lru_path);
-    if (!lru_shaders_list) {
+    if (!have_list) {
         return NULL;
     }
 
-    uint64_t hash;
-    while (fread(&hash, sizeof(uint64_t), 1, lru_shaders_list) == 1) {
-        shader_load_from_disk(pg, hash);
+    const uint64_t *hashes = (const uint64_t *)contents;
+    size_t num_hashes = contents_len / sizeof(uint64_t);
+    if (num_hashes == 0) {
+        g_free(contents);
+        return NULL;
     }
 
+    char *msg = g_strdup_printf("Loading %zu cached shaders", num_hashes);
+    xemu_queue_notification(msg);
+    g_free(msg);
+
+    glo_set_current(g_nv2a_context_shader_loader);
+
+    size_t num_loaded = 0;
+    for (size_t i = 0; i < num_hashes; i++) {
+        if (qatomic_read(&r->shader_preload_cancel)) {
+            break;
+        }
+        if (shader_load_from_disk(pg, hashes[i])) {
+            num_loaded++;
+        }
+    }
+
+    glo_set_current(NULL);
+    g_free(contents);
+
+    msg = g_strdup_printf("Loaded %zu of %zu cached shaders", num_loaded,
+                          num_hashes);
+    xemu_queue_notification(msg);
+    g_free(msg);
+
     return NULL;
 }
 
@@ -502,6 +606,8 @@ static void shader_cache_entry_init(Lru *lru, LruNode *node, const void *state)
     ShaderBinding *binding = container_of(node, ShaderBinding, node);
     memcpy(&binding->state, state, sizeof(ShaderState));
     binding->initialized = false;
+    binding->link_pending = false;
+    binding->load_fence = NULL;
     binding->cached = false;
     binding->program = NULL;
     binding->save_thread = NULL;
@@ -516,11 +622,16 @@ static void shader_cache_entry_post_evict(Lru *lru, LruNode *node)
         g_free(binding->save_thread);
     }
 
+    if (binding->load_fence) {
+        glDeleteSync(binding->load_fence);
+    }
     glDeleteProgram(binding->gl_program);
     if (binding->program) {
         g_free(binding->program);
     }
 
+    binding->link_pending = false;
+    binding->load_fence = NULL;
     binding->cached = false;
     binding->save_thread = NULL;
     binding->program = NULL;
@@ -546,6 +657,18 @@ void pgraph_gl_init_shaders(PGRAPHState *pg)
 
     shader_create_cache_folder();
 
+    r->async_shaders = g_config.display.opengl.async_shaders;
+    if (r->async_shaders != CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_DISABLED) {
+        if (glo_check_extension("GL_KHR_parallel_shader_compile")) {
+            /* Let the driver pick the number of threads */
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        } else {
+            r->async_shaders = CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_DISABLED;
+        }
+    }
+
+    r->cpu_vertex_programs = g_config.perf.cpu_vertex_programs;
+
     /* FIXME: Make this configurable */
     const size_t shader_cache_size = 50*1024;
     lru_init(&r->shader_cache);
@@ -575,6 +698,14 @@ void pgraph_gl_init_shaders(PGRAPHState *pg)
     r->shader_module_cache.init_node = shader_module_cache_entry_init;
     r->shader_module_cache.compare_nodes = shader_module_cache_entry_compare;
     r->shader_module_cache.post_node_evict = shader_module_cache_entry_post_evict;
+
+    glGenBuffers(NV2A_GL_UNIFORM_BLOCK__COUNT, r->gl_uniform_buffers);
+    for (int i = 0; i < NV2A_GL_UNIFORM_BLOCK__COUNT; i++) {
+        glBindBufferBase(GL_UNIFORM_BUFFER, i, r->gl_uniform_buffers[i]);
+        r->uniform_buffer_sizes[i] = 0;
+        r->uniform_block_data[i] = NULL;
+        r->uniform_buffer_hashes[i] = 0;
+    }
 }
 
 void pgraph_gl_finalize_shaders(PGRAPHState *pg)
@@ -590,6 +721,15 @@ void pgraph_gl_finalize_shaders(PGRAPHState *pg)
     g_free(r->shader_module_cache_entries);
     r->shader_module_cache_entries = NULL;
 
+    glDeleteBuffers(NV2A_GL_UNIFORM_BLOCK__COUNT, r->gl_uniform_buffers);
+    for (int i = 0; i < NV2A_GL_UNIFORM_BLOCK__COUNT; i++) {
+        r->gl_uniform_buffers[i] = 0;
+        g_free(r->uniform_block_data[i]);
+        r->uniform_block_data[i] = NULL;
+        xbox_mem_add(XBOX_MEM_GL_BUFFER, -r->uniform_buffer_sizes[i]);
+        r->uniform_buffer_sizes[i] = 0;
+    }
+
     qemu_mutex_destroy(&r->shader_cache_lock);
 }
 
@@ -613,50 +753,42 @@ static void *shader_write_to_disk(void *arg)
     qemu_mkdir(shader_bin);
     g_free(shader_bin);
 
-    FILE *shader_file = qemu_fopen(shader_path, "wb");
-    if (!shader_file) {
-        goto error;
-    }
-
-    size_t written;
-    #define WRITE_OR_ERR(data, data_size) \
-        do { \
-            written = fwrite(data, data_size, 1, shader_file); \
-            if (written != 1) { \
-                fclose(shader_file); \
-                goto error; \
-            } \
-        } while (0)
+    /*
+     * Written whole and renamed into place, so that other instances sharing
+     * the cache never load a partially written binary.
+     */
+    GByteArray *contents = g_byte_array_new();
+    #define APPEND(data, data_size) \
+        g_byte_array_append(contents, (const guint8 *)(data), (data_size))
 
-    WRITE_OR_ERR(&xemu_version_len, sizeof(xemu_version_len));
-    WRITE_OR_ERR(xemu_version, xemu_version_len);
+    APPEND(&xemu_version_len, sizeof(xemu_version_len));
+    APPEND(xemu_version, xemu_version_len);
 
-    WRITE_OR_ERR(&gl_vendor_len, sizeof(gl_vendor_len));
-    WRITE_OR_ERR(shader_gl_vendor, gl_vendor_len);
+    APPEND(&gl_vendor_len, sizeof(gl_vendor_len));
+    APPEND(shader_gl_vendor, gl_vendor_len);
 
-    WRITE_OR_ERR(&binding->program_format, sizeof(binding->program_format));
-    WRITE_OR_ERR(&binding->state, sizeof(binding->state));
+    APPEND(&binding->program_format, sizeof(binding->program_format));
+    APPEND(&binding->state, sizeof(binding->state));
 
-    WRITE_OR_ERR(&binding->program_size, sizeof(binding->program_size));
-    WRITE_OR_ERR(binding->program, binding->program_size);
+    APPEND(&binding->program_size, sizeof(binding->program_size));
+    APPEND(binding->program, binding->program_size);
 
-    #undef WRITE_OR_ERR
+    #undef APPEND
 
-    fclose(shader_file);
+    GError *err = NULL;
+    if (!g_file_set_contents(shader_path, (const gchar *)contents->data,
+                             contents->len, &err)) {
+        fprintf(stderr, "nv2a: Failed to write shader binary file to %s: %s\n",
+                shader_path, err->message);
+        g_error_free(err);
+    }
+    g_byte_array_unref(contents);
 
     g_free(shader_path);
     g_free(binding->program);
     binding->program = NULL;
 
     return NULL;
-
-error:
-    fprintf(stderr, "nv2a: Failed to write shader binary file to %s\n", shader_path);
-    qemu_unlink(shader_path);
-    g_free(shader_path);
-    g_free(binding->program);
-    binding->program = NULL;
-    return NULL;
 }
 
 void pgraph_gl_shader_cache_to_disk(ShaderBinding *binding)
@@ -693,63 +825,88 @@ void pgraph_gl_shader_cache_to_disk(ShaderBinding *binding)
     qemu_thread_create(binding->save_thread, name, shader_write_to_disk, binding, QEMU_THREAD_JOINABLE);
 }
 
-static void apply_uniform_updates(const UniformInfo *info, int *locs,
-                                  void *values, size_t count)
+static void apply_uniform_updates(const UniformInfo *info, const int *offsets,
+                                  const int *strides, const void *values,
+                                  size_t count, uint8_t *block)
 {
     for (int i = 0; i < count; i++) {
-        if (locs[i] == -1) {
+        if (offsets[i] == -1) {
             continue;
         }
 
-        void *value = (char*)values + info[i].val_offs;
-
-        switch (info[i].type) {
-        case UniformElementType_uint:
-            glUniform1uiv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_int:
-            glUniform1iv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_ivec2:
-            glUniform2iv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_ivec4:
-            glUniform4iv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_float:
-            glUniform1fv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_vec2:
-            glUniform2fv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_vec3:
-            glUniform3fv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_vec4:
-            glUniform4fv(locs[i], info[i].count, value);
-            break;
-        case UniformElementType_mat2:
-            glUniformMatrix2fv(locs[i], info[i].count, GL_FALSE, value);
-            break;
-        default:
-            g_assert_not_reached();
+        const uint8_t *value = (const uint8_t *)values + info[i].val_offs;
+        uint8_t *out = block + offsets[i];
+
+        for (int j = 0; j < info[i].count; j++) {
+            if (info[i].type == UniformElementType_mat2) {
+                /* std140 pads each matrix column to a vec4 */
+                memcpy(out, value, 2 * sizeof(float));
+                memcpy(out + 4 * sizeof(float), value + 2 * sizeof(float),
+                       2 * sizeof(float));
+            } else {
+                memcpy(out, value, info[i].size);
+            }
+            value += info[i].size;
+            out += strides[i];
         }
     }
+}
 
-    assert(glGetError() == GL_NO_ERROR);
+/*
+ * Upload the block with a single glBufferSubData, or not at all if it is
+ * unchanged since the last upload.
+ */
+static void upload_uniform_block(PGRAPHGLState *r, int block, GLint size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    uint64_t hash = fast_hash(r->uniform_block_data[block], size);
+    if (hash == r->uniform_buffer_hashes[block]) {
+        nv2a_profile_inc_counter(NV2A_PROF_SHADER_UBO_NOTDIRTY);
+        return;
+    }
+    r->uniform_buffer_hashes[block] = hash;
+
+    nv2a_profile_inc_counter(NV2A_PROF_SHADER_UBO_DIRTY);
+    glBindBuffer(GL_UNIFORM_BUFFER, r->gl_uniform_buffers[block]);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, r->uniform_block_data[block]);
+}
+
+static void reserve_uniform_block(PGRAPHGLState *r, int block, GLint size)
+{
+    if (size <= r->uniform_buffer_sizes[block]) {
+        return;
+    }
+
+    r->uniform_block_data[block] =
+        g_realloc(r->uniform_block_data[block], size);
+    memset(r->uniform_block_data[block], 0, size);
+    xbox_mem_add(XBOX_MEM_GL_BUFFER, size - r->uniform_buffer_sizes[block]);
+    r->uniform_buffer_sizes[block] = size;
+    r->uniform_buffer_hashes[block] = 0;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, r->gl_uniform_buffers[block]);
+    glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
 }
 
 // FIXME: Dirty tracking
-// FIXME: Consider UBO to align with VK renderer
 static void update_shader_uniforms(PGRAPHState *pg, ShaderBinding *binding)
 {
     PGRAPHGLState *r = pg->gl_renderer_state;
 
+    for (int i = 0; i < NV2A_GL_UNIFORM_BLOCK__COUNT; i++) {
+        reserve_uniform_block(r, i, binding->uniform_block_sizes[i]);
+    }
+
     VshUniformValues vsh_values;
     pgraph_glsl_set_vsh_uniform_values(pg, &binding->state.vsh,
                                   binding->uniform_locs.vsh, &vsh_values);
     apply_uniform_updates(VshUniformInfo, binding->uniform_locs.vsh,
-                          &vsh_values, VshUniform__COUNT);
+                          binding->uniform_strides.vsh, &vsh_values,
+                          VshUniform__COUNT,
+                          r->uniform_block_data[NV2A_GL_UNIFORM_BLOCK_VSH]);
 
     PshUniformValues psh_values;
     pgraph_glsl_set_psh_uniform_values(pg, binding->uniform_locs.psh, &psh_values);
@@ -761,22 +918,60 @@ static void update_shader_uniforms(PGRAPHState *pg, ShaderBinding *binding)
         }
     }
     apply_uniform_updates(PshUniformInfo, binding->uniform_locs.psh,
-                          &psh_values, PshUniform__COUNT);
+                          binding->uniform_strides.psh, &psh_values,
+                          PshUniform__COUNT,
+                          r->uniform_block_data[NV2A_GL_UNIFORM_BLOCK_PSH]);
+
+    for (int i = 0; i < NV2A_GL_UNIFORM_BLOCK__COUNT; i++) {
+        upload_uniform_block(r, i, binding->uniform_block_sizes[i]);
+    }
 }
 
-void pgraph_gl_bind_shaders(PGRAPHState *pg)
+/*
+ * Returns false if the draw has to be skipped because its program is still
+ * being linked.
+ */
+void pgraph_gl_prewarm_shader_state(NV2AState *d, const ShaderState *state)
 {
-    PGRAPHGLState *r = pg->gl_renderer_state;
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
 
-    bool binding_changed = false;
-    if (r->shader_binding &&
-        !pgraph_glsl_check_shader_state_dirty(pg, &r->shader_binding->state)) {
-        nv2a_profile_inc_counter(NV2A_PROF_SHADER_BIND_NOTDIRTY);
-        goto update_uniforms;
+    /* Linking would stall the guest as long as it would on first draw */
+    if (r->async_shaders == CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_DISABLED) {
+        return;
+    }
+
+    qemu_mutex_lock(&r->shader_cache_lock);
+
+    uint64_t shader_state_hash = fast_hash((uint8_t *)state, sizeof(*state));
+    LruNode *node = lru_lookup(&r->shader_cache, shader_state_hash, state);
+    ShaderBinding *binding = container_of(node, ShaderBinding, node);
+
+    /* The link completes in the background, and is finished on first bind */
+    if (!binding->initialized && !binding->link_pending) {
+        generate_shaders(r, binding);
     }
 
+    qemu_mutex_unlock(&r->shader_cache_lock);
+}
+
+bool pgraph_gl_bind_shaders(PGRAPHState *pg)
+{
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    bool binding_changed = false;
     ShaderBinding *old_binding = r->shader_binding;
-    ShaderState state = pgraph_glsl_get_shader_state(pg);
+    ShaderState state;
+
+    if (old_binding) {
+        memcpy(&state, &old_binding->state, sizeof(state));
+        if (!pgraph_glsl_update_shader_state(pg, &state) ||
+            !memcmp(&state, &old_binding->state, sizeof(state))) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_BIND_NOTDIRTY);
+            goto update_uniforms;
+        }
+    } else {
+        state = pgraph_glsl_get_shader_state(pg);
+    }
 
     NV2A_GL_DGROUP_BEGIN("%s (%s)", __func__,
                          state.vsh.is_fixed_function ? "FF" : "PROG");
@@ -789,9 +984,28 @@ void pgraph_gl_bind_shaders(PGRAPHState *pg)
     LruNode *node = lru_lookup(&r->shader_cache, shader_state_hash, &state);
     ShaderBinding *binding = container_of(node, ShaderBinding, node);
 
-    if (!binding->initialized && !pgraph_gl_shader_load_from_memory(binding)) {
+    if (!binding->initialized && !binding->link_pending) {
         nv2a_profile_inc_counter(NV2A_PROF_SHADER_GEN);
         generate_shaders(r, binding);
+    }
+
+    if (binding->load_fence) {
+        glWaitSync(binding->load_fence, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(binding->load_fence);
+        binding->load_fence = NULL;
+        pgraph_glsl_record_shader_state(&binding->state);
+    }
+
+    if (binding->link_pending) {
+        if (r->async_shaders == CONFIG_DISPLAY_OPENGL_ASYNC_SHADERS_SKIP_DRAW &&
+            !check_shader_link_complete(binding)) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_NOT_READY);
+            qemu_mutex_unlock(&r->shader_cache_lock);
+            NV2A_GL_DGROUP_END();
+            return false;
+        }
+
+        finish_shader_link(binding);
         if (g_config.perf.cache_shaders) {
             pgraph_gl_shader_cache_to_disk(binding);
         }
@@ -814,6 +1028,11 @@ update_uniforms:
     assert(r->shader_binding);
     assert(r->shader_binding->initialized);
     update_shader_uniforms(pg, r->shader_binding);
+
+    /* The bound state now reflects the registers */
+    pgraph_clear_dirty_reg_map(pg);
+
+    return true;
 }
 
 GLuint pgraph_gl_compile_shader(const char *vs_src, const char *fs_src)
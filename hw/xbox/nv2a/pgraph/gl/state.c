@@ -0,0 +1,275 @@
+/*
+ * Geforce NV2A PGRAPH OpenGL Renderer
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/xbox/nv2a/nv2a_int.h"
+#include "debug.h"
+#include "renderer.h"
+
+/*
+ * Shadow of the fixed function state set on the render context. Every call
+ * that would not change the driver's state is filtered out. Code setting
+ * this state on the render context must go through these helpers, or call
+ * pgraph_gl_invalidate_state_cache() afterwards.
+ */
+
+static const GLenum tracked_caps[] = {
+    GL_BLEND,
+    GL_CULL_FACE,
+    GL_DEPTH_CLAMP,
+    GL_DEPTH_TEST,
+    GL_DITHER,
+    GL_LINE_SMOOTH,
+    GL_POLYGON_OFFSET_FILL,
+    GL_POLYGON_OFFSET_LINE,
+    GL_POLYGON_OFFSET_POINT,
+    GL_POLYGON_SMOOTH,
+    GL_PROGRAM_POINT_SIZE,
+    GL_SCISSOR_TEST,
+    GL_STENCIL_TEST,
+};
+
+static inline bool state_unchanged(bool unchanged)
+{
+    nv2a_profile_inc_counter(unchanged ? NV2A_PROF_GL_STATE_REDUNDANT :
+                                         NV2A_PROF_GL_STATE_CHANGED);
+    return unchanged;
+}
+
+void pgraph_gl_invalidate_state_cache(PGRAPHGLState *r)
+{
+    /*
+     * All ones is never a valid value for the cached fields (an invalid enum,
+     * a NaN float, an unused GLboolean), so the next call for each goes
+     * through to the driver.
+     */
+    memset(&r->state_cache, 0xff, sizeof(r->state_cache));
+    r->state_cache.caps_known = 0;
+}
+
+void pgraph_gl_set_capability(PGRAPHGLState *r, GLenum cap, bool enable)
+{
+    GLStateCache *c = &r->state_cache;
+
+    int i;
+    for (i = 0; i < ARRAY_SIZE(tracked_caps); i++) {
+        if (tracked_caps[i] == cap) {
+            break;
+        }
+    }
+    assert(i < ARRAY_SIZE(tracked_caps));
+
+    uint32_t bit = 1 << i;
+    if (state_unchanged((c->caps_known & bit) &&
+                        !!(c->caps_enabled & bit) == enable)) {
+        return;
+    }
+
+    c->caps_known |= bit;
+    if (enable) {
+        c->caps_enabled |= bit;
+        glEnable(cap);
+    } else {
+        c->caps_enabled &= ~bit;
+        glDisable(cap);
+    }
+}
+
+void pgraph_gl_set_color_mask(PGRAPHGLState *r, bool red, bool green,
+                              bool blue, bool alpha)
+{
+    GLStateCache *c = &r->state_cache;
+    GLboolean mask[4] = { red, green, blue, alpha };
+
+    if (state_unchanged(!memcmp(c->color_mask, mask, sizeof(mask)))) {
+        return;
+    }
+    memcpy(c->color_mask, mask, sizeof(mask));
+    glColorMask(mask[0], mask[1], mask[2], mask[3]);
+}
+
+void pgraph_gl_set_depth_mask(PGRAPHGLState *r, bool enable)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->depth_mask == enable)) {
+        return;
+    }
+    c->depth_mask = enable;
+    glDepthMask(enable);
+}
+
+void pgraph_gl_set_stencil_mask(PGRAPHGLState *r, GLuint mask)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->stencil_mask == mask)) {
+        return;
+    }
+    c->stencil_mask = mask;
+    glStencilMask(mask);
+}
+
+void pgraph_gl_set_blend_func(PGRAPHGLState *r, GLenum sfactor,
+                              GLenum dfactor)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->blend_sfactor == sfactor &&
+                        c->blend_dfactor == dfactor)) {
+        return;
+    }
+    c->blend_sfactor = sfactor;
+    c->blend_dfactor = dfactor;
+    glBlendFunc(sfactor, dfactor);
+}
+
+void pgraph_gl_set_blend_equation(PGRAPHGLState *r, GLenum mode)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->blend_equation == mode)) {
+        return;
+    }
+    c->blend_equation = mode;
+    glBlendEquation(mode);
+}
+
+void pgraph_gl_set_blend_color(PGRAPHGLState *r, const GLfloat color[4])
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(!memcmp(c->blend_color, color,
+                                sizeof(c->blend_color)))) {
+        return;
+    }
+    memcpy(c->blend_color, color, sizeof(c->blend_color));
+    glBlendColor(color[0], color[1], color[2], color[3]);
+}
+
+void pgraph_gl_set_cull_face(PGRAPHGLState *r, GLenum mode)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->cull_face == mode)) {
+        return;
+    }
+    c->cull_face = mode;
+    glCullFace(mode);
+}
+
+void pgraph_gl_set_front_face(PGRAPHGLState *r, GLenum mode)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->front_face == mode)) {
+        return;
+    }
+    c->front_face = mode;
+    glFrontFace(mode);
+}
+
+void pgraph_gl_set_depth_func(PGRAPHGLState *r, GLenum func)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->depth_func == func)) {
+        return;
+    }
+    c->depth_func = func;
+    glDepthFunc(func);
+}
+
+void pgraph_gl_set_stencil_func(PGRAPHGLState *r, GLenum func, GLint ref,
+                                GLuint mask)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->stencil_func == func && c->stencil_ref == ref &&
+                        c->stencil_func_mask == mask)) {
+        return;
+    }
+    c->stencil_func = func;
+    c->stencil_ref = ref;
+    c->stencil_func_mask = mask;
+    glStencilFunc(func, ref, mask);
+}
+
+void pgraph_gl_set_stencil_op(PGRAPHGLState *r, GLenum sfail, GLenum dpfail,
+                              GLenum dppass)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->stencil_op[0] == sfail &&
+                        c->stencil_op[1] == dpfail &&
+                        c->stencil_op[2] == dppass)) {
+        return;
+    }
+    c->stencil_op[0] = sfail;
+    c->stencil_op[1] = dpfail;
+    c->stencil_op[2] = dppass;
+    glStencilOp(sfail, dpfail, dppass);
+}
+
+void pgraph_gl_set_provoking_vertex(PGRAPHGLState *r, GLenum mode)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->provoking_vertex == mode)) {
+        return;
+    }
+    c->provoking_vertex = mode;
+    glProvokingVertex(mode);
+}
+
+void pgraph_gl_set_line_width(PGRAPHGLState *r, GLfloat width)
+{
+    GLStateCache *c = &r->state_cache;
+
+    if (state_unchanged(c->line_width == width)) {
+        return;
+    }
+    c->line_width = width;
+    glLineWidth(width);
+}
+
+void pgraph_gl_set_viewport(PGRAPHGLState *r, GLint x, GLint y,
+                            GLsizei width, GLsizei height)
+{
+    GLStateCache *c = &r->state_cache;
+    GLint viewport[4] = { x, y, width, height };
+
+    if (state_unchanged(!memcmp(c->viewport, viewport, sizeof(viewport)))) {
+        return;
+    }
+    memcpy(c->viewport, viewport, sizeof(viewport));
+    glViewport(x, y, width, height);
+}
+
+void pgraph_gl_set_scissor(PGRAPHGLState *r, GLint x, GLint y, GLsizei width,
+                           GLsizei height)
+{
+    GLStateCache *c = &r->state_cache;
+    GLint scissor[4] = { x, y, width, height };
+
+    if (state_unchanged(!memcmp(c->scissor, scissor, sizeof(scissor)))) {
+        return;
+    }
+    memcpy(c->scissor, scissor, sizeof(scissor));
+    glScissor(x, y, width, height);
+}
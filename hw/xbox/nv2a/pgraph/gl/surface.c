@@ -23,6 +23,8 @@
 #include "ui/xemu-settings.h"
 #include "hw/xbox/nv2a/nv2a_int.h"
 #include "hw/xbox/nv2a/pgraph/swizzle.h"
+#include "hw/xbox/xbox_mem.h"
+#include "qemu/fast-hash.h"
 #include "debug.h"
 #include "renderer.h"
 
@@ -30,7 +32,12 @@ static void surface_download(NV2AState *d, SurfaceBinding *surface, bool force);
 static void surface_download_to_buffer(NV2AState *d, SurfaceBinding *surface,
                                        bool swizzle, bool flip, bool downscale,
                                        uint8_t *pixels);
-static void surface_get_dimensions(PGRAPHState *pg, unsigned int *width, unsigned int *height);
+static void surface_start_readback(NV2AState *d, SurfaceBinding *surface);
+static SurfaceReadback *find_surface_readback(PGRAPHGLState *r,
+                                              SurfaceBinding *surface);
+static void release_surface_readback(SurfaceReadback *readback);
+
+const int min_cpu_read_frames_for_early_readback = 3;
 
 void pgraph_gl_set_surface_scale_factor(NV2AState *d, unsigned int scale)
 {
@@ -78,18 +85,6 @@ void pgraph_gl_reload_surface_scale_factor(PGRAPHState *pg)
     pg->surface_scale_factor = factor < 1 ? 1 : factor;
 }
 
-// FIXME: Move to common
-static bool framebuffer_dirty(PGRAPHState *pg)
-{
-    bool shape_changed = memcmp(&pg->surface_shape, &pg->last_surface_shape,
-                                sizeof(SurfaceShape)) != 0;
-    if (!shape_changed || (!pg->surface_shape.color_format
-            && !pg->surface_shape.zeta_format)) {
-        return false;
-    }
-    return true;
-}
-
 void pgraph_gl_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
 {
     PGRAPHGLState *r = pg->gl_renderer_state;
@@ -105,6 +100,7 @@ void pgraph_gl_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
 
     if (r->color_binding) {
         r->color_binding->draw_dirty |= color;
+        r->color_binding->vram_hash_valid &= !color;
         r->color_binding->frame_time = pg->frame_time;
         r->color_binding->cleared = false;
 
@@ -112,6 +108,7 @@ void pgraph_gl_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
 
     if (r->zeta_binding) {
         r->zeta_binding->draw_dirty |= zeta;
+        r->zeta_binding->vram_hash_valid &= !zeta;
         r->zeta_binding->frame_time = pg->frame_time;
         r->zeta_binding->cleared = false;
 
@@ -237,6 +234,8 @@ static void render_surface_to(NV2AState *d, SurfaceBinding *surface,
     assert(glGetError() == GL_NO_ERROR);
 
     float color[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    /* Sample with the texture's own parameters, not the stage's sampler */
+    glBindSampler(texture_unit, 0);
     glBindTexture(GL_TEXTURE_2D, surface->gl_buffer);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
@@ -250,14 +249,14 @@ static void render_surface_to(NV2AState *d, SurfaceBinding *surface,
     glProgramUniform2f(r->s2t_rndr.prog,
                        r->s2t_rndr.surface_size_loc, width, height);
 
-    glViewport(0, 0, width, height);
-    glColorMask(true, true, true, true);
-    glDisable(GL_DITHER);
-    glDisable(GL_SCISSOR_TEST);
-    glDisable(GL_BLEND);
-    glDisable(GL_STENCIL_TEST);
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
+    pgraph_gl_set_viewport(r, 0, 0, width, height);
+    pgraph_gl_set_color_mask(r, true, true, true, true);
+    pgraph_gl_set_capability(r, GL_DITHER, false);
+    pgraph_gl_set_capability(r, GL_SCISSOR_TEST, false);
+    pgraph_gl_set_capability(r, GL_BLEND, false);
+    pgraph_gl_set_capability(r, GL_STENCIL_TEST, false);
+    pgraph_gl_set_capability(r, GL_CULL_FACE, false);
+    pgraph_gl_set_capability(r, GL_DEPTH_TEST, false);
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -421,6 +420,36 @@ static bool check_surface_overlaps_range(const SurfaceBinding *surface,
     return !(surface->vram_addr >= range_end || range_start >= surface_end);
 }
 
+static void record_surface_cpu_read(PGRAPHState *pg, SurfaceBinding *surface)
+{
+    if (surface->cpu_read_frame_time == pg->frame_time &&
+        surface->cpu_read_frames > 0) {
+        return;
+    }
+
+    if (surface->cpu_read_frames > 0 &&
+        surface->cpu_read_frame_time == pg->frame_time - 1) {
+        surface->cpu_read_frames += 1;
+    } else {
+        surface->cpu_read_frames = 1;
+    }
+    surface->cpu_read_frame_time = pg->frame_time;
+}
+
+/*
+ * Surfaces the CPU has waited on in each of the last few frames are likely to
+ * be read back again, so start reading them back as soon as rendering to them
+ * ends. The CPU access then only has to wait for the copy out of the pack
+ * buffer instead of a full pipeline drain.
+ */
+static bool check_surface_readback_predicted(PGRAPHState *pg,
+                                             SurfaceBinding *surface)
+{
+    return surface->cpu_read_frames >=
+               min_cpu_read_frames_for_early_readback &&
+           pg->frame_time - surface->cpu_read_frame_time <= 1;
+}
+
 static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
                                     hwaddr len, bool write)
 {
@@ -447,6 +476,7 @@ static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
         if (surface->draw_dirty) {
             surface->download_pending = true;
             wait_for_downloads = true;
+            record_surface_cpu_read(&d->pgraph, surface);
         }
 
         if (write) {
@@ -468,23 +498,19 @@ static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
 
 static void register_cpu_access_callback(NV2AState *d, SurfaceBinding *surface)
 {
-    if (tcg_enabled()) {
-        if (surface->width && surface->height) {
-            surface->access_cb = mem_access_callback_insert(
-                qemu_get_cpu(0), d->vram, surface->vram_addr, surface->size,
-                &surface_access_callback, d);
-        } else {
-            surface->access_cb = NULL;
-        }
+    if (surface->width && surface->height) {
+        surface->access_cb = mem_access_callback_insert(
+            qemu_get_cpu(0), d->vram, surface->vram_addr, surface->size,
+            &surface_access_callback, d);
+    } else {
+        surface->access_cb = NULL;
     }
 }
 
 static void unregister_cpu_access_callback(NV2AState *d,
                                            SurfaceBinding const *surface)
 {
-    if (tcg_enabled()) {
-        mem_access_callback_remove_by_ref(qemu_get_cpu(0), surface->access_cb);
-    }
+    mem_access_callback_remove_by_ref(qemu_get_cpu(0), surface->access_cb);
 }
 
 static bool check_surfaces_overlap(const SurfaceBinding *surface,
@@ -581,7 +607,13 @@ void pgraph_gl_surface_invalidate(NV2AState *d, SurfaceBinding *surface)
 
     unregister_cpu_access_callback(d, surface);
 
+    SurfaceReadback *readback = find_surface_readback(r, surface);
+    if (readback) {
+        release_surface_readback(readback);
+    }
+
     glDeleteTextures(1, &surface->gl_buffer);
+    xbox_mem_add(XBOX_MEM_GL_SURFACE, -(int64_t)surface->gl_buffer_size);
 
     QTAILQ_REMOVE(&r->surfaces, surface, entry);
     g_free(surface);
@@ -679,6 +711,65 @@ static void surface_copy_shrink_row(uint8_t *out, uint8_t *in,
     }
 }
 
+static void bind_surface_for_readback(SurfaceBinding *surface)
+{
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           0, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
+                           0, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                           GL_TEXTURE_2D, 0, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
+                           GL_TEXTURE_2D, surface->gl_buffer, 0);
+
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+}
+
+static void unbind_surface_for_readback(NV2AState *d, SurfaceBinding *surface)
+{
+    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
+                           GL_TEXTURE_2D, 0, 0);
+    bind_current_surface(d);
+}
+
+/*
+ * Convert pixels read back at the current scale factor (`in`, with a row
+ * stride of scale * pitch) into the guest layout of the surface.
+ */
+static void surface_copy_from_readback(PGRAPHState *pg,
+                                       SurfaceBinding *surface, bool swizzle,
+                                       bool downscale, uint8_t *in,
+                                       uint8_t *pixels)
+{
+    uint8_t *linear = in;
+
+    /* FIXME: Replace this with a hw accelerated version */
+    if (downscale) {
+        assert(surface->pitch >= (surface->width * surface->fmt.bytes_per_pixel));
+        linear = swizzle ? (uint8_t *)g_malloc(surface->size) : pixels;
+        uint8_t *out = linear;
+        for (unsigned int y = 0; y < surface->height; y++) {
+            surface_copy_shrink_row(out, in, surface->width,
+                                    surface->fmt.bytes_per_pixel,
+                                    pg->surface_scale_factor);
+            in += surface->pitch * pg->surface_scale_factor *
+                  pg->surface_scale_factor;
+            out += surface->pitch;
+        }
+    }
+
+    if (swizzle) {
+        /* FIXME: Consider swizzle in shader */
+        swizzle_rect(linear, surface->width, surface->height, pixels,
+                     surface->pitch, surface->fmt.bytes_per_pixel);
+        if (downscale) {
+            g_free(linear);
+        }
+    } else if (linear != pixels) {
+        memcpy(pixels, linear, surface->pitch * surface->height);
+    }
+}
+
 static void surface_download_to_buffer(NV2AState *d, SurfaceBinding *surface,
                                        bool swizzle, bool flip, bool downscale,
                                        uint8_t *pixels)
@@ -698,36 +789,20 @@ static void surface_download_to_buffer(NV2AState *d, SurfaceBinding *surface,
         surface->width, surface->height, surface->pitch,
         surface->fmt.bytes_per_pixel);
 
-    /*  Bind destination surface to framebuffer */
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                           0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                           0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                           GL_TEXTURE_2D, 0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
-                           GL_TEXTURE_2D, surface->gl_buffer, 0);
-
-    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    bind_surface_for_readback(surface);
 
     /* Read surface into memory */
     uint8_t *gl_read_buf = pixels;
 
-    uint8_t *swizzle_buf = pixels;
-    if (swizzle) {
-        /* FIXME: Allocate big buffer up front and re-alloc if necessary.
-         * FIXME: Consider swizzle in shader
-         */
-        assert(pg->surface_scale_factor == 1 || downscale);
-        swizzle_buf = (uint8_t *)g_malloc(surface->size);
-        gl_read_buf = swizzle_buf;
-    }
-
     if (downscale) {
         pg->scale_buf = (uint8_t *)g_realloc(
             pg->scale_buf, pg->surface_scale_factor * pg->surface_scale_factor *
                                surface->size);
         gl_read_buf = pg->scale_buf;
+    } else if (swizzle) {
+        /* FIXME: Allocate big buffer up front and re-alloc if necessary. */
+        assert(pg->surface_scale_factor == 1);
+        gl_read_buf = (uint8_t *)g_malloc(surface->size);
     }
 
     glo_readpixels(
@@ -736,30 +811,130 @@ static void surface_download_to_buffer(NV2AState *d, SurfaceBinding *surface,
         pg->surface_scale_factor * surface->width,
         pg->surface_scale_factor * surface->height, flip, gl_read_buf);
 
-    /* FIXME: Replace this with a hw accelerated version */
-    if (downscale) {
-        assert(surface->pitch >= (surface->width * surface->fmt.bytes_per_pixel));
-        uint8_t *out = swizzle_buf, *in = pg->scale_buf;
-        for (unsigned int y = 0; y < surface->height; y++) {
-            surface_copy_shrink_row(out, in, surface->width,
-                                    surface->fmt.bytes_per_pixel,
-                                    pg->surface_scale_factor);
-            in += surface->pitch * pg->surface_scale_factor *
-                  pg->surface_scale_factor;
-            out += surface->pitch;
+    if (gl_read_buf != pixels) {
+        surface_copy_from_readback(pg, surface, swizzle, downscale,
+                                   gl_read_buf, pixels);
+        if (gl_read_buf != pg->scale_buf) {
+            g_free(gl_read_buf);
         }
     }
 
-    if (swizzle) {
-        swizzle_rect(swizzle_buf, surface->width, surface->height, pixels,
-                     surface->pitch, surface->fmt.bytes_per_pixel);
-        g_free(swizzle_buf);
+    unbind_surface_for_readback(d, surface);
+}
+
+static SurfaceReadback *find_surface_readback(PGRAPHGLState *r,
+                                              SurfaceBinding *surface)
+{
+    for (int i = 0; i < NV2A_GL_SURFACE_READBACK_SLOTS; i++) {
+        if (r->surface_readbacks[i].surface == surface) {
+            return &r->surface_readbacks[i];
+        }
     }
+    return NULL;
+}
 
-    /* Re-bind original framebuffer target */
-    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
-                           GL_TEXTURE_2D, 0, 0);
-    bind_current_surface(d);
+static void release_surface_readback(SurfaceReadback *readback)
+{
+    if (readback->fence) {
+        glDeleteSync(readback->fence);
+        readback->fence = 0;
+    }
+    readback->surface = NULL;
+}
+
+/*
+ * Start reading the surface into a pixel pack buffer without waiting for it.
+ * The buffers are used round-robin, so at most NV2A_GL_SURFACE_READBACK_SLOTS
+ * readbacks are in flight and starting another drops the oldest one, whose
+ * surface will then be downloaded synchronously if it is needed.
+ */
+static void surface_start_readback(NV2AState *d, SurfaceBinding *surface)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    if (!surface->width || !surface->height) {
+        return;
+    }
+
+    SurfaceReadback *readback = find_surface_readback(r, surface);
+    if (!readback) {
+        readback = &r->surface_readbacks[r->next_surface_readback];
+        r->next_surface_readback =
+            (r->next_surface_readback + 1) % NV2A_GL_SURFACE_READBACK_SLOTS;
+    }
+    release_surface_readback(readback);
+
+    size_t size = pg->surface_scale_factor * pg->surface_scale_factor *
+                  surface->size;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->gl_buffer);
+    if (readback->buffer_size < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        xbox_mem_add(XBOX_MEM_GL_BUFFER,
+                     (int64_t)size - (int64_t)readback->buffer_size);
+        readback->buffer_size = size;
+    }
+
+    bind_surface_for_readback(surface);
+    glo_readpixels(
+        surface->fmt.gl_format, surface->fmt.gl_type, surface->fmt.bytes_per_pixel,
+        pg->surface_scale_factor * surface->pitch,
+        pg->surface_scale_factor * surface->width,
+        pg->surface_scale_factor * surface->height, false, NULL);
+    unbind_surface_for_readback(d, surface);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback->surface = surface;
+    readback->draw_time = surface->draw_time;
+}
+
+/*
+ * Download the surface from a readback started earlier, if the surface has
+ * not been drawn to since. Returns false if there is none to use.
+ */
+static bool surface_finish_readback(NV2AState *d, SurfaceBinding *surface)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    SurfaceReadback *readback = find_surface_readback(r, surface);
+    if (!readback) {
+        return false;
+    }
+    if (readback->draw_time != surface->draw_time) {
+        release_surface_readback(readback);
+        return false;
+    }
+
+    trace_nv2a_pgraph_surface_download(
+        surface->color ? "COLOR" : "ZETA",
+        surface->swizzle ? "sz" : "lin", surface->vram_addr,
+        surface->width, surface->height, surface->pitch,
+        surface->fmt.bytes_per_pixel);
+
+    glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                     GL_TIMEOUT_IGNORED);
+
+    size_t size = pg->surface_scale_factor * pg->surface_scale_factor *
+                  surface->size;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->gl_buffer);
+    uint8_t *mapped = (uint8_t *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                                  size, GL_MAP_READ_BIT);
+    assert(mapped);
+
+    surface_copy_from_readback(pg, surface, surface->swizzle,
+                               pg->surface_scale_factor != 1, mapped,
+                               d->vram_ptr + surface->vram_addr);
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    release_surface_readback(readback);
+
+    nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_READBACK);
+
+    return true;
 }
 
 static void surface_download(NV2AState *d, SurfaceBinding *surface, bool force)
@@ -773,8 +948,13 @@ static void surface_download(NV2AState *d, SurfaceBinding *surface, bool force)
 
     nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD);
 
-    surface_download_to_buffer(d, surface, true, false, true,
-                               d->vram_ptr + surface->vram_addr);
+    int64_t start = nv2a_profile_cpu_time_begin();
+    if (!surface_finish_readback(d, surface)) {
+        surface_download_to_buffer(d, surface, true, false, true,
+                                   d->vram_ptr + surface->vram_addr);
+    }
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SURF_DOWNLOAD,
+                              surface->color ? "color" : "zeta", start);
 
     memory_region_set_client_dirty(d->vram, surface->vram_addr,
                                    surface->pitch * surface->height,
@@ -782,6 +962,9 @@ static void surface_download(NV2AState *d, SurfaceBinding *surface, bool force)
     memory_region_set_client_dirty(d->vram, surface->vram_addr,
                                    surface->pitch * surface->height,
                                    DIRTY_MEMORY_NV2A_TEX);
+    memory_region_set_client_dirty(d->vram, surface->vram_addr,
+                                   surface->pitch * surface->height,
+                                   DIRTY_MEMORY_SNAPSHOT);
 
     surface->download_pending = false;
     surface->draw_dirty = false;
@@ -809,6 +992,11 @@ void pgraph_gl_download_dirty_surfaces(NV2AState *d)
     SurfaceBinding *surface;
     QTAILQ_FOREACH(surface, &r->surfaces, entry) {
         pgraph_gl_surface_download_if_dirty(d, surface);
+        if (!surface->upload_pending) {
+            surface->vram_hash =
+                fast_hash(d->vram_ptr + surface->vram_addr, surface->size);
+            surface->vram_hash_valid = true;
+        }
     }
 
     qatomic_set(&r->download_dirty_surfaces_pending, false);
@@ -884,6 +1072,9 @@ void pgraph_gl_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     PGRAPHState *pg = &d->pgraph;
 
     surface->upload_pending = false;
+    surface->vram_hash = fast_hash(d->vram_ptr + surface->vram_addr,
+                                   surface->size);
+    surface->vram_hash_valid = true;
     surface->draw_time = pg->draw_time;
 
     if (!surface->width || !surface->height) {
@@ -1065,6 +1256,9 @@ static void populate_surface_binding_entry_sized(NV2AState *d, bool color,
     entry->upload_pending = true;
     entry->download_pending = false;
     entry->draw_dirty = false;
+    entry->vram_hash_valid = false;
+    entry->cpu_read_frame_time = 0;
+    entry->cpu_read_frames = 0;
     entry->dma_addr = dma.address;
     entry->dma_len = dma.limit;
     entry->frame_time = pg->frame_time;
@@ -1081,7 +1275,7 @@ static void populate_surface_binding_entry(NV2AState *d, bool color,
     unsigned int width, height;
 
     if (color || !r->color_binding) {
-        surface_get_dimensions(pg, &width, &height);
+        pgraph_get_surface_dimensions(pg, &width, &height);
         pgraph_apply_anti_aliasing_factor(pg, &width, &height);
 
         /* Since we determine surface dimensions based on the clipping
@@ -1109,9 +1303,9 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
 
     Surface *surface = color ? &pg->surface_color : &pg->surface_zeta;
 
-    bool mem_dirty = !tcg_enabled() && memory_region_test_and_clear_dirty(
-                                           d->vram, entry.vram_addr, entry.size,
-                                           DIRTY_MEMORY_NV2A);
+    bool mem_dirty =
+        !tcg_enabled() && pgraph_vram_check_dirty(d, r->surface_vram_gens,
+                                                  entry.vram_addr, entry.size);
 
     if (upload && (surface->buffer_dirty || mem_dirty)) {
         pgraph_gl_unbind_surface(d, color);
@@ -1228,6 +1422,9 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
             glTexImage2D(GL_TEXTURE_2D, 0, entry.fmt.gl_internal_format, width,
                          height, 0, entry.fmt.gl_format, entry.fmt.gl_type,
                          NULL);
+            entry.gl_buffer_size =
+                (size_t)width * height * entry.fmt.bytes_per_pixel;
+            xbox_mem_add(XBOX_MEM_GL_SURFACE, entry.gl_buffer_size);
             found = surface_put(d, entry.vram_addr, &entry);
 
             /* FIXME: Refactor */
@@ -1275,13 +1472,9 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
     }
 
     if (!upload && surface->draw_dirty) {
-        if (!tcg_enabled()) {
-            /* FIXME: Cannot monitor for reads/writes; flush now */
-            surface_download(d,
-                             color ? r->color_binding :
-                                     r->zeta_binding,
-                             true);
-        }
+        /* Catch the next CPU access to what was drawn */
+        SurfaceBinding *binding = color ? r->color_binding : r->zeta_binding;
+        mem_access_callback_rearm(qemu_get_cpu(0), binding->access_cb);
 
         surface->write_enabled_cache = false;
         surface->draw_dirty = false;
@@ -1293,23 +1486,29 @@ void pgraph_gl_unbind_surface(NV2AState *d, bool color)
     PGRAPHState *pg = &d->pgraph;
     PGRAPHGLState *r = pg->gl_renderer_state;
 
+    SurfaceBinding *surface = color ? r->color_binding : r->zeta_binding;
+    if (!surface) {
+        return;
+    }
+
     if (color) {
-        if (r->color_binding) {
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_COLOR_ATTACHMENT0,
-                                   GL_TEXTURE_2D, 0, 0);
-            r->color_binding = NULL;
-        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, 0, 0);
+        r->color_binding = NULL;
     } else {
-        if (r->zeta_binding) {
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_ATTACHMENT,
-                                   GL_TEXTURE_2D, 0, 0);
-            glFramebufferTexture2D(GL_FRAMEBUFFER,
-                                   GL_DEPTH_STENCIL_ATTACHMENT,
-                                   GL_TEXTURE_2D, 0, 0);
-            r->zeta_binding = NULL;
-        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_DEPTH_ATTACHMENT,
+                               GL_TEXTURE_2D, 0, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_DEPTH_STENCIL_ATTACHMENT,
+                               GL_TEXTURE_2D, 0, 0);
+        r->zeta_binding = NULL;
+    }
+
+    if (surface->draw_dirty && check_surface_readback_predicted(pg, surface)) {
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_EARLY);
+        surface_start_readback(d, surface);
     }
 }
 
@@ -1319,52 +1518,11 @@ void pgraph_gl_surface_update(NV2AState *d, bool upload, bool color_write,
     PGRAPHState *pg = &d->pgraph;
     PGRAPHGLState *r = pg->gl_renderer_state;
 
-    pg->surface_shape.z_format =
-        GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
-                 NV_PGRAPH_SETUPRASTER_Z_FORMAT);
-
-    color_write = color_write &&
-            (pg->clearing || pgraph_color_write_enabled(pg));
-    zeta_write = zeta_write && (pg->clearing || pgraph_zeta_write_enabled(pg));
-
-    if (upload) {
-        bool fb_dirty = framebuffer_dirty(pg);
-        if (fb_dirty) {
-            memcpy(&pg->last_surface_shape, &pg->surface_shape,
-                   sizeof(SurfaceShape));
-            pg->surface_color.buffer_dirty = true;
-            pg->surface_zeta.buffer_dirty = true;
-        }
-
-        if (pg->surface_color.buffer_dirty) {
-            pgraph_gl_unbind_surface(d, true);
-        }
-
-        if (color_write) {
-            update_surface_part(d, true, true);
-        }
-
-        if (pg->surface_zeta.buffer_dirty) {
-            pgraph_gl_unbind_surface(d, false);
-        }
-
-        if (zeta_write) {
-            update_surface_part(d, true, false);
-        }
-    } else {
-        if ((color_write || pg->surface_color.write_enabled_cache)
-            && pg->surface_color.draw_dirty) {
-            update_surface_part(d, false, true);
-        }
-        if ((zeta_write || pg->surface_zeta.write_enabled_cache)
-            && pg->surface_zeta.draw_dirty) {
-            update_surface_part(d, false, false);
-        }
-    }
-
-    if (upload) {
-        pg->draw_time++;
-    }
+    static const PGRAPHSurfaceUpdateOps ops = {
+        .unbind_surface = pgraph_gl_unbind_surface,
+        .update_surface_part = update_surface_part,
+    };
+    pgraph_update_surface_parts(d, upload, color_write, zeta_write, &ops);
 
     bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
 
@@ -1395,20 +1553,6 @@ void pgraph_gl_surface_update(NV2AState *d, bool upload, bool color_write,
     surface_evict_old(d);
 }
 
-// FIXME: Move to common
-static void surface_get_dimensions(PGRAPHState *pg, unsigned int *width,
-                                   unsigned int *height)
-{
-    bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
-    if (swizzle) {
-        *width = 1 << pg->surface_shape.log_width;
-        *height = 1 << pg->surface_shape.log_height;
-    } else {
-        *width = pg->surface_shape.clip_width;
-        *height = pg->surface_shape.clip_height;
-    }
-}
-
 void pgraph_gl_init_surfaces(PGRAPHState *pg)
 {
     PGRAPHGLState *r = pg->gl_renderer_state;
@@ -1417,10 +1561,21 @@ void pgraph_gl_init_surfaces(PGRAPHState *pg)
     glGenFramebuffers(1, &r->gl_framebuffer);
     glBindFramebuffer(GL_FRAMEBUFFER, r->gl_framebuffer);
     QTAILQ_INIT(&r->surfaces);
+    r->surface_vram_gens =
+        pgraph_vram_new_seen_gens(container_of(pg, NV2AState, pgraph));
     r->downloads_pending = false;
     qemu_event_init(&r->downloads_complete, false);
     qemu_event_init(&r->dirty_surfaces_download_complete, false);
 
+    for (int i = 0; i < NV2A_GL_SURFACE_READBACK_SLOTS; i++) {
+        SurfaceReadback *readback = &r->surface_readbacks[i];
+        glGenBuffers(1, &readback->gl_buffer);
+        readback->buffer_size = 0;
+        readback->fence = 0;
+        readback->surface = NULL;
+    }
+    r->next_surface_readback = 0;
+
     init_render_to_texture(pg);
 }
 
@@ -1445,6 +1600,49 @@ static void flush_surfaces(NV2AState *d)
     }
 }
 
+/*
+ * Drops the surfaces that no longer match VRAM, e.g. after loading a
+ * snapshot, and keeps the others along with their scaled contents.
+ */
+void pgraph_gl_surface_revalidate(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    bool update_surface = (r->color_binding || r->zeta_binding);
+
+    // Surfaces about to be uploaded are refreshed from VRAM anyway. What was
+    // drawn since must not be read back over the loaded memory.
+    SurfaceBinding *s, *next;
+    QTAILQ_FOREACH(s, &r->surfaces, entry) {
+        if (s->upload_pending && !s->draw_dirty) {
+            s->vram_hash_valid = true;
+        } else if (s->draw_dirty || !s->vram_hash_valid ||
+                   fast_hash(d->vram_ptr + s->vram_addr, s->size) !=
+                       s->vram_hash) {
+            s->vram_hash_valid = false;
+            s->draw_dirty = false;
+            s->download_pending = false;
+        }
+    }
+
+    pg->surface_color.draw_dirty = false;
+    pg->surface_zeta.draw_dirty = false;
+    memset(&pg->last_surface_shape, 0, sizeof(pg->last_surface_shape));
+    pgraph_gl_unbind_surface(d, true);
+    pgraph_gl_unbind_surface(d, false);
+
+    QTAILQ_FOREACH_SAFE(s, &r->surfaces, entry, next) {
+        if (!s->vram_hash_valid) {
+            pgraph_gl_surface_invalidate(d, s);
+        }
+    }
+
+    if (update_surface) {
+        pgraph_gl_surface_update(d, true, true, true);
+    }
+}
+
 void pgraph_gl_finalize_surfaces(PGRAPHState *pg)
 {
     NV2AState *d = container_of(pg, NV2AState, pgraph);
@@ -1454,7 +1652,19 @@ void pgraph_gl_finalize_surfaces(PGRAPHState *pg)
     glDeleteFramebuffers(1, &r->gl_framebuffer);
     r->gl_framebuffer = 0;
 
+    for (int i = 0; i < NV2A_GL_SURFACE_READBACK_SLOTS; i++) {
+        SurfaceReadback *readback = &r->surface_readbacks[i];
+        release_surface_readback(readback);
+        glDeleteBuffers(1, &readback->gl_buffer);
+        xbox_mem_add(XBOX_MEM_GL_BUFFER, -(int64_t)readback->buffer_size);
+        readback->gl_buffer = 0;
+        readback->buffer_size = 0;
+    }
+
     finalize_render_to_texture(pg);
+
+    g_free(r->surface_vram_gens);
+    r->surface_vram_gens = NULL;
 }
 
 void pgraph_gl_surface_flush(NV2AState *d)
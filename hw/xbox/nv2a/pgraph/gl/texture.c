@@ -24,10 +24,14 @@
 #include "hw/xbox/nv2a/pgraph/swizzle.h"
 #include "hw/xbox/nv2a/pgraph/s3tc.h"
 #include "hw/xbox/nv2a/pgraph/texture.h"
+#include "hw/xbox/xbox_mem.h"
 #include "debug.h"
 #include "renderer.h"
 
 static TextureBinding* generate_texture(const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static void upload_texture_data(GLenum gl_target, const TextureShape s,
+                                const uint8_t *texture_data,
+                                const uint8_t *palette_data);
 static void texture_binding_destroy(gpointer data);
 
 struct pgraph_texture_possibly_dirty_struct {
@@ -107,23 +111,73 @@ static bool check_texture_possibly_dirty(NV2AState *d,
     return possibly_dirty;
 }
 
-static void apply_texture_parameters(PGRAPHGLState *r,
-                                     TextureBinding *binding,
-                                     const BasicColorFormatInfo *f,
-                                     unsigned int dimensionality,
-                                     unsigned int filter,
-                                     unsigned int address,
-                                     bool is_bordered,
-                                     uint32_t border_color,
-                                     uint32_t max_anisotropy)
+/*
+ * Sampling state lives in sampler objects shared between all textures using
+ * the same parameters, so texture objects are never modified just to change
+ * how they are sampled.
+ */
+typedef struct SamplerKey {
+    GLenum min_filter;
+    GLenum mag_filter;
+    GLenum wrap[3];
+    uint32_t lod_bias;
+    uint32_t max_anisotropy;
+    uint32_t border_color;
+} SamplerKey;
+
+static guint sampler_key_hash(gconstpointer key)
+{
+    return fast_hash((void *)key, sizeof(SamplerKey));
+}
+
+static gboolean sampler_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(SamplerKey));
+}
+
+static GLuint create_sampler(const SamplerKey *key)
+{
+    GLuint sampler;
+    glGenSamplers(1, &sampler);
+
+    glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, key->min_filter);
+    glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, key->mag_filter);
+    glSamplerParameterf(sampler, GL_TEXTURE_LOD_BIAS,
+                        pgraph_convert_lod_bias_to_float(key->lod_bias));
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, key->wrap[0]);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, key->wrap[1]);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, key->wrap[2]);
+    if (key->max_anisotropy > 1) {
+        glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                            key->max_anisotropy);
+    }
+    if (key->border_color) {
+        /* FIXME: Color channels might be wrong order */
+        GLfloat gl_border_color[4];
+        pgraph_argb_pack32_to_rgba_float(key->border_color, gl_border_color);
+        glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR,
+                             gl_border_color);
+    }
+
+    return sampler;
+}
+
+static GLuint get_texture_sampler(PGRAPHGLState *r,
+                                  const BasicColorFormatInfo *f,
+                                  unsigned int dimensionality,
+                                  unsigned int filter,
+                                  unsigned int address,
+                                  bool is_bordered,
+                                  uint32_t border_color,
+                                  uint32_t max_anisotropy)
 {
     unsigned int min_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIN);
     unsigned int mag_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MAG);
-    unsigned int lod_bias =
-        GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIPMAP_LOD_BIAS);
-    unsigned int addru = GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRU);
-    unsigned int addrv = GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRV);
-    unsigned int addrp = GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRP);
+    unsigned int addr[3] = {
+        GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRU),
+        GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRV),
+        GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRP),
+    };
 
     if (f->linear) {
         /* somtimes games try to set mipmap min filters on linear textures.
@@ -140,66 +194,71 @@ static void apply_texture_parameters(PGRAPHGLState *r,
         }
     }
 
-    if (min_filter != binding->min_filter) {
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
-                        pgraph_texture_min_filter_gl_map[min_filter]);
-        binding->min_filter = min_filter;
-    }
-    if (mag_filter != binding->mag_filter) {
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
-                        pgraph_texture_mag_filter_gl_map[mag_filter]);
-        binding->mag_filter = mag_filter;
-    }
-    if (lod_bias != binding->lod_bias) {
-        binding->lod_bias = lod_bias;
-        glTexParameterf(binding->gl_target, GL_TEXTURE_LOD_BIAS,
-                        pgraph_convert_lod_bias_to_float(lod_bias));
-    }
+    SamplerKey key;
+    memset(&key, 0, sizeof(key));
+    key.min_filter = pgraph_texture_min_filter_gl_map[min_filter];
+    key.mag_filter = pgraph_texture_mag_filter_gl_map[mag_filter];
+    key.lod_bias = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIPMAP_LOD_BIAS);
 
     /* Texture wrapping */
-    assert(addru < ARRAY_SIZE(pgraph_texture_addr_gl_map));
-    if (addru != binding->addru) {
-        glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_S,
-                        pgraph_texture_addr_gl_map[addru]);
-        binding->addru = addru;
-    }
-    bool needs_border_color = binding->addru == NV_PGRAPH_TEXADDRESS0_ADDRU_BORDER;
-    if (dimensionality > 1) {
-        if (addrv != binding->addrv) {
-            assert(addrv < ARRAY_SIZE(pgraph_texture_addr_gl_map));
-            glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_T,
-                            pgraph_texture_addr_gl_map[addrv]);
-            binding->addrv = addrv;
+    bool needs_border_color = false;
+    for (int i = 0; i < 3; i++) {
+        if (i >= dimensionality) {
+            key.wrap[i] = GL_REPEAT;
+            continue;
         }
-        needs_border_color = needs_border_color || binding->addrv == NV_PGRAPH_TEXADDRESS0_ADDRU_BORDER;
+        assert(addr[i] < ARRAY_SIZE(pgraph_texture_addr_gl_map));
+        key.wrap[i] = pgraph_texture_addr_gl_map[addr[i]];
+        needs_border_color = needs_border_color ||
+                             addr[i] == NV_PGRAPH_TEXADDRESS0_ADDRU_BORDER;
     }
-    if (dimensionality > 2) {
-        if (addrp != binding->addrp) {
-            assert(addrp < ARRAY_SIZE(pgraph_texture_addr_gl_map));
-            glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_R,
-                            pgraph_texture_addr_gl_map[addrp]);
-            binding->addrp = addrp;
-        }
-        needs_border_color = needs_border_color || binding->addrp == NV_PGRAPH_TEXADDRESS0_ADDRU_BORDER;
+
+    key.max_anisotropy = r->supported_extensions.texture_filter_anisotropic ?
+                             max_anisotropy : 1;
+
+    if (!is_bordered && needs_border_color) {
+        key.border_color = border_color;
     }
 
-    if (r->supported_extensions.texture_filter_anisotropic) {
-        glTexParameterf(binding->gl_target, GL_TEXTURE_MAX_ANISOTROPY_EXT,
-                        max_anisotropy);
+    GLuint sampler = GPOINTER_TO_UINT(
+        g_hash_table_lookup(r->sampler_cache, &key));
+    if (!sampler) {
+        sampler = create_sampler(&key);
+        g_hash_table_insert(r->sampler_cache, g_memdup2(&key, sizeof(key)),
+                            GUINT_TO_POINTER(sampler));
     }
 
-    if (!is_bordered && needs_border_color) {
-        if (!binding->border_color_set || binding->border_color != border_color) {
-            /* FIXME: Color channels might be wrong order */
-            GLfloat gl_border_color[4];
-            pgraph_argb_pack32_to_rgba_float(border_color, gl_border_color);
-            glTexParameterfv(binding->gl_target, GL_TEXTURE_BORDER_COLOR,
-                             gl_border_color);
+    return sampler;
+}
 
-            binding->border_color_set = true;
-            binding->border_color = border_color;
+static void bind_texture_units(PGRAPHGLState *r,
+                               const GLenum targets[NV2A_MAX_TEXTURES],
+                               const GLuint textures[NV2A_MAX_TEXTURES],
+                               const GLuint samplers[NV2A_MAX_TEXTURES])
+{
+    if (r->supported_extensions.multi_bind) {
+        glBindTextures(0, NV2A_MAX_TEXTURES, textures);
+        glBindSamplers(0, NV2A_MAX_TEXTURES, samplers);
+    } else {
+        for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            if (!textures[i]) {
+                glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+                glBindTexture(GL_TEXTURE_1D, 0);
+                glBindTexture(GL_TEXTURE_2D, 0);
+                glBindTexture(GL_TEXTURE_3D, 0);
+            } else {
+                if (r->texture_unit_targets[i] &&
+                    r->texture_unit_targets[i] != targets[i]) {
+                    glBindTexture(r->texture_unit_targets[i], 0);
+                }
+                glBindTexture(targets[i], textures[i]);
+            }
+            glBindSampler(i, samplers[i]);
         }
     }
+
+    memcpy(r->texture_unit_targets, targets, sizeof(r->texture_unit_targets));
 }
 
 void pgraph_gl_bind_textures(NV2AState *d)
@@ -210,16 +269,15 @@ void pgraph_gl_bind_textures(NV2AState *d)
 
     NV2A_GL_DGROUP_BEGIN("%s", __func__);
 
+    GLenum targets[NV2A_MAX_TEXTURES] = { 0 };
+    GLuint textures[NV2A_MAX_TEXTURES] = { 0 };
+    GLuint samplers[NV2A_MAX_TEXTURES] = { 0 };
+
     for (i=0; i<NV2A_MAX_TEXTURES; i++) {
         bool enabled = pgraph_is_texture_enabled(pg, i);
         /* FIXME: What happens if texture is disabled but stage is active? */
 
-        glActiveTexture(GL_TEXTURE0 + i);
         if (!enabled) {
-            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-            glBindTexture(GL_TEXTURE_1D, 0);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindTexture(GL_TEXTURE_3D, 0);
             continue;
         }
 
@@ -270,21 +328,19 @@ void pgraph_gl_bind_textures(NV2AState *d)
             }
 
             if (reusable) {
-                glBindTexture(r->texture_binding[i]->gl_target,
-                              r->texture_binding[i]->gl_texture);
-                apply_texture_parameters(r,
-                                         r->texture_binding[i],
-                                         &kelvin_color_format_info_map[state.color_format],
-                                         state.dimensionality,
-                                         filter,
-                                         address,
-                                         state.border,
-                                         border_color,
-                                         max_anisotropy);
+                targets[i] = tbind->gl_target;
+                textures[i] = tbind->gl_texture;
+                samplers[i] = get_texture_sampler(
+                    r, &kelvin_color_format_info_map[state.color_format],
+                    state.dimensionality, filter, address, state.border,
+                    border_color, max_anisotropy);
                 continue;
             }
         }
 
+        /* Texture uploads and surface copies below use this stage's unit */
+        glActiveTexture(GL_TEXTURE0 + i);
+
         /*
          * Check active surfaces to see if this texture was a render target
          */
@@ -351,16 +407,26 @@ void pgraph_gl_bind_textures(NV2AState *d)
             }
         }
 
-        // Free existing binding, if texture data has changed
-        bool must_destroy = (key_out->binding != NULL)
-                            && possibly_dirty
-                            && (key_out->binding->data_hash != tex_data_hash);
-        if (must_destroy) {
+        // Refresh existing binding, if texture data has changed
+        bool must_update = (key_out->binding != NULL)
+                           && possibly_dirty
+                           && (key_out->binding->data_hash != tex_data_hash);
+        if (must_update && surf_to_tex) {
             texture_binding_destroy(key_out->binding);
             key_out->binding = NULL;
         }
 
-        if (key_out->binding == NULL) {
+        if (must_update && !surf_to_tex) {
+            // Same shape, so upload into the existing texture object and
+            // let the driver keep its storage instead of allocating anew.
+            glBindTexture(key_out->binding->gl_target,
+                          key_out->binding->gl_texture);
+            upload_texture_data(key_out->binding->gl_target, state,
+                                texture_data, palette_data);
+            key_out->binding->data_hash = tex_data_hash;
+            key_out->binding->draw_time = 0;
+            key_out->binding->scale = 1;
+        } else if (key_out->binding == NULL) {
             // Must create the texture
             key_out->binding = generate_texture(state, texture_data, palette_data);
             key_out->binding->data_hash = tex_data_hash;
@@ -382,27 +448,26 @@ void pgraph_gl_bind_textures(NV2AState *d)
             pgraph_gl_render_surface_to_texture(d, surface, binding, &state, i);
             binding->draw_time = surface->draw_time;
             binding->scale = pg->surface_scale_factor;
+            // Level 0 was respecified at the surface scale
+            update_texture_memory_size(binding, state.levels);
         }
 
-        apply_texture_parameters(r,
-                                 binding,
-                                 &kelvin_color_format_info_map[state.color_format],
-                                 state.dimensionality,
-                                 filter,
-                                 address,
-                                 state.border,
-                                 border_color,
-                                 max_anisotropy);
+        targets[i] = binding->gl_target;
+        textures[i] = binding->gl_texture;
+        samplers[i] = get_texture_sampler(
+            r, &kelvin_color_format_info_map[state.color_format],
+            state.dimensionality, filter, address, state.border, border_color,
+            max_anisotropy);
 
         if (r->texture_binding[i]) {
-            if (r->texture_binding[i]->gl_target != binding->gl_target) {
-                glBindTexture(r->texture_binding[i]->gl_target, 0);
-            }
             texture_binding_destroy(r->texture_binding[i]);
         }
         r->texture_binding[i] = binding;
         pg->texture_dirty[i] = false;
     }
+
+    bind_texture_units(r, targets, textures, samplers);
+
     NV2A_GL_DGROUP_END();
 }
 
@@ -421,6 +486,32 @@ gl_internal_format_to_s3tc_enum(GLint gl_internal_format)
     }
 }
 
+/*
+ * Copy pixels for the next glTex*Image call into the stream buffer and
+ * return the offset to pass instead of the pointer. Sourcing them from a
+ * pixel unpack buffer lets the driver copy them to the texture on the GPU,
+ * rather than synchronously from client memory. Pixels too large to stream
+ * are passed as they are.
+ */
+static const void *stage_pixels(const void *data, size_t size)
+{
+    PGRAPHGLState *r = g_nv2a->pgraph.gl_renderer_state;
+
+    GLintptr offset;
+    if (pgraph_gl_stream_data(r, data, size, 16, &offset)) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, r->gl_stream_buffer);
+        return (const void *)offset;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return data;
+}
+
+static void unstage_pixels(void)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 static void upload_gl_texture(GLenum gl_target,
                               const TextureShape s,
                               const uint8_t *texture_data,
@@ -428,6 +519,7 @@ static void upload_gl_texture(GLenum gl_target,
 {
     ColorFormatInfo f = kelvin_color_format_gl_map[s.color_format];
     nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
+    int64_t start = nv2a_profile_cpu_time_begin();
 
     unsigned int adjusted_width = s.width;
     unsigned int adjusted_height = s.height;
@@ -449,15 +541,20 @@ static void upload_gl_texture(GLenum gl_target,
             /* Can't handle strides unaligned to pixels */
             assert(s.pitch % f.bytes_per_pixel == 0);
 
+            size_t converted_size;
             uint8_t *converted = pgraph_convert_texture_data(
                 s, texture_data, palette_data, adjusted_width, adjusted_height, 1,
-                adjusted_pitch, 0, NULL);
+                adjusted_pitch, 0, &converted_size);
             glPixelStorei(GL_UNPACK_ROW_LENGTH,
                           converted ? 0 : adjusted_pitch / f.bytes_per_pixel);
             glTexImage2D(GL_TEXTURE_2D, 0, f.gl_internal_format,
                          adjusted_width, adjusted_height, 0,
                          f.gl_format, f.gl_type,
-                         converted ? converted : texture_data);
+                         converted ?
+                             stage_pixels(converted, converted_size) :
+                             stage_pixels(texture_data,
+                                          adjusted_pitch * adjusted_height));
+            unstage_pixels();
 
             if (converted) {
               g_free(converted);
@@ -481,7 +578,24 @@ static void upload_gl_texture(GLenum gl_target,
             width = MAX(width, 1);
             height = MAX(height, 1);
 
-            if (f.gl_format == 0) { /* compressed */
+            if (f.gl_format == 0 && !(s.cubemap && s.border)) {
+                /* Compressed, upload the blocks as they are */
+                unsigned int block_size =
+                    f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ?
+                        8 : 16;
+                unsigned int physical_width = (width + 3) & ~3,
+                             physical_height = (height + 3) & ~3;
+                size_t texture_size =
+                    physical_width / 4 * physical_height / 4 * block_size;
+
+                glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
+                                       width, height, 0, texture_size,
+                                       stage_pixels(texture_data,
+                                                    texture_size));
+                unstage_pixels();
+
+                texture_data += texture_size;
+            } else if (f.gl_format == 0) { /* compressed */
                  // https://docs.microsoft.com/en-us/windows/win32/direct3d10/d3d10-graphics-programming-guide-resources-block-compression#virtual-size-versus-physical-size
                 unsigned int block_size =
                     f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ?
@@ -508,7 +622,9 @@ static void upload_gl_texture(GLenum gl_target,
                 }
 
                 glTexImage2D(gl_target, level, GL_RGBA, tex_width, tex_height, 0,
-                             GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, converted);
+                             GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                             stage_pixels(converted, width * height * 4));
+                unstage_pixels();
                 g_free(converted);
                 if (s.cubemap && adjusted_width != s.width) {
                     glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
@@ -524,10 +640,13 @@ static void upload_gl_texture(GLenum gl_target,
                 uint8_t *unswizzled = (uint8_t*)g_malloc(height * pitch);
                 unswizzle_rect(texture_data, width, height,
                                unswizzled, pitch, f.bytes_per_pixel);
+                size_t converted_size;
                 uint8_t *converted = pgraph_convert_texture_data(
                     s, unswizzled, palette_data, width, height, 1, pitch, 0,
-                    NULL);
-                uint8_t *pixel_data = converted ? converted : unswizzled;
+                    &converted_size);
+                const uint8_t *pixel_data =
+                    converted ? stage_pixels(converted, converted_size) :
+                                stage_pixels(unswizzled, height * pitch);
                 unsigned int tex_width = width;
                 unsigned int tex_height = height;
 
@@ -544,6 +663,7 @@ static void upload_gl_texture(GLenum gl_target,
                 glTexImage2D(gl_target, level, f.gl_internal_format, tex_width,
                              tex_height, 0, f.gl_format, f.gl_type,
                              pixel_data);
+                unstage_pixels();
                 if (s.cubemap && s.border) {
                     glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
                 }
@@ -562,6 +682,7 @@ static void upload_gl_texture(GLenum gl_target,
         break;
     }
     case GL_TEXTURE_3D: {
+        PGRAPHGLState *r = g_nv2a->pgraph.gl_renderer_state;
 
         unsigned int width = adjusted_width;
         unsigned int height = adjusted_height;
@@ -587,16 +708,27 @@ static void upload_gl_texture(GLenum gl_target,
 
                 size_t texture_size = physical_width/4 * physical_height/4 * depth * block_size;
 
-                uint8_t *converted = s3tc_decompress_3d(
-                    gl_internal_format_to_s3tc_enum(f.gl_internal_format),
-                    texture_data, width, height, depth);
+                if (r->supported_extensions.texture_compression_vtc) {
+                    glCompressedTexImage3D(gl_target, level,
+                                           f.gl_internal_format, width, height,
+                                           depth, 0, texture_size,
+                                           stage_pixels(texture_data,
+                                                        texture_size));
+                    unstage_pixels();
+                } else {
+                    uint8_t *converted = s3tc_decompress_3d(
+                        gl_internal_format_to_s3tc_enum(f.gl_internal_format),
+                        texture_data, width, height, depth);
 
-                glTexImage3D(gl_target, level,  GL_RGBA8,
-                             width, height, depth, 0,
-                             GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV,
-                             converted);
+                    glTexImage3D(gl_target, level,  GL_RGBA8,
+                                 width, height, depth, 0,
+                                 GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                                 stage_pixels(converted,
+                                              width * height * depth * 4));
+                    unstage_pixels();
 
-                g_free(converted);
+                    g_free(converted);
+                }
 
                 texture_data += texture_size;
             } else {
@@ -610,14 +742,19 @@ static void upload_gl_texture(GLenum gl_target,
                 unswizzle_box(texture_data, width, height, depth, unswizzled,
                                row_pitch, slice_pitch, f.bytes_per_pixel);
 
+                size_t converted_size;
                 uint8_t *converted = pgraph_convert_texture_data(
                     s, unswizzled, palette_data, width, height, depth,
-                    row_pitch, slice_pitch, NULL);
+                    row_pitch, slice_pitch, &converted_size);
 
                 glTexImage3D(gl_target, level, f.gl_internal_format,
                              width, height, depth, 0,
                              f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+                             converted ?
+                                 stage_pixels(converted, converted_size) :
+                                 stage_pixels(unswizzled,
+                                              slice_pitch * depth));
+                unstage_pixels();
 
                 if (converted) {
                     g_free(converted);
@@ -637,49 +774,16 @@ static void upload_gl_texture(GLenum gl_target,
         assert(false);
         break;
     }
+
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_TEX_UPLOAD, NULL, start);
 }
 
-static TextureBinding* generate_texture(const TextureShape s,
-                                        const uint8_t *texture_data,
-                                        const uint8_t *palette_data)
+static void upload_texture_data(GLenum gl_target, const TextureShape s,
+                                const uint8_t *texture_data,
+                                const uint8_t *palette_data)
 {
     ColorFormatInfo f = kelvin_color_format_gl_map[s.color_format];
 
-    /* Create a new opengl texture */
-    GLuint gl_texture;
-    glGenTextures(1, &gl_texture);
-
-    GLenum gl_target;
-    if (s.cubemap) {
-        assert(f.linear == false);
-        assert(s.dimensionality == 2);
-        gl_target = GL_TEXTURE_CUBE_MAP;
-    } else {
-        if (f.linear) {
-            gl_target = GL_TEXTURE_2D;
-            assert(s.dimensionality == 2);
-        } else {
-            switch(s.dimensionality) {
-            case 1: gl_target = GL_TEXTURE_1D; break;
-            case 2: gl_target = GL_TEXTURE_2D; break;
-            case 3: gl_target = GL_TEXTURE_3D; break;
-            default:
-                assert(false);
-                break;
-            }
-        }
-    }
-
-    glBindTexture(gl_target, gl_texture);
-
-    NV2A_GL_DLABEL(GL_TEXTURE, gl_texture,
-                   "offset: 0x%08lx, format: 0x%02X%s, %d dimensions%s, "
-                   "width: %d, height: %d, depth: %d",
-                   texture_data - g_nv2a->vram_ptr,
-                   s.color_format, f.linear ? "" : " (SZ)",
-                   s.dimensionality, s.cubemap ? " (Cubemap)" : "",
-                   s.width, s.height, s.depth);
-
     if (gl_target == GL_TEXTURE_CUBE_MAP) {
         unsigned int block_size;
         if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
@@ -725,6 +829,110 @@ static TextureBinding* generate_texture(const TextureShape s,
     } else {
         upload_gl_texture(gl_target, s, texture_data, palette_data);
     }
+}
+
+/*
+ * Sizes the levels of the bound texture from what the driver reports, as
+ * textures can be stored in a different format than the guest's.
+ */
+static size_t get_texture_memory_size(GLenum gl_target, unsigned int levels)
+{
+    static const GLenum component_sizes[] = {
+        GL_TEXTURE_RED_SIZE,   GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE,
+        GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE,
+    };
+    GLenum level_target = gl_target == GL_TEXTURE_CUBE_MAP ?
+                              GL_TEXTURE_CUBE_MAP_POSITIVE_X :
+                              gl_target;
+    size_t size = 0;
+
+    for (unsigned int level = 0; level < levels; level++) {
+        GLint width = 0, height = 0, depth = 0, compressed = 0;
+        glGetTexLevelParameteriv(level_target, level, GL_TEXTURE_WIDTH, &width);
+        if (width == 0) {
+            break;
+        }
+        glGetTexLevelParameteriv(level_target, level, GL_TEXTURE_HEIGHT,
+                                 &height);
+        glGetTexLevelParameteriv(level_target, level, GL_TEXTURE_DEPTH, &depth);
+        glGetTexLevelParameteriv(level_target, level, GL_TEXTURE_COMPRESSED,
+                                 &compressed);
+
+        if (compressed) {
+            GLint image_size = 0;
+            glGetTexLevelParameteriv(level_target, level,
+                                     GL_TEXTURE_COMPRESSED_IMAGE_SIZE,
+                                     &image_size);
+            size += image_size;
+            continue;
+        }
+
+        int bits = 0;
+        for (int i = 0; i < ARRAY_SIZE(component_sizes); i++) {
+            GLint component_bits = 0;
+            glGetTexLevelParameteriv(level_target, level, component_sizes[i],
+                                     &component_bits);
+            bits += component_bits;
+        }
+        size += (size_t)width * MAX(height, 1) * MAX(depth, 1) *
+                DIV_ROUND_UP(bits, 8);
+    }
+
+    return gl_target == GL_TEXTURE_CUBE_MAP ? size * 6 : size;
+}
+
+/* Accounts for the storage of the bound texture after it was (re)specified */
+static void update_texture_memory_size(TextureBinding *binding,
+                                       unsigned int levels)
+{
+    size_t size = get_texture_memory_size(binding->gl_target, levels);
+    xbox_mem_add(XBOX_MEM_GL_TEXTURE,
+                 (int64_t)size - (int64_t)binding->memory_size);
+    binding->memory_size = size;
+}
+
+static TextureBinding* generate_texture(const TextureShape s,
+                                        const uint8_t *texture_data,
+                                        const uint8_t *palette_data)
+{
+    ColorFormatInfo f = kelvin_color_format_gl_map[s.color_format];
+
+    /* Create a new opengl texture */
+    GLuint gl_texture;
+    glGenTextures(1, &gl_texture);
+
+    GLenum gl_target;
+    if (s.cubemap) {
+        assert(f.linear == false);
+        assert(s.dimensionality == 2);
+        gl_target = GL_TEXTURE_CUBE_MAP;
+    } else {
+        if (f.linear) {
+            gl_target = GL_TEXTURE_2D;
+            assert(s.dimensionality == 2);
+        } else {
+            switch(s.dimensionality) {
+            case 1: gl_target = GL_TEXTURE_1D; break;
+            case 2: gl_target = GL_TEXTURE_2D; break;
+            case 3: gl_target = GL_TEXTURE_3D; break;
+            default:
+                assert(false);
+                break;
+            }
+        }
+    }
+
+    glBindTexture(gl_target, gl_texture);
+
+    NV2A_GL_DLABEL(GL_TEXTURE, gl_texture,
+                   "offset: 0x%08lx, format: 0x%02X%s, %d dimensions%s, "
+                   "width: %d, height: %d, depth: %d",
+                   texture_data - g_nv2a->vram_ptr,
+                   s.color_format, f.linear ? "" : " (SZ)",
+                   s.dimensionality, s.cubemap ? " (Cubemap)" : "",
+                   s.width, s.height, s.depth);
+
+    upload_texture_data(gl_target, s, texture_data, palette_data);
 
     /* Linear textures don't support mipmapping */
     if (!f.linear) {
@@ -746,13 +954,8 @@ static TextureBinding* generate_texture(const TextureShape s,
     ret->refcnt = 1;
     ret->draw_time = 0;
     ret->data_hash = 0;
-    ret->min_filter = 0xFFFFFFFF;
-    ret->mag_filter = 0xFFFFFFFF;
-    ret->lod_bias = 0xFFFFFFFF;
-    ret->addru = 0xFFFFFFFF;
-    ret->addrv = 0xFFFFFFFF;
-    ret->addrp = 0xFFFFFFFF;
-    ret->border_color_set = false;
+    ret->memory_size = 0;
+    update_texture_memory_size(ret, s.levels);
     return ret;
 }
 
@@ -763,6 +966,7 @@ static void texture_binding_destroy(gpointer data)
     binding->refcnt--;
     if (binding->refcnt == 0) {
         glDeleteTextures(1, &binding->gl_texture);
+        xbox_mem_add(XBOX_MEM_GL_TEXTURE, -(int64_t)binding->memory_size);
         g_free(binding);
     }
 }
@@ -810,6 +1014,10 @@ void pgraph_gl_init_textures(NV2AState *d)
     r->texture_cache.init_node = texture_cache_entry_init;
     r->texture_cache.compare_nodes = texture_cache_entry_compare;
     r->texture_cache.post_node_evict = texture_cache_entry_post_evict;
+
+    r->sampler_cache =
+        g_hash_table_new_full(sampler_key_hash, sampler_key_equal, g_free, NULL);
+    memset(r->texture_unit_targets, 0, sizeof(r->texture_unit_targets));
 }
 
 void pgraph_gl_finalize_textures(PGRAPHState *pg)
@@ -824,4 +1032,14 @@ void pgraph_gl_finalize_textures(PGRAPHState *pg)
     free(r->texture_cache_entries);
 
     r->texture_cache_entries = NULL;
+
+    GHashTableIter iter;
+    gpointer sampler;
+    g_hash_table_iter_init(&iter, r->sampler_cache);
+    while (g_hash_table_iter_next(&iter, NULL, &sampler)) {
+        GLuint gl_sampler = GPOINTER_TO_UINT(sampler);
+        glDeleteSamplers(1, &gl_sampler);
+    }
+    g_hash_table_destroy(r->sampler_cache);
+    r->sampler_cache = NULL;
 }
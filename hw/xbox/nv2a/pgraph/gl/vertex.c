@@ -19,17 +19,88 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu/fast-hash.h"
 #include "hw/xbox/nv2a/nv2a_regs.h"
 #include <hw/xbox/nv2a/nv2a_int.h>
+#include "hw/xbox/xbox_mem.h"
+#include "ui/xemu-settings.h"
 #include "debug.h"
 #include "renderer.h"
 
+/*
+ * The persistently mapped memory buffer is written directly, so wait for
+ * draws that may still read the old contents first. glBufferSubData does
+ * the same, implicitly.
+ */
+static void wait_for_memory_buffer_reads(PGRAPHGLState *r)
+{
+    if (!r->gl_memory_buffer_in_use) {
+        return;
+    }
+
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(fence);
+    r->gl_memory_buffer_in_use = false;
+}
+
+static void write_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size)
+{
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+
+    if (r->gl_memory_buffer_pinned) {
+        // The GPU reads guest memory directly, there is nothing to copy
+        return;
+    } else if (r->gl_memory_buffer_map) {
+        wait_for_memory_buffer_reads(r);
+        memcpy(r->gl_memory_buffer_map + addr, d->vram_ptr + addr, size);
+    } else {
+        glBufferSubData(GL_ARRAY_BUFFER, addr, size, d->vram_ptr + addr);
+    }
+}
+
+/*
+ * Backs the pages of a sparse memory buffer that a draw is about to read.
+ * Pages have no defined contents when committed, so all of the VRAM they
+ * cover is copied in.
+ */
+static void commit_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size)
+{
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+    hwaddr page_size = r->gl_memory_buffer_page_size;
+
+    if (!r->gl_memory_buffer_committed) {
+        return;
+    }
+
+    for (hwaddr i = addr / page_size; i <= (addr + size - 1) / page_size;
+         i++) {
+        if (test_bit(i, r->gl_memory_buffer_committed)) {
+            continue;
+        }
+
+        hwaddr page = i * page_size;
+        glBufferPageCommitmentARB(GL_ARRAY_BUFFER, page, page_size, GL_TRUE);
+        set_bit(i, r->gl_memory_buffer_committed);
+        r->gl_memory_buffer_resident += page_size;
+        xbox_mem_add(XBOX_MEM_GL_BUFFER, page_size);
+
+        pgraph_vram_check_dirty(d, r->gl_memory_buffer_vram_gens, page,
+                                page_size);
+        write_memory_buffer(d, page, page_size);
+    }
+}
+
 static void update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
                                  bool quick)
 {
     PGRAPHState *pg = &d->pgraph;
     PGRAPHGLState *r = pg->gl_renderer_state;
 
+    if (r->gl_memory_buffer_pinned) {
+        return;
+    }
+
     glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
 
     hwaddr end = TARGET_PAGE_ALIGN(addr + size);
@@ -44,10 +115,10 @@ static void update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
     last_end = end;
 
     size = end - addr;
-    if (memory_region_test_and_clear_dirty(d->vram, addr, size,
-                                           DIRTY_MEMORY_NV2A)) {
-        glBufferSubData(GL_ARRAY_BUFFER, addr, size,
-                        d->vram_ptr + addr);
+    commit_memory_buffer(d, addr, size);
+    if (pgraph_vram_check_dirty(d, r->gl_memory_buffer_vram_gens, addr,
+                                size)) {
+        write_memory_buffer(d, addr, size);
         nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_1);
     }
 }
@@ -58,7 +129,255 @@ void pgraph_gl_update_entire_memory_buffer(NV2AState *d)
     PGRAPHGLState *r = pg->gl_renderer_state;
 
     glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, memory_region_size(d->vram), d->vram_ptr);
+
+    if (!r->gl_memory_buffer_committed) {
+        write_memory_buffer(d, 0, memory_region_size(d->vram));
+        return;
+    }
+
+    hwaddr page_size = r->gl_memory_buffer_page_size;
+    size_t num_pages = memory_region_size(d->vram) / page_size;
+    for (size_t i = find_first_bit(r->gl_memory_buffer_committed, num_pages);
+         i < num_pages;
+         i = find_next_bit(r->gl_memory_buffer_committed, num_pages, i + 1)) {
+        write_memory_buffer(d, i * page_size, page_size);
+    }
+}
+
+/*
+ * Use guest VRAM itself as the memory buffer, if the driver can make it
+ * accessible to the GPU.
+ */
+static bool init_pinned_memory_buffer(NV2AState *d)
+{
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+
+    if (!glo_check_extension("GL_AMD_pinned_memory")) {
+        return false;
+    }
+
+    glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, r->gl_memory_buffer);
+    glBufferData(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD,
+                 memory_region_size(d->vram), d->vram_ptr, GL_STREAM_READ);
+    glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0);
+    if (glGetError() != GL_NO_ERROR) {
+        // The buffer cannot be given other storage once tried
+        glDeleteBuffers(1, &r->gl_memory_buffer);
+        glGenBuffers(1, &r->gl_memory_buffer);
+        return false;
+    }
+
+    r->gl_memory_buffer_pinned = true;
+    return true;
+}
+
+/*
+ * Allocate only the pages of the memory buffer that draws read vertices
+ * from, which is a small part of VRAM for most titles.
+ */
+static bool init_sparse_memory_buffer(NV2AState *d)
+{
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+    hwaddr size = memory_region_size(d->vram);
+
+    if (!glo_check_extension("GL_ARB_sparse_buffer") ||
+        !glo_check_extension("GL_ARB_buffer_storage")) {
+        return false;
+    }
+
+    GLint page_size = 0;
+    glGetIntegerv(GL_SPARSE_BUFFER_PAGE_SIZE_ARB, &page_size);
+    if (page_size <= 0 || size % page_size) {
+        return false;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL,
+                    GL_SPARSE_STORAGE_BIT_ARB | GL_DYNAMIC_STORAGE_BIT);
+    if (glGetError() != GL_NO_ERROR) {
+        glDeleteBuffers(1, &r->gl_memory_buffer);
+        glGenBuffers(1, &r->gl_memory_buffer);
+        return false;
+    }
+
+    r->gl_memory_buffer_page_size = page_size;
+    r->gl_memory_buffer_committed = bitmap_new(size / page_size);
+    return true;
+}
+
+static void init_memory_buffer(NV2AState *d)
+{
+    PGRAPHGLState *r = d->pgraph.gl_renderer_state;
+    hwaddr size = memory_region_size(d->vram);
+
+    glGenBuffers(1, &r->gl_memory_buffer);
+    r->gl_memory_buffer_vram_gens = pgraph_vram_new_seen_gens(d);
+    r->gl_memory_buffer_map = NULL;
+    r->gl_memory_buffer_in_use = false;
+    r->gl_memory_buffer_pinned = false;
+    r->gl_memory_buffer_committed = NULL;
+    r->gl_memory_buffer_resident = 0;
+
+    if (g_config.display.opengl.share_vertex_ram) {
+        if (init_pinned_memory_buffer(d)) {
+            NV2A_DPRINTF("Vertex RAM: pinned guest memory\n");
+            return;
+        }
+        if (init_sparse_memory_buffer(d)) {
+            NV2A_DPRINTF("Vertex RAM: sparse copy\n");
+            return;
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
+    if (glo_check_extension("GL_ARB_buffer_storage")) {
+        // Dirty VRAM is copied in with memcpy, without driver side copies
+        GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        r->gl_memory_buffer_map =
+            glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        assert(r->gl_memory_buffer_map);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+    r->gl_memory_buffer_resident = size;
+    xbox_mem_add(XBOX_MEM_GL_BUFFER, size);
+}
+
+static void bind_vertex_pointers(
+    PGRAPHState *pg, const VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES])
+{
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    glBindVertexArray(r->gl_vertex_array);
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        const VertexAttribSource *src = &sources[i];
+
+        if (!src->gl_buffer) {
+            glDisableVertexAttribArray(i);
+            glVertexAttrib4fv(i, pg->vertex_attributes[i].inline_value);
+            continue;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, src->gl_buffer);
+        if (src->integer) {
+            glVertexAttribIPointer(i, src->gl_count, src->gl_type, src->stride,
+                                   (void *)src->offset);
+        } else {
+            glVertexAttribPointer(i, src->gl_count, src->gl_type,
+                                  src->gl_normalize, src->stride,
+                                  (void *)src->offset);
+        }
+        glEnableVertexAttribArray(i);
+    }
+}
+
+/*
+ * Vertex array objects are cached by attribute format layout. Attributes
+ * interleaved in the same buffer share a vertex buffer binding and are
+ * addressed relative to the lowest of their offsets, so a draw with a
+ * known layout only has to rebind the buffer offsets.
+ */
+void pgraph_gl_bind_vertex_sources(
+    PGRAPHState *pg, const VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES])
+{
+    PGRAPHGLState *r = pg->gl_renderer_state;
+
+    if (!r->supported_extensions.vertex_attrib_binding) {
+        bind_vertex_pointers(pg, sources);
+        return;
+    }
+
+    struct {
+        GLuint gl_buffer;
+        GLsizei stride;
+        GLintptr min_offset, max_offset;
+    } bindings[NV2A_VERTEXSHADER_ATTRIBUTES];
+    int num_bindings = 0;
+
+    VertexArrayKey key;
+    memset(&key, 0, sizeof(key));
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        const VertexAttribSource *src = &sources[i];
+
+        if (!src->gl_buffer) {
+            glVertexAttrib4fv(i, pg->vertex_attributes[i].inline_value);
+            continue;
+        }
+
+        int b;
+        for (b = 0; b < num_bindings; b++) {
+            GLintptr min_offset = MIN(bindings[b].min_offset, src->offset);
+            GLintptr max_offset = MAX(bindings[b].max_offset, src->offset);
+            if (bindings[b].gl_buffer == src->gl_buffer &&
+                bindings[b].stride == src->stride &&
+                max_offset - min_offset < src->stride &&
+                max_offset - min_offset <=
+                    r->max_vertex_attrib_relative_offset) {
+                bindings[b].min_offset = min_offset;
+                bindings[b].max_offset = max_offset;
+                break;
+            }
+        }
+        if (b == num_bindings) {
+            bindings[b].gl_buffer = src->gl_buffer;
+            bindings[b].stride = src->stride;
+            bindings[b].min_offset = src->offset;
+            bindings[b].max_offset = src->offset;
+            num_bindings++;
+        }
+
+        key.enabled |= 1 << i;
+        key.attrs[i].gl_count = src->gl_count;
+        key.attrs[i].gl_type = src->gl_type;
+        key.attrs[i].gl_normalize = src->gl_normalize;
+        key.attrs[i].integer = src->integer;
+        key.attrs[i].binding = b;
+    }
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        if (key.enabled & (1 << i)) {
+            key.attrs[i].relative_offset =
+                sources[i].offset - bindings[key.attrs[i].binding].min_offset;
+        }
+    }
+
+    uint64_t hash = fast_hash((void *)&key, sizeof(key));
+    LruNode *node = lru_lookup(&r->vertex_array_cache, hash, &key);
+    VertexArrayLruNode *found = container_of(node, VertexArrayLruNode, node);
+
+    glBindVertexArray(found->gl_vertex_array);
+
+    if (!found->initialized) {
+        nv2a_profile_inc_counter(NV2A_PROF_VERTEX_ARRAY_CREATE);
+        for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+            if (!(key.enabled & (1 << i))) {
+                glDisableVertexAttribArray(i);
+                continue;
+            }
+            if (key.attrs[i].integer) {
+                glVertexAttribIFormat(i, key.attrs[i].gl_count,
+                                      key.attrs[i].gl_type,
+                                      key.attrs[i].relative_offset);
+            } else {
+                glVertexAttribFormat(i, key.attrs[i].gl_count,
+                                     key.attrs[i].gl_type,
+                                     key.attrs[i].gl_normalize,
+                                     key.attrs[i].relative_offset);
+            }
+            glVertexAttribBinding(i, key.attrs[i].binding);
+            glEnableVertexAttribArray(i);
+        }
+        found->initialized = true;
+    }
+
+    for (int b = 0; b < num_bindings; b++) {
+        glBindVertexBuffer(b, bindings[b].gl_buffer, bindings[b].min_offset,
+                           bindings[b].stride);
+    }
 }
 
 void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
@@ -81,12 +400,13 @@ void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
 
     pg->compressed_attrs = 0;
 
+    VertexAttribSource sources[NV2A_VERTEXSHADER_ATTRIBUTES];
+    memset(sources, 0, sizeof(sources));
+
     for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attr = &pg->vertex_attributes[i];
 
         if (!attr->count) {
-            glDisableVertexAttribArray(i);
-            glVertexAttrib4fv(i, attr->inline_value);
             continue;
         }
 
@@ -142,9 +462,11 @@ void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
         }
 
         hwaddr start = 0;
+        GLuint gl_buffer;
         if (inline_data) {
-            glBindBuffer(GL_ARRAY_BUFFER, r->gl_inline_array_buffer);
-            attrib_data_addr = attr->inline_array_offset;
+            gl_buffer = r->gl_inline_array_source;
+            attrib_data_addr =
+                r->inline_array_source_offset + attr->inline_array_offset;
             stride = inline_stride;
         } else {
             hwaddr dma_len;
@@ -154,10 +476,12 @@ void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
             assert(attr->offset < dma_len);
             attrib_data_addr = attr_data + attr->offset - d->vram_ptr;
             stride = attr->stride;
+            gl_buffer = r->gl_memory_buffer;
             start = attrib_data_addr + min_element * stride;
             update_memory_buffer(d, start, num_elements * stride,
                                         updated_memory_buffer);
             updated_memory_buffer = true;
+            r->gl_memory_buffer_in_use = true;
         }
 
         uint32_t provoking_element_index = provoking_element - min_element;
@@ -174,27 +498,60 @@ void pgraph_gl_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
             // Stride of 0 indicates that only the first element should be
             // used.
             pgraph_update_inline_value(attr, last_entry);
-            glDisableVertexAttribArray(i);
-            glVertexAttrib4fv(i, attr->inline_value);
             continue;
         }
 
-        if (needs_conversion) {
-            glVertexAttribIPointer(i, gl_count, gl_type, stride,
-                                   (void *)attrib_data_addr);
-        } else {
-            glVertexAttribPointer(i, gl_count, gl_type, gl_normalize, stride,
-                                  (void *)attrib_data_addr);
-        }
+        sources[i] = (VertexAttribSource){
+            .gl_buffer = gl_buffer,
+            .offset = attrib_data_addr,
+            .stride = stride,
+            .gl_count = gl_count,
+            .gl_type = gl_type,
+            .gl_normalize = gl_normalize,
+            .integer = needs_conversion,
+        };
 
-        glEnableVertexAttribArray(i);
         last_entry += stride * provoking_element_index;
         pgraph_update_inline_value(attr, last_entry);
     }
 
+    pgraph_gl_bind_vertex_sources(pg, sources);
+
     NV2A_GL_DGROUP_END();
 }
 
+/*
+ * Binds the element buffer holding the triangle list indices for drawing
+ * vertex_count vertices of quads or a quad strip, and returns the number of
+ * indices to draw. The indices of shorter draws are a prefix of those of
+ * longer ones, so one buffer per primitive mode serves all draws, offset with
+ * a base vertex where needed.
+ */
+unsigned int pgraph_gl_bind_quad_indices(PGRAPHGLState *r,
+                                         enum ShaderPrimitiveMode primitive_mode,
+                                         unsigned int vertex_count)
+{
+    int i = primitive_mode == PRIM_TYPE_QUAD_STRIP;
+    unsigned int index_count =
+        pgraph_glsl_get_quad_triangle_index_count(primitive_mode, vertex_count);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r->gl_quad_index_buffers[i]);
+
+    if (index_count > r->quad_index_buffer_counts[i]) {
+        unsigned int count = pow2ceil(index_count);
+        uint32_t *indices = g_malloc_n(count, sizeof(uint32_t));
+        for (unsigned int j = 0; j < count; j++) {
+            indices[j] = pgraph_glsl_get_quad_triangle_index(primitive_mode, j);
+        }
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(uint32_t),
+                     indices, GL_STATIC_DRAW);
+        g_free(indices);
+        r->quad_index_buffer_counts[i] = count;
+    }
+
+    return index_count;
+}
+
 unsigned int pgraph_gl_bind_inline_array(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
@@ -222,16 +579,125 @@ unsigned int pgraph_gl_bind_inline_array(NV2AState *d)
     NV2A_DPRINTF("draw inline array %d, %d\n", vertex_size, index_count);
 
     nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_2);
-    glBindBuffer(GL_ARRAY_BUFFER, r->gl_inline_array_buffer);
     GLsizeiptr buffer_size = index_count * vertex_size;
-    glBufferData(GL_ARRAY_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, buffer_size, pg->inline_array);
+    if (pgraph_gl_stream_data(r, pg->inline_array, buffer_size, 16,
+                              &r->inline_array_source_offset)) {
+        r->gl_inline_array_source = r->gl_stream_buffer;
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, r->gl_inline_array_buffer);
+        glBufferData(GL_ARRAY_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, buffer_size, pg->inline_array);
+        r->gl_inline_array_source = r->gl_inline_array_buffer;
+        r->inline_array_source_offset = 0;
+    }
     pgraph_gl_bind_vertex_attributes(d, 0, index_count-1, true, vertex_size,
                                   index_count-1);
 
     return index_count;
 }
 
+static const size_t stream_buffer_size = 32 * 1024 * 1024;
+
+static void init_stream_buffer(PGRAPHGLState *r)
+{
+    glGenBuffers(1, &r->gl_stream_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, r->gl_stream_buffer);
+    r->gl_stream_buffer_map = NULL;
+    if (glo_check_extension("GL_ARB_buffer_storage")) {
+        GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, stream_buffer_size, NULL, flags);
+        r->gl_stream_buffer_map =
+            glMapBufferRange(GL_ARRAY_BUFFER, 0, stream_buffer_size, flags);
+        assert(r->gl_stream_buffer_map);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, stream_buffer_size, NULL,
+                     GL_STREAM_DRAW);
+    }
+    xbox_mem_add(XBOX_MEM_GL_BUFFER, stream_buffer_size);
+
+    r->stream_buffer_offset = 0;
+    r->stream_buffer_segment = 0;
+    memset(r->stream_buffer_fences, 0, sizeof(r->stream_buffer_fences));
+}
+
+static void finalize_stream_buffer(PGRAPHGLState *r)
+{
+    for (int i = 0; i < NV2A_GL_STREAM_BUFFER_SEGMENTS; i++) {
+        if (r->stream_buffer_fences[i]) {
+            glDeleteSync(r->stream_buffer_fences[i]);
+            r->stream_buffer_fences[i] = 0;
+        }
+    }
+
+    if (r->gl_stream_buffer_map) {
+        glBindBuffer(GL_ARRAY_BUFFER, r->gl_stream_buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        r->gl_stream_buffer_map = NULL;
+    }
+    glDeleteBuffers(1, &r->gl_stream_buffer);
+    r->gl_stream_buffer = 0;
+    xbox_mem_add(XBOX_MEM_GL_BUFFER, -(int64_t)stream_buffer_size);
+}
+
+/*
+ * Copy per-draw data into the stream buffer without waiting for the GPU to
+ * finish with what was written before. When writing moves on to the next
+ * segment of the ring, the draws which read the current one are fenced, and
+ * the fence of the segment being entered is waited for. Returns false if the
+ * data is too large to stream, in which case nothing is written.
+ */
+bool pgraph_gl_stream_data(PGRAPHGLState *r, const void *data, size_t size,
+                           size_t align, GLintptr *offset)
+{
+    const size_t segment_size =
+        stream_buffer_size / NV2A_GL_STREAM_BUFFER_SEGMENTS;
+    if (size == 0 || size > segment_size) {
+        return false;
+    }
+
+    size_t start = ROUND_UP(r->stream_buffer_offset, align);
+    if (start + size > stream_buffer_size) {
+        start = 0;
+    }
+
+    int end_segment = (start + size - 1) / segment_size;
+    while (r->stream_buffer_segment != end_segment) {
+        int segment = r->stream_buffer_segment;
+        assert(!r->stream_buffer_fences[segment]);
+        r->stream_buffer_fences[segment] =
+            glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        segment = (segment + 1) % NV2A_GL_STREAM_BUFFER_SEGMENTS;
+        if (r->stream_buffer_fences[segment]) {
+            glClientWaitSync(r->stream_buffer_fences[segment],
+                             GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(r->stream_buffer_fences[segment]);
+            r->stream_buffer_fences[segment] = 0;
+        }
+        r->stream_buffer_segment = segment;
+    }
+
+    if (r->gl_stream_buffer_map) {
+        memcpy(r->gl_stream_buffer_map + start, data, size);
+    } else {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, r->gl_stream_buffer);
+        void *ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, start, size,
+                                     GL_MAP_WRITE_BIT |
+                                         GL_MAP_INVALIDATE_RANGE_BIT |
+                                         GL_MAP_UNSYNCHRONIZED_BIT);
+        assert(ptr);
+        memcpy(ptr, data, size);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+
+    r->stream_buffer_offset = start + size;
+    *offset = start;
+    nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_STREAMED);
+
+    return true;
+}
+
 static void vertex_cache_entry_init(Lru *lru, LruNode *node, const void *key)
 {
     VertexLruNode *vnode = container_of(node, VertexLruNode, node);
@@ -245,7 +711,23 @@ static bool vertex_cache_entry_compare(Lru *lru, LruNode *node, const void *key)
     return memcmp(&vnode->key, key, sizeof(VertexKey));
 }
 
+static void vertex_array_cache_entry_init(Lru *lru, LruNode *node,
+                                          const void *key)
+{
+    VertexArrayLruNode *vnode = container_of(node, VertexArrayLruNode, node);
+    memcpy(&vnode->key, key, sizeof(VertexArrayKey));
+    vnode->initialized = false;
+}
+
+static bool vertex_array_cache_entry_compare(Lru *lru, LruNode *node,
+                                             const void *key)
+{
+    VertexArrayLruNode *vnode = container_of(node, VertexArrayLruNode, node);
+    return memcmp(&vnode->key, key, sizeof(VertexArrayKey));
+}
+
 static const size_t element_cache_size = 50*1024;
+static const size_t vertex_array_cache_size = 256;
 
 void pgraph_gl_init_buffers(NV2AState *d)
 {
@@ -271,20 +753,43 @@ void pgraph_gl_init_buffers(NV2AState *d)
 
     glGenBuffers(NV2A_VERTEXSHADER_ATTRIBUTES, r->gl_inline_buffer);
     glGenBuffers(1, &r->gl_inline_array_buffer);
+    memset(r->element_hashes_seen, 0, sizeof(r->element_hashes_seen));
+    glGenBuffers(ARRAY_SIZE(r->gl_quad_index_buffers),
+                 r->gl_quad_index_buffers);
+    memset(r->quad_index_buffer_counts, 0,
+           sizeof(r->quad_index_buffer_counts));
+    init_stream_buffer(r);
 
-    glGenBuffers(1, &r->gl_memory_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
-    glBufferData(GL_ARRAY_BUFFER, memory_region_size(d->vram),
-                 NULL, GL_DYNAMIC_DRAW);
+    init_memory_buffer(d);
 
     glGenVertexArrays(1, &r->gl_vertex_array);
     glBindVertexArray(r->gl_vertex_array);
 
+    lru_init(&r->vertex_array_cache);
+    r->vertex_array_cache_entries =
+        g_malloc_n(vertex_array_cache_size, sizeof(VertexArrayLruNode));
+    GLuint vertex_arrays[vertex_array_cache_size];
+    glGenVertexArrays(vertex_array_cache_size, vertex_arrays);
+    for (int i = 0; i < vertex_array_cache_size; i++) {
+        r->vertex_array_cache_entries[i].gl_vertex_array = vertex_arrays[i];
+        lru_add_free(&r->vertex_array_cache,
+                     &r->vertex_array_cache_entries[i].node);
+    }
+    r->vertex_array_cache.init_node = vertex_array_cache_entry_init;
+    r->vertex_array_cache.compare_nodes = vertex_array_cache_entry_compare;
+
+    r->max_vertex_attrib_relative_offset = 0;
+    if (glo_check_extension("GL_ARB_vertex_attrib_binding")) {
+        glGetIntegerv(GL_MAX_VERTEX_ATTRIB_RELATIVE_OFFSET,
+                      &r->max_vertex_attrib_relative_offset);
+    }
+
     assert(glGetError() == GL_NO_ERROR);
 }
 
 void pgraph_gl_finalize_buffers(PGRAPHState *pg)
 {
+    NV2AState *d = container_of(pg, NV2AState, pgraph);
     PGRAPHGLState *r = pg->gl_renderer_state;
 
     GLuint element_cache_buffers[element_cache_size];
@@ -303,9 +808,37 @@ void pgraph_gl_finalize_buffers(PGRAPHState *pg)
     glDeleteBuffers(1, &r->gl_inline_array_buffer);
     r->gl_inline_array_buffer = 0;
 
+    glDeleteBuffers(ARRAY_SIZE(r->gl_quad_index_buffers),
+                    r->gl_quad_index_buffers);
+    memset(r->gl_quad_index_buffers, 0, sizeof(r->gl_quad_index_buffers));
+
+    finalize_stream_buffer(r);
+
+    if (r->gl_memory_buffer_map) {
+        glBindBuffer(GL_ARRAY_BUFFER, r->gl_memory_buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        r->gl_memory_buffer_map = NULL;
+    }
     glDeleteBuffers(1, &r->gl_memory_buffer);
     r->gl_memory_buffer = 0;
+    g_free(r->gl_memory_buffer_vram_gens);
+    r->gl_memory_buffer_vram_gens = NULL;
+    g_free(r->gl_memory_buffer_committed);
+    r->gl_memory_buffer_committed = NULL;
+    r->gl_memory_buffer_pinned = false;
+    xbox_mem_add(XBOX_MEM_GL_BUFFER, -(int64_t)r->gl_memory_buffer_resident);
+    r->gl_memory_buffer_resident = 0;
 
     glDeleteVertexArrays(1, &r->gl_vertex_array);
     r->gl_vertex_array = 0;
+
+    GLuint vertex_arrays[vertex_array_cache_size];
+    for (int i = 0; i < vertex_array_cache_size; i++) {
+        vertex_arrays[i] = r->vertex_array_cache_entries[i].gl_vertex_array;
+    }
+    glDeleteVertexArrays(vertex_array_cache_size, vertex_arrays);
+    lru_flush(&r->vertex_array_cache);
+
+    g_free(r->vertex_array_cache_entries);
+    r->vertex_array_cache_entries = NULL;
 }
@@ -109,6 +109,61 @@ bool pgraph_glsl_need_geom(const GeomState *state)
     }
 }
 
+/*
+ * Filled, smooth shaded quads and quad strips come out the same when drawn as
+ * a list of the triangles the quad geometry shader splits them into, which
+ * lets them share the triangle geometry shader instead of going through
+ * lines_adjacency primitives. If so, turns the state into that of a triangle
+ * list and returns true; the renderer must then draw the quads with indices
+ * from pgraph_glsl_get_quad_triangle_index().
+ */
+bool pgraph_glsl_expand_quads(GeomState *state,
+                              const struct GPUProperties *gpu_props)
+{
+    if ((state->primitive_mode != PRIM_TYPE_QUADS &&
+         state->primitive_mode != PRIM_TYPE_QUAD_STRIP) ||
+        state->polygon_front_mode != POLY_MODE_FILL ||
+        !state->smooth_shading) {
+        return false;
+    }
+
+    state->primitive_mode = PRIM_TYPE_TRIANGLES;
+    state->tri_rot0 = gpu_props->geom_shader_winding.tri;
+    state->tri_rot1 = state->tri_rot0;
+
+    return true;
+}
+
+unsigned int pgraph_glsl_get_quad_triangle_index_count(
+    enum ShaderPrimitiveMode primitive_mode, unsigned int vertex_count)
+{
+    if (primitive_mode == PRIM_TYPE_QUADS) {
+        return vertex_count / 4 * 6;
+    }
+
+    assert(primitive_mode == PRIM_TYPE_QUAD_STRIP);
+    return vertex_count >= 4 ? (vertex_count - 2) / 2 * 6 : 0;
+}
+
+/*
+ * Vertex index of the i-th index of the triangle list, in the same vertex
+ * order calc_quadz() uses. The indices of a shorter draw are a prefix of
+ * those of a longer one.
+ */
+uint32_t pgraph_glsl_get_quad_triangle_index(
+    enum ShaderPrimitiveMode primitive_mode, unsigned int i)
+{
+    static const uint8_t quads[6] = { 0, 1, 2, 0, 2, 3 };
+    static const uint8_t quad_strip[6] = { 2, 0, 1, 2, 1, 3 };
+
+    if (primitive_mode == PRIM_TYPE_QUADS) {
+        return i / 6 * 4 + quads[i % 6];
+    }
+
+    assert(primitive_mode == PRIM_TYPE_QUAD_STRIP);
+    return i / 6 * 2 + quad_strip[i % 6];
+}
+
 MString *pgraph_glsl_gen_geom(const GeomState *state, GenGeomGlslOptions opts)
 {
     /* FIXME: Missing support for 2-sided-poly mode */
@@ -44,6 +44,13 @@ void pgraph_glsl_set_geom_state(PGRAPHState *pg, GeomState *geom);
 
 bool pgraph_glsl_need_geom(const GeomState *state);
 
+bool pgraph_glsl_expand_quads(GeomState *state,
+                              const struct GPUProperties *gpu_props);
+unsigned int pgraph_glsl_get_quad_triangle_index_count(
+    enum ShaderPrimitiveMode primitive_mode, unsigned int vertex_count);
+uint32_t pgraph_glsl_get_quad_triangle_index(
+    enum ShaderPrimitiveMode primitive_mode, unsigned int i);
+
 MString *pgraph_glsl_gen_geom(const GeomState *state, GenGeomGlslOptions opts);
 
 #endif
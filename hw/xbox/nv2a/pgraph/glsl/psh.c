@@ -58,6 +58,10 @@ static uint32_t get_color_key_mask_for_texture(PGRAPHState *pg, int i)
     return get_colorkey_mask(color_format);
 }
 
+/*
+ * The state is hashed to find a shader, so fields that do not affect the
+ * generated code in the current configuration are left zeroed.
+ */
 void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state)
 {
     state->window_clip_exclusive = pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
@@ -68,17 +72,18 @@ void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state)
     state->final_inputs_0 = pgraph_reg_r(pg, NV_PGRAPH_COMBINESPECFOG0);
     state->final_inputs_1 = pgraph_reg_r(pg, NV_PGRAPH_COMBINESPECFOG1);
 
-    state->alpha_test = pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
-                        NV_PGRAPH_CONTROL_0_ALPHATESTENABLE;
-    state->alpha_func = (enum PshAlphaFunc)GET_MASK(
+    enum PshAlphaFunc alpha_func = (enum PshAlphaFunc)GET_MASK(
         pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0), NV_PGRAPH_CONTROL_0_ALPHAFUNC);
+    if ((pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
+         NV_PGRAPH_CONTROL_0_ALPHATESTENABLE) &&
+        alpha_func != ALPHA_FUNC_ALWAYS) {
+        state->alpha_test = true;
+        state->alpha_func = alpha_func;
+    }
 
     state->point_sprite = pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
                           NV_PGRAPH_SETUPRASTER_POINTSMOOTHENABLE;
 
-    state->shadow_depth_func =
-        (enum PshShadowDepthFunc)GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SHADOWCTL),
-                                          NV_PGRAPH_SHADOWCTL_SHADOW_ZFUNC);
     state->z_perspective = pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
                            NV_PGRAPH_CONTROL_0_Z_PERSPECTIVE_ENABLE;
 
@@ -103,10 +108,15 @@ void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state)
             pgraph_reg_r(pg, NV_PGRAPH_COMBINEALPHAO0 + i * 4);
     }
 
+    bool any_shadow_map = false;
     for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            state->compare_mode[i][j] =
-                (pgraph_reg_r(pg, NV_PGRAPH_SHADERCLIPMODE) >> (4 * i + j)) & 1;
+        uint32_t mode = (state->shader_stage_program >> (i * 5)) & 0x1F;
+        if (mode == PS_TEXTUREMODES_CLIPPLANE) {
+            for (int j = 0; j < 4; j++) {
+                state->compare_mode[i][j] =
+                    (pgraph_reg_r(pg, NV_PGRAPH_SHADERCLIPMODE) >>
+                     (4 * i + j)) & 1;
+            }
         }
 
         uint32_t ctl_0 = pgraph_reg_r(pg, NV_PGRAPH_TEXCTL0_0 + i * 4);
@@ -193,6 +203,7 @@ void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state)
                                  || (f.gl_internal_format == GL_RG8_SNORM);
 #endif
         state->shadow_map[i] = f.depth;
+        any_shadow_map |= f.depth;
 
         uint32_t filter = pgraph_reg_r(pg, NV_PGRAPH_TEXFILTER0 + i * 4);
         unsigned int min_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIN);
@@ -211,6 +222,12 @@ void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state)
         state->conv_tex[i] = kernel;
     }
 
+    if (any_shadow_map) {
+        state->shadow_depth_func = (enum PshShadowDepthFunc)GET_MASK(
+            pgraph_reg_r(pg, NV_PGRAPH_SHADOWCTL),
+            NV_PGRAPH_SHADOWCTL_SHADOW_ZFUNC);
+    }
+
     state->surface_zeta_format = pg->surface_shape.zeta_format;
     unsigned int z_format = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
                                      NV_PGRAPH_SETUPRASTER_Z_FORMAT);
@@ -366,8 +383,53 @@ static MString* get_var(struct PixelShader *ps, int reg, bool is_dest)
     }
 }
 
+/* Value of an input reading the zero register, after its input mapping */
+static bool get_input_constant(struct InputInfo in, float *value)
+{
+    if (in.reg != PS_REGISTER_ZERO) {
+        return false;
+    }
+
+    switch (in.mod) {
+    case PS_INPUTMAPPING_UNSIGNED_IDENTITY:
+    case PS_INPUTMAPPING_SIGNED_IDENTITY:
+    case PS_INPUTMAPPING_SIGNED_NEGATE:
+        *value = 0.0f;
+        break;
+    case PS_INPUTMAPPING_UNSIGNED_INVERT:
+    case PS_INPUTMAPPING_EXPAND_NEGATE:
+        *value = 1.0f;
+        break;
+    case PS_INPUTMAPPING_EXPAND_NORMAL:
+        *value = -1.0f;
+        break;
+    case PS_INPUTMAPPING_HALFBIAS_NORMAL:
+        *value = -0.5f;
+        break;
+    case PS_INPUTMAPPING_HALFBIAS_NEGATE:
+        *value = 0.5f;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    return true;
+}
+
+static bool is_input_constant(struct InputInfo in, float value)
+{
+    float v;
+    return get_input_constant(in, &v) && v == value;
+}
+
 static MString* get_input_var(struct PixelShader *ps, struct InputInfo in, bool is_alpha)
 {
+    float value;
+    if (get_input_constant(in, &value)) {
+        return is_alpha ? mstring_from_fmt("%.1f", value) :
+                          mstring_from_fmt("vec3(%.1f)", value);
+    }
+
     MString *reg = get_var(ps, in.reg, false);
 
     if (!is_alpha) {
@@ -462,39 +524,60 @@ static MString* get_output(MString *reg, int mapping)
     return res;
 }
 
+static bool is_product_zero(struct InputInfo x, struct InputInfo y)
+{
+    return is_input_constant(x, 0.0f) || is_input_constant(y, 0.0f);
+}
+
+/* Product of two inputs, folding multiplications by zero and one */
+static MString *get_product(struct PixelShader *ps, struct InputInfo x,
+                            struct InputInfo y, bool dot, bool is_alpha)
+{
+    if (is_product_zero(x, y)) {
+        return mstring_from_str(is_alpha || dot ? "0.0" : "vec3(0.0)");
+    }
+
+    MString *ret;
+    MString *x_var = get_input_var(ps, x, is_alpha);
+    MString *y_var = get_input_var(ps, y, is_alpha);
+
+    if (dot) {
+        ret = mstring_from_fmt("dot(%s, %s)", mstring_get_str(x_var),
+                               mstring_get_str(y_var));
+    } else if (is_input_constant(x, 1.0f)) {
+        mstring_ref(y_var);
+        ret = y_var;
+    } else if (is_input_constant(y, 1.0f)) {
+        mstring_ref(x_var);
+        ret = x_var;
+    } else {
+        ret = mstring_from_fmt("(%s * %s)", mstring_get_str(x_var),
+                               mstring_get_str(y_var));
+    }
+
+    mstring_unref(x_var);
+    mstring_unref(y_var);
+    return ret;
+}
+
 static MString* add_stage_code(struct PixelShader *ps,
                                struct InputVarInfo input,
                                struct OutputInfo output,
                                const char *write_mask, bool is_alpha)
 {
     MString *ret = mstring_new();
-    MString *a = get_input_var(ps, input.a, is_alpha);
-    MString *b = get_input_var(ps, input.b, is_alpha);
-    MString *c = get_input_var(ps, input.c, is_alpha);
-    MString *d = get_input_var(ps, input.d, is_alpha);
 
     const char *caster = "";
     if (strlen(write_mask) == 3) {
         caster = "vec3";
     }
 
-    MString *ab;
-    if (output.ab_op == PS_COMBINEROUTPUT_AB_DOT_PRODUCT) {
-        ab = mstring_from_fmt("dot(%s, %s)",
-                              mstring_get_str(a), mstring_get_str(b));
-    } else {
-        ab = mstring_from_fmt("(%s * %s)",
-                              mstring_get_str(a), mstring_get_str(b));
-    }
-
-    MString *cd;
-    if (output.cd_op == PS_COMBINEROUTPUT_CD_DOT_PRODUCT) {
-        cd = mstring_from_fmt("dot(%s, %s)",
-                              mstring_get_str(c), mstring_get_str(d));
-    } else {
-        cd = mstring_from_fmt("(%s * %s)",
-                              mstring_get_str(c), mstring_get_str(d));
-    }
+    MString *ab = get_product(ps, input.a, input.b,
+                              output.ab_op == PS_COMBINEROUTPUT_AB_DOT_PRODUCT,
+                              is_alpha);
+    MString *cd = get_product(ps, input.c, input.d,
+                              output.cd_op == PS_COMBINEROUTPUT_CD_DOT_PRODUCT,
+                              is_alpha);
 
     MString *ab_mapping = get_output(ab, output.mapping);
     MString *cd_mapping = get_output(cd, output.mapping);
@@ -527,7 +610,13 @@ static MString* add_stage_code(struct PixelShader *ps,
     }
 
     MString *muxsum;
-    if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM) {
+    if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM &&
+        is_product_zero(input.a, input.b)) {
+        muxsum = mstring_from_fmt("%s(%s)", caster, mstring_get_str(cd));
+    } else if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM &&
+               is_product_zero(input.c, input.d)) {
+        muxsum = mstring_from_fmt("%s(%s)", caster, mstring_get_str(ab));
+    } else if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM) {
         muxsum = mstring_from_fmt("(%s + %s)", mstring_get_str(ab),
                                   mstring_get_str(cd));
     } else {
@@ -569,10 +658,6 @@ static MString* add_stage_code(struct PixelShader *ps,
                            mstring_get_str(muxsum_dest), write_mask, write_mask);
     }
 
-    mstring_unref(a);
-    mstring_unref(b);
-    mstring_unref(c);
-    mstring_unref(d);
     mstring_unref(ab);
     mstring_unref(cd);
     mstring_unref(ab_mapping);
@@ -613,6 +698,114 @@ static void add_final_stage_code(struct PixelShader *ps, struct FCInputInfo fina
     ps->varE = ps->varF = NULL;
 }
 
+/*
+ * Liveness of the combiner registers, one bit per register for its rgb
+ * channels and one for its alpha channel.
+ */
+#define LIVE_RGB(reg) (1u << (reg))
+#define LIVE_ALPHA(reg) (1u << (16 + (reg)))
+
+static uint32_t get_input_live_bits(struct InputInfo in)
+{
+    uint32_t bits = in.chan == PS_CHANNEL_ALPHA ? LIVE_ALPHA(in.reg) :
+                                                  LIVE_RGB(in.reg);
+    if (in.reg == PS_REGISTER_V1R0_SUM) {
+        bits |= LIVE_RGB(PS_REGISTER_V1) | LIVE_RGB(PS_REGISTER_R0);
+    }
+    return bits;
+}
+
+static void eliminate_dead_outputs(struct InputVarInfo *input,
+                                   struct OutputInfo *output, bool is_alpha,
+                                   uint32_t live, uint32_t *written,
+                                   uint32_t *read)
+{
+    uint32_t ab_bits, cd_bits, muxsum_bits;
+    if (is_alpha) {
+        ab_bits = LIVE_ALPHA(output->ab);
+        cd_bits = LIVE_ALPHA(output->cd);
+        muxsum_bits = LIVE_ALPHA(output->muxsum);
+    } else {
+        ab_bits = LIVE_RGB(output->ab);
+        if (output->flags & PS_COMBINEROUTPUT_AB_BLUE_TO_ALPHA) {
+            ab_bits |= LIVE_ALPHA(output->ab);
+        }
+        cd_bits = LIVE_RGB(output->cd);
+        if (output->flags & PS_COMBINEROUTPUT_CD_BLUE_TO_ALPHA) {
+            cd_bits |= LIVE_ALPHA(output->cd);
+        }
+        muxsum_bits = LIVE_RGB(output->muxsum);
+    }
+
+    if (output->ab == PS_REGISTER_DISCARD || !(ab_bits & live)) {
+        output->ab = PS_REGISTER_DISCARD;
+    } else {
+        *written |= ab_bits;
+        *read |= get_input_live_bits(input->a) |
+                 get_input_live_bits(input->b);
+    }
+    if (output->cd == PS_REGISTER_DISCARD || !(cd_bits & live)) {
+        output->cd = PS_REGISTER_DISCARD;
+    } else {
+        *written |= cd_bits;
+        *read |= get_input_live_bits(input->c) |
+                 get_input_live_bits(input->d);
+    }
+    if (output->muxsum == PS_REGISTER_DISCARD || !(muxsum_bits & live)) {
+        output->muxsum = PS_REGISTER_DISCARD;
+    } else {
+        *written |= muxsum_bits;
+        *read |= get_input_live_bits(input->a) |
+                 get_input_live_bits(input->b) |
+                 get_input_live_bits(input->c) |
+                 get_input_live_bits(input->d);
+        if (output->muxsum_op != PS_COMBINEROUTPUT_AB_CD_SUM) {
+            *read |= LIVE_ALPHA(PS_REGISTER_R0);
+        }
+    }
+}
+
+/*
+ * Discard the outputs of combiner stages that are overwritten or never read
+ * before the final combiner, so no code is generated for them.
+ */
+static void eliminate_dead_stages(struct PixelShader *ps)
+{
+    uint32_t live;
+
+    if (ps->final_input.enabled) {
+        const struct FCInputInfo *f = &ps->final_input;
+        live = get_input_live_bits(f->a) |
+               get_input_live_bits(f->b) |
+               get_input_live_bits(f->c) |
+               get_input_live_bits(f->d) |
+               get_input_live_bits(f->e) |
+               get_input_live_bits(f->f) |
+               get_input_live_bits(f->g);
+    } else {
+        live = LIVE_RGB(PS_REGISTER_R0) | LIVE_ALPHA(PS_REGISTER_R0);
+    }
+
+    for (int i = ps->num_stages - 1; i >= 0; i--) {
+        struct PSStageInfo *stage = &ps->stage[i];
+        uint32_t written = 0, read = 0;
+
+        eliminate_dead_outputs(&stage->rgb_input, &stage->rgb_output, false,
+                               live, &written, &read);
+        eliminate_dead_outputs(&stage->alpha_input, &stage->alpha_output,
+                               true, live, &written, &read);
+
+        live = (live & ~written) | read;
+    }
+}
+
+static bool has_stage_outputs(const struct OutputInfo *output)
+{
+    return output->ab != PS_REGISTER_DISCARD ||
+           output->cd != PS_REGISTER_DISCARD ||
+           output->muxsum != PS_REGISTER_DISCARD;
+}
+
 static const char *get_sampler_type(struct PixelShader *ps, enum PS_TEXTUREMODES mode, int i)
 {
     const char *sampler2D = "sampler2D";
@@ -802,6 +995,167 @@ static void define_colorkey_comparator(MString *preflight)
     // clang-format on
 }
 
+static bool is_combiner_uniform(int i)
+{
+    switch (i) {
+    case PshUniform_combinerAlphaI:
+    case PshUniform_combinerAlphaO:
+    case PshUniform_combinerColorI:
+    case PshUniform_combinerColorO:
+    case PshUniform_combinerCtl:
+    case PshUniform_combinerSpecFog:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void define_uber_combiner_funcs(MString *preflight)
+{
+    // clang-format off
+    mstring_append(
+        preflight,
+        "vec4 psh_input_map(vec4 x, uint mapping) {\n"
+        "    switch (mapping) {\n"
+        "    case 0x00u: return max(x, 0.0);\n"
+        "    case 0x20u: return 1.0 - clamp(x, 0.0, 1.0);\n"
+        "    case 0x40u: return 2.0 * max(x, 0.0) - 1.0;\n"
+        "    case 0x60u: return -2.0 * max(x, 0.0) + 1.0;\n"
+        "    case 0x80u: return max(x, 0.0) - 0.5;\n"
+        "    case 0xa0u: return -max(x, 0.0) + 0.5;\n"
+        "    case 0xc0u: return x;\n"
+        "    default: return -x;\n"
+        "    }\n"
+        "}\n"
+        "vec4 psh_output_map(vec4 x, uint mapping) {\n"
+        "    switch (mapping) {\n"
+        "    case 0x08u: return x - 0.5;\n"
+        "    case 0x10u: return x * 2.0;\n"
+        "    case 0x18u: return (x - 0.5) * 2.0;\n"
+        "    case 0x20u: return x * 4.0;\n"
+        "    case 0x30u: return x / 2.0;\n"
+        "    default: return x;\n"
+        "    }\n"
+        "}\n"
+        "vec3 psh_rgb_input(vec4 reg, uint sel) {\n"
+        "    vec4 x = (sel & 0x10u) != 0u ? reg.aaaa : reg;\n"
+        "    return psh_input_map(x, sel & 0xe0u).rgb;\n"
+        "}\n"
+        "float psh_alpha_input(vec4 reg, uint sel) {\n"
+        "    float x = (sel & 0x10u) != 0u ? reg.a : reg.b;\n"
+        "    return psh_input_map(vec4(x), sel & 0xe0u).x;\n"
+        "}\n");
+    // clang-format on
+}
+
+/*
+ * Evaluate the general and final combiner stages by interpreting the combiner
+ * registers, which are passed in as uniforms. Matches the code generated by
+ * add_stage_code and add_final_stage_code.
+ */
+static void add_uber_combiner_code(struct PixelShader *ps)
+{
+    add_var_ref(ps, "r0");
+    add_var_ref(ps, "r1");
+
+    // clang-format off
+    mstring_append(
+        ps->code,
+        "// Combiners (interpreted)\n"
+        "vec4 regs[16];\n"
+        "regs[0] = vec4(0.0);\n"
+        "regs[3] = pFog;\n"
+        "regs[4] = v0;\n"
+        "regs[5] = v1;\n"
+        "regs[6] = vec4(0.0);\n"
+        "regs[7] = vec4(0.0);\n"
+        "regs[8] = t0;\n"
+        "regs[9] = t1;\n"
+        "regs[10] = t2;\n"
+        "regs[11] = t3;\n"
+        "regs[12] = r0;\n"
+        "regs[13] = r1;\n"
+        "regs[14] = vec4(0.0);\n"
+        "regs[15] = vec4(0.0);\n"
+        "uint combinerFlags = combinerCtl >> 8;\n"
+        "int numStages = int(combinerCtl & 0xffu);\n"
+        "for (int i = 0; i < numStages; i++) {\n"
+        "  regs[1] = consts[(combinerFlags & 0x10u) != 0u ? i * 2 : 0];\n"
+        "  regs[2] = consts[(combinerFlags & 0x100u) != 0u ? i * 2 + 1 : 1];\n"
+        "  bool mux = (combinerFlags & 0x1u) != 0u ?\n"
+        "      regs[12].a >= 0.5 : (uint(regs[12].a * 255.0) & 1u) == 1u;\n"
+        "\n"
+        "  uint ci = combinerColorI[i];\n"
+        "  uint co = combinerColorO[i];\n"
+        "  uint cflags = co >> 12;\n"
+        "  uint cmapping = cflags & 0x38u;\n"
+        "  vec3 rgbA = psh_rgb_input(regs[(ci >> 24) & 0xfu], ci >> 24);\n"
+        "  vec3 rgbB = psh_rgb_input(regs[(ci >> 16) & 0xfu], ci >> 16);\n"
+        "  vec3 rgbC = psh_rgb_input(regs[(ci >> 8) & 0xfu], ci >> 8);\n"
+        "  vec3 rgbD = psh_rgb_input(regs[ci & 0xfu], ci);\n"
+        "  vec3 abRgb = (cflags & 0x2u) != 0u ? vec3(dot(rgbA, rgbB)) : rgbA * rgbB;\n"
+        "  vec3 cdRgb = (cflags & 0x1u) != 0u ? vec3(dot(rgbC, rgbD)) : rgbC * rgbD;\n"
+        "  vec3 muxSumRgb = (cflags & 0x4u) != 0u ? (mux ? cdRgb : abRgb)\n"
+        "                                          : abRgb + cdRgb;\n"
+        "  abRgb = clamp(psh_output_map(vec4(abRgb, 0.0), cmapping).rgb, -1.0, 1.0);\n"
+        "  cdRgb = clamp(psh_output_map(vec4(cdRgb, 0.0), cmapping).rgb, -1.0, 1.0);\n"
+        "  muxSumRgb = clamp(psh_output_map(vec4(muxSumRgb, 0.0), cmapping).rgb, -1.0, 1.0);\n"
+        "\n"
+        "  uint ai = combinerAlphaI[i];\n"
+        "  uint ao = combinerAlphaO[i];\n"
+        "  uint aflags = ao >> 12;\n"
+        "  uint amapping = aflags & 0x38u;\n"
+        "  float abA = psh_alpha_input(regs[(ai >> 24) & 0xfu], ai >> 24) *\n"
+        "              psh_alpha_input(regs[(ai >> 16) & 0xfu], ai >> 16);\n"
+        "  float cdA = psh_alpha_input(regs[(ai >> 8) & 0xfu], ai >> 8) *\n"
+        "              psh_alpha_input(regs[ai & 0xfu], ai);\n"
+        "  float muxSumA = (aflags & 0x4u) != 0u ? (mux ? cdA : abA) : abA + cdA;\n"
+        "  abA = clamp(psh_output_map(vec4(abA), amapping).x, -1.0, 1.0);\n"
+        "  cdA = clamp(psh_output_map(vec4(cdA), amapping).x, -1.0, 1.0);\n"
+        "  muxSumA = clamp(psh_output_map(vec4(muxSumA), amapping).x, -1.0, 1.0);\n"
+        "\n"
+        "  uint dst = (co >> 4) & 0xfu;\n"
+        "  if (dst != 0u) {\n"
+        "    regs[dst].rgb = abRgb;\n"
+        "    if ((cflags & 0x80u) != 0u) regs[dst].a = abRgb.b;\n"
+        "  }\n"
+        "  dst = co & 0xfu;\n"
+        "  if (dst != 0u) {\n"
+        "    regs[dst].rgb = cdRgb;\n"
+        "    if ((cflags & 0x40u) != 0u) regs[dst].a = cdRgb.b;\n"
+        "  }\n"
+        "  dst = (co >> 8) & 0xfu;\n"
+        "  if (dst != 0u) regs[dst].rgb = muxSumRgb;\n"
+        "  dst = (ao >> 4) & 0xfu;\n"
+        "  if (dst != 0u) regs[dst].a = abA;\n"
+        "  dst = ao & 0xfu;\n"
+        "  if (dst != 0u) regs[dst].a = cdA;\n"
+        "  dst = (ao >> 8) & 0xfu;\n"
+        "  if (dst != 0u) regs[dst].a = muxSumA;\n"
+        "}\n"
+        "\n"
+        "uint fc0 = combinerSpecFog[0];\n"
+        "uint fc1 = combinerSpecFog[1];\n"
+        "if (fc0 != 0u || fc1 != 0u) {\n"
+        "  regs[1] = consts[16];\n"
+        "  regs[2] = consts[17];\n"
+        "  vec3 sumV1 = (fc1 & 0x40u) != 0u ? 1.0 - regs[5].rgb : regs[5].rgb;\n"
+        "  vec3 sumR0 = (fc1 & 0x20u) != 0u ? 1.0 - regs[12].rgb : regs[12].rgb;\n"
+        "  regs[14] = vec4(sumV1 + sumR0, 0.0);\n"
+        "  if ((fc1 & 0x80u) != 0u) regs[14] = clamp(regs[14], 0.0, 1.0);\n"
+        "  vec3 fe = psh_rgb_input(regs[(fc1 >> 24) & 0xfu], fc1 >> 24);\n"
+        "  vec3 ff = psh_rgb_input(regs[(fc1 >> 16) & 0xfu], fc1 >> 16);\n"
+        "  regs[15] = vec4(fe * ff, 0.0);\n"
+        "  vec3 fa = psh_rgb_input(regs[(fc0 >> 24) & 0xfu], fc0 >> 24);\n"
+        "  vec3 fb = psh_rgb_input(regs[(fc0 >> 16) & 0xfu], fc0 >> 16);\n"
+        "  vec3 fc = psh_rgb_input(regs[(fc0 >> 8) & 0xfu], fc0 >> 8);\n"
+        "  vec3 fd = psh_rgb_input(regs[fc0 & 0xfu], fc0);\n"
+        "  fragColor.rgb = fd + mix(fc, fb, fa);\n"
+        "  fragColor.a = psh_alpha_input(regs[(fc1 >> 8) & 0xfu], fc1 >> 8);\n"
+        "}\n");
+    // clang-format on
+}
+
 static MString* psh_convert(struct PixelShader *ps)
 {
     MString *preflight = mstring_new();
@@ -815,19 +1169,21 @@ static MString* psh_convert(struct PixelShader *ps)
             "layout(binding = %d, std140) uniform PshUniforms {\n",
             ps->opts.ubo_binding);
     } else {
-        mstring_append_fmt(preflight,
-                           "layout(location = 0) out vec4 fragColor;\n");
+        mstring_append(preflight,
+                       "layout(location = 0) out vec4 fragColor;\n"
+                       "layout(std140) uniform PshUniforms {\n");
     }
 
-    const char *u = ps->opts.vulkan ? "" : "uniform ";
     for (int i = 0; i < ARRAY_SIZE(PshUniformInfo); i++) {
+        if (is_combiner_uniform(i) && !ps->opts.uber_combiners) {
+            continue;
+        }
         const UniformInfo *info = &PshUniformInfo[i];
         const char *type_str = uniform_element_type_to_str[info->type];
         if (info->count == 1) {
-            mstring_append_fmt(preflight, "%s%s %s;\n", u, type_str,
-                               info->name);
+            mstring_append_fmt(preflight, "%s %s;\n", type_str, info->name);
         } else {
-            mstring_append_fmt(preflight, "%s%s %s[%zd];\n", u, type_str,
+            mstring_append_fmt(preflight, "%s %s[%zd];\n", type_str,
                                info->name, info->count);
         }
     }
@@ -838,8 +1194,10 @@ static MString* psh_convert(struct PixelShader *ps)
         }
     }
 
-    if (ps->opts.vulkan) {
-        mstring_append(preflight, "};\n");
+    mstring_append(preflight, "};\n");
+
+    if (ps->opts.uber_combiners) {
+        define_uber_combiner_funcs(preflight);
     }
 
     const char *dotmap_funcs[] = {
@@ -1085,6 +1443,7 @@ static MString* psh_convert(struct PixelShader *ps)
     ps->code = mstring_new();
 
     bool color_key_comparator_defined = false;
+    bool bindless_indices_declared = false;
 
     for (int i = 0; i < 4; i++) {
 
@@ -1356,12 +1715,31 @@ static MString* psh_convert(struct PixelShader *ps)
             break;
         }
 
-        if (sampler_type != NULL) {
+        if (sampler_type != NULL && ps->opts.bindless_textures) {
+            // Same descriptor array for all stages, viewed with the type of
+            // the texture bound to this one
+            if (!bindless_indices_declared) {
+                mstring_append(preflight,
+                               "layout(push_constant) uniform PushConstants {\n"
+                               "    uint texIndex[4];\n"
+                               "};\n");
+                bindless_indices_declared = true;
+            }
+            mstring_append_fmt(preflight,
+                               "layout(set = %d, binding = %d) uniform %s "
+                               "texSampArray%d[%d];\n"
+                               "#define texSamp%d texSampArray%d[texIndex[%d]]\n",
+                               ps->opts.bindless_tex_set,
+                               ps->opts.bindless_tex_binding, sampler_type, i,
+                               ps->opts.bindless_tex_count, i, i, i);
+        } else if (sampler_type != NULL) {
             if (ps->opts.vulkan) {
                 mstring_append_fmt(preflight, "layout(binding = %d) ", ps->opts.tex_binding + i);
             }
             mstring_append_fmt(preflight, "uniform %s texSamp%d;\n", sampler_type, i);
+        }
 
+        if (sampler_type != NULL) {
             /* As this means a texture fetch does happen, do alphakill */
             if (ps->state->alphakill[i]) {
                 mstring_append_fmt(vars, "if (t%d.a == 0.0) { discard; };\n",
@@ -1422,16 +1800,29 @@ static MString* psh_convert(struct PixelShader *ps)
         }
     }
 
+    eliminate_dead_stages(ps);
+
     for (int i = 0; i < ps->num_stages; i++) {
         ps->cur_stage = i;
         mstring_append_fmt(ps->code, "// Stage %d\n", i);
-        MString* color = add_stage_code(ps, ps->stage[i].rgb_input, ps->stage[i].rgb_output, "rgb", false);
-        MString* alpha = add_stage_code(ps, ps->stage[i].alpha_input, ps->stage[i].alpha_output, "a", true);
+        MString *color = NULL, *alpha = NULL;
+        if (has_stage_outputs(&ps->stage[i].rgb_output)) {
+            color = add_stage_code(ps, ps->stage[i].rgb_input,
+                                   ps->stage[i].rgb_output, "rgb", false);
+        }
+        if (has_stage_outputs(&ps->stage[i].alpha_output)) {
+            alpha = add_stage_code(ps, ps->stage[i].alpha_input,
+                                   ps->stage[i].alpha_output, "a", true);
+        }
 
-        mstring_append(ps->code, mstring_get_str(color));
-        mstring_append(ps->code, mstring_get_str(alpha));
-        mstring_unref(color);
-        mstring_unref(alpha);
+        if (color) {
+            mstring_append(ps->code, mstring_get_str(color));
+            mstring_unref(color);
+        }
+        if (alpha) {
+            mstring_append(ps->code, mstring_get_str(alpha));
+            mstring_unref(alpha);
+        }
     }
 
     if (ps->final_input.enabled) {
@@ -1440,7 +1831,34 @@ static MString* psh_convert(struct PixelShader *ps)
         add_final_stage_code(ps, ps->final_input);
     }
 
-    if (ps->state->alpha_test && ps->state->alpha_func != ALPHA_FUNC_ALWAYS) {
+    if (ps->opts.uber_combiners) {
+        add_uber_combiner_code(ps);
+    }
+
+    if (ps->opts.use_spec_constants) {
+        mstring_append_fmt(preflight,
+                           "layout(constant_id = %d) const int alphaFunc = "
+                           "%d;\n",
+                           PSH_SPEC_CONSTANT_ALPHA_FUNC, ALPHA_FUNC_ALWAYS);
+        // clang-format off
+        mstring_append_fmt(ps->code,
+            "if (alphaFunc != %d) {\n"
+            "  int fragAlpha = int(round(fragColor.a * 255.0));\n"
+            "  bool alphaPass = false;\n"
+            "  if (alphaFunc == %d) alphaPass = fragAlpha < alphaRef;\n"
+            "  else if (alphaFunc == %d) alphaPass = fragAlpha == alphaRef;\n"
+            "  else if (alphaFunc == %d) alphaPass = fragAlpha <= alphaRef;\n"
+            "  else if (alphaFunc == %d) alphaPass = fragAlpha > alphaRef;\n"
+            "  else if (alphaFunc == %d) alphaPass = fragAlpha != alphaRef;\n"
+            "  else if (alphaFunc == %d) alphaPass = fragAlpha >= alphaRef;\n"
+            "  if (!alphaPass) discard;\n"
+            "}\n",
+            ALPHA_FUNC_ALWAYS, ALPHA_FUNC_LESS, ALPHA_FUNC_EQUAL,
+            ALPHA_FUNC_LEQUAL, ALPHA_FUNC_GREATER, ALPHA_FUNC_NOTEQUAL,
+            ALPHA_FUNC_GEQUAL);
+        // clang-format on
+    } else if (ps->state->alpha_test &&
+               ps->state->alpha_func != ALPHA_FUNC_ALWAYS) {
         if (ps->state->alpha_func == ALPHA_FUNC_NEVER) {
             mstring_append(ps->code, "discard;\n");
         } else {
@@ -1630,6 +2048,23 @@ void pgraph_glsl_set_psh_uniform_values(PGRAPHState *pg,
             }
         }
     }
+    if (locs[PshUniform_combinerCtl] != -1) {
+        values->combinerCtl[0] = pgraph_reg_r(pg, NV_PGRAPH_COMBINECTL);
+        values->combinerSpecFog[0] =
+            pgraph_reg_r(pg, NV_PGRAPH_COMBINESPECFOG0);
+        values->combinerSpecFog[1] =
+            pgraph_reg_r(pg, NV_PGRAPH_COMBINESPECFOG1);
+        for (int i = 0; i < 8; i++) {
+            values->combinerColorI[i] =
+                pgraph_reg_r(pg, NV_PGRAPH_COMBINECOLORI0 + i * 4);
+            values->combinerColorO[i] =
+                pgraph_reg_r(pg, NV_PGRAPH_COMBINECOLORO0 + i * 4);
+            values->combinerAlphaI[i] =
+                pgraph_reg_r(pg, NV_PGRAPH_COMBINEALPHAI0 + i * 4);
+            values->combinerAlphaO[i] =
+                pgraph_reg_r(pg, NV_PGRAPH_COMBINEALPHAO0 + i * 4);
+        }
+    }
     if (locs[PshUniform_alphaRef] != -1) {
         int alpha_ref = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0),
                                  NV_PGRAPH_CONTROL_0_ALPHAREF);
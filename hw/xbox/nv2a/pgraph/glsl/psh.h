@@ -76,28 +76,50 @@ typedef struct PshState {
 
 void pgraph_glsl_set_psh_state(PGRAPHState *pg, PshState *state);
 
-#define PSH_UNIFORM_DECL_X(S, DECL) \
-    DECL(S, alphaRef, int, 1)       \
-    DECL(S, bumpMat, mat2, 4)       \
-    DECL(S, bumpOffset, float, 4)   \
-    DECL(S, bumpScale, float, 4)    \
-    DECL(S, clipRange, vec4, 1)     \
-    DECL(S, clipRegion, ivec4, 8)   \
-    DECL(S, colorKey, uint, 4)      \
-    DECL(S, colorKeyMask, uint, 4)  \
-    DECL(S, consts, vec4, 18)       \
-    DECL(S, depthFactor, float, 1)  \
-    DECL(S, depthOffset, float, 1)  \
-    DECL(S, fogColor, vec4, 1)      \
-    DECL(S, surfaceScale, ivec2, 1) \
+#define PSH_UNIFORM_DECL_X(S, DECL)   \
+    DECL(S, alphaRef, int, 1)         \
+    DECL(S, bumpMat, mat2, 4)         \
+    DECL(S, bumpOffset, float, 4)     \
+    DECL(S, bumpScale, float, 4)      \
+    DECL(S, clipRange, vec4, 1)       \
+    DECL(S, clipRegion, ivec4, 8)     \
+    DECL(S, colorKey, uint, 4)        \
+    DECL(S, colorKeyMask, uint, 4)    \
+    DECL(S, combinerAlphaI, uint, 8)  \
+    DECL(S, combinerAlphaO, uint, 8)  \
+    DECL(S, combinerColorI, uint, 8)  \
+    DECL(S, combinerColorO, uint, 8)  \
+    DECL(S, combinerCtl, uint, 1)     \
+    DECL(S, combinerSpecFog, uint, 2) \
+    DECL(S, consts, vec4, 18)         \
+    DECL(S, depthFactor, float, 1)    \
+    DECL(S, depthOffset, float, 1)    \
+    DECL(S, fogColor, vec4, 1)        \
+    DECL(S, surfaceScale, ivec2, 1)   \
     DECL(S, texScale, float, 4)
 
 DECL_UNIFORM_TYPES(PshUniform, PSH_UNIFORM_DECL_X)
 
+// Specialization constant ids, with use_spec_constants
+#define PSH_SPEC_CONSTANT_ALPHA_FUNC 0
+
 typedef struct GenPshGlslOptions {
     bool vulkan;
     int ubo_binding;
     int tex_binding;
+    // Interpret the register combiner setup from uniforms instead of
+    // generating code for it. The combiner fields of PshState are ignored.
+    bool uber_combiners;
+    // Sample from one array of bindless_tex_count textures, indexed by push
+    // constants, instead of from the bindings at tex_binding
+    bool bindless_textures;
+    int bindless_tex_set;
+    int bindless_tex_binding;
+    int bindless_tex_count;
+    // Vulkan only. Select the alpha test function with a specialization
+    // constant, ALPHA_FUNC_ALWAYS when the test is disabled. The alpha_test
+    // and alpha_func fields of PshState are ignored.
+    bool use_spec_constants;
 } GenPshGlslOptions;
 
 MString *pgraph_glsl_gen_psh(const PshState *state, GenPshGlslOptions opts);
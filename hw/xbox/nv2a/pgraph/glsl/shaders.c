@@ -17,9 +17,205 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu/fast-hash.h"
+#include "qemu/mstring.h"
+#include "qemu/thread.h"
+#include "hw/xbox/nv2a/debug.h"
 #include "hw/xbox/nv2a/pgraph/pgraph.h"
 #include "shaders.h"
 
+#define SHADER_CODE_CACHE_MAX_ENTRIES 1024
+/* Well under the smallest renderer shader cache, so prewarming evicts none */
+#define SHADER_STATE_HISTORY_MAX_ENTRIES 512
+
+typedef struct ShaderCodeCacheEntry {
+    ShaderCodeKey key;
+    char *code;
+} ShaderCodeCacheEntry;
+
+static QemuMutex shader_code_cache_lock;
+static GHashTable *shader_code_cache;
+
+/* Shader states seen by any renderer, oldest first, guarded by the lock */
+static GHashTable *shader_state_history_set;
+static GQueue shader_state_history = G_QUEUE_INIT;
+
+const char *nv2a_dbg_shader_dump_dir;
+
+static guint shader_code_cache_entry_hash(gconstpointer key)
+{
+    return fast_hash(key, sizeof(ShaderCodeKey));
+}
+
+static gboolean shader_code_cache_entry_equal(gconstpointer a,
+                                              gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(ShaderCodeKey));
+}
+
+static void shader_code_cache_entry_free(gpointer data)
+{
+    ShaderCodeCacheEntry *entry = data;
+    g_free(entry->code);
+    g_free(entry);
+}
+
+static guint shader_state_hash(gconstpointer key)
+{
+    return fast_hash(key, sizeof(ShaderState));
+}
+
+static gboolean shader_state_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(ShaderState));
+}
+
+static void shader_code_cache_init(void)
+{
+    static gsize initialized;
+
+    if (g_once_init_enter(&initialized)) {
+        qemu_mutex_init(&shader_code_cache_lock);
+        shader_code_cache =
+            g_hash_table_new_full(shader_code_cache_entry_hash,
+                                  shader_code_cache_entry_equal, NULL,
+                                  shader_code_cache_entry_free);
+        shader_state_history_set = g_hash_table_new_full(
+            shader_state_hash, shader_state_equal, g_free, NULL);
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+static char *generate_shader_code(const ShaderCodeKey *key)
+{
+    MString *code;
+
+    /* Generation builds many short lived strings, all freed at the end */
+    mstring_arena_begin();
+
+    switch (key->stage) {
+    case SHADER_CODE_VERTEX:
+        code = pgraph_glsl_gen_vsh(&key->vsh.state, key->vsh.glsl_opts);
+        break;
+    case SHADER_CODE_GEOMETRY:
+        code = pgraph_glsl_gen_geom(&key->geom.state, key->geom.glsl_opts);
+        break;
+    case SHADER_CODE_FRAGMENT:
+        code = pgraph_glsl_gen_psh(&key->psh.state, key->psh.glsl_opts);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    char *ret = g_strdup(mstring_get_str(code));
+    mstring_unref(code);
+    mstring_arena_end();
+
+    return ret;
+}
+
+char *pgraph_glsl_get_shader_code(const ShaderCodeKey *key)
+{
+    shader_code_cache_init();
+
+    char *code = NULL;
+
+    qemu_mutex_lock(&shader_code_cache_lock);
+    ShaderCodeCacheEntry *entry = g_hash_table_lookup(shader_code_cache, key);
+    if (entry) {
+        code = g_strdup(entry->code);
+    }
+    qemu_mutex_unlock(&shader_code_cache_lock);
+
+    if (code) {
+        return code;
+    }
+
+    /* Generate without the lock, another thread may race to the same key */
+    code = generate_shader_code(key);
+
+    entry = g_new(ShaderCodeCacheEntry, 1);
+    memcpy(&entry->key, key, sizeof(ShaderCodeKey));
+    entry->code = g_strdup(code);
+
+    qemu_mutex_lock(&shader_code_cache_lock);
+    if (g_hash_table_size(shader_code_cache) >=
+        SHADER_CODE_CACHE_MAX_ENTRIES) {
+        g_hash_table_remove_all(shader_code_cache);
+    }
+    g_hash_table_replace(shader_code_cache, &entry->key, entry);
+    qemu_mutex_unlock(&shader_code_cache_lock);
+
+    return code;
+}
+
+void pgraph_glsl_record_shader_state(const ShaderState *state)
+{
+    shader_code_cache_init();
+
+    qemu_mutex_lock(&shader_code_cache_lock);
+    if (!g_hash_table_contains(shader_state_history_set, state)) {
+        if (g_queue_get_length(&shader_state_history) >=
+            SHADER_STATE_HISTORY_MAX_ENTRIES) {
+            g_hash_table_remove(shader_state_history_set,
+                                g_queue_pop_head(&shader_state_history));
+        }
+        ShaderState *copy = g_memdup2(state, sizeof(ShaderState));
+        g_hash_table_add(shader_state_history_set, copy);
+        g_queue_push_tail(&shader_state_history, copy);
+    }
+    qemu_mutex_unlock(&shader_code_cache_lock);
+}
+
+ShaderState *pgraph_glsl_get_shader_state_history(size_t *num_states)
+{
+    shader_code_cache_init();
+
+    qemu_mutex_lock(&shader_code_cache_lock);
+    size_t n = g_queue_get_length(&shader_state_history);
+    ShaderState *states = g_new(ShaderState, MAX(n, 1));
+    size_t i = n;
+    /* Most recently seen first, as those are the most likely to be needed */
+    for (GList *l = shader_state_history.head; l; l = l->next) {
+        memcpy(&states[--i], l->data, sizeof(ShaderState));
+    }
+    qemu_mutex_unlock(&shader_code_cache_lock);
+
+    *num_states = n;
+    return states;
+}
+
+void pgraph_glsl_dump_shader_state(const ShaderState *state)
+{
+    if (!nv2a_dbg_shader_dump_dir) {
+        return;
+    }
+
+    uint64_t hash = fast_hash((const uint8_t *)state, sizeof(*state));
+    g_autofree char *name =
+        g_strdup_printf("%016" PRIx64 SHADER_STATE_DUMP_SUFFIX, hash);
+    g_autofree char *path =
+        g_build_filename(nv2a_dbg_shader_dump_dir, name, NULL);
+    if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+        return;
+    }
+
+    ShaderStateDump *dump = g_new0(ShaderStateDump, 1);
+    memcpy(dump->magic, SHADER_STATE_DUMP_MAGIC, sizeof(dump->magic));
+    dump->version = SHADER_STATE_DUMP_VERSION;
+    dump->state_size = sizeof(ShaderState);
+    memcpy(&dump->state, state, sizeof(ShaderState));
+
+    GError *err = NULL;
+    if (!g_file_set_contents(path, (const gchar *)dump, sizeof(*dump),
+                             &err)) {
+        fprintf(stderr, "nv2a: failed to dump shader state to %s: %s\n",
+                path, err->message);
+        g_error_free(err);
+    }
+    g_free(dump);
+}
+
 ShaderState pgraph_glsl_get_shader_state(PGRAPHState *pg)
 {
     pg->program_data_dirty = false; /* fixme */
@@ -36,29 +232,81 @@ ShaderState pgraph_glsl_get_shader_state(PGRAPHState *pg)
     return state;
 }
 
-bool pgraph_glsl_check_shader_state_dirty(PGRAPHState *pg,
-                                          const ShaderState *state)
+static bool check_regs_dirty(PGRAPHState *pg, const unsigned int *regs,
+                             size_t num_regs)
+{
+    for (size_t i = 0; i < num_regs; i++) {
+        if (pgraph_is_reg_dirty(pg, regs[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool check_vsh_state_dirty(PGRAPHState *pg, const VshState *state)
 {
     if (pg->program_data_dirty) {
         return true;
     }
 
-    unsigned int regs[] = {
-        NV_PGRAPH_COMBINECTL,      NV_PGRAPH_COMBINESPECFOG0,
-        NV_PGRAPH_COMBINESPECFOG1, NV_PGRAPH_CONTROL_0,
-        NV_PGRAPH_CONTROL_3,       NV_PGRAPH_CSV0_C,
-        NV_PGRAPH_CSV0_D,          NV_PGRAPH_CSV1_A,
-        NV_PGRAPH_CSV1_B,          NV_PGRAPH_POINTSIZE,
-        NV_PGRAPH_SETUPRASTER,     NV_PGRAPH_SHADERCLIPMODE,
-        NV_PGRAPH_SHADERCTL,       NV_PGRAPH_SHADERPROG,
-        NV_PGRAPH_SHADOWCTL,       NV_PGRAPH_ZCOMPRESSOCCLUDE,
+    static const unsigned int regs[] = {
+        NV_PGRAPH_CONTROL_0, NV_PGRAPH_CONTROL_3, NV_PGRAPH_CSV0_C,
+        NV_PGRAPH_CSV0_D,    NV_PGRAPH_CSV1_A,    NV_PGRAPH_CSV1_B,
+        NV_PGRAPH_POINTSIZE,
     };
-    for (int i = 0; i < ARRAY_SIZE(regs); i++) {
-        if (pgraph_is_reg_dirty(pg, regs[i])) {
+    if (check_regs_dirty(pg, regs, ARRAY_SIZE(regs))) {
+        return true;
+    }
+
+    if (pg->uniform_attrs != state->uniform_attrs ||
+        pg->swizzle_attrs != state->swizzle_attrs ||
+        pg->compressed_attrs != state->compressed_attrs ||
+        pg->vsh_pretransformed != state->pretransformed ||
+        pg->surface_scale_factor != state->surface_scale_factor) {
+        return true;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (pg->texture_matrix_enable[i] !=
+            state->fixed_function.texture_matrix_enable[i]) {
             return true;
         }
     }
 
+    return false;
+}
+
+static bool check_geom_state_dirty(PGRAPHState *pg, const GeomState *state)
+{
+    static const unsigned int regs[] = {
+        NV_PGRAPH_CONTROL_0,
+        NV_PGRAPH_CONTROL_3,
+        NV_PGRAPH_SETUPRASTER,
+    };
+
+    return pg->primitive_mode != state->primitive_mode ||
+           check_regs_dirty(pg, regs, ARRAY_SIZE(regs));
+}
+
+static bool check_psh_state_dirty(PGRAPHState *pg, const PshState *state)
+{
+    static const unsigned int regs[] = {
+        NV_PGRAPH_COMBINECTL,      NV_PGRAPH_COMBINESPECFOG0,
+        NV_PGRAPH_COMBINESPECFOG1, NV_PGRAPH_CONTROL_0,
+        NV_PGRAPH_CONTROL_3,       NV_PGRAPH_SETUPRASTER,
+        NV_PGRAPH_SHADERCLIPMODE,  NV_PGRAPH_SHADERCTL,
+        NV_PGRAPH_SHADERPROG,      NV_PGRAPH_SHADOWCTL,
+        NV_PGRAPH_ZCOMPRESSOCCLUDE,
+    };
+    if (check_regs_dirty(pg, regs, ARRAY_SIZE(regs))) {
+        return true;
+    }
+
+    if (pg->surface_shape.zeta_format != state->surface_zeta_format) {
+        return true;
+    }
+
     int num_stages = pgraph_reg_r(pg, NV_PGRAPH_COMBINECTL) & 0xFF;
     for (int i = 0; i < num_stages; i++) {
         if (pgraph_is_reg_dirty(pg, NV_PGRAPH_COMBINEALPHAI0 + i * 4) ||
@@ -69,27 +317,48 @@ bool pgraph_glsl_check_shader_state_dirty(PGRAPHState *pg,
         }
     }
 
-    if (pg->uniform_attrs != state->vsh.uniform_attrs ||
-        pg->swizzle_attrs != state->vsh.swizzle_attrs ||
-        pg->compressed_attrs != state->vsh.compressed_attrs ||
-        pg->primitive_mode != state->geom.primitive_mode ||
-        pg->surface_scale_factor != state->vsh.surface_scale_factor ||
-        pg->surface_shape.zeta_format != state->psh.surface_zeta_format) {
-        return true;
-    }
-
     for (int i = 0; i < 4; i++) {
         if (pgraph_is_reg_dirty(pg, NV_PGRAPH_TEXCTL0_0 + i * 4) ||
             pgraph_is_reg_dirty(pg, NV_PGRAPH_TEXFILTER0 + i * 4) ||
             pgraph_is_reg_dirty(pg, NV_PGRAPH_TEXFMT0 + i * 4)) {
             return true;
         }
-
-        if (pg->texture_matrix_enable[i] !=
-            state->vsh.fixed_function.texture_matrix_enable[i]) {
-            return true;
-        }
     }
 
     return false;
 }
+
+bool pgraph_glsl_check_shader_state_dirty(PGRAPHState *pg,
+                                          const ShaderState *state)
+{
+    return check_vsh_state_dirty(pg, &state->vsh) ||
+           check_geom_state_dirty(pg, &state->geom) ||
+           check_psh_state_dirty(pg, &state->psh);
+}
+
+bool pgraph_glsl_update_shader_state(PGRAPHState *pg, ShaderState *state)
+{
+    bool updated = false;
+
+    /* Fragments are zeroed before being re-derived as the state is hashed */
+    if (check_vsh_state_dirty(pg, &state->vsh)) {
+        pg->program_data_dirty = false;
+        memset(&state->vsh, 0, sizeof(state->vsh));
+        pgraph_glsl_set_vsh_state(pg, &state->vsh);
+        updated = true;
+    }
+
+    if (check_geom_state_dirty(pg, &state->geom)) {
+        memset(&state->geom, 0, sizeof(state->geom));
+        pgraph_glsl_set_geom_state(pg, &state->geom);
+        updated = true;
+    }
+
+    if (check_psh_state_dirty(pg, &state->psh)) {
+        memset(&state->psh, 0, sizeof(state->psh));
+        pgraph_glsl_set_psh_state(pg, &state->psh);
+        updated = true;
+    }
+
+    return updated;
+}
@@ -32,9 +32,78 @@ typedef struct ShaderState {
 
 typedef struct PGRAPHState PGRAPHState;
 
+enum ShaderCodeStage {
+    SHADER_CODE_VERTEX,
+    SHADER_CODE_GEOMETRY,
+    SHADER_CODE_FRAGMENT,
+};
+
+/* Everything the GLSL of one shader stage is generated from */
+typedef struct ShaderCodeKey {
+    enum ShaderCodeStage stage;
+    union {
+        struct {
+            VshState state;
+            GenVshGlslOptions glsl_opts;
+        } vsh;
+        struct {
+            GeomState state;
+            GenGeomGlslOptions glsl_opts;
+        } geom;
+        struct {
+            PshState state;
+            GenPshGlslOptions glsl_opts;
+        } psh;
+    };
+} ShaderCodeKey;
+
+/*
+ * Returns the GLSL for a key, to be freed with g_free(). Generated code is
+ * kept in a cache shared by the renderers and outliving them, so it is not
+ * generated again when a renderer evicts a module, or is switched away from
+ * and back to. The key must be zeroed before it is filled in, as it is
+ * hashed. Safe to call from any thread.
+ */
+char *pgraph_glsl_get_shader_code(const ShaderCodeKey *key);
+
+/*
+ * Remembers a shader state a renderer built shaders for. The most recent ones
+ * are kept across renderer switches, so that the new renderer can build its
+ * shaders for them ahead of the draws that need them. Safe to call from any
+ * thread.
+ */
+void pgraph_glsl_record_shader_state(const ShaderState *state);
+
+/* Returns the remembered states, most recent first, to be freed with g_free() */
+ShaderState *pgraph_glsl_get_shader_state_history(size_t *num_states);
+
+/*
+ * With -nv2a_shader_dump <dir>, every shader state is written to <dir> the
+ * first time a renderer generates shaders for it, to build a corpus for
+ * tests/xbox/shaders. The state is stored raw, so a dump is only usable by a
+ * build with the same ShaderState layout (the size is checked on load).
+ */
+#define SHADER_STATE_DUMP_MAGIC "NV2ASHD"
+#define SHADER_STATE_DUMP_VERSION 1
+#define SHADER_STATE_DUMP_SUFFIX ".nv2ashd"
+
+typedef struct ShaderStateDump {
+    char magic[8];
+    uint32_t version;
+    uint32_t state_size;
+    ShaderState state;
+} ShaderStateDump;
+
+void pgraph_glsl_dump_shader_state(const ShaderState *state);
+
 ShaderState pgraph_glsl_get_shader_state(PGRAPHState *pg);
 
 bool pgraph_glsl_check_shader_state_dirty(PGRAPHState *pg,
                                           const ShaderState *state);
 
+/* Re-derive only the parts of a previously derived state whose inputs have
+ * been dirtied since. Returns true if anything was re-derived.
+ */
+bool pgraph_glsl_update_shader_state(PGRAPHState *pg, ShaderState *state);
+
 #endif
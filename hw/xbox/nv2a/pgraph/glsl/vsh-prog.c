@@ -27,6 +27,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/fast-hash.h"
+#include "qemu/thread.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -723,20 +725,69 @@ static const char* vsh_header =
     "  return t;\n"
     "}\n";
 
-void pgraph_glsl_gen_vsh_prog(uint16_t version, const uint32_t *tokens,
-                              unsigned int length, MString *header,
-                              MString *body)
+/*
+ * Shader state misses mostly differ in state other than the vertex program,
+ * so the translated program is kept by its tokens and spliced into new
+ * variants. The cache is dropped when it fills up.
+ */
+#define VSH_PROG_CACHE_MAX_ENTRIES 1024
+
+typedef struct VshProgCacheEntry {
+    uint32_t *tokens;
+    unsigned int length;
+    char *translation;
+} VshProgCacheEntry;
+
+static QemuMutex vsh_prog_cache_lock;
+static GHashTable *vsh_prog_cache;
+
+static guint vsh_prog_cache_entry_hash(gconstpointer key)
 {
+    const VshProgCacheEntry *entry = key;
+    return fast_hash((const uint8_t *)entry->tokens,
+                     entry->length * VSH_TOKEN_SIZE * sizeof(uint32_t));
+}
 
-    mstring_append(header, vsh_header);
+static gboolean vsh_prog_cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const VshProgCacheEntry *entry_a = a, *entry_b = b;
+    return entry_a->length == entry_b->length &&
+           !memcmp(entry_a->tokens, entry_b->tokens,
+                   entry_a->length * VSH_TOKEN_SIZE * sizeof(uint32_t));
+}
 
+static void vsh_prog_cache_entry_free(gpointer data)
+{
+    VshProgCacheEntry *entry = data;
+    g_free(entry->tokens);
+    g_free(entry->translation);
+    g_free(entry);
+}
+
+static void vsh_prog_cache_init(void)
+{
+    static gsize initialized;
+
+    if (g_once_init_enter(&initialized)) {
+        qemu_mutex_init(&vsh_prog_cache_lock);
+        vsh_prog_cache =
+            g_hash_table_new_full(vsh_prog_cache_entry_hash,
+                                  vsh_prog_cache_entry_equal,
+                                  vsh_prog_cache_entry_free, NULL);
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+static MString *translate_program(const uint32_t *tokens, unsigned int length)
+{
+    MString *ret = mstring_new();
     bool has_final = false;
     int slot;
 
     for (slot=0; slot < length; slot++) {
         const uint32_t* cur_token = &tokens[slot * VSH_TOKEN_SIZE];
         MString *token_str = decode_token(cur_token);
-        mstring_append_fmt(body,
+        mstring_append_fmt(ret,
                            "  /* Slot %d: 0x%08X 0x%08X 0x%08X 0x%08X */\n"
                            "  %s\n",
                            slot, cur_token[0], cur_token[1], cur_token[2],
@@ -750,6 +801,11 @@ void pgraph_glsl_gen_vsh_prog(uint16_t version, const uint32_t *tokens,
     }
     assert(has_final);
 
+    return ret;
+}
+
+static void append_clip_space_transform(MString *body)
+{
     mstring_append(body,
         /* The shaders leave the result in screen space, while OpenGL expects it
          * in clip space.
@@ -770,3 +826,61 @@ void pgraph_glsl_gen_vsh_prog(uint16_t version, const uint32_t *tokens,
         "  oPos.xyz *= oPos.w;\n"
     );
 }
+
+void pgraph_glsl_gen_vsh_prog(uint16_t version, const uint32_t *tokens,
+                              unsigned int length, MString *header,
+                              MString *body)
+{
+
+    mstring_append(header, vsh_header);
+
+    vsh_prog_cache_init();
+
+    VshProgCacheEntry key = {
+        .tokens = (uint32_t *)tokens,
+        .length = length,
+    };
+
+    qemu_mutex_lock(&vsh_prog_cache_lock);
+    VshProgCacheEntry *entry = g_hash_table_lookup(vsh_prog_cache, &key);
+    if (entry) {
+        mstring_append(body, entry->translation);
+    }
+    qemu_mutex_unlock(&vsh_prog_cache_lock);
+
+    if (!entry) {
+        MString *translation = translate_program(tokens, length);
+        mstring_append(body, mstring_get_str(translation));
+
+        entry = g_new(VshProgCacheEntry, 1);
+        entry->tokens = g_memdup2(tokens, length * VSH_TOKEN_SIZE *
+                                              sizeof(uint32_t));
+        entry->length = length;
+        entry->translation = g_strdup(mstring_get_str(translation));
+        mstring_unref(translation);
+
+        qemu_mutex_lock(&vsh_prog_cache_lock);
+        if (g_hash_table_size(vsh_prog_cache) >= VSH_PROG_CACHE_MAX_ENTRIES) {
+            g_hash_table_remove_all(vsh_prog_cache);
+        }
+        g_hash_table_replace(vsh_prog_cache, entry, entry);
+        qemu_mutex_unlock(&vsh_prog_cache_lock);
+    }
+
+    append_clip_space_transform(body);
+}
+
+/*
+ * Copies every output register from the vertex attribute of the same index,
+ * for vertices already run through the vertex program on the CPU.
+ */
+void pgraph_glsl_gen_vsh_prog_passthrough(MString *body)
+{
+    for (int i = 0; i < ARRAY_SIZE(out_reg_name); i++) {
+        if (out_reg_name[i][0] == 'o') {
+            mstring_append_fmt(body, "  %s = v%d;\n", out_reg_name[i], i);
+        }
+    }
+
+    append_clip_space_transform(body);
+}
@@ -27,5 +27,6 @@
 void pgraph_glsl_gen_vsh_prog(uint16_t version, const uint32_t *tokens,
                               unsigned int length, MString *header,
                               MString *body);
+void pgraph_glsl_gen_vsh_prog_passthrough(MString *body);
 
 #endif
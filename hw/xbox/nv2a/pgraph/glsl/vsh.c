@@ -34,18 +34,6 @@ static void set_fixed_function_vsh_state(PGRAPHState *pg,
         pgraph_reg_r(pg, NV_PGRAPH_CSV0_D), NV_PGRAPH_CSV0_D_SKIN);
     state->normalization = pgraph_reg_r(pg, NV_PGRAPH_CSV0_C) &
                            NV_PGRAPH_CSV0_C_NORMALIZATION_ENABLE;
-    state->local_eye =
-        GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_LOCALEYE);
-
-    state->emission_src = (enum MaterialColorSource)GET_MASK(
-        pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_EMISSION);
-    state->ambient_src = (enum MaterialColorSource)GET_MASK(
-        pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_AMBIENT);
-    state->diffuse_src = (enum MaterialColorSource)GET_MASK(
-        pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_DIFFUSE);
-    state->specular_src = (enum MaterialColorSource)GET_MASK(
-        pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_SPECULAR);
-
     for (int i = 0; i < 4; i++) {
         state->texture_matrix_enable[i] = pg->texture_matrix_enable[i];
     }
@@ -67,6 +55,18 @@ static void set_fixed_function_vsh_state(PGRAPHState *pg,
     state->lighting =
         GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_LIGHTING);
     if (state->lighting) {
+        state->local_eye = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
+                                    NV_PGRAPH_CSV0_C_LOCALEYE);
+
+        state->emission_src = (enum MaterialColorSource)GET_MASK(
+            pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_EMISSION);
+        state->ambient_src = (enum MaterialColorSource)GET_MASK(
+            pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_AMBIENT);
+        state->diffuse_src = (enum MaterialColorSource)GET_MASK(
+            pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_DIFFUSE);
+        state->specular_src = (enum MaterialColorSource)GET_MASK(
+            pgraph_reg_r(pg, NV_PGRAPH_CSV0_C), NV_PGRAPH_CSV0_C_SPECULAR);
+
         for (int i = 0; i < NV2A_MAX_LIGHTS; i++) {
             state->light[i] =
                 (enum VshLight)GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_D),
@@ -99,6 +99,11 @@ static void set_programmable_vsh_state(PGRAPHState *pg,
     }
 }
 
+/*
+ * The state is hashed to find a shader, so fields that do not affect the
+ * generated code in the current configuration are left zeroed, and values
+ * only read by uniforms are not part of it.
+ */
 void pgraph_glsl_set_vsh_state(PGRAPHState *pg, VshState *vsh)
 {
     bool vertex_program = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_D),
@@ -117,24 +122,21 @@ void pgraph_glsl_set_vsh_state(PGRAPHState *pg, VshState *vsh)
 
     vsh->specular_enable = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
                                     NV_PGRAPH_CSV0_C_SPECULAR_ENABLE);
-    vsh->separate_specular = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
-                                      NV_PGRAPH_CSV0_C_SEPARATE_SPECULAR);
-    vsh->ignore_specular_alpha =
-        !GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
-                  NV_PGRAPH_CSV0_C_ALPHA_FROM_MATERIAL_SPECULAR);
-    vsh->specular_power = pg->specular_power;
-    vsh->specular_power_back = pg->specular_power_back;
+    if (vsh->specular_enable) {
+        vsh->separate_specular = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
+                                          NV_PGRAPH_CSV0_C_SEPARATE_SPECULAR);
+        vsh->ignore_specular_alpha =
+            !GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
+                      NV_PGRAPH_CSV0_C_ALPHA_FROM_MATERIAL_SPECULAR);
+    }
 
     vsh->z_perspective = pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
                          NV_PGRAPH_CONTROL_0_Z_PERSPECTIVE_ENABLE;
 
     vsh->point_params_enable = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_D),
                                         NV_PGRAPH_CSV0_D_POINTPARAMSENABLE);
-    vsh->point_size = pgraph_reg_r(pg, NV_PGRAPH_POINTSIZE) / 8.0f;
-    if (vsh->point_params_enable) {
-        for (int i = 0; i < 8; i++) {
-            vsh->point_params[i] = pg->point_params[i];
-        }
+    if (!vsh->point_params_enable) {
+        vsh->point_size = pgraph_reg_r(pg, NV_PGRAPH_POINTSIZE) / 8.0f;
     }
 
     vsh->smooth_shading = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_3),
@@ -151,17 +153,81 @@ void pgraph_glsl_set_vsh_state(PGRAPHState *pg, VshState *vsh)
     }
 
     vsh->is_fixed_function = fixed_function;
-    if (fixed_function) {
+    if (pg->vsh_pretransformed) {
+        assert(vertex_program);
+        vsh->pretransformed = true;
+    } else if (fixed_function) {
         set_fixed_function_vsh_state(pg, &vsh->fixed_function);
     } else {
         set_programmable_vsh_state(pg, &vsh->programmable);
     }
 }
 
+/*
+ * Fog factor for an infinite fog distance, also used in place of a NaN fog
+ * factor
+ */
+static float get_fog_saturated_result(enum VshFogMode fog_mode)
+{
+    switch (fog_mode) {
+    case FOG_MODE_LINEAR:
+    case FOG_MODE_LINEAR_ABS:
+    case FOG_MODE_EXP:
+        return 1.0f;
+    default:
+        return 0.0f;
+    }
+}
+
+static void append_fog_factor(MString *body, enum VshFogMode fog_mode)
+{
+    switch (fog_mode) {
+    case FOG_MODE_LINEAR:
+    case FOG_MODE_LINEAR_ABS:
+        /* f = (end - d) / (end - start)
+         *    fogParam.y = -1 / (end - start)
+         *    fogParam.x = 1 - end * fogParam.y;
+         */
+        mstring_append(body, "  fogFactor = fogParam.x + fogDistance * fogParam.y;\n");
+        mstring_append(body, "  fogFactor -= 1.0;\n");
+        break;
+    case FOG_MODE_EXP:
+    case FOG_MODE_EXP_ABS:
+        /* f = 1 / (e^(d * density))
+         *    fogParam.y = -density / (2 * ln(256))
+         *    fogParam.x = 1.5
+         */
+        mstring_append(body, "  fogFactor = fogParam.x + exp2(fogDistance * fogParam.y * 16.0);\n");
+        mstring_append(body, "  fogFactor -= 1.5;\n");
+        break;
+    case FOG_MODE_EXP2:
+    case FOG_MODE_EXP2_ABS:
+        /* f = 1 / (e^((d * density)^2))
+         *    fogParam.y = -density / (2 * sqrt(ln(256)))
+         *    fogParam.x = 1.5
+         */
+        mstring_append(body, "  fogFactor = fogParam.x + exp2(-fogDistance * fogDistance * fogParam.y * fogParam.y * 32.0);\n");
+        mstring_append(body, "  fogFactor -= 1.5;\n");
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    switch (fog_mode) {
+    case FOG_MODE_LINEAR_ABS:
+    case FOG_MODE_EXP_ABS:
+    case FOG_MODE_EXP2_ABS:
+        mstring_append(body, "  fogFactor = abs(fogFactor);\n");
+        break;
+    default:
+        break;
+    }
+}
+
 MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
 {
     MString *uniforms = mstring_new();
-    const char *u = opts.vulkan ? "" : "uniform ";
     for (int i = 0; i < ARRAY_SIZE(VshUniformInfo); i++) {
         const UniformInfo *info = &VshUniformInfo[i];
         const char *type_str = uniform_element_type_to_str[info->type];
@@ -171,10 +237,9 @@ MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
             continue;
         }
         if (info->count == 1) {
-            mstring_append_fmt(uniforms, "%s%s %s;\n", u, type_str,
-                               info->name);
+            mstring_append_fmt(uniforms, "%s %s;\n", type_str, info->name);
         } else {
-            mstring_append_fmt(uniforms, "%s%s %s[%zd];\n", u, type_str,
+            mstring_append_fmt(uniforms, "%s %s[%zd];\n", type_str,
                                info->name, info->count);
         }
     }
@@ -301,9 +366,13 @@ MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
     if (state->is_fixed_function) {
         pgraph_glsl_gen_vsh_ff(state, header, body);
     } else {
-        pgraph_glsl_gen_vsh_prog(
-            VSH_VERSION_XVS, (uint32_t *)state->programmable.program_data,
-            state->programmable.program_length, header, body);
+        if (state->pretransformed) {
+            pgraph_glsl_gen_vsh_prog_passthrough(body);
+        } else {
+            pgraph_glsl_gen_vsh_prog(
+                VSH_VERSION_XVS, (uint32_t *)state->programmable.program_data,
+                state->programmable.program_length, header, body);
+        }
         if (!state->point_params_enable) {
             mstring_append_fmt(body, "  oPts.x = %f * %d;\n",
                                state->point_size <= 0.f ? 1.f :
@@ -328,72 +397,38 @@ MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
 
         /* FIXME: Do this per pixel? */
 
-        float infinite_fogdistance_result = 0.0f;
-        float nan_fogfactor_result = 0.0f;
-
-        switch (state->fog_mode) {
-        case FOG_MODE_LINEAR:
-        case FOG_MODE_LINEAR_ABS:
-
-            /* f = (end - d) / (end - start)
-             *    fogParam.y = -1 / (end - start)
-             *    fogParam.x = 1 - end * fogParam.y;
-             */
-            infinite_fogdistance_result = 1.0f;
-            nan_fogfactor_result = 1.0f;
-            mstring_append(body, "  float fogFactor = fogParam.x + fogDistance * fogParam.y;\n");
-            mstring_append(body, "  fogFactor -= 1.0;\n");
-            break;
-        case FOG_MODE_EXP:
-            infinite_fogdistance_result = 1.0f;
-            nan_fogfactor_result = 1.0f;
-            /* fallthrough */
-        case FOG_MODE_EXP_ABS:
-
-            /* f = 1 / (e^(d * density))
-             *    fogParam.y = -density / (2 * ln(256))
-             *    fogParam.x = 1.5
-             */
-            mstring_append(body, "  float fogFactor = fogParam.x + exp2(fogDistance * fogParam.y * 16.0);\n");
-            mstring_append(body, "  fogFactor -= 1.5;\n");
-            break;
-        case FOG_MODE_EXP2:
-        case FOG_MODE_EXP2_ABS:
-
-            /* f = 1 / (e^((d * density)^2))
-             *    fogParam.y = -density / (2 * sqrt(ln(256)))
-             *    fogParam.x = 1.5
-             */
-
-            mstring_append(body, "  float fogFactor = fogParam.x + exp2(-fogDistance * fogDistance * fogParam.y * fogParam.y * 32.0);\n");
-            mstring_append(body, "  fogFactor -= 1.5;\n");
-            break;
-        default:
-            assert(false);
-            break;
-        }
-        switch (state->fog_mode) {
-        case FOG_MODE_LINEAR_ABS:
-        case FOG_MODE_EXP_ABS:
-        case FOG_MODE_EXP2_ABS:
-            mstring_append(body, "  fogFactor = abs(fogFactor);\n");
-            break;
-        default:
-            break;
+        mstring_append(body, "  float fogFactor;\n");
+        if (opts.use_spec_constants) {
+            static const enum VshFogMode fog_modes[] = {
+                FOG_MODE_LINEAR,     FOG_MODE_EXP,     FOG_MODE_EXP2,
+                FOG_MODE_LINEAR_ABS, FOG_MODE_EXP_ABS, FOG_MODE_EXP2_ABS,
+            };
+            mstring_append(body, "  float fogSaturated = 0.0;\n");
+            for (int i = 0; i < ARRAY_SIZE(fog_modes); i++) {
+                mstring_append_fmt(body, "  %sif (fogMode == %d) {\n",
+                                   i ? "} else " : "", fog_modes[i]);
+                append_fog_factor(body, fog_modes[i]);
+                mstring_append_fmt(body, "  fogSaturated = %f;\n",
+                                   get_fog_saturated_result(fog_modes[i]));
+            }
+            mstring_append(body, "  }\n");
+        } else {
+            append_fog_factor(body, state->fog_mode);
+            mstring_append_fmt(body, "  const float fogSaturated = %f;\n",
+                               get_fog_saturated_result(state->fog_mode));
         }
 
         /* Fog is clamped to min/max normal float values here to match HW
          * interpolation. It is then clamped to [0,1] in the pixel shader.
          */
         // clang-format off
-        mstring_append_fmt(
+        mstring_append(
             body,
             "  if (isinf(fogDistance)) {\n"
-            "    oFog = vec4(%f);\n"
+            "    oFog = vec4(fogSaturated);\n"
             "  } else {\n"
-            "    oFog = clamp(NaNToValue(vec4(fogFactor), %f), -FLOAT_MAX, FLOAT_MAX);\n"
-            "  }\n",
-            infinite_fogdistance_result, nan_fogfactor_result);
+            "    oFog = clamp(NaNToValue(vec4(fogFactor), fogSaturated), -FLOAT_MAX, FLOAT_MAX);\n"
+            "  }\n");
         // clang-format on
     }
 
@@ -453,9 +488,9 @@ MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
             opts.use_push_constants_for_uniform_attrs) {
             mstring_append_fmt(output,
                                "layout(push_constant) uniform PushConstants {\n"
-                               "    vec4 inlineValue[%d];\n"
+                               "    layout(offset = %d) vec4 inlineValue[%d];\n"
                                "};\n\n",
-                               num_uniform_attrs);
+                               opts.push_constants_offset, num_uniform_attrs);
         }
         mstring_append_fmt(
             output,
@@ -463,9 +498,19 @@ MString *pgraph_glsl_gen_vsh(const VshState *state, GenVshGlslOptions opts)
             "%s"
             "};\n\n",
             opts.ubo_binding, mstring_get_str(uniforms));
+        if (opts.use_spec_constants && state->fog_enable) {
+            mstring_append_fmt(output,
+                               "layout(constant_id = %d) const int fogMode = "
+                               "%d;\n\n",
+                               VSH_SPEC_CONSTANT_FOG_MODE, FOG_MODE_LINEAR);
+        }
     } else {
-        mstring_append(
-            output, mstring_get_str(uniforms));
+        /* Block binding is assigned with glUniformBlockBinding */
+        mstring_append_fmt(output,
+                           "layout(std140) uniform VshUniforms {\n"
+                           "%s"
+                           "};\n\n",
+                           mstring_get_str(uniforms));
     }
 
     mstring_append(output, mstring_get_str(header));
@@ -60,17 +60,16 @@ typedef struct {
     bool specular_enable;
     bool separate_specular;
     bool ignore_specular_alpha;
-    float specular_power;
-    float specular_power_back;
 
     bool point_params_enable;
     float point_size;
-    float point_params[8];
 
     bool smooth_shading;
     bool z_perspective;
 
     bool is_fixed_function;
+    // The vertex program already ran on the CPU, outputs come in attributes
+    bool pretransformed;
     FixedFunctionVshState fixed_function;
     ProgrammableVshState programmable;
 } VshState;
@@ -96,11 +95,18 @@ void pgraph_glsl_set_vsh_state(PGRAPHState *pg, VshState *state);
 
 DECL_UNIFORM_TYPES(VshUniform, VSH_UNIFORM_DECL_X)
 
+// Specialization constant ids, with use_spec_constants
+#define VSH_SPEC_CONSTANT_FOG_MODE 0
+
 typedef struct GenVshGlslOptions {
     bool vulkan;
     bool prefix_outputs;
     bool use_push_constants_for_uniform_attrs;
+    int push_constants_offset; // Of the uniform attrs
     int ubo_binding;
+    // Vulkan only. Select the fog mode with a specialization constant
+    // instead of generating code for it. The fog_mode of VshState is ignored.
+    bool use_spec_constants;
 } GenVshGlslOptions;
 
 MString *pgraph_glsl_gen_vsh(const VshState *state,
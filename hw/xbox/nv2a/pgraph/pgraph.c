@@ -22,10 +22,12 @@
 #include <math.h>
 
 #include "hw/xbox/nv2a/nv2a_int.h"
+#include "qemu/thread-stats.h"
 #include "ui/xemu-notifications.h"
 #include "ui/xemu-settings.h"
 #include "util.h"
 #include "swizzle.h"
+#include "glsl/shaders.h"
 #include "nv2a_vsh_emulator.h"
 
 #define PG_GET_MASK(reg, mask) GET_MASK(pgraph_reg_r(pg, reg), mask)
@@ -44,17 +46,23 @@ uint64_t pgraph_read(void *opaque, hwaddr addr, unsigned int size)
     NV2AState *d = (NV2AState *)opaque;
     PGRAPHState *pg = &d->pgraph;
 
-    qemu_mutex_lock(&pg->lock);
-
+    /*
+     * Guest drivers poll status and interrupt registers while the PFIFO
+     * thread holds the lock for entire method runs. Registers are published
+     * atomically, so only RDI reads, which auto-increment the index, need to
+     * be serialized.
+     */
     uint64_t r = 0;
     switch (addr) {
     case NV_PGRAPH_INTR:
-        r = pg->pending_interrupts;
+        r = qatomic_load_acquire(&pg->pending_interrupts);
         break;
     case NV_PGRAPH_INTR_EN:
-        r = pg->enabled_interrupts;
+        r = qatomic_read(&pg->enabled_interrupts);
         break;
     case NV_PGRAPH_RDI_DATA: {
+        qemu_mutex_lock(&pg->lock);
+
         unsigned int select = PG_GET_MASK(NV_PGRAPH_RDI_INDEX,
                                        NV_PGRAPH_RDI_INDEX_SELECT);
         unsigned int address = PG_GET_MASK(NV_PGRAPH_RDI_INDEX,
@@ -67,16 +75,18 @@ uint64_t pgraph_read(void *opaque, hwaddr addr, unsigned int size)
                                   NV_PGRAPH_RDI_INDEX_ADDRESS));
         PG_SET_MASK(NV_PGRAPH_RDI_INDEX,
                  NV_PGRAPH_RDI_INDEX_ADDRESS, address + 1);
+
+        qemu_mutex_unlock(&pg->lock);
         break;
     }
     default:
-        r = pgraph_reg_r(pg, addr);
+        assert(addr % 4 == 0);
+        r = qatomic_read(&pg->regs_[addr]);
         break;
     }
 
-    qemu_mutex_unlock(&pg->lock);
-
     nv2a_reg_log_read(NV_PGRAPH, addr, size, r);
+    nv2a_poll_throttle(d, NV_PGRAPH, addr, r);
     return r;
 }
 
@@ -87,12 +97,14 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
 
     nv2a_reg_log_write(NV_PGRAPH, addr, size, val);
 
+    /* Dispatched without the BQL, which updating the IRQ needs */
+    BQL_LOCK_GUARD();
     qemu_mutex_lock(&d->pfifo.lock); // FIXME: Factor out fifo lock here
     qemu_mutex_lock(&pg->lock);
 
     switch (addr) {
     case NV_PGRAPH_INTR:
-        pg->pending_interrupts &= ~val;
+        qatomic_and(&pg->pending_interrupts, ~val);
 
         if (!(pg->pending_interrupts & NV_PGRAPH_INTR_ERROR)) {
             pg->waiting_for_nop = false;
@@ -103,7 +115,7 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
         pfifo_kick(d);
         break;
     case NV_PGRAPH_INTR_EN:
-        pg->enabled_interrupts = val;
+        qatomic_set(&pg->enabled_interrupts, val);
         break;
     case NV_PGRAPH_INCREMENT:
         if (val & NV_PGRAPH_INCREMENT_READ_3D) {
@@ -166,6 +178,8 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
         break;
     }
 
+    pgraph_invalidate_ctx_switch(pg);
+
     // events
     switch (addr) {
     case NV_PGRAPH_FIFO:
@@ -198,9 +212,10 @@ void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
                             NV_PGRAPH_DEBUG_3_HW_CONTEXT_SWITCH));
 
         pg->waiting_for_context_switch = true;
+        pgraph_invalidate_ctx_switch(pg);
         qemu_mutex_unlock(&pg->lock);
         bql_lock();
-        pg->pending_interrupts |= NV_PGRAPH_INTR_CONTEXT_SWITCH;
+        qatomic_or(&pg->pending_interrupts, NV_PGRAPH_INTR_CONTEXT_SWITCH);
         nv2a_update_irq(d);
         bql_unlock();
         qemu_mutex_lock(&pg->lock);
@@ -215,12 +230,17 @@ void pgraph_renderer_register(const PGRAPHRenderer *renderer)
     renderers[renderer->type] = renderer;
 }
 
+static void pgraph_init_kelvin_method_states(void);
+
 void pgraph_init(NV2AState *d)
 {
     g_nv2a = d;
 
+    pgraph_init_kelvin_method_states();
+
     PGRAPHState *pg = &d->pgraph;
     qemu_mutex_init(&pg->lock);
+    thread_stats_register_lock("pgraph", &pg->lock);
     qemu_mutex_init(&pg->renderer_lock);
     qemu_event_init(&pg->sync_complete, false);
     qemu_event_init(&pg->flush_complete, false);
@@ -240,10 +260,15 @@ void pgraph_init(NV2AState *d)
         VertexAttribute *attribute = &pg->vertex_attributes[i];
         attribute->inline_buffer = (float*)g_malloc(NV2A_MAX_BATCH_LENGTH
                                               * sizeof(float) * 4);
-        attribute->inline_buffer_populated = false;
     }
+    pg->inline_buffer_attrs = 0;
+
+    pg->optimistic_zpass_reports = g_config.perf.optimistic_zpass_reports;
+    pgraph_invalidate_zpass_report_cache(pg);
 
+    pgraph_vram_init(d);
     pgraph_clear_dirty_reg_map(pg);
+    pgraph_invalidate_ctx_switch(pg);
 }
 
 void pgraph_clear_dirty_reg_map(PGRAPHState *pg)
@@ -351,6 +376,9 @@ void pgraph_destroy(PGRAPHState *pg)
        pg->renderer->ops.finalize(d);
     }
 
+    g_free(pg->prewarm.states);
+    pgraph_vram_finalize(d);
+    thread_stats_unregister_lock(&pg->lock);
     qemu_mutex_destroy(&pg->lock);
 }
 
@@ -394,6 +422,11 @@ void nv2a_set_surface_scale_factor(unsigned int scale)
     bql_lock();
 }
 
+void nv2a_set_optimistic_zpass_reports(bool enabled)
+{
+    qatomic_set(&g_nv2a->pgraph.optimistic_zpass_reports, enabled);
+}
+
 unsigned int nv2a_get_surface_scale_factor(void)
 {
     NV2AState *d = g_nv2a;
@@ -514,6 +547,116 @@ static const struct {
 #undef DEF_METHOD_CASE_4_OFFSET
 #undef DEF_METHOD_CASE_4
 
+/* The state changed by each Kelvin method, as NV2A_PROF_STATE_*, or -1 */
+static int8_t pgraph_kelvin_method_states[ARRAY_SIZE(pgraph_kelvin_methods)];
+
+static int pgraph_get_kelvin_method_state(const char *name)
+{
+    /* The first matching prefix wins */
+    static const struct {
+        const char *prefix;
+        int state;
+    } prefixes[] = {
+        /* Vertex data and draws */
+        { "NV097_SET_BEGIN_END", -1 },
+        { "NV097_SET_VERTEX_DATA_ARRAY", NV2A_PROF_STATE_VERTEX_ARRAY },
+        { "NV097_SET_VERTEX", -1 },
+        { "NV097_SET_NORMAL", -1 },
+        { "NV097_SET_DIFFUSE_COLOR", -1 },
+        { "NV097_SET_SPECULAR_COLOR", -1 },
+        { "NV097_SET_TEXCOORD", -1 },
+        { "NV097_SET_FOG_COORD", -1 },
+        { "NV097_SET_WEIGHT", -1 },
+        /* Synchronization */
+        { "NV097_SET_OBJECT", -1 },
+        { "NV097_SET_FLIP", -1 },
+        { "NV097_SET_SEMAPHORE", -1 },
+
+        { "NV097_SET_SURFACE", NV2A_PROF_STATE_SURFACE },
+        { "NV097_SET_CONTEXT_DMA", NV2A_PROF_STATE_SURFACE },
+        { "NV097_SET_TEXTURE_MATRIX", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_TEXTURE", NV2A_PROF_STATE_TEXTURE },
+        { "NV097_SET_TRANSFORM", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_PROJECTION_MATRIX", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_MODEL_VIEW_MATRIX", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_INVERSE_MODEL_VIEW_MATRIX", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_COMPOSITE_MATRIX", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_TEXGEN", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_VIEWPORT", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_SKIN_MODE", NV2A_PROF_STATE_TRANSFORM },
+        { "NV097_SET_LIGHT", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_BACK_LIGHT", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_MATERIAL", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_COLOR_MATERIAL", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_SPECULAR_PARAMS", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_SPECULAR_ENABLE", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_SCENE_AMBIENT_COLOR", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_EYE", NV2A_PROF_STATE_LIGHTING },
+        { "NV097_SET_COMBINER", NV2A_PROF_STATE_COMBINER },
+        { "NV097_SET_SHADER", NV2A_PROF_STATE_COMBINER },
+        { "NV097_SET_DOT_RGBMAPPING", NV2A_PROF_STATE_COMBINER },
+        { "NV097_SET_SPECULAR_FOG_FACTOR", NV2A_PROF_STATE_COMBINER },
+        { "NV097_SET_", NV2A_PROF_STATE_RENDER },
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(prefixes); i++) {
+        if (g_str_has_prefix(name, prefixes[i].prefix)) {
+            return prefixes[i].state;
+        }
+    }
+
+    return -1;
+}
+
+static void pgraph_init_kelvin_method_states(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(pgraph_kelvin_methods); i++) {
+        pgraph_kelvin_method_states[i] =
+            pgraph_kelvin_methods[i].handler ?
+                pgraph_get_kelvin_method_state(pgraph_kelvin_methods[i].name) :
+                -1;
+    }
+}
+
+const char *pgraph_get_method_name(unsigned int graphics_class,
+                                   unsigned int method)
+{
+    int idx = METHOD_ADDR_TO_INDEX(method);
+
+    if (graphics_class != NV_KELVIN_PRIMITIVE ||
+        idx >= ARRAY_SIZE(pgraph_kelvin_methods) ||
+        !pgraph_kelvin_methods[idx].handler) {
+        return NULL;
+    }
+
+    return pgraph_kelvin_methods[idx].name;
+}
+
+/*
+ * Counts the method towards the frame's statistics. Kelvin methods are
+ * counted as the first method of their range, such as all texture stages.
+ */
+static void pgraph_profile_method(PGRAPHState *pg, unsigned int method,
+                                  int num_processed)
+{
+    uint32_t graphics_class = pg->ctx_switch_graphics_class;
+    int idx = METHOD_ADDR_TO_INDEX(method);
+
+    g_nv2a_stats.frame_working.stream.methods += num_processed;
+
+    if (graphics_class == NV_KELVIN_PRIMITIVE &&
+        idx < ARRAY_SIZE(pgraph_kelvin_methods) &&
+        pgraph_kelvin_methods[idx].handler) {
+        int state = pgraph_kelvin_method_states[idx];
+        if (state >= 0) {
+            g_nv2a_stats.frame_working.stream.state_changes[state]++;
+        }
+        method = pgraph_kelvin_methods[idx].base;
+    }
+
+    nv2a_profile_method(graphics_class, method, num_processed);
+}
+
 static void pgraph_method_log(unsigned int subchannel,
                               unsigned int graphics_class,
                               unsigned int method, uint32_t parameter)
@@ -557,6 +700,12 @@ static void pgraph_method_log(unsigned int subchannel,
     last = method;
 }
 
+static inline bool pgraph_method_log_enabled(void)
+{
+    return trace_event_get_state_backends(TRACE_NV2A_PGRAPH_METHOD) ||
+           trace_event_get_state_backends(TRACE_NV2A_PGRAPH_METHOD_ABBREV);
+}
+
 static void pgraph_method_inc(MethodFunc handler, uint32_t end,
                               METHOD_HANDLER_ARG_DECL)
 {
@@ -564,10 +713,11 @@ static void pgraph_method_inc(MethodFunc handler, uint32_t end,
         handler(METHOD_HANDLER_ARGS);
         return;
     }
+    bool log = pgraph_method_log_enabled();
     size_t count = MIN(num_words_available, (end - method) / 4);
     for (size_t i = 0; i < count; i++) {
         parameter = ldl_le_p(parameters + i);
-        if (i) {
+        if (i && log) {
             pgraph_method_log(subchannel, NV_KELVIN_PRIMITIVE, method,
                               parameter);
         }
@@ -584,9 +734,10 @@ static void pgraph_method_non_inc(MethodFunc handler, METHOD_HANDLER_ARG_DECL)
         return;
     }
 
+    bool log = pgraph_method_log_enabled();
     for (size_t i = 0; i < num_words_available; i++) {
         parameter = ldl_le_p(parameters + i);
-        if (i) {
+        if (i && log) {
             pgraph_method_log(subchannel, NV_KELVIN_PRIMITIVE, method,
                               parameter);
         }
@@ -618,10 +769,35 @@ static void pgraph_method_non_inc(MethodFunc handler, METHOD_HANDLER_ARG_DECL)
     }                                                             \
     DEF_METHOD_INT(gclass, name)
 
-int pgraph_method(NV2AState *d, unsigned int subchannel,
-                   unsigned int method, uint32_t parameter,
-                   uint32_t *parameters, size_t num_words_available,
-                   size_t max_lookahead_words, bool inc)
+static bool pgraph_can_merge_draw(PGRAPHState *pg)
+{
+    unsigned int vertices_per_primitive;
+
+    switch (pg->primitive_mode) {
+    case PRIM_TYPE_POINTS: vertices_per_primitive = 1; break;
+    case PRIM_TYPE_LINES: vertices_per_primitive = 2; break;
+    case PRIM_TYPE_TRIANGLES: vertices_per_primitive = 3; break;
+    case PRIM_TYPE_QUADS: vertices_per_primitive = 4; break;
+    default:
+        /* Strips, fans, loops and polygons don't concatenate */
+        return false;
+    }
+
+    /* Only plain indexed draws, ending on a primitive boundary, with enough
+     * room left that the next block can't overflow the element buffer.
+     */
+    return pg->inline_elements_length > 0 &&
+           pg->inline_elements_length < NV2A_MAX_BATCH_LENGTH / 4 &&
+           (pg->inline_elements_length % vertices_per_primitive) == 0 &&
+           pg->draw_arrays_length == 0 && pg->inline_array_length == 0 &&
+           pg->inline_buffer_length == 0;
+}
+
+static int pgraph_method_dispatch(NV2AState *d, unsigned int subchannel,
+                                  unsigned int method, uint32_t parameter,
+                                  uint32_t *parameters,
+                                  size_t num_words_available,
+                                  size_t max_lookahead_words, bool inc)
 {
     int num_processed = 1;
 
@@ -638,6 +814,8 @@ int pgraph_method(NV2AState *d, unsigned int subchannel,
     assert(subchannel < 8);
 
     if (method == NV_SET_OBJECT) {
+        pg->ctx_switch_subchannel = -1;
+
         assert(parameter < memory_region_size(&d->ramin));
         uint8_t *obj_ptr = d->ramin_ptr + parameter;
 
@@ -654,20 +832,28 @@ int pgraph_method(NV2AState *d, unsigned int subchannel,
         pgraph_reg_w(pg, NV_PGRAPH_CTX_CACHE5 + subchannel * 4, ctx_5);
     }
 
-    // is this right?
-    pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH1,
-                 pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE1 + subchannel * 4));
-    pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH2,
-                 pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE2 + subchannel * 4));
-    pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH3,
-                 pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE3 + subchannel * 4));
-    pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH4,
-                 pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE4 + subchannel * 4));
-    pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH5,
-                 pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE5 + subchannel * 4));
-
-    uint32_t graphics_class = PG_GET_MASK(NV_PGRAPH_CTX_SWITCH1,
-                                       NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+    /* Only reload the object context when the subchannel changes or the
+     * cached context was invalidated (NV_SET_OBJECT, MMIO, context switch).
+     */
+    if (pg->ctx_switch_subchannel != subchannel) {
+        // is this right?
+        pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH1,
+                     pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE1 + subchannel * 4));
+        pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH2,
+                     pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE2 + subchannel * 4));
+        pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH3,
+                     pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE3 + subchannel * 4));
+        pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH4,
+                     pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE4 + subchannel * 4));
+        pgraph_reg_w(pg, NV_PGRAPH_CTX_SWITCH5,
+                     pgraph_reg_r(pg, NV_PGRAPH_CTX_CACHE5 + subchannel * 4));
+
+        pg->ctx_switch_subchannel = subchannel;
+        pg->ctx_switch_graphics_class = PG_GET_MASK(
+            NV_PGRAPH_CTX_SWITCH1, NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+    }
+
+    uint32_t graphics_class = pg->ctx_switch_graphics_class;
 
     pgraph_method_log(subchannel, graphics_class, method, parameter);
 
@@ -776,15 +962,31 @@ int pgraph_method(NV2AState *d, unsigned int subchannel,
         if (handler == NULL) {
             goto unhandled;
         }
+        #define LAM(i, mthd) ((parameters[i*2+1] & 0x31fff) == (mthd))
+        #define LAP(i, prm) (parameters[i*2+2] == (prm))
+        #define LAMP(i, mthd, prm) (LAM(i, mthd) && LAP(i, prm))
+
+        /* Merge END,BEGIN between consecutive indexed list draws. Nothing
+         * can change between the two blocks, so the element lists can be
+         * concatenated and submitted as a single draw.
+         */
+        if (method == NV097_SET_BEGIN_END &&
+            parameter == NV097_SET_BEGIN_END_OP_END &&
+            num_words_available == 1 && max_lookahead_words >= 4 &&
+            pgraph_can_merge_draw(pg) &&
+            LAMP(0, NV097_SET_BEGIN_END, pg->primitive_mode) &&
+            (LAM(1, NV097_ARRAY_ELEMENT16) ||
+             LAM(1, NV097_ARRAY_ELEMENT32))) {
+            nv2a_profile_inc_counter(NV2A_PROF_BEGIN_ENDS_MERGED);
+            num_processed = 3;
+            break;
+        }
+
         size_t num_words_consumed = 1;
         handler(d, pg, subchannel, method, parameter, parameters,
                 num_words_available, &num_words_consumed, inc);
 
         /* Squash repeated BEGIN,DRAW_ARRAYS,END */
-        #define LAM(i, mthd) ((parameters[i*2+1] & 0x31fff) == (mthd))
-        #define LAP(i, prm) (parameters[i*2+2] == (prm))
-        #define LAMP(i, mthd, prm) (LAM(i, mthd) && LAP(i, prm))
-
         if (method == NV097_DRAW_ARRAYS && (max_lookahead_words >= 7) &&
             pg->inline_elements_length == 0 &&
             pg->draw_arrays_length <
@@ -815,6 +1017,31 @@ unhandled:
     return num_processed;
 }
 
+int pgraph_method(NV2AState *d, unsigned int subchannel,
+                   unsigned int method, uint32_t parameter,
+                   uint32_t *parameters, size_t num_words_available,
+                   size_t max_lookahead_words, bool inc)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (unlikely(pg->capture)) {
+        pgraph_capture_pre_method(d, subchannel, method);
+    }
+
+    int num_processed =
+        pgraph_method_dispatch(d, subchannel, method, parameter, parameters,
+                               num_words_available, max_lookahead_words, inc);
+    pgraph_profile_method(pg, method, num_processed);
+
+    if (unlikely(pg->capture)) {
+        pgraph_capture_method(d, subchannel, method, parameter, parameters,
+                              num_words_available, max_lookahead_words, inc,
+                              num_processed);
+    }
+
+    return num_processed;
+}
+
 DEF_METHOD(NV097, SET_OBJECT)
 {
     pg->kelvin.object_instance = parameter;
@@ -846,7 +1073,8 @@ DEF_METHOD(NV097, NO_OPERATION)
     pgraph_reg_w(pg, NV_PGRAPH_TRAPPED_DATA_LOW, parameter);
     pgraph_reg_w(pg, NV_PGRAPH_NSOURCE,
                  NV_PGRAPH_NSOURCE_NOTIFICATION); /* TODO: check this */
-    pg->pending_interrupts |= NV_PGRAPH_INTR_ERROR;
+    /* Publish after the trap registers for lock-free readers */
+    qatomic_or(&pg->pending_interrupts, NV_PGRAPH_INTR_ERROR);
     pg->waiting_for_nop = true;
 
     qemu_mutex_unlock(&pg->lock);
@@ -905,6 +1133,10 @@ DEF_METHOD(NV097, FLIP_STALL)
     d->pgraph.renderer->ops.flip_stall(d);
     nv2a_profile_flip_stall();
     pg->waiting_for_flip = true;
+
+    if (unlikely(pg->capture)) {
+        pgraph_capture_flip_stall(d);
+    }
 }
 
 // TODO: these should be loading the dma objects from ramin here?
@@ -2471,6 +2703,30 @@ DEF_METHOD(NV097, SET_LOGIC_OP)
              parameter & 0xF);
 }
 
+static void write_zpass_pixel_cnt_report(NV2AState *d, uint32_t parameter,
+                                         uint32_t result)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    uint64_t timestamp = 0x0011223344556677; /* FIXME: Update timestamp?! */
+    uint32_t done = 0; // FIXME: Check
+
+    hwaddr report_dma_len;
+    uint8_t *report_data =
+        (uint8_t *)nv_dma_map(d, pg->dma_report, &report_dma_len);
+
+    hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
+    assert(offset < report_dma_len);
+    report_data += offset;
+
+    stq_le_p((uint64_t *)&report_data[0], timestamp);
+    stl_le_p((uint32_t *)&report_data[8], result);
+    stl_le_p((uint32_t *)&report_data[12], done);
+    nv_dma_mark_written(d, report_data, 16);
+
+    NV2A_DPRINTF("Report result %d @%" HWADDR_PRIx, result, offset);
+}
+
 DEF_METHOD(NV097, CLEAR_REPORT_VALUE)
 {
     d->pgraph.renderer->ops.clear_report_value(d);
@@ -2486,6 +2742,18 @@ DEF_METHOD(NV097, GET_REPORT)
     uint8_t type = GET_MASK(parameter, NV097_GET_REPORT_TYPE);
     assert(type == NV097_GET_REPORT_TYPE_ZPASS_PIXEL_CNT);
 
+    if (pg->optimistic_zpass_reports) {
+        /* Don't make the guest wait, the real result is cached once it
+         * resolves and returned for the next report at this offset.
+         */
+        hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
+        unsigned int slot = (offset / 16) % NV2A_ZPASS_REPORT_CACHE_SIZE;
+        uint32_t result = pg->zpass_report_cache[slot].offset == offset ?
+                              pg->zpass_report_cache[slot].result :
+                              0;
+        write_zpass_pixel_cnt_report(d, parameter, result);
+    }
+
     d->pgraph.renderer->ops.get_report(d, parameter);
 }
 
@@ -2496,6 +2764,43 @@ DEF_METHOD_INC(NV097, SET_EYE_DIRECTION)
     pg->ltctxa_dirty[NV_IGRAPH_XF_LTCTXA_EYED] = true;
 }
 
+static void pgraph_profile_draw(PGRAPHState *pg)
+{
+    enum NV2A_PROF_DRAW_KINDS_ENUM kind;
+    unsigned int num_vertices = 0;
+
+    if (pg->draw_arrays_length) {
+        kind = NV2A_PROF_DRAW_KIND_ARRAYS;
+        for (int i = 0; i < pg->draw_arrays_length; i++) {
+            num_vertices += pg->draw_arrays_count[i];
+        }
+    } else if (pg->inline_elements_length) {
+        kind = NV2A_PROF_DRAW_KIND_ELEMENTS;
+        num_vertices = pg->inline_elements_length;
+    } else if (pg->inline_buffer_length) {
+        kind = NV2A_PROF_DRAW_KIND_INLINE_BUFFER;
+        num_vertices = pg->inline_buffer_length;
+    } else if (pg->inline_array_length) {
+        kind = NV2A_PROF_DRAW_KIND_INLINE_ARRAY;
+        unsigned int vertex_size =
+            pgraph_get_inline_array_vertex_size(pg, NULL);
+        if (vertex_size) {
+            num_vertices = pg->inline_array_length * 4 / vertex_size;
+        }
+    } else {
+        return;
+    }
+
+    typeof(g_nv2a_stats.frame_working.stream) *stream =
+        &g_nv2a_stats.frame_working.stream;
+    stream->draws[kind]++;
+    stream->draw_vertices[kind] += num_vertices;
+    if (pg->primitive_mode < NV2A_PROF_PRIM_TYPES) {
+        stream->prim_draws[pg->primitive_mode]++;
+        stream->prim_vertices[pg->primitive_mode] += num_vertices;
+    }
+}
+
 DEF_METHOD(NV097, SET_BEGIN_END)
 {
     if (parameter == NV097_SET_BEGIN_END_OP_END) {
@@ -2505,6 +2810,7 @@ DEF_METHOD(NV097, SET_BEGIN_END)
             return;
         }
         nv2a_profile_inc_counter(NV2A_PROF_BEGIN_ENDS);
+        pgraph_profile_draw(pg);
         d->pgraph.renderer->ops.draw_end(d);
         pgraph_reset_inline_buffers(pg);
         pg->primitive_mode = PRIM_TYPE_INVALID;
@@ -2859,6 +3165,7 @@ DEF_METHOD(NV097, BACK_END_WRITE_SEMAPHORE_RELEASE)
     semaphore_data += semaphore_offset;
 
     stl_le_p((uint32_t*)semaphore_data, parameter);
+    nv_dma_mark_written(d, semaphore_data, sizeof(uint32_t));
 
     //qemu_mutex_lock(&d->pgraph.lock);
     //bql_unlock();
@@ -3143,22 +3450,16 @@ void pgraph_write_zpass_pixel_cnt_report(NV2AState *d, uint32_t parameter,
 {
     PGRAPHState *pg = &d->pgraph;
 
-    uint64_t timestamp = 0x0011223344556677; /* FIXME: Update timestamp?! */
-    uint32_t done = 0; // FIXME: Check
-
-    hwaddr report_dma_len;
-    uint8_t *report_data =
-        (uint8_t *)nv_dma_map(d, pg->dma_report, &report_dma_len);
-
-    hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
-    assert(offset < report_dma_len);
-    report_data += offset;
-
-    stq_le_p((uint64_t *)&report_data[0], timestamp);
-    stl_le_p((uint32_t *)&report_data[8], result);
-    stl_le_p((uint32_t *)&report_data[12], done);
+    if (pg->optimistic_zpass_reports) {
+        /* Already answered when the report was requested */
+        hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
+        unsigned int slot = (offset / 16) % NV2A_ZPASS_REPORT_CACHE_SIZE;
+        pg->zpass_report_cache[slot].offset = offset;
+        pg->zpass_report_cache[slot].result = result;
+        return;
+    }
 
-    NV2A_DPRINTF("Report result %d @%" HWADDR_PRIx, result, offset);
+    write_zpass_pixel_cnt_report(d, parameter, result);
 }
 
 static void do_wait_for_renderer_switch(CPUState *cpu, run_on_cpu_data data)
@@ -3172,10 +3473,63 @@ static void do_wait_for_renderer_switch(CPUState *cpu, run_on_cpu_data data)
     qemu_event_wait(&d->pgraph.renderer_switch_complete);
 }
 
+/*
+ * After a renderer switch, the new renderer builds shaders for the states
+ * seen before it, a few at a time between batches of guest commands, so
+ * that a title does not stutter through building them all on first draw.
+ */
+#define PGRAPH_PREWARM_BATCH_SIZE 8
+
+static void start_prewarm(PGRAPHState *pg)
+{
+    g_free(pg->prewarm.states);
+    pg->prewarm.states = NULL;
+    pg->prewarm.num_states = 0;
+    pg->prewarm.next = 0;
+
+    if (pg->renderer->ops.prewarm_shader_state) {
+        pg->prewarm.states =
+            pgraph_glsl_get_shader_state_history(&pg->prewarm.num_states);
+    }
+}
+
+static void process_prewarm(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->prewarm.next >= pg->prewarm.num_states) {
+        return;
+    }
+
+    qemu_mutex_unlock(&d->pfifo.lock);
+    qemu_mutex_lock(&pg->lock);
+
+    size_t end = MIN(pg->prewarm.next + PGRAPH_PREWARM_BATCH_SIZE,
+                     pg->prewarm.num_states);
+    for (; pg->prewarm.next < end; pg->prewarm.next++) {
+        pg->renderer->ops.prewarm_shader_state(
+            d, &pg->prewarm.states[pg->prewarm.next]);
+    }
+
+    qemu_mutex_unlock(&pg->lock);
+    qemu_mutex_lock(&d->pfifo.lock);
+
+    if (pg->prewarm.next < pg->prewarm.num_states) {
+        /* Come back for the next batch without waiting for the guest */
+        d->pfifo.fifo_kick = true;
+    } else {
+        g_free(pg->prewarm.states);
+        pg->prewarm.states = NULL;
+        pg->prewarm.num_states = 0;
+        pg->prewarm.next = 0;
+    }
+}
+
 void pgraph_process_pending(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
     pg->renderer->ops.process_pending(d);
+    process_prewarm(d);
 
     if (g_config.display.renderer != pg->renderer->type &&
         pg->renderer_switch_phase == PGRAPH_RENDERER_SWITCH_PHASE_IDLE) {
@@ -3212,6 +3566,7 @@ void pgraph_process_pending(NV2AState *d)
         }
 
         init_renderer(pg);
+        start_prewarm(pg);
 
         qemu_mutex_unlock(&d->pgraph.renderer_lock);
         qemu_mutex_unlock(&d->pgraph.lock);
@@ -38,6 +38,9 @@ typedef struct NV2AState NV2AState;
 typedef struct PGRAPHNullState PGRAPHNullState;
 typedef struct PGRAPHGLState PGRAPHGLState;
 typedef struct PGRAPHVkState PGRAPHVkState;
+typedef struct PGRAPHCaptureState PGRAPHCaptureState;
+typedef struct PGRAPHReplayState PGRAPHReplayState;
+typedef struct ShaderState ShaderState;
 
 typedef struct VertexAttribute {
     bool dma_select;
@@ -57,7 +60,6 @@ typedef struct VertexAttribute {
     bool needs_conversion;
 
     float *inline_buffer;
-    bool inline_buffer_populated;
 } VertexAttribute;
 
 typedef struct Surface {
@@ -132,9 +134,17 @@ typedef struct PGRAPHRenderer {
         unsigned int (*get_surface_scale_factor)(NV2AState *d);
         int (*get_framebuffer_surface)(NV2AState *d);
         GPUProperties *(*get_gpu_properties)(void);
+        void (*prewarm_shader_state)(NV2AState *d, const ShaderState *state);
     } ops;
 } PGRAPHRenderer;
 
+#define NV2A_ZPASS_REPORT_CACHE_SIZE 64
+
+/* Inline arrays up to this many vertices may be transformed on the CPU */
+#define PGRAPH_VSH_CPU_MAX_VERTICES 32
+/* Vertex program output registers, oPos through oT3 */
+#define PGRAPH_VSH_CPU_OUTPUT_REGS 13
+
 typedef struct PGRAPHState {
     QemuMutex lock;
     QemuMutex renderer_lock;
@@ -178,6 +188,11 @@ typedef struct PGRAPHState {
     hwaddr dma_report;
     hwaddr report_offset;
     bool zpass_pixel_count_enable;
+    bool optimistic_zpass_reports;
+    struct {
+        hwaddr offset;
+        uint32_t result;
+    } zpass_report_cache[NV2A_ZPASS_REPORT_CACHE_SIZE];
 
     hwaddr dma_vertex_a, dma_vertex_b;
 
@@ -219,6 +234,7 @@ typedef struct PGRAPHState {
     uint16_t compressed_attrs;
     uint16_t uniform_attrs;
     uint16_t swizzle_attrs;
+    bool vsh_pretransformed; /* Vertex program already ran on the CPU */
 
     unsigned int inline_array_length;
     uint32_t inline_array[NV2A_MAX_BATCH_LENGTH];
@@ -227,6 +243,8 @@ typedef struct PGRAPHState {
     uint32_t inline_elements[NV2A_MAX_BATCH_LENGTH];
 
     unsigned int inline_buffer_length;
+    /* Attributes with per-vertex data in inline_buffer */
+    uint16_t inline_buffer_attrs;
 
     unsigned int draw_arrays_length;
     unsigned int draw_arrays_min_start;
@@ -240,12 +258,17 @@ typedef struct PGRAPHState {
     uint32_t regs_[0x2000];
     DECLARE_BITMAP(regs_dirty, 0x2000 / sizeof(uint32_t));
 
+    /* Subchannel whose object context is loaded in CTX_SWITCH*, or -1 */
+    int ctx_switch_subchannel;
+    uint32_t ctx_switch_graphics_class;
+
     bool clearing; // FIXME: Internal
     bool waiting_for_nop;
     bool waiting_for_flip;
     bool waiting_for_context_switch;
 
     bool flush_pending;
+    bool flush_revalidate; // Keep the surfaces that still match VRAM
     QemuEvent flush_complete;
 
     bool sync_pending;
@@ -254,6 +277,14 @@ typedef struct PGRAPHState {
     bool framebuffer_in_use;
     QemuCond framebuffer_released;
 
+    /* CPU write generation of each VRAM page, see vram.c */
+    struct {
+        uint32_t *page_gen;
+        size_t num_pages;
+        uint32_t gen;
+        bool sync_pending;
+    } vram;
+
     enum {
         PGRAPH_RENDERER_SWITCH_PHASE_IDLE,
         PGRAPH_RENDERER_SWITCH_PHASE_STARTED,
@@ -261,9 +292,20 @@ typedef struct PGRAPHState {
     } renderer_switch_phase;
     QemuEvent renderer_switch_complete;
 
+    /* Shader states seen before a renderer switch, for the new renderer */
+    struct {
+        ShaderState *states;
+        size_t num_states;
+        size_t next;
+    } prewarm;
+
     unsigned int surface_scale_factor;
     uint8_t *scale_buf;
 
+    /* Command stream capture and replay, see capture.c */
+    PGRAPHCaptureState *capture;
+    PGRAPHReplayState *replay;
+
     const PGRAPHRenderer *renderer;
     union {
         PGRAPHNullState *null_renderer_state;
@@ -289,7 +331,25 @@ int pgraph_method(NV2AState *d, unsigned int subchannel, unsigned int method,
                   bool inc);
 void pgraph_check_within_begin_end_block(PGRAPHState *pg);
 
+/* Capture */
+void pgraph_capture_pre_method(NV2AState *d, unsigned int subchannel,
+                               unsigned int method);
+void pgraph_capture_method(NV2AState *d, unsigned int subchannel,
+                           unsigned int method, uint32_t parameter,
+                           uint32_t *parameters, size_t num_words_available,
+                           size_t max_lookahead_words, bool inc,
+                           int num_processed);
+void pgraph_capture_flip_stall(NV2AState *d);
+void pgraph_capture_finalize(NV2AState *d);
+void pgraph_replay_init(NV2AState *d, const char *path, int loops,
+                        Error **errp);
+void pgraph_replay_reset(NV2AState *d);
+void pgraph_replay_run(NV2AState *d);
+
 void *pfifo_thread(void *arg);
+void *pfifo_pusher_thread(void *arg);
+void pfifo_reset_method_ring(NV2AState *d);
+void pfifo_invalidate_ramht_cache(NV2AState *d);
 void pfifo_kick(NV2AState *d);
 
 void pgraph_renderer_register(const PGRAPHRenderer *renderer);
@@ -312,11 +372,30 @@ static inline void pgraph_reg_w(PGRAPHState *pg, unsigned int r, uint32_t v)
     if (pg->regs_[r] != v) {
         bitmap_set(pg->regs_dirty, r / sizeof(uint32_t), 1);
     }
-    pg->regs_[r] = v;
+    qatomic_set(&pg->regs_[r], v); /* Read without lock by pgraph_read */
 }
 
 void pgraph_clear_dirty_reg_map(PGRAPHState *pg);
 
+void pgraph_vram_init(NV2AState *d);
+void pgraph_vram_finalize(NV2AState *d);
+uint32_t *pgraph_vram_new_seen_gens(NV2AState *d);
+void pgraph_vram_mark_sync_pending(NV2AState *d);
+bool pgraph_vram_check_dirty(NV2AState *d, uint32_t *seen, hwaddr addr,
+                             hwaddr size);
+
+static inline void pgraph_invalidate_ctx_switch(PGRAPHState *pg)
+{
+    pg->ctx_switch_subchannel = -1;
+}
+
+static inline void pgraph_invalidate_zpass_report_cache(PGRAPHState *pg)
+{
+    for (int i = 0; i < NV2A_ZPASS_REPORT_CACHE_SIZE; i++) {
+        pg->zpass_report_cache[i].offset = -1;
+    }
+}
+
 static inline bool pgraph_is_reg_dirty(PGRAPHState *pg, unsigned int reg)
 {
     return test_bit(reg / sizeof(uint32_t), pg->regs_dirty);
@@ -387,11 +466,33 @@ static inline void pgraph_apply_scaling_factor(PGRAPHState *pg,
     *height *= pg->surface_scale_factor;
 }
 
+/* Called before every immediate mode attribute update */
+static inline void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg,
+                                                          unsigned int attr)
+{
+    if (!(pg->inline_buffer_attrs & (1 << attr)) && pg->inline_buffer_length) {
+        pgraph_populate_inline_buffer(pg, attr);
+    }
+}
+
 void pgraph_get_clear_color(PGRAPHState *pg, float rgba[4]);
 void pgraph_get_clear_depth_stencil_value(PGRAPHState *pg, float *depth, int *stencil);
 
+/* Surface */
+typedef struct PGRAPHSurfaceUpdateOps {
+    void (*unbind_surface)(NV2AState *d, bool color);
+    void (*update_surface_part)(NV2AState *d, bool upload, bool color);
+} PGRAPHSurfaceUpdateOps;
+
+void pgraph_get_surface_dimensions(PGRAPHState const *pg, unsigned int *width,
+                                   unsigned int *height);
+bool pgraph_framebuffer_dirty(PGRAPHState const *pg);
+void pgraph_update_surface_parts(NV2AState *d, bool upload, bool color_write,
+                                 bool zeta_write,
+                                 const PGRAPHSurfaceUpdateOps *ops);
+
 /* Vertex */
-void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg, unsigned int attr);
+void pgraph_populate_inline_buffer(PGRAPHState *pg, unsigned int attr);
 void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg);
 void pgraph_reset_inline_buffers(PGRAPHState *pg);
 void pgraph_reset_draw_arrays(PGRAPHState *pg);
@@ -399,6 +500,13 @@ void pgraph_update_inline_value(VertexAttribute *attr, const uint8_t *data);
 void pgraph_get_inline_values(PGRAPHState *pg, uint16_t attrs,
                                float values[NV2A_VERTEXSHADER_ATTRIBUTES][4],
                                int *count);
+unsigned int pgraph_get_inline_array_vertex_size(
+    PGRAPHState *pg, unsigned int offsets[NV2A_VERTEXSHADER_ATTRIBUTES]);
+unsigned int pgraph_vsh_cpu_transform_inline_array(
+    PGRAPHState *pg, float out[][PGRAPH_VSH_CPU_OUTPUT_REGS][4]);
+
+const char *pgraph_get_method_name(unsigned int graphics_class,
+                                   unsigned int method);
 
 /* RDI */
 uint32_t pgraph_rdi_read(PGRAPHState *pg, unsigned int select,
@@ -18,14 +18,52 @@
  */
 
 #include "hw/xbox/nv2a/nv2a_int.h"
+#include "qemu/lru.h"
+#include "qemu/timeline.h"
+#include "ui/xemu-frame-stats.h"
+#include "ui/xemu-settings.h"
+
+/* Hitches closer together than this are logged but not announced */
+#define HITCH_NOTIFY_INTERVAL_MS 2000
 
 NV2AStats g_nv2a_stats;
 
+static int64_t last_flip_vtime_us;
+
+/* Classes whose methods are counted apart, the others are counted together */
+static const unsigned int method_classes[] = {
+    NV_KELVIN_PRIMITIVE,
+    NV_IMAGE_BLIT,
+    NV_CONTEXT_SURFACES_2D,
+    NV_CONTEXT_PATTERN,
+    NV_BETA,
+};
+
+#define NUM_METHOD_CLASSES (ARRAY_SIZE(method_classes) + 1)
+#define NUM_METHODS 0x800
+
+typedef struct MethodCount {
+    uint32_t calls;
+    uint32_t words;
+} MethodCount;
+
+/* Of the current and of the last frame, which are swapped at each flip */
+static MethodCount method_counts[2][NUM_METHOD_CLASSES][NUM_METHODS];
+static int method_counts_frame;
+
+static struct {
+    FILE *log;
+    bool log_failed;
+    int64_t last_notify_ms;
+    char *summary;
+} hitch;
+
 void nv2a_profile_increment(void)
 {
     int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     const int64_t fps_update_interval = 250000;
     g_nv2a_stats.last_flip_time = now;
+    qatomic_set(&last_flip_vtime_us, qemu_clock_get_us(QEMU_CLOCK_VIRTUAL));
 
     static int64_t frame_count = 0;
     frame_count++;
@@ -39,11 +77,156 @@ void nv2a_profile_increment(void)
     }
 }
 
+typedef struct HitchCause {
+    const char *name;
+    int us;
+} HitchCause;
+
+static int compare_hitch_causes(const void *a, const void *b)
+{
+    return ((const HitchCause *)b)->us - ((const HitchCause *)a)->us;
+}
+
+static FILE *get_hitch_log(void)
+{
+    if (!hitch.log && !hitch.log_failed) {
+        g_autofree char *path = g_build_filename(
+            xemu_settings_get_base_path(), "nv2a-hitches.log", NULL);
+        hitch.log = qemu_fopen(path, "a");
+        if (!hitch.log) {
+            fprintf(stderr, "nv2a: Failed to open %s\n", path);
+            hitch.log_failed = true;
+        }
+    }
+
+    return hitch.log;
+}
+
+/*
+ * Explains a long frame by ranking the host time spent on work that commonly
+ * causes hitches, and lists the counters that were well above their average
+ * over the recent frames.
+ */
+static void report_hitch(int mspf)
+{
+    const typeof(g_nv2a_stats.frame_working) *frame =
+        &g_nv2a_stats.frame_working;
+
+    HitchCause causes[NV2A_PROF_CPU__COUNT + 2];
+    int num_causes = 0;
+    int attributed_us = 0;
+    for (int i = 0; i < NV2A_PROF_CPU__COUNT; i++) {
+        if (frame->cpu_timers[i] > 0) {
+            causes[num_causes++] = (HitchCause){
+                nv2a_profile_get_cpu_timer_name(i), frame->cpu_timers[i]
+            };
+            attributed_us += frame->cpu_timers[i];
+        }
+    }
+    if (frame->gpu_us) {
+        causes[num_causes++] = (HitchCause){ "GPU", frame->gpu_us };
+    }
+    if (mspf * 1000 > attributed_us) {
+        causes[num_causes++] =
+            (HitchCause){ "UNATTRIBUTED", mspf * 1000 - attributed_us };
+    }
+    if (!num_causes) {
+        return;
+    }
+    qsort(causes, num_causes, sizeof(causes[0]), compare_hitch_causes);
+
+    g_autoptr(GDateTime) now = g_date_time_new_now_local();
+    g_autofree char *time_str = g_date_time_format(now, "%F %T");
+
+    g_autoptr(GString) report = g_string_new(NULL);
+    g_string_append_printf(report, "[%s] Frame %u took %d ms\n", time_str,
+                           g_nv2a_stats.frame_count, mspf);
+    for (int i = 0; i < num_causes; i++) {
+        g_string_append_printf(report, "  %-16s %8.2f ms\n", causes[i].name,
+                               causes[i].us / 1000.0);
+    }
+
+    int num_frames = MIN(g_nv2a_stats.frame_count, NV2A_PROF_NUM_FRAMES);
+    bool counters_header = false;
+    for (int i = 0; i < NV2A_PROF__COUNT && num_frames; i++) {
+        int64_t total = 0;
+        for (int j = 0; j < NV2A_PROF_NUM_FRAMES; j++) {
+            total += g_nv2a_stats.frame_history[j].counters[i];
+        }
+        double avg = (double)total / num_frames;
+        if (frame->counters[i] <= 2 * avg + 1) {
+            continue;
+        }
+        if (!counters_header) {
+            g_string_append(report, "  Counters above average:\n");
+            counters_header = true;
+        }
+        g_string_append_printf(report, "    %-32s %6d (avg %.1f)\n",
+                               nv2a_profile_get_counter_name(i),
+                               frame->counters[i], avg);
+    }
+
+    FILE *log = get_hitch_log();
+    if (log) {
+        fputs(report->str, log);
+        fflush(log);
+    }
+
+    int64_t now_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (now_ms - hitch.last_notify_ms >= HITCH_NOTIFY_INTERVAL_MS) {
+        hitch.last_notify_ms = now_ms;
+        char *summary = g_strdup_printf("Hitch: %d ms, mostly %s (%.0f ms)",
+                                        mspf, causes[0].name,
+                                        causes[0].us / 1000.0);
+        g_free(qatomic_xchg(&hitch.summary, summary));
+    }
+
+#ifdef CONFIG_RENDERDOC
+    if (g_config.display.debug.video.hitch_renderdoc_capture &&
+        nv2a_dbg_renderdoc_available() && !renderdoc_capture_frames) {
+        nv2a_dbg_renderdoc_capture_frames(1, false);
+    }
+#endif
+}
+
+char *nv2a_profile_take_hitch_summary(void)
+{
+    return qatomic_xchg(&hitch.summary, NULL);
+}
+
 void nv2a_profile_flip_stall(void)
 {
     int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t render_time = (now-g_nv2a_stats.last_flip_time)/1000;
 
+    /*
+     * The virtual clock does not advance while the VM is stopped, so frames
+     * spanning a pause or snapshot load are not taken for hitches or
+     * counted as long frames.
+     */
+    int64_t vtime_us = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) -
+                       qatomic_read(&last_flip_vtime_us);
+    int64_t frame_us = MIN(now - g_nv2a_stats.last_flip_time, vtime_us);
+
+    if (g_config.display.debug.video.hitch_detection) {
+        int mspf = frame_us / 1000;
+        if (mspf >= g_config.display.debug.video.hitch_threshold_ms) {
+            report_hitch(mspf);
+        }
+    }
+
+    const typeof(g_nv2a_stats.frame_working) *frame =
+        &g_nv2a_stats.frame_working;
+    int cpu_us = 0;
+    for (int i = 0; i < NV2A_PROF_CPU__COUNT; i++) {
+        cpu_us += frame->cpu_timers[i];
+    }
+    xemu_frame_stats_record(XEMU_FRAME_STAT_FRAME_TIME, frame_us);
+    xemu_frame_stats_record(XEMU_FRAME_STAT_CPU_TIME, cpu_us);
+    if (frame->gpu_us) {
+        xemu_frame_stats_record(XEMU_FRAME_STAT_GPU_TIME, frame->gpu_us);
+    }
+
     g_nv2a_stats.frame_working.mspf = render_time;
     g_nv2a_stats.frame_history[g_nv2a_stats.frame_ptr] =
         g_nv2a_stats.frame_working;
@@ -51,6 +234,112 @@ void nv2a_profile_flip_stall(void)
         (g_nv2a_stats.frame_ptr + 1) % NV2A_PROF_NUM_FRAMES;
     g_nv2a_stats.frame_count++;
     memset(&g_nv2a_stats.frame_working, 0, sizeof(g_nv2a_stats.frame_working));
+
+    int frame = !method_counts_frame;
+    memset(method_counts[frame], 0, sizeof(method_counts[frame]));
+    qatomic_set(&method_counts_frame, frame);
+}
+
+void nv2a_profile_method(unsigned int graphics_class, unsigned int method,
+                         int words)
+{
+    int class_idx = 0;
+    while (class_idx < ARRAY_SIZE(method_classes) &&
+           method_classes[class_idx] != graphics_class) {
+        class_idx++;
+    }
+
+    MethodCount *count =
+        &method_counts[method_counts_frame][class_idx][(method >> 2) %
+                                                       NUM_METHODS];
+    count->calls++;
+    count->words += words;
+}
+
+void nv2a_profile_add_pushbuffer_bytes(int bytes)
+{
+    qatomic_add(&g_nv2a_stats.frame_working.stream.pushbuffer_bytes, bytes);
+}
+
+int nv2a_profile_get_top_methods(NV2AProfMethod *methods, int max)
+{
+    const MethodCount(*counts)[NUM_METHODS] =
+        method_counts[!qatomic_read(&method_counts_frame)];
+    int num_methods = 0;
+
+    for (int c = 0; c < NUM_METHOD_CLASSES; c++) {
+        for (int m = 0; m < NUM_METHODS; m++) {
+            unsigned int words = counts[c][m].words;
+            if (!words ||
+                (num_methods == max && methods[max - 1].words >= words)) {
+                continue;
+            }
+
+            /* Insertion into the sorted list, dropping the last if full */
+            int i = MIN(num_methods, max - 1);
+            while (i > 0 && methods[i - 1].words < words) {
+                methods[i] = methods[i - 1];
+                i--;
+            }
+            unsigned int graphics_class =
+                c < ARRAY_SIZE(method_classes) ? method_classes[c] : 0;
+            methods[i] = (NV2AProfMethod){
+                .graphics_class = graphics_class,
+                .method = m << 2,
+                .name = pgraph_get_method_name(graphics_class, m << 2),
+                .calls = counts[c][m].calls,
+                .words = words,
+            };
+            num_methods = MIN(num_methods + 1, max);
+        }
+    }
+
+    return num_methods;
+}
+
+const char *nv2a_profile_get_draw_kind_name(unsigned int kind)
+{
+    const char *default_names[NV2A_PROF_DRAW_KIND__COUNT] = {
+        #define _X(x) stringify(x),
+        NV2A_PROF_DRAW_KINDS_XMAC
+        #undef _X
+    };
+
+    assert(kind < NV2A_PROF_DRAW_KIND__COUNT);
+    return default_names[kind] + 20; /* 'NV2A_PROF_DRAW_KIND_' */
+}
+
+const char *nv2a_profile_get_state_name(unsigned int state)
+{
+    const char *default_names[NV2A_PROF_STATE__COUNT] = {
+        #define _X(x) stringify(x),
+        NV2A_PROF_STATE_XMAC
+        #undef _X
+    };
+
+    assert(state < NV2A_PROF_STATE__COUNT);
+    return default_names[state] + 16; /* 'NV2A_PROF_STATE_' */
+}
+
+const char *nv2a_profile_get_prim_type_name(unsigned int prim_type)
+{
+    const char *names[NV2A_PROF_PRIM_TYPES] = {
+        [PRIM_TYPE_INVALID] = "INVALID",
+        [PRIM_TYPE_POINTS] = "POINTS",
+        [PRIM_TYPE_LINES] = "LINES",
+        [PRIM_TYPE_LINE_LOOP] = "LINE_LOOP",
+        [PRIM_TYPE_LINE_STRIP] = "LINE_STRIP",
+        [PRIM_TYPE_TRIANGLES] = "TRIANGLES",
+        [PRIM_TYPE_TRIANGLE_STRIP] = "TRIANGLE_STRIP",
+        [PRIM_TYPE_TRIANGLE_FAN] = "TRIANGLE_FAN",
+        [PRIM_TYPE_QUADS] = "QUADS",
+        [PRIM_TYPE_QUAD_STRIP] = "QUAD_STRIP",
+        [PRIM_TYPE_POLYGON] = "POLYGON",
+    };
+    QEMU_BUILD_BUG_ON(PRIM_TYPE_POLYGON + 1 != NV2A_PROF_PRIM_TYPES);
+
+    assert(prim_type < NV2A_PROF_PRIM_TYPES);
+    return names[prim_type];
 }
 
 const char *nv2a_profile_get_counter_name(unsigned int cnt)
@@ -72,3 +361,94 @@ int nv2a_profile_get_counter_value(unsigned int cnt)
                        NV2A_PROF_NUM_FRAMES;
     return g_nv2a_stats.frame_history[idx].counters[cnt];
 }
+
+const char *nv2a_profile_get_gpu_timer_name(unsigned int timer)
+{
+    const char *default_names[NV2A_PROF_GPU__COUNT] = {
+        #define _X(x) stringify(x),
+        NV2A_PROF_GPU_TIMERS_XMAC
+        #undef _X
+    };
+
+    assert(timer < NV2A_PROF_GPU__COUNT);
+    return default_names[timer] + 14; /* 'NV2A_PROF_GPU_' */
+}
+
+const char *nv2a_profile_get_cpu_timer_name(unsigned int timer)
+{
+    const char *default_names[NV2A_PROF_CPU__COUNT] = {
+        #define _X(x) stringify(x),
+        NV2A_PROF_CPU_TIMERS_XMAC
+        #undef _X
+    };
+
+    assert(timer < NV2A_PROF_CPU__COUNT);
+    return default_names[timer] + 14; /* 'NV2A_PROF_CPU_' */
+}
+
+int nv2a_profile_get_cpu_timer_value(unsigned int timer)
+{
+    assert(timer < NV2A_PROF_CPU__COUNT);
+    unsigned int idx = (g_nv2a_stats.frame_ptr + NV2A_PROF_NUM_FRAMES - 1) %
+                       NV2A_PROF_NUM_FRAMES;
+    return g_nv2a_stats.frame_history[idx].cpu_timers[timer];
+}
+
+int64_t nv2a_profile_cpu_time_begin(void)
+{
+    return get_clock();
+}
+
+void nv2a_profile_cpu_time_end(enum NV2A_PROF_CPU_TIMERS_ENUM timer,
+                               const char *detail, int64_t start)
+{
+    int64_t end = get_clock();
+
+    /* Shaders and pipelines may be compiled on worker threads */
+    qatomic_add(&g_nv2a_stats.frame_working.cpu_timers[timer],
+                (end - start) / 1000);
+
+    if (timeline_is_active()) {
+        timeline_record(nv2a_profile_get_cpu_timer_name(timer), detail, start);
+    }
+}
+
+int nv2a_profile_get_gpu_timer_value(unsigned int timer)
+{
+    assert(timer < NV2A_PROF_GPU__COUNT);
+    unsigned int idx = (g_nv2a_stats.frame_ptr + NV2A_PROF_NUM_FRAMES - 1) %
+                       NV2A_PROF_NUM_FRAMES;
+    return g_nv2a_stats.frame_history[idx].gpu_timers[timer];
+}
+
+const char *nv2a_profile_get_cache_name(unsigned int cache)
+{
+    const char *names[NV2A_PROF_CACHE__COUNT] = {
+        [NV2A_PROF_CACHE_TEXTURE] = "texture_cache",
+        [NV2A_PROF_CACHE_SHADER] = "shader_cache",
+        [NV2A_PROF_CACHE_PIPELINE] = "pipeline_cache",
+        [NV2A_PROF_CACHE_SHADER_MODULE] = "shader_module_cache",
+        [NV2A_PROF_CACHE_SAMPLER] = "sampler_cache",
+        [NV2A_PROF_CACHE_FRAMEBUFFER] = "framebuffer_cache",
+        [NV2A_PROF_CACHE_COMPUTE_PIPELINE] = "compute_pipeline_cache",
+        [NV2A_PROF_CACHE_ELEMENT] = "element_cache",
+        [NV2A_PROF_CACHE_VERTEX_ARRAY] = "vertex_array_cache",
+    };
+
+    assert(cache < NV2A_PROF_CACHE__COUNT);
+    return names[cache];
+}
+
+void nv2a_profile_update_cache(enum NV2A_PROF_CACHES_ENUM cache,
+                               const Lru *lru)
+{
+    QEMU_BUILD_BUG_ON(NV2A_PROF_CACHE_AGE_BUCKETS != LRU_EVICTION_AGE_BUCKETS);
+
+    g_nv2a_stats.caches[cache].used = lru->num_used;
+    g_nv2a_stats.caches[cache].capacity = lru->num_used + lru->num_free;
+    g_nv2a_stats.caches[cache].hits = lru->hits;
+    g_nv2a_stats.caches[cache].misses = lru->misses;
+    g_nv2a_stats.caches[cache].evictions = lru->evictions;
+    memcpy(g_nv2a_stats.caches[cache].eviction_age, lru->eviction_age,
+           sizeof(lru->eviction_age));
+}
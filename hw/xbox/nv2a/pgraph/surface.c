@@ -0,0 +1,105 @@
+/*
+ * QEMU Geforce NV2A implementation
+ *
+ * Copyright (c) 2012 espes
+ * Copyright (c) 2015 Jannik Vogel
+ * Copyright (c) 2018-2024 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/xbox/nv2a/nv2a_int.h"
+
+void pgraph_get_surface_dimensions(PGRAPHState const *pg, unsigned int *width,
+                                   unsigned int *height)
+{
+    bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
+    if (swizzle) {
+        *width = 1 << pg->surface_shape.log_width;
+        *height = 1 << pg->surface_shape.log_height;
+    } else {
+        *width = pg->surface_shape.clip_width;
+        *height = pg->surface_shape.clip_height;
+    }
+}
+
+bool pgraph_framebuffer_dirty(PGRAPHState const *pg)
+{
+    bool shape_changed = memcmp(&pg->surface_shape, &pg->last_surface_shape,
+                                sizeof(SurfaceShape)) != 0;
+    if (!shape_changed || (!pg->surface_shape.color_format
+            && !pg->surface_shape.zeta_format)) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Decide which surfaces must be bound or written back for the coming draw
+ * (upload) or after it, and let the renderer do so through `ops`. Renderers
+ * then refresh the bindings they are left with.
+ */
+void pgraph_update_surface_parts(NV2AState *d, bool upload, bool color_write,
+                                 bool zeta_write,
+                                 const PGRAPHSurfaceUpdateOps *ops)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pg->surface_shape.z_format =
+        GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
+                 NV_PGRAPH_SETUPRASTER_Z_FORMAT);
+
+    color_write = color_write &&
+            (pg->clearing || pgraph_color_write_enabled(pg));
+    zeta_write = zeta_write && (pg->clearing || pgraph_zeta_write_enabled(pg));
+
+    if (upload) {
+        bool fb_dirty = pgraph_framebuffer_dirty(pg);
+        if (fb_dirty) {
+            memcpy(&pg->last_surface_shape, &pg->surface_shape,
+                   sizeof(SurfaceShape));
+            pg->surface_color.buffer_dirty = true;
+            pg->surface_zeta.buffer_dirty = true;
+        }
+
+        if (pg->surface_color.buffer_dirty) {
+            ops->unbind_surface(d, true);
+        }
+
+        if (color_write) {
+            ops->update_surface_part(d, true, true);
+        }
+
+        if (pg->surface_zeta.buffer_dirty) {
+            ops->unbind_surface(d, false);
+        }
+
+        if (zeta_write) {
+            ops->update_surface_part(d, true, false);
+        }
+    } else {
+        if ((color_write || pg->surface_color.write_enabled_cache)
+            && pg->surface_color.draw_dirty) {
+            ops->update_surface_part(d, false, true);
+        }
+        if ((zeta_write || pg->surface_zeta.write_enabled_cache)
+            && pg->surface_zeta.draw_dirty) {
+            ops->update_surface_part(d, false, false);
+        }
+    }
+
+    if (upload) {
+        pg->draw_time++;
+    }
+}
@@ -25,6 +25,12 @@
 #include <assert.h>
 #include <stdbool.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "swizzle.h"
 
 /*
@@ -45,12 +51,12 @@
  * mask_z:  00000000
  * for "Z": yyyxyxyx
  */
-static void generate_swizzle_masks(unsigned int width,
-                                   unsigned int height,
-                                   unsigned int depth,
-                                   uint32_t* mask_x,
-                                   uint32_t* mask_y,
-                                   uint32_t* mask_z)
+void generate_swizzle_masks(unsigned int width,
+                            unsigned int height,
+                            unsigned int depth,
+                            uint32_t* mask_x,
+                            uint32_t* mask_y,
+                            uint32_t* mask_z)
 {
     uint32_t x = 0, y = 0, z = 0;
     uint32_t bit = 1;
@@ -150,10 +156,177 @@ static inline void unswizzle_box_internal(
     }
 }
 
-/* Multiversioned to optimize for common bytes_per_pixel */         \
-#define C(m, bpp)                                                   \
-    m##_internal(src_buf, width, height, depth, dst_buf, row_pitch, \
-                 slice_pitch, bpp)
+/*
+ * When a 2D texture is at least 4x4, the low 4 bits of a swizzled offset are
+ * x0 y0 x1 y1, so each aligned 4x4 block of texels is stored contiguously and
+ * each of its rows is made of two runs of 2 texels. Blocks are moved whole,
+ * stepping the block offsets through the remaining mask bits.
+ */
+static const unsigned int block_row_offsets[4] = { 0, 2, 8, 10 };
+
+static inline void unswizzle_block(const uint8_t *src, uint8_t *dst,
+                                   unsigned int row_pitch,
+                                   unsigned int bytes_per_pixel)
+{
+#if defined(__SSE2__)
+    if (bytes_per_pixel == 4) {
+        __m128i q0 = _mm_loadu_si128((const __m128i *)src + 0);
+        __m128i q1 = _mm_loadu_si128((const __m128i *)src + 1);
+        __m128i q2 = _mm_loadu_si128((const __m128i *)src + 2);
+        __m128i q3 = _mm_loadu_si128((const __m128i *)src + 3);
+        _mm_storeu_si128((__m128i *)(dst + 0 * row_pitch),
+                         _mm_unpacklo_epi64(q0, q1));
+        _mm_storeu_si128((__m128i *)(dst + 1 * row_pitch),
+                         _mm_unpackhi_epi64(q0, q1));
+        _mm_storeu_si128((__m128i *)(dst + 2 * row_pitch),
+                         _mm_unpacklo_epi64(q2, q3));
+        _mm_storeu_si128((__m128i *)(dst + 3 * row_pitch),
+                         _mm_unpackhi_epi64(q2, q3));
+        return;
+    }
+#elif defined(__ARM_NEON)
+    if (bytes_per_pixel == 4) {
+        const uint32_t *s = (const uint32_t *)src;
+        uint32x4_t q0 = vld1q_u32(s + 0), q1 = vld1q_u32(s + 4),
+                   q2 = vld1q_u32(s + 8), q3 = vld1q_u32(s + 12);
+        vst1q_u32((uint32_t *)(dst + 0 * row_pitch),
+                  vcombine_u32(vget_low_u32(q0), vget_low_u32(q1)));
+        vst1q_u32((uint32_t *)(dst + 1 * row_pitch),
+                  vcombine_u32(vget_high_u32(q0), vget_high_u32(q1)));
+        vst1q_u32((uint32_t *)(dst + 2 * row_pitch),
+                  vcombine_u32(vget_low_u32(q2), vget_low_u32(q3)));
+        vst1q_u32((uint32_t *)(dst + 3 * row_pitch),
+                  vcombine_u32(vget_high_u32(q2), vget_high_u32(q3)));
+        return;
+    }
+#endif
+
+    for (int row = 0; row < 4; row++) {
+        const uint8_t *s = src + block_row_offsets[row] * bytes_per_pixel;
+        uint8_t *d = dst + row * row_pitch;
+        memcpy(d, s, 2 * bytes_per_pixel);
+        memcpy(d + 2 * bytes_per_pixel, s + 4 * bytes_per_pixel,
+               2 * bytes_per_pixel);
+    }
+}
+
+static inline void swizzle_block(const uint8_t *src, uint8_t *dst,
+                                 unsigned int row_pitch,
+                                 unsigned int bytes_per_pixel)
+{
+#if defined(__SSE2__)
+    if (bytes_per_pixel == 4) {
+        __m128i r0 = _mm_loadu_si128((const __m128i *)(src + 0 * row_pitch));
+        __m128i r1 = _mm_loadu_si128((const __m128i *)(src + 1 * row_pitch));
+        __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2 * row_pitch));
+        __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3 * row_pitch));
+        _mm_storeu_si128((__m128i *)dst + 0, _mm_unpacklo_epi64(r0, r1));
+        _mm_storeu_si128((__m128i *)dst + 1, _mm_unpackhi_epi64(r0, r1));
+        _mm_storeu_si128((__m128i *)dst + 2, _mm_unpacklo_epi64(r2, r3));
+        _mm_storeu_si128((__m128i *)dst + 3, _mm_unpackhi_epi64(r2, r3));
+        return;
+    }
+#elif defined(__ARM_NEON)
+    if (bytes_per_pixel == 4) {
+        uint32_t *d = (uint32_t *)dst;
+        uint32x4_t r0 = vld1q_u32((const uint32_t *)(src + 0 * row_pitch)),
+                   r1 = vld1q_u32((const uint32_t *)(src + 1 * row_pitch)),
+                   r2 = vld1q_u32((const uint32_t *)(src + 2 * row_pitch)),
+                   r3 = vld1q_u32((const uint32_t *)(src + 3 * row_pitch));
+        vst1q_u32(d + 0, vcombine_u32(vget_low_u32(r0), vget_low_u32(r1)));
+        vst1q_u32(d + 4, vcombine_u32(vget_high_u32(r0), vget_high_u32(r1)));
+        vst1q_u32(d + 8, vcombine_u32(vget_low_u32(r2), vget_low_u32(r3)));
+        vst1q_u32(d + 12, vcombine_u32(vget_high_u32(r2), vget_high_u32(r3)));
+        return;
+    }
+#endif
+
+    for (int row = 0; row < 4; row++) {
+        const uint8_t *s = src + row * row_pitch;
+        uint8_t *d = dst + block_row_offsets[row] * bytes_per_pixel;
+        memcpy(d, s, 2 * bytes_per_pixel);
+        memcpy(d + 4 * bytes_per_pixel, s + 2 * bytes_per_pixel,
+               2 * bytes_per_pixel);
+    }
+}
+
+static inline bool can_use_blocks(unsigned int width, unsigned int height,
+                                  unsigned int depth)
+{
+    return width >= 4 && height >= 4 && depth == 1;
+}
+
+static inline void swizzle_box_blocks_internal(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    uint32_t block_mask_x = mask_x & ~0xf, block_mask_y = mask_y & ~0xf;
+
+    uint32_t off_y = 0;
+    for (unsigned int y = 0; y < height; y += 4) {
+        uint32_t off_x = 0;
+        const uint8_t *src_tmp = src_buf + y * row_pitch;
+        uint8_t *dst_tmp = dst_buf + off_y * bytes_per_pixel;
+        for (unsigned int x = 0; x < width; x += 4) {
+            swizzle_block(src_tmp + x * bytes_per_pixel,
+                          dst_tmp + off_x * bytes_per_pixel, row_pitch,
+                          bytes_per_pixel);
+            off_x = (off_x - block_mask_x) & block_mask_x;
+        }
+        off_y = (off_y - block_mask_y) & block_mask_y;
+    }
+}
+
+static inline void unswizzle_box_blocks_internal(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    uint32_t block_mask_x = mask_x & ~0xf, block_mask_y = mask_y & ~0xf;
+
+    uint32_t off_y = 0;
+    for (unsigned int y = 0; y < height; y += 4) {
+        uint32_t off_x = 0;
+        const uint8_t *src_tmp = src_buf + off_y * bytes_per_pixel;
+        uint8_t *dst_tmp = dst_buf + y * row_pitch;
+        for (unsigned int x = 0; x < width; x += 4) {
+            unswizzle_block(src_tmp + off_x * bytes_per_pixel,
+                            dst_tmp + x * bytes_per_pixel, row_pitch,
+                            bytes_per_pixel);
+            off_x = (off_x - block_mask_x) & block_mask_x;
+        }
+        off_y = (off_y - block_mask_y) & block_mask_y;
+    }
+}
+
+/* Multiversioned to optimize for common bytes_per_pixel */
+#define C(m, bpp)                                                         \
+    do {                                                                  \
+        if (can_use_blocks(width, height, depth)) {                       \
+            m##_blocks_internal(src_buf, width, height, depth, dst_buf,   \
+                                row_pitch, slice_pitch, bpp);             \
+        } else {                                                          \
+            m##_internal(src_buf, width, height, depth, dst_buf,          \
+                         row_pitch, slice_pitch, bpp);                    \
+        }                                                                 \
+    } while (0)
 #define MULTIVERSION(m)                                                     \
     void m(const uint8_t *src_buf, unsigned int width, unsigned int height, \
            unsigned int depth, uint8_t *dst_buf, unsigned int row_pitch,    \
@@ -172,6 +345,12 @@ static inline void unswizzle_box_internal(
         case 4:                                                             \
             C(m, 4);                                                        \
             break;                                                          \
+        case 8:                                                             \
+            C(m, 8);                                                        \
+            break;                                                          \
+        case 16:                                                            \
+            C(m, 16);                                                       \
+            break;                                                          \
         default:                                                            \
             C(m, bytes_per_pixel);                                          \
         }                                                                   \
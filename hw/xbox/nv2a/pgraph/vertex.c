@@ -20,6 +20,7 @@
  */
 
 #include "hw/xbox/nv2a/nv2a_int.h"
+#include "nv2a_vsh_emulator.h"
 
 void pgraph_update_inline_value(VertexAttribute *attr, const uint8_t *data)
 {
@@ -102,16 +103,117 @@ void pgraph_get_inline_values(PGRAPHState *pg, uint16_t attrs,
 }
 
 
-void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg, unsigned int attr)
+/*
+ * Returns the size of a vertex of the inline array, packed the way the
+ * renderers bind it, and the offset of each enabled attribute if offsets is
+ * not NULL.
+ */
+unsigned int pgraph_get_inline_array_vertex_size(
+    PGRAPHState *pg, unsigned int offsets[NV2A_VERTEXSHADER_ATTRIBUTES])
 {
-    VertexAttribute *attribute = &pg->vertex_attributes[attr];
+    unsigned int offset = 0;
+    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attr = &pg->vertex_attributes[i];
+        if (attr->count == 0) {
+            continue;
+        }
+        offset = ROUND_UP(offset, attr->size);
+        if (offsets) {
+            offsets[i] = offset;
+        }
+        offset += attr->size * attr->count;
+        offset = ROUND_UP(offset, attr->size);
+    }
+
+    return offset;
+}
+
+/*
+ * Runs the current vertex program on the CPU for each vertex of the inline
+ * array, leaving its output registers in out. Returns the number of vertices
+ * transformed, or 0 if the draw is not suitable and has to be transformed by
+ * the vertex shader as usual.
+ */
+unsigned int pgraph_vsh_cpu_transform_inline_array(
+    PGRAPHState *pg, float out[][PGRAPH_VSH_CPU_OUTPUT_REGS][4])
+{
+    bool vertex_program = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_D),
+                                   NV_PGRAPH_CSV0_D_MODE) == 2;
+    if (!vertex_program || pg->enable_vertex_program_write) {
+        return 0;
+    }
+
+    unsigned int offsets[NV2A_VERTEXSHADER_ATTRIBUTES];
+    unsigned int vertex_size = pgraph_get_inline_array_vertex_size(pg, offsets);
+    if (!vertex_size) {
+        return 0;
+    }
+    unsigned int num_vertices = pg->inline_array_length * 4 / vertex_size;
+    if (!num_vertices || num_vertices > PGRAPH_VSH_CPU_MAX_VERTICES) {
+        return 0;
+    }
 
-    if (attribute->inline_buffer_populated || pg->inline_buffer_length == 0) {
-        return;
+    int program_start = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CSV0_C),
+                                 NV_PGRAPH_CSV0_C_CHEOPS_PROGRAM_START);
+    Nv2aVshProgram program;
+    Nv2aVshParseResult result = nv2a_vsh_parse_program(
+        &program, pg->program_data[program_start],
+        NV2A_MAX_TRANSFORM_PROGRAM_LENGTH - program_start);
+    if (result != NV2AVPR_SUCCESS) {
+        nv2a_vsh_program_destroy(&program);
+        return 0;
     }
 
+    Nv2aVshCPUFullExecutionState state_storage;
+    Nv2aVshExecutionState state = nv2a_vsh_emu_initialize_full_execution_state(
+        &state_storage, (float *)pg->vsh_constants);
+
+    for (unsigned int v = 0; v < num_vertices; v++) {
+        const uint8_t *vertex = (uint8_t *)pg->inline_array + v * vertex_size;
+
+        for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+            VertexAttribute attr = pg->vertex_attributes[i];
+            float *input = &state_storage.input_regs[i * 4];
+
+            if (attr.count) {
+                pgraph_update_inline_value(&attr, vertex + offsets[i]);
+                if (attr.format ==
+                    NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_UB_D3D) {
+                    /* Stored as BGRA */
+                    float b = attr.inline_value[0];
+                    attr.inline_value[0] = attr.inline_value[2];
+                    attr.inline_value[2] = b;
+                }
+            }
+            memcpy(input, attr.inline_value, 4 * sizeof(float));
+        }
+
+        /* Registers start out the same as in the generated shader */
+        memset(state_storage.temp_regs, 0, sizeof(state_storage.temp_regs));
+        memset(state_storage.address_reg, 0,
+               sizeof(state_storage.address_reg));
+        for (int i = 0; i < PGRAPH_VSH_CPU_OUTPUT_REGS; i++) {
+            float *output = &state_storage.output_regs[i * 4];
+            output[0] = output[1] = output[2] = 0.0f;
+            output[3] = 1.0f;
+        }
+
+        nv2a_vsh_emu_execute(&state, &program);
+
+        memcpy(out[v], state_storage.output_regs, sizeof(out[v]));
+    }
+
+    nv2a_vsh_program_destroy(&program);
+
+    return num_vertices;
+}
+
+void pgraph_populate_inline_buffer(PGRAPHState *pg, unsigned int attr)
+{
+    VertexAttribute *attribute = &pg->vertex_attributes[attr];
+
     /* Now upload the previous attribute value */
-    attribute->inline_buffer_populated = true;
+    pg->inline_buffer_attrs |= 1 << attr;
     for (int i = 0; i < pg->inline_buffer_length; i++) {
         memcpy(&attribute->inline_buffer[i * 4], attribute->inline_value,
                sizeof(float) * 4);
@@ -123,12 +225,12 @@ void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg)
     pgraph_check_within_begin_end_block(pg);
     assert(pg->inline_buffer_length < NV2A_MAX_BATCH_LENGTH);
 
-    for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &pg->vertex_attributes[i];
-        if (attribute->inline_buffer_populated) {
-            memcpy(&attribute->inline_buffer[pg->inline_buffer_length * 4],
-                   attribute->inline_value, sizeof(float) * 4);
-        }
+    /* Only visit attributes that were set within this begin/end block */
+    for (uint32_t attrs = pg->inline_buffer_attrs; attrs;
+         attrs &= attrs - 1) {
+        VertexAttribute *attribute = &pg->vertex_attributes[ctz32(attrs)];
+        memcpy(&attribute->inline_buffer[pg->inline_buffer_length * 4],
+               attribute->inline_value, sizeof(float) * 4);
     }
 
     pg->inline_buffer_length++;
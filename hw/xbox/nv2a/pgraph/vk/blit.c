@@ -165,7 +165,7 @@ void pgraph_vk_image_blit(NV2AState *d)
             surf_dest->download_pending = false;
             surf_dest->draw_dirty = false;
         }
-        surf_dest->upload_pending = true;
+        pgraph_vk_mark_surface_upload_pending(surf_dest, 0, 0);
         pg->draw_time++;
     }
 
@@ -224,4 +224,6 @@ void pgraph_vk_image_blit(NV2AState *d)
                                    DIRTY_MEMORY_VGA);
     memory_region_set_client_dirty(d->vram, dest_addr, clipped_dest_size,
                                    DIRTY_MEMORY_NV2A_TEX);
+    memory_region_set_client_dirty(d->vram, dest_addr, clipped_dest_size,
+                                   DIRTY_MEMORY_SNAPSHOT);
 }
@@ -18,6 +18,25 @@
  */
 
 #include "renderer.h"
+#include "qemu/host-utils.h"
+
+/*
+ * Streamed data is written to host visible staging rings and copied to the
+ * matching device buffers at the same offsets when a frame is submitted. The
+ * space used by a frame is reclaimed once the fence of its submit signals.
+ * Rings without a device buffer are read directly by transfer commands.
+ */
+static const struct {
+    int staging, device;
+} ring_buffers[] = {
+    { BUFFER_INDEX_STAGING, BUFFER_INDEX },
+    { BUFFER_VERTEX_INLINE_STAGING, BUFFER_VERTEX_INLINE },
+    { BUFFER_UNIFORM_STAGING, BUFFER_UNIFORM },
+    { BUFFER_TRANSFER_STAGING, -1 },
+};
+
+// Rings double in size when a single frame fills them, up to this factor
+static const int max_ring_growth = 8;
 
 static void create_buffer(PGRAPHState *pg, StorageBuffer *buffer)
 {
@@ -38,11 +57,113 @@ static void destroy_buffer(PGRAPHState *pg, StorageBuffer *buffer)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    vmaDestroyBuffer(r->allocator, buffer->buffer, buffer->allocation);
+    if (buffer->imported_memory) {
+        vkDestroyBuffer(r->device, buffer->buffer, NULL);
+        vkFreeMemory(r->device, buffer->imported_memory, NULL);
+        buffer->imported_memory = VK_NULL_HANDLE;
+    } else {
+        vmaDestroyBuffer(r->allocator, buffer->buffer, buffer->allocation);
+    }
     buffer->buffer = VK_NULL_HANDLE;
     buffer->allocation = VK_NULL_HANDLE;
 }
 
+/*
+ * Back the vertex RAM buffer with guest VRAM itself, so the GPU fetches vertex
+ * data from it directly instead of from a copy. Returns false if the device
+ * cannot import the allocation, in which case a regular buffer is created
+ * and dirty pages are copied to it.
+ */
+static bool import_vertex_ram_buffer(NV2AState *d, StorageBuffer *buffer)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    const VkExternalMemoryHandleTypeFlagBits handle_type =
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+    if (!r->external_memory_host_extension_enabled) {
+        return false;
+    }
+
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+    };
+    VkPhysicalDeviceProperties2 props = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &host_props,
+    };
+    vkGetPhysicalDeviceProperties2(r->physical_device, &props);
+
+    VkDeviceSize alignment = host_props.minImportedHostPointerAlignment;
+    if ((uintptr_t)d->vram_ptr % alignment ||
+        buffer->buffer_size % alignment) {
+        NV2A_VK_DPRINTF("VRAM allocation is not aligned for import");
+        return false;
+    }
+
+    VkMemoryHostPointerPropertiesEXT pointer_props = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+    };
+    if (vkGetMemoryHostPointerPropertiesEXT(r->device, handle_type,
+                                            d->vram_ptr, &pointer_props) !=
+        VK_SUCCESS) {
+        return false;
+    }
+
+    VkExternalMemoryBufferCreateInfo external_memory_buffer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+        .handleTypes = handle_type,
+    };
+    VkBufferCreateInfo buffer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = &external_memory_buffer_create_info,
+        .size = buffer->buffer_size,
+        .usage = buffer->usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    if (vkCreateBuffer(r->device, &buffer_create_info, NULL,
+                       &buffer->buffer) != VK_SUCCESS) {
+        buffer->buffer = VK_NULL_HANDLE;
+        return false;
+    }
+
+    // Guest writes are not flushed, only accept coherent memory
+    VkMemoryRequirements memory_requirements;
+    vkGetBufferMemoryRequirements(r->device, buffer->buffer,
+                                  &memory_requirements);
+    uint32_t memory_type = pgraph_vk_get_memory_type(
+        pg, memory_requirements.memoryTypeBits & pointer_props.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    VkImportMemoryHostPointerInfoEXT import_info = {
+        .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+        .handleType = handle_type,
+        .pHostPointer = d->vram_ptr,
+    };
+    VkMemoryAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = &import_info,
+        .allocationSize = buffer->buffer_size,
+        .memoryTypeIndex = memory_type,
+    };
+    if (memory_type == 0xFFFFFFFF ||
+        vkAllocateMemory(r->device, &alloc_info, NULL,
+                         &buffer->imported_memory) != VK_SUCCESS) {
+        vkDestroyBuffer(r->device, buffer->buffer, NULL);
+        buffer->buffer = VK_NULL_HANDLE;
+        buffer->imported_memory = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VK_CHECK(vkBindBufferMemory(r->device, buffer->buffer,
+                                buffer->imported_memory, 0));
+    buffer->mapped = d->vram_ptr;
+
+    return true;
+}
+
 void pgraph_vk_init_buffers(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
@@ -62,7 +183,8 @@ void pgraph_vk_init_buffers(NV2AState *d)
 
     r->storage_buffers[BUFFER_STAGING_DST] = (StorageBuffer){
         .alloc_info = host_alloc_create_info,
-        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
         .buffer_size = 4096 * 4096 * 4,
     };
 
@@ -74,7 +196,8 @@ void pgraph_vk_init_buffers(NV2AState *d)
 
     r->storage_buffers[BUFFER_COMPUTE_DST] = (StorageBuffer){
         .alloc_info = device_alloc_create_info,
-        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
         .buffer_size = (1024 * 10) * (1024 * 10) * 8,
     };
@@ -109,6 +232,10 @@ void pgraph_vk_init_buffers(NV2AState *d)
     r->bitmap_size = memory_region_size(d->vram) / 4096;
     r->uploaded_bitmap = bitmap_new(r->bitmap_size);
     bitmap_clear(r->uploaded_bitmap, 0, r->bitmap_size);
+    r->vertex_ram_vram_gens = pgraph_vram_new_seen_gens(d);
+    for (int i = 0; i < r->num_frames; i++) {
+        r->frames[i].vertex_ram_bitmap = bitmap_new(r->bitmap_size);
+    }
 
     r->storage_buffers[BUFFER_VERTEX_INLINE] = (StorageBuffer){
         .alloc_info = device_alloc_create_info,
@@ -137,7 +264,32 @@ void pgraph_vk_init_buffers(NV2AState *d)
         .buffer_size = r->storage_buffers[BUFFER_UNIFORM].buffer_size,
     };
 
+    r->storage_buffers[BUFFER_TRANSFER_STAGING] = (StorageBuffer){
+        .alloc_info = host_alloc_create_info,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .buffer_size = 16 * 1024 * 1024,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(ring_buffers); i++) {
+        StorageBuffer *staging = &r->storage_buffers[ring_buffers[i].staging];
+        staging->buffer_size *= r->num_frames;
+        staging->buffer_size_max = staging->buffer_size * max_ring_growth;
+        if (ring_buffers[i].device >= 0) {
+            r->storage_buffers[ring_buffers[i].device].buffer_size =
+                staging->buffer_size;
+        }
+    }
+
+    bool vertex_ram_imported =
+        import_vertex_ram_buffer(d, &r->storage_buffers[BUFFER_VERTEX_RAM]);
+    NV2A_VK_DPRINTF("Vertex RAM: %s",
+                    vertex_ram_imported ? "imported guest memory" : "copied");
+
     for (int i = 0; i < BUFFER_COUNT; i++) {
+        if ((i == BUFFER_VERTEX_RAM && vertex_ram_imported) ||
+            (i == BUFFER_TRANSFER_STAGING && !r->transfer_queue)) {
+            continue;
+        }
         create_buffer(pg, &r->storage_buffers[i]);
     }
 
@@ -146,9 +298,14 @@ void pgraph_vk_init_buffers(NV2AState *d)
     int buffers_to_map[] = { BUFFER_VERTEX_RAM,
                              BUFFER_INDEX_STAGING,
                              BUFFER_VERTEX_INLINE_STAGING,
-                             BUFFER_UNIFORM_STAGING };
+                             BUFFER_UNIFORM_STAGING,
+                             BUFFER_TRANSFER_STAGING };
 
     for (int i = 0; i < ARRAY_SIZE(buffers_to_map); i++) {
+        if (r->storage_buffers[buffers_to_map[i]].mapped ||
+            !r->storage_buffers[buffers_to_map[i]].buffer) {
+            continue;
+        }
         VK_CHECK(vmaMapMemory(
             r->allocator, r->storage_buffers[buffers_to_map[i]].allocation,
             (void **)&r->storage_buffers[buffers_to_map[i]].mapped));
@@ -161,7 +318,11 @@ void pgraph_vk_finalize_buffers(NV2AState *d)
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     for (int i = 0; i < BUFFER_COUNT; i++) {
-        if (r->storage_buffers[i].mapped) {
+        if (!r->storage_buffers[i].buffer) {
+            continue;
+        }
+        if (r->storage_buffers[i].mapped &&
+            !r->storage_buffers[i].imported_memory) {
             vmaUnmapMemory(r->allocator, r->storage_buffers[i].allocation);
         }
         destroy_buffer(pg, &r->storage_buffers[i]);
@@ -169,6 +330,73 @@ void pgraph_vk_finalize_buffers(NV2AState *d)
 
     g_free(r->uploaded_bitmap);
     r->uploaded_bitmap = NULL;
+    g_free(r->vertex_ram_vram_gens);
+    r->vertex_ram_vram_gens = NULL;
+    for (int i = 0; i < r->num_frames; i++) {
+        g_free(r->frames[i].vertex_ram_bitmap);
+        r->frames[i].vertex_ram_bitmap = NULL;
+    }
+}
+
+static bool ring_has_pending_submits(PGRAPHVkState *r)
+{
+    return r->completed_submit_count != r->submit_count;
+}
+
+/*
+ * Oldest offset still in use, either by a submitted frame the GPU may be
+ * reading or by the frame being recorded.
+ */
+static size_t get_ring_tail(PGRAPHVkState *r, StorageBuffer *b)
+{
+    if (ring_has_pending_submits(r)) {
+        int slot = r->completed_submit_count % r->num_frames;
+        return b->submitted_frame_starts[slot];
+    }
+    return b->frame_start;
+}
+
+/*
+ * The head never catches up with the tail from behind, so the ring has wrapped
+ * when the head is below the tail and is empty when they are equal.
+ */
+static size_t get_ring_usage(PGRAPHVkState *r, StorageBuffer *b)
+{
+    size_t tail = get_ring_tail(r, b);
+    if (b->buffer_offset >= tail) {
+        return b->buffer_offset - tail;
+    }
+    return b->buffer_size - tail + b->buffer_offset;
+}
+
+static bool find_ring_space(PGRAPHVkState *r, StorageBuffer *b,
+                            VkDeviceSize size, VkDeviceAddress alignment,
+                            size_t *offset, bool *wraps)
+{
+    if (!ring_has_pending_submits(r) && b->buffer_offset == b->frame_start) {
+        // Ring is idle, start over from the beginning
+        b->buffer_offset = 0;
+        b->frame_start = 0;
+        b->frame_wrapped = false;
+    }
+
+    size_t head = b->buffer_offset;
+    size_t tail = get_ring_tail(r, b);
+
+    *offset = ROUND_UP(head, alignment);
+    *wraps = false;
+
+    if (head < tail) {
+        return *offset + size < tail;
+    }
+    if (*offset + size <= b->buffer_size) {
+        return true;
+    }
+
+    // Continue at the start of the buffer
+    *offset = 0;
+    *wraps = true;
+    return size < tail;
 }
 
 bool pgraph_vk_buffer_has_space_for(PGRAPHState *pg, int index,
@@ -177,7 +405,140 @@ bool pgraph_vk_buffer_has_space_for(PGRAPHState *pg, int index,
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
     StorageBuffer *b = &r->storage_buffers[index];
-    return (ROUND_UP(b->buffer_offset, alignment) + size) <= b->buffer_size;
+
+    size_t offset;
+    bool wraps;
+    return find_ring_space(r, b, size, alignment, &offset, &wraps);
+}
+
+VkDeviceSize pgraph_vk_allocate_buffer_space(PGRAPHState *pg, int index,
+                                             VkDeviceSize size,
+                                             VkDeviceAddress alignment)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    StorageBuffer *b = &r->storage_buffers[index];
+
+    size_t offset;
+    bool wraps;
+    bool has_space = find_ring_space(r, b, size, alignment, &offset, &wraps);
+    assert(has_space);
+
+    if (wraps) {
+        b->frame_wrap_end = b->buffer_offset;
+        b->frame_wrapped = true;
+    }
+    b->buffer_offset = offset + size;
+
+    size_t usage = get_ring_usage(r, b);
+    if (usage > b->high_water) {
+        b->high_water = usage;
+    }
+
+    return offset;
+}
+
+static int get_ring_index(int index)
+{
+    for (int i = 0; i < ARRAY_SIZE(ring_buffers); i++) {
+        if (ring_buffers[i].staging == index) {
+            return i;
+        }
+    }
+    assert(!"Not a streamed buffer");
+    return -1;
+}
+
+/*
+ * Replace a ring with one twice the size. All submitted frames must be
+ * complete. The data of the frame being recorded keeps its offsets.
+ */
+static void grow_ring(PGRAPHState *pg, int ring, VkDeviceSize min_size)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    StorageBuffer *staging = &r->storage_buffers[ring_buffers[ring].staging];
+
+    assert(!ring_has_pending_submits(r));
+
+    size_t old_size = staging->buffer_size;
+    size_t new_size = MIN(old_size * 2, staging->buffer_size_max);
+    new_size = MAX(new_size, pow2ceil(min_size));
+    if (new_size <= old_size) {
+        return;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_BUFFER_RING_GROW);
+    trace_nv2a_pgraph_vk_buffer_ring_grow(ring_buffers[ring].staging, old_size,
+                                          new_size, staging->high_water);
+
+    StorageBuffer old_staging = *staging;
+    staging->buffer_size = new_size;
+    create_buffer(pg, staging);
+    VK_CHECK(vmaMapMemory(r->allocator, staging->allocation,
+                          (void **)&staging->mapped));
+    memcpy(staging->mapped, old_staging.mapped, old_size);
+    vmaUnmapMemory(r->allocator, old_staging.allocation);
+    destroy_buffer(pg, &old_staging);
+
+    if (ring_buffers[ring].device < 0) {
+        return;
+    }
+
+    StorageBuffer *device = &r->storage_buffers[ring_buffers[ring].device];
+    destroy_buffer(pg, device);
+    device->buffer_size = new_size;
+    create_buffer(pg, device);
+
+    // Descriptor sets written so far refer to the old uniform buffer
+    pgraph_vk_reset_descriptor_sets(r);
+}
+
+/*
+ * Make room for an allocation of the given size in a streamed buffer. Space
+ * held by earlier frames is reclaimed as their submits complete. If the frame
+ * being recorded fills the ring by itself, it is submitted and the ring grows
+ * so that following frames fit.
+ */
+void pgraph_vk_ensure_buffer_space(PGRAPHState *pg, int index,
+                                   VkDeviceSize size, VkDeviceAddress alignment)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (pgraph_vk_buffer_has_space_for(pg, index, size, alignment)) {
+        return;
+    }
+
+    pgraph_vk_retire_completed_submits(r);
+    while (ring_has_pending_submits(r) &&
+           !pgraph_vk_buffer_has_space_for(pg, index, size, alignment)) {
+        nv2a_profile_inc_counter(NV2A_PROF_BUFFER_RING_WAIT);
+        pgraph_vk_wait_for_submit(r, r->completed_submit_count);
+    }
+    if (pgraph_vk_buffer_has_space_for(pg, index, size, alignment)) {
+        return;
+    }
+
+    pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    pgraph_vk_wait_for_all_submits(r);
+    StorageBuffer *b = &r->storage_buffers[index];
+    grow_ring(pg, get_ring_index(index),
+              get_ring_usage(r, b) + size + alignment);
+
+    assert(pgraph_vk_buffer_has_space_for(pg, index, size, alignment));
+}
+
+/*
+ * Called once the data of the current frame has been copied to the device
+ * buffer, the space stays in use until the submit completes.
+ */
+void pgraph_vk_end_buffer_frame(PGRAPHState *pg, int index)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    StorageBuffer *b = &r->storage_buffers[index];
+
+    b->submitted_frame_starts[r->submit_count % r->num_frames] =
+        b->frame_start;
+    b->frame_start = b->buffer_offset;
+    b->frame_wrapped = false;
 }
 
 VkDeviceSize pgraph_vk_append_to_buffer(PGRAPHState *pg, int index, void **data,
@@ -188,19 +549,23 @@ VkDeviceSize pgraph_vk_append_to_buffer(PGRAPHState *pg, int index, void **data,
 
     VkDeviceSize total_size = 0;
     for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            total_size = ROUND_UP(total_size, alignment);
+        }
         total_size += sizes[i];
     }
-    assert(pgraph_vk_buffer_has_space_for(pg, index, total_size, alignment));
 
     StorageBuffer *b = &r->storage_buffers[index];
-    VkDeviceSize starting_offset = ROUND_UP(b->buffer_offset, alignment);
+    VkDeviceSize starting_offset =
+        pgraph_vk_allocate_buffer_space(pg, index, total_size, alignment);
 
     assert(b->mapped);
 
+    VkDeviceSize offset = starting_offset;
     for (int i = 0; i < count; i++) {
-        b->buffer_offset = ROUND_UP(b->buffer_offset, alignment);
-        memcpy(b->mapped + b->buffer_offset, data[i], sizes[i]);
-        b->buffer_offset += sizes[i];
+        offset = ROUND_UP(offset, alignment);
+        memcpy(b->mapped + offset, data[i], sizes[i]);
+        offset += sizes[i];
     }
 
     return starting_offset;
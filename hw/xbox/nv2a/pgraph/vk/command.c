@@ -17,6 +17,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "ui/xemu-settings.h"
 #include "renderer.h"
 
 static void create_command_pool(PGRAPHState *pg)
@@ -33,6 +34,12 @@ static void create_command_pool(PGRAPHState *pg)
     };
     VK_CHECK(
         vkCreateCommandPool(r->device, &create_info, NULL, &r->command_pool));
+
+    if (r->transfer_queue) {
+        create_info.queueFamilyIndex = r->transfer_queue_family;
+        VK_CHECK(vkCreateCommandPool(r->device, &create_info, NULL,
+                                     &r->transfer_command_pool));
+    }
 }
 
 static void destroy_command_pool(PGRAPHState *pg)
@@ -40,40 +47,307 @@ static void destroy_command_pool(PGRAPHState *pg)
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     vkDestroyCommandPool(r->device, r->command_pool, NULL);
+    if (r->transfer_queue) {
+        vkDestroyCommandPool(r->device, r->transfer_command_pool, NULL);
+    }
 }
 
 static void create_command_buffers(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
+    VkCommandBuffer command_buffers[2 * NV2A_VK_MAX_FRAMES_IN_FLIGHT];
+
     VkCommandBufferAllocateInfo alloc_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
         .commandPool = r->command_pool,
         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = ARRAY_SIZE(r->command_buffers),
+        .commandBufferCount = 2 * r->num_frames,
     };
     VK_CHECK(
-        vkAllocateCommandBuffers(r->device, &alloc_info, r->command_buffers));
+        vkAllocateCommandBuffers(r->device, &alloc_info, command_buffers));
+
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+    };
+    VkFenceCreateInfo fence_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+
+    for (int i = 0; i < r->num_frames; i++) {
+        CommandBufferFrame *frame = &r->frames[i];
+        frame->command_buffer = command_buffers[2 * i];
+        frame->aux_command_buffer = command_buffers[2 * i + 1];
+        VK_CHECK(vkCreateSemaphore(r->device, &semaphore_info, NULL,
+                                   &frame->semaphore));
+        VK_CHECK(
+            vkCreateFence(r->device, &fence_info, NULL, &frame->fence));
+    }
+
+    if (r->transfer_queue) {
+        VkCommandBuffer transfer_command_buffers[NV2A_VK_MAX_FRAMES_IN_FLIGHT];
+        alloc_info.commandPool = r->transfer_command_pool;
+        alloc_info.commandBufferCount = r->num_frames;
+        VK_CHECK(vkAllocateCommandBuffers(r->device, &alloc_info,
+                                          transfer_command_buffers));
+        for (int i = 0; i < r->num_frames; i++) {
+            CommandBufferFrame *frame = &r->frames[i];
+            frame->transfer_command_buffer = transfer_command_buffers[i];
+            VK_CHECK(vkCreateSemaphore(r->device, &semaphore_info, NULL,
+                                       &frame->transfer_semaphore));
+        }
+    }
 
-    r->command_buffer = r->command_buffers[0];
-    r->aux_command_buffer = r->command_buffers[1];
+    r->timeline_semaphore = VK_NULL_HANDLE;
+    if (r->timeline_semaphore_enabled) {
+        VkSemaphoreTypeCreateInfo type_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0,
+        };
+        VkSemaphoreCreateInfo timeline_semaphore_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &type_info,
+        };
+        VK_CHECK(vkCreateSemaphore(r->device, &timeline_semaphore_info, NULL,
+                                   &r->timeline_semaphore));
+    }
+    r->timeline_value = 0;
+    r->completed_timeline_value = 0;
+
+    r->submit_count = 0;
+    r->completed_submit_count = 0;
+    r->frame = &r->frames[0];
+    r->command_buffer = r->frame->command_buffer;
+    r->aux_command_buffer = r->frame->aux_command_buffer;
 }
 
 static void destroy_command_buffers(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    vkFreeCommandBuffers(r->device, r->command_pool,
-                         ARRAY_SIZE(r->command_buffers), r->command_buffers);
+    assert(r->completed_submit_count == r->submit_count);
+
+    for (int i = 0; i < r->num_frames; i++) {
+        CommandBufferFrame *frame = &r->frames[i];
+        VkCommandBuffer command_buffers[] = { frame->command_buffer,
+                                              frame->aux_command_buffer };
+        vkFreeCommandBuffers(r->device, r->command_pool,
+                             ARRAY_SIZE(command_buffers), command_buffers);
+        vkDestroyFence(r->device, frame->fence, NULL);
+        vkDestroySemaphore(r->device, frame->semaphore, NULL);
+        frame->command_buffer = VK_NULL_HANDLE;
+        frame->aux_command_buffer = VK_NULL_HANDLE;
+
+        if (r->transfer_queue) {
+            vkFreeCommandBuffers(r->device, r->transfer_command_pool, 1,
+                                 &frame->transfer_command_buffer);
+            vkDestroySemaphore(r->device, frame->transfer_semaphore, NULL);
+            frame->transfer_command_buffer = VK_NULL_HANDLE;
+        }
+    }
+
+    if (r->timeline_semaphore) {
+        vkDestroySemaphore(r->device, r->timeline_semaphore, NULL);
+        r->timeline_semaphore = VK_NULL_HANDLE;
+    }
 
+    r->frame = NULL;
     r->command_buffer = VK_NULL_HANDLE;
     r->aux_command_buffer = VK_NULL_HANDLE;
 }
 
-VkCommandBuffer pgraph_vk_begin_single_time_commands(PGRAPHState *pg)
+static void set_completed_timeline_value(PGRAPHVkState *r, uint64_t value)
+{
+    uint64_t completed = qatomic_read(&r->completed_timeline_value);
+    while (completed < value) {
+        uint64_t prev =
+            qatomic_cmpxchg(&r->completed_timeline_value, completed, value);
+        if (prev == completed) {
+            break;
+        }
+        completed = prev;
+    }
+}
+
+static void retire_frame(PGRAPHVkState *r)
+{
+    CommandBufferFrame *frame =
+        &r->frames[r->completed_submit_count % r->num_frames];
+    set_completed_timeline_value(r, frame->timeline_value);
+    pgraph_vk_resolve_gpu_timers(r, &frame->gpu_timers);
+    r->completed_submit_count += 1;
+}
+
+static CommandBufferFrame *get_oldest_pending_frame(PGRAPHVkState *r)
+{
+    if (r->completed_submit_count == r->submit_count) {
+        return NULL;
+    }
+    return &r->frames[r->completed_submit_count % r->num_frames];
+}
+
+static bool check_frame_complete(PGRAPHVkState *r, CommandBufferFrame *frame)
+{
+    if (r->timeline_semaphore) {
+        return pgraph_vk_check_timeline_value(r, frame->timeline_value);
+    }
+    return vkGetFenceStatus(r->device, frame->fence) == VK_SUCCESS;
+}
+
+void pgraph_vk_retire_completed_submits(PGRAPHVkState *r)
+{
+    CommandBufferFrame *frame;
+    while ((frame = get_oldest_pending_frame(r)) != NULL &&
+           check_frame_complete(r, frame)) {
+        retire_frame(r);
+    }
+}
+
+void pgraph_vk_wait_for_submit(PGRAPHVkState *r, uint32_t submit_index)
+{
+    CommandBufferFrame *frame;
+    while (r->completed_submit_count <= submit_index &&
+           (frame = get_oldest_pending_frame(r)) != NULL) {
+        nv2a_profile_inc_counter(NV2A_PROF_FRAME_WAIT);
+        if (r->timeline_semaphore) {
+            pgraph_vk_wait_for_timeline_value(r, frame->timeline_value);
+        } else {
+            VK_CHECK(vkWaitForFences(r->device, 1, &frame->fence, VK_TRUE,
+                                     UINT64_MAX));
+        }
+        retire_frame(r);
+    }
+}
+
+void pgraph_vk_wait_for_all_submits(PGRAPHVkState *r)
+{
+    if (r->submit_count > r->completed_submit_count) {
+        pgraph_vk_wait_for_submit(r, r->submit_count - 1);
+    }
+}
+
+/*
+ * Wait until GPU work recorded at or before draw_time has completed, so that
+ * objects last used at that time may be destroyed. Work in the command buffer
+ * currently being recorded is not covered.
+ */
+void pgraph_vk_wait_for_draw_time(PGRAPHVkState *r, unsigned int draw_time)
+{
+    CommandBufferFrame *frame;
+    while ((frame = get_oldest_pending_frame(r)) != NULL &&
+           frame->start_time <= draw_time) {
+        pgraph_vk_wait_for_submit(r, r->completed_submit_count);
+    }
+}
+
+/*
+ * Make the graphics queue submit described by submit_info signal the next
+ * timeline value, which is stored to value. value and timeline_info must
+ * remain valid until the submit.
+ */
+void pgraph_vk_signal_timeline(PGRAPHVkState *r, VkSubmitInfo *submit_info,
+                               VkTimelineSemaphoreSubmitInfo *timeline_info,
+                               uint64_t *value)
+{
+    *value = ++r->timeline_value;
+
+    if (!r->timeline_semaphore) {
+        return;
+    }
+
+    assert(submit_info->signalSemaphoreCount == 0);
+    *timeline_info = (VkTimelineSemaphoreSubmitInfo){
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .pNext = submit_info->pNext,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = value,
+    };
+    submit_info->pNext = timeline_info;
+    submit_info->signalSemaphoreCount = 1;
+    submit_info->pSignalSemaphores = &r->timeline_semaphore;
+}
+
+/*
+ * Check whether the GPU has completed the submit that signals value, without
+ * waiting. With timeline semaphore support this may be called from any thread.
+ */
+bool pgraph_vk_check_timeline_value(PGRAPHVkState *r, uint64_t value)
+{
+    if (value <= qatomic_read(&r->completed_timeline_value)) {
+        return true;
+    }
+    if (!r->timeline_semaphore) {
+        return false;
+    }
+
+    uint64_t completed;
+    VK_CHECK(vkGetSemaphoreCounterValue(r->device, r->timeline_semaphore,
+                                        &completed));
+    set_completed_timeline_value(r, completed);
+
+    return value <= completed;
+}
+
+/*
+ * Wait for the GPU to complete the submit that signals value, and everything
+ * submitted to the graphics queue before it. Unlike waiting for the queue to
+ * go idle, work submitted later keeps running. With timeline semaphore
+ * support this may be called from any thread, e.g. from CPU access callbacks,
+ * otherwise only from the PGRAPH thread.
+ */
+void pgraph_vk_wait_for_timeline_value(PGRAPHVkState *r, uint64_t value)
+{
+    if (value <= qatomic_read(&r->completed_timeline_value)) {
+        return;
+    }
+
+    if (r->timeline_semaphore) {
+        VkSemaphoreWaitInfo wait_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &r->timeline_semaphore,
+            .pValues = &value,
+        };
+        nv2a_profile_inc_counter(NV2A_PROF_TIMELINE_WAIT);
+        VK_CHECK(vkWaitSemaphores(r->device, &wait_info, UINT64_MAX));
+        set_completed_timeline_value(r, value);
+        return;
+    }
+
+    CommandBufferFrame *frame;
+    while (qatomic_read(&r->completed_timeline_value) < value &&
+           (frame = get_oldest_pending_frame(r)) != NULL) {
+        pgraph_vk_wait_for_submit(r, r->completed_submit_count);
+    }
+    assert(qatomic_read(&r->completed_timeline_value) >= value);
+}
+
+/*
+ * Move recording on to the next frame of the ring once the current one has
+ * been submitted, waiting for the GPU to release it if it is still in use.
+ */
+void pgraph_vk_advance_frame(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
+    assert(!r->in_command_buffer);
+    assert(!r->in_aux_command_buffer);
+
+    if (r->submit_count - r->completed_submit_count >= r->num_frames) {
+        pgraph_vk_wait_for_submit(r, r->submit_count - r->num_frames);
+    }
+
+    int frame_index = r->submit_count % r->num_frames;
+    r->frame = &r->frames[frame_index];
+    r->command_buffer = r->frame->command_buffer;
+    r->aux_command_buffer = r->frame->aux_command_buffer;
+    bitmap_clear(r->frame->vertex_ram_bitmap, 0, r->bitmap_size);
+    pgraph_vk_recorder_reset_frame(r, frame_index);
+}
+
+static VkCommandBuffer begin_aux_command_buffer(PGRAPHVkState *r)
+{
     assert(!r->in_aux_command_buffer);
     r->in_aux_command_buffer = true;
 
@@ -86,28 +360,138 @@ VkCommandBuffer pgraph_vk_begin_single_time_commands(PGRAPHState *pg)
     return r->aux_command_buffer;
 }
 
+/*
+ * Records into the aux command buffer of the current frame, which is submitted
+ * ahead of the main command buffer when the frame is finished.
+ */
+VkCommandBuffer pgraph_vk_begin_aux_commands(PGRAPHState *pg)
+{
+    return begin_aux_command_buffer(pg->vk_renderer_state);
+}
+
+/*
+ * Records into the transfer command buffer of the current frame. It is
+ * submitted to the transfer queue ahead of the next graphics queue submit,
+ * which waits for it, so uploads recorded here overlap with the frames still
+ * executing. Only available with a dedicated transfer queue.
+ */
+VkCommandBuffer pgraph_vk_begin_transfer_commands(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    assert(r->transfer_queue);
+
+    // Keep the uploads part of a frame, which reclaims their staging space
+    pgraph_vk_ensure_command_buffer(pg);
+
+    VkCommandBuffer cmd = r->frame->transfer_command_buffer;
+    if (!r->in_transfer_command_buffer) {
+        VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        VK_CHECK(vkBeginCommandBuffer(cmd, &begin_info));
+        r->in_transfer_command_buffer = true;
+    }
+
+    return cmd;
+}
+
+/*
+ * Submit recorded uploads, if any. Returns the semaphore the next graphics
+ * queue submit must wait on, or VK_NULL_HANDLE.
+ */
+VkSemaphore pgraph_vk_submit_transfer_commands(PGRAPHVkState *r)
+{
+    if (!r->in_transfer_command_buffer) {
+        return VK_NULL_HANDLE;
+    }
+
+    CommandBufferFrame *frame = r->frame;
+    VK_CHECK(vkEndCommandBuffer(frame->transfer_command_buffer));
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &frame->transfer_command_buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &frame->transfer_semaphore,
+    };
+    VK_CHECK(vkQueueSubmit(r->transfer_queue, 1, &submit_info, VK_NULL_HANDLE));
+    nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_TRANSFER);
+    r->in_transfer_command_buffer = false;
+
+    return frame->transfer_semaphore;
+}
+
+VkCommandBuffer pgraph_vk_begin_single_time_commands(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    /*
+     * Single time commands may update resources used by submitted frames.
+     * Their barriers order them after the frames on the GPU, but without a
+     * timeline semaphore the queue is waited idle on completion, so wait for
+     * the frames first to keep them retiring in order.
+     */
+    if (!r->timeline_semaphore) {
+        pgraph_vk_wait_for_all_submits(r);
+    }
+
+    VkCommandBuffer cmd = begin_aux_command_buffer(r);
+    pgraph_vk_begin_command_buffer_timer(r, cmd);
+
+    return cmd;
+}
+
 void pgraph_vk_end_single_time_commands(PGRAPHState *pg, VkCommandBuffer cmd)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     assert(r->in_aux_command_buffer);
 
+    pgraph_vk_end_command_buffer_timer(r, cmd,
+                                       NV2A_PROF_GPU_SUBMIT_SINGLE_TIME);
     VK_CHECK(vkEndCommandBuffer(cmd));
 
+    // Commands may operate on resources of uploads recorded before them
+    VkSemaphore transfer_semaphore = pgraph_vk_submit_transfer_commands(r);
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
     VkSubmitInfo submit_info = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
         .commandBufferCount = 1,
         .pCommandBuffers = &cmd,
+        .waitSemaphoreCount = transfer_semaphore ? 1 : 0,
+        .pWaitSemaphores = &transfer_semaphore,
+        .pWaitDstStageMask = &wait_stage,
     };
+    VkTimelineSemaphoreSubmitInfo timeline_info;
+    uint64_t value;
+    pgraph_vk_signal_timeline(r, &submit_info, &timeline_info, &value);
     VK_CHECK(vkQueueSubmit(r->queue, 1, &submit_info, VK_NULL_HANDLE));
     nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_AUX);
-    VK_CHECK(vkQueueWaitIdle(r->queue));
+
+    // Callers reuse staging buffers and read back results right away
+    if (r->timeline_semaphore) {
+        pgraph_vk_wait_for_timeline_value(r, value);
+        pgraph_vk_retire_completed_submits(r);
+    } else {
+        VK_CHECK(vkQueueWaitIdle(r->queue));
+        set_completed_timeline_value(r, value);
+    }
+    pgraph_vk_resolve_gpu_timers(r, &r->single_time_gpu_timers);
 
     r->in_aux_command_buffer = false;
 }
 
 void pgraph_vk_init_command_buffers(PGRAPHState *pg)
 {
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    r->num_frames = MAX(1, MIN(g_config.display.vulkan.frames_in_flight,
+                               NV2A_VK_MAX_FRAMES_IN_FLIGHT));
+
     create_command_pool(pg);
     create_command_buffers(pg);
 }
@@ -70,10 +70,22 @@ void pgraph_vk_debug_frame_terminator(void)
 #endif
 }
 
+/*
+ * Labels may not be recorded into the primary command buffer inside a render
+ * pass whose contents come from secondary command buffers. Rather than
+ * tracking which labels would straddle such a pass, they are dropped from the
+ * main command buffer entirely while recording on worker threads.
+ */
+static bool debug_markers_enabled(PGRAPHVkState *r, VkCommandBuffer cmd)
+{
+    return r->debug_utils_extension_enabled &&
+           !(r->recorder && cmd == r->command_buffer);
+}
+
 void pgraph_vk_insert_debug_marker(PGRAPHVkState *r, VkCommandBuffer cmd,
                                    float color[4], const char *format, ...)
 {
-    if (!r->debug_utils_extension_enabled) {
+    if (!debug_markers_enabled(r, cmd)) {
         return;
     }
 
@@ -97,7 +109,7 @@ void pgraph_vk_insert_debug_marker(PGRAPHVkState *r, VkCommandBuffer cmd,
 void pgraph_vk_begin_debug_marker(PGRAPHVkState *r, VkCommandBuffer cmd,
                                   float color[4], const char *format, ...)
 {
-    if (!r->debug_utils_extension_enabled) {
+    if (!debug_markers_enabled(r, cmd)) {
         return;
     }
 
@@ -123,7 +135,7 @@ void pgraph_vk_begin_debug_marker(PGRAPHVkState *r, VkCommandBuffer cmd,
 
 void pgraph_vk_end_debug_marker(PGRAPHVkState *r, VkCommandBuffer cmd)
 {
-    if (!r->debug_utils_extension_enabled) {
+    if (!debug_markers_enabled(r, cmd)) {
         return;
     }
 
@@ -20,25 +20,6 @@
 #include "renderer.h"
 #include <math.h>
 
-static uint8_t *convert_texture_data__CR8YB8CB8YA8(uint8_t *data_out,
-                                                   const uint8_t *data_in,
-                                                   unsigned int width,
-                                                   unsigned int height,
-                                                   unsigned int pitch)
-{
-    int x, y;
-    for (y = 0; y < height; y++) {
-        const uint8_t *line = &data_in[y * pitch];
-        const uint32_t row_offset = y * width;
-        for (x = 0; x < width; x++) {
-            uint8_t *pixel = &data_out[(row_offset + x) * 4];
-            convert_yuy2_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
-            pixel[3] = 255;
-        }
-    }
-    return data_out;
-}
-
 static float pvideo_calculate_scale(unsigned int din_dout,
                                     unsigned int output_size)
 {
@@ -118,11 +99,11 @@ static void create_pvideo_image(PGRAPHState *pg, int width, int height)
 
     VkSamplerCreateInfo sampler_create_info = {
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-        .magFilter = VK_FILTER_LINEAR,
+        .magFilter = VK_FILTER_NEAREST,
         .minFilter = VK_FILTER_NEAREST,
-        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
         .borderColor = VK_BORDER_COLOR_INT_OPAQUE_WHITE,
         .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
     };
@@ -136,7 +117,12 @@ static void upload_pvideo_image(PGRAPHState *pg, PvideoState state)
     PGRAPHVkState *r = pg->vk_renderer_state;
     PGRAPHVkDisplayState *disp = &r->display;
 
-    create_pvideo_image(pg, state.in_width, state.in_height);
+    /*
+     * The YUY2 data is uploaded as is, one RGBA texel per pair of pixels, and
+     * converted and filtered by the display shader.
+     */
+    unsigned int pairs_width = (state.in_width + 1) / 2;
+    create_pvideo_image(pg, pairs_width, state.in_height);
 
     // FIXME: Dirty tracking. We don't necessarily need to upload so much.
 
@@ -147,9 +133,11 @@ static void upload_pvideo_image(PGRAPHState *pg, PvideoState state)
                           r->storage_buffers[BUFFER_STAGING_SRC].allocation,
                           (void *)&mapped_memory_ptr));
 
-    convert_texture_data__CR8YB8CB8YA8(
-        mapped_memory_ptr, d->vram_ptr + state.base + state.offset,
-        state.in_width, state.in_height, state.pitch);
+    const uint8_t *data = d->vram_ptr + state.base + state.offset;
+    for (int y = 0; y < state.in_height; y++) {
+        memcpy(&mapped_memory_ptr[y * pairs_width * 4], &data[y * state.pitch],
+               pairs_width * 4);
+    }
 
     vmaFlushAllocation(r->allocator,
                        r->storage_buffers[BUFFER_STAGING_SRC].allocation, 0,
@@ -188,7 +176,7 @@ static void upload_pvideo_image(PGRAPHState *pg, PvideoState state)
         .imageSubresource.baseArrayLayer = 0,
         .imageSubresource.layerCount = 1,
         .imageOffset = (VkOffset3D){ 0, 0, 0 },
-        .imageExtent = (VkExtent3D){ state.in_width, state.in_height, 1 },
+        .imageExtent = (VkExtent3D){ pairs_width, state.in_height, 1 },
     };
     vkCmdCopyBufferToImage(cmd, r->storage_buffers[BUFFER_STAGING_SRC].buffer,
                            disp->pvideo.image,
@@ -216,6 +204,34 @@ static const char *display_frag_glsl =
     "    vec3 pvideo_color_key;\n"
     "};\n"
     "layout(location = 0) out vec4 out_Color;\n"
+    // pvideo_tex holds packed Y0 U Y1 V pixel pairs, one per texel
+    "vec3 pvideo_yuv_to_rgb(float y, float u, float v)\n"
+    "{\n"
+    "    float c = y * 255.0 - 16.0;\n"
+    "    float d = u * 255.0 - 128.0;\n"
+    "    float e = v * 255.0 - 128.0;\n"
+    "    vec3 rgb = floor((vec3(298.0 * c + 409.0 * e,\n"
+    "                           298.0 * c - 100.0 * d - 208.0 * e,\n"
+    "                           298.0 * c + 516.0 * d) + 128.0) / 256.0);\n"
+    "    return clamp(rgb, 0.0, 255.0) / 255.0;\n"
+    "}\n"
+    "vec4 pvideo_texel(ivec2 p)\n"
+    "{\n"
+    "    ivec2 size = textureSize(pvideo_tex, 0) * ivec2(2, 1);\n"
+    "    p = clamp(p, ivec2(0), size - 1);\n"
+    "    vec4 pair = texelFetch(pvideo_tex, ivec2(p.x >> 1, p.y), 0);\n"
+    "    float y = (p.x & 1) != 0 ? pair.b : pair.r;\n"
+    "    return vec4(pvideo_yuv_to_rgb(y, pair.g, pair.a), 1.0);\n"
+    "}\n"
+    "vec4 pvideo_sample(vec2 pos)\n"
+    "{\n"
+    "    pos -= 0.5;\n"
+    "    ivec2 p = ivec2(floor(pos));\n"
+    "    vec2 f = fract(pos);\n"
+    "    return mix(mix(pvideo_texel(p), pvideo_texel(p + ivec2(1, 0)), f.x),\n"
+    "               mix(pvideo_texel(p + ivec2(0, 1)), pvideo_texel(p + ivec2(1, 1)), f.x),\n"
+    "               f.y);\n"
+    "}\n"
     "void main()\n"
     "{\n"
     "    vec2 tex_coord = gl_FragCoord.xy/display_size;\n"
@@ -230,8 +246,7 @@ static const char *display_frag_glsl =
     "                           greaterThan(screen_coord, output_region.zw));\n"
     "        if (!any(clip) && (!pvideo_color_key_enable || out_Color.rgb == pvideo_color_key)) {\n"
     "            vec2 out_xy = screen_coord - pvideo_pos.xy;\n"
-    "            vec2 in_st = (pvideo_in_pos + out_xy * pvideo_scale.xy) / textureSize(pvideo_tex, 0);\n"
-    "            out_Color.rgba = texture(pvideo_tex, in_st);\n"
+    "            out_Color.rgba = pvideo_sample(pvideo_in_pos + out_xy * pvideo_scale.xy);\n"
     "        }\n"
     "    }\n"
     "}\n";
@@ -369,6 +384,12 @@ static void destroy_render_pass(PGRAPHState *pg)
     r->display.render_pass = VK_NULL_HANDLE;
 }
 
+void pgraph_vk_compile_display_shaders_ahead(PGRAPHVkState *r)
+{
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_FRAGMENT_BIT,
+                            display_frag_glsl);
+}
+
 static void create_display_pipeline(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -541,7 +562,6 @@ static void destroy_current_display_image(PGRAPHState *pg)
 
     destroy_frame_buffer(pg);
 
-#if HAVE_EXTERNAL_MEMORY
     glDeleteTextures(1, &d->gl_texture_id);
     d->gl_texture_id = 0;
 
@@ -551,7 +571,6 @@ static void destroy_current_display_image(PGRAPHState *pg)
 #ifdef WIN32
     CloseHandle(d->handle);
     d->handle = 0;
-#endif
 #endif
 
     vkDestroyImageView(r->device, d->image_view, NULL);
@@ -581,7 +600,6 @@ static void create_display_image(PGRAPHState *pg, int width, int height)
     const GLint gl_internal_format = GL_RGBA8;
     bool use_optimal_tiling = true;
 
-#if HAVE_EXTERNAL_MEMORY
     GLint num_tiling_types;
     glGetInternalformativ(GL_TEXTURE_2D, gl_internal_format,
                           GL_NUM_TILING_TYPES_EXT, 1, &num_tiling_types);
@@ -598,7 +616,6 @@ static void create_display_image(PGRAPHState *pg, int width, int height)
             break;
         }
     }
-#endif
 
     // Create image
     VkImageCreateInfo image_create_info = {
@@ -669,8 +686,6 @@ static void create_display_image(PGRAPHState *pg, int width, int height)
     VK_CHECK(vkCreateImageView(r->device, &image_view_create_info, NULL,
                                &d->image_view));
 
-#if HAVE_EXTERNAL_MEMORY
-
 #ifdef WIN32
 
     VkMemoryGetWin32HandleInfoKHR handle_info = {
@@ -713,8 +728,6 @@ static void create_display_image(PGRAPHState *pg, int width, int height)
                          image_create_info.extent.height, d->gl_memory_obj, 0);
     assert(glGetError() == GL_NO_ERROR);
 
-#endif // HAVE_EXTERNAL_MEMORY
-
     d->width = image_create_info.extent.width;
     d->height = image_create_info.extent.height;
 
@@ -891,7 +904,7 @@ static void update_uniforms(PGRAPHState *pg, SurfaceBinding *surface)
         uniform4f(l, uniform_index(l, "pvideo_pos"), pvideo->out_x,
                   pvideo->out_y, pvideo->out_width, pvideo->out_height);
         uniform4f(l, uniform_index(l, "pvideo_scale"), pvideo->scale_x,
-                  pvideo->scale_y, 1.0f / pg->surface_scale_factor, 1.0);
+                  pvideo->scale_y, 1.0f / r->surface_scale_factor, 1.0);
     }
 }
 
@@ -901,13 +914,20 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
     PGRAPHVkState *r = pg->vk_renderer_state;
     PGRAPHVkDisplayState *disp = &r->display;
 
-    if (r->in_command_buffer &&
-        surface->draw_time >= r->command_buffer_start_time) {
+    /*
+     * The display is rendered at the end of the frame command buffer, so that
+     * GL waits for it on the GPU through present_semaphore instead of the
+     * PGRAPH thread waiting for the queue to go idle.
+     */
+    if (r->in_command_buffer) {
         pgraph_vk_finish(pg, VK_FINISH_REASON_PRESENTING);
     }
 
     pgraph_vk_upload_surface_data(d, surface, !tcg_enabled());
 
+    // Descriptor set and pvideo image may still be in use by the last render
+    pgraph_vk_wait_for_timeline_value(r, disp->timeline_value);
+
     disp->pvideo.state = get_pvideo_state(pg);
     if (disp->pvideo.state.enabled) {
         upload_pvideo_image(pg, disp->pvideo.state);
@@ -916,7 +936,8 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
     update_uniforms(pg, surface);
     update_descriptor_set(pg, surface);
 
-    VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg);
+    pgraph_vk_ensure_command_buffer(pg);
+    VkCommandBuffer cmd = r->command_buffer;
     pgraph_vk_begin_debug_marker(r, cmd, RGBA_YELLOW,
         "Display Surface %08"HWADDR_PRIx, surface->vram_addr);
 
@@ -935,6 +956,7 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
         .renderArea.extent.width = disp->width,
         .renderArea.extent.height = disp->height,
     };
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_DISPLAY);
     vkCmdBeginRenderPass(cmd, &render_pass_begin_info,
                          VK_SUBPASS_CONTENTS_INLINE);
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -965,6 +987,7 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
     vkCmdDraw(cmd, 3, 1, 0, 0);
 
     vkCmdEndRenderPass(cmd);
+    pgraph_vk_end_gpu_timer(r, cmd);
 
 #if 0
     VkImageCopy region = {
@@ -976,8 +999,8 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
         .extent.height = surface->height,
         .extent.depth = 1,
     };
-    pgraph_apply_scaling_factor(pg, &region.extent.width,
-                                &region.extent.height);
+    pgraph_vk_apply_surface_scale_factor(surface, &region.extent.width,
+                                         &region.extent.height);
 
     vkCmdCopyImage(cmd, surface->image,
                    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, disp->image,
@@ -995,12 +1018,140 @@ static void render_display(PGRAPHState *pg, SurfaceBinding *surface)
                                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
     pgraph_vk_end_debug_marker(r, cmd);
-    pgraph_vk_end_single_time_commands(pg, cmd);
-    nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_5);
+
+    disp->present_pending = true;
+    pgraph_vk_finish(pg, VK_FINISH_REASON_PRESENTING);
+    disp->timeline_value = r->timeline_value;
 
     disp->draw_time = surface->draw_time;
 }
 
+static void create_present_semaphore(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    PGRAPHVkDisplayState *d = &r->display;
+
+    VkExportSemaphoreCreateInfo export_semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+        .handleTypes =
+#ifdef WIN32
+            VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_WIN32_BIT
+#else
+            VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT
+#endif
+            ,
+    };
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &export_semaphore_create_info,
+    };
+    VK_CHECK(vkCreateSemaphore(r->device, &semaphore_create_info, NULL,
+                               &d->present_semaphore));
+
+    glGenSemaphoresEXT(1, &d->gl_semaphore);
+
+#ifdef WIN32
+
+    VkSemaphoreGetWin32HandleInfoKHR handle_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_WIN32_HANDLE_INFO_KHR,
+        .semaphore = d->present_semaphore,
+        .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_WIN32_BIT,
+    };
+    VK_CHECK(vkGetSemaphoreWin32HandleKHR(r->device, &handle_info,
+                                          &d->semaphore_handle));
+    glImportSemaphoreWin32HandleEXT(d->gl_semaphore,
+                                    GL_HANDLE_TYPE_OPAQUE_WIN32_EXT,
+                                    d->semaphore_handle);
+
+#else
+
+    // Ownership of the fd is transferred to GL
+    int fd;
+    VkSemaphoreGetFdInfoKHR fd_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+        .semaphore = d->present_semaphore,
+        .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT,
+    };
+    VK_CHECK(vkGetSemaphoreFdKHR(r->device, &fd_info, &fd));
+    glImportSemaphoreFdEXT(d->gl_semaphore, GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
+
+#endif // WIN32
+
+    assert(glIsSemaphoreEXT(d->gl_semaphore));
+    assert(glGetError() == GL_NO_ERROR);
+}
+
+static void destroy_present_semaphore(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    PGRAPHVkDisplayState *d = &r->display;
+
+    glDeleteSemaphoresEXT(1, &d->gl_semaphore);
+    d->gl_semaphore = 0;
+
+#ifdef WIN32
+    CloseHandle(d->semaphore_handle);
+    d->semaphore_handle = 0;
+#endif
+
+    vkDestroySemaphore(r->device, d->present_semaphore, NULL);
+    d->present_semaphore = VK_NULL_HANDLE;
+}
+
+/*
+ * Add present_semaphore to the signal operations of the submit described by
+ * submit_info if the display was rendered into its command buffer. semaphores
+ * and values must remain valid until the submit.
+ */
+void pgraph_vk_signal_present(PGRAPHVkState *r, VkSubmitInfo *submit_info,
+                              VkTimelineSemaphoreSubmitInfo *timeline_info,
+                              VkSemaphore semaphores[2], uint64_t values[2])
+{
+    PGRAPHVkDisplayState *d = &r->display;
+
+    if (!d->present_pending) {
+        return;
+    }
+
+    // Only the timeline semaphore may already be signaled
+    uint32_t n = submit_info->signalSemaphoreCount;
+    assert(n <= 1);
+    if (n) {
+        semaphores[0] = submit_info->pSignalSemaphores[0];
+        values[0] = timeline_info->pSignalSemaphoreValues[0];
+        timeline_info->signalSemaphoreValueCount = 2;
+        timeline_info->pSignalSemaphoreValues = values;
+    }
+    semaphores[n] = d->present_semaphore;
+    values[n] = 0; // Ignored for binary semaphores
+
+    submit_info->signalSemaphoreCount = n + 1;
+    submit_info->pSignalSemaphores = semaphores;
+
+    d->present_pending = false;
+    d->present_signaled = true;
+}
+
+/*
+ * Called by the frontend, with its GL context current, once the display has
+ * been synced. Makes GL wait for the display image to be rendered before it
+ * is sampled and returns the texture to sample it from.
+ */
+GLuint pgraph_vk_wait_for_present(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    PGRAPHVkDisplayState *d = &r->display;
+
+    if (d->present_signaled) {
+        GLenum layout = GL_LAYOUT_SHADER_READ_ONLY_EXT;
+        glWaitSemaphoreEXT(d->gl_semaphore, 0, NULL, 1, &d->gl_texture_id,
+                           &layout);
+        d->present_signaled = false;
+    }
+
+    return d->gl_texture_id;
+}
+
 static void create_surface_sampler(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -1040,6 +1191,7 @@ void pgraph_vk_init_display(PGRAPHState *pg)
     create_render_pass(pg);
     create_display_pipeline(pg);
     create_surface_sampler(pg);
+    create_present_semaphore(pg);
 }
 
 void pgraph_vk_finalize_display(PGRAPHState *pg)
@@ -1048,6 +1200,8 @@ void pgraph_vk_finalize_display(PGRAPHState *pg)
 
     destroy_pvideo_image(pg);
 
+    destroy_present_semaphore(pg);
+
     if (r->display.image != VK_NULL_HANDLE) {
         destroy_current_display_image(pg);
     }
@@ -1082,12 +1236,15 @@ void pgraph_vk_render_display(PGRAPHState *pg)
         height *= 2;
     }
 
-    pgraph_apply_scaling_factor(pg, &width, &height);
+    // Independent of the scale of the surface, which may not be scaled yet
+    width *= r->surface_scale_factor;
+    height *= r->surface_scale_factor;
 
     PGRAPHVkDisplayState *disp = &r->display;
     if (!disp->image || disp->width != width || disp->height != height) {
         create_display_image(pg, width, height);
     }
 
+    pgraph_vk_record_display_surface(r, surface);
     render_display(pg, surface);
 }
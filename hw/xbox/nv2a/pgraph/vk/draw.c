@@ -19,6 +19,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/fast-hash.h"
+#include "qemu/timeline.h"
+#include "xemu-version.h"
+#include "ui/xemu-settings.h"
 #include "renderer.h"
 #include <math.h>
 
@@ -47,12 +50,13 @@ void pgraph_vk_draw_begin(NV2AState *d)
     }
 }
 
-static VkPrimitiveTopology get_primitive_topology(PGRAPHState *pg)
-{
-    PGRAPHVkState *r = pg->vk_renderer_state;
+static void start_pipeline_precompile(PGRAPHVkState *r);
+static void stop_pipeline_precompile(PGRAPHVkState *r);
 
-    int polygon_mode = r->shader_binding->state.geom.polygon_front_mode;
-    int primitive_mode = r->shader_binding->state.geom.primitive_mode;
+static VkPrimitiveTopology get_primitive_topology(const GeomState *state)
+{
+    int polygon_mode = state->polygon_front_mode;
+    int primitive_mode = state->primitive_mode;
 
     // FIXME: Replace with LUT
     switch (primitive_mode) {
@@ -107,6 +111,9 @@ static void pipeline_cache_entry_post_evict(Lru *lru, LruNode *node)
             snode->draw_time < r->command_buffer_start_time) &&
            "Pipeline evicted while in use!");
 
+    // May still be referenced by a submitted frame
+    pgraph_vk_wait_for_draw_time(r, snode->draw_time);
+
     vkDestroyPipeline(r->device, snode->pipeline, NULL);
     snode->pipeline = VK_NULL_HANDLE;
 
@@ -121,6 +128,294 @@ static bool pipeline_cache_entry_compare(Lru *lru, LruNode *node,
     return memcmp(&snode->key, key, sizeof(PipelineKey));
 }
 
+/*
+ * The driver pipeline cache is saved on exit along with the keys of the
+ * pipelines that were in use, so they can be rebuilt on the next boot. Both
+ * are only valid for the same xemu build and device.
+ */
+#define PIPELINE_CACHE_FILE_MAGIC "XVKPCACH"
+#define PIPELINE_CACHE_FILE_VERSION 2
+
+typedef struct PipelineCacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    char xemu_version[64];
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+    uint64_t num_keys;
+} PipelineCacheFileHeader;
+
+#define PIPELINE_CACHE_SIZE 2048
+
+static char *get_pipeline_cache_path(void)
+{
+    return g_build_filename(xemu_settings_get_cache_path(), "vk_pipeline_cache",
+                            NULL);
+}
+
+static void init_pipeline_cache_file_header(PGRAPHVkState *r,
+                                            PipelineCacheFileHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, PIPELINE_CACHE_FILE_MAGIC, sizeof(header->magic));
+    header->version = PIPELINE_CACHE_FILE_VERSION;
+    header->key_size = sizeof(PipelineKey);
+    g_strlcpy(header->xemu_version, xemu_version,
+              sizeof(header->xemu_version));
+    header->vendor_id = r->device_props.vendorID;
+    header->device_id = r->device_props.deviceID;
+    header->driver_version = r->device_props.driverVersion;
+    memcpy(header->pipeline_cache_uuid, r->device_props.pipelineCacheUUID,
+           VK_UUID_SIZE);
+}
+
+/*
+ * Returns the header of the cache file at @path if it was saved for this
+ * device and is consistent, with the file in *@contents to be freed.
+ */
+static PipelineCacheFileHeader *check_pipeline_cache_file(PGRAPHVkState *r,
+                                                          gchar **contents,
+                                                          gsize length)
+{
+    PipelineCacheFileHeader expected, *header = (void *)*contents;
+    init_pipeline_cache_file_header(r, &expected);
+    if (length >= sizeof(*header)) {
+        expected.data_size = header->data_size;
+        expected.num_keys = header->num_keys;
+    }
+
+    if (length < sizeof(*header) ||
+        memcmp(header, &expected, sizeof(expected)) ||
+        header->data_size > length - sizeof(*header) ||
+        header->num_keys > (length - sizeof(*header) - header->data_size) /
+                               sizeof(PipelineKey)) {
+        NV2A_VK_DPRINTF("Discarding stale pipeline cache");
+        g_free(*contents);
+        *contents = NULL;
+        return NULL;
+    }
+
+    return header;
+}
+
+static PipelineCacheFileHeader *read_pipeline_cache_file(PGRAPHVkState *r,
+                                                         const char *path,
+                                                         gchar **contents)
+{
+    gsize length;
+    if (!g_file_get_contents(path, contents, &length, NULL)) {
+        *contents = NULL;
+        return NULL;
+    }
+
+    return check_pipeline_cache_file(r, contents, length);
+}
+
+/* Called on the init ahead thread, before the device is known */
+void pgraph_vk_read_pipeline_cache_ahead(PGRAPHVkState *r)
+{
+    if (!g_config.perf.cache_shaders) {
+        return;
+    }
+
+    g_autofree char *path = get_pipeline_cache_path();
+    if (!g_file_get_contents(path, &r->init_ahead.pipeline_cache,
+                             &r->init_ahead.pipeline_cache_size, NULL)) {
+        r->init_ahead.pipeline_cache = NULL;
+    }
+}
+
+static void load_pipeline_cache_from_disk(PGRAPHVkState *r,
+                                          VkPipelineCacheCreateInfo *cache_info,
+                                          gchar **contents)
+{
+    PipelineCacheFileHeader *header;
+
+    *contents = NULL;
+
+    if (!g_config.perf.cache_shaders) {
+        return;
+    }
+
+    if (r->init_ahead.pipeline_cache) {
+        *contents = g_steal_pointer(&r->init_ahead.pipeline_cache);
+        header = check_pipeline_cache_file(r, contents,
+                                           r->init_ahead.pipeline_cache_size);
+    } else {
+        g_autofree char *path = get_pipeline_cache_path();
+        header = read_pipeline_cache_file(r, path, contents);
+    }
+    if (!header) {
+        return;
+    }
+
+    uint8_t *data = (uint8_t *)(header + 1);
+    cache_info->initialDataSize = header->data_size;
+    cache_info->pInitialData = data;
+
+    r->num_saved_pipeline_keys = header->num_keys;
+    r->saved_pipeline_keys = g_memdup2(data + header->data_size,
+                                       header->num_keys * sizeof(PipelineKey));
+}
+
+/*
+ * Serializes saving among instances of xemu sharing the cache path, returns
+ * the fd holding the lock or -1.
+ */
+static int lock_pipeline_cache(const char *path)
+{
+#ifndef _WIN32
+    g_autofree char *lock_path = g_strconcat(path, ".lock", NULL);
+    int fd = qemu_open_old(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        if (!qemu_lock_fd(fd, 0, 1, true)) {
+            return fd;
+        }
+        g_usleep(10000);
+    }
+    qemu_close(fd);
+#endif
+    return -1;
+}
+
+static void unlock_pipeline_cache(int fd)
+{
+    if (fd >= 0) {
+        qemu_close(fd);
+    }
+}
+
+static guint pipeline_key_hash(gconstpointer key)
+{
+    return fast_hash(key, sizeof(PipelineKey));
+}
+
+static gboolean pipeline_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(PipelineKey));
+}
+
+/*
+ * Merges in what other instances sharing the cache saved since this one
+ * loaded it, so that the last one to exit does not drop their pipelines.
+ * Returns the header of the file, or NULL if there is none to merge.
+ */
+static PipelineCacheFileHeader *merge_pipeline_cache_from_disk(
+    PGRAPHVkState *r, const char *path, gchar **contents)
+{
+    PipelineCacheFileHeader *header =
+        read_pipeline_cache_file(r, path, contents);
+    if (!header) {
+        return NULL;
+    }
+
+    VkPipelineCacheCreateInfo cache_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = header->data_size,
+        .pInitialData = header + 1,
+    };
+    VkPipelineCache disk_cache;
+    if (vkCreatePipelineCache(r->device, &cache_info, NULL, &disk_cache) ==
+        VK_SUCCESS) {
+        vkMergePipelineCaches(r->device, r->vk_pipeline_cache, 1,
+                              &disk_cache);
+        vkDestroyPipelineCache(r->device, disk_cache, NULL);
+    }
+
+    return header;
+}
+
+static void save_pipeline_cache_to_disk(PGRAPHVkState *r)
+{
+    if (!g_config.perf.cache_shaders) {
+        return;
+    }
+
+    g_autofree char *path = get_pipeline_cache_path();
+    int lock_fd = lock_pipeline_cache(path);
+    g_autofree gchar *disk_contents = NULL;
+    PipelineCacheFileHeader *disk_header =
+        merge_pipeline_cache_from_disk(r, path, &disk_contents);
+    size_t num_disk_keys = disk_header ? disk_header->num_keys : 0;
+
+    size_t data_size = 0;
+    VK_CHECK(vkGetPipelineCacheData(r->device, r->vk_pipeline_cache,
+                                    &data_size, NULL));
+
+    PipelineCacheFileHeader header;
+    init_pipeline_cache_file_header(r, &header);
+
+    size_t keys_offset = sizeof(header) + data_size;
+    size_t max_keys = MIN(r->pipeline_cache.num_used + num_disk_keys,
+                          PIPELINE_CACHE_SIZE);
+    size_t max_size = keys_offset + max_keys * sizeof(PipelineKey);
+    g_autofree uint8_t *contents = g_malloc(max_size);
+
+    VkResult result = vkGetPipelineCacheData(
+        r->device, r->vk_pipeline_cache, &data_size, contents + sizeof(header));
+    if (result != VK_SUCCESS) {
+        unlock_pipeline_cache(lock_fd);
+        return;
+    }
+    header.data_size = data_size;
+    keys_offset = sizeof(header) + data_size;
+
+    /* Most recently used first, so they can be rebuilt in the same order */
+    PipelineKey *keys = (PipelineKey *)(contents + keys_offset);
+    LruNode *node;
+    QTAILQ_FOREACH(node, &r->pipeline_cache.global, next_global) {
+        if (!lru_is_node_in_use(&r->pipeline_cache, node)) {
+            continue;
+        }
+        PipelineBinding *snode = container_of(node, PipelineBinding, node);
+        if (snode->key.uber_psh) {
+            /* Only needed until the specialized shader is compiled */
+            continue;
+        }
+        memcpy(&keys[header.num_keys++], &snode->key, sizeof(PipelineKey));
+    }
+
+    /* Followed by those only other instances used, as space permits */
+    if (num_disk_keys) {
+        const PipelineKey *disk_keys =
+            (const PipelineKey *)((uint8_t *)(disk_header + 1) +
+                                  disk_header->data_size);
+        GHashTable *seen =
+            g_hash_table_new(pipeline_key_hash, pipeline_key_equal);
+        for (size_t i = 0; i < header.num_keys; i++) {
+            g_hash_table_add(seen, &keys[i]);
+        }
+        for (size_t i = 0; i < num_disk_keys && header.num_keys < max_keys;
+             i++) {
+            if (!g_hash_table_contains(seen, &disk_keys[i])) {
+                memcpy(&keys[header.num_keys++], &disk_keys[i],
+                       sizeof(PipelineKey));
+            }
+        }
+        g_hash_table_destroy(seen);
+    }
+
+    memcpy(contents, &header, sizeof(header));
+
+    g_autoptr(GError) err = NULL;
+    if (!g_file_set_contents(path, (gchar *)contents,
+                             keys_offset +
+                                 header.num_keys * sizeof(PipelineKey),
+                             &err)) {
+        fprintf(stderr, "nv2a: Failed to write pipeline cache: %s\n",
+                err->message);
+    }
+    unlock_pipeline_cache(lock_fd);
+}
+
 static void init_pipeline_cache(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -132,15 +427,25 @@ static void init_pipeline_cache(PGRAPHState *pg)
         .pInitialData = NULL,
         .pNext = NULL,
     };
-    VK_CHECK(vkCreatePipelineCache(r->device, &cache_info, NULL,
-                                   &r->vk_pipeline_cache));
+    g_autofree gchar *contents = NULL;
+    load_pipeline_cache_from_disk(r, &cache_info, &contents);
+
+    VkResult result = vkCreatePipelineCache(r->device, &cache_info, NULL,
+                                            &r->vk_pipeline_cache);
+    if (result != VK_SUCCESS && cache_info.pInitialData) {
+        /* Driver rejected the saved data, start over */
+        cache_info.initialDataSize = 0;
+        cache_info.pInitialData = NULL;
+        result = vkCreatePipelineCache(r->device, &cache_info, NULL,
+                                       &r->vk_pipeline_cache);
+    }
+    VK_CHECK(result);
 
-    const size_t pipeline_cache_size = 2048;
     lru_init(&r->pipeline_cache);
     r->pipeline_cache_entries =
-        g_malloc_n(pipeline_cache_size, sizeof(PipelineBinding));
+        g_malloc_n(PIPELINE_CACHE_SIZE, sizeof(PipelineBinding));
     assert(r->pipeline_cache_entries != NULL);
-    for (int i = 0; i < pipeline_cache_size; i++) {
+    for (int i = 0; i < PIPELINE_CACHE_SIZE; i++) {
         lru_add_free(&r->pipeline_cache, &r->pipeline_cache_entries[i].node);
     }
 
@@ -153,9 +458,15 @@ static void finalize_pipeline_cache(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
+    stop_pipeline_precompile(r);
+    save_pipeline_cache_to_disk(r);
+
     lru_flush(&r->pipeline_cache);
     g_free(r->pipeline_cache_entries);
     r->pipeline_cache_entries = NULL;
+    g_free(r->saved_pipeline_keys);
+    r->saved_pipeline_keys = NULL;
+    r->num_saved_pipeline_keys = 0;
 
     vkDestroyPipelineCache(r->device, r->vk_pipeline_cache, NULL);
 }
@@ -177,6 +488,12 @@ static char const *const solid_frag_glsl =
     "    fragColor = vec4(1.0);"
     "}\n";
 
+void pgraph_vk_compile_clear_shaders_ahead(PGRAPHVkState *r)
+{
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_VERTEX_BIT, quad_glsl);
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_FRAGMENT_BIT, solid_frag_glsl);
+}
+
 static void init_clear_shaders(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -216,18 +533,8 @@ void pgraph_vk_init_pipelines(PGRAPHState *pg)
     init_pipeline_cache(pg);
     init_clear_shaders(pg);
     init_render_passes(r);
-
-    VkSemaphoreCreateInfo semaphore_info = {
-        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
-    };
-    VK_CHECK(vkCreateSemaphore(r->device, &semaphore_info, NULL,
-                               &r->command_buffer_semaphore));
-
-    VkFenceCreateInfo fence_info = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    };
-    VK_CHECK(
-        vkCreateFence(r->device, &fence_info, NULL, &r->command_buffer_fence));
+    init_framebuffer_cache(r);
+    start_pipeline_precompile(r);
 }
 
 void pgraph_vk_finalize_pipelines(PGRAPHState *pg)
@@ -236,10 +543,8 @@ void pgraph_vk_finalize_pipelines(PGRAPHState *pg)
 
     finalize_clear_shaders(pg);
     finalize_pipeline_cache(pg);
+    finalize_framebuffer_cache(r);
     finalize_render_passes(r);
-
-    vkDestroyFence(r->device, r->command_buffer_fence, NULL);
-    vkDestroySemaphore(r->device, r->command_buffer_semaphore, NULL);
 }
 
 static void init_render_pass_state(PGRAPHState *pg, RenderPassState *state)
@@ -253,7 +558,25 @@ static void init_render_pass_state(PGRAPHState *pg, RenderPassState *state)
                                            VK_FORMAT_UNDEFINED;
 }
 
-static VkRenderPass create_render_pass(PGRAPHVkState *r, RenderPassState *state)
+static bool format_has_stencil(VkFormat format)
+{
+    return format == VK_FORMAT_D24_UNORM_S8_UINT ||
+           format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+static VkAttachmentLoadOp get_load_op(VkImageAspectFlags clear_aspects,
+                                      VkImageAspectFlags aspect)
+{
+    return (clear_aspects & aspect) ? VK_ATTACHMENT_LOAD_OP_CLEAR :
+                                      VK_ATTACHMENT_LOAD_OP_LOAD;
+}
+
+/*
+ * Load ops do not affect render pass compatibility, so pipelines created for
+ * the plain pass can be used in the passes that clear on load.
+ */
+static VkRenderPass create_render_pass(PGRAPHVkState *r, RenderPassState *state,
+                                       VkImageAspectFlags clear_aspects)
 {
     NV2A_VK_DPRINTF("Creating render pass");
 
@@ -268,7 +591,7 @@ static VkRenderPass create_render_pass(PGRAPHVkState *r, RenderPassState *state)
         attachments[num_attachments] = (VkAttachmentDescription){
             .format = state->color_format,
             .samples = VK_SAMPLE_COUNT_1_BIT,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+            .loadOp = get_load_op(clear_aspects, VK_IMAGE_ASPECT_COLOR_BIT),
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
             .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
             .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
@@ -283,13 +606,18 @@ static VkRenderPass create_render_pass(PGRAPHVkState *r, RenderPassState *state)
 
     VkAttachmentReference depth_reference;
     if (zeta) {
+        bool stencil = format_has_stencil(state->zeta_format);
         attachments[num_attachments] = (VkAttachmentDescription){
             .format = state->zeta_format,
             .samples = VK_SAMPLE_COUNT_1_BIT,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+            .loadOp = get_load_op(clear_aspects, VK_IMAGE_ASPECT_DEPTH_BIT),
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
-            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp =
+                stencil ?
+                    get_load_op(clear_aspects, VK_IMAGE_ASPECT_STENCIL_BIT) :
+                    VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = stencil ? VK_ATTACHMENT_STORE_OP_STORE :
+                                        VK_ATTACHMENT_STORE_OP_DONT_CARE,
             .initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
             .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
         };
@@ -351,38 +679,161 @@ static VkRenderPass create_render_pass(PGRAPHVkState *r, RenderPassState *state)
     return render_pass;
 }
 
-static VkRenderPass add_new_render_pass(PGRAPHVkState *r, RenderPassState *state)
+static VkRenderPass add_new_render_pass(PGRAPHVkState *r,
+                                        RenderPassState *state,
+                                        VkImageAspectFlags clear_aspects)
 {
     RenderPass new_pass;
     memcpy(&new_pass.state, state, sizeof(*state));
-    new_pass.render_pass = create_render_pass(r, state);
+    new_pass.clear_aspects = clear_aspects;
+    new_pass.render_pass = create_render_pass(r, state, clear_aspects);
     g_array_append_vals(r->render_passes, &new_pass, 1);
     return new_pass.render_pass;
 }
 
-static VkRenderPass get_render_pass(PGRAPHVkState *r, RenderPassState *state)
+static VkRenderPass get_clearing_render_pass(PGRAPHVkState *r,
+                                             RenderPassState *state,
+                                             VkImageAspectFlags clear_aspects)
 {
     for (int i = 0; i < r->render_passes->len; i++) {
         RenderPass *p = &g_array_index(r->render_passes, RenderPass, i);
-        if (!memcmp(&p->state, state, sizeof(*state))) {
+        if (!memcmp(&p->state, state, sizeof(*state)) &&
+            p->clear_aspects == clear_aspects) {
             return p->render_pass;
         }
     }
-    return add_new_render_pass(r, state);
+    return add_new_render_pass(r, state, clear_aspects);
 }
 
-static void create_frame_buffer(PGRAPHState *pg)
+static VkRenderPass get_render_pass(PGRAPHVkState *r, RenderPassState *state)
 {
-    PGRAPHVkState *r = pg->vk_renderer_state;
+    return get_clearing_render_pass(r, state, 0);
+}
 
-    NV2A_VK_DPRINTF("Creating framebuffer");
+static void framebuffer_cache_entry_init(Lru *lru, LruNode *node,
+                                         const void *key)
+{
+    FramebufferBinding *fnode = container_of(node, FramebufferBinding, node);
+    memcpy(&fnode->key, key, sizeof(FramebufferKey));
+    fnode->framebuffer = VK_NULL_HANDLE;
+    fnode->draw_time = 0;
+}
+
+static bool framebuffer_cache_entry_pre_evict(Lru *lru, LruNode *node)
+{
+    PGRAPHVkState *r = container_of(lru, PGRAPHVkState, framebuffer_cache);
+    FramebufferBinding *fnode = container_of(node, FramebufferBinding, node);
+
+    // Keep framebuffers used by the command buffer being recorded
+    return !r->in_command_buffer ||
+           fnode->draw_time < r->command_buffer_start_time;
+}
+
+static void framebuffer_cache_entry_post_evict(Lru *lru, LruNode *node)
+{
+    PGRAPHVkState *r = container_of(lru, PGRAPHVkState, framebuffer_cache);
+    FramebufferBinding *fnode = container_of(node, FramebufferBinding, node);
+
+    assert((!r->in_command_buffer ||
+            fnode->draw_time < r->command_buffer_start_time) &&
+           "Framebuffer evicted while in use!");
+
+    // May still be referenced by a submitted frame
+    pgraph_vk_wait_for_draw_time(r, fnode->draw_time);
+
+    vkDestroyFramebuffer(r->device, fnode->framebuffer, NULL);
+    fnode->framebuffer = VK_NULL_HANDLE;
+
+    if (r->framebuffer_binding == fnode) {
+        r->framebuffer_binding = NULL;
+    }
+}
+
+static bool framebuffer_cache_entry_compare(Lru *lru, LruNode *node,
+                                            const void *key)
+{
+    FramebufferBinding *fnode = container_of(node, FramebufferBinding, node);
+    return memcmp(&fnode->key, key, sizeof(FramebufferKey));
+}
+
+static void init_framebuffer_cache(PGRAPHVkState *r)
+{
+    const size_t framebuffer_cache_size = 256;
+    lru_init(&r->framebuffer_cache);
+    r->framebuffer_cache_entries =
+        g_malloc_n(framebuffer_cache_size, sizeof(FramebufferBinding));
+    for (int i = 0; i < framebuffer_cache_size; i++) {
+        lru_add_free(&r->framebuffer_cache,
+                     &r->framebuffer_cache_entries[i].node);
+    }
+
+    r->framebuffer_cache.init_node = framebuffer_cache_entry_init;
+    r->framebuffer_cache.compare_nodes = framebuffer_cache_entry_compare;
+    r->framebuffer_cache.pre_node_evict = framebuffer_cache_entry_pre_evict;
+    r->framebuffer_cache.post_node_evict = framebuffer_cache_entry_post_evict;
+    r->framebuffer_binding = NULL;
+}
+
+static void finalize_framebuffer_cache(PGRAPHVkState *r)
+{
+    lru_flush(&r->framebuffer_cache);
+    g_free(r->framebuffer_cache_entries);
+    r->framebuffer_cache_entries = NULL;
+}
+
+/*
+ * Framebuffers referencing a surface image view have to go before the view is
+ * destroyed, a new view could be created with the same handle.
+ */
+void pgraph_vk_evict_framebuffers_using(PGRAPHVkState *r, VkImageView view)
+{
+    if (!r->framebuffer_cache_entries) {
+        return; // Surfaces are finalized after the cache
+    }
+
+    LruNode *node, *next;
+    QTAILQ_FOREACH_SAFE(node, &r->framebuffer_cache.global, next_global,
+                        next) {
+        FramebufferBinding *fnode =
+            container_of(node, FramebufferBinding, node);
+        if (lru_is_node_in_use(&r->framebuffer_cache, node) &&
+            (fnode->key.color_view == view || fnode->key.zeta_view == view)) {
+            lru_evict_node(&r->framebuffer_cache, node);
+        }
+    }
+}
+
+static void bind_framebuffer(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
 
     assert(r->color_binding || r->zeta_binding);
 
-    if (r->framebuffer_index >= ARRAY_SIZE(r->framebuffers)) {
-        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    SurfaceBinding *binding = r->color_binding ? : r->zeta_binding;
+
+    FramebufferKey key;
+    memset(&key, 0, sizeof(key));
+    key.render_pass = r->render_pass;
+    key.color_view =
+        r->color_binding ? r->color_binding->image_view : VK_NULL_HANDLE;
+    key.zeta_view =
+        r->zeta_binding ? r->zeta_binding->image_view : VK_NULL_HANDLE;
+    key.width = binding->width;
+    key.height = binding->height;
+    pgraph_apply_scaling_factor(pg, &key.width, &key.height);
+
+    uint64_t hash = fast_hash((void *)&key, sizeof(key));
+    LruNode *node = lru_lookup(&r->framebuffer_cache, hash, &key);
+    FramebufferBinding *fnode = container_of(node, FramebufferBinding, node);
+    r->framebuffer_binding = fnode;
+
+    if (fnode->framebuffer != VK_NULL_HANDLE) {
+        return;
     }
 
+    NV2A_VK_DPRINTF("Creating framebuffer");
+    nv2a_profile_inc_counter(NV2A_PROF_FRAMEBUFFER_GEN);
+
     VkImageView attachments[2];
     int attachment_count = 0;
 
@@ -393,32 +844,17 @@ static void create_frame_buffer(PGRAPHState *pg)
         attachments[attachment_count++] = r->zeta_binding->image_view;
     }
 
-    SurfaceBinding *binding = r->color_binding ? : r->zeta_binding;
-
     VkFramebufferCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
         .renderPass = r->render_pass,
         .attachmentCount = attachment_count,
         .pAttachments = attachments,
-        .width = binding->width,
-        .height = binding->height,
+        .width = key.width,
+        .height = key.height,
         .layers = 1,
     };
-    pgraph_apply_scaling_factor(pg, &create_info.width, &create_info.height);
     VK_CHECK(vkCreateFramebuffer(r->device, &create_info, NULL,
-                                 &r->framebuffers[r->framebuffer_index++]));
-}
-
-static void destroy_framebuffers(PGRAPHState *pg)
-{
-    NV2A_VK_DPRINTF("Destroying framebuffer");
-    PGRAPHVkState *r = pg->vk_renderer_state;
-
-    for (int i = 0; i < r->framebuffer_index; i++) {
-        vkDestroyFramebuffer(r->device, r->framebuffers[i], NULL);
-        r->framebuffers[i] = VK_NULL_HANDLE;
-    }
-    r->framebuffer_index = 0;
+                                 &fnode->framebuffer));
 }
 
 static void create_clear_pipeline(PGRAPHState *pg)
@@ -597,8 +1033,10 @@ static void create_clear_pipeline(PGRAPHState *pg)
     };
 
     VkPipeline pipeline;
+    int64_t start = nv2a_profile_cpu_time_begin();
     VK_CHECK(vkCreateGraphicsPipelines(r->device, r->vk_pipeline_cache, 1,
                                        &pipeline_info, NULL, &pipeline));
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_PIPELINE_CREATE, "clear", start);
 
     snode->pipeline = pipeline;
     snode->layout = layout;
@@ -611,6 +1049,57 @@ static void create_clear_pipeline(PGRAPHState *pg)
     NV2A_VK_DGROUP_END();
 }
 
+// FIXME: Register masking
+// FIXME: Use more dynamic state updates
+static const unsigned int pipeline_key_regs[] = {
+    NV_PGRAPH_BLEND,       NV_PGRAPH_CONTROL_0,   NV_PGRAPH_CONTROL_1,
+    NV_PGRAPH_CONTROL_2,   NV_PGRAPH_CONTROL_3,   NV_PGRAPH_SETUPRASTER,
+    NV_PGRAPH_ZOFFSETBIAS, NV_PGRAPH_ZOFFSETFACTOR,
+};
+
+/*
+ * Register fields that are set as dynamic state at draw time rather than baked
+ * into the pipeline. The core dynamic states (blend constants and stencil
+ * masks and reference) are always used, the rest of the depth, stencil and
+ * culling state needs VK_EXT_extended_dynamic_state.
+ */
+static const unsigned int dynamic_state_regs[] = {
+    NV_PGRAPH_BLENDCOLOR, NV_PGRAPH_CONTROL_0, NV_PGRAPH_CONTROL_1,
+    NV_PGRAPH_CONTROL_2,  NV_PGRAPH_SETUPRASTER,
+};
+
+static uint32_t get_dynamic_state_reg_mask(PGRAPHVkState *r, unsigned int reg)
+{
+    bool extended = r->extended_dynamic_state_extension_enabled;
+
+    switch (reg) {
+    case NV_PGRAPH_CONTROL_0:
+        return extended ? (NV_PGRAPH_CONTROL_0_ZFUNC |
+                           NV_PGRAPH_CONTROL_0_ZENABLE |
+                           NV_PGRAPH_CONTROL_0_ZWRITEENABLE) :
+                          0;
+    case NV_PGRAPH_CONTROL_1:
+        return NV_PGRAPH_CONTROL_1_STENCIL_REF |
+               NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ |
+               NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE |
+               (extended ? (NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE |
+                            NV_PGRAPH_CONTROL_1_STENCIL_FUNC) :
+                           0);
+    case NV_PGRAPH_CONTROL_2:
+        return extended ? (NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL |
+                           NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL |
+                           NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS) :
+                          0;
+    case NV_PGRAPH_SETUPRASTER:
+        return extended ? (NV_PGRAPH_SETUPRASTER_FRONTFACE |
+                           NV_PGRAPH_SETUPRASTER_CULLENABLE |
+                           NV_PGRAPH_SETUPRASTER_CULLCTRL) :
+                          0;
+    default:
+        return 0;
+    }
+}
+
 static bool check_render_pass_dirty(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -633,14 +1122,8 @@ static bool check_pipeline_dirty(PGRAPHState *pg)
         return true;
     }
 
-    const unsigned int regs[] = {
-        NV_PGRAPH_BLEND,       NV_PGRAPH_BLENDCOLOR,  NV_PGRAPH_CONTROL_0,
-        NV_PGRAPH_CONTROL_1,   NV_PGRAPH_CONTROL_2,   NV_PGRAPH_CONTROL_3,
-        NV_PGRAPH_SETUPRASTER, NV_PGRAPH_ZOFFSETBIAS, NV_PGRAPH_ZOFFSETFACTOR,
-    };
-
-    for (int i = 0; i < ARRAY_SIZE(regs); i++) {
-        if (pgraph_is_reg_dirty(pg, regs[i])) {
+    for (int i = 0; i < ARRAY_SIZE(pipeline_key_regs); i++) {
+        if (pgraph_is_reg_dirty(pg, pipeline_key_regs[i])) {
             return true;
         }
     }
@@ -669,6 +1152,7 @@ static void init_pipeline_key(PGRAPHState *pg, PipelineKey *key)
     memset(key, 0, sizeof(*key));
     init_render_pass_state(pg, &key->render_pass_state);
     memcpy(&key->shader_state, &r->shader_binding->state, sizeof(ShaderState));
+    key->uber_psh = r->shader_binding->psh.pending_module_info != NULL;
     memcpy(key->binding_descriptions, r->vertex_binding_descriptions,
            sizeof(key->binding_descriptions[0]) *
                r->num_active_vertex_binding_descriptions);
@@ -676,66 +1160,130 @@ static void init_pipeline_key(PGRAPHState *pg, PipelineKey *key)
            sizeof(key->attribute_descriptions[0]) *
                r->num_active_vertex_attribute_descriptions);
 
-    // FIXME: Register masking
-    // FIXME: Use more dynamic state updates
-    const int regs[] = {
-        NV_PGRAPH_BLEND,       NV_PGRAPH_BLENDCOLOR,  NV_PGRAPH_CONTROL_0,
-        NV_PGRAPH_CONTROL_1,   NV_PGRAPH_CONTROL_2,   NV_PGRAPH_CONTROL_3,
-        NV_PGRAPH_SETUPRASTER, NV_PGRAPH_ZOFFSETBIAS, NV_PGRAPH_ZOFFSETFACTOR,
-    };
-    assert(ARRAY_SIZE(regs) == ARRAY_SIZE(key->regs));
-    for (int i = 0; i < ARRAY_SIZE(regs); i++) {
-        key->regs[i] = pgraph_reg_r(pg, regs[i]);
+    QEMU_BUILD_BUG_ON(ARRAY_SIZE(pipeline_key_regs) !=
+                      ARRAY_SIZE(key->regs));
+    for (int i = 0; i < ARRAY_SIZE(pipeline_key_regs); i++) {
+        key->regs[i] =
+            pgraph_reg_r(pg, pipeline_key_regs[i]) &
+            ~get_dynamic_state_reg_mask(r, pipeline_key_regs[i]);
     }
 }
 
-static void create_pipeline(PGRAPHState *pg)
+static uint32_t get_pipeline_key_reg(const PipelineKey *key, unsigned int reg)
 {
-    NV2A_VK_DGROUP_BEGIN("Creating pipeline");
+    for (int i = 0; i < ARRAY_SIZE(pipeline_key_regs); i++) {
+        if (pipeline_key_regs[i] == reg) {
+            return key->regs[i];
+        }
+    }
+    assert(!"Register is not part of the pipeline key");
+    return 0;
+}
 
-    NV2AState *d = container_of(pg, NV2AState, pgraph);
-    PGRAPHVkState *r = pg->vk_renderer_state;
+/*
+ * Build a graphics pipeline from its key alone, without looking at PGRAPH
+ * state, so it can also be used by the precompile threads.
+ */
+/*
+ * Push constants hold the bindless texture indices for the fragment shader,
+ * followed by any inline vertex attribute values for the vertex shader. Both
+ * stages share one range so they can be pushed together. Returns the size of
+ * the range, 0 if there are no push constants.
+ */
+static uint32_t get_push_constants_range(PGRAPHVkState *r,
+                                         uint32_t uniform_attrs,
+                                         VkShaderStageFlags *stages)
+{
+    uint32_t size = 0;
+    *stages = 0;
 
-    pgraph_vk_bind_textures(d);
-    pgraph_vk_bind_shaders(pg);
+    if (r->bindless_textures_enabled) {
+        size = pgraph_vk_get_uniform_attrs_push_constant_offset(r);
+        *stages |= VK_SHADER_STAGE_FRAGMENT_BIT;
+    }
 
-    // FIXME: If nothing was dirty, don't even try creating the key or hashing.
-    //        Just use the same pipeline.
-    bool pipeline_dirty = check_pipeline_dirty(pg);
+    int num_uniform_attrs = __builtin_popcount(uniform_attrs);
+    if (num_uniform_attrs &&
+        pgraph_vk_use_push_constants_for_uniform_attrs(r, uniform_attrs)) {
+        size = pgraph_vk_get_uniform_attrs_push_constant_offset(r) +
+               num_uniform_attrs * 4 * sizeof(float);
+        *stages |= VK_SHADER_STAGE_VERTEX_BIT;
+    }
 
-    pgraph_clear_dirty_reg_map(pg);
-    // FIXME: We could clear less
+    return size;
+}
 
-    if (r->pipeline_binding && !pipeline_dirty) {
-        NV2A_VK_DPRINTF("Cache hit");
-        NV2A_VK_DGROUP_END();
-        return;
+/* Constants are 32-bit ints, with ids numbered from 0 in each stage */
+static void init_specialization_info(VkSpecializationInfo *info,
+                                     VkSpecializationMapEntry *entries,
+                                     const int32_t *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        entries[i] = (VkSpecializationMapEntry){
+            .constantID = i,
+            .offset = i * sizeof(int32_t),
+            .size = sizeof(int32_t),
+        };
     }
 
-    PipelineKey key;
-    init_pipeline_key(pg, &key);
-    uint64_t hash = fast_hash((void *)&key, sizeof(key));
+    *info = (VkSpecializationInfo){
+        .mapEntryCount = count,
+        .pMapEntries = entries,
+        .dataSize = count * sizeof(int32_t),
+        .pData = data,
+    };
+}
 
-    LruNode *node = lru_lookup(&r->pipeline_cache, hash, &key);
-    PipelineBinding *snode = container_of(node, PipelineBinding, node);
-    if (snode->pipeline != VK_NULL_HANDLE) {
-        NV2A_VK_DPRINTF("Cache hit");
-        r->pipeline_binding_changed = r->pipeline_binding != snode;
-        r->pipeline_binding = snode;
-        NV2A_VK_DGROUP_END();
-        return;
-    }
+static VkPipeline create_graphics_pipeline(PGRAPHVkState *r,
+                                           const PipelineKey *key,
+                                           VkShaderModule vsh_module,
+                                           VkShaderModule geom_module,
+                                           VkShaderModule psh_module,
+                                           VkRenderPass render_pass,
+                                           VkPipelineLayout *layout,
+                                           bool *has_dynamic_line_width)
+{
+    bool has_color =
+        key->render_pass_state.color_format != VK_FORMAT_UNDEFINED;
+    bool has_zeta = key->render_pass_state.zeta_format != VK_FORMAT_UNDEFINED;
 
-    NV2A_VK_DPRINTF("Cache miss");
-    nv2a_profile_inc_counter(NV2A_PROF_PIPELINE_GEN);
+    /* Active vertex descriptions are packed at the start of the key */
+    int num_vertex_descriptions = 0;
+    while (num_vertex_descriptions < ARRAY_SIZE(key->attribute_descriptions) &&
+           key->attribute_descriptions[num_vertex_descriptions].format !=
+               VK_FORMAT_UNDEFINED) {
+        num_vertex_descriptions++;
+    }
 
-    memcpy(&snode->key, &key, sizeof(key));
+    uint32_t control_0 = get_pipeline_key_reg(key, NV_PGRAPH_CONTROL_0);
+    uint32_t control_1 = get_pipeline_key_reg(key, NV_PGRAPH_CONTROL_1);
+    uint32_t control_2 = get_pipeline_key_reg(key, NV_PGRAPH_CONTROL_2);
+    uint32_t setupraster = get_pipeline_key_reg(key, NV_PGRAPH_SETUPRASTER);
+    uint32_t blend = get_pipeline_key_reg(key, NV_PGRAPH_BLEND);
 
-    uint32_t control_0 = pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0);
     bool depth_test = control_0 & NV_PGRAPH_CONTROL_0_ZENABLE;
     bool depth_write = !!(control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE);
-    bool stencil_test =
-        pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1) & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
+    bool stencil_test = control_1 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE;
+
+    const ShaderState *shader_state = &key->shader_state;
+
+    const int32_t vsh_spec_data[] = {
+        [VSH_SPEC_CONSTANT_FOG_MODE] = shader_state->vsh.fog_mode,
+    };
+    VkSpecializationMapEntry vsh_spec_entries[ARRAY_SIZE(vsh_spec_data)];
+    VkSpecializationInfo vsh_spec_info;
+    init_specialization_info(&vsh_spec_info, vsh_spec_entries, vsh_spec_data,
+                             ARRAY_SIZE(vsh_spec_data));
+
+    const int32_t psh_spec_data[] = {
+        [PSH_SPEC_CONSTANT_ALPHA_FUNC] = shader_state->psh.alpha_test ?
+                                             shader_state->psh.alpha_func :
+                                             ALPHA_FUNC_ALWAYS,
+    };
+    VkSpecializationMapEntry psh_spec_entries[ARRAY_SIZE(psh_spec_data)];
+    VkSpecializationInfo psh_spec_info;
+    init_specialization_info(&psh_spec_info, psh_spec_entries, psh_spec_data,
+                             ARRAY_SIZE(psh_spec_data));
 
     int num_active_shader_stages = 0;
     VkPipelineShaderStageCreateInfo shader_stages[3];
@@ -744,15 +1292,16 @@ static void create_pipeline(PGRAPHState *pg)
         (VkPipelineShaderStageCreateInfo){
             .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
             .stage = VK_SHADER_STAGE_VERTEX_BIT,
-            .module = r->shader_binding->vsh.module_info->module,
+            .module = vsh_module,
             .pName = "main",
+            .pSpecializationInfo = &vsh_spec_info,
         };
-    if (r->shader_binding->geom.module_info) {
+    if (geom_module != VK_NULL_HANDLE) {
         shader_stages[num_active_shader_stages++] =
             (VkPipelineShaderStageCreateInfo){
                 .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
                 .stage = VK_SHADER_STAGE_GEOMETRY_BIT,
-                .module = r->shader_binding->geom.module_info->module,
+                .module = geom_module,
                 .pName = "main",
             };
     }
@@ -760,23 +1309,22 @@ static void create_pipeline(PGRAPHState *pg)
         (VkPipelineShaderStageCreateInfo){
             .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
             .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-            .module = r->shader_binding->psh.module_info->module,
+            .module = psh_module,
             .pName = "main",
+            .pSpecializationInfo = &psh_spec_info,
         };
 
     VkPipelineVertexInputStateCreateInfo vertex_input = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount =
-            r->num_active_vertex_binding_descriptions,
-        .pVertexBindingDescriptions = r->vertex_binding_descriptions,
-        .vertexAttributeDescriptionCount =
-            r->num_active_vertex_attribute_descriptions,
-        .pVertexAttributeDescriptions = r->vertex_attribute_descriptions,
+        .vertexBindingDescriptionCount = num_vertex_descriptions,
+        .pVertexBindingDescriptions = key->binding_descriptions,
+        .vertexAttributeDescriptionCount = num_vertex_descriptions,
+        .pVertexAttributeDescriptions = key->attribute_descriptions,
     };
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology = get_primitive_topology(pg),
+        .topology = get_primitive_topology(&key->shader_state.geom),
         .primitiveRestartEnable = VK_FALSE,
     };
 
@@ -792,10 +1340,10 @@ static void create_pipeline(PGRAPHState *pg)
         .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
         .depthClampEnable = VK_TRUE,
         .rasterizerDiscardEnable = VK_FALSE,
-        .polygonMode = pgraph_polygon_mode_vk_map[r->shader_binding->state
-                                                      .geom.polygon_front_mode],
+        .polygonMode = pgraph_polygon_mode_vk_map[key->shader_state.geom
+                                                      .polygon_front_mode],
         .lineWidth = 1.0f,
-        .frontFace = (pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
+        .frontFace = (setupraster &
                       NV_PGRAPH_SETUPRASTER_FRONTFACE) ?
                          VK_FRONT_FACE_COUNTER_CLOCKWISE :
                          VK_FRONT_FACE_CLOCKWISE,
@@ -803,8 +1351,8 @@ static void create_pipeline(PGRAPHState *pg)
         .pNext = rasterizer_next_struct,
     };
 
-    if (pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) & NV_PGRAPH_SETUPRASTER_CULLENABLE) {
-        uint32_t cull_face = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
+    if (setupraster & NV_PGRAPH_SETUPRASTER_CULLENABLE) {
+        uint32_t cull_face = GET_MASK(setupraster,
                                       NV_PGRAPH_SETUPRASTER_CULLCTRL);
         assert(cull_face < ARRAY_SIZE(pgraph_cull_face_vk_map));
         rasterizer.cullMode = pgraph_cull_face_vk_map[cull_face];
@@ -826,26 +1374,26 @@ static void create_pipeline(PGRAPHState *pg)
     if (depth_test) {
         depth_stencil.depthTestEnable = VK_TRUE;
         uint32_t depth_func =
-            GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0), NV_PGRAPH_CONTROL_0_ZFUNC);
+            GET_MASK(control_0, NV_PGRAPH_CONTROL_0_ZFUNC);
         assert(depth_func < ARRAY_SIZE(pgraph_depth_func_vk_map));
         depth_stencil.depthCompareOp = pgraph_depth_func_vk_map[depth_func];
     }
 
     if (stencil_test) {
         depth_stencil.stencilTestEnable = VK_TRUE;
-        uint32_t stencil_func = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
+        uint32_t stencil_func = GET_MASK(control_1,
                                          NV_PGRAPH_CONTROL_1_STENCIL_FUNC);
-        uint32_t stencil_ref = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
+        uint32_t stencil_ref = GET_MASK(control_1,
                                         NV_PGRAPH_CONTROL_1_STENCIL_REF);
-        uint32_t mask_read = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
+        uint32_t mask_read = GET_MASK(control_1,
                                       NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ);
-        uint32_t mask_write = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_1),
+        uint32_t mask_write = GET_MASK(control_1,
                                        NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE);
-        uint32_t op_fail = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_2),
+        uint32_t op_fail = GET_MASK(control_2,
                                     NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL);
-        uint32_t op_zfail = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_2),
+        uint32_t op_zfail = GET_MASK(control_2,
                                      NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL);
-        uint32_t op_zpass = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_CONTROL_2),
+        uint32_t op_zpass = GET_MASK(control_2,
                                      NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS);
 
         assert(stencil_func < ARRAY_SIZE(pgraph_stencil_func_vk_map));
@@ -878,15 +1426,13 @@ static void create_pipeline(PGRAPHState *pg)
         .colorWriteMask = write_mask,
     };
 
-    float blend_constant[4] = { 0, 0, 0, 0 };
-
-    if (pgraph_reg_r(pg, NV_PGRAPH_BLEND) & NV_PGRAPH_BLEND_EN) {
+    if (blend & NV_PGRAPH_BLEND_EN) {
         color_blend_attachment.blendEnable = VK_TRUE;
 
         uint32_t sfactor =
-            GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND), NV_PGRAPH_BLEND_SFACTOR);
+            GET_MASK(blend, NV_PGRAPH_BLEND_SFACTOR);
         uint32_t dfactor =
-            GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND), NV_PGRAPH_BLEND_DFACTOR);
+            GET_MASK(blend, NV_PGRAPH_BLEND_DFACTOR);
         assert(sfactor < ARRAY_SIZE(pgraph_blend_factor_vk_map));
         assert(dfactor < ARRAY_SIZE(pgraph_blend_factor_vk_map));
         color_blend_attachment.srcColorBlendFactor =
@@ -899,148 +1445,410 @@ static void create_pipeline(PGRAPHState *pg)
             pgraph_blend_factor_vk_map[dfactor];
 
         uint32_t equation =
-            GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_BLEND), NV_PGRAPH_BLEND_EQN);
+            GET_MASK(blend, NV_PGRAPH_BLEND_EQN);
         assert(equation < ARRAY_SIZE(pgraph_blend_equation_vk_map));
 
         color_blend_attachment.colorBlendOp =
             pgraph_blend_equation_vk_map[equation];
         color_blend_attachment.alphaBlendOp =
             pgraph_blend_equation_vk_map[equation];
+    }
+
+    VkPipelineColorBlendStateCreateInfo color_blending = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        .logicOpEnable = VK_FALSE,
+        .logicOp = VK_LOGIC_OP_COPY,
+        .attachmentCount = has_color ? 1 : 0,
+        .pAttachments = has_color ? &color_blend_attachment : NULL,
+    };
+
+    VkDynamicState dynamic_states[14] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+        VK_DYNAMIC_STATE_BLEND_CONSTANTS,
+        VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK,
+        VK_DYNAMIC_STATE_STENCIL_WRITE_MASK,
+        VK_DYNAMIC_STATE_STENCIL_REFERENCE,
+    };
+    int num_dynamic_states = 6;
+
+    if (r->extended_dynamic_state_extension_enabled) {
+        static const VkDynamicState extended_dynamic_states[] = {
+            VK_DYNAMIC_STATE_CULL_MODE_EXT,
+            VK_DYNAMIC_STATE_FRONT_FACE_EXT,
+            VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT,
+            VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT,
+            VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT,
+            VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT,
+            VK_DYNAMIC_STATE_STENCIL_OP_EXT,
+        };
+        memcpy(&dynamic_states[num_dynamic_states], extended_dynamic_states,
+               sizeof(extended_dynamic_states));
+        num_dynamic_states += ARRAY_SIZE(extended_dynamic_states);
+    }
+
+    *has_dynamic_line_width =
+        (r->enabled_physical_device_features.wideLines == VK_TRUE) &&
+        (key->shader_state.geom.polygon_front_mode == POLY_MODE_LINE ||
+         key->shader_state.geom.primitive_mode == PRIM_TYPE_LINES ||
+         key->shader_state.geom.primitive_mode == PRIM_TYPE_LINE_LOOP ||
+         key->shader_state.geom.primitive_mode == PRIM_TYPE_LINE_STRIP);
+    if (*has_dynamic_line_width) {
+        dynamic_states[num_dynamic_states++] = VK_DYNAMIC_STATE_LINE_WIDTH;
+    }
+
+    VkPipelineDynamicStateCreateInfo dynamic_state = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = num_dynamic_states,
+        .pDynamicStates = dynamic_states,
+    };
+
+    // FIXME: Dither
+    // if (pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
+    //         NV_PGRAPH_CONTROL_0_DITHERENABLE))
+    // FIXME: point size
+    // FIXME: Edge Antialiasing
+    // bool anti_aliasing = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_ANTIALIASING),
+    // NV_PGRAPH_ANTIALIASING_ENABLE);
+    // if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
+    //                           NV_PGRAPH_SETUPRASTER_LINESMOOTHENABLE) {
+    // FIXME: VK_EXT_line_rasterization
+    // }
+
+    // if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
+    //                           NV_PGRAPH_SETUPRASTER_POLYSMOOTHENABLE) {
+    // FIXME: No direct analog. Just do it with MSAA.
+    // }
+
+
+    VkDescriptorSetLayout set_layouts[] = {
+        r->descriptor_set_layout,
+        r->bindless_descriptor_set_layout,
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = r->bindless_textures_enabled ? 2 : 1,
+        .pSetLayouts = set_layouts,
+    };
+
+    VkPushConstantRange push_constant_range;
+    push_constant_range.size = get_push_constants_range(
+        r, key->shader_state.vsh.uniform_attrs,
+        &push_constant_range.stageFlags);
+    if (push_constant_range.size) {
+        // FIXME: Minimize push constants
+        push_constant_range.offset = 0;
+        pipeline_layout_info.pushConstantRangeCount = 1;
+        pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+    }
+
+    VK_CHECK(vkCreatePipelineLayout(r->device, &pipeline_layout_info, NULL,
+                                    layout));
+
+    VkGraphicsPipelineCreateInfo pipeline_create_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .stageCount = num_active_shader_stages,
+        .pStages = shader_stages,
+        .pVertexInputState = &vertex_input,
+        .pInputAssemblyState = &input_assembly,
+        .pViewportState = &viewport_state,
+        .pRasterizationState = &rasterizer,
+        .pMultisampleState = &multisampling,
+        .pDepthStencilState = has_zeta ? &depth_stencil : NULL,
+        .pColorBlendState = &color_blending,
+        .pDynamicState = &dynamic_state,
+        .layout = *layout,
+        .renderPass = render_pass,
+        .subpass = 0,
+        .basePipelineHandle = VK_NULL_HANDLE,
+    };
+    VkPipeline pipeline;
+    int64_t start = nv2a_profile_cpu_time_begin();
+    VK_CHECK(vkCreateGraphicsPipelines(r->device, r->vk_pipeline_cache, 1,
+                                       &pipeline_create_info, NULL, &pipeline));
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_PIPELINE_CREATE, NULL, start);
+
+    return pipeline;
+}
+
+/*
+ * Pipelines for the keys saved by the last session are rebuilt from their keys
+ * on a few worker threads at startup, most recently used first, so they are
+ * usually ready before the title first draws with them. The render thread
+ * adopts a precompiled pipeline on its first cache miss for that key.
+ */
+static void *precompile_pipelines_thread(void *opaque)
+{
+    PGRAPHVkState *r = opaque;
+
+    static const VkShaderStageFlagBits stages[3] = {
+        VK_SHADER_STAGE_VERTEX_BIT,
+        VK_SHADER_STAGE_GEOMETRY_BIT,
+        VK_SHADER_STAGE_FRAGMENT_BIT,
+    };
+
+    while (!qatomic_read(&r->precompile_stop)) {
+        int i = qatomic_fetch_inc(&r->precompile_next);
+        if (i >= r->num_saved_pipeline_keys) {
+            break;
+        }
+
+        PrecompiledPipeline *p = &r->precompiled_pipelines[i];
+        if (qatomic_cmpxchg(&p->status, PRECOMPILED_PIPELINE_PENDING,
+                            PRECOMPILED_PIPELINE_BUILDING) !=
+            PRECOMPILED_PIPELINE_PENDING) {
+            continue;
+        }
+
+        const PipelineKey *key = &r->saved_pipeline_keys[i];
+        ShaderModuleInfo *modules[3] = { NULL, NULL, NULL };
+        for (int j = 0; j < ARRAY_SIZE(stages); j++) {
+            ShaderModuleCacheKey module_key;
+            if (pgraph_vk_init_shader_module_cache_key(
+                    r, &key->shader_state, stages[j], &module_key)) {
+                modules[j] =
+                    pgraph_vk_create_shader_module_for_key(r, &module_key);
+            }
+        }
+
+        p->pipeline = create_graphics_pipeline(
+            r, key, modules[0]->module,
+            modules[1] ? modules[1]->module : VK_NULL_HANDLE,
+            modules[2]->module, p->render_pass, &p->layout,
+            &p->has_dynamic_line_width);
+
+        /* The pipeline keeps what it needs, the modules can go */
+        for (int j = 0; j < ARRAY_SIZE(modules); j++) {
+            if (modules[j]) {
+                pgraph_vk_destroy_shader_module(r, modules[j]);
+            }
+        }
+
+        qatomic_store_release(&p->status, PRECOMPILED_PIPELINE_READY);
+    }
+
+    return NULL;
+}
+
+static guint pipeline_key_hash(gconstpointer key)
+{
+    return fast_hash((void *)key, sizeof(PipelineKey));
+}
+
+static gboolean pipeline_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(PipelineKey));
+}
+
+static void start_pipeline_precompile(PGRAPHVkState *r)
+{
+    if (!r->num_saved_pipeline_keys) {
+        return;
+    }
+
+    r->precompiled_pipelines = g_malloc0_n(r->num_saved_pipeline_keys,
+                                           sizeof(PrecompiledPipeline));
+    r->precompiled_pipeline_index =
+        g_hash_table_new(pipeline_key_hash, pipeline_key_equal);
+
+    for (int i = 0; i < r->num_saved_pipeline_keys; i++) {
+        PipelineKey *key = &r->saved_pipeline_keys[i];
+        PrecompiledPipeline *p = &r->precompiled_pipelines[i];
+
+        /* Clear pipelines are cheap and built differently */
+        if (key->clear ||
+            g_hash_table_contains(r->precompiled_pipeline_index, key)) {
+            p->status = PRECOMPILED_PIPELINE_TAKEN;
+            continue;
+        }
+
+        /* Render passes are created here, the render pass list is not
+         * thread safe */
+        p->status = PRECOMPILED_PIPELINE_PENDING;
+        p->render_pass = get_render_pass(r, &key->render_pass_state);
+        g_hash_table_insert(r->precompiled_pipeline_index, key,
+                            GINT_TO_POINTER(i + 1));
+    }
+
+    r->precompile_next = 0;
+    r->precompile_stop = false;
+    r->num_precompile_threads = MIN(4, MAX(1, g_get_num_processors() / 2));
+    r->precompile_threads = g_new(QemuThread, r->num_precompile_threads);
+    for (int i = 0; i < r->num_precompile_threads; i++) {
+        qemu_thread_create(&r->precompile_threads[i], "nv2a.vk_precompile",
+                           precompile_pipelines_thread, r,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void stop_pipeline_precompile(PGRAPHVkState *r)
+{
+    if (!r->precompile_threads) {
+        return;
+    }
+
+    qatomic_set(&r->precompile_stop, true);
+    for (int i = 0; i < r->num_precompile_threads; i++) {
+        qemu_thread_join(&r->precompile_threads[i]);
+    }
+    g_free(r->precompile_threads);
+    r->precompile_threads = NULL;
+    r->num_precompile_threads = 0;
+
+    /* Destroy whatever was built but never used */
+    for (int i = 0; i < r->num_saved_pipeline_keys; i++) {
+        PrecompiledPipeline *p = &r->precompiled_pipelines[i];
+        if (p->status == PRECOMPILED_PIPELINE_READY) {
+            vkDestroyPipeline(r->device, p->pipeline, NULL);
+            vkDestroyPipelineLayout(r->device, p->layout, NULL);
+        }
+    }
+
+    g_hash_table_destroy(r->precompiled_pipeline_index);
+    r->precompiled_pipeline_index = NULL;
+    g_free(r->precompiled_pipelines);
+    r->precompiled_pipelines = NULL;
+}
+
+static bool take_precompiled_pipeline(PGRAPHVkState *r, PipelineBinding *snode)
+{
+    if (!r->precompiled_pipeline_index) {
+        return false;
+    }
 
-        uint32_t blend_color = pgraph_reg_r(pg, NV_PGRAPH_BLENDCOLOR);
-        pgraph_argb_pack32_to_rgba_float(blend_color, blend_constant);
+    int index = GPOINTER_TO_INT(
+        g_hash_table_lookup(r->precompiled_pipeline_index, &snode->key)) - 1;
+    if (index < 0) {
+        return false;
     }
 
-    VkPipelineColorBlendStateCreateInfo color_blending = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        .logicOpEnable = VK_FALSE,
-        .logicOp = VK_LOGIC_OP_COPY,
-        .attachmentCount = r->color_binding ? 1 : 0,
-        .pAttachments = r->color_binding ? &color_blend_attachment : NULL,
-        .blendConstants[0] = blend_constant[0],
-        .blendConstants[1] = blend_constant[1],
-        .blendConstants[2] = blend_constant[2],
-        .blendConstants[3] = blend_constant[3],
-    };
+    /*
+     * If the pipeline has not been started yet, claim it so the workers skip
+     * it. If it is still being built, don't wait for it.
+     */
+    PrecompiledPipeline *p = &r->precompiled_pipelines[index];
+    int status = qatomic_cmpxchg(&p->status, PRECOMPILED_PIPELINE_PENDING,
+                                 PRECOMPILED_PIPELINE_TAKEN);
+    if (status != PRECOMPILED_PIPELINE_READY) {
+        return false;
+    }
+    qatomic_set(&p->status, PRECOMPILED_PIPELINE_TAKEN);
 
-    VkDynamicState dynamic_states[3] = { VK_DYNAMIC_STATE_VIEWPORT,
-                                         VK_DYNAMIC_STATE_SCISSOR };
-    int num_dynamic_states = 2;
+    snode->pipeline = p->pipeline;
+    snode->layout = p->layout;
+    snode->render_pass = p->render_pass;
+    snode->has_dynamic_line_width = p->has_dynamic_line_width;
 
-    snode->has_dynamic_line_width =
-        (r->enabled_physical_device_features.wideLines == VK_TRUE) &&
-        (r->shader_binding->state.geom.polygon_front_mode == POLY_MODE_LINE ||
-         r->shader_binding->state.geom.primitive_mode == PRIM_TYPE_LINES ||
-         r->shader_binding->state.geom.primitive_mode == PRIM_TYPE_LINE_LOOP ||
-         r->shader_binding->state.geom.primitive_mode == PRIM_TYPE_LINE_STRIP);
-    if (snode->has_dynamic_line_width) {
-        dynamic_states[num_dynamic_states++] = VK_DYNAMIC_STATE_LINE_WIDTH;
-    }
+    return true;
+}
 
-    VkPipelineDynamicStateCreateInfo dynamic_state = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
-        .dynamicStateCount = num_dynamic_states,
-        .pDynamicStates = dynamic_states,
-    };
+static bool create_pipeline(PGRAPHState *pg)
+{
+    NV2A_VK_DGROUP_BEGIN("Creating pipeline");
 
-    // FIXME: Dither
-    // if (pgraph_reg_r(pg, NV_PGRAPH_CONTROL_0) &
-    //         NV_PGRAPH_CONTROL_0_DITHERENABLE))
-    // FIXME: point size
-    // FIXME: Edge Antialiasing
-    // bool anti_aliasing = GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_ANTIALIASING),
-    // NV_PGRAPH_ANTIALIASING_ENABLE);
-    // if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
-    //                           NV_PGRAPH_SETUPRASTER_LINESMOOTHENABLE) {
-    // FIXME: VK_EXT_line_rasterization
-    // }
+    NV2AState *d = container_of(pg, NV2AState, pgraph);
+    PGRAPHVkState *r = pg->vk_renderer_state;
 
-    // if (!anti_aliasing && pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER) &
-    //                           NV_PGRAPH_SETUPRASTER_POLYSMOOTHENABLE) {
-    // FIXME: No direct analog. Just do it with MSAA.
-    // }
+    pgraph_vk_bind_textures(d);
+    if (!pgraph_vk_bind_shaders(pg)) {
+        NV2A_VK_DPRINTF("Shaders not ready");
+        NV2A_VK_DGROUP_END();
+        return false;
+    }
 
+    // FIXME: If nothing was dirty, don't even try creating the key or hashing.
+    //        Just use the same pipeline.
+    bool pipeline_dirty = check_pipeline_dirty(pg);
 
-    VkPipelineLayoutCreateInfo pipeline_layout_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = 1,
-        .pSetLayouts = &r->descriptor_set_layout,
-    };
+    pgraph_clear_dirty_reg_map(pg);
+    // FIXME: We could clear less
 
-    VkPushConstantRange push_constant_range;
-    if (r->use_push_constants_for_uniform_attrs) {
-        int num_uniform_attributes =
-            __builtin_popcount(r->shader_binding->state.vsh.uniform_attrs);
-        if (num_uniform_attributes) {
-            push_constant_range = (VkPushConstantRange){
-                .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-                .offset = 0,
-                // FIXME: Minimize push constants
-                .size = num_uniform_attributes * 4 * sizeof(float),
-            };
-            pipeline_layout_info.pushConstantRangeCount = 1;
-            pipeline_layout_info.pPushConstantRanges = &push_constant_range;
-        }
+    if (r->pipeline_binding && !pipeline_dirty) {
+        NV2A_VK_DPRINTF("Cache hit");
+        NV2A_VK_DGROUP_END();
+        return true;
     }
 
-    VkPipelineLayout layout;
-    VK_CHECK(vkCreatePipelineLayout(r->device, &pipeline_layout_info, NULL,
-                                    &layout));
+    PipelineKey key;
+    init_pipeline_key(pg, &key);
+    uint64_t hash = fast_hash((void *)&key, sizeof(key));
 
-    VkGraphicsPipelineCreateInfo pipeline_create_info = {
-        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .stageCount = num_active_shader_stages,
-        .pStages = shader_stages,
-        .pVertexInputState = &vertex_input,
-        .pInputAssemblyState = &input_assembly,
-        .pViewportState = &viewport_state,
-        .pRasterizationState = &rasterizer,
-        .pMultisampleState = &multisampling,
-        .pDepthStencilState = r->zeta_binding ? &depth_stencil : NULL,
-        .pColorBlendState = &color_blending,
-        .pDynamicState = &dynamic_state,
-        .layout = layout,
-        .renderPass = get_render_pass(r, &key.render_pass_state),
-        .subpass = 0,
-        .basePipelineHandle = VK_NULL_HANDLE,
-    };
-    VkPipeline pipeline;
-    VK_CHECK(vkCreateGraphicsPipelines(r->device, r->vk_pipeline_cache, 1,
-                                       &pipeline_create_info, NULL, &pipeline));
+    LruNode *node = lru_lookup(&r->pipeline_cache, hash, &key);
+    PipelineBinding *snode = container_of(node, PipelineBinding, node);
+    if (snode->pipeline != VK_NULL_HANDLE) {
+        NV2A_VK_DPRINTF("Cache hit");
+        r->pipeline_binding_changed = r->pipeline_binding != snode;
+        r->pipeline_binding = snode;
+        NV2A_VK_DGROUP_END();
+        return true;
+    }
 
-    snode->pipeline = pipeline;
-    snode->layout = layout;
-    snode->render_pass = pipeline_create_info.renderPass;
+    NV2A_VK_DPRINTF("Cache miss");
+
+    memcpy(&snode->key, &key, sizeof(key));
+
+    if (take_precompiled_pipeline(r, snode)) {
+        nv2a_profile_inc_counter(NV2A_PROF_PIPELINE_PRECOMPILED);
+    } else {
+        nv2a_profile_inc_counter(NV2A_PROF_PIPELINE_GEN);
+
+        VkRenderPass render_pass = get_render_pass(r, &key.render_pass_state);
+        VkShaderModule geom_module =
+            r->shader_binding->geom.module_info ?
+                r->shader_binding->geom.module_info->module :
+                VK_NULL_HANDLE;
+
+        snode->pipeline = create_graphics_pipeline(
+            r, &snode->key, r->shader_binding->vsh.module_info->module,
+            geom_module, r->shader_binding->psh.module_info->module,
+            render_pass, &snode->layout, &snode->has_dynamic_line_width);
+        snode->render_pass = render_pass;
+    }
     snode->draw_time = pg->draw_time;
 
     r->pipeline_binding = snode;
     r->pipeline_binding_changed = true;
 
     NV2A_VK_DGROUP_END();
+    return true;
 }
 
-static void push_vertex_attr_values(PGRAPHState *pg)
+static void push_constants(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
+    uint32_t uniform_attrs = r->shader_binding->state.vsh.uniform_attrs;
 
-    if (!r->use_push_constants_for_uniform_attrs) {
+    VkShaderStageFlags stages;
+    uint32_t size = get_push_constants_range(r, uniform_attrs, &stages);
+    if (!size) {
         return;
     }
 
     // FIXME: Partial updates
 
-    float values[NV2A_VERTEXSHADER_ATTRIBUTES][4];
-    int num_uniform_attrs = 0;
+    uint8_t data[NV2A_MAX_TEXTURES * sizeof(uint32_t) +
+                 NV2A_VERTEXSHADER_ATTRIBUTES * 4 * sizeof(float)];
 
-    pgraph_get_inline_values(pg, r->shader_binding->state.vsh.uniform_attrs,
-                             values, &num_uniform_attrs);
+    if (r->bindless_textures_enabled) {
+        uint32_t *texture_indices = (uint32_t *)data;
+        for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
+            texture_indices[i] = r->texture_bindings[i]->bindless_index;
+        }
+    }
 
-    if (num_uniform_attrs > 0) {
-        vkCmdPushConstants(r->command_buffer, r->pipeline_binding->layout,
-                           VK_SHADER_STAGE_VERTEX_BIT, 0,
-                           num_uniform_attrs * 4 * sizeof(float),
-                           &values);
+    if (pgraph_vk_use_push_constants_for_uniform_attrs(r, uniform_attrs)) {
+        float values[NV2A_VERTEXSHADER_ATTRIBUTES][4];
+        int num_uniform_attrs = 0;
+        pgraph_get_inline_values(pg, uniform_attrs, values,
+                                 &num_uniform_attrs);
+
+        uint32_t offset = pgraph_vk_get_uniform_attrs_push_constant_offset(r);
+        assert(offset + num_uniform_attrs * sizeof(values[0]) == size);
+        memcpy(data + offset, values, num_uniform_attrs * sizeof(values[0]));
     }
+
+    pgraph_vk_cmd_push_constants(r, r->pipeline_binding->layout, stages, 0,
+                                 size, data);
 }
 
 static void bind_descriptor_sets(PGRAPHState *pg)
@@ -1048,10 +1856,21 @@ static void bind_descriptor_sets(PGRAPHState *pg)
     PGRAPHVkState *r = pg->vk_renderer_state;
     assert(r->descriptor_set_index >= 1);
 
-    vkCmdBindDescriptorSets(r->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            r->pipeline_binding->layout, 0, 1,
-                            &r->descriptor_sets[r->descriptor_set_index - 1], 0,
-                            NULL);
+    uint32_t dynamic_offsets[ARRAY_SIZE(r->uniform_buffer_offsets)];
+    for (int i = 0; i < ARRAY_SIZE(dynamic_offsets); i++) {
+        dynamic_offsets[i] = r->uniform_buffer_offsets[i];
+    }
+
+    // The bindless set is rebound along with the other, as pipeline layouts
+    // with different push constant ranges are not compatible for any set
+    VkDescriptorSet sets[] = {
+        r->frame->descriptor_sets[r->descriptor_set_current],
+        r->bindless_descriptor_set,
+    };
+    pgraph_vk_cmd_bind_descriptor_sets(r, r->pipeline_binding->layout,
+                                       r->bindless_textures_enabled ? 2 : 1,
+                                       sets, ARRAY_SIZE(dynamic_offsets),
+                                       dynamic_offsets);
 }
 
 static void begin_query(PGRAPHVkState *r)
@@ -1093,12 +1912,38 @@ static void sync_staging_buffer(PGRAPHState *pg, VkCommandBuffer cmd,
     StorageBuffer *b_src = &r->storage_buffers[index_src];
     StorageBuffer *b_dst = &r->storage_buffers[index_dst];
 
-    if (!b_src->buffer_offset) {
+    /*
+     * Staging and destination buffers share the ring layout. The data of the
+     * frame is in two pieces if it wrapped around the end of the ring.
+     */
+    VkBufferCopy copy_regions[2];
+    int num_regions = 0;
+
+    size_t end = b_src->frame_wrapped ? b_src->frame_wrap_end :
+                                        b_src->buffer_offset;
+    if (end > b_src->frame_start) {
+        copy_regions[num_regions++] = (VkBufferCopy){
+            .srcOffset = b_src->frame_start,
+            .dstOffset = b_src->frame_start,
+            .size = end - b_src->frame_start,
+        };
+    }
+    if (b_src->frame_wrapped && b_src->buffer_offset > 0) {
+        copy_regions[num_regions++] = (VkBufferCopy){
+            .srcOffset = 0,
+            .dstOffset = 0,
+            .size = b_src->buffer_offset,
+        };
+    }
+
+    pgraph_vk_end_buffer_frame(pg, index_src);
+
+    if (!num_regions) {
         return;
     }
 
-    VkBufferCopy copy_region = { .size = b_src->buffer_offset };
-    vkCmdCopyBuffer(cmd, b_src->buffer, b_dst->buffer, 1, &copy_region);
+    vkCmdCopyBuffer(cmd, b_src->buffer, b_dst->buffer, num_regions,
+                    copy_regions);
 
     VkAccessFlags dst_access_mask;
     VkPipelineStageFlags dst_stage_mask;
@@ -1121,28 +1966,33 @@ static void sync_staging_buffer(PGRAPHState *pg, VkCommandBuffer cmd,
         break;
     }
 
-    VkBufferMemoryBarrier barrier = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-        .dstAccessMask = dst_access_mask,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .buffer = b_dst->buffer,
-        .size = b_src->buffer_offset
-    };
+    VkBufferMemoryBarrier barriers[2];
+    for (int i = 0; i < num_regions; i++) {
+        barriers[i] = (VkBufferMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = dst_access_mask,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = b_dst->buffer,
+            .offset = copy_regions[i].dstOffset,
+            .size = copy_regions[i].size,
+        };
+    }
     vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stage_mask, 0,
-                         0, NULL, 1, &barrier, 0, NULL);
-
-    b_src->buffer_offset = 0;
+                         0, NULL, num_regions, barriers, 0, NULL);
 }
 
 static void flush_memory_buffer(PGRAPHState *pg, VkCommandBuffer cmd)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    VK_CHECK(vmaFlushAllocation(
-        r->allocator, r->storage_buffers[BUFFER_VERTEX_RAM].allocation, 0,
-        VK_WHOLE_SIZE));
+    // Imported guest memory is host coherent
+    if (!r->storage_buffers[BUFFER_VERTEX_RAM].imported_memory) {
+        VK_CHECK(vmaFlushAllocation(
+            r->allocator, r->storage_buffers[BUFFER_VERTEX_RAM].allocation, 0,
+            VK_WHOLE_SIZE));
+    }
 
     VkBufferMemoryBarrier barrier = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
@@ -1160,6 +2010,65 @@ static void flush_memory_buffer(PGRAPHState *pg, VkCommandBuffer cmd)
                          &barrier, 0, NULL);
 }
 
+/*
+ * Begin a render pass on the framebuffer of the pending clear, with load ops
+ * that perform it.
+ */
+static void begin_clearing_render_pass(PGRAPHVkState *r)
+{
+    PendingClear *clear = &r->pending_clear;
+    assert(clear->aspects);
+
+    VkClearValue clear_values[2];
+    int num_clear_values = 0;
+    if (clear->state.color_format != VK_FORMAT_UNDEFINED) {
+        clear_values[num_clear_values++] = clear->color;
+    }
+    if (clear->state.zeta_format != VK_FORMAT_UNDEFINED) {
+        clear_values[num_clear_values++] = clear->depth_stencil;
+    }
+
+    VkRenderPassBeginInfo render_pass_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass =
+            get_clearing_render_pass(r, &clear->state, clear->aspects),
+        .framebuffer = clear->framebuffer,
+        .renderArea.extent = clear->extent,
+        .clearValueCount = num_clear_values,
+        .pClearValues = clear_values,
+    };
+    pgraph_vk_begin_gpu_timer(r, r->command_buffer,
+                              NV2A_PROF_GPU_RENDER_PASS);
+    vkCmdBeginRenderPass(r->command_buffer, &render_pass_begin_info,
+                         pgraph_vk_recorder_begin_render_pass(
+                             r, render_pass_begin_info.renderPass,
+                             render_pass_begin_info.framebuffer));
+    r->in_render_pass = true;
+
+    clear->aspects = 0;
+}
+
+/*
+ * Perform a pending clear in a render pass of its own, for when the next pass
+ * is not on the same framebuffer or something outside of a pass needs the
+ * cleared surfaces.
+ */
+static void flush_pending_clear(PGRAPHVkState *r)
+{
+    assert(!r->in_render_pass);
+
+    if (!r->pending_clear.aspects) {
+        return;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_PIPELINE_RENDERPASSES);
+    begin_clearing_render_pass(r);
+    pgraph_vk_recorder_end_render_pass(r);
+    vkCmdEndRenderPass(r->command_buffer);
+    pgraph_vk_end_gpu_timer(r, r->command_buffer);
+    r->in_render_pass = false;
+}
+
 static void begin_render_pass(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -1173,35 +2082,98 @@ static void begin_render_pass(PGRAPHState *pg)
                  vp_height = pg->surface_binding_dim.height;
     pgraph_apply_scaling_factor(pg, &vp_width, &vp_height);
 
-    assert(r->framebuffer_index > 0);
+    assert(r->framebuffer_binding);
+    VkFramebuffer framebuffer = r->framebuffer_binding->framebuffer;
+    r->framebuffer_binding->draw_time = pg->draw_time;
+
+    PendingClear *clear = &r->pending_clear;
+    if (clear->aspects) {
+        if (clear->framebuffer == framebuffer &&
+            !memcmp(&clear->state, &r->pipeline_binding->key.render_pass_state,
+                    sizeof(clear->state))) {
+            begin_clearing_render_pass(r);
+            return;
+        }
+        flush_pending_clear(r);
+    }
 
     VkRenderPassBeginInfo render_pass_begin_info = {
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
         .renderPass = r->render_pass,
-        .framebuffer = r->framebuffers[r->framebuffer_index - 1],
+        .framebuffer = framebuffer,
         .renderArea.extent.width = vp_width,
         .renderArea.extent.height = vp_height,
         .clearValueCount = 0,
         .pClearValues = NULL,
     };
+    pgraph_vk_begin_gpu_timer(r, r->command_buffer,
+                              NV2A_PROF_GPU_RENDER_PASS);
     vkCmdBeginRenderPass(r->command_buffer, &render_pass_begin_info,
-                         VK_SUBPASS_CONTENTS_INLINE);
+                         pgraph_vk_recorder_begin_render_pass(
+                             r, r->render_pass, framebuffer));
     r->in_render_pass = true;
-
 }
 
 static void end_render_pass(PGRAPHVkState *r)
 {
     if (r->in_render_pass) {
+        pgraph_vk_recorder_end_render_pass(r);
         vkCmdEndRenderPass(r->command_buffer);
+        pgraph_vk_end_gpu_timer(r, r->command_buffer);
         r->in_render_pass = false;
     }
 }
 
+/*
+ * Instead of recording a clear, have the next render pass on the framebuffer
+ * clear the given aspects when it loads the attachments.
+ */
+static void defer_clear(PGRAPHState *pg, VkImageAspectFlags aspects,
+                        VkClearValue color, VkClearValue depth_stencil)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    assert(!r->in_render_pass);
+
+    unsigned int vp_width = pg->surface_binding_dim.width,
+                 vp_height = pg->surface_binding_dim.height;
+    pgraph_apply_scaling_factor(pg, &vp_width, &vp_height);
+
+    assert(r->framebuffer_binding);
+    VkFramebuffer framebuffer = r->framebuffer_binding->framebuffer;
+    r->framebuffer_binding->draw_time = pg->draw_time;
+
+    PendingClear *clear = &r->pending_clear;
+    RenderPassState *state = &r->pipeline_binding->key.render_pass_state;
+
+    if (clear->aspects &&
+        (clear->framebuffer != framebuffer ||
+         memcmp(&clear->state, state, sizeof(*state)))) {
+        flush_pending_clear(r);
+    }
+
+    clear->aspects |= aspects;
+    clear->state = *state;
+    clear->framebuffer = framebuffer;
+    clear->extent = (VkExtent2D){ .width = vp_width, .height = vp_height };
+    if (aspects & VK_IMAGE_ASPECT_COLOR_BIT) {
+        clear->color = color;
+    }
+    if (aspects & VK_IMAGE_ASPECT_DEPTH_BIT) {
+        clear->depth_stencil.depthStencil.depth =
+            depth_stencil.depthStencil.depth;
+    }
+    if (aspects & VK_IMAGE_ASPECT_STENCIL_BIT) {
+        clear->depth_stencil.depthStencil.stencil =
+            depth_stencil.depthStencil.stencil;
+    }
+}
+
 const enum NV2A_PROF_COUNTERS_ENUM finish_reason_to_counter_enum[] = {
     [VK_FINISH_REASON_VERTEX_BUFFER_DIRTY] = NV2A_PROF_FINISH_VERTEX_BUFFER_DIRTY,
     [VK_FINISH_REASON_SURFACE_CREATE] = NV2A_PROF_FINISH_SURFACE_CREATE,
     [VK_FINISH_REASON_SURFACE_DOWN] = NV2A_PROF_FINISH_SURFACE_DOWN,
+    [VK_FINISH_REASON_SURFACE_READ] = NV2A_PROF_FINISH_SURFACE_READ,
     [VK_FINISH_REASON_NEED_BUFFER_SPACE] = NV2A_PROF_FINISH_NEED_BUFFER_SPACE,
     [VK_FINISH_REASON_FRAMEBUFFER_DIRTY] = NV2A_PROF_FINISH_FRAMEBUFFER_DIRTY,
     [VK_FINISH_REASON_PRESENTING] = NV2A_PROF_FINISH_PRESENTING,
@@ -1210,9 +2182,44 @@ const enum NV2A_PROF_COUNTERS_ENUM finish_reason_to_counter_enum[] = {
     [VK_FINISH_REASON_STALLED] = NV2A_PROF_FINISH_STALLED,
 };
 
+const enum NV2A_PROF_GPU_TIMERS_ENUM finish_reason_to_gpu_timer_enum[] = {
+    [VK_FINISH_REASON_VERTEX_BUFFER_DIRTY] =
+        NV2A_PROF_GPU_SUBMIT_VERTEX_BUFFER_DIRTY,
+    [VK_FINISH_REASON_SURFACE_CREATE] = NV2A_PROF_GPU_SUBMIT_SURFACE_CREATE,
+    [VK_FINISH_REASON_SURFACE_DOWN] = NV2A_PROF_GPU_SUBMIT_SURFACE_DOWN,
+    [VK_FINISH_REASON_SURFACE_READ] = NV2A_PROF_GPU_SUBMIT_SURFACE_READ,
+    [VK_FINISH_REASON_NEED_BUFFER_SPACE] =
+        NV2A_PROF_GPU_SUBMIT_NEED_BUFFER_SPACE,
+    [VK_FINISH_REASON_FRAMEBUFFER_DIRTY] =
+        NV2A_PROF_GPU_SUBMIT_FRAMEBUFFER_DIRTY,
+    [VK_FINISH_REASON_PRESENTING] = NV2A_PROF_GPU_SUBMIT_PRESENTING,
+    [VK_FINISH_REASON_FLIP_STALL] = NV2A_PROF_GPU_SUBMIT_FLIP_STALL,
+    [VK_FINISH_REASON_FLUSH] = NV2A_PROF_GPU_SUBMIT_FLUSH,
+    [VK_FINISH_REASON_STALLED] = NV2A_PROF_GPU_SUBMIT_STALLED,
+};
+
+/*
+ * Most reasons only need the command buffer to be submitted, the CPU can go on
+ * to record the next frame while the GPU executes it. These expect the results
+ * of the submitted work to be available once finished.
+ */
+static bool finish_reason_needs_idle(FinishReason finish_reason)
+{
+    switch (finish_reason) {
+    case VK_FINISH_REASON_SURFACE_CREATE:
+    case VK_FINISH_REASON_SURFACE_DOWN:
+    case VK_FINISH_REASON_FLUSH:
+    case VK_FINISH_REASON_STALLED:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void pgraph_vk_finish(PGRAPHState *pg, FinishReason finish_reason)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
+    int64_t zone_start = timeline_begin();
 
     assert(!r->in_draw);
     assert(r->debug_depth == 0);
@@ -1223,12 +2230,15 @@ void pgraph_vk_finish(PGRAPHState *pg, FinishReason finish_reason)
         if (r->in_render_pass) {
             end_render_pass(r);
         }
+        flush_pending_clear(r);
         if (r->query_in_flight) {
             end_query(r);
         }
+        pgraph_vk_end_command_buffer_timer(
+            r, r->command_buffer, finish_reason_to_gpu_timer_enum[finish_reason]);
         VK_CHECK(vkEndCommandBuffer(r->command_buffer));
 
-        VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg); // FIXME: Cleanup
+        VkCommandBuffer cmd = pgraph_vk_begin_aux_commands(pg);
         sync_staging_buffer(pg, cmd, BUFFER_INDEX_STAGING, BUFFER_INDEX);
         sync_staging_buffer(pg, cmd, BUFFER_VERTEX_INLINE_STAGING,
                                 BUFFER_VERTEX_INLINE);
@@ -1238,30 +2248,55 @@ void pgraph_vk_finish(PGRAPHState *pg, FinishReason finish_reason)
         VK_CHECK(vkEndCommandBuffer(r->aux_command_buffer));
         r->in_aux_command_buffer = false;
 
+        CommandBufferFrame *frame = r->frame;
+        frame->start_time = r->command_buffer_start_time;
+
+        VkSemaphore transfer_semaphore = pgraph_vk_submit_transfer_commands(r);
+        if (r->transfer_queue) {
+            pgraph_vk_end_buffer_frame(pg, BUFFER_TRANSFER_STAGING);
+        }
+
         VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
         VkSubmitInfo submit_infos[] = {
             {
                 .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
                 .commandBufferCount = 1,
-                .pCommandBuffers = &r->aux_command_buffer,
+                .pCommandBuffers = &frame->aux_command_buffer,
+                .waitSemaphoreCount = transfer_semaphore ? 1 : 0,
+                .pWaitSemaphores = &transfer_semaphore,
+                .pWaitDstStageMask = &wait_stage,
                 .signalSemaphoreCount = 1,
-                .pSignalSemaphores = &r->command_buffer_semaphore,
+                .pSignalSemaphores = &frame->semaphore,
             },
             {
 
                 .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
                 .commandBufferCount = 1,
-                .pCommandBuffers = &r->command_buffer,
+                .pCommandBuffers = &frame->command_buffer,
                 .waitSemaphoreCount = 1,
-                .pWaitSemaphores = &r->command_buffer_semaphore,
+                .pWaitSemaphores = &frame->semaphore,
                 .pWaitDstStageMask = &wait_stage,
             }
         };
+        VkTimelineSemaphoreSubmitInfo timeline_info;
+        pgraph_vk_signal_timeline(r, &submit_infos[1], &timeline_info,
+                                  &frame->timeline_value);
+        VkSemaphore signal_semaphores[2];
+        uint64_t signal_values[2];
+        pgraph_vk_signal_present(r, &submit_infos[1], &timeline_info,
+                                 signal_semaphores, signal_values);
+        pgraph_vk_mark_surfaces_written(r, frame->timeline_value);
+
         nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT);
-        vkResetFences(r->device, 1, &r->command_buffer_fence);
+        VkFence fence = VK_NULL_HANDLE;
+        if (!r->timeline_semaphore) {
+            fence = frame->fence;
+            vkResetFences(r->device, 1, &fence);
+        }
         VK_CHECK(vkQueueSubmit(r->queue, ARRAY_SIZE(submit_infos), submit_infos,
-                               r->command_buffer_fence));
+                               fence));
         r->submit_count += 1;
+        r->in_command_buffer = false;
 
         bool check_budget = false;
 
@@ -1277,12 +2312,19 @@ void pgraph_vk_finish(PGRAPHState *pg, FinishReason finish_reason)
             check_budget = true;
         }
 
-        VK_CHECK(vkWaitForFences(r->device, 1, &r->command_buffer_fence,
-                                 VK_TRUE, UINT64_MAX));
+        /*
+         * Compute descriptor sets are not part of the frame ring, if any were
+         * written the frame has to complete before they can be reused.
+         */
+        if (finish_reason_needs_idle(finish_reason) ||
+            r->compute.descriptor_set_index > 0) {
+            pgraph_vk_wait_for_all_submits(r);
+        } else {
+            pgraph_vk_retire_completed_submits(r);
+        }
 
-        r->descriptor_set_index = 0;
-        r->in_command_buffer = false;
-        destroy_framebuffers(pg);
+        pgraph_vk_advance_frame(pg);
+        pgraph_vk_reset_descriptor_sets(r);
 
         if (check_budget) {
             pgraph_vk_check_memory_budget(pg);
@@ -1293,6 +2335,13 @@ void pgraph_vk_finish(PGRAPHState *pg, FinishReason finish_reason)
     pgraph_vk_process_pending_reports_internal(d);
 
     pgraph_vk_compute_finish_complete(r);
+
+    if (zone_start) {
+        timeline_end("finish",
+                     nv2a_profile_get_counter_name(
+                         finish_reason_to_counter_enum[finish_reason]),
+                     zone_start);
+    }
 }
 
 void pgraph_vk_begin_command_buffer(PGRAPHState *pg)
@@ -1306,6 +2355,7 @@ void pgraph_vk_begin_command_buffer(PGRAPHState *pg)
     };
     VK_CHECK(vkBeginCommandBuffer(r->command_buffer,
                                   &command_buffer_begin_info));
+    pgraph_vk_begin_command_buffer_timer(r, r->command_buffer);
     r->command_buffer_start_time = pg->draw_time;
     r->in_command_buffer = true;
 }
@@ -1326,6 +2376,7 @@ void pgraph_vk_ensure_not_in_render_pass(PGRAPHState *pg)
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     end_render_pass(r);
+    flush_pending_clear(r);
     if (r->query_in_flight) {
         end_query(r);
     }
@@ -1352,7 +2403,11 @@ void pgraph_vk_end_nondraw_commands(PGRAPHState *pg, VkCommandBuffer cmd)
 // buffer. For other reasons though (like descriptor set amount, surface
 // changes, etc) we do flush often.
 
-static void begin_pre_draw(PGRAPHState *pg)
+/*
+ * Returns false if the draw has to be skipped because its shaders are still
+ * being compiled.
+ */
+static bool begin_pre_draw(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
@@ -1362,8 +2417,8 @@ static void begin_pre_draw(PGRAPHState *pg)
 
     if (pg->clearing) {
         create_clear_pipeline(pg);
-    } else {
-        create_pipeline(pg);
+    } else if (!create_pipeline(pg)) {
+        return false;
     }
 
     bool render_pass_dirty = r->pipeline_binding->render_pass != r->render_pass;
@@ -1374,18 +2429,17 @@ static void begin_pre_draw(PGRAPHState *pg)
     if (render_pass_dirty) {
         r->render_pass = r->pipeline_binding->render_pass;
     }
-    if (r->framebuffer_dirty) {
-        create_frame_buffer(pg);
+    if (r->framebuffer_dirty || render_pass_dirty || !r->framebuffer_binding) {
+        bind_framebuffer(pg);
         r->framebuffer_dirty = false;
     }
     if (!pg->clearing) {
         pgraph_vk_update_descriptor_sets(pg);
     }
-    if (r->framebuffer_index == 0) {
-        create_frame_buffer(pg);
-    }
 
     pgraph_vk_ensure_command_buffer(pg);
+
+    return true;
 }
 
 static float clamp_line_width_to_device_limits(PGRAPHState *pg, float width)
@@ -1403,6 +2457,85 @@ static float clamp_line_width_to_device_limits(PGRAPHState *pg, float width)
     return fminf(fmaxf(min_width, width), max_width);
 }
 
+static void set_dynamic_state(PGRAPHState *pg, bool force)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    uint32_t regs[ARRAY_SIZE(dynamic_state_regs)];
+    QEMU_BUILD_BUG_ON(sizeof(regs) != sizeof(r->dynamic_state_regs));
+    for (int i = 0; i < ARRAY_SIZE(dynamic_state_regs); i++) {
+        regs[i] = pgraph_reg_r(pg, dynamic_state_regs[i]);
+    }
+    if (!force && !memcmp(regs, r->dynamic_state_regs, sizeof(regs))) {
+        return;
+    }
+    memcpy(r->dynamic_state_regs, regs, sizeof(regs));
+
+    uint32_t blend_color = regs[0];
+    uint32_t control_0 = regs[1];
+    uint32_t control_1 = regs[2];
+    uint32_t control_2 = regs[3];
+    uint32_t setupraster = regs[4];
+
+    float blend_constant[4];
+    pgraph_argb_pack32_to_rgba_float(blend_color, blend_constant);
+    pgraph_vk_cmd_set_blend_constants(r, blend_constant);
+
+    pgraph_vk_cmd_set_stencil_compare_mask(
+        r, VK_STENCIL_FACE_FRONT_AND_BACK,
+        GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ));
+    pgraph_vk_cmd_set_stencil_write_mask(
+        r, VK_STENCIL_FACE_FRONT_AND_BACK,
+        GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
+    pgraph_vk_cmd_set_stencil_reference(
+        r, VK_STENCIL_FACE_FRONT_AND_BACK,
+        GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_REF));
+
+    if (!r->extended_dynamic_state_extension_enabled) {
+        return;
+    }
+
+    VkCullModeFlags cull_mode = VK_CULL_MODE_NONE;
+    if (setupraster & NV_PGRAPH_SETUPRASTER_CULLENABLE) {
+        uint32_t cull_face = GET_MASK(setupraster,
+                                      NV_PGRAPH_SETUPRASTER_CULLCTRL);
+        assert(cull_face < ARRAY_SIZE(pgraph_cull_face_vk_map));
+        cull_mode = pgraph_cull_face_vk_map[cull_face];
+    }
+    pgraph_vk_cmd_set_cull_mode(r, cull_mode);
+    pgraph_vk_cmd_set_front_face(
+        r, (setupraster & NV_PGRAPH_SETUPRASTER_FRONTFACE) ?
+               VK_FRONT_FACE_COUNTER_CLOCKWISE :
+               VK_FRONT_FACE_CLOCKWISE);
+
+    uint32_t depth_func = GET_MASK(control_0, NV_PGRAPH_CONTROL_0_ZFUNC);
+    assert(depth_func < ARRAY_SIZE(pgraph_depth_func_vk_map));
+    pgraph_vk_cmd_set_depth_test_enable(
+        r, !!(control_0 & NV_PGRAPH_CONTROL_0_ZENABLE));
+    pgraph_vk_cmd_set_depth_write_enable(
+        r, !!(control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE));
+    pgraph_vk_cmd_set_depth_compare_op(r, pgraph_depth_func_vk_map[depth_func]);
+
+    uint32_t stencil_func =
+        GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_FUNC);
+    uint32_t op_fail = GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL);
+    uint32_t op_zfail =
+        GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL);
+    uint32_t op_zpass =
+        GET_MASK(control_2, NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS);
+    assert(stencil_func < ARRAY_SIZE(pgraph_stencil_func_vk_map));
+    assert(op_fail < ARRAY_SIZE(pgraph_stencil_op_vk_map));
+    assert(op_zfail < ARRAY_SIZE(pgraph_stencil_op_vk_map));
+    assert(op_zpass < ARRAY_SIZE(pgraph_stencil_op_vk_map));
+    pgraph_vk_cmd_set_stencil_test_enable(
+        r, !!(control_1 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE));
+    pgraph_vk_cmd_set_stencil_op(r, VK_STENCIL_FACE_FRONT_AND_BACK,
+                                 pgraph_stencil_op_vk_map[op_fail],
+                                 pgraph_stencil_op_vk_map[op_zpass],
+                                 pgraph_stencil_op_vk_map[op_zfail],
+                                 pgraph_stencil_func_vk_map[stencil_func]);
+}
+
 static void begin_draw(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
@@ -1424,10 +2557,6 @@ static void begin_draw(PGRAPHState *pg)
         end_query(r);
     }
 
-    if (pg->clearing) {
-        end_render_pass(r);
-    }
-
     bool must_bind_pipeline = r->pipeline_binding_changed;
 
     if (!r->in_render_pass) {
@@ -1437,8 +2566,7 @@ static void begin_draw(PGRAPHState *pg)
 
     if (must_bind_pipeline) {
         nv2a_profile_inc_counter(NV2A_PROF_PIPELINE_BIND);
-        vkCmdBindPipeline(r->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          r->pipeline_binding->pipeline);
+        pgraph_vk_cmd_bind_pipeline(r, r->pipeline_binding->pipeline);
         r->pipeline_binding->draw_time = pg->draw_time;
 
         unsigned int vp_width = pg->surface_binding_dim.width,
@@ -1451,7 +2579,7 @@ static void begin_draw(PGRAPHState *pg)
             .minDepth = 0.0,
             .maxDepth = 1.0,
         };
-        vkCmdSetViewport(r->command_buffer, 0, 1, &viewport);
+        pgraph_vk_cmd_set_viewport(r, &viewport);
 
         /* Surface clip */
         /* FIXME: Consider moving to PSH w/ window clip */
@@ -1473,18 +2601,19 @@ static void begin_draw(PGRAPHState *pg)
             .extent.width = scissor_width,
             .extent.height = scissor_height,
         };
-        vkCmdSetScissor(r->command_buffer, 0, 1, &scissor);
+        pgraph_vk_cmd_set_scissor(r, &scissor);
 
         if (r->pipeline_binding->has_dynamic_line_width) {
             float line_width =
                 clamp_line_width_to_device_limits(pg, pg->surface_scale_factor);
-            vkCmdSetLineWidth(r->command_buffer, line_width);
+            pgraph_vk_cmd_set_line_width(r, line_width);
         }
     }
 
     if (!pg->clearing) {
+        set_dynamic_state(pg, must_bind_pipeline);
         bind_descriptor_sets(pg);
-        push_vertex_attr_values(pg);
+        push_constants(pg);
     }
 
     r->in_draw = true;
@@ -1497,10 +2626,6 @@ static void end_draw(PGRAPHState *pg)
     assert(r->in_command_buffer);
     assert(r->in_render_pass);
 
-    if (pg->clearing) {
-        end_render_pass(r);
-    }
-
     r->in_draw = false;
 }
 
@@ -1626,12 +2751,14 @@ static void sync_vertex_ram_buffer(PGRAPHState *pg)
 
         NV2A_VK_DPRINTF("- %d: %08"HWADDR_PRIx" %zd bytes", i, addr, size);
 
-        if (memory_region_test_and_clear_dirty(d->vram, addr, size,
-                                               DIRTY_MEMORY_NV2A)) {
+        if (pgraph_vram_check_dirty(d, r->vertex_ram_vram_gens, addr, size)) {
             NV2A_VK_DPRINTF("Memory dirty. Synchronizing...");
             pgraph_vk_update_vertex_ram_buffer(pg, addr, d->vram_ptr + addr,
                                                size);
         }
+
+        bitmap_set(r->frame->vertex_ram_bitmap, addr / TARGET_PAGE_SIZE,
+                   size / TARGET_PAGE_SIZE);
     }
 
     r->num_vertex_ram_buffer_syncs = 0;
@@ -1678,10 +2805,6 @@ void pgraph_vk_clear_surface(NV2AState *d, uint32_t parameter)
                          write_zeta ? " zeta" : "");
 
     begin_pre_draw(pg);
-    pgraph_vk_begin_debug_marker(r, r->command_buffer,
-        RGBA_BLUE, "Clear %08" HWADDR_PRIx,
-        binding->vram_addr);
-    begin_draw(pg);
 
     // FIXME: What does hardware do when min >= max?
     // FIXME: What does hardware do when min >= surface size?
@@ -1708,8 +2831,17 @@ void pgraph_vk_clear_surface(NV2AState *d, uint32_t parameter)
         .layerCount = 1,
     };
 
+    unsigned int vp_width = pg->surface_binding_dim.width,
+                 vp_height = pg->surface_binding_dim.height;
+    pgraph_apply_scaling_factor(pg, &vp_width, &vp_height);
+
+    bool clear_whole_surface = xmin == 0 && ymin == 0 &&
+                               scissor_width >= vp_width &&
+                               scissor_height >= vp_height;
+
     int num_attachments = 0;
     VkClearAttachment attachments[2];
+    bool draw_color_clear = false;
 
     if (write_color && r->color_binding) {
         const bool clear_all_color_channels =
@@ -1726,11 +2858,7 @@ void pgraph_vk_clear_surface(NV2AState *d, uint32_t parameter)
                 pg, attachments[num_attachments].clearValue.color.float32);
             num_attachments++;
         } else {
-            float blend_constants[4];
-            pgraph_get_clear_color(pg, blend_constants);
-            vkCmdSetScissor(r->command_buffer, 0, 1, &clear_rect.rect);
-            vkCmdSetBlendConstants(r->command_buffer, blend_constants);
-            vkCmdDraw(r->command_buffer, 3, 1, 0, 0);
+            draw_color_clear = true;
         }
     }
 
@@ -1755,12 +2883,46 @@ void pgraph_vk_clear_surface(NV2AState *d, uint32_t parameter)
         };
     }
 
-    if (num_attachments) {
-        vkCmdClearAttachments(r->command_buffer, num_attachments, attachments,
-                              1, &clear_rect);
+    if (clear_whole_surface && !draw_color_clear && num_attachments) {
+        /*
+         * The cleared aspects are overwritten entirely, let the next pass
+         * clear them as it loads the attachments instead of loading them.
+         */
+        nv2a_profile_inc_counter(NV2A_PROF_CLEAR_LOAD_OP);
+        pgraph_vk_ensure_not_in_render_pass(pg);
+
+        VkImageAspectFlags aspects = 0;
+        VkClearValue color = { 0 }, depth_stencil = { 0 };
+        for (int i = 0; i < num_attachments; i++) {
+            aspects |= attachments[i].aspectMask;
+            if (attachments[i].aspectMask & VK_IMAGE_ASPECT_COLOR_BIT) {
+                color = attachments[i].clearValue;
+            } else {
+                depth_stencil = attachments[i].clearValue;
+            }
+        }
+        defer_clear(pg, aspects, color, depth_stencil);
+    } else {
+        pgraph_vk_begin_debug_marker(r, r->command_buffer, RGBA_BLUE,
+                                     "Clear %08" HWADDR_PRIx,
+                                     binding->vram_addr);
+        begin_draw(pg);
+
+        if (draw_color_clear) {
+            float blend_constants[4];
+            pgraph_get_clear_color(pg, blend_constants);
+            pgraph_vk_cmd_set_scissor(r, &clear_rect.rect);
+            pgraph_vk_cmd_set_blend_constants(r, blend_constants);
+            pgraph_vk_cmd_draw(r, 3, 1, 0, 0);
+        }
+        if (num_attachments) {
+            pgraph_vk_cmd_clear_attachments(r, num_attachments, attachments,
+                                            &clear_rect);
+        }
+
+        end_draw(pg);
+        pgraph_vk_end_debug_marker(r, r->command_buffer);
     }
-    end_draw(pg);
-    pgraph_vk_end_debug_marker(r, r->command_buffer);
 
     pg->clearing = false;
 
@@ -1818,9 +2980,8 @@ static void bind_vertex_buffer(PGRAPHState *pg, uint16_t inline_map,
         offsets[i] = offset + r->vertex_attribute_offsets[attr_idx];
     }
 
-    vkCmdBindVertexBuffers(r->command_buffer, 0,
-                           r->num_active_vertex_binding_descriptions, buffers,
-                           offsets);
+    pgraph_vk_cmd_bind_vertex_buffers(
+        r, 0, r->num_active_vertex_binding_descriptions, buffers, offsets);
 }
 
 static void bind_inline_vertex_buffer(PGRAPHState *pg, VkDeviceSize offset)
@@ -1854,16 +3015,6 @@ void pgraph_vk_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
     }
 }
 
-static bool ensure_buffer_space(PGRAPHState *pg, int index, VkDeviceSize size)
-{
-    if (!pgraph_vk_buffer_has_space_for(pg, index, size, 1)) {
-        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
-        return true;
-    }
-
-    return false;
-}
-
 static void get_size_and_count_for_format(VkFormat fmt, size_t *size, size_t *count)
 {
     static const struct {
@@ -1960,12 +3111,8 @@ static VertexBufferRemap remap_unaligned_attributes(PGRAPHState *pg,
 
     // reserve space
     if (remap.attributes) {
-        StorageBuffer *buffer = &r->storage_buffers[BUFFER_VERTEX_INLINE_STAGING];
-        VkDeviceSize starting_offset = ROUND_UP(buffer->buffer_offset, 16);
-        size_t total_space_required =
-            (starting_offset - buffer->buffer_offset) + remap.buffer_space_required;
-        ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING, total_space_required);
-        buffer->buffer_offset = ROUND_UP(buffer->buffer_offset, 16);
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING,
+                                      remap.buffer_space_required, 16);
     }
 
     return remap;
@@ -1984,8 +3131,8 @@ static void copy_remapped_attributes_to_inline_buffer(PGRAPHState *pg,
         return;
     }
 
-    assert(pgraph_vk_buffer_has_space_for(pg, BUFFER_VERTEX_INLINE_STAGING,
-                                          remap.buffer_space_required, 256));
+    VkDeviceSize base_offset = pgraph_vk_allocate_buffer_space(
+        pg, BUFFER_VERTEX_INLINE_STAGING, remap.buffer_space_required, 16);
 
     // FIXME: SIMD memcpy
     // FIXME: Caching
@@ -2000,7 +3147,7 @@ static void copy_remapped_attributes_to_inline_buffer(PGRAPHState *pg,
         }
 
         VkDeviceSize attr_buffer_offset =
-            buffer->buffer_offset + remap.map[attr_id].offset;
+            base_offset + remap.map[attr_id].offset;
 
         uint8_t *out_ptr = buffer->mapped + attr_buffer_offset;
         uint8_t *in_ptr = d->vram_ptr + r->vertex_attribute_offsets[attr_id];
@@ -2013,9 +3160,6 @@ static void copy_remapped_attributes_to_inline_buffer(PGRAPHState *pg,
 
         r->vertex_attribute_offsets[attr_id] = attr_buffer_offset;
     }
-
-
-    buffer->buffer_offset += remap.buffer_space_required;
 }
 
 void pgraph_vk_flush_draw(NV2AState *d)
@@ -2050,7 +3194,10 @@ void pgraph_vk_flush_draw(NV2AState *d)
         sync_vertex_ram_buffer(pg);
         VertexBufferRemap remap = remap_unaligned_attributes(pg, max_element);
 
-        begin_pre_draw(pg);
+        if (!begin_pre_draw(pg)) {
+            NV2A_VK_DGROUP_END();
+            return;
+        }
         copy_remapped_attributes_to_inline_buffer(pg, remap, 0, max_element);
         pgraph_vk_begin_debug_marker(r, r->command_buffer, RGBA_BLUE,
                                      "Draw Arrays");
@@ -2060,7 +3207,7 @@ void pgraph_vk_flush_draw(NV2AState *d)
             uint32_t start = pg->draw_arrays_start[i],
                      count = pg->draw_arrays_count[i];
             NV2A_VK_DPRINTF("- [%d] Start:%d Count:%d", i, start, count);
-            vkCmdDraw(r->command_buffer, count, 1, start, 0);
+            pgraph_vk_cmd_draw(r, count, 1, start, 0);
         }
         end_draw(pg);
         pgraph_vk_end_debug_marker(r, r->command_buffer);
@@ -2076,7 +3223,8 @@ void pgraph_vk_flush_draw(NV2AState *d)
         size_t index_data_size =
             pg->inline_elements_length * sizeof(pg->inline_elements[0]);
 
-        ensure_buffer_space(pg, BUFFER_INDEX_STAGING, index_data_size);
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_INDEX_STAGING, index_data_size,
+                                      1);
 
         uint32_t min_element = (uint32_t)-1;
         uint32_t max_element = 0;
@@ -2090,7 +3238,10 @@ void pgraph_vk_flush_draw(NV2AState *d)
         sync_vertex_ram_buffer(pg);
         VertexBufferRemap remap = remap_unaligned_attributes(pg, max_element + 1);
 
-        begin_pre_draw(pg);
+        if (!begin_pre_draw(pg)) {
+            NV2A_VK_DGROUP_END();
+            return;
+        }
         copy_remapped_attributes_to_inline_buffer(pg, remap, 0, max_element + 1);
         VkDeviceSize buffer_offset = pgraph_vk_update_index_buffer(
             pg, pg->inline_elements, index_data_size);
@@ -2098,11 +3249,10 @@ void pgraph_vk_flush_draw(NV2AState *d)
                                      "Inline Elements");
         begin_draw(pg);
         bind_vertex_buffer(pg, remap.attributes, 0);
-        vkCmdBindIndexBuffer(r->command_buffer,
-                             r->storage_buffers[BUFFER_INDEX].buffer,
-                             buffer_offset, VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(r->command_buffer, pg->inline_elements_length, 1, 0, 0,
-                         0);
+        pgraph_vk_cmd_bind_index_buffer(r,
+                                        r->storage_buffers[BUFFER_INDEX].buffer,
+                                        buffer_offset, VK_INDEX_TYPE_UINT32);
+        pgraph_vk_cmd_draw_indexed(r, pg->inline_elements_length, 1, 0, 0, 0);
         end_draw(pg);
         pgraph_vk_end_debug_marker(r, r->command_buffer);
 
@@ -2127,19 +3277,23 @@ void pgraph_vk_flush_draw(NV2AState *d)
             data[i] = attr->inline_buffer;
             sizes[i] = vertex_data_size;
 
-            attr->inline_buffer_populated = false;
             offset += vertex_data_size;
         }
-        ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING, offset);
+        pg->inline_buffer_attrs = 0;
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING, offset,
+                                      1);
 
-        begin_pre_draw(pg);
+        if (!begin_pre_draw(pg)) {
+            NV2A_VK_DGROUP_END();
+            return;
+        }
         VkDeviceSize buffer_offset = pgraph_vk_update_vertex_inline_buffer(
             pg, data, sizes, r->num_active_vertex_attribute_descriptions);
         pgraph_vk_begin_debug_marker(r, r->command_buffer, RGBA_BLUE,
                                      "Inline Buffer");
         begin_draw(pg);
         bind_inline_vertex_buffer(pg, buffer_offset);
-        vkCmdDraw(r->command_buffer, pg->inline_buffer_length, 1, 0, 0);
+        pgraph_vk_cmd_draw(r, pg->inline_buffer_length, 1, 0, 0);
         end_draw(pg);
         pgraph_vk_end_debug_marker(r, r->command_buffer);
 
@@ -2149,8 +3303,8 @@ void pgraph_vk_flush_draw(NV2AState *d)
         nv2a_profile_inc_counter(NV2A_PROF_INLINE_ARRAYS);
 
         VkDeviceSize inline_array_data_size = pg->inline_array_length * 4;
-        ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING,
-                               inline_array_data_size);
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_VERTEX_INLINE_STAGING,
+                                      inline_array_data_size, 1);
 
         unsigned int offset = 0;
         for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
@@ -2175,7 +3329,10 @@ void pgraph_vk_flush_draw(NV2AState *d)
         pgraph_vk_bind_vertex_attributes(d, 0, index_count - 1, true,
                                          vertex_size, index_count - 1);
 
-        begin_pre_draw(pg);
+        if (!begin_pre_draw(pg)) {
+            NV2A_VK_DGROUP_END();
+            return;
+        }
         void *inline_array_data = pg->inline_array;
         VkDeviceSize buffer_offset = pgraph_vk_update_vertex_inline_buffer(
             pg, &inline_array_data, &inline_array_data_size, 1);
@@ -2183,7 +3340,7 @@ void pgraph_vk_flush_draw(NV2AState *d)
                                      "Inline Array");
         begin_draw(pg);
         bind_inline_vertex_buffer(pg, buffer_offset);
-        vkCmdDraw(r->command_buffer, index_count, 1, 0, 0);
+        pgraph_vk_cmd_draw(r, index_count, 1, 0, 0);
         end_draw(pg);
         pgraph_vk_end_debug_marker(r, r->command_buffer);
         NV2A_VK_DGROUP_END();
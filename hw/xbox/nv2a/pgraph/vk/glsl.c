@@ -17,6 +17,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "hw/xbox/xbox_mem.h"
 #include "ui/xemu-settings.h"
 #include "renderer.h"
 
@@ -364,16 +365,78 @@ static glslang_stage_t vk_shader_stage_to_glslang_stage(VkShaderStageFlagBits st
     }
 }
 
+void pgraph_vk_init_shader_module_from_spv(PGRAPHVkState *r,
+                                           ShaderModuleInfo *info,
+                                           GByteArray *spv)
+{
+    info->spirv = spv;
+    info->module = pgraph_vk_create_shader_module_from_spv(r, info->spirv);
+    xbox_mem_add(XBOX_MEM_SHADER_CACHE, spv->len);
+    init_layout_from_spv(info);
+}
+
+/*
+ * Queues an internal shader to be compiled to SPIR-V along with the rest of
+ * the work done ahead, while the device is created.
+ */
+void pgraph_vk_compile_ahead(PGRAPHVkState *r, VkShaderStageFlagBits stage,
+                             const char *glsl)
+{
+    if (!r->init_ahead.shaders) {
+        r->init_ahead.shaders = g_array_new(false, false,
+                                            sizeof(InitAheadShader));
+    }
+    g_array_append_val(r->init_ahead.shaders,
+                       ((InitAheadShader){ .stage = stage, .glsl = glsl }));
+}
+
+/* Called on the init ahead thread, once the glslang process is set up */
+void pgraph_vk_run_compile_ahead(PGRAPHVkState *r)
+{
+    if (!r->init_ahead.shaders) {
+        return;
+    }
+
+    r->init_ahead.spv = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_byte_array_unref);
+    for (guint i = 0; i < r->init_ahead.shaders->len; i++) {
+        InitAheadShader *s =
+            &g_array_index(r->init_ahead.shaders, InitAheadShader, i);
+        g_hash_table_insert(
+            r->init_ahead.spv, (gpointer)s->glsl,
+            pgraph_vk_compile_glsl_to_spv(
+                vk_shader_stage_to_glslang_stage(s->stage), s->glsl));
+    }
+}
+
+void pgraph_vk_compile_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info,
+                                     VkShaderStageFlagBits stage,
+                                     const char *glsl)
+{
+    GByteArray *spv = NULL;
+
+    if (r->init_ahead.spv) {
+        spv = g_hash_table_lookup(r->init_ahead.spv, glsl);
+        if (spv) {
+            g_hash_table_steal(r->init_ahead.spv, glsl);
+        }
+    }
+    if (!spv) {
+        spv = pgraph_vk_compile_glsl_to_spv(
+            vk_shader_stage_to_glslang_stage(stage), glsl);
+    }
+
+    info->glsl = strdup(glsl);
+    pgraph_vk_init_shader_module_from_spv(r, info, spv);
+}
+
 ShaderModuleInfo *pgraph_vk_create_shader_module_from_glsl(
     PGRAPHVkState *r, VkShaderStageFlagBits stage, const char *glsl)
 {
     ShaderModuleInfo *info = g_malloc0(sizeof(*info));
     info->refcnt = 0;
-    info->glsl = strdup(glsl);
-    info->spirv = pgraph_vk_compile_glsl_to_spv(
-        vk_shader_stage_to_glslang_stage(stage), glsl);
-    info->module = pgraph_vk_create_shader_module_from_spv(r, info->spirv);
-    init_layout_from_spv(info);
+    pgraph_vk_compile_shader_module(r, info, stage, glsl);
+    info->ready = true;
     return info;
 }
 
@@ -408,11 +471,15 @@ void pgraph_vk_destroy_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info)
     if (info->glsl) {
         free(info->glsl);
     }
-    finalize_uniform_layout(&info->uniforms);
-    finalize_uniform_layout(&info->push_constants);
-    free(info->descriptor_sets);
-    spvReflectDestroyShaderModule(&info->reflect_module);
-    vkDestroyShaderModule(r->device, info->module, NULL);
-    g_byte_array_unref(info->spirv);
+    /* A module whose compile was cancelled has nothing else to release */
+    if (info->spirv) {
+        finalize_uniform_layout(&info->uniforms);
+        finalize_uniform_layout(&info->push_constants);
+        free(info->descriptor_sets);
+        spvReflectDestroyShaderModule(&info->reflect_module);
+        vkDestroyShaderModule(r->device, info->module, NULL);
+        xbox_mem_add(XBOX_MEM_SHADER_CACHE, -(int64_t)info->spirv->len);
+        g_byte_array_unref(info->spirv);
+    }
     g_free(info);
 }
@@ -585,6 +585,16 @@ static void determine_triangle_winding_order(uint8_t *pixels, int width,
     props->geom_shader_winding.tri_fan = (fan_rot + 2) % 3;
 }
 
+void pgraph_vk_compile_gpu_properties_shaders_ahead(PGRAPHVkState *r)
+{
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_VERTEX_BIT,
+                            vertex_shader_source);
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_GEOMETRY_BIT,
+                            geometry_shader_source);
+    pgraph_vk_compile_ahead(r, VK_SHADER_STAGE_FRAGMENT_BIT,
+                            fragment_shader_source);
+}
+
 void pgraph_vk_determine_gpu_properties(NV2AState *d)
 {
     const int width = 640;
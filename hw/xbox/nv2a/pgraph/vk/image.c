@@ -32,10 +32,17 @@ static bool check_format_has_stencil_component(VkFormat format)
            format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
 
-void pgraph_vk_transition_image_layout(PGRAPHState *pg, VkCommandBuffer cmd,
-                                       VkImage image, VkFormat format,
-                                       VkImageLayout oldLayout,
-                                       VkImageLayout newLayout)
+/*
+ * Fill in a barrier for a layout transition of a whole image, along with the
+ * stages it must be issued between. Barriers of several images can be merged
+ * into one vkCmdPipelineBarrier by combining their stage masks.
+ */
+void pgraph_vk_init_image_layout_barrier(VkImage image, VkFormat format,
+                                         VkImageLayout oldLayout,
+                                         VkImageLayout newLayout,
+                                         VkImageMemoryBarrier *out_barrier,
+                                         VkPipelineStageFlags *src_stage,
+                                         VkPipelineStageFlags *dst_stage)
 {
     VkImageMemoryBarrier barrier = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
@@ -200,10 +207,258 @@ void pgraph_vk_transition_image_layout(PGRAPHState *pg, VkCommandBuffer cmd,
         sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
         destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
 
+    // Src -> Shader Read
+    } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL &&
+               newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
     } else {
         assert(!"unsupported layout transition!");
     }
 
+    *out_barrier = barrier;
+    *src_stage = sourceStage;
+    *dst_stage = destinationStage;
+}
+
+void pgraph_vk_transition_image_layout(PGRAPHState *pg, VkCommandBuffer cmd,
+                                       VkImage image, VkFormat format,
+                                       VkImageLayout oldLayout,
+                                       VkImageLayout newLayout)
+{
+    VkImageMemoryBarrier barrier;
+    VkPipelineStageFlags sourceStage, destinationStage;
+
+    pgraph_vk_init_image_layout_barrier(image, format, oldLayout, newLayout,
+                                        &barrier, &sourceStage,
+                                        &destinationStage);
     vkCmdPipelineBarrier(cmd, sourceStage, destinationStage, 0, 0,
                          NULL, 0, NULL, 1, &barrier);
 }
+
+static const VkDeviceSize image_pool_block_size[IMAGE_POOL_COUNT] = {
+    [IMAGE_POOL_TEXTURE_SMALL] = 16 * 1024 * 1024,
+    [IMAGE_POOL_TEXTURE_LARGE] = 64 * 1024 * 1024,
+    [IMAGE_POOL_COLOR_SURFACE] = 128 * 1024 * 1024,
+    [IMAGE_POOL_ZETA_SURFACE] = 128 * 1024 * 1024,
+};
+
+static const int max_num_recycled_images = 64;
+static const VkDeviceSize max_recycled_image_bytes = 64 * 1024 * 1024;
+
+static enum ImagePool get_image_pool(const VkImageCreateInfo *create_info)
+{
+    if (create_info->usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+        return IMAGE_POOL_ZETA_SURFACE;
+    }
+    if (create_info->usage & VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT) {
+        return IMAGE_POOL_COLOR_SURFACE;
+    }
+
+    const uint64_t max_small_texture_texels = 256 * 256;
+    uint64_t texels = (uint64_t)create_info->extent.width *
+                      create_info->extent.height * create_info->extent.depth *
+                      create_info->arrayLayers;
+    return texels <= max_small_texture_texels ? IMAGE_POOL_TEXTURE_SMALL :
+                                                IMAGE_POOL_TEXTURE_LARGE;
+}
+
+static VmaPool get_or_create_image_pool(PGRAPHVkState *r, enum ImagePool pool,
+                                        const VkImageCreateInfo *create_info,
+                                        const VmaAllocationCreateInfo *alloc_create_info)
+{
+    if (r->image_pools[pool] || r->image_pool_unavailable[pool]) {
+        return r->image_pools[pool];
+    }
+
+    // Pools are bound to a memory type, pick it from the first image placed
+    uint32_t memory_type_index;
+    VkResult result = vmaFindMemoryTypeIndexForImageInfo(
+        r->allocator, create_info, alloc_create_info, &memory_type_index);
+    if (result == VK_SUCCESS) {
+        VmaPoolCreateInfo pool_create_info = {
+            .memoryTypeIndex = memory_type_index,
+            .blockSize = image_pool_block_size[pool],
+        };
+        result = vmaCreatePool(r->allocator, &pool_create_info,
+                               &r->image_pools[pool]);
+    }
+    if (result != VK_SUCCESS) {
+        NV2A_VK_DPRINTF("Image pool %d unavailable (%d)", pool, result);
+        r->image_pool_unavailable[pool] = true;
+        r->image_pools[pool] = VK_NULL_HANDLE;
+    }
+
+    return r->image_pools[pool];
+}
+
+static bool check_recycled_image_compatible(const VkImageCreateInfo *a,
+                                            const VkImageCreateInfo *b)
+{
+    return a->flags == b->flags && a->imageType == b->imageType &&
+           a->format == b->format && a->extent.width == b->extent.width &&
+           a->extent.height == b->extent.height &&
+           a->extent.depth == b->extent.depth &&
+           a->mipLevels == b->mipLevels && a->arrayLayers == b->arrayLayers &&
+           a->samples == b->samples && a->tiling == b->tiling &&
+           a->usage == b->usage && a->sharingMode == b->sharingMode;
+}
+
+static RecycledImage *
+take_compatible_recycled_image(PGRAPHVkState *r,
+                               const VkImageCreateInfo *create_info)
+{
+    RecycledImage *ri;
+    QTAILQ_FOREACH(ri, &r->recycled_images, entry) {
+        if (check_recycled_image_compatible(&ri->create_info, create_info)) {
+            QTAILQ_REMOVE(&r->recycled_images, ri, entry);
+            r->num_recycled_images -= 1;
+            r->residency.recycled_image_bytes -= ri->memory_size;
+            return ri;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Create an image for device access. A recycled image of the same shape is
+ * used if there is one, otherwise memory is sub-allocated from the pool of the
+ * image's class, falling back to a regular allocation if the image does not
+ * fit in the pool (e.g. it requires an incompatible memory type or is larger
+ * than a block). Image contents are undefined.
+ */
+void pgraph_vk_create_image(PGRAPHVkState *r,
+                            const VkImageCreateInfo *create_info,
+                            VkImage *image, VmaAllocation *allocation,
+                            VkDeviceSize *memory_size)
+{
+    RecycledImage *ri = take_compatible_recycled_image(r, create_info);
+    if (ri) {
+        *image = ri->image;
+        *allocation = ri->allocation;
+        *memory_size = ri->memory_size;
+        g_free(ri);
+        nv2a_profile_inc_counter(NV2A_PROF_IMAGE_RECYCLED);
+        return;
+    }
+
+    VmaAllocationCreateInfo alloc_create_info = {
+        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+    };
+    VmaAllocationInfo alloc_info;
+
+    enum ImagePool pool = get_image_pool(create_info);
+    alloc_create_info.pool = get_or_create_image_pool(r, pool, create_info,
+                                                      &alloc_create_info);
+    if (alloc_create_info.pool) {
+        if (vmaCreateImage(r->allocator, create_info, &alloc_create_info,
+                           image, allocation, &alloc_info) == VK_SUCCESS) {
+            *memory_size = alloc_info.size;
+            return;
+        }
+        alloc_create_info.pool = VK_NULL_HANDLE;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_IMAGE_UNPOOLED);
+    VK_CHECK(vmaCreateImage(r->allocator, create_info, &alloc_create_info,
+                            image, allocation, &alloc_info));
+    *memory_size = alloc_info.size;
+}
+
+/*
+ * Release an image created by pgraph_vk_create_image that is no longer used
+ * by the GPU, keeping it for reuse if there is room.
+ */
+void pgraph_vk_recycle_image(PGRAPHVkState *r,
+                             const VkImageCreateInfo *create_info,
+                             VkImage image, VmaAllocation allocation)
+{
+    VmaAllocationInfo alloc_info;
+    vmaGetAllocationInfo(r->allocator, allocation, &alloc_info);
+
+    if (alloc_info.size > max_recycled_image_bytes) {
+        vmaDestroyImage(r->allocator, image, allocation);
+        return;
+    }
+
+    // Make room by dropping the least recently released images
+    if (r->num_recycled_images >= max_num_recycled_images) {
+        pgraph_vk_trim_recycled_images(r, alloc_info.size);
+    }
+    if (r->residency.recycled_image_bytes + alloc_info.size >
+        max_recycled_image_bytes) {
+        pgraph_vk_trim_recycled_images(
+            r, r->residency.recycled_image_bytes + alloc_info.size -
+                   max_recycled_image_bytes);
+    }
+
+    RecycledImage *ri = g_malloc(sizeof(RecycledImage));
+    ri->create_info = *create_info;
+    ri->create_info.pNext = NULL;
+    ri->create_info.pQueueFamilyIndices = NULL;
+    ri->image = image;
+    ri->allocation = allocation;
+    ri->memory_size = alloc_info.size;
+
+    QTAILQ_INSERT_HEAD(&r->recycled_images, ri, entry);
+    r->num_recycled_images += 1;
+    r->residency.recycled_image_bytes += ri->memory_size;
+}
+
+/*
+ * Destroy recycled images, least recently released first, until at least
+ * `bytes` of device memory have been released. Returns the number of bytes
+ * released.
+ */
+VkDeviceSize pgraph_vk_trim_recycled_images(PGRAPHVkState *r,
+                                            VkDeviceSize bytes)
+{
+    VkDeviceSize freed = 0;
+
+    RecycledImage *ri, *prev;
+    QTAILQ_FOREACH_REVERSE_SAFE(ri, &r->recycled_images, entry, prev) {
+        if (freed >= bytes) {
+            break;
+        }
+        freed += ri->memory_size;
+        QTAILQ_REMOVE(&r->recycled_images, ri, entry);
+        r->num_recycled_images -= 1;
+        r->residency.recycled_image_bytes -= ri->memory_size;
+        vmaDestroyImage(r->allocator, ri->image, ri->allocation);
+        g_free(ri);
+    }
+
+    return freed;
+}
+
+void pgraph_vk_init_images(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    QTAILQ_INIT(&r->recycled_images);
+    r->num_recycled_images = 0;
+
+    for (int i = 0; i < IMAGE_POOL_COUNT; i++) {
+        r->image_pools[i] = VK_NULL_HANDLE;
+        r->image_pool_unavailable[i] = false;
+    }
+}
+
+void pgraph_vk_finalize_images(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    pgraph_vk_trim_recycled_images(r, VK_WHOLE_SIZE);
+    assert(QTAILQ_EMPTY(&r->recycled_images));
+
+    for (int i = 0; i < IMAGE_POOL_COUNT; i++) {
+        if (r->image_pools[i]) {
+            vmaDestroyPool(r->allocator, r->image_pools[i]);
+            r->image_pools[i] = VK_NULL_HANDLE;
+        }
+    }
+}
@@ -19,6 +19,7 @@
 
 #include "qemu/osdep.h"
 #include "ui/xemu-settings.h"
+#include "ui/xemu-headless.h"
 #include "renderer.h"
 #include "xemu-version.h"
 
@@ -99,6 +100,15 @@ static bool check_validation_layer_support(void)
 
 static void create_window(PGRAPHVkState *r, Error **errp)
 {
+    /*
+     * The window is only used to query the surface extensions, frames are
+     * presented through GL. Headless there is no video driver to create a
+     * Vulkan window with, so render without one.
+     */
+    if (xemu_headless_enabled()) {
+        return;
+    }
+
     r->window = SDL_CreateWindow(
         "SDL Offscreen Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
         640, 480, SDL_WINDOW_VULKAN | SDL_WINDOW_HIDDEN);
@@ -155,7 +165,10 @@ static StringArray *get_required_instance_extension_names(PGRAPHState *pg)
 
     // Add instance extensions SDL lists as required
     unsigned int sdl_count = 0;
-    SDL_Vulkan_GetInstanceExtensions((SDL_Window *)r->window, &sdl_count, NULL);
+    if (r->window) {
+        SDL_Vulkan_GetInstanceExtensions((SDL_Window *)r->window, &sdl_count,
+                                         NULL);
+    }
 
     StringArray *extensions =
         g_array_sized_new(FALSE, FALSE, sizeof(char *),
@@ -335,6 +348,7 @@ QueueFamilyIndices pgraph_vk_find_queue_families(VkPhysicalDevice device)
 {
     QueueFamilyIndices indices = {
         .queue_family = -1,
+        .transfer_queue_family = -1,
     };
 
     uint32_t num_queue_families = 0;
@@ -357,6 +371,16 @@ QueueFamilyIndices pgraph_vk_find_queue_families(VkPhysicalDevice device)
         }
     }
 
+    // Copy engine, typically able to run alongside the graphics queue
+    for (int i = 0; i < num_queue_families; i++) {
+        VkQueueFlags flags = queue_families[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            indices.transfer_queue_family = i;
+            break;
+        }
+    }
+
     return indices;
 }
 
@@ -404,6 +428,14 @@ static void add_optional_device_extension_names(
     r->memory_budget_extension_enabled = add_extension_if_available(
         available_extensions, enabled_extension_names,
         VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    r->extended_dynamic_state_extension_enabled = add_extension_if_available(
+        available_extensions, enabled_extension_names,
+        VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+
+    r->external_memory_host_extension_enabled = add_extension_if_available(
+        available_extensions, enabled_extension_names,
+        VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
 }
 
 static bool check_device_support_required_extensions(VkPhysicalDevice device)
@@ -528,12 +560,22 @@ static bool create_logical_device(PGRAPHState *pg, Error **errp)
 
     float queuePriority = 1.0f;
 
-    VkDeviceQueueCreateInfo queue_create_info = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = indices.queue_family,
-        .queueCount = 1,
-        .pQueuePriorities = &queuePriority,
+    VkDeviceQueueCreateInfo queue_create_infos[2] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = indices.queue_family,
+            .queueCount = 1,
+            .pQueuePriorities = &queuePriority,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = indices.transfer_queue_family,
+            .queueCount = 1,
+            .pQueuePriorities = &queuePriority,
+        },
     };
+    bool use_transfer_queue = indices.transfer_queue_family >= 0 &&
+                              g_config.display.vulkan.transfer_queue;
 
     // Check device features
     VkPhysicalDeviceFeatures physical_device_features;
@@ -556,10 +598,12 @@ static bool create_logical_device(PGRAPHState *pg, Error **errp)
         F(depthClamp, true),
         F(fillModeNonSolid, true),
         F(geometryShader, true),
+        F(inheritedQueries, false),
         F(occlusionQueryPrecise, true),
         F(samplerAnisotropy, false),
         F(shaderClipDistance, true),
         F(shaderTessellationAndGeometryPointSize, true),
+        F(textureCompressionBC, false),
         F(wideLines, false),
         #undef F
         // clang-format on
@@ -595,10 +639,87 @@ static bool create_logical_device(PGRAPHState *pg, Error **errp)
         next_struct = &custom_border_features;
     }
 
+    VkPhysicalDeviceExtendedDynamicStateFeaturesEXT
+        extended_dynamic_state_features;
+    if (r->extended_dynamic_state_extension_enabled) {
+        extended_dynamic_state_features =
+            (VkPhysicalDeviceExtendedDynamicStateFeaturesEXT){
+                .sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT,
+                .extendedDynamicState = VK_TRUE,
+                .pNext = next_struct,
+            };
+        next_struct = &extended_dynamic_state_features;
+    }
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    };
+    VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+        .pNext = &timeline_semaphore_features,
+    };
+    VkPhysicalDeviceDescriptorIndexingProperties descriptor_indexing_props = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES,
+    };
+    if (r->device_props.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceFeatures2 features2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &descriptor_indexing_features,
+        };
+        vkGetPhysicalDeviceFeatures2(r->physical_device, &features2);
+
+        VkPhysicalDeviceProperties2 props2 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &descriptor_indexing_props,
+        };
+        vkGetPhysicalDeviceProperties2(r->physical_device, &props2);
+    }
+    r->timeline_semaphore_enabled =
+        timeline_semaphore_features.timelineSemaphore == VK_TRUE;
+    if (r->timeline_semaphore_enabled) {
+        timeline_semaphore_features.pNext = next_struct;
+        next_struct = &timeline_semaphore_features;
+    }
+
+    // Textures are sampled through a descriptor array which is updated as
+    // textures are created, while command buffers using other entries of it
+    // may still be pending
+    r->bindless_textures_enabled =
+        g_config.display.vulkan.bindless_textures &&
+        physical_device_features.shaderSampledImageArrayDynamicIndexing &&
+        descriptor_indexing_features.descriptorBindingPartiallyBound &&
+        descriptor_indexing_features
+            .descriptorBindingSampledImageUpdateAfterBind &&
+        descriptor_indexing_features
+            .descriptorBindingUpdateUnusedWhilePending &&
+        descriptor_indexing_props
+                .maxPerStageDescriptorUpdateAfterBindSampledImages >=
+            NV2A_VK_BINDLESS_TEXTURE_COUNT &&
+        descriptor_indexing_props
+                .maxDescriptorSetUpdateAfterBindSampledImages >=
+            NV2A_VK_BINDLESS_TEXTURE_COUNT;
+    if (r->bindless_textures_enabled) {
+        r->enabled_physical_device_features
+            .shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+        descriptor_indexing_features = (VkPhysicalDeviceDescriptorIndexingFeatures){
+            .sType =
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+            .descriptorBindingPartiallyBound = VK_TRUE,
+            .descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+            .descriptorBindingUpdateUnusedWhilePending = VK_TRUE,
+            .pNext = next_struct,
+        };
+        next_struct = &descriptor_indexing_features;
+    }
+    NV2A_VK_DPRINTF("Bindless textures: %s",
+                    r->bindless_textures_enabled ? "enabled" : "disabled");
+
     VkDeviceCreateInfo device_create_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .queueCreateInfoCount = 1,
-        .pQueueCreateInfos = &queue_create_info,
+        .queueCreateInfoCount = use_transfer_queue ? 2 : 1,
+        .pQueueCreateInfos = queue_create_infos,
         .pEnabledFeatures = &r->enabled_physical_device_features,
         .enabledExtensionCount = enabled_extension_names->len,
         .ppEnabledExtensionNames =
@@ -619,6 +740,18 @@ static bool create_logical_device(PGRAPHState *pg, Error **errp)
     }
 
     vkGetDeviceQueue(r->device, indices.queue_family, 0, &r->queue);
+    r->queue_family = indices.queue_family;
+
+    r->transfer_queue = VK_NULL_HANDLE;
+    r->transfer_queue_family = -1;
+    if (use_transfer_queue) {
+        vkGetDeviceQueue(r->device, indices.transfer_queue_family, 0,
+                         &r->transfer_queue);
+        r->transfer_queue_family = indices.transfer_queue_family;
+    }
+    NV2A_VK_DPRINTF("Transfer queue: %s",
+                    use_transfer_queue ? "dedicated" : "graphics");
+
     return true;
 }
 
@@ -0,0 +1,861 @@
+/*
+ * Geforce NV2A PGRAPH Vulkan Renderer
+ *
+ * Copyright (c) 2024 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Commands recorded inside PGRAPH render passes go through the
+ * pgraph_vk_cmd_* wrappers below. Normally they are recorded straight into
+ * r->command_buffer. When recording threads are enabled, the draws of a render
+ * pass are instead encoded into batches, each of which a worker thread records
+ * into a secondary command buffer while emulation continues. The batches are
+ * executed in order from the primary command buffer when the pass ends.
+ *
+ * A secondary command buffer does not inherit any state, so every batch starts
+ * by replaying the last command of each kind of state that was set before it.
+ */
+
+#include "qemu/osdep.h"
+#include "ui/xemu-settings.h"
+#include "renderer.h"
+
+#define RECORD_BATCH_MAX_DRAWS 128
+#define RECORD_MAX_THREADS 8
+
+typedef enum RecordedCommandType {
+    // State that draws depend on, replayed at the start of each batch
+    RECORDED_CMD_BIND_PIPELINE,
+    RECORDED_CMD_SET_VIEWPORT,
+    RECORDED_CMD_SET_SCISSOR,
+    RECORDED_CMD_SET_LINE_WIDTH,
+    RECORDED_CMD_SET_BLEND_CONSTANTS,
+    RECORDED_CMD_SET_STENCIL_COMPARE_MASK,
+    RECORDED_CMD_SET_STENCIL_WRITE_MASK,
+    RECORDED_CMD_SET_STENCIL_REFERENCE,
+    RECORDED_CMD_SET_CULL_MODE,
+    RECORDED_CMD_SET_FRONT_FACE,
+    RECORDED_CMD_SET_DEPTH_TEST_ENABLE,
+    RECORDED_CMD_SET_DEPTH_WRITE_ENABLE,
+    RECORDED_CMD_SET_DEPTH_COMPARE_OP,
+    RECORDED_CMD_SET_STENCIL_TEST_ENABLE,
+    RECORDED_CMD_SET_STENCIL_OP,
+    RECORDED_CMD_BIND_DESCRIPTOR_SETS,
+    RECORDED_CMD_PUSH_CONSTANTS,
+    RECORDED_CMD_BIND_VERTEX_BUFFERS,
+    RECORDED_CMD_BIND_INDEX_BUFFER,
+    RECORDED_CMD__NUM_STATE,
+
+    // Actions
+    RECORDED_CMD_DRAW = RECORDED_CMD__NUM_STATE,
+    RECORDED_CMD_DRAW_INDEXED,
+    RECORDED_CMD_CLEAR_ATTACHMENTS,
+} RecordedCommandType;
+
+typedef struct RecordedCommand {
+    RecordedCommandType type;
+    union {
+        VkPipeline pipeline;
+        VkViewport viewport;
+        VkRect2D scissor;
+        float line_width;
+        float blend_constants[4];
+        struct {
+            VkStencilFaceFlags face;
+            uint32_t value;
+        } stencil;
+        VkCullModeFlags cull_mode;
+        VkFrontFace front_face;
+        VkBool32 enable;
+        VkCompareOp compare_op;
+        struct {
+            VkStencilFaceFlags face;
+            VkStencilOp fail_op, pass_op, depth_fail_op;
+            VkCompareOp compare_op;
+        } stencil_op;
+        struct {
+            VkPipelineLayout layout;
+            uint32_t num_sets;
+            VkDescriptorSet sets[2];
+            uint32_t num_dynamic_offsets;
+            uint32_t dynamic_offsets[4];
+        } descriptor_sets;
+        struct {
+            VkPipelineLayout layout;
+            VkShaderStageFlags stages;
+            uint32_t offset, size;
+            uint8_t values[NV2A_MAX_TEXTURES * sizeof(uint32_t) +
+                           NV2A_VERTEXSHADER_ATTRIBUTES * 4 * sizeof(float)];
+        } push_constants;
+        struct {
+            uint32_t first, count;
+            VkBuffer buffers[NV2A_VERTEXSHADER_ATTRIBUTES];
+            VkDeviceSize offsets[NV2A_VERTEXSHADER_ATTRIBUTES];
+        } vertex_buffers;
+        struct {
+            VkBuffer buffer;
+            VkDeviceSize offset;
+            VkIndexType type;
+        } index_buffer;
+        struct {
+            uint32_t vertex_count, instance_count;
+            uint32_t first_vertex, first_instance;
+        } draw;
+        struct {
+            uint32_t index_count, instance_count, first_index;
+            int32_t vertex_offset;
+            uint32_t first_instance;
+        } draw_indexed;
+        struct {
+            uint32_t count;
+            VkClearAttachment attachments[2];
+            VkClearRect rect;
+        } clear;
+    };
+} RecordedCommand;
+
+typedef struct RecordBatch {
+    GArray *commands; // RecordedCommand
+    int num_draws;
+    int frame_index;
+    VkRenderPass render_pass;
+    VkFramebuffer framebuffer;
+    bool occlusion_query;
+    VkCommandBuffer command_buffer; // Set by the worker
+    bool done;
+} RecordBatch;
+
+typedef struct RecordWorkerFrame {
+    VkCommandPool command_pool; // Reset when the frame is reused
+    GArray *command_buffers; // VkCommandBuffer
+    int num_used;
+} RecordWorkerFrame;
+
+typedef struct RecordWorker {
+    PGRAPHVkState *r;
+    QemuThread thread;
+    RecordWorkerFrame frames[NV2A_VK_MAX_FRAMES_IN_FLIGHT];
+} RecordWorker;
+
+struct CommandRecorder {
+    RecordWorker *workers;
+    int num_workers;
+
+    QemuMutex lock;
+    QemuCond work_cond; // Batch queued or stopping
+    QemuCond done_cond; // Batch recorded
+    GQueue queue; // RecordBatch
+    bool stop;
+
+    // Render pass being recorded into batches, only touched by PFIFO thread
+    bool active;
+    VkRenderPass render_pass;
+    VkFramebuffer framebuffer;
+    bool occlusion_query;
+    RecordBatch **batches; // Of the current pass, reused across passes
+    VkCommandBuffer *command_buffers; // Parallel to batches
+    int num_batches, max_batches;
+    RecordBatch *batch; // Open for new commands, or NULL
+    RecordedCommand state[RECORDED_CMD__NUM_STATE];
+    uint32_t state_valid; // Bitmask of RecordedCommandType
+};
+
+QEMU_BUILD_BUG_ON(RECORDED_CMD__NUM_STATE > 32);
+
+static void execute_command(VkCommandBuffer cmd, const RecordedCommand *c)
+{
+    switch (c->type) {
+    case RECORDED_CMD_BIND_PIPELINE:
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, c->pipeline);
+        break;
+    case RECORDED_CMD_SET_VIEWPORT:
+        vkCmdSetViewport(cmd, 0, 1, &c->viewport);
+        break;
+    case RECORDED_CMD_SET_SCISSOR:
+        vkCmdSetScissor(cmd, 0, 1, &c->scissor);
+        break;
+    case RECORDED_CMD_SET_LINE_WIDTH:
+        vkCmdSetLineWidth(cmd, c->line_width);
+        break;
+    case RECORDED_CMD_SET_BLEND_CONSTANTS:
+        vkCmdSetBlendConstants(cmd, c->blend_constants);
+        break;
+    case RECORDED_CMD_SET_STENCIL_COMPARE_MASK:
+        vkCmdSetStencilCompareMask(cmd, c->stencil.face, c->stencil.value);
+        break;
+    case RECORDED_CMD_SET_STENCIL_WRITE_MASK:
+        vkCmdSetStencilWriteMask(cmd, c->stencil.face, c->stencil.value);
+        break;
+    case RECORDED_CMD_SET_STENCIL_REFERENCE:
+        vkCmdSetStencilReference(cmd, c->stencil.face, c->stencil.value);
+        break;
+    case RECORDED_CMD_SET_CULL_MODE:
+        vkCmdSetCullModeEXT(cmd, c->cull_mode);
+        break;
+    case RECORDED_CMD_SET_FRONT_FACE:
+        vkCmdSetFrontFaceEXT(cmd, c->front_face);
+        break;
+    case RECORDED_CMD_SET_DEPTH_TEST_ENABLE:
+        vkCmdSetDepthTestEnableEXT(cmd, c->enable);
+        break;
+    case RECORDED_CMD_SET_DEPTH_WRITE_ENABLE:
+        vkCmdSetDepthWriteEnableEXT(cmd, c->enable);
+        break;
+    case RECORDED_CMD_SET_DEPTH_COMPARE_OP:
+        vkCmdSetDepthCompareOpEXT(cmd, c->compare_op);
+        break;
+    case RECORDED_CMD_SET_STENCIL_TEST_ENABLE:
+        vkCmdSetStencilTestEnableEXT(cmd, c->enable);
+        break;
+    case RECORDED_CMD_SET_STENCIL_OP:
+        vkCmdSetStencilOpEXT(cmd, c->stencil_op.face, c->stencil_op.fail_op,
+                             c->stencil_op.pass_op, c->stencil_op.depth_fail_op,
+                             c->stencil_op.compare_op);
+        break;
+    case RECORDED_CMD_BIND_DESCRIPTOR_SETS:
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                c->descriptor_sets.layout, 0,
+                                c->descriptor_sets.num_sets,
+                                c->descriptor_sets.sets,
+                                c->descriptor_sets.num_dynamic_offsets,
+                                c->descriptor_sets.dynamic_offsets);
+        break;
+    case RECORDED_CMD_PUSH_CONSTANTS:
+        vkCmdPushConstants(cmd, c->push_constants.layout,
+                           c->push_constants.stages, c->push_constants.offset,
+                           c->push_constants.size, c->push_constants.values);
+        break;
+    case RECORDED_CMD_BIND_VERTEX_BUFFERS:
+        vkCmdBindVertexBuffers(cmd, c->vertex_buffers.first,
+                               c->vertex_buffers.count,
+                               c->vertex_buffers.buffers,
+                               c->vertex_buffers.offsets);
+        break;
+    case RECORDED_CMD_BIND_INDEX_BUFFER:
+        vkCmdBindIndexBuffer(cmd, c->index_buffer.buffer,
+                             c->index_buffer.offset, c->index_buffer.type);
+        break;
+    case RECORDED_CMD_DRAW:
+        vkCmdDraw(cmd, c->draw.vertex_count, c->draw.instance_count,
+                  c->draw.first_vertex, c->draw.first_instance);
+        break;
+    case RECORDED_CMD_DRAW_INDEXED:
+        vkCmdDrawIndexed(cmd, c->draw_indexed.index_count,
+                         c->draw_indexed.instance_count,
+                         c->draw_indexed.first_index,
+                         c->draw_indexed.vertex_offset,
+                         c->draw_indexed.first_instance);
+        break;
+    case RECORDED_CMD_CLEAR_ATTACHMENTS:
+        vkCmdClearAttachments(cmd, c->clear.count, c->clear.attachments, 1,
+                              &c->clear.rect);
+        break;
+    default:
+        assert(!"Invalid recorded command");
+    }
+}
+
+static VkCommandBuffer get_worker_command_buffer(PGRAPHVkState *r,
+                                                 RecordWorker *w,
+                                                 int frame_index)
+{
+    RecordWorkerFrame *frame = &w->frames[frame_index];
+
+    if (frame->num_used == frame->command_buffers->len) {
+        VkCommandBufferAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = frame->command_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = 1,
+        };
+        VkCommandBuffer cmd;
+        VK_CHECK(vkAllocateCommandBuffers(r->device, &alloc_info, &cmd));
+        g_array_append_val(frame->command_buffers, cmd);
+    }
+
+    return g_array_index(frame->command_buffers, VkCommandBuffer,
+                         frame->num_used++);
+}
+
+static void record_batch(PGRAPHVkState *r, RecordWorker *w, RecordBatch *batch)
+{
+    VkCommandBuffer cmd = get_worker_command_buffer(r, w, batch->frame_index);
+
+    VkCommandBufferInheritanceInfo inheritance_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass = batch->render_pass,
+        .subpass = 0,
+        .framebuffer = batch->framebuffer,
+        .occlusionQueryEnable = batch->occlusion_query,
+    };
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                 VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+        .pInheritanceInfo = &inheritance_info,
+    };
+    VK_CHECK(vkBeginCommandBuffer(cmd, &begin_info));
+
+    for (int i = 0; i < batch->commands->len; i++) {
+        execute_command(cmd,
+                        &g_array_index(batch->commands, RecordedCommand, i));
+    }
+
+    VK_CHECK(vkEndCommandBuffer(cmd));
+    batch->command_buffer = cmd;
+}
+
+static void *record_thread(void *opaque)
+{
+    RecordWorker *w = opaque;
+    PGRAPHVkState *r = w->r;
+    CommandRecorder *rec = r->recorder;
+
+    qemu_mutex_lock(&rec->lock);
+    while (true) {
+        while (!rec->stop && g_queue_is_empty(&rec->queue)) {
+            qemu_cond_wait(&rec->work_cond, &rec->lock);
+        }
+        if (rec->stop) {
+            break;
+        }
+
+        RecordBatch *batch = g_queue_pop_head(&rec->queue);
+        qemu_mutex_unlock(&rec->lock);
+
+        record_batch(r, w, batch);
+
+        qemu_mutex_lock(&rec->lock);
+        batch->done = true;
+        qemu_cond_broadcast(&rec->done_cond);
+    }
+    qemu_mutex_unlock(&rec->lock);
+
+    return NULL;
+}
+
+static void dispatch_batch(CommandRecorder *rec)
+{
+    assert(rec->batch);
+
+    nv2a_profile_inc_counter(NV2A_PROF_RECORD_BATCH);
+
+    qemu_mutex_lock(&rec->lock);
+    g_queue_push_tail(&rec->queue, rec->batch);
+    qemu_cond_signal(&rec->work_cond);
+    qemu_mutex_unlock(&rec->lock);
+
+    rec->batch = NULL;
+}
+
+static void open_batch(PGRAPHVkState *r)
+{
+    CommandRecorder *rec = r->recorder;
+
+    assert(!rec->batch);
+
+    if (rec->num_batches == rec->max_batches) {
+        rec->max_batches = MAX(8, 2 * rec->max_batches);
+        rec->batches =
+            g_renew(RecordBatch *, rec->batches, rec->max_batches);
+        rec->command_buffers =
+            g_renew(VkCommandBuffer, rec->command_buffers, rec->max_batches);
+        for (int i = rec->num_batches; i < rec->max_batches; i++) {
+            rec->batches[i] = g_new0(RecordBatch, 1);
+            rec->batches[i]->commands =
+                g_array_new(false, false, sizeof(RecordedCommand));
+        }
+    }
+
+    RecordBatch *batch = rec->batches[rec->num_batches++];
+    g_array_set_size(batch->commands, 0);
+    batch->num_draws = 0;
+    batch->frame_index = r->submit_count % r->num_frames;
+    batch->render_pass = rec->render_pass;
+    batch->framebuffer = rec->framebuffer;
+    batch->occlusion_query = rec->occlusion_query;
+    batch->command_buffer = VK_NULL_HANDLE;
+    batch->done = false;
+
+    // State is not inherited, start from where the previous batch left off
+    for (int i = 0; i < RECORDED_CMD__NUM_STATE; i++) {
+        if (rec->state_valid & (1 << i)) {
+            g_array_append_val(batch->commands, rec->state[i]);
+        }
+    }
+
+    rec->batch = batch;
+}
+
+static void record_command(PGRAPHVkState *r, const RecordedCommand *c)
+{
+    CommandRecorder *rec = r->recorder;
+
+    if (!rec || !rec->active) {
+        execute_command(r->command_buffer, c);
+        return;
+    }
+
+    if (!rec->batch) {
+        open_batch(r);
+    }
+    g_array_append_val(rec->batch->commands, *c);
+
+    if (c->type < RECORDED_CMD__NUM_STATE) {
+        rec->state[c->type] = *c;
+        rec->state_valid |= 1 << c->type;
+    } else if (++rec->batch->num_draws >= RECORD_BATCH_MAX_DRAWS) {
+        dispatch_batch(rec);
+    }
+}
+
+/*
+ * Called as a render pass is begun on the primary command buffer, returns how
+ * the contents of the pass will be provided.
+ */
+VkSubpassContents pgraph_vk_recorder_begin_render_pass(PGRAPHVkState *r,
+                                                       VkRenderPass render_pass,
+                                                       VkFramebuffer framebuffer)
+{
+    CommandRecorder *rec = r->recorder;
+
+    if (!rec) {
+        return VK_SUBPASS_CONTENTS_INLINE;
+    }
+
+    assert(!rec->active);
+    assert(rec->num_batches == 0);
+
+    /*
+     * Draws in secondary command buffers may only count towards an active
+     * occlusion query if the device can inherit it.
+     */
+    if (r->query_in_flight &&
+        !r->enabled_physical_device_features.inheritedQueries) {
+        return VK_SUBPASS_CONTENTS_INLINE;
+    }
+
+    rec->active = true;
+    rec->render_pass = render_pass;
+    rec->framebuffer = framebuffer;
+    rec->occlusion_query = r->query_in_flight;
+    rec->state_valid = 0;
+
+    return VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS;
+}
+
+/*
+ * Called before the render pass is ended on the primary command buffer, waits
+ * for the batches of the pass to be recorded and executes them in order.
+ */
+void pgraph_vk_recorder_end_render_pass(PGRAPHVkState *r)
+{
+    CommandRecorder *rec = r->recorder;
+
+    if (!rec || !rec->active) {
+        return;
+    }
+
+    if (rec->batch) {
+        dispatch_batch(rec);
+    }
+
+    if (rec->num_batches) {
+        qemu_mutex_lock(&rec->lock);
+        for (int i = 0; i < rec->num_batches; i++) {
+            while (!rec->batches[i]->done) {
+                nv2a_profile_inc_counter(NV2A_PROF_RECORD_WAIT);
+                qemu_cond_wait(&rec->done_cond, &rec->lock);
+            }
+            rec->command_buffers[i] = rec->batches[i]->command_buffer;
+        }
+        qemu_mutex_unlock(&rec->lock);
+
+        vkCmdExecuteCommands(r->command_buffer, rec->num_batches,
+                             rec->command_buffers);
+    }
+
+    rec->num_batches = 0;
+    rec->active = false;
+}
+
+/*
+ * Secondary command buffers of a frame may be reused once the primary command
+ * buffer that executed them has completed.
+ */
+void pgraph_vk_recorder_reset_frame(PGRAPHVkState *r, int frame_index)
+{
+    CommandRecorder *rec = r->recorder;
+
+    if (!rec) {
+        return;
+    }
+
+    assert(!rec->active);
+
+    for (int i = 0; i < rec->num_workers; i++) {
+        RecordWorkerFrame *frame = &rec->workers[i].frames[frame_index];
+        if (frame->num_used) {
+            VK_CHECK(vkResetCommandPool(r->device, frame->command_pool, 0));
+            frame->num_used = 0;
+        }
+    }
+}
+
+void pgraph_vk_cmd_bind_pipeline(PGRAPHVkState *r, VkPipeline pipeline)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_BIND_PIPELINE,
+        .pipeline = pipeline,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_viewport(PGRAPHVkState *r, const VkViewport *viewport)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_VIEWPORT,
+        .viewport = *viewport,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_scissor(PGRAPHVkState *r, const VkRect2D *scissor)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_SCISSOR,
+        .scissor = *scissor,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_line_width(PGRAPHVkState *r, float line_width)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_LINE_WIDTH,
+        .line_width = line_width,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_blend_constants(PGRAPHVkState *r,
+                                       const float blend_constants[4])
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_BLEND_CONSTANTS,
+    };
+    memcpy(c.blend_constants, blend_constants, sizeof(c.blend_constants));
+    record_command(r, &c);
+}
+
+static void record_stencil_value(PGRAPHVkState *r, RecordedCommandType type,
+                                 VkStencilFaceFlags face, uint32_t value)
+{
+    RecordedCommand c = {
+        .type = type,
+        .stencil.face = face,
+        .stencil.value = value,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_stencil_compare_mask(PGRAPHVkState *r,
+                                            VkStencilFaceFlags face,
+                                            uint32_t mask)
+{
+    record_stencil_value(r, RECORDED_CMD_SET_STENCIL_COMPARE_MASK, face, mask);
+}
+
+void pgraph_vk_cmd_set_stencil_write_mask(PGRAPHVkState *r,
+                                          VkStencilFaceFlags face,
+                                          uint32_t mask)
+{
+    record_stencil_value(r, RECORDED_CMD_SET_STENCIL_WRITE_MASK, face, mask);
+}
+
+void pgraph_vk_cmd_set_stencil_reference(PGRAPHVkState *r,
+                                         VkStencilFaceFlags face,
+                                         uint32_t reference)
+{
+    record_stencil_value(r, RECORDED_CMD_SET_STENCIL_REFERENCE, face,
+                         reference);
+}
+
+void pgraph_vk_cmd_set_cull_mode(PGRAPHVkState *r, VkCullModeFlags cull_mode)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_CULL_MODE,
+        .cull_mode = cull_mode,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_front_face(PGRAPHVkState *r, VkFrontFace front_face)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_FRONT_FACE,
+        .front_face = front_face,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_depth_test_enable(PGRAPHVkState *r, VkBool32 enable)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_DEPTH_TEST_ENABLE,
+        .enable = enable,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_depth_write_enable(PGRAPHVkState *r, VkBool32 enable)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_DEPTH_WRITE_ENABLE,
+        .enable = enable,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_depth_compare_op(PGRAPHVkState *r, VkCompareOp op)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_DEPTH_COMPARE_OP,
+        .compare_op = op,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_stencil_test_enable(PGRAPHVkState *r, VkBool32 enable)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_STENCIL_TEST_ENABLE,
+        .enable = enable,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_set_stencil_op(PGRAPHVkState *r, VkStencilFaceFlags face,
+                                  VkStencilOp fail_op, VkStencilOp pass_op,
+                                  VkStencilOp depth_fail_op,
+                                  VkCompareOp compare_op)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_SET_STENCIL_OP,
+        .stencil_op.face = face,
+        .stencil_op.fail_op = fail_op,
+        .stencil_op.pass_op = pass_op,
+        .stencil_op.depth_fail_op = depth_fail_op,
+        .stencil_op.compare_op = compare_op,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_bind_descriptor_sets(PGRAPHVkState *r,
+                                        VkPipelineLayout layout,
+                                        uint32_t num_sets,
+                                        const VkDescriptorSet *sets,
+                                        uint32_t num_dynamic_offsets,
+                                        const uint32_t *dynamic_offsets)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_BIND_DESCRIPTOR_SETS,
+        .descriptor_sets.layout = layout,
+        .descriptor_sets.num_sets = num_sets,
+        .descriptor_sets.num_dynamic_offsets = num_dynamic_offsets,
+    };
+    assert(num_sets <= ARRAY_SIZE(c.descriptor_sets.sets));
+    memcpy(c.descriptor_sets.sets, sets, num_sets * sizeof(VkDescriptorSet));
+    assert(num_dynamic_offsets <= ARRAY_SIZE(c.descriptor_sets.dynamic_offsets));
+    memcpy(c.descriptor_sets.dynamic_offsets, dynamic_offsets,
+           num_dynamic_offsets * sizeof(uint32_t));
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_push_constants(PGRAPHVkState *r, VkPipelineLayout layout,
+                                  VkShaderStageFlags stages, uint32_t offset,
+                                  uint32_t size, const void *values)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_PUSH_CONSTANTS,
+        .push_constants.layout = layout,
+        .push_constants.stages = stages,
+        .push_constants.offset = offset,
+        .push_constants.size = size,
+    };
+    assert(size <= sizeof(c.push_constants.values));
+    memcpy(c.push_constants.values, values, size);
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_bind_vertex_buffers(PGRAPHVkState *r, uint32_t first,
+                                       uint32_t count, const VkBuffer *buffers,
+                                       const VkDeviceSize *offsets)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_BIND_VERTEX_BUFFERS,
+        .vertex_buffers.first = first,
+        .vertex_buffers.count = count,
+    };
+    assert(count <= ARRAY_SIZE(c.vertex_buffers.buffers));
+    memcpy(c.vertex_buffers.buffers, buffers, count * sizeof(VkBuffer));
+    memcpy(c.vertex_buffers.offsets, offsets, count * sizeof(VkDeviceSize));
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_bind_index_buffer(PGRAPHVkState *r, VkBuffer buffer,
+                                     VkDeviceSize offset, VkIndexType type)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_BIND_INDEX_BUFFER,
+        .index_buffer.buffer = buffer,
+        .index_buffer.offset = offset,
+        .index_buffer.type = type,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_draw(PGRAPHVkState *r, uint32_t vertex_count,
+                        uint32_t instance_count, uint32_t first_vertex,
+                        uint32_t first_instance)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_DRAW,
+        .draw.vertex_count = vertex_count,
+        .draw.instance_count = instance_count,
+        .draw.first_vertex = first_vertex,
+        .draw.first_instance = first_instance,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_draw_indexed(PGRAPHVkState *r, uint32_t index_count,
+                                uint32_t instance_count, uint32_t first_index,
+                                int32_t vertex_offset, uint32_t first_instance)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_DRAW_INDEXED,
+        .draw_indexed.index_count = index_count,
+        .draw_indexed.instance_count = instance_count,
+        .draw_indexed.first_index = first_index,
+        .draw_indexed.vertex_offset = vertex_offset,
+        .draw_indexed.first_instance = first_instance,
+    };
+    record_command(r, &c);
+}
+
+void pgraph_vk_cmd_clear_attachments(PGRAPHVkState *r, uint32_t count,
+                                     const VkClearAttachment *attachments,
+                                     const VkClearRect *rect)
+{
+    RecordedCommand c = {
+        .type = RECORDED_CMD_CLEAR_ATTACHMENTS,
+        .clear.count = count,
+        .clear.rect = *rect,
+    };
+    assert(count <= ARRAY_SIZE(c.clear.attachments));
+    memcpy(c.clear.attachments, attachments,
+           count * sizeof(VkClearAttachment));
+    record_command(r, &c);
+}
+
+void pgraph_vk_init_recorder(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    int num_threads = MIN(g_config.display.vulkan.command_recording_threads,
+                          RECORD_MAX_THREADS);
+    if (num_threads <= 0) {
+        r->recorder = NULL;
+        return;
+    }
+
+    CommandRecorder *rec = g_new0(CommandRecorder, 1);
+    r->recorder = rec;
+
+    qemu_mutex_init(&rec->lock);
+    qemu_cond_init(&rec->work_cond);
+    qemu_cond_init(&rec->done_cond);
+    g_queue_init(&rec->queue);
+    rec->stop = false;
+
+    QueueFamilyIndices indices =
+        pgraph_vk_find_queue_families(r->physical_device);
+
+    rec->num_workers = num_threads;
+    rec->workers = g_new0(RecordWorker, num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        RecordWorker *w = &rec->workers[i];
+        w->r = r;
+        for (int j = 0; j < r->num_frames; j++) {
+            VkCommandPoolCreateInfo create_info = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                .queueFamilyIndex = indices.queue_family,
+            };
+            VK_CHECK(vkCreateCommandPool(r->device, &create_info, NULL,
+                                         &w->frames[j].command_pool));
+            w->frames[j].command_buffers =
+                g_array_new(false, false, sizeof(VkCommandBuffer));
+        }
+        qemu_thread_create(&w->thread, "nv2a.vk_record", record_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    NV2A_VK_DPRINTF("Recording draws on %d threads", num_threads);
+}
+
+void pgraph_vk_finalize_recorder(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    CommandRecorder *rec = r->recorder;
+
+    if (!rec) {
+        return;
+    }
+
+    assert(!rec->active);
+
+    qemu_mutex_lock(&rec->lock);
+    rec->stop = true;
+    qemu_cond_broadcast(&rec->work_cond);
+    qemu_mutex_unlock(&rec->lock);
+
+    for (int i = 0; i < rec->num_workers; i++) {
+        RecordWorker *w = &rec->workers[i];
+        qemu_thread_join(&w->thread);
+        for (int j = 0; j < r->num_frames; j++) {
+            vkDestroyCommandPool(r->device, w->frames[j].command_pool, NULL);
+            g_array_free(w->frames[j].command_buffers, true);
+        }
+    }
+    g_free(rec->workers);
+
+    for (int i = 0; i < rec->max_batches; i++) {
+        g_array_free(rec->batches[i]->commands, true);
+        g_free(rec->batches[i]);
+    }
+    g_free(rec->batches);
+    g_free(rec->command_buffers);
+
+    assert(g_queue_is_empty(&rec->queue));
+    qemu_cond_destroy(&rec->done_cond);
+    qemu_cond_destroy(&rec->work_cond);
+    qemu_mutex_destroy(&rec->lock);
+
+    g_free(rec);
+    r->recorder = NULL;
+}
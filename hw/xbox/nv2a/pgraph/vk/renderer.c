@@ -18,19 +18,87 @@
  */
 
 #include "hw/xbox/nv2a/nv2a_int.h"
+#include "hw/xbox/xbox_mem.h"
 #include "renderer.h"
 
 #include "gloffscreen.h"
 
-#if HAVE_EXTERNAL_MEMORY
 static GloContext *g_gl_context;
-#endif
 
 static void early_context_init(void)
 {
-#if HAVE_EXTERNAL_MEMORY
     g_gl_context = glo_context_create();
+}
+
+/*
+ * The display image is shared with the frontend's GL context and synchronized
+ * with a semaphore, there is no path to hand a frame over through the CPU.
+ */
+static char const *const required_gl_extensions[] = {
+    "GL_EXT_memory_object",
+    "GL_EXT_semaphore",
+#ifdef WIN32
+    "GL_EXT_memory_object_win32",
+    "GL_EXT_semaphore_win32",
+#else
+    "GL_EXT_memory_object_fd",
+    "GL_EXT_semaphore_fd",
 #endif
+};
+
+static bool check_gl_extensions(Error **errp)
+{
+    for (int i = 0; i < ARRAY_SIZE(required_gl_extensions); i++) {
+        if (!glo_check_extension(required_gl_extensions[i])) {
+            error_setg(errp, "OpenGL extension %s is required to present "
+                       "frames from the Vulkan renderer",
+                       required_gl_extensions[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Work that does not need the device is done on a thread of its own while
+ * the instance and device are created: setting up the glslang process,
+ * compiling the internal shaders and reading the pipeline cache file.
+ */
+static void *init_ahead_thread(void *opaque)
+{
+    PGRAPHVkState *r = opaque;
+
+    pgraph_vk_init_glsl_compiler();
+    pgraph_vk_run_compile_ahead(r);
+    pgraph_vk_read_pipeline_cache_ahead(r);
+
+    return NULL;
+}
+
+static void start_init_ahead(PGRAPHVkState *r)
+{
+    pgraph_vk_compile_clear_shaders_ahead(r);
+    pgraph_vk_compile_display_shaders_ahead(r);
+    pgraph_vk_compile_gpu_properties_shaders_ahead(r);
+
+    qemu_thread_create(&r->init_ahead.thread, "nv2a.vk.init", init_ahead_thread,
+                       r, QEMU_THREAD_JOINABLE);
+}
+
+/* Drops whatever was done ahead but not used */
+static void finish_init_ahead(PGRAPHVkState *r)
+{
+    if (r->init_ahead.spv) {
+        g_hash_table_destroy(r->init_ahead.spv);
+        r->init_ahead.spv = NULL;
+    }
+    if (r->init_ahead.shaders) {
+        g_array_free(r->init_ahead.shaders, true);
+        r->init_ahead.shaders = NULL;
+    }
+    g_free(r->init_ahead.pipeline_cache);
+    r->init_ahead.pipeline_cache = NULL;
 }
 
 static void pgraph_vk_init(NV2AState *d, Error **errp)
@@ -38,25 +106,35 @@ static void pgraph_vk_init(NV2AState *d, Error **errp)
     PGRAPHState *pg = &d->pgraph;
 
     pg->vk_renderer_state = (PGRAPHVkState *)g_malloc0(sizeof(PGRAPHVkState));
+    PGRAPHVkState *r = pg->vk_renderer_state;
 
-#if HAVE_EXTERNAL_MEMORY
     glo_set_current(g_gl_context);
-#endif
+    if (!check_gl_extensions(errp)) {
+        return;
+    }
 
     pgraph_vk_debug_init();
 
+    start_init_ahead(r);
     pgraph_vk_init_instance(pg, errp);
     if (*errp) {
+        qemu_thread_join(&r->init_ahead.thread);
+        finish_init_ahead(r);
+        pgraph_vk_finalize_glsl_compiler();
         return;
     }
 
     pgraph_vk_init_command_buffers(pg);
+    pgraph_vk_init_recorder(pg);
     pgraph_vk_init_buffers(d);
+    pgraph_vk_init_images(pg);
     pgraph_vk_init_surfaces(pg);
+    qemu_thread_join(&r->init_ahead.thread);
     pgraph_vk_init_shaders(pg);
     pgraph_vk_init_pipelines(pg);
     pgraph_vk_init_textures(pg);
     pgraph_vk_init_reports(pg);
+    pgraph_vk_init_timestamps(pg);
     pgraph_vk_init_compute(pg);
     pgraph_vk_init_display(pg);
 
@@ -64,20 +142,26 @@ static void pgraph_vk_init(NV2AState *d, Error **errp)
                                    memory_region_size(d->vram));
 
     pgraph_vk_determine_gpu_properties(d);
+    finish_init_ahead(r);
 }
 
 static void pgraph_vk_finalize(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
 
+    pgraph_vk_wait_for_all_submits(pg->vk_renderer_state);
+
     pgraph_vk_finalize_display(pg);
     pgraph_vk_finalize_compute(pg);
+    pgraph_vk_finalize_timestamps(pg);
     pgraph_vk_finalize_reports(pg);
     pgraph_vk_finalize_textures(pg);
     pgraph_vk_finalize_pipelines(pg);
     pgraph_vk_finalize_shaders(pg);
     pgraph_vk_finalize_surfaces(pg);
+    pgraph_vk_finalize_images(pg);
     pgraph_vk_finalize_buffers(d);
+    pgraph_vk_finalize_recorder(pg);
     pgraph_vk_finalize_command_buffers(pg);
     pgraph_vk_finalize_instance(pg);
 
@@ -90,7 +174,12 @@ static void pgraph_vk_flush(NV2AState *d)
     PGRAPHState *pg = &d->pgraph;
 
     pgraph_vk_finish(pg, VK_FINISH_REASON_FLUSH);
-    pgraph_vk_surface_flush(d);
+    if (qatomic_read(&pg->flush_revalidate)) {
+        pgraph_vk_surface_revalidate(d);
+        qatomic_set(&pg->flush_revalidate, false);
+    } else {
+        pgraph_vk_surface_flush(d);
+    }
     pgraph_vk_mark_textures_possibly_dirty(d, 0, memory_region_size(d->vram));
     pgraph_vk_update_vertex_ram_buffer(&d->pgraph, 0, d->vram_ptr,
                                        memory_region_size(d->vram));
@@ -143,8 +232,21 @@ static void pgraph_vk_process_pending(NV2AState *d)
 
 static void pgraph_vk_flip_stall(NV2AState *d)
 {
+    PGRAPHVkState *r = d->pgraph.vk_renderer_state;
+
     pgraph_vk_finish(&d->pgraph, VK_FINISH_REASON_FLIP_STALL);
     pgraph_vk_debug_frame_terminator();
+
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_TEXTURE, &r->texture_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_SHADER, &r->shader_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_PIPELINE, &r->pipeline_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_SHADER_MODULE,
+                              &r->shader_module_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_SAMPLER, &r->sampler_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_FRAMEBUFFER,
+                              &r->framebuffer_cache);
+    nv2a_profile_update_cache(NV2A_PROF_CACHE_COMPUTE_PIPELINE,
+                              &r->compute.pipeline_cache);
 }
 
 static void pgraph_vk_pre_savevm_trigger(NV2AState *d)
@@ -172,7 +274,6 @@ static void pgraph_vk_pre_shutdown_wait(NV2AState *d)
 static int pgraph_vk_get_framebuffer_surface(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
-    PGRAPHVkState *r = pg->vk_renderer_state;
 
     qemu_mutex_lock(&d->pfifo.lock);
 
@@ -183,6 +284,7 @@ static int pgraph_vk_get_framebuffer_surface(NV2AState *d)
         d, d->pcrtc.start + vga_display_params.line_offset);
     if (surface == NULL || !surface->color) {
         qemu_mutex_unlock(&d->pfifo.lock);
+        nv2a_profile_inc_counter(NV2A_PROF_DISPLAY_VGA_FALLBACK);
         return 0;
     }
 
@@ -190,18 +292,13 @@ static int pgraph_vk_get_framebuffer_surface(NV2AState *d)
 
     surface->frame_time = pg->frame_time;
 
-#if HAVE_EXTERNAL_MEMORY
     qemu_event_reset(&d->pgraph.sync_complete);
     qatomic_set(&pg->sync_pending, true);
     pfifo_kick(d);
     qemu_mutex_unlock(&d->pfifo.lock);
     qemu_event_wait(&d->pgraph.sync_complete);
-    return r->display.gl_texture_id;
-#else
-    qemu_mutex_unlock(&d->pfifo.lock);
-    pgraph_vk_wait_for_surface_download(surface);
-    return 0;
-#endif
+    nv2a_profile_inc_counter(NV2A_PROF_DISPLAY_INTEROP);
+    return pgraph_vk_wait_for_present(pg);
 }
 
 static PGRAPHRenderer pgraph_vk_renderer = {
@@ -230,6 +327,7 @@ static PGRAPHRenderer pgraph_vk_renderer = {
         .get_surface_scale_factor = pgraph_vk_get_surface_scale_factor,
         .get_framebuffer_surface = pgraph_vk_get_framebuffer_surface,
         .get_gpu_properties = pgraph_vk_get_gpu_properties,
+        .prewarm_shader_state = pgraph_vk_prewarm_shader_state,
     }
 };
 
@@ -238,9 +336,50 @@ static void __attribute__((constructor)) register_renderer(void)
     pgraph_renderer_register(&pgraph_vk_renderer);
 }
 
+static void publish_memory_usage(PGRAPHVkState *r)
+{
+    static const XboxMemCategory buffer_categories[BUFFER_COUNT] = {
+        [BUFFER_STAGING_DST] = XBOX_MEM_VK_STAGING,
+        [BUFFER_STAGING_SRC] = XBOX_MEM_VK_STAGING,
+        [BUFFER_COMPUTE_DST] = XBOX_MEM_VK_COMPUTE,
+        [BUFFER_COMPUTE_SRC] = XBOX_MEM_VK_COMPUTE,
+        [BUFFER_INDEX] = XBOX_MEM_VK_VERTEX,
+        [BUFFER_INDEX_STAGING] = XBOX_MEM_VK_STAGING,
+        [BUFFER_VERTEX_RAM] = XBOX_MEM_VK_VERTEX,
+        [BUFFER_VERTEX_INLINE] = XBOX_MEM_VK_VERTEX,
+        [BUFFER_VERTEX_INLINE_STAGING] = XBOX_MEM_VK_STAGING,
+        [BUFFER_UNIFORM] = XBOX_MEM_VK_UNIFORM,
+        [BUFFER_UNIFORM_STAGING] = XBOX_MEM_VK_STAGING,
+        [BUFFER_TRANSFER_STAGING] = XBOX_MEM_VK_STAGING,
+    };
+    uint64_t bytes[XBOX_MEM__COUNT] = { 0 };
+
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        StorageBuffer *b = &r->storage_buffers[i];
+        // Imported buffers are guest memory, not allocated by the renderer
+        if (b->buffer && !b->imported_memory) {
+            bytes[buffer_categories[i]] += b->buffer_size;
+        }
+    }
+
+    xbox_mem_set(XBOX_MEM_VK_TEXTURE, r->residency.texture_bytes);
+    xbox_mem_set(XBOX_MEM_VK_SURFACE, r->residency.surface_bytes);
+    xbox_mem_set(XBOX_MEM_VK_RECYCLED_IMAGE, r->residency.recycled_image_bytes);
+    xbox_mem_set(XBOX_MEM_VK_STAGING, bytes[XBOX_MEM_VK_STAGING]);
+    xbox_mem_set(XBOX_MEM_VK_VERTEX, bytes[XBOX_MEM_VK_VERTEX]);
+    xbox_mem_set(XBOX_MEM_VK_UNIFORM, bytes[XBOX_MEM_VK_UNIFORM]);
+    xbox_mem_set(XBOX_MEM_VK_COMPUTE, bytes[XBOX_MEM_VK_COMPUTE]);
+}
+
+/*
+ * Keep device memory use under the budget reported by VMA (exact with
+ * VK_EXT_memory_budget, estimated otherwise). Once a device local heap goes
+ * over the high watermark, memory is reclaimed down to the low watermark from
+ * recycled images, invalid surfaces, then cached textures, then surfaces that
+ * have not been used in the current frame.
+ */
 void pgraph_vk_check_memory_budget(PGRAPHState *pg)
 {
-#if 0 // FIXME
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     VkPhysicalDeviceMemoryProperties const *props;
@@ -249,24 +388,65 @@ void pgraph_vk_check_memory_budget(PGRAPHState *pg)
     g_autofree VmaBudget *budgets = g_malloc_n(props->memoryHeapCount, sizeof(VmaBudget));
     vmaGetHeapBudgets(r->allocator, budgets);
 
-    const float budget_threshold = 0.8;
-    bool near_budget = false;
+    const double high_watermark = 0.9;
+    const double low_watermark = 0.8;
+    double max_use_to_budget_ratio = 0;
+    VmaBudget *b = NULL;
 
     for (int i = 0; i < props->memoryHeapCount; i++) {
-        VmaBudget *b = &budgets[i];
-        float use_to_budget_ratio =
-            (double)b->statistics.allocationBytes / (double)b->budget;
-        NV2A_VK_DPRINTF("Heap %d: used %lu/%lu MiB (%.2f%%)", i,
-                        b->statistics.allocationBytes / (1024 * 1024),
-                        b->budget / (1024 * 1024), use_to_budget_ratio * 100);
-        near_budget |= use_to_budget_ratio > budget_threshold;
+        if (!(props->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ||
+            !budgets[i].budget) {
+            continue;
+        }
+        double use_to_budget_ratio =
+            (double)budgets[i].usage / (double)budgets[i].budget;
+        NV2A_VK_DPRINTF("Heap %d: used %" PRIu64 "/%" PRIu64 " MiB (%.2f%%)", i,
+                        (uint64_t)budgets[i].usage / (1024 * 1024),
+                        (uint64_t)budgets[i].budget / (1024 * 1024),
+                        use_to_budget_ratio * 100);
+        if (!b || use_to_budget_ratio > max_use_to_budget_ratio) {
+            max_use_to_budget_ratio = use_to_budget_ratio;
+            b = &budgets[i];
+        }
     }
 
-    // If any heaps are near budget, free up some resources
-    if (near_budget) {
-        pgraph_vk_trim_texture_cache(pg);
+    if (!b) {
+        return;
     }
-#endif
+
+    r->residency.budget = b->budget;
+    r->residency.usage = b->usage;
+
+    if (max_use_to_budget_ratio > high_watermark) {
+        VkDeviceSize target = b->budget * low_watermark;
+        VkDeviceSize reclaim = b->usage - target;
+        trace_nv2a_pgraph_vk_residency_over_budget(b->usage, b->budget,
+                                                    reclaim);
+
+        VkDeviceSize freed = pgraph_vk_trim_recycled_images(r, reclaim);
+        if (freed < reclaim) {
+            freed += pgraph_vk_trim_invalid_surfaces(r, reclaim - freed);
+        }
+        if (freed < reclaim) {
+            // Evicted texture images are recycled, release them as well
+            pgraph_vk_trim_texture_cache(pg, reclaim - freed);
+            freed += pgraph_vk_trim_recycled_images(r, reclaim - freed);
+        }
+        if (freed < reclaim) {
+            r->residency.surface_reclaim_bytes = reclaim - freed;
+        }
+    }
+
+    g_nv2a_stats.vram.budget = r->residency.budget;
+    g_nv2a_stats.vram.usage = r->residency.usage;
+    g_nv2a_stats.vram.texture_bytes = r->residency.texture_bytes;
+    g_nv2a_stats.vram.surface_bytes = r->residency.surface_bytes;
+    g_nv2a_stats.vram.invalid_surface_bytes =
+        pgraph_vk_get_invalid_surface_bytes(r);
+    g_nv2a_stats.vram.allocation_bytes = b->statistics.allocationBytes;
+    g_nv2a_stats.vram.allocations = b->statistics.allocationCount;
+
+    publish_memory_usage(r);
 
 #if 0
     char *s;
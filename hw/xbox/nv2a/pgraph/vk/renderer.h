@@ -23,6 +23,7 @@
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
 #include "qemu/queue.h"
+#include "qemu/interval-tree.h"
 #include "qemu/lru.h"
 #include "hw/hw.h"
 #include "hw/xbox/nv2a/nv2a_int.h"
@@ -41,10 +42,17 @@
 #include "constants.h"
 #include "glsl.h"
 
-#define HAVE_EXTERNAL_MEMORY 1
+#define NV2A_VK_MAX_FRAMES_IN_FLIGHT 3
+
+#define NV2A_VK_TEXTURE_CACHE_SIZE 1024
+// One descriptor per texture cache entry, plus one for the dummy texture
+#define NV2A_VK_BINDLESS_TEXTURE_COUNT (NV2A_VK_TEXTURE_CACHE_SIZE + 1)
+// Bindless texture bindings each hold their sampler, leave room for the rest
+#define NV2A_VK_SAMPLER_CACHE_SIZE (NV2A_VK_BINDLESS_TEXTURE_COUNT + 256)
 
 typedef struct QueueFamilyIndices {
     int queue_family;
+    int transfer_queue_family; // Dedicated to transfers, or -1
 } QueueFamilyIndices;
 
 typedef struct MemorySyncRequirement {
@@ -58,18 +66,48 @@ typedef struct RenderPassState {
 
 typedef struct RenderPass {
     RenderPassState state;
+    VkImageAspectFlags clear_aspects; // Cleared by the load ops of the pass
     VkRenderPass render_pass;
 } RenderPass;
 
+/*
+ * A clear of the whole render area, deferred so that it can be done by the
+ * load ops of the next render pass on the framebuffer.
+ */
+typedef struct PendingClear {
+    VkImageAspectFlags aspects;
+    RenderPassState state;
+    VkFramebuffer framebuffer;
+    VkExtent2D extent;
+    VkClearValue color;
+    VkClearValue depth_stencil;
+} PendingClear;
+
 typedef struct PipelineKey {
     bool clear;
+    bool uber_psh;
     RenderPassState render_pass_state;
     ShaderState shader_state;
-    uint32_t regs[9];
+    uint32_t regs[8];
     VkVertexInputBindingDescription binding_descriptions[NV2A_VERTEXSHADER_ATTRIBUTES];
     VkVertexInputAttributeDescription attribute_descriptions[NV2A_VERTEXSHADER_ATTRIBUTES];
 } PipelineKey;
 
+typedef struct FramebufferKey {
+    VkRenderPass render_pass;
+    VkImageView color_view;
+    VkImageView zeta_view;
+    uint32_t width;
+    uint32_t height;
+} FramebufferKey;
+
+typedef struct FramebufferBinding {
+    LruNode node;
+    FramebufferKey key;
+    VkFramebuffer framebuffer;
+    unsigned int draw_time;
+} FramebufferBinding;
+
 typedef struct PipelineBinding {
     LruNode node;
     PipelineKey key;
@@ -80,6 +118,21 @@ typedef struct PipelineBinding {
     bool has_dynamic_line_width;
 } PipelineBinding;
 
+enum PrecompiledPipelineStatus {
+    PRECOMPILED_PIPELINE_PENDING,
+    PRECOMPILED_PIPELINE_BUILDING,
+    PRECOMPILED_PIPELINE_READY,
+    PRECOMPILED_PIPELINE_TAKEN,
+};
+
+typedef struct PrecompiledPipeline {
+    int status; // enum PrecompiledPipelineStatus, accessed atomically
+    VkRenderPass render_pass;
+    VkPipelineLayout layout;
+    VkPipeline pipeline;
+    bool has_dynamic_line_width;
+} PrecompiledPipeline;
+
 enum Buffer {
     BUFFER_STAGING_DST,
     BUFFER_STAGING_SRC,
@@ -92,6 +145,7 @@ enum Buffer {
     BUFFER_VERTEX_INLINE_STAGING,
     BUFFER_UNIFORM,
     BUFFER_UNIFORM_STAGING,
+    BUFFER_TRANSFER_STAGING, // Only with a transfer queue
     BUFFER_COUNT
 };
 
@@ -100,14 +154,41 @@ typedef struct StorageBuffer {
     VkBufferUsageFlags usage;
     VmaAllocationCreateInfo alloc_info;
     VmaAllocation allocation;
+    VkDeviceMemory imported_memory; // Host memory used in place of allocation
     VkMemoryPropertyFlags properties;
-    size_t buffer_offset;
+    size_t buffer_offset; // Ring head for streamed buffers
     size_t buffer_size;
     uint8_t *mapped;
+
+    // Ring state of streamed buffers
+    size_t buffer_size_max;
+    size_t frame_start; // Data of the frame being recorded starts here
+    size_t frame_wrap_end; // and ends here if it wrapped around to 0
+    bool frame_wrapped;
+    size_t submitted_frame_starts[NV2A_VK_MAX_FRAMES_IN_FLIGHT];
+    size_t high_water; // Most space used at once, for profiling
 } StorageBuffer;
 
+enum ImagePool {
+    IMAGE_POOL_TEXTURE_SMALL,
+    IMAGE_POOL_TEXTURE_LARGE,
+    IMAGE_POOL_COLOR_SURFACE,
+    IMAGE_POOL_ZETA_SURFACE,
+    IMAGE_POOL_COUNT
+};
+
+// Released texture image kept for reuse by a texture of identical shape
+typedef struct RecycledImage {
+    QTAILQ_ENTRY(RecycledImage) entry;
+    VkImageCreateInfo create_info;
+    VkImage image;
+    VmaAllocation allocation;
+    VkDeviceSize memory_size;
+} RecycledImage;
+
 typedef struct SurfaceBinding {
     QTAILQ_ENTRY(SurfaceBinding) entry;
+    IntervalTreeNode vram_range; // In surface_ranges, if size is not 0
     MemAccessCallback *access_cb;
 
     hwaddr vram_addr;
@@ -122,13 +203,22 @@ typedef struct SurfaceBinding {
     unsigned int height;
     unsigned int pitch;
     size_t size;
+    unsigned int scale; // Of the host image relative to the guest surface
 
     bool cleared;
     int frame_time;
     int draw_time;
+    uint64_t write_value; // Timeline value of the last submit writing it
     bool draw_dirty;
     bool download_pending;
     bool upload_pending;
+    hwaddr upload_dirty_start; // CPU written bytes, whole surface if empty
+    hwaddr upload_dirty_end;
+    uint64_t vram_hash; // Of VRAM when last synchronized with the image
+    int vram_hash_draw_time; // draw_time when vram_hash was taken
+    bool vram_hash_valid;
+    int cpu_read_frame_time; // Last frame the CPU waited for a download
+    int cpu_read_frames; // Consecutive frames the CPU waited for a download
 
     BasicSurfaceFormatInfo fmt;
     SurfaceFormatInfo host_fmt;
@@ -136,6 +226,7 @@ typedef struct SurfaceBinding {
     VkImage image;
     VkImageView image_view;
     VmaAllocation allocation;
+    VkDeviceSize memory_size; // Of both image and scratch image
 
     // Used for scaling
     VkImage image_scratch;
@@ -147,6 +238,7 @@ typedef struct SurfaceBinding {
 
 typedef struct ShaderModuleInfo {
     int refcnt;
+    bool ready; // Compiled, accessed atomically
     char *glsl;
     GByteArray *spirv;
     VkShaderModule module;
@@ -192,8 +284,12 @@ typedef struct ShaderBinding {
     } geom;
     struct {
         ShaderModuleInfo *module_info;
+        // Specialized module still being compiled while module_info is the
+        // uber shader, otherwise NULL
+        ShaderModuleInfo *pending_module_info;
         PshUniformLocs uniform_locs;
     } psh;
+    bool uniform_locs_valid; // Set once all modules are compiled
 } ShaderBinding;
 
 typedef struct TextureKey {
@@ -203,26 +299,69 @@ typedef struct TextureKey {
     hwaddr palette_vram_offset;
     hwaddr palette_length;
     float scale;
+    // Sampler state, only with bindless textures
     uint32_t filter;
     uint32_t address;
     uint32_t border_color;
     uint32_t max_anisotropy;
 } TextureKey;
 
+typedef struct DescriptorSetKey {
+    VkDeviceSize ubo_ranges[2];
+    VkImageView image_views[NV2A_MAX_TEXTURES];
+    VkSampler samplers[NV2A_MAX_TEXTURES];
+} DescriptorSetKey;
+
+typedef struct SamplerKey {
+    VkFilter mag_filter, min_filter;
+    VkSamplerMipmapMode mipmap_mode;
+    VkSamplerAddressMode address_mode_u, address_mode_v, address_mode_w;
+    float min_lod, max_lod, lod_bias;
+    uint32_t max_anisotropy; // 1 when disabled
+    VkBorderColor border_color;
+    VkFormat custom_border_color_format; // Only with custom border colors
+    VkClearColorValue custom_border_color;
+} SamplerKey;
+
+typedef struct SamplerBinding {
+    LruNode node;
+    SamplerKey key;
+    VkSampler sampler;
+    unsigned int num_textures; // Bindings holding it for bindless descriptors
+    uint32_t submit_time;
+} SamplerBinding;
+
 typedef struct TextureBinding {
     LruNode node;
     TextureKey key;
+    IntervalTreeNode vram_range; // Pages of texture data in texture_ranges
+    IntervalTreeNode palette_range; // In texture_palette_ranges, if any
     VkImage image;
     VkImageLayout current_layout;
     VkImageView image_view;
+    VkImageCreateInfo image_create_info; // To recycle image on eviction
     VmaAllocation allocation;
-    VkSampler sampler;
-    bool possibly_dirty;
-    uint64_t hash;
+    VkDeviceSize memory_size;
+    SamplerBinding *sampler; // Combined with the image in bindless descriptors
+    uint32_t bindless_index; // In bindless_descriptor_set
+    bool possibly_dirty; // Palette, texture data is tracked per page
+    unsigned long *dirty_pages; // Pages of texture data possibly modified
+    uint64_t *page_hashes; // Hash of texture data in each page
+    unsigned int num_pages;
+    uint64_t palette_hash;
+    bool mipmaps_generated; // Levels after the first are blitted from it
+    VkBuffer index_buffer; // Palette indices, when decoded with compute
+    VmaAllocation index_allocation;
+    VkDeviceSize index_buffer_size;
     unsigned int draw_time;
     uint32_t submit_time;
 } TextureBinding;
 
+typedef struct SurfaceToTextureCopy {
+    SurfaceBinding *surface;
+    TextureBinding *texture;
+} SurfaceToTextureCopy;
+
 typedef struct QueryReport {
     QSIMPLEQ_ENTRY(QueryReport) entry;
     bool clear;
@@ -230,6 +369,34 @@ typedef struct QueryReport {
     unsigned int query_count;
 } QueryReport;
 
+#define NV2A_VK_MAX_GPU_TIMERS 64 // Per command buffer, including its own
+
+typedef struct GpuTimerPool {
+    VkQueryPool query_pool; // Start and end timestamp of each timer
+    int num_timers;
+    int depth; // Of nested timers, only the outermost is measured
+    uint8_t timers[NV2A_VK_MAX_GPU_TIMERS]; // enum NV2A_PROF_GPU_TIMERS_ENUM
+} GpuTimerPool;
+
+typedef struct CommandBufferFrame {
+    VkCommandBuffer command_buffer;
+    VkCommandBuffer aux_command_buffer;
+    VkSemaphore semaphore; // Orders aux_command_buffer before command_buffer
+    VkFence fence;
+
+    // Uploads on the transfer queue, which the next graphics submit waits for
+    VkCommandBuffer transfer_command_buffer;
+    VkSemaphore transfer_semaphore;
+    unsigned int start_time; // Draw time when command_buffer was begun
+    uint64_t timeline_value; // Reached when command_buffer has completed
+    GpuTimerPool gpu_timers; // Of command_buffer
+
+    // Resources referenced by command_buffer, reclaimed when it retires
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_sets[1024];
+    unsigned long *vertex_ram_bitmap; // Vertex RAM pages read by draws
+} CommandBufferFrame;
+
 typedef struct PvideoState {
     bool enabled;
     hwaddr base;
@@ -285,23 +452,40 @@ typedef struct PGRAPHVkDisplayState {
 
     int width, height;
     int draw_time;
+    uint64_t timeline_value; // Of the last submit that rendered the display
 
     // OpenGL Interop
 #ifdef WIN32
     HANDLE handle;
+    HANDLE semaphore_handle;
 #else
     int fd;
 #endif
     GLuint gl_memory_obj;
     GLuint gl_texture_id;
+
+    // Signaled once the display image is rendered, waited for by GL
+    VkSemaphore present_semaphore;
+    GLuint gl_semaphore;
+    bool present_pending; // Signal present_semaphore at the next submit
+    bool present_signaled; // GL has to wait for present_semaphore
 } PGRAPHVkDisplayState;
 
 typedef struct ComputePipelineKey {
     VkFormat host_fmt;
     bool pack;
     int workgroup_size;
+    int texture_bytes_per_pixel; // Texture decode, 0 for depth/stencil
+    bool texture_palette;
+    int surface_bytes_per_pixel; // Surface swizzle, 0 for depth/stencil
 } ComputePipelineKey;
 
+typedef struct TextureDecodeRegion {
+    unsigned int width, height;
+    VkDeviceSize src_offset; // From the start of the swizzled data, in bytes
+    VkDeviceSize dst_offset; // From the start of the output, in bytes
+} TextureDecodeRegion;
+
 typedef struct ComputePipeline {
     LruNode node;
     ComputePipelineKey key;
@@ -318,8 +502,25 @@ typedef struct PGRAPHVkComputeState {
     ComputePipeline *pipeline_cache_entries;
 } PGRAPHVkComputeState;
 
+typedef struct CommandRecorder CommandRecorder;
+
+typedef struct InitAheadShader {
+    VkShaderStageFlagBits stage;
+    const char *glsl;
+} InitAheadShader;
+
 typedef struct PGRAPHVkState {
     void *window;
+
+    // Done on a thread of its own while the device is created
+    struct {
+        QemuThread thread;
+        GArray *shaders; // InitAheadShader, to compile
+        GHashTable *spv; // GLSL source -> GByteArray, once compiled
+        gchar *pipeline_cache; // Contents of the pipeline cache file
+        gsize pipeline_cache_size;
+    } init_ahead;
+
     VkInstance instance;
     VkDebugUtilsMessengerEXT debug_messenger;
     int debug_depth;
@@ -327,6 +528,11 @@ typedef struct PGRAPHVkState {
     bool debug_utils_extension_enabled;
     bool custom_border_color_extension_enabled;
     bool memory_budget_extension_enabled;
+    bool extended_dynamic_state_extension_enabled;
+    bool external_memory_host_extension_enabled;
+    bool timeline_semaphore_enabled;
+    bool bindless_textures_enabled;
+    bool gpu_timers_enabled;
 
     VkPhysicalDevice physical_device;
     VkPhysicalDeviceFeatures enabled_physical_device_features;
@@ -335,45 +541,92 @@ typedef struct PGRAPHVkState {
     VmaAllocator allocator;
     uint32_t allocator_last_submit_index;
 
+    struct {
+        VkDeviceSize budget; // Of the device local heap closest to its budget
+        VkDeviceSize usage;
+        VkDeviceSize texture_bytes;
+        VkDeviceSize surface_bytes;
+        VkDeviceSize surface_reclaim_bytes; // Left for the next surface update
+        VkDeviceSize recycled_image_bytes;
+    } residency;
+
+    VmaPool image_pools[IMAGE_POOL_COUNT]; // Created on first use
+    bool image_pool_unavailable[IMAGE_POOL_COUNT];
+    QTAILQ_HEAD(, RecycledImage) recycled_images;
+    int num_recycled_images;
+
     VkQueue queue;
+    int queue_family;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffers[2];
+    VkQueue transfer_queue; // VK_NULL_HANDLE without a dedicated family
+    int transfer_queue_family;
+    VkCommandPool transfer_command_pool;
+    bool in_transfer_command_buffer;
+    CommandBufferFrame frames[NV2A_VK_MAX_FRAMES_IN_FLIGHT];
+    int num_frames;
+    CommandBufferFrame *frame; // Being recorded, frames[submit_count % n]
 
     VkCommandBuffer command_buffer;
-    VkSemaphore command_buffer_semaphore;
-    VkFence command_buffer_fence;
     unsigned int command_buffer_start_time;
     bool in_command_buffer;
     uint32_t submit_count;
+    uint32_t completed_submit_count; // Submits known to have finished executing
+
+    // Every graphics queue submit signals the next value. Without timeline
+    // semaphore support values are tracked through the frame fences instead.
+    VkSemaphore timeline_semaphore;
+    uint64_t timeline_value; // Signaled by the most recent submit
+    uint64_t completed_timeline_value; // Accessed atomically
 
     VkCommandBuffer aux_command_buffer;
     bool in_aux_command_buffer;
 
-    VkFramebuffer framebuffers[50];
-    int framebuffer_index;
+    CommandRecorder *recorder; // Only when recording on worker threads
+
     bool framebuffer_dirty;
+    Lru framebuffer_cache;
+    FramebufferBinding *framebuffer_cache_entries;
+    FramebufferBinding *framebuffer_binding;
 
     VkRenderPass render_pass;
     GArray *render_passes; // RenderPass
     bool in_render_pass;
+    PendingClear pending_clear;
     bool in_draw;
 
     Lru pipeline_cache;
     VkPipelineCache vk_pipeline_cache;
     PipelineBinding *pipeline_cache_entries;
+    PipelineKey *saved_pipeline_keys; // Most recently used first
+    size_t num_saved_pipeline_keys;
+    PrecompiledPipeline *precompiled_pipelines; // Parallel to saved keys
+    GHashTable *precompiled_pipeline_index; // PipelineKey * -> index + 1
+    QemuThread *precompile_threads;
+    int num_precompile_threads;
+    int precompile_next; // Next saved key to build, accessed atomically
+    bool precompile_stop;
     PipelineBinding *pipeline_binding;
     bool pipeline_binding_changed;
+    uint32_t dynamic_state_regs[5]; // Last values set as dynamic state
 
-    VkDescriptorPool descriptor_pool;
     VkDescriptorSetLayout descriptor_set_layout;
-    VkDescriptorSet descriptor_sets[1024];
-    int descriptor_set_index;
+    DescriptorSetKey descriptor_set_keys[1024];
+    int descriptor_set_index; // Sets written in this command buffer
+    int descriptor_set_current;
+    GHashTable *descriptor_set_cache; // DescriptorSetKey * -> index + 1
+
+    // Image views and samplers of all resident textures, indexed by
+    // TextureBinding::bindless_index
+    VkDescriptorSetLayout bindless_descriptor_set_layout;
+    VkDescriptorPool bindless_descriptor_pool;
+    VkDescriptorSet bindless_descriptor_set;
 
     StorageBuffer storage_buffers[BUFFER_COUNT];
 
     MemorySyncRequirement vertex_ram_buffer_syncs[NV2A_VERTEXSHADER_ATTRIBUTES];
     size_t num_vertex_ram_buffer_syncs;
     unsigned long *uploaded_bitmap;
+    uint32_t *vertex_ram_vram_gens; // VRAM generations last synchronized
     size_t bitmap_size;
 
     VkVertexInputAttributeDescription vertex_attribute_descriptions[NV2A_VERTEXSHADER_ATTRIBUTES];
@@ -385,8 +638,13 @@ typedef struct PGRAPHVkState {
     hwaddr vertex_attribute_offsets[NV2A_VERTEXSHADER_ATTRIBUTES];
 
     QTAILQ_HEAD(, SurfaceBinding) surfaces;
+    uint32_t *surface_vram_gens; // VRAM generations last checked by surfaces
+    IntervalTreeRoot surface_ranges; // VRAM used by surfaces
     QTAILQ_HEAD(, SurfaceBinding) invalid_surfaces;
     SurfaceBinding *color_binding, *zeta_binding;
+    unsigned int surface_scale_factor; // Configured, surfaces may use less
+    GHashTable *unscaled_surface_addrs; // Read back by the CPU, kept at 1x
+    GHashTable *display_surface_addrs; // Scanned out by render_display
     bool downloads_pending;
     QemuEvent downloads_complete;
     bool download_dirty_surfaces_pending;
@@ -394,10 +652,18 @@ typedef struct PGRAPHVkState {
 
     Lru texture_cache;
     TextureBinding *texture_cache_entries;
+    IntervalTreeRoot texture_ranges; // VRAM used by created bindings
+    IntervalTreeRoot texture_palette_ranges;
     TextureBinding *texture_bindings[NV2A_MAX_TEXTURES];
     TextureBinding dummy_texture;
+    Lru sampler_cache;
+    SamplerBinding *sampler_cache_entries;
+    SamplerBinding *texture_samplers[NV2A_MAX_TEXTURES];
+    SurfaceToTextureCopy pending_surface_copies[NV2A_MAX_TEXTURES];
+    int num_pending_surface_copies;
     bool texture_bindings_changed;
     VkFormatProperties *texture_format_properties;
+    bool texture_compression_bc, texture_compression_bc_3d;
 
     Lru shader_cache;
     ShaderBinding *shader_cache_entries;
@@ -409,13 +675,27 @@ typedef struct PGRAPHVkState {
     Lru shader_module_cache;
     ShaderModuleCacheEntry *shader_module_cache_entries;
 
+    int async_shaders; // CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_*
+    bool uber_shaders;
+    QemuMutex shader_compile_lock;
+    QemuCond shader_compile_cond; // Job queued or stopping
+    QemuCond shader_compile_done_cond; // Job finished
+    GQueue shader_compile_queue; // ShaderCompileJob
+    QemuThread *shader_compile_threads;
+    int num_shader_compile_threads;
+    bool shader_compile_stop;
+
     // FIXME: Merge these into a structure
     uint64_t uniform_buffer_hashes[2];
     size_t uniform_buffer_offsets[2];
-    bool uniforms_changed;
+    bool uniforms_changed[2];
 
     VkQueryPool query_pool;
     int max_queries_in_flight; // FIXME: Move out to constant
+
+    float timestamp_period; // ns per timestamp tick
+    uint64_t timestamp_mask; // Of valid timestamp bits
+    GpuTimerPool single_time_gpu_timers;
     int num_queries_in_flight;
     bool new_query_needed;
     bool query_in_flight;
@@ -462,8 +742,17 @@ GByteArray *pgraph_vk_compile_glsl_to_spv(glslang_stage_t stage,
                                           const char *glsl_source);
 VkShaderModule pgraph_vk_create_shader_module_from_spv(PGRAPHVkState *r,
                                                        GByteArray *spv);
+void pgraph_vk_init_shader_module_from_spv(PGRAPHVkState *r,
+                                           ShaderModuleInfo *info,
+                                           GByteArray *spv);
+void pgraph_vk_compile_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info,
+                                     VkShaderStageFlagBits stage,
+                                     const char *glsl);
 ShaderModuleInfo *pgraph_vk_create_shader_module_from_glsl(
     PGRAPHVkState *r, VkShaderStageFlagBits stage, const char *glsl);
+void pgraph_vk_compile_ahead(PGRAPHVkState *r, VkShaderStageFlagBits stage,
+                             const char *glsl);
+void pgraph_vk_run_compile_ahead(PGRAPHVkState *r);
 void pgraph_vk_ref_shader_module(ShaderModuleInfo *info);
 void pgraph_vk_unref_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info);
 void pgraph_vk_destroy_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info);
@@ -474,21 +763,114 @@ void pgraph_vk_finalize_buffers(NV2AState *d);
 bool pgraph_vk_buffer_has_space_for(PGRAPHState *pg, int index,
                                     VkDeviceSize size,
                                     VkDeviceAddress alignment);
+void pgraph_vk_ensure_buffer_space(PGRAPHState *pg, int index,
+                                   VkDeviceSize size, VkDeviceAddress alignment);
+VkDeviceSize pgraph_vk_allocate_buffer_space(PGRAPHState *pg, int index,
+                                             VkDeviceSize size,
+                                             VkDeviceAddress alignment);
 VkDeviceSize pgraph_vk_append_to_buffer(PGRAPHState *pg, int index, void **data,
                                         VkDeviceSize *sizes, size_t count,
                                         VkDeviceAddress alignment);
+void pgraph_vk_end_buffer_frame(PGRAPHState *pg, int index);
 
 // command.c
 void pgraph_vk_init_command_buffers(PGRAPHState *pg);
 void pgraph_vk_finalize_command_buffers(PGRAPHState *pg);
 VkCommandBuffer pgraph_vk_begin_single_time_commands(PGRAPHState *pg);
 void pgraph_vk_end_single_time_commands(PGRAPHState *pg, VkCommandBuffer cmd);
+VkCommandBuffer pgraph_vk_begin_aux_commands(PGRAPHState *pg);
+VkCommandBuffer pgraph_vk_begin_transfer_commands(PGRAPHState *pg);
+VkSemaphore pgraph_vk_submit_transfer_commands(PGRAPHVkState *r);
+void pgraph_vk_advance_frame(PGRAPHState *pg);
+void pgraph_vk_retire_completed_submits(PGRAPHVkState *r);
+void pgraph_vk_wait_for_submit(PGRAPHVkState *r, uint32_t submit_index);
+void pgraph_vk_wait_for_all_submits(PGRAPHVkState *r);
+void pgraph_vk_wait_for_draw_time(PGRAPHVkState *r, unsigned int draw_time);
+void pgraph_vk_signal_timeline(PGRAPHVkState *r, VkSubmitInfo *submit_info,
+                               VkTimelineSemaphoreSubmitInfo *timeline_info,
+                               uint64_t *value);
+bool pgraph_vk_check_timeline_value(PGRAPHVkState *r, uint64_t value);
+void pgraph_vk_wait_for_timeline_value(PGRAPHVkState *r, uint64_t value);
+
+// record.c
+void pgraph_vk_init_recorder(PGRAPHState *pg);
+void pgraph_vk_finalize_recorder(PGRAPHState *pg);
+VkSubpassContents pgraph_vk_recorder_begin_render_pass(PGRAPHVkState *r,
+                                                       VkRenderPass render_pass,
+                                                       VkFramebuffer framebuffer);
+void pgraph_vk_recorder_end_render_pass(PGRAPHVkState *r);
+void pgraph_vk_recorder_reset_frame(PGRAPHVkState *r, int frame_index);
+void pgraph_vk_cmd_bind_pipeline(PGRAPHVkState *r, VkPipeline pipeline);
+void pgraph_vk_cmd_set_viewport(PGRAPHVkState *r, const VkViewport *viewport);
+void pgraph_vk_cmd_set_scissor(PGRAPHVkState *r, const VkRect2D *scissor);
+void pgraph_vk_cmd_set_line_width(PGRAPHVkState *r, float line_width);
+void pgraph_vk_cmd_set_blend_constants(PGRAPHVkState *r,
+                                       const float blend_constants[4]);
+void pgraph_vk_cmd_set_stencil_compare_mask(PGRAPHVkState *r,
+                                            VkStencilFaceFlags face,
+                                            uint32_t mask);
+void pgraph_vk_cmd_set_stencil_write_mask(PGRAPHVkState *r,
+                                          VkStencilFaceFlags face,
+                                          uint32_t mask);
+void pgraph_vk_cmd_set_stencil_reference(PGRAPHVkState *r,
+                                         VkStencilFaceFlags face,
+                                         uint32_t reference);
+void pgraph_vk_cmd_set_cull_mode(PGRAPHVkState *r, VkCullModeFlags cull_mode);
+void pgraph_vk_cmd_set_front_face(PGRAPHVkState *r, VkFrontFace front_face);
+void pgraph_vk_cmd_set_depth_test_enable(PGRAPHVkState *r, VkBool32 enable);
+void pgraph_vk_cmd_set_depth_write_enable(PGRAPHVkState *r, VkBool32 enable);
+void pgraph_vk_cmd_set_depth_compare_op(PGRAPHVkState *r, VkCompareOp op);
+void pgraph_vk_cmd_set_stencil_test_enable(PGRAPHVkState *r, VkBool32 enable);
+void pgraph_vk_cmd_set_stencil_op(PGRAPHVkState *r, VkStencilFaceFlags face,
+                                  VkStencilOp fail_op, VkStencilOp pass_op,
+                                  VkStencilOp depth_fail_op,
+                                  VkCompareOp compare_op);
+void pgraph_vk_cmd_bind_descriptor_sets(PGRAPHVkState *r,
+                                        VkPipelineLayout layout,
+                                        uint32_t num_sets,
+                                        const VkDescriptorSet *sets,
+                                        uint32_t num_dynamic_offsets,
+                                        const uint32_t *dynamic_offsets);
+void pgraph_vk_cmd_push_constants(PGRAPHVkState *r, VkPipelineLayout layout,
+                                  VkShaderStageFlags stages, uint32_t offset,
+                                  uint32_t size, const void *values);
+void pgraph_vk_cmd_bind_vertex_buffers(PGRAPHVkState *r, uint32_t first,
+                                       uint32_t count, const VkBuffer *buffers,
+                                       const VkDeviceSize *offsets);
+void pgraph_vk_cmd_bind_index_buffer(PGRAPHVkState *r, VkBuffer buffer,
+                                     VkDeviceSize offset, VkIndexType type);
+void pgraph_vk_cmd_draw(PGRAPHVkState *r, uint32_t vertex_count,
+                        uint32_t instance_count, uint32_t first_vertex,
+                        uint32_t first_instance);
+void pgraph_vk_cmd_draw_indexed(PGRAPHVkState *r, uint32_t index_count,
+                                uint32_t instance_count, uint32_t first_index,
+                                int32_t vertex_offset, uint32_t first_instance);
+void pgraph_vk_cmd_clear_attachments(PGRAPHVkState *r, uint32_t count,
+                                     const VkClearAttachment *attachments,
+                                     const VkClearRect *rect);
 
 // image.c
+void pgraph_vk_init_image_layout_barrier(VkImage image, VkFormat format,
+                                         VkImageLayout oldLayout,
+                                         VkImageLayout newLayout,
+                                         VkImageMemoryBarrier *out_barrier,
+                                         VkPipelineStageFlags *src_stage,
+                                         VkPipelineStageFlags *dst_stage);
 void pgraph_vk_transition_image_layout(PGRAPHState *pg, VkCommandBuffer cmd,
                                        VkImage image, VkFormat format,
                                        VkImageLayout oldLayout,
                                        VkImageLayout newLayout);
+void pgraph_vk_init_images(PGRAPHState *pg);
+void pgraph_vk_finalize_images(PGRAPHState *pg);
+void pgraph_vk_create_image(PGRAPHVkState *r,
+                            const VkImageCreateInfo *create_info,
+                            VkImage *image, VmaAllocation *allocation,
+                            VkDeviceSize *memory_size);
+void pgraph_vk_recycle_image(PGRAPHVkState *r,
+                             const VkImageCreateInfo *create_info,
+                             VkImage image, VmaAllocation allocation);
+VkDeviceSize pgraph_vk_trim_recycled_images(PGRAPHVkState *r,
+                                            VkDeviceSize bytes);
 
 // vertex.c
 void pgraph_vk_bind_vertex_attributes(NV2AState *d, unsigned int min_element,
@@ -509,12 +891,17 @@ VkDeviceSize pgraph_vk_update_vertex_inline_buffer(PGRAPHState *pg, void **data,
 void pgraph_vk_init_surfaces(PGRAPHState *pg);
 void pgraph_vk_finalize_surfaces(PGRAPHState *pg);
 void pgraph_vk_surface_flush(NV2AState *d);
+void pgraph_vk_surface_revalidate(NV2AState *d);
 void pgraph_vk_process_pending_downloads(NV2AState *d);
 void pgraph_vk_surface_download_if_dirty(NV2AState *d, SurfaceBinding *surface);
+void pgraph_vk_mark_surfaces_written(PGRAPHVkState *r, uint64_t value);
+void pgraph_vk_wait_for_surface_writes(NV2AState *d, SurfaceBinding *surface);
 SurfaceBinding *pgraph_vk_surface_get_within(NV2AState *d, hwaddr addr);
 void pgraph_vk_wait_for_surface_download(SurfaceBinding *e);
 void pgraph_vk_download_dirty_surfaces(NV2AState *d);
 void pgraph_vk_download_surfaces_in_range_if_dirty(PGRAPHState *pg, hwaddr start, hwaddr size);
+void pgraph_vk_mark_surface_upload_pending(SurfaceBinding *surface,
+                                           hwaddr offset, hwaddr len);
 void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                                    bool force);
 void pgraph_vk_surface_update(NV2AState *d, bool upload, bool color_write,
@@ -524,23 +911,44 @@ void pgraph_vk_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta);
 void pgraph_vk_set_surface_scale_factor(NV2AState *d, unsigned int scale);
 unsigned int pgraph_vk_get_surface_scale_factor(NV2AState *d);
 void pgraph_vk_reload_surface_scale_factor(PGRAPHState *pg);
+void pgraph_vk_apply_surface_scale_factor(SurfaceBinding const *surface,
+                                          unsigned int *width,
+                                          unsigned int *height);
+void pgraph_vk_record_display_surface(PGRAPHVkState *r,
+                                      SurfaceBinding const *surface);
+VkDeviceSize pgraph_vk_get_invalid_surface_bytes(PGRAPHVkState *r);
+VkDeviceSize pgraph_vk_trim_invalid_surfaces(PGRAPHVkState *r,
+                                             VkDeviceSize bytes);
 
 // surface-compute.c
 void pgraph_vk_init_compute(PGRAPHState *pg);
 bool pgraph_vk_compute_needs_finish(PGRAPHVkState *r);
 void pgraph_vk_compute_finish_complete(PGRAPHVkState *r);
 void pgraph_vk_finalize_compute(PGRAPHState *pg);
+void pgraph_vk_swizzle_surface(PGRAPHState *pg, VkCommandBuffer cmd,
+                               int bytes_per_pixel, unsigned int width,
+                               unsigned int height, VkBuffer src, VkBuffer dst);
 void pgraph_vk_pack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
                                   VkCommandBuffer cmd, VkBuffer src,
                                   VkBuffer dst, bool downscale);
+void pgraph_vk_decode_texture(PGRAPHState *pg, VkCommandBuffer cmd,
+                              int bytes_per_pixel, bool palette,
+                              VkDescriptorBufferInfo buffers[3],
+                              const TextureDecodeRegion *regions,
+                              int num_regions);
 void pgraph_vk_unpack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
                                     VkCommandBuffer cmd, VkBuffer src,
                                     VkBuffer dst);
 
 // display.c
+void pgraph_vk_compile_display_shaders_ahead(PGRAPHVkState *r);
 void pgraph_vk_init_display(PGRAPHState *pg);
 void pgraph_vk_finalize_display(PGRAPHState *pg);
 void pgraph_vk_render_display(PGRAPHState *pg);
+void pgraph_vk_signal_present(PGRAPHVkState *r, VkSubmitInfo *submit_info,
+                              VkTimelineSemaphoreSubmitInfo *timeline_info,
+                              VkSemaphore semaphores[2], uint64_t values[2]);
+GLuint pgraph_vk_wait_for_present(PGRAPHState *pg);
 
 // texture.c
 void pgraph_vk_init_textures(PGRAPHState *pg);
@@ -548,13 +956,27 @@ void pgraph_vk_finalize_textures(PGRAPHState *pg);
 void pgraph_vk_bind_textures(NV2AState *d);
 void pgraph_vk_mark_textures_possibly_dirty(NV2AState *d, hwaddr addr,
                                             hwaddr size);
-void pgraph_vk_trim_texture_cache(PGRAPHState *pg);
+VkDeviceSize pgraph_vk_trim_texture_cache(PGRAPHState *pg, VkDeviceSize bytes);
 
 // shaders.c
 void pgraph_vk_init_shaders(PGRAPHState *pg);
 void pgraph_vk_finalize_shaders(PGRAPHState *pg);
 void pgraph_vk_update_descriptor_sets(PGRAPHState *pg);
-void pgraph_vk_bind_shaders(PGRAPHState *pg);
+void pgraph_vk_reset_descriptor_sets(PGRAPHVkState *r);
+void pgraph_vk_write_bindless_texture(PGRAPHVkState *r,
+                                      TextureBinding *texture);
+uint32_t pgraph_vk_get_uniform_attrs_push_constant_offset(PGRAPHVkState *r);
+bool pgraph_vk_use_push_constants_for_uniform_attrs(PGRAPHVkState *r,
+                                                    uint32_t uniform_attrs);
+bool pgraph_vk_bind_shaders(PGRAPHState *pg);
+void pgraph_vk_prewarm_shader_state(NV2AState *d, const ShaderState *state);
+bool pgraph_vk_init_shader_module_cache_key(PGRAPHVkState *r,
+                                            const ShaderState *state,
+                                            VkShaderStageFlagBits stage,
+                                            ShaderModuleCacheKey *key);
+ShaderModuleInfo *
+pgraph_vk_create_shader_module_for_key(PGRAPHVkState *r,
+                                       const ShaderModuleCacheKey *key);
 
 // reports.c
 void pgraph_vk_init_reports(PGRAPHState *pg);
@@ -564,10 +986,23 @@ void pgraph_vk_get_report(NV2AState *d, uint32_t parameter);
 void pgraph_vk_process_pending_reports(NV2AState *d);
 void pgraph_vk_process_pending_reports_internal(NV2AState *d);
 
+// timestamps.c
+void pgraph_vk_init_timestamps(PGRAPHState *pg);
+void pgraph_vk_finalize_timestamps(PGRAPHState *pg);
+void pgraph_vk_begin_command_buffer_timer(PGRAPHVkState *r,
+                                          VkCommandBuffer cmd);
+void pgraph_vk_end_command_buffer_timer(PGRAPHVkState *r, VkCommandBuffer cmd,
+                                        enum NV2A_PROF_GPU_TIMERS_ENUM timer);
+void pgraph_vk_begin_gpu_timer(PGRAPHVkState *r, VkCommandBuffer cmd,
+                               enum NV2A_PROF_GPU_TIMERS_ENUM timer);
+void pgraph_vk_end_gpu_timer(PGRAPHVkState *r, VkCommandBuffer cmd);
+void pgraph_vk_resolve_gpu_timers(PGRAPHVkState *r, GpuTimerPool *pool);
+
 typedef enum FinishReason {
     VK_FINISH_REASON_VERTEX_BUFFER_DIRTY,
     VK_FINISH_REASON_SURFACE_CREATE,
     VK_FINISH_REASON_SURFACE_DOWN,
+    VK_FINISH_REASON_SURFACE_READ,
     VK_FINISH_REASON_NEED_BUFFER_SPACE,
     VK_FINISH_REASON_FRAMEBUFFER_DIRTY,
     VK_FINISH_REASON_PRESENTING,
@@ -577,6 +1012,8 @@ typedef enum FinishReason {
 } FinishReason;
 
 // draw.c
+void pgraph_vk_compile_clear_shaders_ahead(PGRAPHVkState *r);
+void pgraph_vk_read_pipeline_cache_ahead(PGRAPHVkState *r);
 void pgraph_vk_init_pipelines(PGRAPHState *pg);
 void pgraph_vk_finalize_pipelines(PGRAPHState *pg);
 void pgraph_vk_clear_surface(NV2AState *d, uint32_t parameter);
@@ -587,6 +1024,7 @@ void pgraph_vk_flush_draw(NV2AState *d);
 void pgraph_vk_begin_command_buffer(PGRAPHState *pg);
 void pgraph_vk_ensure_command_buffer(PGRAPHState *pg);
 void pgraph_vk_ensure_not_in_render_pass(PGRAPHState *pg);
+void pgraph_vk_evict_framebuffers_using(PGRAPHVkState *r, VkImageView view);
 
 VkCommandBuffer pgraph_vk_begin_nondraw_commands(PGRAPHState *pg);
 void pgraph_vk_end_nondraw_commands(PGRAPHState *pg, VkCommandBuffer cmd);
@@ -595,6 +1033,7 @@ void pgraph_vk_end_nondraw_commands(PGRAPHState *pg, VkCommandBuffer cmd);
 void pgraph_vk_image_blit(NV2AState *d);
 
 // gpuprops.c
+void pgraph_vk_compile_gpu_properties_shaders_ahead(PGRAPHVkState *r);
 void pgraph_vk_determine_gpu_properties(NV2AState *d);
 GPUProperties *pgraph_vk_get_gpu_properties(void);
 
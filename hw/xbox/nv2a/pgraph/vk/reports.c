@@ -81,6 +81,12 @@ void pgraph_vk_get_report(NV2AState *d, uint32_t parameter)
     QSIMPLEQ_INSERT_TAIL(&r->report_queue, report, entry);
 
     r->new_query_needed = true;
+
+    /* Without stalls to resolve them, queries can pile up in optimistic mode */
+    if (pg->optimistic_zpass_reports &&
+        r->num_queries_in_flight >= r->max_queries_in_flight / 2) {
+        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    }
 }
 
 void pgraph_vk_process_pending_reports_internal(NV2AState *d)
@@ -153,6 +159,13 @@ void pgraph_vk_process_pending_reports(NV2AState *d)
     uint32_t *dma_get = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET];
     uint32_t *dma_put = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT];
 
+    /* Optimistic reports are answered up front and resolve whenever the
+     * command buffer is next finished, there is nothing to wait for.
+     */
+    if (pg->optimistic_zpass_reports) {
+        return;
+    }
+
     if (*dma_get == *dma_put && r->in_command_buffer) {
         pgraph_vk_finish(pg, VK_FINISH_REASON_STALLED);
     }
@@ -19,24 +19,27 @@
 
 #include "qemu/osdep.h"
 #include "qemu/fast-hash.h"
-#include "qemu/mstring.h"
+#include "xemu-version.h"
+#include "ui/xemu-settings.h"
 #include "renderer.h"
 
 #define VSH_UBO_BINDING 0
 #define PSH_UBO_BINDING 1
 #define PSH_TEX_BINDING 2
+#define BINDLESS_TEX_SET 1
+#define BINDLESS_TEX_BINDING 0
 
 const size_t MAX_UNIFORM_ATTR_VALUES_SIZE = NV2A_VERTEXSHADER_ATTRIBUTES * 4 * sizeof(float);
 
-static void create_descriptor_pool(PGRAPHState *pg)
+static void create_descriptor_pools(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    size_t num_sets = ARRAY_SIZE(r->descriptor_sets);
+    size_t num_sets = ARRAY_SIZE(r->frames[0].descriptor_sets);
 
     VkDescriptorPoolSize pool_sizes[] = {
         {
-            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             .descriptorCount = 2 * num_sets,
         },
         {
@@ -47,21 +50,28 @@ static void create_descriptor_pool(PGRAPHState *pg)
 
     VkDescriptorPoolCreateInfo pool_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-        .poolSizeCount = ARRAY_SIZE(pool_sizes),
+        // Textures are in the bindless set instead
+        .poolSizeCount =
+            r->bindless_textures_enabled ? 1 : ARRAY_SIZE(pool_sizes),
         .pPoolSizes = pool_sizes,
-        .maxSets = ARRAY_SIZE(r->descriptor_sets),
+        .maxSets = num_sets,
         .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
     };
-    VK_CHECK(vkCreateDescriptorPool(r->device, &pool_info, NULL,
-                                    &r->descriptor_pool));
+
+    for (int i = 0; i < r->num_frames; i++) {
+        VK_CHECK(vkCreateDescriptorPool(r->device, &pool_info, NULL,
+                                        &r->frames[i].descriptor_pool));
+    }
 }
 
-static void destroy_descriptor_pool(PGRAPHState *pg)
+static void destroy_descriptor_pools(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    vkDestroyDescriptorPool(r->device, r->descriptor_pool, NULL);
-    r->descriptor_pool = VK_NULL_HANDLE;
+    for (int i = 0; i < r->num_frames; i++) {
+        vkDestroyDescriptorPool(r->device, r->frames[i].descriptor_pool, NULL);
+        r->frames[i].descriptor_pool = VK_NULL_HANDLE;
+    }
 }
 
 static void create_descriptor_set_layout(PGRAPHState *pg)
@@ -73,13 +83,13 @@ static void create_descriptor_set_layout(PGRAPHState *pg)
     bindings[0] = (VkDescriptorSetLayoutBinding){
         .binding = VSH_UBO_BINDING,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
     };
     bindings[1] = (VkDescriptorSetLayoutBinding){
         .binding = PSH_UBO_BINDING,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
     };
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
@@ -92,7 +102,7 @@ static void create_descriptor_set_layout(PGRAPHState *pg)
     }
     VkDescriptorSetLayoutCreateInfo layout_info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        .bindingCount = ARRAY_SIZE(bindings),
+        .bindingCount = r->bindless_textures_enabled ? 2 : ARRAY_SIZE(bindings),
         .pBindings = bindings,
     };
     VK_CHECK(vkCreateDescriptorSetLayout(r->device, &layout_info, NULL,
@@ -107,99 +117,300 @@ static void destroy_descriptor_set_layout(PGRAPHState *pg)
     r->descriptor_set_layout = VK_NULL_HANDLE;
 }
 
+/*
+ * With bindless textures, the image view and sampler of every resident texture
+ * has an entry in a single descriptor array which stays bound for all draws.
+ * Entries are written as textures are created, and shaders select theirs with
+ * indices passed as push constants. An entry is only rewritten once its
+ * texture has been evicted, which waits for command buffers using it to
+ * complete, so other entries can be updated while the set is in use.
+ */
+static void create_bindless_descriptor_set(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    VkDescriptorSetLayoutBinding binding = {
+        .binding = BINDLESS_TEX_BINDING,
+        .descriptorCount = NV2A_VK_BINDLESS_TEXTURE_COUNT,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+    };
+    VkDescriptorBindingFlags binding_flags =
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = {
+        .sType =
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindingFlags = &binding_flags,
+    };
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+        .bindingCount = 1,
+        .pBindings = &binding,
+        .pNext = &binding_flags_info,
+    };
+    VK_CHECK(vkCreateDescriptorSetLayout(r->device, &layout_info, NULL,
+                                         &r->bindless_descriptor_set_layout));
+
+    VkDescriptorPoolSize pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = NV2A_VK_BINDLESS_TEXTURE_COUNT,
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+        .poolSizeCount = 1,
+        .pPoolSizes = &pool_size,
+        .maxSets = 1,
+    };
+    VK_CHECK(vkCreateDescriptorPool(r->device, &pool_info, NULL,
+                                    &r->bindless_descriptor_pool));
+
+    VkDescriptorSetAllocateInfo alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = r->bindless_descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &r->bindless_descriptor_set_layout,
+    };
+    VK_CHECK(vkAllocateDescriptorSets(r->device, &alloc_info,
+                                      &r->bindless_descriptor_set));
+}
+
+static void destroy_bindless_descriptor_set(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    // Frees the set along with the pool
+    vkDestroyDescriptorPool(r->device, r->bindless_descriptor_pool, NULL);
+    r->bindless_descriptor_pool = VK_NULL_HANDLE;
+    r->bindless_descriptor_set = VK_NULL_HANDLE;
+
+    vkDestroyDescriptorSetLayout(r->device, r->bindless_descriptor_set_layout,
+                                 NULL);
+    r->bindless_descriptor_set_layout = VK_NULL_HANDLE;
+}
+
+void pgraph_vk_write_bindless_texture(PGRAPHVkState *r,
+                                      TextureBinding *texture)
+{
+    assert(r->bindless_textures_enabled);
+    assert(texture->bindless_index < NV2A_VK_BINDLESS_TEXTURE_COUNT);
+
+    VkDescriptorImageInfo image_info = {
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .imageView = texture->image_view,
+        .sampler = texture->sampler->sampler,
+    };
+    VkWriteDescriptorSet descriptor_write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = r->bindless_descriptor_set,
+        .dstBinding = BINDLESS_TEX_BINDING,
+        .dstArrayElement = texture->bindless_index,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .pImageInfo = &image_info,
+    };
+    vkUpdateDescriptorSets(r->device, 1, &descriptor_write, 0, NULL);
+    nv2a_profile_inc_counter(NV2A_PROF_BINDLESS_TEXTURE_WRITE);
+}
+
+/*
+ * Push constants start with the bindless texture indices, followed by inline
+ * vertex attribute values when they fit.
+ */
+uint32_t pgraph_vk_get_uniform_attrs_push_constant_offset(PGRAPHVkState *r)
+{
+    return r->bindless_textures_enabled ? NV2A_MAX_TEXTURES * sizeof(uint32_t) :
+                                          0;
+}
+
+bool pgraph_vk_use_push_constants_for_uniform_attrs(PGRAPHVkState *r,
+                                                    uint32_t uniform_attrs)
+{
+    size_t size = pgraph_vk_get_uniform_attrs_push_constant_offset(r) +
+                  __builtin_popcount(uniform_attrs) * 4 * sizeof(float);
+
+    return r->use_push_constants_for_uniform_attrs &&
+           size <= r->device_props.limits.maxPushConstantsSize;
+}
+
+static guint descriptor_set_key_hash(gconstpointer key)
+{
+    return fast_hash((void *)key, sizeof(DescriptorSetKey));
+}
+
+static gboolean descriptor_set_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(DescriptorSetKey));
+}
+
 static void create_descriptor_sets(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    VkDescriptorSetLayout layouts[ARRAY_SIZE(r->descriptor_sets)];
+    VkDescriptorSetLayout layouts[ARRAY_SIZE(r->frames[0].descriptor_sets)];
     for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
         layouts[i] = r->descriptor_set_layout;
     }
 
-    VkDescriptorSetAllocateInfo alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool = r->descriptor_pool,
-        .descriptorSetCount = ARRAY_SIZE(r->descriptor_sets),
-        .pSetLayouts = layouts,
-    };
-    VK_CHECK(
-        vkAllocateDescriptorSets(r->device, &alloc_info, r->descriptor_sets));
+    for (int i = 0; i < r->num_frames; i++) {
+        CommandBufferFrame *frame = &r->frames[i];
+        VkDescriptorSetAllocateInfo alloc_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = frame->descriptor_pool,
+            .descriptorSetCount = ARRAY_SIZE(frame->descriptor_sets),
+            .pSetLayouts = layouts,
+        };
+        VK_CHECK(vkAllocateDescriptorSets(r->device, &alloc_info,
+                                          frame->descriptor_sets));
+    }
+
+    r->descriptor_set_cache =
+        g_hash_table_new(descriptor_set_key_hash, descriptor_set_key_equal);
 }
 
 static void destroy_descriptor_sets(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    vkFreeDescriptorSets(r->device, r->descriptor_pool,
-                         ARRAY_SIZE(r->descriptor_sets), r->descriptor_sets);
-    for (int i = 0; i < ARRAY_SIZE(r->descriptor_sets); i++) {
-        r->descriptor_sets[i] = VK_NULL_HANDLE;
+    for (int i = 0; i < r->num_frames; i++) {
+        CommandBufferFrame *frame = &r->frames[i];
+        vkFreeDescriptorSets(r->device, frame->descriptor_pool,
+                             ARRAY_SIZE(frame->descriptor_sets),
+                             frame->descriptor_sets);
+        for (int j = 0; j < ARRAY_SIZE(frame->descriptor_sets); j++) {
+            frame->descriptor_sets[j] = VK_NULL_HANDLE;
+        }
     }
+
+    g_hash_table_destroy(r->descriptor_set_cache);
+    r->descriptor_set_cache = NULL;
+}
+
+/*
+ * Each frame has its own descriptor sets, which can only be rewritten once the
+ * command buffer using them has completed. The cache of written sets only
+ * covers the frame being recorded, so it is reset along with the ring.
+ */
+void pgraph_vk_reset_descriptor_sets(PGRAPHVkState *r)
+{
+    r->descriptor_set_index = 0;
+    g_hash_table_remove_all(r->descriptor_set_cache);
 }
 
 void pgraph_vk_update_descriptor_sets(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    bool need_uniform_write =
-        r->uniforms_changed ||
-        !r->storage_buffers[BUFFER_UNIFORM_STAGING].buffer_offset;
+    bool frame_start =
+        r->storage_buffers[BUFFER_UNIFORM_STAGING].buffer_offset ==
+        r->storage_buffers[BUFFER_UNIFORM_STAGING].frame_start;
+    bool need_uniform_write[2];
+    for (int i = 0; i < ARRAY_SIZE(need_uniform_write); i++) {
+        need_uniform_write[i] = r->uniforms_changed[i] || frame_start;
+    }
+
+    bool need_texture_write =
+        r->texture_bindings_changed && !r->bindless_textures_enabled;
 
-    if (!(r->shader_bindings_changed || r->texture_bindings_changed ||
-          (r->descriptor_set_index == 0) || need_uniform_write)) {
+    if (!(r->shader_bindings_changed || need_texture_write ||
+          (r->descriptor_set_index == 0) || need_uniform_write[0] ||
+          need_uniform_write[1])) {
         return; // Nothing changed
     }
 
     ShaderBinding *binding = r->shader_binding;
     ShaderUniformLayout *layouts[] = { &binding->vsh.module_info->uniforms,
                                        &binding->psh.module_info->uniforms };
-    VkDeviceSize ubo_buffer_total_size = 0;
-    for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
-        ubo_buffer_total_size += layouts[i]->total_size;
-    }
-    bool need_ubo_staging_buffer_reset =
-        r->uniforms_changed &&
-        !pgraph_vk_buffer_has_space_for(pg, BUFFER_UNIFORM_STAGING,
-                                        ubo_buffer_total_size,
-                                        r->device_props.limits.minUniformBufferOffsetAlignment);
+    VkDeviceAddress ubo_alignment =
+        r->device_props.limits.minUniformBufferOffsetAlignment;
 
     bool need_descriptor_write_reset =
-        (r->descriptor_set_index >= ARRAY_SIZE(r->descriptor_sets));
+        (r->descriptor_set_index >= ARRAY_SIZE(r->frame->descriptor_sets));
 
-    if (need_descriptor_write_reset || need_ubo_staging_buffer_reset) {
+    if (need_descriptor_write_reset) {
         pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
-        need_uniform_write = true;
+        need_uniform_write[0] = need_uniform_write[1] = true;
     }
 
-    VkWriteDescriptorSet descriptor_writes[2 + NV2A_MAX_TEXTURES];
+    /*
+     * Uniform buffers are bound with dynamic offsets, so only the blocks that
+     * changed are appended, the other keeps pointing at its last copy.
+     */
+    if (need_uniform_write[0] || need_uniform_write[1]) {
+        VkDeviceSize ubo_buffer_total_size = 0;
+        for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
+            ubo_buffer_total_size += ROUND_UP(layouts[i]->total_size,
+                                              ubo_alignment);
+        }
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_UNIFORM_STAGING,
+                                      ubo_buffer_total_size, ubo_alignment);
 
-    assert(r->descriptor_set_index < ARRAY_SIZE(r->descriptor_sets));
+        /* Making space may have started a new frame, with nothing to reuse */
+        if (r->storage_buffers[BUFFER_UNIFORM_STAGING].buffer_offset ==
+            r->storage_buffers[BUFFER_UNIFORM_STAGING].frame_start) {
+            need_uniform_write[0] = need_uniform_write[1] = true;
+        }
 
-    if (need_uniform_write) {
         for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
+            if (!need_uniform_write[i]) {
+                continue;
+            }
             void *data = layouts[i]->allocation;
             VkDeviceSize size = layouts[i]->total_size;
             r->uniform_buffer_offsets[i] = pgraph_vk_append_to_buffer(
-                pg, BUFFER_UNIFORM_STAGING, &data, &size, 1,
-                r->device_props.limits.minUniformBufferOffsetAlignment);
+                pg, BUFFER_UNIFORM_STAGING, &data, &size, 1, ubo_alignment);
+            r->uniforms_changed[i] = false;
         }
+    }
+
+    /*
+     * Uniform buffers are bound with dynamic offsets, so the set only depends
+     * on the bound textures and the uniform block sizes. Reuse a set written
+     * earlier in this command buffer if there is one.
+     */
+    DescriptorSetKey key;
+    memset(&key, 0, sizeof(key));
+    for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
+        key.ubo_ranges[i] = layouts[i]->total_size;
+    }
+    if (!r->bindless_textures_enabled) {
+        for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
+            key.image_views[i] = r->texture_bindings[i]->image_view;
+            key.samplers[i] = r->texture_samplers[i]->sampler;
+        }
+    }
 
-        r->uniforms_changed = false;
+    int index = GPOINTER_TO_INT(
+        g_hash_table_lookup(r->descriptor_set_cache, &key));
+    if (index) {
+        nv2a_profile_inc_counter(NV2A_PROF_DESCRIPTOR_SET_REUSED);
+        r->descriptor_set_current = index - 1;
+        return;
     }
 
+    assert(r->descriptor_set_index < ARRAY_SIZE(r->frame->descriptor_sets));
+    index = r->descriptor_set_index++;
+    VkDescriptorSet set = r->frame->descriptor_sets[index];
+
+    VkWriteDescriptorSet descriptor_writes[2 + NV2A_MAX_TEXTURES];
+
     VkDescriptorBufferInfo ubo_buffer_infos[2];
     for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
         ubo_buffer_infos[i] = (VkDescriptorBufferInfo){
             .buffer = r->storage_buffers[BUFFER_UNIFORM].buffer,
-            .offset = r->uniform_buffer_offsets[i],
-            .range = layouts[i]->total_size,
+            .offset = 0,
+            .range = key.ubo_ranges[i],
         };
         descriptor_writes[i] = (VkWriteDescriptorSet){
             .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet = r->descriptor_sets[r->descriptor_set_index],
+            .dstSet = set,
             .dstBinding = i == 0 ? VSH_UBO_BINDING : PSH_UBO_BINDING,
             .dstArrayElement = 0,
-            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             .descriptorCount = 1,
             .pBufferInfo = &ubo_buffer_infos[i],
         };
@@ -209,12 +420,12 @@ void pgraph_vk_update_descriptor_sets(PGRAPHState *pg)
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
         image_infos[i] = (VkDescriptorImageInfo){
             .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-            .imageView = r->texture_bindings[i]->image_view,
-            .sampler = r->texture_bindings[i]->sampler,
+            .imageView = key.image_views[i],
+            .sampler = key.samplers[i],
         };
         descriptor_writes[2 + i] = (VkWriteDescriptorSet){
             .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet = r->descriptor_sets[r->descriptor_set_index],
+            .dstSet = set,
             .dstBinding = PSH_TEX_BINDING + i,
             .dstArrayElement = 0,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
@@ -223,9 +434,15 @@ void pgraph_vk_update_descriptor_sets(PGRAPHState *pg)
         };
     }
 
-    vkUpdateDescriptorSets(r->device, 6, descriptor_writes, 0, NULL);
+    int num_descriptor_writes =
+        r->bindless_textures_enabled ? 2 : ARRAY_SIZE(descriptor_writes);
+    vkUpdateDescriptorSets(r->device, num_descriptor_writes, descriptor_writes,
+                           0, NULL);
 
-    r->descriptor_set_index++;
+    r->descriptor_set_keys[index] = key;
+    g_hash_table_insert(r->descriptor_set_cache, &r->descriptor_set_keys[index],
+                        GINT_TO_POINTER(index + 1));
+    r->descriptor_set_current = index;
 }
 
 static void update_shader_uniform_locs(ShaderBinding *binding)
@@ -253,6 +470,443 @@ get_and_ref_shader_module_for_key(PGRAPHVkState *r,
     return module->module_info;
 }
 
+/*
+ * Build the module cache key for one stage of a shader state. Returns false if
+ * the stage is not used by this state. Safe to call from any thread.
+ *
+ * The fog mode and alpha test are left to specialization constants set at
+ * pipeline creation, so one module serves every value of them.
+ */
+bool pgraph_vk_init_shader_module_cache_key(PGRAPHVkState *r,
+                                            const ShaderState *state,
+                                            VkShaderStageFlagBits stage,
+                                            ShaderModuleCacheKey *key)
+{
+    bool need_geometry_shader = pgraph_glsl_need_geom(&state->geom);
+
+    memset(key, 0, sizeof(*key));
+    key->kind = stage;
+
+    switch (stage) {
+    case VK_SHADER_STAGE_GEOMETRY_BIT:
+        if (!need_geometry_shader) {
+            return false;
+        }
+        key->geom.state = state->geom;
+        key->geom.glsl_opts.vulkan = true;
+        return true;
+    case VK_SHADER_STAGE_VERTEX_BIT:
+        key->vsh.state = state->vsh;
+        key->vsh.state.fog_mode = 0;
+        key->vsh.glsl_opts.vulkan = true;
+        key->vsh.glsl_opts.use_spec_constants = true;
+        key->vsh.glsl_opts.prefix_outputs = need_geometry_shader;
+        key->vsh.glsl_opts.use_push_constants_for_uniform_attrs =
+            pgraph_vk_use_push_constants_for_uniform_attrs(
+                r, state->vsh.uniform_attrs);
+        key->vsh.glsl_opts.push_constants_offset =
+            pgraph_vk_get_uniform_attrs_push_constant_offset(r);
+        key->vsh.glsl_opts.ubo_binding = VSH_UBO_BINDING;
+        return true;
+    case VK_SHADER_STAGE_FRAGMENT_BIT:
+        key->psh.state = state->psh;
+        key->psh.state.alpha_test = false;
+        key->psh.state.alpha_func = 0;
+        key->psh.glsl_opts.vulkan = true;
+        key->psh.glsl_opts.use_spec_constants = true;
+        key->psh.glsl_opts.ubo_binding = PSH_UBO_BINDING;
+        key->psh.glsl_opts.tex_binding = PSH_TEX_BINDING;
+        if (r->bindless_textures_enabled) {
+            key->psh.glsl_opts.bindless_textures = true;
+            key->psh.glsl_opts.bindless_tex_set = BINDLESS_TEX_SET;
+            key->psh.glsl_opts.bindless_tex_binding = BINDLESS_TEX_BINDING;
+            key->psh.glsl_opts.bindless_tex_count =
+                NV2A_VK_BINDLESS_TEXTURE_COUNT;
+        }
+        return true;
+    default:
+        assert(!"Invalid shader module kind");
+        return false;
+    }
+}
+
+/*
+ * Compiled SPIR-V is kept on disk, one file per module key, so GLSL generation
+ * and glslang can be skipped entirely on later boots. Bump the version when
+ * the generated code changes without the key changing.
+ */
+#define SPIRV_CACHE_FILE_MAGIC "XVKSPIRV"
+#define SPIRV_CACHE_FILE_VERSION 3
+
+typedef struct SpirvCacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    char xemu_version[64];
+    ShaderModuleCacheKey key;
+} SpirvCacheFileHeader;
+
+static char *get_spirv_cache_dir(void)
+{
+    return g_build_filename(xemu_settings_get_cache_path(), "vk_spirv", NULL);
+}
+
+static char *get_spirv_cache_path(const ShaderModuleCacheKey *key)
+{
+    uint64_t hash = fast_hash((void *)key, sizeof(*key));
+    g_autofree char *dir = get_spirv_cache_dir();
+    g_autofree char *name = g_strdup_printf("%016" PRIx64 ".spv", hash);
+    return g_build_filename(dir, name, NULL);
+}
+
+static void init_spirv_cache_file_header(const ShaderModuleCacheKey *key,
+                                         SpirvCacheFileHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SPIRV_CACHE_FILE_MAGIC, sizeof(header->magic));
+    header->version = SPIRV_CACHE_FILE_VERSION;
+    header->key_size = sizeof(ShaderModuleCacheKey);
+    g_strlcpy(header->xemu_version, xemu_version,
+              sizeof(header->xemu_version));
+    memcpy(&header->key, key, sizeof(*key));
+}
+
+static GByteArray *load_spirv_from_disk(const ShaderModuleCacheKey *key)
+{
+    if (!g_config.perf.cache_shaders) {
+        return NULL;
+    }
+
+    g_autofree char *path = get_spirv_cache_path(key);
+    g_autofree gchar *contents = NULL;
+    gsize length;
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        return NULL;
+    }
+
+    /* The full key is stored to catch hash collisions */
+    SpirvCacheFileHeader expected;
+    init_spirv_cache_file_header(key, &expected);
+    if (length <= sizeof(expected) ||
+        (length - sizeof(expected)) % sizeof(uint32_t) ||
+        memcmp(contents, &expected, sizeof(expected))) {
+        qemu_unlink(path);
+        return NULL;
+    }
+
+    GByteArray *spv = g_byte_array_sized_new(length - sizeof(expected));
+    g_byte_array_append(spv, (guint8 *)contents + sizeof(expected),
+                        length - sizeof(expected));
+    return spv;
+}
+
+static void save_spirv_to_disk(const ShaderModuleCacheKey *key,
+                               const GByteArray *spv)
+{
+    if (!g_config.perf.cache_shaders) {
+        return;
+    }
+
+    size_t length = sizeof(SpirvCacheFileHeader) + spv->len;
+    g_autofree uint8_t *contents = g_malloc(length);
+    init_spirv_cache_file_header(key, (SpirvCacheFileHeader *)contents);
+    memcpy(contents + sizeof(SpirvCacheFileHeader), spv->data, spv->len);
+
+    g_autofree char *path = get_spirv_cache_path(key);
+    g_autoptr(GError) err = NULL;
+    if (!g_file_set_contents(path, (gchar *)contents, length, &err)) {
+        fprintf(stderr, "nv2a: Failed to write shader module cache: %s\n",
+                err->message);
+    }
+}
+
+static void compile_shader_module_for_key(PGRAPHVkState *r,
+                                          const ShaderModuleCacheKey *key,
+                                          ShaderModuleInfo *info)
+{
+    GByteArray *spv = load_spirv_from_disk(key);
+    if (spv) {
+        pgraph_vk_init_shader_module_from_spv(r, info, spv);
+        return;
+    }
+
+    ShaderCodeKey code_key;
+    const char *stage_name;
+    memset(&code_key, 0, sizeof(code_key));
+
+    switch (key->kind) {
+    case VK_SHADER_STAGE_VERTEX_BIT:
+        code_key.stage = SHADER_CODE_VERTEX;
+        memcpy(&code_key.vsh, &key->vsh, sizeof(code_key.vsh));
+        stage_name = "vertex";
+        break;
+    case VK_SHADER_STAGE_GEOMETRY_BIT:
+        code_key.stage = SHADER_CODE_GEOMETRY;
+        memcpy(&code_key.geom, &key->geom, sizeof(code_key.geom));
+        stage_name = "geometry";
+        break;
+    case VK_SHADER_STAGE_FRAGMENT_BIT:
+        code_key.stage = SHADER_CODE_FRAGMENT;
+        memcpy(&code_key.psh, &key->psh, sizeof(code_key.psh));
+        stage_name = "fragment";
+        break;
+    default:
+        assert(!"Invalid shader module kind");
+        return;
+    }
+
+    int64_t start = nv2a_profile_cpu_time_begin();
+    g_autofree char *code = pgraph_glsl_get_shader_code(&code_key);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SHADER_GEN, stage_name, start);
+
+    start = nv2a_profile_cpu_time_begin();
+    pgraph_vk_compile_shader_module(r, info, key->kind, code);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SHADER_COMPILE, stage_name, start);
+
+    save_spirv_to_disk(key, info->spirv);
+}
+
+/*
+ * Generate and compile the module for a cache key without going through the
+ * module cache. Safe to call from any thread.
+ */
+ShaderModuleInfo *
+pgraph_vk_create_shader_module_for_key(PGRAPHVkState *r,
+                                       const ShaderModuleCacheKey *key)
+{
+    ShaderModuleInfo *info = g_malloc0(sizeof(*info));
+    compile_shader_module_for_key(r, key, info);
+    info->ready = true;
+    return info;
+}
+
+/*
+ * With async shaders enabled, a module cache miss only allocates the
+ * ShaderModuleInfo and queues a job to fill it in. Later lookups of the same
+ * key hit the same cache entry, so each module is compiled once no matter how
+ * many draws ask for it while it is in flight.
+ */
+typedef struct ShaderCompileJob {
+    ShaderModuleCacheKey key;
+    ShaderModuleInfo *info;
+} ShaderCompileJob;
+
+static void *shader_compile_thread(void *opaque)
+{
+    PGRAPHVkState *r = opaque;
+
+    qemu_mutex_lock(&r->shader_compile_lock);
+    while (true) {
+        while (!r->shader_compile_stop &&
+               g_queue_is_empty(&r->shader_compile_queue)) {
+            qemu_cond_wait(&r->shader_compile_cond, &r->shader_compile_lock);
+        }
+        if (r->shader_compile_stop) {
+            break;
+        }
+
+        ShaderCompileJob *job = g_queue_pop_head(&r->shader_compile_queue);
+        qemu_mutex_unlock(&r->shader_compile_lock);
+
+        compile_shader_module_for_key(r, &job->key, job->info);
+
+        qemu_mutex_lock(&r->shader_compile_lock);
+        qatomic_store_release(&job->info->ready, true);
+        qemu_cond_broadcast(&r->shader_compile_done_cond);
+        g_free(job);
+    }
+    qemu_mutex_unlock(&r->shader_compile_lock);
+
+    return NULL;
+}
+
+static gint compare_shader_compile_job_info(gconstpointer a, gconstpointer b)
+{
+    const ShaderCompileJob *job = a;
+    return job->info != b;
+}
+
+static void queue_shader_compile(PGRAPHVkState *r,
+                                 const ShaderModuleCacheKey *key,
+                                 ShaderModuleInfo *info)
+{
+    ShaderCompileJob *job = g_malloc(sizeof(*job));
+    memcpy(&job->key, key, sizeof(*key));
+    job->info = info;
+
+    qemu_mutex_lock(&r->shader_compile_lock);
+    g_queue_push_tail(&r->shader_compile_queue, job);
+    qemu_cond_signal(&r->shader_compile_cond);
+    qemu_mutex_unlock(&r->shader_compile_lock);
+}
+
+/*
+ * Make sure no worker will touch the module after this returns. A job that has
+ * not been picked up yet is either compiled here or, if the module is about to
+ * be destroyed anyway, dropped.
+ */
+static void finish_shader_compile(PGRAPHVkState *r, ShaderModuleInfo *info,
+                                  bool cancel)
+{
+    if (qatomic_load_acquire(&info->ready)) {
+        return;
+    }
+
+    qemu_mutex_lock(&r->shader_compile_lock);
+    GList *link = g_queue_find_custom(&r->shader_compile_queue, info,
+                                      compare_shader_compile_job_info);
+    if (link) {
+        ShaderCompileJob *job = link->data;
+        g_queue_delete_link(&r->shader_compile_queue, link);
+        qemu_mutex_unlock(&r->shader_compile_lock);
+
+        if (!cancel) {
+            compile_shader_module_for_key(r, &job->key, info);
+            qatomic_store_release(&info->ready, true);
+        }
+        g_free(job);
+        return;
+    }
+
+    while (!qatomic_read(&info->ready)) {
+        qemu_cond_wait(&r->shader_compile_done_cond, &r->shader_compile_lock);
+    }
+    qemu_mutex_unlock(&r->shader_compile_lock);
+}
+
+static void release_shader_module(PGRAPHVkState *r, ShaderModuleInfo *info)
+{
+    if (info->refcnt == 1) {
+        finish_shader_compile(r, info, true);
+    }
+    pgraph_vk_unref_shader_module(r, info);
+}
+
+static void init_shader_compile_threads(PGRAPHVkState *r)
+{
+    r->async_shaders = g_config.display.vulkan.async_shaders;
+    r->uber_shaders =
+        r->async_shaders != CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_DISABLED &&
+        g_config.display.vulkan.uber_shaders;
+
+    qemu_mutex_init(&r->shader_compile_lock);
+    qemu_cond_init(&r->shader_compile_cond);
+    qemu_cond_init(&r->shader_compile_done_cond);
+    g_queue_init(&r->shader_compile_queue);
+    r->shader_compile_stop = false;
+    r->num_shader_compile_threads = 0;
+    r->shader_compile_threads = NULL;
+
+    if (r->async_shaders == CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_DISABLED) {
+        return;
+    }
+
+    r->num_shader_compile_threads = MIN(4, MAX(1, g_get_num_processors() / 2));
+    r->shader_compile_threads =
+        g_new(QemuThread, r->num_shader_compile_threads);
+    for (int i = 0; i < r->num_shader_compile_threads; i++) {
+        qemu_thread_create(&r->shader_compile_threads[i],
+                           "nv2a.vk_shader_compile", shader_compile_thread, r,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void finalize_shader_compile_threads(PGRAPHVkState *r)
+{
+    qemu_mutex_lock(&r->shader_compile_lock);
+    r->shader_compile_stop = true;
+    qemu_cond_broadcast(&r->shader_compile_cond);
+    qemu_mutex_unlock(&r->shader_compile_lock);
+
+    for (int i = 0; i < r->num_shader_compile_threads; i++) {
+        qemu_thread_join(&r->shader_compile_threads[i]);
+    }
+    g_free(r->shader_compile_threads);
+    r->shader_compile_threads = NULL;
+    r->num_shader_compile_threads = 0;
+}
+
+static void destroy_shader_compile_queue(PGRAPHVkState *r)
+{
+    assert(g_queue_is_empty(&r->shader_compile_queue));
+    qemu_cond_destroy(&r->shader_compile_done_cond);
+    qemu_cond_destroy(&r->shader_compile_cond);
+    qemu_mutex_destroy(&r->shader_compile_lock);
+}
+
+/*
+ * The uber fragment shader interprets the combiner registers, so it is shared
+ * by every state that differs only in its combiner setup.
+ */
+static void init_uber_psh_module_cache_key(PGRAPHVkState *r,
+                                           const ShaderState *state,
+                                           ShaderModuleCacheKey *key)
+{
+    pgraph_vk_init_shader_module_cache_key(r, state,
+                                           VK_SHADER_STAGE_FRAGMENT_BIT, key);
+    PshState *psh = &key->psh.state;
+    psh->combiner_control = 0;
+    psh->final_inputs_0 = 0;
+    psh->final_inputs_1 = 0;
+    memset(psh->rgb_inputs, 0, sizeof(psh->rgb_inputs));
+    memset(psh->rgb_outputs, 0, sizeof(psh->rgb_outputs));
+    memset(psh->alpha_inputs, 0, sizeof(psh->alpha_inputs));
+    memset(psh->alpha_outputs, 0, sizeof(psh->alpha_outputs));
+    key->psh.glsl_opts.uber_combiners = true;
+}
+
+/*
+ * Returns true once every module of the binding is compiled. In wait mode (or
+ * with async shaders disabled) this always succeeds, blocking if needed. If
+ * uber shaders are enabled, the uber fragment shader is used until the
+ * specialized one is ready.
+ */
+static bool ensure_shader_binding_ready(PGRAPHVkState *r,
+                                        ShaderBinding *binding)
+{
+    if (binding->uniform_locs_valid) {
+        ShaderModuleInfo *pending = binding->psh.pending_module_info;
+        if (!pending || !qatomic_load_acquire(&pending->ready)) {
+            return true;
+        }
+
+        release_shader_module(r, binding->psh.module_info);
+        binding->psh.module_info = pending;
+        binding->psh.pending_module_info = NULL;
+        update_shader_uniform_locs(binding);
+        r->shader_bindings_changed = true;
+        return true;
+    }
+
+    if (r->uber_shaders && !binding->psh.pending_module_info &&
+        !qatomic_load_acquire(&binding->psh.module_info->ready)) {
+        ShaderModuleCacheKey key;
+        init_uber_psh_module_cache_key(r, &binding->state, &key);
+        binding->psh.pending_module_info = binding->psh.module_info;
+        binding->psh.module_info = get_and_ref_shader_module_for_key(r, &key);
+    }
+
+    ShaderModuleInfo *modules[] = {
+        binding->vsh.module_info,
+        binding->geom.module_info,
+        binding->psh.module_info,
+    };
+    for (int i = 0; i < ARRAY_SIZE(modules); i++) {
+        if (!modules[i]) {
+            continue;
+        }
+        if (r->async_shaders == CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_SKIP_DRAW &&
+            !qatomic_load_acquire(&modules[i]->ready)) {
+            return false;
+        }
+        finish_shader_compile(r, modules[i], false);
+    }
+
+    update_shader_uniform_locs(binding);
+    binding->uniform_locs_valid = true;
+    return true;
+}
+
 static void shader_cache_entry_init(Lru *lru, LruNode *node, const void *state)
 {
     PGRAPHVkState *r = container_of(lru, PGRAPHVkState, shader_cache);
@@ -261,39 +915,28 @@ static void shader_cache_entry_init(Lru *lru, LruNode *node, const void *state)
 
     NV2A_VK_DPRINTF("cache miss");
     nv2a_profile_inc_counter(NV2A_PROF_SHADER_GEN);
+    pgraph_glsl_dump_shader_state(&binding->state);
+    pgraph_glsl_record_shader_state(&binding->state);
 
     ShaderModuleCacheKey key;
 
-    bool need_geometry_shader = pgraph_glsl_need_geom(&binding->state.geom);
-    if (need_geometry_shader) {
-        memset(&key, 0, sizeof(key));
-        key.kind = VK_SHADER_STAGE_GEOMETRY_BIT;
-        key.geom.state = binding->state.geom;
-        key.geom.glsl_opts.vulkan = true;
+    if (pgraph_vk_init_shader_module_cache_key(
+            r, &binding->state, VK_SHADER_STAGE_GEOMETRY_BIT, &key)) {
         binding->geom.module_info = get_and_ref_shader_module_for_key(r, &key);
     } else {
         binding->geom.module_info = NULL;
     }
 
-    memset(&key, 0, sizeof(key));
-    key.kind = VK_SHADER_STAGE_VERTEX_BIT;
-    key.vsh.state = binding->state.vsh;
-    key.vsh.glsl_opts.vulkan = true;
-    key.vsh.glsl_opts.prefix_outputs = need_geometry_shader;
-    key.vsh.glsl_opts.use_push_constants_for_uniform_attrs =
-        r->use_push_constants_for_uniform_attrs;
-    key.vsh.glsl_opts.ubo_binding = VSH_UBO_BINDING;
+    pgraph_vk_init_shader_module_cache_key(r, &binding->state,
+                                           VK_SHADER_STAGE_VERTEX_BIT, &key);
     binding->vsh.module_info = get_and_ref_shader_module_for_key(r, &key);
 
-    memset(&key, 0, sizeof(key));
-    key.kind = VK_SHADER_STAGE_FRAGMENT_BIT;
-    key.psh.state = binding->state.psh;
-    key.psh.glsl_opts.vulkan = true;
-    key.psh.glsl_opts.ubo_binding = PSH_UBO_BINDING;
-    key.psh.glsl_opts.tex_binding = PSH_TEX_BINDING;
+    pgraph_vk_init_shader_module_cache_key(r, &binding->state,
+                                           VK_SHADER_STAGE_FRAGMENT_BIT, &key);
     binding->psh.module_info = get_and_ref_shader_module_for_key(r, &key);
+    binding->psh.pending_module_info = NULL;
 
-    update_shader_uniform_locs(binding);
+    binding->uniform_locs_valid = false;
 }
 
 static void shader_cache_entry_post_evict(Lru *lru, LruNode *node)
@@ -305,10 +948,11 @@ static void shader_cache_entry_post_evict(Lru *lru, LruNode *node)
         snode->vsh.module_info,
         snode->geom.module_info,
         snode->psh.module_info,
+        snode->psh.pending_module_info,
     };
     for (int i = 0; i < ARRAY_SIZE(modules); i++) {
         if (modules[i]) {
-            pgraph_vk_unref_shader_module(r, modules[i]);
+            release_shader_module(r, modules[i]);
         }
     }
 }
@@ -327,30 +971,14 @@ static void shader_module_cache_entry_init(Lru *lru, LruNode *node,
         container_of(node, ShaderModuleCacheEntry, node);
     memcpy(&module->key, key, sizeof(ShaderModuleCacheKey));
 
-    MString *code;
-
-    switch (module->key.kind) {
-    case VK_SHADER_STAGE_VERTEX_BIT:
-        code = pgraph_glsl_gen_vsh(&module->key.vsh.state,
-                                   module->key.vsh.glsl_opts);
-        break;
-    case VK_SHADER_STAGE_GEOMETRY_BIT:
-        code = pgraph_glsl_gen_geom(&module->key.geom.state,
-                                    module->key.geom.glsl_opts);
-        break;
-    case VK_SHADER_STAGE_FRAGMENT_BIT:
-        code = pgraph_glsl_gen_psh(&module->key.psh.state,
-                                   module->key.psh.glsl_opts);
-        break;
-    default:
-        assert(!"Invalid shader module kind");
-        code = NULL;
+    if (r->async_shaders == CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_DISABLED) {
+        module->module_info =
+            pgraph_vk_create_shader_module_for_key(r, &module->key);
+    } else {
+        module->module_info = g_malloc0(sizeof(ShaderModuleInfo));
+        queue_shader_compile(r, &module->key, module->module_info);
     }
-
-    module->module_info = pgraph_vk_create_shader_module_from_glsl(
-        r, module->key.kind, mstring_get_str(code));
     pgraph_vk_ref_shader_module(module->module_info);
-    mstring_unref(code);
 }
 
 static void shader_module_cache_entry_post_evict(Lru *lru, LruNode *node)
@@ -358,7 +986,7 @@ static void shader_module_cache_entry_post_evict(Lru *lru, LruNode *node)
     PGRAPHVkState *r = container_of(lru, PGRAPHVkState, shader_module_cache);
     ShaderModuleCacheEntry *module =
         container_of(node, ShaderModuleCacheEntry, node);
-    pgraph_vk_unref_shader_module(r, module->module_info);
+    release_shader_module(r, module->module_info);
     module->module_info = NULL;
 }
 
@@ -374,6 +1002,11 @@ static void shader_cache_init(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
+    if (g_config.perf.cache_shaders) {
+        g_autofree char *spirv_cache_dir = get_spirv_cache_dir();
+        qemu_mkdir(spirv_cache_dir);
+    }
+
     const size_t shader_cache_size = 1024;
     lru_init(&r->shader_cache);
     r->shader_cache_entries = g_malloc_n(shader_cache_size, sizeof(ShaderBinding));
@@ -425,6 +1058,19 @@ static ShaderBinding *get_shader_binding_for_state(PGRAPHVkState *r,
     return binding;
 }
 
+void pgraph_vk_prewarm_shader_state(NV2AState *d, const ShaderState *state)
+{
+    PGRAPHVkState *r = d->pgraph.vk_renderer_state;
+
+    /* Compiling would stall the guest as long as it would on first draw */
+    if (r->async_shaders == CONFIG_DISPLAY_VULKAN_ASYNC_SHADERS_DISABLED) {
+        return;
+    }
+
+    /* A miss queues the module compiles, the binding is finished when bound */
+    get_shader_binding_for_state(r, state);
+}
+
 static void apply_uniform_updates(ShaderUniformLayout *layout,
                                   const UniformInfo *info, int *locs,
                                   void *values, size_t count)
@@ -437,7 +1083,34 @@ static void apply_uniform_updates(ShaderUniformLayout *layout,
     }
 }
 
-// FIXME: Dirty tracking
+/*
+ * The vertex program constants are most of the vertex shader uniforms, and
+ * only a few of them usually change between draws. Copy just the rows
+ * written since the last update, or all of them when the binding changed as
+ * the layout may then not hold the latest values.
+ */
+static void update_vsh_constants(PGRAPHState *pg, ShaderBinding *binding)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    ShaderUniformLayout *layout = &binding->vsh.module_info->uniforms;
+    int loc = binding->vsh.uniform_locs[VshUniform_c];
+
+    if (loc == -1) {
+        return;
+    }
+
+    size_t stride = layout->uniforms[loc - 1].stride;
+    char *out = uniform_ptr(layout, loc);
+
+    for (int i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
+        if (r->shader_bindings_changed || pg->vsh_constants_dirty[i]) {
+            memcpy(out + i * stride, pg->vsh_constants[i],
+                   sizeof(pg->vsh_constants[i]));
+            pg->vsh_constants_dirty[i] = false;
+        }
+    }
+}
+
 static void update_shader_uniforms(PGRAPHState *pg)
 {
     NV2A_VK_DGROUP_BEGIN("%s", __func__);
@@ -450,12 +1123,17 @@ static void update_shader_uniforms(PGRAPHState *pg)
     ShaderUniformLayout *layouts[] = { &binding->vsh.module_info->uniforms,
                                        &binding->psh.module_info->uniforms };
 
+    /* Constants are copied separately, only where they changed */
+    VshUniformLocs vsh_locs;
+    memcpy(vsh_locs, binding->vsh.uniform_locs, sizeof(vsh_locs));
+    vsh_locs[VshUniform_c] = -1;
+
     VshUniformValues vsh_values;
-    pgraph_glsl_set_vsh_uniform_values(pg, &binding->state.vsh,
-                                  binding->vsh.uniform_locs, &vsh_values);
+    pgraph_glsl_set_vsh_uniform_values(pg, &binding->state.vsh, vsh_locs,
+                                       &vsh_values);
     apply_uniform_updates(&binding->vsh.module_info->uniforms, VshUniformInfo,
-                          binding->vsh.uniform_locs, &vsh_values,
-                          VshUniform__COUNT);
+                          vsh_locs, &vsh_values, VshUniform__COUNT);
+    update_vsh_constants(pg, binding);
 
     PshUniformValues psh_values;
     pgraph_glsl_set_psh_uniform_values(pg, binding->psh.uniform_locs,
@@ -481,18 +1159,18 @@ static void update_shader_uniforms(PGRAPHState *pg)
     for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
         uint64_t hash =
             fast_hash(layouts[i]->allocation, layouts[i]->total_size);
-        r->uniforms_changed |= (hash != r->uniform_buffer_hashes[i]);
+        r->uniforms_changed[i] |= (hash != r->uniform_buffer_hashes[i]);
         r->uniform_buffer_hashes[i] = hash;
     }
 
-    nv2a_profile_inc_counter(r->uniforms_changed ?
+    nv2a_profile_inc_counter(r->uniforms_changed[0] || r->uniforms_changed[1] ?
                                  NV2A_PROF_SHADER_UBO_DIRTY :
                                  NV2A_PROF_SHADER_UBO_NOTDIRTY);
 
     NV2A_VK_DGROUP_END();
 }
 
-void pgraph_vk_bind_shaders(PGRAPHState *pg)
+bool pgraph_vk_bind_shaders(PGRAPHState *pg)
 {
     NV2A_VK_DGROUP_BEGIN("%s", __func__);
 
@@ -500,32 +1178,50 @@ void pgraph_vk_bind_shaders(PGRAPHState *pg)
 
     r->shader_bindings_changed = false;
 
-    if (!r->shader_binding ||
-        pgraph_glsl_check_shader_state_dirty(pg, &r->shader_binding->state)) {
+    if (!r->shader_binding) {
         ShaderState new_state = pgraph_glsl_get_shader_state(pg);
-        if (!r->shader_binding || memcmp(&r->shader_binding->state, &new_state,
-                                         sizeof(ShaderState))) {
-            r->shader_binding = get_shader_binding_for_state(r, &new_state);
-            r->shader_bindings_changed = true;
-        }
+        r->shader_binding = get_shader_binding_for_state(r, &new_state);
+        r->shader_bindings_changed = true;
     } else {
-        nv2a_profile_inc_counter(NV2A_PROF_SHADER_BIND_NOTDIRTY);
+        ShaderState new_state;
+        memcpy(&new_state, &r->shader_binding->state, sizeof(ShaderState));
+        if (pgraph_glsl_update_shader_state(pg, &new_state)) {
+            if (memcmp(&r->shader_binding->state, &new_state,
+                       sizeof(ShaderState))) {
+                r->shader_binding = get_shader_binding_for_state(r, &new_state);
+                r->shader_bindings_changed = true;
+            }
+        } else {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_BIND_NOTDIRTY);
+        }
+    }
+
+    if (!ensure_shader_binding_ready(r, r->shader_binding)) {
+        /* Look the binding up again on the next draw */
+        nv2a_profile_inc_counter(NV2A_PROF_SHADER_NOT_READY);
+        r->shader_binding = NULL;
+        NV2A_VK_DGROUP_END();
+        return false;
     }
 
     update_shader_uniforms(pg);
 
     NV2A_VK_DGROUP_END();
+    return true;
 }
 
 void pgraph_vk_init_shaders(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    pgraph_vk_init_glsl_compiler();
-    create_descriptor_pool(pg);
+    create_descriptor_pools(pg);
     create_descriptor_set_layout(pg);
     create_descriptor_sets(pg);
+    if (r->bindless_textures_enabled) {
+        create_bindless_descriptor_set(pg);
+    }
     shader_cache_init(pg);
+    init_shader_compile_threads(r);
 
     r->use_push_constants_for_uniform_attrs =
         (r->device_props.limits.maxPushConstantsSize >=
@@ -534,9 +1230,16 @@ void pgraph_vk_init_shaders(PGRAPHState *pg)
 
 void pgraph_vk_finalize_shaders(PGRAPHState *pg)
 {
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    finalize_shader_compile_threads(r);
     shader_cache_finalize(pg);
+    destroy_shader_compile_queue(r);
+    if (r->bindless_textures_enabled) {
+        destroy_bindless_descriptor_set(pg);
+    }
     destroy_descriptor_sets(pg);
     destroy_descriptor_set_layout(pg);
-    destroy_descriptor_pool(pg);
+    destroy_descriptor_pools(pg);
     pgraph_vk_finalize_glsl_compiler();
 }
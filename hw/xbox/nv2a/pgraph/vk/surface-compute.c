@@ -18,12 +18,12 @@
  */
 
 #include "hw/xbox/nv2a/pgraph/pgraph.h"
+#include "hw/xbox/nv2a/pgraph/swizzle.h"
 #include "qemu/fast-hash.h"
 #include "qemu/lru.h"
 #include "renderer.h"
 #include <vulkan/vulkan_core.h>
 
-// TODO: Swizzle/Unswizzle
 // TODO: Float depth format (low priority, but would be better for accuracy)
 
 // FIXME: Below pipeline creation assumes identical 3 buffer setup. For
@@ -118,6 +118,136 @@ const char *unpack_z24s8_to_d32_sfloat_s8_uint_glsl =
     "    }\n"
     "}\n";
 
+/*
+ * Unswizzle a texture level, expanding palette indices if PALETTE is set.
+ * Each invocation writes one 32-bit unit of the tightly packed output, which
+ * holds TEXELS_PER_UNIT texels.
+ */
+const char *decode_swizzled_texture_glsl =
+    "layout(push_constant) uniform PushConstants {\n"
+    "    uint width, height, mask_x, mask_y, src_offset, dst_offset;\n"
+    "};\n"
+    "layout(set = 0, binding = 0) buffer TextureIn { uint texture_in[]; };\n"
+    "layout(set = 0, binding = 1) buffer PaletteIn { uint palette_in[]; };\n"
+    "layout(set = 0, binding = 2) buffer TextureOut { uint texture_out[]; };\n"
+    "uint deposit_bits(uint value, uint mask) {\n"
+    "    uint result = 0u;\n"
+    "    for (uint bit = 1u; mask != 0u; bit <<= 1) {\n"
+    "        if ((value & bit) != 0u) {\n"
+    "            result |= mask & (~mask + 1u);\n"
+    "        }\n"
+    "        mask &= mask - 1u;\n"
+    "    }\n"
+    "    return result;\n"
+    "}\n"
+    "uint read_texel(uint idx) {\n"
+    "    uint x = idx % width, y = idx / width;\n"
+    "    uint offset = src_offset + (deposit_bits(x, mask_x) |\n"
+    "                                deposit_bits(y, mask_y)) * BYTES_PER_PIXEL;\n"
+    "    uint value = texture_in[offset / 4];\n"
+    "#if BYTES_PER_PIXEL < 4\n"
+    "    value = (value >> ((offset % 4) * 8)) &\n"
+    "            ((1u << (BYTES_PER_PIXEL * 8)) - 1u);\n"
+    "#endif\n"
+    "#if PALETTE\n"
+    "    value = palette_in[value];\n"
+    "#endif\n"
+    "    return value;\n"
+    "}\n"
+    "void main() {\n"
+    "    uint idx_out = gl_GlobalInvocationID.x;\n"
+    "    uint num_texels = width * height;\n"
+    "    if (idx_out * TEXELS_PER_UNIT >= num_texels) {\n"
+    "        return;\n"
+    "    }\n"
+    "    uint value = 0u;\n"
+    "    for (uint i = 0u; i < TEXELS_PER_UNIT; i++) {\n"
+    "        uint idx = idx_out * TEXELS_PER_UNIT + i;\n"
+    "        if (idx < num_texels) {\n"
+    "            value |= read_texel(idx) << (i * 32u / TEXELS_PER_UNIT);\n"
+    "        }\n"
+    "    }\n"
+    "    texture_out[dst_offset / 4 + idx_out] = value;\n"
+    "}\n";
+
+/*
+ * Swizzle a tightly packed linear surface for download. Each invocation writes
+ * one 32-bit unit of the swizzled output, which holds TEXELS_PER_UNIT texels.
+ */
+const char *encode_swizzled_surface_glsl =
+    "layout(push_constant) uniform PushConstants {\n"
+    "    uint width, height, mask_x, mask_y;\n"
+    "};\n"
+    "layout(set = 0, binding = 0) buffer SurfaceIn { uint surface_in[]; };\n"
+    "layout(set = 0, binding = 2) buffer SurfaceOut { uint surface_out[]; };\n"
+    "uint extract_bits(uint value, uint mask) {\n"
+    "    uint result = 0u;\n"
+    "    for (uint bit = 1u; mask != 0u; bit <<= 1) {\n"
+    "        if ((value & mask & (~mask + 1u)) != 0u) {\n"
+    "            result |= bit;\n"
+    "        }\n"
+    "        mask &= mask - 1u;\n"
+    "    }\n"
+    "    return result;\n"
+    "}\n"
+    "uint read_texel(uint idx) {\n"
+    "    uint x = extract_bits(idx, mask_x), y = extract_bits(idx, mask_y);\n"
+    "    uint offset = (y * width + x) * BYTES_PER_PIXEL;\n"
+    "    uint value = surface_in[offset / 4];\n"
+    "#if BYTES_PER_PIXEL < 4\n"
+    "    value = (value >> ((offset % 4) * 8)) &\n"
+    "            ((1u << (BYTES_PER_PIXEL * 8)) - 1u);\n"
+    "#endif\n"
+    "    return value;\n"
+    "}\n"
+    "void main() {\n"
+    "    uint idx_out = gl_GlobalInvocationID.x;\n"
+    "    uint num_texels = width * height;\n"
+    "    if (idx_out * TEXELS_PER_UNIT >= num_texels) {\n"
+    "        return;\n"
+    "    }\n"
+    "    uint value = 0u;\n"
+    "    for (uint i = 0u; i < TEXELS_PER_UNIT; i++) {\n"
+    "        uint idx = idx_out * TEXELS_PER_UNIT + i;\n"
+    "        if (idx < num_texels) {\n"
+    "            value |= read_texel(idx) << (i * 32u / TEXELS_PER_UNIT);\n"
+    "        }\n"
+    "    }\n"
+    "    surface_out[idx_out] = value;\n"
+    "}\n";
+
+static gchar *get_surface_swizzle_glsl(int bytes_per_pixel, int workgroup_size)
+{
+    gchar *glsl = g_strdup_printf(
+        "#version 450\n"
+        "layout(local_size_x = %d, local_size_y = 1, local_size_z = 1) in;\n"
+        "#define BYTES_PER_PIXEL %du\n"
+        "#define TEXELS_PER_UNIT %du\n"
+        "%s", workgroup_size, bytes_per_pixel, 4 / bytes_per_pixel,
+        encode_swizzled_surface_glsl);
+    assert(glsl);
+
+    return glsl;
+}
+
+static gchar *get_texture_decode_glsl(int bytes_per_pixel, bool palette,
+                                      int workgroup_size)
+{
+    int output_bytes_per_pixel = palette ? 4 : bytes_per_pixel;
+
+    gchar *glsl = g_strdup_printf(
+        "#version 450\n"
+        "layout(local_size_x = %d, local_size_y = 1, local_size_z = 1) in;\n"
+        "#define BYTES_PER_PIXEL %du\n"
+        "#define TEXELS_PER_UNIT %du\n"
+        "#define PALETTE %d\n"
+        "%s", workgroup_size, bytes_per_pixel, 4 / output_bytes_per_pixel,
+        palette, decode_swizzled_texture_glsl);
+    assert(glsl);
+
+    return glsl;
+}
+
 static gchar *get_compute_shader_glsl(VkFormat host_fmt, bool pack,
                                       int workgroup_size)
 {
@@ -246,7 +376,7 @@ static void create_compute_pipeline_layout(PGRAPHState *pg)
 
     VkPushConstantRange push_constant_range = {
         .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
-        .size = 2 * sizeof(uint32_t),
+        .size = 6 * sizeof(uint32_t),
     };
     VkPipelineLayoutCreateInfo pipeline_layout_info = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
@@ -321,8 +451,10 @@ static void update_descriptor_sets(PGRAPHState *pg,
 
 bool pgraph_vk_compute_needs_finish(PGRAPHVkState *r)
 {
-    bool need_descriptor_write_reset = (r->compute.descriptor_set_index >=
-                                        ARRAY_SIZE(r->compute.descriptor_sets));
+    // A swizzled depth-stencil download needs two sets: pack, then swizzle
+    bool need_descriptor_write_reset =
+        (r->compute.descriptor_set_index + 2 >
+         ARRAY_SIZE(r->compute.descriptor_sets));
 
     return need_descriptor_write_reset;
 }
@@ -384,11 +516,13 @@ void pgraph_vk_pack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
     PGRAPHVkState *r = pg->vk_renderer_state;
 
     unsigned int input_width = surface->width, input_height = surface->height;
-    pgraph_apply_scaling_factor(pg, &input_width, &input_height);
+    pgraph_vk_apply_surface_scale_factor(surface, &input_width,
+                                         &input_height);
 
     unsigned int output_width = surface->width, output_height = surface->height;
     if (!downscale) {
-        pgraph_apply_scaling_factor(pg, &output_width, &output_height);
+        pgraph_vk_apply_surface_scale_factor(surface, &output_width,
+                                             &output_height);
     }
 
     size_t depth_bytes_per_pixel = 4;
@@ -436,6 +570,7 @@ void pgraph_vk_pack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
     // FIXME: Smarter workgroup scaling
 
     pgraph_vk_begin_debug_marker(r, cmd, RGBA_PINK, __func__);
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_COMPUTE);
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
     vkCmdBindDescriptorSets(
         cmd, VK_PIPELINE_BIND_POINT_COMPUTE, r->compute.pipeline_layout, 0, 1,
@@ -451,6 +586,7 @@ void pgraph_vk_pack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
     // FIXME: Check max group count
 
     vkCmdDispatch(cmd, group_count, 1, 1);
+    pgraph_vk_end_gpu_timer(r, cmd);
     pgraph_vk_end_debug_marker(r, cmd);
 }
 
@@ -463,7 +599,8 @@ void pgraph_vk_unpack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
     unsigned int input_width = surface->width, input_height = surface->height;
 
     unsigned int output_width = surface->width, output_height = surface->height;
-    pgraph_apply_scaling_factor(pg, &output_width, &output_height);
+    pgraph_vk_apply_surface_scale_factor(surface, &output_width,
+                                         &output_height);
 
     size_t depth_bytes_per_pixel = 4;
     size_t depth_size = output_width * output_height * depth_bytes_per_pixel;
@@ -509,6 +646,7 @@ void pgraph_vk_unpack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
     // FIXME: Smarter workgroup scaling
 
     pgraph_vk_begin_debug_marker(r, cmd, RGBA_PINK, __func__);
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_COMPUTE);
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
     vkCmdBindDescriptorSets(
         cmd, VK_PIPELINE_BIND_POINT_COMPUTE, r->compute.pipeline_layout, 0, 1,
@@ -522,6 +660,149 @@ void pgraph_vk_unpack_depth_stencil(PGRAPHState *pg, SurfaceBinding *surface,
                        VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants),
                        push_constants);
     vkCmdDispatch(cmd, group_count, 1, 1);
+    pgraph_vk_end_gpu_timer(r, cmd);
+    pgraph_vk_end_debug_marker(r, cmd);
+}
+
+//
+// Unswizzle texture levels from buffers[0] into buffers[2], expanding palette
+// indices with the palette in buffers[1].
+//
+void pgraph_vk_decode_texture(PGRAPHState *pg, VkCommandBuffer cmd,
+                              int bytes_per_pixel, bool palette,
+                              VkDescriptorBufferInfo buffers[3],
+                              const TextureDecodeRegion *regions,
+                              int num_regions)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    update_descriptor_sets(pg, buffers, 3);
+
+    ComputePipelineKey key;
+    memset(&key, 0, sizeof(key));
+    key.host_fmt = VK_FORMAT_UNDEFINED;
+    key.workgroup_size =
+        MIN(256, r->device_props.limits.maxComputeWorkGroupSize[0]);
+    key.texture_bytes_per_pixel = bytes_per_pixel;
+    key.texture_palette = palette;
+
+    LruNode *node = lru_lookup(&r->compute.pipeline_cache,
+                               fast_hash((void *)&key, sizeof(key)), &key);
+    ComputePipeline *pipeline = container_of(node, ComputePipeline, node);
+
+    int output_bytes_per_pixel = palette ? 4 : bytes_per_pixel;
+    int texels_per_unit = 4 / output_bytes_per_pixel;
+
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_PINK, __func__);
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_COMPUTE);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
+    vkCmdBindDescriptorSets(
+        cmd, VK_PIPELINE_BIND_POINT_COMPUTE, r->compute.pipeline_layout, 0, 1,
+        &r->compute.descriptor_sets[r->compute.descriptor_set_index - 1], 0,
+        NULL);
+
+    for (int i = 0; i < num_regions; i++) {
+        const TextureDecodeRegion *region = &regions[i];
+
+        uint32_t mask_x, mask_y, mask_z;
+        generate_swizzle_masks(region->width, region->height, 1, &mask_x,
+                               &mask_y, &mask_z);
+
+        // Output units are 32-bit, so the destination must be aligned too
+        assert(region->dst_offset % 4 == 0);
+        assert(bytes_per_pixel < 4 || region->src_offset % 4 == 0);
+
+        uint32_t push_constants[6] = {
+            region->width, region->height,    mask_x,
+            mask_y,        region->src_offset, region->dst_offset,
+        };
+        vkCmdPushConstants(cmd, r->compute.pipeline_layout,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof(push_constants), push_constants);
+
+        size_t output_size_in_units = DIV_ROUND_UP(
+            region->width * region->height, texels_per_unit);
+        size_t group_count = DIV_ROUND_UP(output_size_in_units,
+                                          pipeline->key.workgroup_size);
+        assert(r->device_props.limits.maxComputeWorkGroupCount[0] >=
+               group_count);
+
+        vkCmdDispatch(cmd, group_count, 1, 1);
+    }
+
+    pgraph_vk_end_gpu_timer(r, cmd);
+    pgraph_vk_end_debug_marker(r, cmd);
+}
+
+//
+// Swizzle a tightly packed linear surface from src into dst, in the layout
+// guest memory expects.
+//
+void pgraph_vk_swizzle_surface(PGRAPHState *pg, VkCommandBuffer cmd,
+                               int bytes_per_pixel, unsigned int width,
+                               unsigned int height, VkBuffer src, VkBuffer dst)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    assert(bytes_per_pixel == 1 || bytes_per_pixel == 2 ||
+           bytes_per_pixel == 4);
+
+    size_t size = ROUND_UP(width * height * bytes_per_pixel, 4);
+
+    // Binding 1 is unused, but the layout expects three buffers
+    VkDescriptorBufferInfo buffers[] = {
+        {
+            .buffer = src,
+            .offset = 0,
+            .range = size,
+        },
+        {
+            .buffer = src,
+            .offset = 0,
+            .range = size,
+        },
+        {
+            .buffer = dst,
+            .offset = 0,
+            .range = size,
+        },
+    };
+    update_descriptor_sets(pg, buffers, ARRAY_SIZE(buffers));
+
+    ComputePipelineKey key;
+    memset(&key, 0, sizeof(key));
+    key.host_fmt = VK_FORMAT_UNDEFINED;
+    key.workgroup_size =
+        MIN(256, r->device_props.limits.maxComputeWorkGroupSize[0]);
+    key.surface_bytes_per_pixel = bytes_per_pixel;
+
+    LruNode *node = lru_lookup(&r->compute.pipeline_cache,
+                               fast_hash((void *)&key, sizeof(key)), &key);
+    ComputePipeline *pipeline = container_of(node, ComputePipeline, node);
+
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, 1, &mask_x, &mask_y, &mask_z);
+
+    size_t output_size_in_units =
+        DIV_ROUND_UP(width * height, 4 / bytes_per_pixel);
+    size_t group_count =
+        DIV_ROUND_UP(output_size_in_units, pipeline->key.workgroup_size);
+    assert(r->device_props.limits.maxComputeWorkGroupCount[0] >= group_count);
+
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_PINK, __func__);
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_COMPUTE);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->pipeline);
+    vkCmdBindDescriptorSets(
+        cmd, VK_PIPELINE_BIND_POINT_COMPUTE, r->compute.pipeline_layout, 0, 1,
+        &r->compute.descriptor_sets[r->compute.descriptor_set_index - 1], 0,
+        NULL);
+
+    uint32_t push_constants[4] = { width, height, mask_x, mask_y };
+    vkCmdPushConstants(cmd, r->compute.pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants),
+                       push_constants);
+    vkCmdDispatch(cmd, group_count, 1, 1);
+    pgraph_vk_end_gpu_timer(r, cmd);
     pgraph_vk_end_debug_marker(r, cmd);
 }
 
@@ -538,8 +819,18 @@ static void pipeline_cache_entry_init(Lru *lru, LruNode *node,
                 "Warning: Needed compute shader with workgroup size = 1\n");
     }
 
-    gchar *glsl = get_compute_shader_glsl(
-        snode->key.host_fmt, snode->key.pack, snode->key.workgroup_size);
+    gchar *glsl;
+    if (snode->key.surface_bytes_per_pixel) {
+        glsl = get_surface_swizzle_glsl(snode->key.surface_bytes_per_pixel,
+                                        snode->key.workgroup_size);
+    } else if (snode->key.texture_bytes_per_pixel) {
+        glsl = get_texture_decode_glsl(snode->key.texture_bytes_per_pixel,
+                                       snode->key.texture_palette,
+                                       snode->key.workgroup_size);
+    } else {
+        glsl = get_compute_shader_glsl(snode->key.host_fmt, snode->key.pack,
+                                       snode->key.workgroup_size);
+    }
     assert(glsl);
     snode->pipeline = create_compute_pipeline(r, glsl);
     g_free(glsl);
@@ -26,11 +26,14 @@
 #include "hw/xbox/nv2a/nv2a_int.h"
 #include "hw/xbox/nv2a/pgraph/swizzle.h"
 #include "qemu/compiler.h"
+#include "qemu/fast-hash.h"
 #include "ui/xemu-settings.h"
 #include "renderer.h"
 
 const int num_invalid_surfaces_to_keep = 10;  // FIXME: Make automatic
+const int max_invalid_surfaces_per_shape = 2;
 const int max_surface_frame_time_delta = 5;
+const int min_cpu_read_frames_for_early_download = 3;
 
 void pgraph_vk_set_surface_scale_factor(NV2AState *d, unsigned int scale)
 {
@@ -67,39 +70,61 @@ void pgraph_vk_set_surface_scale_factor(NV2AState *d, unsigned int scale)
 
 unsigned int pgraph_vk_get_surface_scale_factor(NV2AState *d)
 {
-    return d->pgraph.surface_scale_factor; // FIXME: Move internal to renderer
+    return d->pgraph.vk_renderer_state->surface_scale_factor;
 }
 
 void pgraph_vk_reload_surface_scale_factor(PGRAPHState *pg)
 {
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
     int factor = g_config.display.quality.surface_scale;
-    pg->surface_scale_factor = MAX(factor, 1);
+    r->surface_scale_factor = MAX(factor, 1);
+
+    // Updated to the scale of the bound surfaces as they are bound
+    pg->surface_scale_factor = r->surface_scale_factor;
 }
 
-// FIXME: Move to common
-static void get_surface_dimensions(PGRAPHState const *pg, unsigned int *width,
-                                   unsigned int *height)
+void pgraph_vk_apply_surface_scale_factor(SurfaceBinding const *surface,
+                                          unsigned int *width,
+                                          unsigned int *height)
 {
-    bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
-    if (swizzle) {
-        *width = 1 << pg->surface_shape.log_width;
-        *height = 1 << pg->surface_shape.log_height;
-    } else {
-        *width = pg->surface_shape.clip_width;
-        *height = pg->surface_shape.clip_height;
+    *width *= surface->scale;
+    *height *= surface->scale;
+}
+
+/*
+ * Only surfaces whose resolution can be seen benefit from being scaled. Those
+ * the CPU keeps reading back are rendered at 1x, which saves downscaling them
+ * on every download, and optionally so is every surface which has not been
+ * scanned out. A zeta surface always matches the color surface it is bound
+ * with.
+ */
+static unsigned int get_surface_target_scale(PGRAPHVkState *r, bool color,
+                                             hwaddr vram_addr)
+{
+    if (!color && r->color_binding) {
+        return r->color_binding->scale;
+    }
+
+    gpointer key = GUINT_TO_POINTER(vram_addr);
+    if (g_hash_table_contains(r->unscaled_surface_addrs, key)) {
+        return 1;
     }
+    if (g_config.display.quality.surface_scale_display_only &&
+        !(color && g_hash_table_contains(r->display_surface_addrs, key))) {
+        return 1;
+    }
+
+    return r->surface_scale_factor;
 }
 
-// FIXME: Move to common
-static bool framebuffer_dirty(PGRAPHState const *pg)
+void pgraph_vk_record_display_surface(PGRAPHVkState *r,
+                                      SurfaceBinding const *surface)
 {
-    bool shape_changed = memcmp(&pg->surface_shape, &pg->last_surface_shape,
-                                sizeof(SurfaceShape)) != 0;
-    if (!shape_changed || (!pg->surface_shape.color_format
-            && !pg->surface_shape.zeta_format)) {
-        return false;
+    if (g_config.display.quality.surface_scale_display_only) {
+        g_hash_table_add(r->display_surface_addrs,
+                         GUINT_TO_POINTER(surface->vram_addr));
     }
-    return true;
 }
 
 static void memcpy_image(void *dst, void const *src, int dst_stride,
@@ -122,24 +147,67 @@ static void memcpy_image(void *dst, void const *src, int dst_stride,
     }
 }
 
-static bool check_surface_overlaps_range(const SurfaceBinding *surface,
-                                         hwaddr range_start, hwaddr range_len)
+/*
+ * Find the first surface overlapping a range, or the next one after node if
+ * it is not NULL. Surfaces of size 0 overlap nothing and are not indexed.
+ */
+static SurfaceBinding *find_surface_in_range(PGRAPHVkState *r,
+                                             IntervalTreeNode *node,
+                                             hwaddr range_start,
+                                             hwaddr range_len)
 {
-    hwaddr surface_end = surface->vram_addr + surface->size;
-    hwaddr range_end = range_start + range_len;
-    return !(surface->vram_addr >= range_end || range_start >= surface_end);
+    if (!range_len) {
+        return NULL;
+    }
+
+    hwaddr range_last = range_start + range_len - 1;
+    node = node ? interval_tree_iter_next(node, range_start, range_last) :
+                  interval_tree_iter_first(&r->surface_ranges, range_start,
+                                           range_last);
+    return node ? container_of(node, SurfaceBinding, vram_range) : NULL;
 }
 
+#define FOR_EACH_SURFACE_IN_RANGE(r, surface, range_start, range_len)     \
+    for (surface = find_surface_in_range(r, NULL, range_start, range_len); \
+         surface; surface = find_surface_in_range(r, &surface->vram_range, \
+                                                  range_start, range_len))
+
 void pgraph_vk_download_surfaces_in_range_if_dirty(PGRAPHState *pg,
                                                    hwaddr start, hwaddr size)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
     SurfaceBinding *surface;
 
-    QTAILQ_FOREACH(surface, &r->surfaces, entry) {
-        if (check_surface_overlaps_range(surface, start, size)) {
-            pgraph_vk_surface_download_if_dirty(
-                container_of(pg, NV2AState, pgraph), surface);
+    FOR_EACH_SURFACE_IN_RANGE(r, surface, start, size) {
+        pgraph_vk_surface_download_if_dirty(
+            container_of(pg, NV2AState, pgraph), surface);
+    }
+}
+
+/*
+ * Pack the separately copied depth and stencil aspects of a depth-stencil
+ * image into the guest Z24S8 layout, like pack_depth_stencil on the GPU does.
+ */
+static void pack_depth_stencil_to_z24s8(SurfaceBinding const *surface,
+                                        uint8_t *pixels, uint8_t const *depth,
+                                        uint8_t const *stencil)
+{
+    bool float_depth =
+        surface->host_fmt.vk_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+
+    for (unsigned int y = 0; y < surface->height; y++) {
+        uint32_t *row = (uint32_t *)(pixels + y * surface->pitch);
+        for (unsigned int x = 0; x < surface->width; x++) {
+            size_t idx = y * surface->width + x;
+            uint32_t depth_value;
+            if (float_depth) {
+                float f;
+                memcpy(&f, depth + idx * 4, sizeof(f));
+                depth_value = (uint32_t)(f * (float)0xffffff);
+            } else {
+                memcpy(&depth_value, depth + idx * 4, sizeof(depth_value));
+            }
+            row[x] = depth_value << 8 | stencil[idx];
         }
     }
 }
@@ -166,17 +234,26 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
 
     assert(no_conversion_necessary);
 
-    bool compute_needs_finish = (use_compute_to_convert_depth_stencil_format &&
-                                 pgraph_vk_compute_needs_finish(r));
-
-    if (r->in_command_buffer &&
-        surface->draw_time >= r->command_buffer_start_time) {
-        pgraph_vk_finish(pg, VK_FINISH_REASON_SURFACE_DOWN);
-    } else if (compute_needs_finish) {
+    // With nothing to downscale or swizzle, the aspects can be packed by the
+    // host as they are read back, leaving compute descriptors alone
+    bool downscale = (surface->scale != 1);
+    bool pack_depth_stencil_on_host =
+        use_compute_to_convert_depth_stencil_format && !downscale &&
+        !surface->swizzle;
+    bool pack_depth_stencil_on_gpu =
+        use_compute_to_convert_depth_stencil_format &&
+        !pack_depth_stencil_on_host;
+
+    bool compute_needs_finish =
+        ((pack_depth_stencil_on_gpu || surface->swizzle) &&
+         pgraph_vk_compute_needs_finish(r));
+
+    if (compute_needs_finish) {
         pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
     }
 
-    bool downscale = (pg->surface_scale_factor != 1);
+    // No need for the GPU to go idle, only for rendering to the surface
+    pgraph_vk_wait_for_surface_writes(d, surface);
 
     trace_nv2a_pgraph_surface_download(
         surface->color ? "COLOR" : "ZETA",
@@ -184,20 +261,10 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
         surface->width, surface->height, surface->pitch,
         surface->fmt.bytes_per_pixel);
 
-    // Read surface into memory
-    uint8_t *gl_read_buf = pixels;
-
-    uint8_t *swizzle_buf = pixels;
-    if (surface->swizzle) {
-        // FIXME: Swizzle in shader
-        assert(pg->surface_scale_factor == 1 || downscale);
-        swizzle_buf = (uint8_t *)g_malloc(surface->size);
-        gl_read_buf = swizzle_buf;
-    }
-
     unsigned int scaled_width = surface->width,
                  scaled_height = surface->height;
-    pgraph_apply_scaling_factor(pg, &scaled_width, &scaled_height);
+    pgraph_vk_apply_surface_scale_factor(surface, &scaled_width,
+                                         &scaled_height);
 
     VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg);
     pgraph_vk_begin_debug_marker(r, cmd, RGBA_RED, __func__);
@@ -248,11 +315,13 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
             .dstOffsets[1] = (VkOffset3D){surface->width, surface->height, 1},
         };
 
+        pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_BLIT);
         vkCmdBlitImage(cmd, surface->image,
                        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
                        surface->image_scratch,
                        surface->image_scratch_current_layout, 1, &blit_region,
                        surface->color ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+        pgraph_vk_end_gpu_timer(r, cmd);
 
         pgraph_vk_transition_image_layout(pg, cmd, surface->image_scratch,
                                           surface->host_fmt.vk_format,
@@ -267,12 +336,13 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
         surface_image_loc = surface->image;
     }
 
+    size_t stencil_offset = 0;
     if (surface->host_fmt.aspect & VK_IMAGE_ASPECT_STENCIL_BIT) {
         size_t depth_size = scaled_width * scaled_height * 4;
+        stencil_offset = ROUND_UP(
+            depth_size, r->device_props.limits.minStorageBufferOffsetAlignment);
         copy_regions[num_copy_regions++] = (VkBufferImageCopy){
-            .bufferOffset = ROUND_UP(
-                depth_size,
-                r->device_props.limits.minStorageBufferOffsetAlignment),
+            .bufferOffset = stencil_offset,
             .imageSubresource.aspectMask = VK_IMAGE_ASPECT_STENCIL_BIT,
             .imageSubresource.layerCount = 1,
             .imageExtent = (VkExtent3D){ scaled_width, scaled_height, 1 },
@@ -287,10 +357,15 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
                                    surface->width * surface->height;
     assert((downloaded_image_size) <=
            r->storage_buffers[BUFFER_STAGING_DST].buffer_size);
-
-    int copy_buffer_idx = use_compute_to_convert_depth_stencil_format ?
-                             BUFFER_COMPUTE_DST :
-                             BUFFER_STAGING_DST;
+    assert(!pack_depth_stencil_on_host ||
+           stencil_offset + surface->width * surface->height <=
+               r->storage_buffers[BUFFER_STAGING_DST].buffer_size);
+
+    // Swizzled surfaces are reordered by a compute pass into the staging
+    // buffer, so the host receives them in guest layout
+    int copy_buffer_idx = (pack_depth_stencil_on_gpu || surface->swizzle) ?
+                              BUFFER_COMPUTE_DST :
+                              BUFFER_STAGING_DST;
     VkBuffer copy_buffer = r->storage_buffers[copy_buffer_idx].buffer;
 
     {
@@ -320,9 +395,13 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
     // FIXME: Verify output of depth stencil conversion
     // FIXME: Track current layout and only transition when required
 
-    if (use_compute_to_convert_depth_stencil_format) {
+    VkAccessFlags copy_buffer_access = VK_ACCESS_TRANSFER_WRITE_BIT;
+    VkPipelineStageFlags copy_buffer_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    size_t packed_size = 0;
+
+    if (pack_depth_stencil_on_gpu) {
         size_t bytes_per_pixel = 4;
-        size_t packed_size =
+        packed_size =
             downscale ? (surface->width * surface->height * bytes_per_pixel) :
                         (scaled_width * scaled_height * bytes_per_pixel);
 
@@ -374,6 +453,56 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
                              VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
                              &post_compute_src_barrier, 0, NULL);
 
+        copy_buffer = pack_buffer;
+        copy_buffer_access = VK_ACCESS_SHADER_WRITE_BIT;
+        copy_buffer_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    }
+
+    if (surface->swizzle) {
+        //
+        // Swizzle into staging buffer for host download
+        //
+
+        VkBufferMemoryBarrier pre_swizzle_src_barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = copy_buffer_access,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = copy_buffer,
+            .size = VK_WHOLE_SIZE
+        };
+        vkCmdPipelineBarrier(cmd, copy_buffer_stage,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL,
+                             1, &pre_swizzle_src_barrier, 0, NULL);
+
+        VkBuffer staging_buffer =
+            r->storage_buffers[BUFFER_STAGING_DST].buffer;
+
+        VkBufferMemoryBarrier pre_swizzle_dst_barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_HOST_READ_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = staging_buffer,
+            .size = VK_WHOLE_SIZE
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_HOST_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL,
+                             1, &pre_swizzle_dst_barrier, 0, NULL);
+
+        pgraph_vk_swizzle_surface(pg, cmd, surface->fmt.bytes_per_pixel,
+                                  surface->width, surface->height,
+                                  copy_buffer, staging_buffer);
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_SWIZZLE);
+
+        copy_buffer = staging_buffer;
+        copy_buffer_access = VK_ACCESS_SHADER_WRITE_BIT;
+        copy_buffer_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    } else if (pack_depth_stencil_on_gpu) {
+        VkBuffer pack_buffer = copy_buffer;
+
         VkBufferMemoryBarrier post_compute_dst_barrier = {
             .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
             .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
@@ -423,6 +552,9 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
         vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
                              VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
                              &post_copy_src_barrier, 0, NULL);
+
+        copy_buffer_access = VK_ACCESS_TRANSFER_WRITE_BIT;
+        copy_buffer_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
     }
 
     //
@@ -431,16 +563,15 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
 
     VkBufferMemoryBarrier post_copy_dst_barrier = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .srcAccessMask = copy_buffer_access,
         .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .buffer = copy_buffer,
         .size = VK_WHOLE_SIZE
     };
-    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1,
-                         &post_copy_dst_barrier, 0, NULL);
+    vkCmdPipelineBarrier(cmd, copy_buffer_stage, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         0, NULL, 1, &post_copy_dst_barrier, 0, NULL);
 
     nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_1);
     pgraph_vk_end_debug_marker(r, cmd);
@@ -455,20 +586,38 @@ static void download_surface_to_buffer(NV2AState *d, SurfaceBinding *surface,
                             r->storage_buffers[BUFFER_STAGING_DST].allocation,
                             0, VK_WHOLE_SIZE);
 
-    memcpy_image(gl_read_buf, mapped_memory_ptr, surface->pitch,
-                 surface->width * surface->fmt.bytes_per_pixel,
-                 surface->height);
+    if (surface->swizzle) {
+        memcpy(pixels, mapped_memory_ptr,
+               surface->width * surface->height * surface->fmt.bytes_per_pixel);
+    } else if (pack_depth_stencil_on_host) {
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_HOST_PACK);
+        pack_depth_stencil_to_z24s8(surface, pixels, mapped_memory_ptr,
+                                    (uint8_t *)mapped_memory_ptr +
+                                        stencil_offset);
+    } else {
+        memcpy_image(pixels, mapped_memory_ptr, surface->pitch,
+                     surface->width * surface->fmt.bytes_per_pixel,
+                     surface->height);
+    }
 
     vmaUnmapMemory(r->allocator,
                    r->storage_buffers[BUFFER_STAGING_DST].allocation);
+}
 
-    if (surface->swizzle) {
-        // FIXME: Swizzle in shader
-        swizzle_rect(swizzle_buf, surface->width, surface->height, pixels,
-                     surface->pitch, surface->fmt.bytes_per_pixel);
-        nv2a_profile_inc_counter(NV2A_PROF_SURF_SWIZZLE);
-        g_free(swizzle_buf);
-    }
+static uint64_t hash_surface_vram(NV2AState *d, SurfaceBinding *surface)
+{
+    return fast_hash(d->vram_ptr + surface->vram_addr, surface->size);
+}
+
+/*
+ * Remember the VRAM contents the image was last synchronized with, so an
+ * upload of the same bytes can be skipped.
+ */
+static void record_surface_vram_hash(NV2AState *d, SurfaceBinding *surface)
+{
+    surface->vram_hash = hash_surface_vram(d, surface);
+    surface->vram_hash_draw_time = surface->draw_time;
+    surface->vram_hash_valid = true;
 }
 
 static void download_surface(NV2AState *d, SurfaceBinding *surface, bool force)
@@ -480,7 +629,11 @@ static void download_surface(NV2AState *d, SurfaceBinding *surface, bool force)
 
     // FIXME: Respect write enable at last TOU?
 
+    int64_t start = nv2a_profile_cpu_time_begin();
     download_surface_to_buffer(d, surface, d->vram_ptr + surface->vram_addr);
+    nv2a_profile_cpu_time_end(NV2A_PROF_CPU_SURF_DOWNLOAD,
+                              surface->color ? "color" : "zeta", start);
+    record_surface_vram_hash(d, surface);
 
     memory_region_set_client_dirty(d->vram, surface->vram_addr,
                                    surface->pitch * surface->height,
@@ -488,6 +641,9 @@ static void download_surface(NV2AState *d, SurfaceBinding *surface, bool force)
     memory_region_set_client_dirty(d->vram, surface->vram_addr,
                                    surface->pitch * surface->height,
                                    DIRTY_MEMORY_NV2A_TEX);
+    memory_region_set_client_dirty(d->vram, surface->vram_addr,
+                                   surface->pitch * surface->height,
+                                   DIRTY_MEMORY_SNAPSHOT);
 
     surface->download_pending = false;
     surface->draw_dirty = false;
@@ -534,6 +690,71 @@ void pgraph_vk_download_dirty_surfaces(NV2AState *d)
     qemu_event_set(&r->dirty_surfaces_download_complete);
 }
 
+static void record_surface_cpu_read(PGRAPHState *pg, SurfaceBinding *surface)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (surface->cpu_read_frame_time == pg->frame_time &&
+        surface->cpu_read_frames > 0) {
+        return;
+    }
+
+    if (surface->cpu_read_frames > 0 &&
+        surface->cpu_read_frame_time == pg->frame_time - 1) {
+        surface->cpu_read_frames += 1;
+    } else {
+        surface->cpu_read_frames = 1;
+    }
+    surface->cpu_read_frame_time = pg->frame_time;
+
+    if (surface->scale > 1 &&
+        surface->cpu_read_frames >= min_cpu_read_frames_for_early_download) {
+        // Recreated at 1x the next time it is bound
+        g_hash_table_add(r->unscaled_surface_addrs,
+                         GUINT_TO_POINTER(surface->vram_addr));
+    }
+}
+
+/*
+ * Surfaces the CPU has waited on in each of the last few frames are likely to
+ * be read back again, so download them as soon as rendering to them ends
+ * rather than stalling the CPU in the access callback.
+ */
+static bool check_surface_download_predicted(PGRAPHState *pg,
+                                             SurfaceBinding *surface)
+{
+    return surface->cpu_read_frames >=
+               min_cpu_read_frames_for_early_download &&
+           pg->frame_time - surface->cpu_read_frame_time <= 1;
+}
+
+/*
+ * Record that the CPU wrote len bytes at offset into the surface, so that only
+ * the rows covering them need to be uploaded. A len of 0 marks the whole
+ * surface.
+ */
+void pgraph_vk_mark_surface_upload_pending(SurfaceBinding *surface,
+                                           hwaddr offset, hwaddr len)
+{
+    bool whole_surface_pending =
+        surface->upload_pending &&
+        surface->upload_dirty_end <= surface->upload_dirty_start;
+
+    if (len == 0 || whole_surface_pending) {
+        surface->upload_dirty_start = 0;
+        surface->upload_dirty_end = 0;
+    } else if (!surface->upload_pending) {
+        surface->upload_dirty_start = offset;
+        surface->upload_dirty_end = offset + len;
+    } else {
+        surface->upload_dirty_start =
+            MIN(surface->upload_dirty_start, offset);
+        surface->upload_dirty_end = MAX(surface->upload_dirty_end, offset + len);
+    }
+
+    surface->upload_pending = true;
+}
+
 static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
                                     hwaddr len, bool write)
 {
@@ -544,11 +765,7 @@ static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
     bool wait_for_downloads = false;
 
     SurfaceBinding *surface;
-    QTAILQ_FOREACH(surface, &r->surfaces, entry) {
-        if (!check_surface_overlaps_range(surface, addr, len)) {
-            continue;
-        }
-
+    FOR_EACH_SURFACE_IN_RANGE(r, surface, addr, len) {
         hwaddr offset = addr - surface->vram_addr;
 
         if (write) {
@@ -560,10 +777,14 @@ static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
         if (surface->draw_dirty) {
             surface->download_pending = true;
             wait_for_downloads = true;
+            record_surface_cpu_read(&d->pgraph, surface);
         }
 
         if (write) {
-            surface->upload_pending = true;
+            hwaddr start = MAX(addr, surface->vram_addr);
+            hwaddr end = MIN(addr + len, surface->vram_addr + surface->size);
+            pgraph_vk_mark_surface_upload_pending(
+                surface, start - surface->vram_addr, end - start);
         }
     }
 
@@ -581,23 +802,19 @@ static void surface_access_callback(void *opaque, MemoryRegion *mr, hwaddr addr,
 
 static void register_cpu_access_callback(NV2AState *d, SurfaceBinding *surface)
 {
-    if (tcg_enabled()) {
-        if (surface->width && surface->height) {
-            surface->access_cb = mem_access_callback_insert(
-                qemu_get_cpu(0), d->vram, surface->vram_addr, surface->size,
-                &surface_access_callback, d);
-        } else {
-            surface->access_cb = NULL;
-        }
+    if (surface->width && surface->height) {
+        surface->access_cb = mem_access_callback_insert(
+            qemu_get_cpu(0), d->vram, surface->vram_addr, surface->size,
+            &surface_access_callback, d);
+    } else {
+        surface->access_cb = NULL;
     }
 }
 
 static void unregister_cpu_access_callback(NV2AState *d,
                                            SurfaceBinding const *surface)
 {
-    if (tcg_enabled()) {
-        mem_access_callback_remove_by_ref(qemu_get_cpu(0), surface->access_cb);
-    }
+    mem_access_callback_remove_by_ref(qemu_get_cpu(0), surface->access_cb);
 }
 
 static void bind_surface(PGRAPHVkState *r, SurfaceBinding *surface)
@@ -616,16 +833,19 @@ static void unbind_surface(NV2AState *d, bool color)
     PGRAPHState *pg = &d->pgraph;
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    if (color) {
-        if (r->color_binding) {
-            r->color_binding = NULL;
-            r->framebuffer_dirty = true;
-        }
-    } else {
-        if (r->zeta_binding) {
-            r->zeta_binding = NULL;
-            r->framebuffer_dirty = true;
-        }
+    SurfaceBinding **binding = color ? &r->color_binding : &r->zeta_binding;
+    SurfaceBinding *surface = *binding;
+
+    if (!surface) {
+        return;
+    }
+
+    *binding = NULL;
+    r->framebuffer_dirty = true;
+
+    if (surface->draw_dirty && check_surface_download_predicted(pg, surface)) {
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_EARLY);
+        pgraph_vk_surface_download_if_dirty(d, surface);
     }
 }
 
@@ -655,30 +875,26 @@ static void invalidate_surface(NV2AState *d, SurfaceBinding *surface)
     unregister_cpu_access_callback(d, surface);
 
     QTAILQ_REMOVE(&r->surfaces, surface, entry);
+    if (surface->size) {
+        interval_tree_remove(&surface->vram_range, &r->surface_ranges);
+    }
     QTAILQ_INSERT_HEAD(&r->invalid_surfaces, surface, entry);
 }
 
-static bool check_surfaces_overlap(const SurfaceBinding *surface,
-                                   const SurfaceBinding *other_surface)
-{
-    return check_surface_overlaps_range(surface, other_surface->vram_addr,
-                                        other_surface->size);
-}
-
 static void invalidate_overlapping_surfaces(NV2AState *d,
                                             SurfaceBinding const *surface)
 {
     PGRAPHVkState *r = d->pgraph.vk_renderer_state;
 
-    SurfaceBinding *other_surface, *next_surface;
-    QTAILQ_FOREACH_SAFE (other_surface, &r->surfaces, entry, next_surface) {
-        if (check_surfaces_overlap(surface, other_surface)) {
-            trace_nv2a_pgraph_surface_evict_overlapping(
-                other_surface->vram_addr, other_surface->width,
-                other_surface->height, other_surface->pitch);
-            pgraph_vk_surface_download_if_dirty(d, other_surface);
-            invalidate_surface(d, other_surface);
-        }
+    // Invalidating removes the surface from the index, so start over each time
+    SurfaceBinding *other_surface;
+    while ((other_surface = find_surface_in_range(r, NULL, surface->vram_addr,
+                                                  surface->size))) {
+        trace_nv2a_pgraph_surface_evict_overlapping(
+            other_surface->vram_addr, other_surface->width,
+            other_surface->height, other_surface->pitch);
+        pgraph_vk_surface_download_if_dirty(d, other_surface);
+        invalidate_surface(d, other_surface);
     }
 }
 
@@ -692,6 +908,11 @@ static void surface_put(NV2AState *d, SurfaceBinding *surface)
     register_cpu_access_callback(d, surface);
 
     QTAILQ_INSERT_HEAD(&r->surfaces, surface, entry);
+    if (surface->size) {
+        surface->vram_range.start = surface->vram_addr;
+        surface->vram_range.last = surface->vram_addr + surface->size - 1;
+        interval_tree_insert(&surface->vram_range, &r->surface_ranges);
+    }
 }
 
 SurfaceBinding *pgraph_vk_surface_get(NV2AState *d, hwaddr addr)
@@ -712,15 +933,7 @@ SurfaceBinding *pgraph_vk_surface_get_within(NV2AState *d, hwaddr addr)
 {
     PGRAPHVkState *r = d->pgraph.vk_renderer_state;
 
-    SurfaceBinding *surface;
-    QTAILQ_FOREACH (surface, &r->surfaces, entry) {
-        if (addr >= surface->vram_addr &&
-            addr < (surface->vram_addr + surface->size)) {
-            return surface;
-        }
-    }
-
-    return NULL;
+    return find_surface_in_range(r, NULL, addr, 1);
 }
 
 static void set_surface_label(PGRAPHState *pg, SurfaceBinding const *surface)
@@ -765,7 +978,7 @@ static void create_surface_image(PGRAPHState *pg, SurfaceBinding *surface)
 
     unsigned int width = surface->width ? surface->width : 1;
     unsigned int height = surface->height ? surface->height : 1;
-    pgraph_apply_scaling_factor(pg, &width, &height);
+    pgraph_vk_apply_surface_scale_factor(surface, &width, &height);
 
     assert(!surface->image);
     assert(!surface->image_scratch);
@@ -792,19 +1005,16 @@ static void create_surface_image(PGRAPHState *pg, SurfaceBinding *surface)
         .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
     };
 
-    VmaAllocationCreateInfo alloc_create_info = {
-        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-    };
-
-    VK_CHECK(vmaCreateImage(r->allocator, &image_create_info,
-                            &alloc_create_info, &surface->image,
-                            &surface->allocation, NULL));
-
-    VK_CHECK(vmaCreateImage(r->allocator, &image_create_info,
-                            &alloc_create_info, &surface->image_scratch,
-                            &surface->allocation_scratch, NULL));
+    VkDeviceSize memory_size, memory_size_scratch;
+    pgraph_vk_create_image(r, &image_create_info, &surface->image,
+                           &surface->allocation, &memory_size);
+    pgraph_vk_create_image(r, &image_create_info, &surface->image_scratch,
+                           &surface->allocation_scratch, &memory_size_scratch);
     surface->image_scratch_current_layout = VK_IMAGE_LAYOUT_UNDEFINED;
 
+    surface->memory_size = memory_size + memory_size_scratch;
+    r->residency.surface_bytes += surface->memory_size;
+
     VkImageViewCreateInfo image_view_create_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
         .image = surface->image,
@@ -838,6 +1048,7 @@ static void migrate_surface_image(SurfaceBinding *dst, SurfaceBinding *src)
     dst->image = src->image;
     dst->image_view = src->image_view;
     dst->allocation = src->allocation;
+    dst->memory_size = src->memory_size;
     dst->image_scratch = src->image_scratch;
     dst->image_scratch_current_layout = src->image_scratch_current_layout;
     dst->allocation_scratch = src->allocation_scratch;
@@ -845,6 +1056,7 @@ static void migrate_surface_image(SurfaceBinding *dst, SurfaceBinding *src)
     src->image = VK_NULL_HANDLE;
     src->image_view = VK_NULL_HANDLE;
     src->allocation = VK_NULL_HANDLE;
+    src->memory_size = 0;
     src->image_scratch = VK_NULL_HANDLE;
     src->image_scratch_current_layout = VK_IMAGE_LAYOUT_UNDEFINED;
     src->allocation_scratch = VK_NULL_HANDLE;
@@ -852,6 +1064,7 @@ static void migrate_surface_image(SurfaceBinding *dst, SurfaceBinding *src)
 
 static void destroy_surface_image(PGRAPHVkState *r, SurfaceBinding *surface)
 {
+    pgraph_vk_evict_framebuffers_using(r, surface->image_view);
     vkDestroyImageView(r->device, surface->image_view, NULL);
     surface->image_view = VK_NULL_HANDLE;
 
@@ -863,6 +1076,10 @@ static void destroy_surface_image(PGRAPHVkState *r, SurfaceBinding *surface)
                     surface->allocation_scratch);
     surface->image_scratch = VK_NULL_HANDLE;
     surface->allocation_scratch = VK_NULL_HANDLE;
+
+    assert(r->residency.surface_bytes >= surface->memory_size);
+    r->residency.surface_bytes -= surface->memory_size;
+    surface->memory_size = 0;
 }
 
 static bool check_invalid_surface_is_compatibile(SurfaceBinding *surface,
@@ -871,6 +1088,7 @@ static bool check_invalid_surface_is_compatibile(SurfaceBinding *surface,
     return surface->host_fmt.vk_format == target->host_fmt.vk_format &&
            surface->width == target->width &&
            surface->height == target->height &&
+           surface->scale == target->scale &&
            surface->host_fmt.usage == target->host_fmt.usage;
 }
 
@@ -888,19 +1106,179 @@ get_any_compatible_invalid_surface(PGRAPHVkState *r, SurfaceBinding *target)
     return NULL;
 }
 
+static int count_compatible_invalid_surfaces_before(PGRAPHVkState *r,
+                                                    SurfaceBinding *target)
+{
+    int count = 0;
+
+    SurfaceBinding *surface;
+    QTAILQ_FOREACH(surface, &r->invalid_surfaces, entry) {
+        if (surface == target) {
+            break;
+        }
+        if (check_invalid_surface_is_compatibile(surface, target)) {
+            count += 1;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Keep the most recently invalidated surfaces for reuse, with only a few of
+ * any one shape so that the kept images cover as many shapes as possible.
+ */
 static void prune_invalid_surfaces(PGRAPHVkState *r, int keep)
 {
     int num_surfaces = 0;
 
     SurfaceBinding *surface, *next;
     QTAILQ_FOREACH_SAFE(surface, &r->invalid_surfaces, entry, next) {
-        num_surfaces += 1;
-        if (num_surfaces > keep) {
-            QTAILQ_REMOVE(&r->invalid_surfaces, surface, entry);
-            destroy_surface_image(r, surface);
-            g_free(surface);
+        if (num_surfaces < keep &&
+            count_compatible_invalid_surfaces_before(r, surface) <
+                max_invalid_surfaces_per_shape) {
+            num_surfaces += 1;
+            continue;
+        }
+        QTAILQ_REMOVE(&r->invalid_surfaces, surface, entry);
+        destroy_surface_image(r, surface);
+        g_free(surface);
+    }
+}
+
+/*
+ * Create invalid surfaces of the shapes most titles render to, so the first
+ * frames do not have to allocate and initialize images while drawing.
+ */
+static void prewarm_surfaces(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    static const struct {
+        unsigned int width, height;
+    } shapes[] = {
+        { 640, 480 },
+        { 720, 480 },
+        { 1280, 720 },
+    };
+    const VkDeviceSize max_prewarm_bytes = 128 * 1024 * 1024;
+
+    SurfaceFormatInfo const formats[] = {
+        kelvin_surface_color_format_vk_map
+            [NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8],
+        r->kelvin_surface_zeta_vk_map[NV097_SET_SURFACE_FORMAT_ZETA_Z24S8],
+    };
+
+    VkDeviceSize bytes = 0;
+    for (int i = 0; i < ARRAY_SIZE(shapes); i++) {
+        for (int j = 0; j < ARRAY_SIZE(formats); j++) {
+            // Image and scratch image
+            VkDeviceSize surface_bytes = 2 * (VkDeviceSize)shapes[i].width *
+                                         shapes[i].height *
+                                         r->surface_scale_factor *
+                                         r->surface_scale_factor *
+                                         formats[j].host_bytes_per_pixel;
+            if (bytes + surface_bytes > max_prewarm_bytes) {
+                return;
+            }
+            bytes += surface_bytes;
+
+            SurfaceBinding *surface = g_malloc0(sizeof(SurfaceBinding));
+            surface->color = j == 0;
+            surface->host_fmt = formats[j];
+            surface->width = shapes[i].width;
+            surface->height = shapes[i].height;
+            surface->scale = r->surface_scale_factor;
+            create_surface_image(pg, surface);
+            QTAILQ_INSERT_TAIL(&r->invalid_surfaces, surface, entry);
+        }
+    }
+}
+
+VkDeviceSize pgraph_vk_get_invalid_surface_bytes(PGRAPHVkState *r)
+{
+    VkDeviceSize bytes = 0;
+
+    SurfaceBinding *surface;
+    QTAILQ_FOREACH(surface, &r->invalid_surfaces, entry) {
+        bytes += surface->memory_size;
+    }
+
+    return bytes;
+}
+
+/*
+ * Destroy invalid surfaces, least recently invalidated first, until at least
+ * `bytes` of device memory have been released. Returns the number of bytes
+ * released.
+ */
+VkDeviceSize pgraph_vk_trim_invalid_surfaces(PGRAPHVkState *r,
+                                             VkDeviceSize bytes)
+{
+    VkDeviceSize freed = 0;
+
+    SurfaceBinding *surface, *prev;
+    QTAILQ_FOREACH_REVERSE_SAFE(surface, &r->invalid_surfaces, entry, prev) {
+        if (freed >= bytes) {
+            break;
+        }
+        trace_nv2a_pgraph_surface_evict_reason("invalid", surface->vram_addr);
+        pgraph_vk_wait_for_draw_time(r, surface->draw_time);
+        freed += surface->memory_size;
+        QTAILQ_REMOVE(&r->invalid_surfaces, surface, entry);
+        destroy_surface_image(r, surface);
+        g_free(surface);
+        nv2a_profile_inc_counter(NV2A_PROF_RESIDENCY_EVICT);
+    }
+
+    return freed;
+}
+
+static int compare_surfaces_by_frame_time(gconstpointer a, gconstpointer b)
+{
+    const SurfaceBinding *sa = a, *sb = b;
+    return sa->frame_time - sb->frame_time;
+}
+
+/*
+ * Memory budget checks run at the end of a command buffer where surfaces
+ * cannot be invalidated, so any memory that could not be reclaimed from
+ * textures and invalid surfaces is reclaimed here from surfaces which have
+ * not been used in the current frame, least recently used first.
+ */
+static void reclaim_surfaces_over_budget(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (!r->residency.surface_reclaim_bytes) {
+        return;
+    }
+
+    GSList *candidates = NULL;
+    SurfaceBinding *s;
+    QTAILQ_FOREACH(s, &r->surfaces, entry) {
+        if (s != r->color_binding && s != r->zeta_binding &&
+            s->frame_time < pg->frame_time) {
+            candidates = g_slist_prepend(candidates, s);
         }
     }
+    candidates = g_slist_sort(candidates, compare_surfaces_by_frame_time);
+
+    VkDeviceSize freed = 0;
+    for (GSList *l = candidates;
+         l && freed < r->residency.surface_reclaim_bytes; l = l->next) {
+        s = l->data;
+        trace_nv2a_pgraph_surface_evict_reason("budget", s->vram_addr);
+        pgraph_vk_surface_download_if_dirty(d, s);
+        invalidate_surface(d, s);
+        freed += s->memory_size;
+        nv2a_profile_inc_counter(NV2A_PROF_RESIDENCY_EVICT);
+    }
+    g_slist_free(candidates);
+
+    pgraph_vk_trim_invalid_surfaces(r, freed);
+    r->residency.surface_reclaim_bytes = 0;
 }
 
 static void expire_old_surfaces(NV2AState *d)
@@ -924,7 +1302,7 @@ static bool check_surface_compatibility(SurfaceBinding const *s1,
     bool format_compatible =
         (s1->color == s2->color) &&
         (s1->host_fmt.vk_format == s2->host_fmt.vk_format) &&
-        (s1->pitch == s2->pitch);
+        (s1->pitch == s2->pitch) && (s1->scale == s2->scale);
     if (!format_compatible) {
         return false;
     }
@@ -943,6 +1321,38 @@ void pgraph_vk_surface_download_if_dirty(NV2AState *d, SurfaceBinding *surface)
     }
 }
 
+/*
+ * Record that surfaces rendered to in the command buffer being submitted are
+ * written when the submit reaches timeline value.
+ */
+void pgraph_vk_mark_surfaces_written(PGRAPHVkState *r, uint64_t value)
+{
+    SurfaceBinding *surface;
+    QTAILQ_FOREACH(surface, &r->surfaces, entry) {
+        if (surface->draw_time >= r->command_buffer_start_time) {
+            surface->write_value = value;
+        }
+    }
+}
+
+/*
+ * Wait for the GPU to complete all rendering to surface, submitting the
+ * command buffer first if it renders to it. Work which does not write the
+ * surface, including work submitted later, is not waited for.
+ */
+void pgraph_vk_wait_for_surface_writes(NV2AState *d, SurfaceBinding *surface)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (r->in_command_buffer &&
+        surface->draw_time >= r->command_buffer_start_time) {
+        pgraph_vk_finish(pg, VK_FINISH_REASON_SURFACE_READ);
+    }
+
+    pgraph_vk_wait_for_timeline_value(r, surface->write_value);
+}
+
 void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                                    bool force)
 {
@@ -953,6 +1363,20 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
         return;
     }
 
+    // Guest writes may have left VRAM as it was, e.g. when clearing memory
+    // the GPU has just cleared. Nothing was drawn since then, so the image
+    // still holds the same data.
+    if (!force && surface->initialized && surface->vram_hash_valid &&
+        !surface->draw_dirty &&
+        surface->vram_hash_draw_time == surface->draw_time &&
+        surface->size && surface->vram_hash == hash_surface_vram(d, surface)) {
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_UPLOAD_SKIPPED);
+        surface->upload_pending = false;
+        surface->upload_dirty_start = 0;
+        surface->upload_dirty_end = 0;
+        return;
+    }
+
     nv2a_profile_inc_counter(NV2A_PROF_SURF_UPLOAD);
 
     pgraph_vk_finish(pg, VK_FINISH_REASON_SURFACE_CREATE); // FIXME: SURFACE_UP
@@ -963,16 +1387,38 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                  surface->width, surface->height, surface->pitch,
                  surface->fmt.bytes_per_pixel);
 
+    bool use_compute_to_convert_depth_stencil_format =
+        surface->host_fmt.vk_format == VK_FORMAT_D24_UNORM_S8_UINT ||
+        surface->host_fmt.vk_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    bool upscale = surface->scale > 1 &&
+                   !use_compute_to_convert_depth_stencil_format;
+
+    // Only upload the rows written by the CPU if the rest is already in place.
+    // Rows of swizzled, packed or scaled surfaces are not contiguous in either
+    // image, so those are always uploaded whole.
+    unsigned int upload_y = 0, upload_height = surface->height;
+    if (!force && surface->initialized && !surface->swizzle &&
+        !use_compute_to_convert_depth_stencil_format && !upscale &&
+        surface->upload_dirty_end > surface->upload_dirty_start &&
+        surface->pitch) {
+        upload_y = surface->upload_dirty_start / surface->pitch;
+        upload_height =
+            MIN(DIV_ROUND_UP(surface->upload_dirty_end, surface->pitch),
+                surface->height) - upload_y;
+    }
+
     surface->upload_pending = false;
+    surface->upload_dirty_start = 0;
+    surface->upload_dirty_end = 0;
     surface->draw_time = pg->draw_time;
 
-    if (!surface->width || !surface->height) {
+    if (!surface->width || !surface->height || !upload_height) {
         surface->initialized = true;
         return;
     }
 
     uint8_t *data = d->vram_ptr;
-    uint8_t *buf = data + surface->vram_addr;
+    uint8_t *buf = data + surface->vram_addr + upload_y * surface->pitch;
 
     g_autofree uint8_t *swizzle_buf = NULL;
     uint8_t *gl_read_buf = NULL;
@@ -995,7 +1441,7 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     //
 
     StorageBuffer *copy_buffer = &r->storage_buffers[BUFFER_STAGING_SRC];
-    size_t uploaded_image_size = surface->height * surface->width *
+    size_t uploaded_image_size = upload_height * surface->width *
                                  surface->fmt.bytes_per_pixel;
     assert(uploaded_image_size <= copy_buffer->buffer_size);
 
@@ -1003,10 +1449,6 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     VK_CHECK(vmaMapMemory(r->allocator, copy_buffer->allocation,
                           &mapped_memory_ptr));
 
-    bool use_compute_to_convert_depth_stencil_format =
-        surface->host_fmt.vk_format == VK_FORMAT_D24_UNORM_S8_UINT ||
-        surface->host_fmt.vk_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
-
     bool no_conversion_necessary =
         surface->color || surface->host_fmt.vk_format == VK_FORMAT_D16_UNORM ||
         use_compute_to_convert_depth_stencil_format;
@@ -1014,7 +1456,7 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
 
     memcpy_image(mapped_memory_ptr, gl_read_buf,
                  surface->width * surface->fmt.bytes_per_pixel, surface->pitch,
-                 surface->height);
+                 upload_height);
 
     vmaFlushAllocation(r->allocator, copy_buffer->allocation, 0, VK_WHOLE_SIZE);
     vmaUnmapMemory(r->allocator, copy_buffer->allocation);
@@ -1045,7 +1487,8 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                                            VK_IMAGE_ASPECT_COLOR_BIT :
                                            VK_IMAGE_ASPECT_DEPTH_BIT,
         .imageSubresource.layerCount = 1,
-        .imageExtent = (VkExtent3D){ surface->width, surface->height, 1 },
+        .imageOffset = (VkOffset3D){ 0, upload_y, 0 },
+        .imageExtent = (VkExtent3D){ surface->width, upload_height, 1 },
     };
 
     if (surface->host_fmt.aspect & VK_IMAGE_ASPECT_STENCIL_BIT) {
@@ -1058,7 +1501,8 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
 
 
     unsigned int scaled_width = surface->width, scaled_height = surface->height;
-    pgraph_apply_scaling_factor(pg, &scaled_width, &scaled_height);
+    pgraph_vk_apply_surface_scale_factor(surface, &scaled_width,
+                                         &scaled_height);
 
     if (use_compute_to_convert_depth_stencil_format) {
 
@@ -1213,9 +1657,6 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
-    bool upscale = pg->surface_scale_factor > 1 &&
-                   !use_compute_to_convert_depth_stencil_format;
-
     if (upscale) {
         VkImageBlit blitRegion = {
             .srcSubresource.aspectMask = surface->host_fmt.aspect,
@@ -1233,10 +1674,12 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
             .dstOffsets[1] = (VkOffset3D){scaled_width, scaled_height, 1},
         };
 
+        pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_BLIT);
         vkCmdBlitImage(cmd, surface->image_scratch,
                        surface->image_scratch_current_layout, surface->image,
                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blitRegion,
                        surface->color ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+        pgraph_vk_end_gpu_timer(r, cmd);
     } else {
         // Note: We should be able to vkCmdCopyBufferToImage directly into
         // surface->image, but there is an apparent AMD Windows driver
@@ -1250,6 +1693,8 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                 .srcSubresource.layerCount = 1,
                 .dstSubresource.aspectMask = aspect,
                 .dstSubresource.layerCount = 1,
+                .srcOffset = regions[i].imageOffset,
+                .dstOffset = regions[i].imageOffset,
                 .extent = regions[i].imageExtent,
             };
             vkCmdCopyImage(cmd, surface->image_scratch,
@@ -1268,8 +1713,10 @@ void pgraph_vk_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_2);
     pgraph_vk_end_debug_marker(r, cmd);
     pgraph_vk_end_single_time_commands(pg, cmd);
+    surface->write_value = r->timeline_value;
 
     surface->initialized = true;
+    record_surface_vram_hash(d, surface);
 }
 
 static void compare_surfaces(SurfaceBinding const *a, SurfaceBinding const *b)
@@ -1358,6 +1805,7 @@ static void populate_surface_binding_target_sized(NV2AState *d, bool color,
     target->height = height;
     target->pitch = surface->pitch;
     target->size = height * MAX(surface->pitch, width * fmt.bytes_per_pixel);
+    target->scale = get_surface_target_scale(r, color, target->vram_addr);
     target->upload_pending = true;
     target->download_pending = false;
     target->draw_dirty = false;
@@ -1379,7 +1827,7 @@ static void populate_surface_binding_target(NV2AState *d, bool color,
     unsigned int width, height;
 
     if (color || !r->color_binding) {
-        get_surface_dimensions(pg, &width, &height);
+        pgraph_get_surface_dimensions(pg, &width, &height);
         pgraph_apply_anti_aliasing_factor(pg, &width, &height);
 
         // Since we determine surface dimensions based on the clipping
@@ -1396,6 +1844,126 @@ static void populate_surface_binding_target(NV2AState *d, bool color,
     populate_surface_binding_target_sized(d, color, width, height, target);
 }
 
+/*
+ * A surface rendered to by the GPU can be reinterpreted in place as the
+ * target surface if their guest memory layouts match texel for texel and the
+ * host images store the same bytes as guest memory, so raw image data can be
+ * moved between them without a round trip through VRAM.
+ */
+static bool check_surface_reinterpretable(SurfaceBinding const *surface,
+                                          SurfaceBinding const *target)
+{
+    if (!surface->draw_dirty || surface->upload_pending ||
+        !surface->initialized) {
+        return false;
+    }
+
+    if (surface->vram_addr != target->vram_addr ||
+        surface->pitch != target->pitch ||
+        surface->width != target->width || target->height > surface->height ||
+        surface->fmt.bytes_per_pixel != target->fmt.bytes_per_pixel ||
+        surface->scale != target->scale ||
+        surface->swizzle != target->swizzle ||
+        (surface->swizzle && surface->height != target->height)) {
+        return false;
+    }
+
+    // Packed depth-stencil formats need conversion in both directions
+    SurfaceBinding const *surfaces[] = { surface, target };
+    for (int i = 0; i < ARRAY_SIZE(surfaces); i++) {
+        if ((surfaces[i]->host_fmt.aspect & VK_IMAGE_ASPECT_STENCIL_BIT) ||
+            surfaces[i]->host_fmt.host_bytes_per_pixel !=
+                surfaces[i]->fmt.bytes_per_pixel) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void reinterpret_surface(NV2AState *d, SurfaceBinding *src,
+                                SurfaceBinding *dst)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    nv2a_profile_inc_counter(NV2A_PROF_SURF_REINTERPRET);
+
+    unsigned int scaled_width = dst->width, scaled_height = dst->height;
+    pgraph_vk_apply_surface_scale_factor(dst, &scaled_width, &scaled_height);
+
+    VkBuffer buffer = r->storage_buffers[BUFFER_COMPUTE_DST].buffer;
+    assert(scaled_width * scaled_height * dst->fmt.bytes_per_pixel <=
+           r->storage_buffers[BUFFER_COMPUTE_DST].buffer_size);
+
+    VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg);
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_RED, __func__);
+
+    pgraph_vk_transition_image_layout(
+        pg, cmd, src->image, src->host_fmt.vk_format,
+        src->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
+                     VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    pgraph_vk_transition_image_layout(
+        pg, cmd, dst->image, dst->host_fmt.vk_format,
+        dst->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
+                     VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    // Go through a buffer, as image copies cannot change the aspect
+    VkBufferImageCopy src_region = {
+        .imageSubresource.aspectMask = src->host_fmt.aspect,
+        .imageSubresource.layerCount = 1,
+        .imageExtent = (VkExtent3D){ scaled_width, scaled_height, 1 },
+    };
+    VkBufferImageCopy dst_region = src_region;
+    dst_region.imageSubresource.aspectMask = dst->host_fmt.aspect;
+
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_BLIT);
+    vkCmdCopyImageToBuffer(cmd, src->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1,
+                           &src_region);
+
+    VkBufferMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = buffer,
+        .size = VK_WHOLE_SIZE
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &barrier, 0, NULL);
+
+    vkCmdCopyBufferToImage(cmd, buffer, dst->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                           &dst_region);
+    pgraph_vk_end_gpu_timer(r, cmd);
+
+    pgraph_vk_transition_image_layout(
+        pg, cmd, src->image, src->host_fmt.vk_format,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        src->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
+                     VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    pgraph_vk_transition_image_layout(
+        pg, cmd, dst->image, dst->host_fmt.vk_format,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        dst->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
+                     VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+
+    pgraph_vk_end_debug_marker(r, cmd);
+    pgraph_vk_end_single_time_commands(pg, cmd);
+
+    // The data now only exists in the new surface
+    dst->upload_pending = false;
+    dst->initialized = true;
+    dst->draw_dirty = true;
+    dst->draw_time = pg->draw_time;
+    dst->write_value = r->timeline_value;
+}
+
 static void update_surface_part(NV2AState *d, bool upload, bool color)
 {
     PGRAPHState *pg = &d->pgraph;
@@ -1407,9 +1975,10 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
 
     Surface *pg_surface = color ? &pg->surface_color : &pg->surface_zeta;
 
-    bool mem_dirty = !tcg_enabled() && memory_region_test_and_clear_dirty(
-                                           d->vram, target.vram_addr,
-                                           target.size, DIRTY_MEMORY_NV2A);
+    bool mem_dirty =
+        !tcg_enabled() && pgraph_vram_check_dirty(d, r->surface_vram_gens,
+                                                  target.vram_addr,
+                                                  target.size);
 
     SurfaceBinding *current_binding = color ? r->color_binding
                                             : r->zeta_binding;
@@ -1443,6 +2012,7 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
             pg->surface_shape.clip_height);
 
         bool should_create = true;
+        SurfaceBinding *reinterpret_src = NULL;
 
         if (surface != NULL) {
             bool is_compatible =
@@ -1494,7 +2064,8 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
 
             if (is_compatible && !color && r->color_binding) {
                 is_compatible &= (surface->width == r->color_binding->width) &&
-                                 (surface->height == r->color_binding->height);
+                                 (surface->height == r->color_binding->height) &&
+                                 (surface->scale == r->color_binding->scale);
             }
 
             if (is_compatible) {
@@ -1505,15 +2076,29 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
                 pg->surface_binding_dim.height = surface->height;
                 pg->surface_binding_dim.clip_y = surface->shape.clip_y;
                 pg->surface_binding_dim.clip_height = surface->shape.clip_height;
-                surface->upload_pending |= mem_dirty;
+                if (mem_dirty) {
+                    pgraph_vk_mark_surface_upload_pending(surface, 0, 0);
+                }
                 pg->surface_zeta.buffer_dirty |= color;
                 should_create = false;
             } else {
                 trace_nv2a_pgraph_surface_evict_reason(
                     "incompatible", surface->vram_addr);
                 compare_surfaces(surface, &target);
-                pgraph_vk_surface_download_if_dirty(d, surface);
+                if (check_surface_reinterpretable(surface, &target)) {
+                    // Keep the image out of reach of reuse and pruning until
+                    // its contents have been copied to the new surface
+                    reinterpret_src = surface;
+                    surface->draw_dirty = false;
+                    surface->download_pending = false;
+                } else {
+                    pgraph_vk_surface_download_if_dirty(d, surface);
+                }
                 invalidate_surface(d, surface);
+                if (reinterpret_src) {
+                    QTAILQ_REMOVE(&r->invalid_surfaces, reinterpret_src,
+                                  entry);
+                }
             }
         }
 
@@ -1530,6 +2115,12 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
             set_surface_label(pg, surface);
             surface_put(d, surface);
 
+            if (reinterpret_src) {
+                reinterpret_surface(d, reinterpret_src, surface);
+                QTAILQ_INSERT_HEAD(&r->invalid_surfaces, reinterpret_src,
+                                   entry);
+            }
+
             // FIXME: Refactor
             pg->surface_binding_dim.width = target.width;
             pg->surface_binding_dim.clip_x = target.shape.clip_x;
@@ -1540,7 +2131,8 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
 
             if (color && r->zeta_binding &&
                 (r->zeta_binding->width != target.width ||
-                 r->zeta_binding->height != target.height)) {
+                 r->zeta_binding->height != target.height ||
+                 r->zeta_binding->scale != target.scale)) {
                 pg->surface_zeta.buffer_dirty = true;
             }
         }
@@ -1560,73 +2152,33 @@ static void update_surface_part(NV2AState *d, bool upload, bool color)
 
         bind_surface(r, surface);
         pg_surface->buffer_dirty = false;
+
+        if (color || !r->color_binding) {
+            pg->surface_scale_factor = surface->scale;
+        }
     }
 
     if (!upload && pg_surface->draw_dirty) {
-        if (!tcg_enabled()) {
-            // FIXME: Cannot monitor for reads/writes; flush now
-            download_surface(d, color ? r->color_binding : r->zeta_binding,
-                             true);
-        }
+        // Catch the next CPU access to what was drawn
+        SurfaceBinding *binding = color ? r->color_binding : r->zeta_binding;
+        mem_access_callback_rearm(qemu_get_cpu(0), binding->access_cb);
 
         pg_surface->write_enabled_cache = false;
         pg_surface->draw_dirty = false;
     }
 }
 
-// FIXME: Move to common?
 void pgraph_vk_surface_update(NV2AState *d, bool upload, bool color_write,
                               bool zeta_write)
 {
     PGRAPHState *pg = &d->pgraph;
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    pg->surface_shape.z_format =
-        GET_MASK(pgraph_reg_r(pg, NV_PGRAPH_SETUPRASTER),
-                 NV_PGRAPH_SETUPRASTER_Z_FORMAT);
-
-    color_write = color_write &&
-            (pg->clearing || pgraph_color_write_enabled(pg));
-    zeta_write = zeta_write && (pg->clearing || pgraph_zeta_write_enabled(pg));
-
-    if (upload) {
-        bool fb_dirty = framebuffer_dirty(pg);
-        if (fb_dirty) {
-            memcpy(&pg->last_surface_shape, &pg->surface_shape,
-                   sizeof(SurfaceShape));
-            pg->surface_color.buffer_dirty = true;
-            pg->surface_zeta.buffer_dirty = true;
-        }
-
-        if (pg->surface_color.buffer_dirty) {
-            unbind_surface(d, true);
-        }
-
-        if (color_write) {
-            update_surface_part(d, true, true);
-        }
-
-        if (pg->surface_zeta.buffer_dirty) {
-            unbind_surface(d, false);
-        }
-
-        if (zeta_write) {
-            update_surface_part(d, true, false);
-        }
-    } else {
-        if ((color_write || pg->surface_color.write_enabled_cache)
-            && pg->surface_color.draw_dirty) {
-            update_surface_part(d, false, true);
-        }
-        if ((zeta_write || pg->surface_zeta.write_enabled_cache)
-            && pg->surface_zeta.draw_dirty) {
-            update_surface_part(d, false, false);
-        }
-    }
-
-    if (upload) {
-        pg->draw_time++;
-    }
+    static const PGRAPHSurfaceUpdateOps ops = {
+        .unbind_surface = unbind_surface,
+        .update_surface_part = update_surface_part,
+    };
+    pgraph_update_surface_parts(d, upload, color_write, zeta_write, &ops);
 
     bool swizzle = (pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE);
 
@@ -1655,6 +2207,7 @@ void pgraph_vk_surface_update(NV2AState *d, bool upload, bool color_write,
     }
 
     expire_old_surfaces(d);
+    reclaim_surfaces_over_budget(d);
     prune_invalid_surfaces(r, num_invalid_surfaces_to_keep);
 }
 
@@ -1717,6 +2270,7 @@ void pgraph_vk_init_surfaces(PGRAPHState *pg)
     }
 
     QTAILQ_INIT(&r->surfaces);
+    r->surface_ranges = (IntervalTreeRoot){};
     QTAILQ_INIT(&r->invalid_surfaces);
 
     r->downloads_pending = false;
@@ -1727,12 +2281,67 @@ void pgraph_vk_init_surfaces(PGRAPHState *pg)
     r->zeta_binding = NULL;
     r->framebuffer_dirty = true;
 
+    r->unscaled_surface_addrs = g_hash_table_new(NULL, NULL);
+    r->display_surface_addrs = g_hash_table_new(NULL, NULL);
+    r->surface_vram_gens =
+        pgraph_vram_new_seen_gens(container_of(pg, NV2AState, pgraph));
+
     pgraph_vk_reload_surface_scale_factor(pg); // FIXME: Move internal
+    prewarm_surfaces(pg);
 }
 
 void pgraph_vk_finalize_surfaces(PGRAPHState *pg)
 {
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
     pgraph_vk_surface_flush(container_of(pg, NV2AState, pgraph));
+    prune_invalid_surfaces(r, 0);
+
+    g_hash_table_destroy(r->unscaled_surface_addrs);
+    g_hash_table_destroy(r->display_surface_addrs);
+    g_free(r->surface_vram_gens);
+    r->surface_vram_gens = NULL;
+}
+
+/*
+ * Drops the surfaces that no longer match VRAM, e.g. after loading a
+ * snapshot, and keeps the others along with their scaled contents.
+ */
+void pgraph_vk_surface_revalidate(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    // Surfaces about to be uploaded are refreshed from VRAM anyway. What was
+    // drawn since must not be read back over the loaded memory.
+    SurfaceBinding *s, *next;
+    QTAILQ_FOREACH(s, &r->surfaces, entry) {
+        bool keep = !s->draw_dirty &&
+                    (s->upload_pending ||
+                     (s->vram_hash_valid &&
+                      s->vram_hash_draw_time == s->draw_time &&
+                      s->vram_hash == hash_surface_vram(d, s)));
+        if (!keep) {
+            s->vram_hash_valid = false;
+            s->draw_dirty = false;
+            s->download_pending = false;
+        } else {
+            s->vram_hash_valid = true;
+        }
+    }
+
+    pg->surface_color.draw_dirty = false;
+    pg->surface_zeta.draw_dirty = false;
+    memset(&pg->last_surface_shape, 0, sizeof(pg->last_surface_shape));
+    unbind_surface(d, true);
+    unbind_surface(d, false);
+
+    QTAILQ_FOREACH_SAFE(s, &r->surfaces, entry, next) {
+        if (!s->vram_hash_valid) {
+            invalidate_surface(d, s);
+        }
+    }
+    prune_invalid_surfaces(r, 0);
 }
 
 void pgraph_vk_surface_flush(NV2AState *d)
@@ -1757,4 +2366,5 @@ void pgraph_vk_surface_flush(NV2AState *d)
     prune_invalid_surfaces(r, 0);
 
     pgraph_vk_reload_surface_scale_factor(pg);
+    prewarm_surfaces(pg);
 }
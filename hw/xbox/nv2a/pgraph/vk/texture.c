@@ -28,6 +28,8 @@
 #include "hw/xbox/nv2a/pgraph/swizzle.h"
 #include "qemu/fast-hash.h"
 #include "qemu/lru.h"
+#include "xemu-version.h"
+#include "ui/xemu-settings.h"
 #include "renderer.h"
 
 static void texture_cache_release_node_resources(PGRAPHVkState *r, TextureBinding *snode);
@@ -85,6 +87,47 @@ static enum S3TC_DECOMPRESS_FORMAT kelvin_format_to_s3tc_format(int color_format
 }
 
 // FIXME: Move to common
+static VkFormat kelvin_format_to_bc_format(int color_format)
+{
+    switch (color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5:
+        return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT23_A8R8G8B8:
+        return VK_FORMAT_BC2_UNORM_BLOCK;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT45_A8R8G8B8:
+        return VK_FORMAT_BC3_UNORM_BLOCK;
+    default:
+        assert(!"Invalid format");
+    }
+}
+
+/*
+ * Whether compressed texture data can be uploaded as is, rather than being
+ * decompressed on the CPU. Bordered textures are decompressed so that the
+ * border can be cropped off of cubemap faces.
+ */
+static bool check_texture_compressed_upload_supported(PGRAPHState *pg,
+                                                      const TextureShape *s)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (!pgraph_is_texture_format_compressed(pg, s->color_format) ||
+        s->border) {
+        return false;
+    }
+
+    return s->dimensionality == 3 ? r->texture_compression_bc_3d :
+                                    r->texture_compression_bc;
+}
+
+static VkFormat get_texture_vk_format(PGRAPHState *pg, const TextureShape *s)
+{
+    if (check_texture_compressed_upload_supported(pg, s)) {
+        return kelvin_format_to_bc_format(s->color_format);
+    }
+    return kelvin_color_format_vk_map[s->color_format].vk_format;
+}
+
 static void memcpy_image(void *dst, void *src, int min_stride, int dst_stride, int src_stride, int height)
 {
     uint8_t *dst_ptr = (uint8_t *)dst;
@@ -134,11 +177,120 @@ static size_t get_cubemap_layer_size(PGRAPHState *pg, TextureShape s)
     return ROUND_UP(length, NV2A_CUBEMAP_FACE_ALIGNMENT);
 }
 
+/*
+ * Compressed 3D textures store the blocks of up to 4 consecutive slices
+ * together. Reorder them to be slice by slice, as expected by Vulkan.
+ */
+static uint8_t *reorder_compressed_blocks_3d(const uint8_t *data,
+                                             unsigned int width,
+                                             unsigned int height,
+                                             unsigned int depth,
+                                             size_t block_size, size_t *size)
+{
+    unsigned int num_blocks_x = (width + 3) / 4, num_blocks_y = (height + 3) / 4;
+    size_t slice_size = num_blocks_x * num_blocks_y * block_size;
+
+    *size = slice_size * depth;
+    uint8_t *reordered = g_malloc(*size);
+
+    for (unsigned int z = 0; z < depth; z += 4) {
+        unsigned int block_depth = MIN(depth - z, 4);
+        for (unsigned int j = 0; j < num_blocks_y; j++) {
+            for (unsigned int i = 0; i < num_blocks_x; i++) {
+                for (unsigned int slice = 0; slice < block_depth; slice++) {
+                    memcpy(reordered + (z + slice) * slice_size +
+                               (j * num_blocks_x + i) * block_size,
+                           data, block_size);
+                    data += block_size;
+                }
+            }
+        }
+    }
+
+    return reordered;
+}
+
+static size_t get_level_size(bool is_compressed, size_t block_size,
+                             unsigned int bytes_per_pixel, unsigned int width,
+                             unsigned int height, unsigned int depth)
+{
+    if (is_compressed) {
+        unsigned int physical_width = (width + 3) & ~3,
+                     physical_height = (height + 3) & ~3;
+        return physical_width / 4 * physical_height / 4 * depth * block_size;
+    }
+    return width * height * depth * bytes_per_pixel;
+}
+
+static bool is_level_wanted(const uint32_t *level_masks, int layer, int level)
+{
+    return !level_masks || (level_masks[layer] & (1 << level));
+}
+
+/*
+ * Add the levels of each layer whose data overlaps bytes [start, end) of the
+ * texture to level_masks.
+ */
+static void get_levels_in_range(PGRAPHState *pg, const TextureShape *s,
+                                hwaddr start, hwaddr end,
+                                uint32_t level_masks[6])
+{
+    BasicColorFormatInfo f = kelvin_color_format_info_map[s->color_format];
+
+    if (f.linear) {
+        level_masks[0] |= 1;
+        return;
+    }
+
+    bool is_compressed = pgraph_is_texture_format_compressed(pg, s->color_format);
+    size_t block_size =
+        s->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5 ? 8 :
+                                                                            16;
+
+    unsigned int adjusted_width = s->width, adjusted_height = s->height,
+                 adjusted_depth = s->dimensionality == 3 ? s->depth : 1;
+    if (s->border) {
+        adjusted_width = MAX(16, adjusted_width * 2);
+        adjusted_height = MAX(16, adjusted_height * 2);
+        if (s->dimensionality == 3) {
+            adjusted_depth = MAX(16, s->depth * 2);
+        }
+    }
+
+    hwaddr layer_size = s->cubemap ? get_cubemap_layer_size(pg, *s) : 0;
+    const int num_layers = s->cubemap ? 6 : 1;
+
+    for (int layer = 0; layer < num_layers; layer++) {
+        unsigned int width = adjusted_width, height = adjusted_height,
+                     depth = adjusted_depth;
+        hwaddr offset = layer * layer_size;
+
+        for (int level = 0; level < s->levels; level++) {
+            width = MAX(width, 1);
+            height = MAX(height, 1);
+            depth = MAX(depth, 1);
+
+            size_t size = get_level_size(is_compressed, block_size,
+                                         f.bytes_per_pixel, width, height,
+                                         depth);
+            if (offset < end && start < offset + size) {
+                level_masks[layer] |= 1 << level;
+            }
+            offset += size;
+
+            width /= 2;
+            height /= 2;
+            depth /= 2;
+        }
+    }
+}
+
 // FIXME: Move to common
 // FIXME: More refactoring
 // FIXME: Possible parallelization of decoding
 // FIXME: Bounds checking
-static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx)
+static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx,
+                                         const uint32_t *level_masks)
 {
     NV2AState *d = container_of(pg, NV2AState, pgraph);
     TextureShape s = pgraph_get_texture_shape(pg, texture_idx);
@@ -221,6 +373,7 @@ static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx)
     }
 
     bool is_compressed = pgraph_is_texture_format_compressed(pg, s.color_format);
+    bool keep_compressed = check_texture_compressed_upload_supported(pg, &s);
     size_t block_size = 0;
     if (is_compressed) {
         bool is_dxt1 =
@@ -241,7 +394,26 @@ static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx)
 
                 width = MAX(width, 1);
                 height = MAX(height, 1);
-                if (is_compressed) {
+                if (!is_level_wanted(level_masks, layer, level)) {
+                    texture_data_ptr +=
+                        get_level_size(is_compressed, block_size,
+                                       f.bytes_per_pixel, width, height, 1);
+                } else if (is_compressed && keep_compressed) {
+                    unsigned int physical_width = (width + 3) & ~3,
+                                 physical_height = (height + 3) & ~3;
+                    size_t size =
+                        physical_width / 4 * physical_height / 4 * block_size;
+
+                    layout->layers[layer].levels[level] = (TextureLevel){
+                        .width = width,
+                        .height = height,
+                        .depth = 1,
+                        .decoded_size = size,
+                        .decoded_data = g_memdup2(texture_data_ptr, size),
+                    };
+
+                    texture_data_ptr += size;
+                } else if (is_compressed) {
                     // https://docs.microsoft.com/en-us/windows/win32/direct3d10/d3d10-graphics-programming-guide-resources-block-compression#virtual-size-versus-physical-size
                     unsigned int tex_width = width, tex_height = height;
                     unsigned int physical_width = (width + 3) & ~3,
@@ -331,7 +503,32 @@ static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx)
                      depth = adjusted_depth;
 
         for (int level = 0; level < s.levels; level++) {
-            if (is_compressed) {
+            if (!is_level_wanted(level_masks, 0, level)) {
+                width = MAX(width, 1);
+                height = MAX(height, 1);
+                depth = MAX(depth, 1);
+                texture_data_ptr +=
+                    get_level_size(is_compressed, block_size,
+                                   f.bytes_per_pixel, width, height, depth);
+            } else if (is_compressed && keep_compressed) {
+                width = MAX(width, 1);
+                height = MAX(height, 1);
+                depth = MAX(depth, 1);
+
+                size_t size;
+                uint8_t *reordered = reorder_compressed_blocks_3d(
+                    texture_data_ptr, width, height, depth, block_size, &size);
+
+                layout->layers[0].levels[level] = (TextureLevel){
+                    .width = width,
+                    .height = height,
+                    .depth = depth,
+                    .decoded_size = size,
+                    .decoded_data = reordered,
+                };
+
+                texture_data_ptr += size;
+            } else if (is_compressed) {
                 width = MAX(width, 1);
                 height = MAX(height, 1);
                 unsigned int physical_width = (width + 3) & ~3,
@@ -401,154 +598,249 @@ static TextureLayout *get_texture_layout(PGRAPHState *pg, int texture_idx)
 }
 
 struct pgraph_texture_possibly_dirty_struct {
+    NV2AState *d;
     hwaddr addr, end;
+    DirtyBitmapSnapshot *snap; // Pages of the range to mark, NULL for all
 };
 
-static void mark_textures_possibly_dirty_visitor(Lru *lru, LruNode *node, void *opaque)
+static hwaddr get_texture_page_base(const TextureKey *key)
 {
-    struct pgraph_texture_possibly_dirty_struct *test = opaque;
+    return key->texture_vram_offset & TARGET_PAGE_MASK;
+}
 
-    TextureBinding *tnode = container_of(node, TextureBinding, node);
-    if (tnode->possibly_dirty) {
-        return;
+static unsigned int get_texture_num_pages(const TextureKey *key)
+{
+    return (TARGET_PAGE_ALIGN(key->texture_vram_offset + key->texture_length) -
+            get_texture_page_base(key)) >> TARGET_PAGE_BITS;
+}
+
+/*
+ * Created bindings are indexed by the pages of their texture data and by their
+ * palette, so that writes only visit the bindings they overlap.
+ */
+static void insert_texture_ranges(PGRAPHVkState *r, TextureBinding *binding)
+{
+    hwaddr page_base = get_texture_page_base(&binding->key);
+    binding->vram_range.start = page_base;
+    binding->vram_range.last =
+        page_base +
+        ((hwaddr)get_texture_num_pages(&binding->key) << TARGET_PAGE_BITS) - 1;
+    interval_tree_insert(&binding->vram_range, &r->texture_ranges);
+
+    if (binding->key.palette_length) {
+        binding->palette_range.start = binding->key.palette_vram_offset;
+        binding->palette_range.last = binding->key.palette_vram_offset +
+                                      binding->key.palette_length - 1;
+        interval_tree_insert(&binding->palette_range,
+                             &r->texture_palette_ranges);
     }
+}
 
-    uintptr_t k_tex_addr = tnode->key.texture_vram_offset;
-    uintptr_t k_tex_end = k_tex_addr + tnode->key.texture_length - 1;
-    bool overlapping = !(test->addr > k_tex_end || k_tex_addr > test->end);
+static void remove_texture_ranges(PGRAPHVkState *r, TextureBinding *binding)
+{
+    interval_tree_remove(&binding->vram_range, &r->texture_ranges);
+    if (binding->key.palette_length) {
+        interval_tree_remove(&binding->palette_range,
+                             &r->texture_palette_ranges);
+    }
+}
 
-    if (tnode->key.palette_length > 0) {
-        uintptr_t k_pal_addr = tnode->key.palette_vram_offset;
-        uintptr_t k_pal_end = k_pal_addr + tnode->key.palette_length - 1;
-        overlapping |= !(test->addr > k_pal_end || k_pal_addr > test->end);
+static void mark_texture_pages_possibly_dirty(
+    TextureBinding *tnode, struct pgraph_texture_possibly_dirty_struct *test)
+{
+    if (!tnode->dirty_pages) {
+        return;
     }
 
-    tnode->possibly_dirty |= overlapping;
+    hwaddr page_base = get_texture_page_base(&tnode->key);
+    hwaddr start = MAX(test->addr, page_base);
+    hwaddr end = MIN(test->end, page_base +
+                     ((hwaddr)tnode->num_pages << TARGET_PAGE_BITS) - 1);
+    for (hwaddr addr = start; addr <= end; addr += TARGET_PAGE_SIZE) {
+        if (!test->snap || memory_region_snapshot_get_dirty(
+                               test->d->vram, test->snap, addr,
+                               TARGET_PAGE_SIZE)) {
+            set_bit((addr - page_base) >> TARGET_PAGE_BITS,
+                    tnode->dirty_pages);
+        }
+    }
 }
 
-void pgraph_vk_mark_textures_possibly_dirty(NV2AState *d,
-    hwaddr addr, hwaddr size)
+static void mark_textures_possibly_dirty(NV2AState *d, hwaddr addr,
+                                         hwaddr size,
+                                         DirtyBitmapSnapshot *snap)
 {
     hwaddr end = TARGET_PAGE_ALIGN(addr + size) - 1;
     addr &= TARGET_PAGE_MASK;
     assert(end <= memory_region_size(d->vram));
 
+    PGRAPHVkState *r = d->pgraph.vk_renderer_state;
     struct pgraph_texture_possibly_dirty_struct test = {
+        .d = d,
         .addr = addr,
         .end = end,
+        .snap = snap,
     };
 
-    lru_visit_active(&d->pgraph.vk_renderer_state->texture_cache,
-                     mark_textures_possibly_dirty_visitor,
-                     &test);
+    for (IntervalTreeNode *node =
+             interval_tree_iter_first(&r->texture_ranges, addr, end);
+         node; node = interval_tree_iter_next(node, addr, end)) {
+        mark_texture_pages_possibly_dirty(
+            container_of(node, TextureBinding, vram_range), &test);
+    }
+
+    for (IntervalTreeNode *node =
+             interval_tree_iter_first(&r->texture_palette_ranges, addr, end);
+         node; node = interval_tree_iter_next(node, addr, end)) {
+        container_of(node, TextureBinding, palette_range)->possibly_dirty =
+            true;
+    }
+}
+
+void pgraph_vk_mark_textures_possibly_dirty(NV2AState *d,
+    hwaddr addr, hwaddr size)
+{
+    mark_textures_possibly_dirty(d, addr, size, NULL);
 }
 
-static bool check_texture_dirty(NV2AState *d, hwaddr addr, hwaddr size)
+/*
+ * Mark the textures using pages of a range modified since they were last
+ * checked as possibly dirty.
+ */
+static void check_texture_dirty(NV2AState *d, hwaddr addr, hwaddr size)
 {
     hwaddr end = TARGET_PAGE_ALIGN(addr + size);
     addr &= TARGET_PAGE_MASK;
     assert(end < memory_region_size(d->vram));
-    return memory_region_test_and_clear_dirty(d->vram, addr, end - addr,
-                                              DIRTY_MEMORY_NV2A_TEX);
+
+    /*
+     * Snapshots copy and clear whole longs of the dirty bitmap, so take one
+     * of exactly those pages to not lose track of the pages around the range.
+     */
+    ram_addr_t base = memory_region_get_ram_addr(d->vram);
+    hwaddr align = TARGET_PAGE_SIZE * BITS_PER_LONG;
+    hwaddr first = MAX(QEMU_ALIGN_DOWN(base + addr, align), base) - base;
+    hwaddr last = MIN(QEMU_ALIGN_UP(base + end, align),
+                      base + memory_region_size(d->vram)) - base;
+
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+        d->vram, first, last - first, DIRTY_MEMORY_NV2A_TEX);
+    if (memory_region_snapshot_get_dirty(d->vram, snap, first,
+                                         last - first)) {
+        mark_textures_possibly_dirty(d, first, last - first, snap);
+    }
+    g_free(snap);
 }
 
-// Check if any of the pages spanned by the a texture are dirty.
-static bool check_texture_possibly_dirty(NV2AState *d,
+static void check_texture_possibly_dirty(NV2AState *d,
                                          hwaddr texture_vram_offset,
                                          unsigned int length,
                                          hwaddr palette_vram_offset,
                                          unsigned int palette_length)
 {
-    bool possibly_dirty = false;
-    if (check_texture_dirty(d, texture_vram_offset, length)) {
-        possibly_dirty = true;
-        pgraph_vk_mark_textures_possibly_dirty(d, texture_vram_offset, length);
+    check_texture_dirty(d, texture_vram_offset, length);
+    if (palette_length) {
+        check_texture_dirty(d, palette_vram_offset, palette_length);
     }
-    if (palette_length && check_texture_dirty(d, palette_vram_offset,
-                                                     palette_length)) {
-        possibly_dirty = true;
-        pgraph_vk_mark_textures_possibly_dirty(d, palette_vram_offset,
-                                            palette_length);
-    }
-    return possibly_dirty;
 }
 
-// FIXME: Make sure we update sampler when data matches. Should we add filtering
-// options to the textureshape?
-static void upload_texture_image(PGRAPHState *pg, int texture_idx,
-                                 TextureBinding *binding)
+static bool check_texture_mipmap_generation_supported(PGRAPHState *pg,
+                                                     const TextureShape *s)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
-    TextureShape *state = &binding->key.state;
-    VkColorFormatInfo vkf = kelvin_color_format_vk_map[state->color_format];
-
-    nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
+    BasicColorFormatInfo f = kelvin_color_format_info_map[s->color_format];
+    const VkFormatFeatureFlags features =
+        VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
 
-    g_autofree TextureLayout *layout = get_texture_layout(pg, texture_idx);
-    const int num_layers = state->cubemap ? 6 : 1;
+    if (!g_config.display.vulkan.gpu_generate_mipmaps) {
+        return false;
+    }
 
-    // Calculate decoded texture data size
-    size_t texture_data_size = 0;
-    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
-        TextureLayer *layer = &layout->layers[layer_idx];
-        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
-            size_t size = layer->levels[level_idx].decoded_size;
-            assert(size);
-            texture_data_size += size;
-        }
+    if (f.linear || s->border || s->dimensionality != 2 || s->levels < 2) {
+        return false;
     }
 
-    assert(texture_data_size <=
-           r->storage_buffers[BUFFER_STAGING_SRC].buffer_size);
+    // Blits cannot write block-compressed images
+    if (check_texture_compressed_upload_supported(pg, s)) {
+        return false;
+    }
 
-    // Copy texture data to mapped device buffer
-    uint8_t *mapped_memory_ptr;
+    return (r->texture_format_properties[s->color_format]
+                .optimalTilingFeatures &
+            features) == features;
+}
 
-    VK_CHECK(vmaMapMemory(r->allocator,
-                          r->storage_buffers[BUFFER_STAGING_SRC].allocation,
-                          (void *)&mapped_memory_ptr));
+/*
+ * Fill the levels after the first by successively downscaling the previous
+ * one. The first level must be in TRANSFER_DST_OPTIMAL layout, all levels are
+ * left in TRANSFER_SRC_OPTIMAL.
+ */
+static void generate_texture_mipmaps(PGRAPHVkState *r, VkCommandBuffer cmd,
+                                     TextureBinding *binding)
+{
+    TextureShape *state = &binding->key.state;
+    const int num_layers = state->cubemap ? 6 : 1;
+    int32_t width = binding->image_create_info.extent.width;
+    int32_t height = binding->image_create_info.extent.height;
 
-    int num_regions = num_layers * state->levels;
-    g_autofree VkBufferImageCopy *regions =
-        g_malloc0_n(num_regions, sizeof(VkBufferImageCopy));
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = binding->image,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.layerCount = num_layers,
+    };
 
-    VkBufferImageCopy *region = regions;
-    VkDeviceSize buffer_offset = 0;
+    for (int level = 1; level < state->levels; level++) {
+        barrier.subresourceRange.baseMipLevel = level - 1;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
+                             NULL, 1, &barrier);
+
+        int32_t level_width = MAX(width / 2, 1);
+        int32_t level_height = MAX(height / 2, 1);
+
+        VkImageBlit blit = {
+            .srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .srcSubresource.mipLevel = level - 1,
+            .srcSubresource.layerCount = num_layers,
+            .srcOffsets[1] = (VkOffset3D){ width, height, 1 },
+            .dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .dstSubresource.mipLevel = level,
+            .dstSubresource.layerCount = num_layers,
+            .dstOffsets[1] = (VkOffset3D){ level_width, level_height, 1 },
+        };
+        vkCmdBlitImage(cmd, binding->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, binding->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                       VK_FILTER_LINEAR);
 
-    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
-        TextureLayer *layer = &layout->layers[layer_idx];
-        NV2A_VK_DPRINTF("Layer %d", layer_idx);
-        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
-            TextureLevel *level = &layer->levels[level_idx];
-            NV2A_VK_DPRINTF(" - Level %d, w=%d h=%d d=%d @ %08" HWADDR_PRIx,
-                            level_idx, level->width, level->height,
-                            level->depth, buffer_offset);
-            memcpy(mapped_memory_ptr + buffer_offset, level->decoded_data,
-                   level->decoded_size);
-            *region = (VkBufferImageCopy){
-                .bufferOffset = buffer_offset,
-                .bufferRowLength = 0, // Tightly packed
-                .bufferImageHeight = 0,
-                .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .imageSubresource.mipLevel = level_idx,
-                .imageSubresource.baseArrayLayer = layer_idx,
-                .imageSubresource.layerCount = 1,
-                .imageOffset = (VkOffset3D){ 0, 0, 0 },
-                .imageExtent =
-                    (VkExtent3D){ level->width, level->height, level->depth },
-            };
-            buffer_offset += level->decoded_size;
-            region++;
-        }
+        width = level_width;
+        height = level_height;
     }
-    assert(buffer_offset <= r->storage_buffers[BUFFER_STAGING_SRC].buffer_size);
 
-    vmaFlushAllocation(r->allocator,
-                       r->storage_buffers[BUFFER_STAGING_SRC].allocation, 0,
-                       VK_WHOLE_SIZE);
+    barrier.subresourceRange.baseMipLevel = state->levels - 1;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                         1, &barrier);
+}
 
-    vmaUnmapMemory(r->allocator,
-                   r->storage_buffers[BUFFER_STAGING_SRC].allocation);
+static void upload_texture_image_on_graphics_queue(PGRAPHState *pg,
+                                                   TextureBinding *binding,
+                                                   StorageBuffer *staging,
+                                                   VkBufferImageCopy *regions,
+                                                   int num_regions)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    VkColorFormatInfo vkf =
+        kelvin_color_format_vk_map[binding->key.state.color_format];
 
     // FIXME: Use nondraw. Need to fill and copy tex buffer at once
     VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg);
@@ -560,7 +852,7 @@ static void upload_texture_image(PGRAPHState *pg, int texture_idx,
         .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
         .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
         .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .buffer = r->storage_buffers[BUFFER_STAGING_SRC].buffer,
+        .buffer = staging->buffer,
         .size = VK_WHOLE_SIZE
     };
     vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_HOST_BIT,
@@ -572,9 +864,13 @@ static void upload_texture_image(PGRAPHState *pg, int texture_idx,
                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     binding->current_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
 
-    vkCmdCopyBufferToImage(cmd, r->storage_buffers[BUFFER_STAGING_SRC].buffer,
-                           binding->image, binding->current_layout,
-                           num_regions, regions);
+    vkCmdCopyBufferToImage(cmd, staging->buffer, binding->image,
+                           binding->current_layout, num_regions, regions);
+
+    if (binding->mipmaps_generated) {
+        generate_texture_mipmaps(r, cmd, binding);
+        binding->current_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    }
 
     pgraph_vk_transition_image_layout(pg, cmd, binding->image, vkf.vk_format,
                                       binding->current_layout,
@@ -584,49 +880,936 @@ static void upload_texture_image(PGRAPHState *pg, int texture_idx,
     nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_4);
     pgraph_vk_end_debug_marker(r, cmd);
     pgraph_vk_end_single_time_commands(pg, cmd);
-
-    // Release decoded texture data
-    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
-        TextureLayer *layer = &layout->layers[layer_idx];
-        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
-            g_free(layer->levels[level_idx].decoded_data);
-        }
-    }
 }
 
-static void copy_zeta_surface_to_texture(PGRAPHState *pg, SurfaceBinding *surface,
-                                       TextureBinding *texture)
+/*
+ * Record the copy of staged texture data into the transfer command buffer
+ * rather than submitting it and waiting for the graphics queue to go idle.
+ * Texture images are shared with the transfer queue family, so no ownership
+ * transfer is needed, and the semaphore the graphics queue waits on makes the
+ * new contents visible to the draws of the frame.
+ */
+static void upload_texture_image_on_transfer_queue(PGRAPHState *pg,
+                                                   TextureBinding *binding,
+                                                   StorageBuffer *staging,
+                                                   VkBufferImageCopy *regions,
+                                                   int num_regions)
 {
-    assert(!surface->color);
-
     PGRAPHVkState *r = pg->vk_renderer_state;
-    TextureShape *state = &texture->key.state;
-    VkColorFormatInfo vkf = kelvin_color_format_vk_map[state->color_format];
-
-    bool use_compute_to_convert_depth_stencil =
-        surface->host_fmt.vk_format == VK_FORMAT_D24_UNORM_S8_UINT ||
-        surface->host_fmt.vk_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    TextureShape *state = &binding->key.state;
 
-    bool compute_needs_finish = use_compute_to_convert_depth_stencil &&
-                                pgraph_vk_compute_needs_finish(r);
-    if (compute_needs_finish) {
-        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    // Frames that may still sample the old contents must complete first
+    if (binding->current_layout != VK_IMAGE_LAYOUT_UNDEFINED &&
+        r->submit_count > 0) {
+        pgraph_vk_wait_for_submit(r, MIN(binding->submit_time,
+                                         r->submit_count - 1));
     }
 
-    nv2a_profile_inc_counter(NV2A_PROF_SURF_TO_TEX);
+    VkCommandBuffer cmd = pgraph_vk_begin_transfer_commands(pg);
 
-    trace_nv2a_pgraph_surface_render_to_texture(
-        surface->vram_addr, surface->width, surface->height);
+    VkImageSubresourceRange subresource_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = VK_REMAINING_MIP_LEVELS,
+        .layerCount = state->cubemap ? 6 : 1,
+    };
 
-    VkCommandBuffer cmd = pgraph_vk_begin_nondraw_commands(pg);
-    pgraph_vk_begin_debug_marker(r, cmd, RGBA_GREEN, __func__);
+    VkBufferMemoryBarrier host_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = staging->buffer,
+        .size = VK_WHOLE_SIZE,
+    };
+    VkImageMemoryBarrier dst_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .oldLayout = binding->current_layout,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = binding->image,
+        .subresourceRange = subresource_range,
+    };
+    vkCmdPipelineBarrier(cmd,
+                         VK_PIPELINE_STAGE_HOST_BIT |
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &host_barrier, 1, &dst_barrier);
+
+    vkCmdCopyBufferToImage(cmd, staging->buffer, binding->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, num_regions,
+                           regions);
+
+    /*
+     * The shader stages that will sample the image do not exist on this
+     * queue, the semaphore wait orders them after the transition.
+     */
+    VkImageMemoryBarrier read_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = binding->image,
+        .subresourceRange = subresource_range,
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0,
+                         NULL, 1, &read_barrier);
 
-    unsigned int scaled_width = surface->width,
-                 scaled_height = surface->height;
-    pgraph_apply_scaling_factor(pg, &scaled_width, &scaled_height);
+    binding->current_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+}
 
-    size_t copied_image_size =
-        scaled_width * scaled_height * surface->host_fmt.host_bytes_per_pixel;
+// FIXME: Make sure we update sampler when data matches. Should we add filtering
+// options to the textureshape?
+static bool check_texture_gpu_decode_supported(PGRAPHState *pg,
+                                               const TextureShape *s)
+{
+    BasicColorFormatInfo f = kelvin_color_format_info_map[s->color_format];
+
+    if (!g_config.display.vulkan.gpu_texture_decode) {
+        return false;
+    }
+
+    // Linear formats need no unswizzling, and YUV conversion stays on CPU
+    if (f.linear || s->border || s->dimensionality != 2) {
+        return false;
+    }
+
+    if (pgraph_is_texture_format_compressed(pg, s->color_format) ||
+        s->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5) {
+        return false;
+    }
+
+    return f.bytes_per_pixel == 1 || f.bytes_per_pixel == 2 ||
+           f.bytes_per_pixel == 4;
+}
+
+static void ensure_texture_index_buffer(PGRAPHState *pg,
+                                        TextureBinding *binding,
+                                        VkDeviceSize size)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (binding->index_buffer != VK_NULL_HANDLE) {
+        assert(binding->index_buffer_size >= size);
+        return;
+    }
+
+    VkBufferCreateInfo buffer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    VmaAllocationCreateInfo alloc_create_info = {
+        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+    };
+    VK_CHECK(vmaCreateBuffer(r->allocator, &buffer_create_info,
+                             &alloc_create_info, &binding->index_buffer,
+                             &binding->index_allocation, NULL));
+    binding->index_buffer_size = size;
+    r->residency.texture_bytes += size;
+}
+
+/*
+ * Copy the swizzled texture data as is and unswizzle it, expanding palette
+ * indices, with a compute shader before copying it to the image.
+ *
+ * Palette indices are kept in a buffer of the binding, so with palette_only
+ * only the palette is uploaded and the texture is expanded again from the
+ * indices of the last upload.
+ */
+static bool upload_texture_image_with_compute(PGRAPHState *pg, int texture_idx,
+                                              TextureBinding *binding,
+                                              bool palette_only)
+{
+    NV2AState *d = container_of(pg, NV2AState, pgraph);
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    TextureShape *state = &binding->key.state;
+    BasicColorFormatInfo f = kelvin_color_format_info_map[state->color_format];
+    VkColorFormatInfo vkf = kelvin_color_format_vk_map[state->color_format];
+
+    const bool palette =
+        state->color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8;
+    const int bytes_per_pixel = f.bytes_per_pixel;
+    const int output_bytes_per_pixel = palette ? 4 : bytes_per_pixel;
+    const int num_layers = state->cubemap ? 6 : 1;
+    const int num_regions = num_layers * state->levels;
+    const VkDeviceSize alignment =
+        MAX(r->device_props.limits.minStorageBufferOffsetAlignment, 4);
+
+    size_t layer_size = 0, decoded_layer_size = 0;
+    {
+        unsigned int width = state->width, height = state->height;
+        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
+            width = MAX(width, 1);
+            height = MAX(height, 1);
+            layer_size += width * height * bytes_per_pixel;
+            decoded_layer_size += ROUND_UP(
+                width * height * output_bytes_per_pixel, 4);
+            width /= 2;
+            height /= 2;
+        }
+    }
+    if (state->cubemap) {
+        layer_size = get_cubemap_layer_size(pg, *state);
+    }
+
+    size_t texture_data_size = num_layers * layer_size;
+    size_t palette_offset = ROUND_UP(texture_data_size, alignment);
+    size_t palette_size = palette ? 256 * 4 : 4;
+    size_t input_size = palette_offset + palette_size;
+    size_t decoded_size = num_layers * decoded_layer_size;
+
+    StorageBuffer *staging = &r->storage_buffers[BUFFER_STAGING_SRC];
+    StorageBuffer *input = &r->storage_buffers[BUFFER_COMPUTE_DST];
+    StorageBuffer *output = &r->storage_buffers[BUFFER_COMPUTE_SRC];
+
+    if (input_size > staging->buffer_size || input_size > input->buffer_size ||
+        decoded_size > output->buffer_size) {
+        return false;
+    }
+
+    assert(!palette_only || binding->index_buffer != VK_NULL_HANDLE);
+    if (palette) {
+        ensure_texture_index_buffer(pg, binding,
+                                    ROUND_UP(texture_data_size, 4));
+    }
+
+    if (pgraph_vk_compute_needs_finish(r)) {
+        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    }
+
+    const hwaddr texture_vram_offset =
+        pgraph_get_texture_phys_addr(pg, texture_idx);
+    size_t texture_palette_data_size;
+    const hwaddr texture_palette_vram_offset =
+        pgraph_get_texture_palette_phys_addr_length(pg, texture_idx,
+                                                    &texture_palette_data_size);
+
+    uint8_t *mapped_memory_ptr;
+    VK_CHECK(vmaMapMemory(r->allocator, staging->allocation,
+                          (void *)&mapped_memory_ptr));
+    if (!palette_only) {
+        memcpy(mapped_memory_ptr, d->vram_ptr + texture_vram_offset,
+               texture_data_size);
+    }
+    if (palette) {
+        memcpy(mapped_memory_ptr + palette_offset,
+               d->vram_ptr + texture_palette_vram_offset, palette_size);
+    }
+    vmaFlushAllocation(r->allocator, staging->allocation, 0, input_size);
+    vmaUnmapMemory(r->allocator, staging->allocation);
+
+    g_autofree TextureDecodeRegion *decode_regions =
+        g_malloc0_n(num_regions, sizeof(TextureDecodeRegion));
+    g_autofree VkBufferImageCopy *copy_regions =
+        g_malloc0_n(num_regions, sizeof(VkBufferImageCopy));
+
+    VkDeviceSize dst_offset = 0;
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        unsigned int width = state->width, height = state->height;
+        VkDeviceSize src_offset = layer_idx * layer_size;
+        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
+            int i = layer_idx * state->levels + level_idx;
+            width = MAX(width, 1);
+            height = MAX(height, 1);
+            decode_regions[i] = (TextureDecodeRegion){
+                .width = width,
+                .height = height,
+                .src_offset = src_offset,
+                .dst_offset = dst_offset,
+            };
+            copy_regions[i] = (VkBufferImageCopy){
+                .bufferOffset = dst_offset,
+                .bufferRowLength = 0, // Tightly packed
+                .bufferImageHeight = 0,
+                .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .imageSubresource.mipLevel = level_idx,
+                .imageSubresource.baseArrayLayer = layer_idx,
+                .imageSubresource.layerCount = 1,
+                .imageOffset = (VkOffset3D){ 0, 0, 0 },
+                .imageExtent = (VkExtent3D){ width, height, 1 },
+            };
+            src_offset += width * height * bytes_per_pixel;
+            dst_offset +=
+                ROUND_UP(width * height * output_bytes_per_pixel, 4);
+            width /= 2;
+            height /= 2;
+        }
+    }
+    assert(dst_offset == decoded_size);
+
+    VkCommandBuffer cmd = pgraph_vk_begin_single_time_commands(pg);
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_GREEN, __func__);
+
+    VkBufferMemoryBarrier host_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_HOST_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = staging->buffer,
+        .size = VK_WHOLE_SIZE
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_HOST_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &host_barrier, 0, NULL);
+
+    // Earlier submissions may still be reading the compute buffers
+    VkBufferMemoryBarrier pre_copy_dst_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = input->buffer,
+        .size = input_size
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &pre_copy_dst_barrier, 0, NULL);
+
+    if (palette) {
+        VkBufferCopy palette_copy_region = {
+            .srcOffset = palette_offset,
+            .dstOffset = palette_offset,
+            .size = palette_size,
+        };
+        vkCmdCopyBuffer(cmd, staging->buffer, input->buffer, 1,
+                        &palette_copy_region);
+    } else {
+        VkBufferCopy buffer_copy_region = {
+            .size = input_size,
+        };
+        vkCmdCopyBuffer(cmd, staging->buffer, input->buffer, 1,
+                        &buffer_copy_region);
+    }
+
+    if (palette && !palette_only) {
+        // The last expansion may still be reading the indices
+        VkBufferMemoryBarrier pre_copy_index_barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = binding->index_buffer,
+            .size = VK_WHOLE_SIZE
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                             &pre_copy_index_barrier, 0, NULL);
+
+        VkBufferCopy index_copy_region = {
+            .size = texture_data_size,
+        };
+        vkCmdCopyBuffer(cmd, staging->buffer, binding->index_buffer, 1,
+                        &index_copy_region);
+
+        VkBufferMemoryBarrier pre_decode_index_barrier = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer = binding->index_buffer,
+            .size = VK_WHOLE_SIZE
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL,
+                             1, &pre_decode_index_barrier, 0, NULL);
+    }
+
+    VkBufferMemoryBarrier pre_decode_src_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = input->buffer,
+        .size = input_size
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 1,
+                         &pre_decode_src_barrier, 0, NULL);
+
+    VkBufferMemoryBarrier pre_decode_dst_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = output->buffer,
+        .size = decoded_size
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 1,
+                         &pre_decode_dst_barrier, 0, NULL);
+
+    VkDescriptorBufferInfo buffers[] = {
+        {
+            .buffer = palette ? binding->index_buffer : input->buffer,
+            .offset = 0,
+            .range = ROUND_UP(texture_data_size, 4),
+        },
+        {
+            .buffer = input->buffer,
+            .offset = palette_offset,
+            .range = palette_size,
+        },
+        {
+            .buffer = output->buffer,
+            .offset = 0,
+            .range = decoded_size,
+        },
+    };
+    pgraph_vk_decode_texture(pg, cmd, bytes_per_pixel, palette, buffers,
+                             decode_regions, num_regions);
+
+    VkBufferMemoryBarrier post_decode_dst_barrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = output->buffer,
+        .size = decoded_size
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 1,
+                         &post_decode_dst_barrier, 0, NULL);
+
+    pgraph_vk_transition_image_layout(pg, cmd, binding->image, vkf.vk_format,
+                                      binding->current_layout,
+                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    binding->current_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+    vkCmdCopyBufferToImage(cmd, output->buffer, binding->image,
+                           binding->current_layout, num_regions, copy_regions);
+
+    pgraph_vk_transition_image_layout(pg, cmd, binding->image, vkf.vk_format,
+                                      binding->current_layout,
+                                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    binding->current_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    nv2a_profile_inc_counter(NV2A_PROF_QUEUE_SUBMIT_4);
+    pgraph_vk_end_debug_marker(r, cmd);
+    pgraph_vk_end_single_time_commands(pg, cmd);
+
+    return true;
+}
+
+static void free_texture_layout(const TextureShape *state,
+                                TextureLayout *layout)
+{
+    const int num_layers = state->cubemap ? 6 : 1;
+
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        TextureLayer *layer = &layout->layers[layer_idx];
+        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
+            g_free(layer->levels[level_idx].decoded_data);
+        }
+    }
+    g_free(layout);
+}
+
+/*
+ * Upload the decoded levels of a layout to the texture image. Levels without
+ * data are left untouched.
+ */
+static void upload_texture_layout(PGRAPHState *pg, TextureBinding *binding,
+                                  TextureLayout *layout,
+                                  const uint32_t *level_masks)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    TextureShape *state = &binding->key.state;
+    const int num_layers = state->cubemap ? 6 : 1;
+
+    // Calculate decoded texture data size
+    size_t texture_data_size = 0;
+    int num_regions = 0;
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        TextureLayer *layer = &layout->layers[layer_idx];
+        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
+            size_t size = layer->levels[level_idx].decoded_size;
+            assert(size || !is_level_wanted(level_masks, layer_idx, level_idx));
+            texture_data_size += size;
+            num_regions += size ? 1 : 0;
+        }
+    }
+    assert(num_regions > 0);
+
+    // Blits need the graphics queue
+    bool use_transfer_queue = r->transfer_queue != VK_NULL_HANDLE &&
+                              !binding->mipmaps_generated;
+    StorageBuffer *staging =
+        &r->storage_buffers[use_transfer_queue ? BUFFER_TRANSFER_STAGING :
+                                                 BUFFER_STAGING_SRC];
+
+    // Copy texture data to mapped device buffer
+    uint8_t *mapped_memory_ptr;
+    VkDeviceSize buffer_offset = 0;
+
+    if (use_transfer_queue) {
+        pgraph_vk_ensure_buffer_space(pg, BUFFER_TRANSFER_STAGING,
+                                      texture_data_size, 16);
+        buffer_offset = pgraph_vk_allocate_buffer_space(
+            pg, BUFFER_TRANSFER_STAGING, texture_data_size, 16);
+        mapped_memory_ptr = staging->mapped;
+    } else {
+        assert(texture_data_size <= staging->buffer_size);
+        VK_CHECK(vmaMapMemory(r->allocator, staging->allocation,
+                              (void *)&mapped_memory_ptr));
+    }
+    VkDeviceSize base_offset = buffer_offset;
+
+    g_autofree VkBufferImageCopy *regions =
+        g_malloc0_n(num_regions, sizeof(VkBufferImageCopy));
+
+    VkBufferImageCopy *region = regions;
+
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        TextureLayer *layer = &layout->layers[layer_idx];
+        NV2A_VK_DPRINTF("Layer %d", layer_idx);
+        for (int level_idx = 0; level_idx < state->levels; level_idx++) {
+            TextureLevel *level = &layer->levels[level_idx];
+            if (!level->decoded_size) {
+                continue;
+            }
+            NV2A_VK_DPRINTF(" - Level %d, w=%d h=%d d=%d @ %08" HWADDR_PRIx,
+                            level_idx, level->width, level->height,
+                            level->depth, buffer_offset);
+            memcpy(mapped_memory_ptr + buffer_offset, level->decoded_data,
+                   level->decoded_size);
+            *region = (VkBufferImageCopy){
+                .bufferOffset = buffer_offset,
+                .bufferRowLength = 0, // Tightly packed
+                .bufferImageHeight = 0,
+                .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .imageSubresource.mipLevel = level_idx,
+                .imageSubresource.baseArrayLayer = layer_idx,
+                .imageSubresource.layerCount = 1,
+                .imageOffset = (VkOffset3D){ 0, 0, 0 },
+                .imageExtent =
+                    (VkExtent3D){ level->width, level->height, level->depth },
+            };
+            buffer_offset += level->decoded_size;
+            region++;
+        }
+    }
+    assert(buffer_offset <= staging->buffer_size);
+
+    if (use_transfer_queue) {
+        vmaFlushAllocation(r->allocator, staging->allocation, base_offset,
+                           texture_data_size);
+        upload_texture_image_on_transfer_queue(pg, binding, staging, regions,
+                                               num_regions);
+    } else {
+        vmaFlushAllocation(r->allocator, staging->allocation, 0,
+                           VK_WHOLE_SIZE);
+        vmaUnmapMemory(r->allocator, staging->allocation);
+        upload_texture_image_on_graphics_queue(pg, binding, staging, regions,
+                                               num_regions);
+    }
+}
+
+/*
+ * Upload the levels of each layer in level_masks to the texture image, or all
+ * of them if level_masks is NULL.
+ */
+static void upload_texture_image(PGRAPHState *pg, int texture_idx,
+                                 TextureBinding *binding,
+                                 const uint32_t *level_masks)
+{
+    TextureShape *state = &binding->key.state;
+
+    // Only the first level is uploaded, the others are generated from it
+    uint32_t base_level_masks[6] = { 0 };
+    if (binding->mipmaps_generated) {
+        bool base_level_wanted = false;
+        for (int layer_idx = 0; layer_idx < (state->cubemap ? 6 : 1);
+             layer_idx++) {
+            if (is_level_wanted(level_masks, layer_idx, 0)) {
+                base_level_masks[layer_idx] = 1;
+                base_level_wanted = true;
+            }
+        }
+        if (!base_level_wanted) {
+            return;
+        }
+        level_masks = base_level_masks;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
+
+    if (check_texture_gpu_decode_supported(pg, state) &&
+        upload_texture_image_with_compute(pg, texture_idx, binding, false)) {
+        return;
+    }
+
+    TextureLayout *layout = get_texture_layout(pg, texture_idx, level_masks);
+    upload_texture_layout(pg, binding, layout, level_masks);
+    free_texture_layout(state, layout);
+}
+
+/*
+ * Decoded textures are kept on disk, one file per texture content and shape,
+ * so textures loaded again on later boots can be uploaded straight from a
+ * mapping of the file instead of being unswizzled, converted or decompressed.
+ * Only textures seen for the first time are stored; bindings that are updated
+ * in place are likely to be dynamic and are not worth keeping. Bump the
+ * version when decoding changes without the key changing.
+ */
+#define TEXTURE_CACHE_FILE_MAGIC "XVKTEX"
+#define TEXTURE_CACHE_FILE_VERSION 1
+#define TEXTURE_CACHE_MIN_TEXTURE_LENGTH (16 * KiB)
+
+typedef struct TextureDiskCacheKey {
+    TextureShape state;
+    VkFormat format;
+    uint64_t texture_length;
+    uint64_t content_hash;
+} TextureDiskCacheKey;
+
+typedef struct TextureCacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    char xemu_version[64];
+    TextureDiskCacheKey key;
+} TextureCacheFileHeader;
+
+/* Followed by the data of each level, in the same order */
+typedef struct TextureCacheFileLevel {
+    uint32_t width, height, depth;
+    uint32_t size;
+} TextureCacheFileLevel;
+
+static char *get_texture_cache_dir(void)
+{
+    return g_build_filename(xemu_settings_get_cache_path(), "vk_textures",
+                            NULL);
+}
+
+static char *get_texture_cache_path(const TextureDiskCacheKey *key)
+{
+    uint64_t hash = fast_hash((void *)key, sizeof(*key));
+    g_autofree char *dir = get_texture_cache_dir();
+    g_autofree char *name = g_strdup_printf("%016" PRIx64 ".tex", hash);
+    return g_build_filename(dir, name, NULL);
+}
+
+static void init_texture_disk_cache_key(PGRAPHState *pg,
+                                        TextureBinding *binding,
+                                        TextureDiskCacheKey *key)
+{
+    NV2AState *d = container_of(pg, NV2AState, pgraph);
+
+    memset(key, 0, sizeof(*key));
+    key->state = binding->key.state;
+    key->format = get_texture_vk_format(pg, &binding->key.state);
+    key->texture_length = binding->key.texture_length;
+    key->content_hash = fast_hash(d->vram_ptr +
+                                      binding->key.texture_vram_offset,
+                                  binding->key.texture_length);
+    if (binding->key.palette_length) {
+        key->content_hash ^= binding->palette_hash;
+    }
+}
+
+static void init_texture_cache_file_header(const TextureDiskCacheKey *key,
+                                           TextureCacheFileHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TEXTURE_CACHE_FILE_MAGIC,
+           sizeof(TEXTURE_CACHE_FILE_MAGIC));
+    header->version = TEXTURE_CACHE_FILE_VERSION;
+    header->key_size = sizeof(TextureDiskCacheKey);
+    g_strlcpy(header->xemu_version, xemu_version,
+              sizeof(header->xemu_version));
+    memcpy(&header->key, key, sizeof(*key));
+}
+
+/*
+ * Fill a layout with levels pointing into the mapped cache file for a key.
+ * The mapping must be kept until the layout has been uploaded.
+ */
+static GMappedFile *load_texture_from_disk(const TextureDiskCacheKey *key,
+                                           TextureLayout *layout)
+{
+    g_autofree char *path = get_texture_cache_path(key);
+    GMappedFile *file = g_mapped_file_new(path, false, NULL);
+    if (!file) {
+        return NULL;
+    }
+
+    const int num_layers = key->state.cubemap ? 6 : 1;
+    const size_t num_levels = num_layers * key->state.levels;
+    size_t length = g_mapped_file_get_length(file);
+    uint8_t *contents = (uint8_t *)g_mapped_file_get_contents(file);
+
+    /* The full key is stored to catch hash collisions */
+    TextureCacheFileHeader expected;
+    init_texture_cache_file_header(key, &expected);
+    size_t data_offset =
+        sizeof(expected) + num_levels * sizeof(TextureCacheFileLevel);
+    if (length < data_offset ||
+        memcmp(contents, &expected, sizeof(expected))) {
+        goto invalid;
+    }
+
+    const TextureCacheFileLevel *levels =
+        (const TextureCacheFileLevel *)(contents + sizeof(expected));
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        for (int level_idx = 0; level_idx < key->state.levels; level_idx++) {
+            const TextureCacheFileLevel *src = levels++;
+            if (!src->size || src->size > length - data_offset) {
+                goto invalid;
+            }
+            layout->layers[layer_idx].levels[level_idx] = (TextureLevel){
+                .width = src->width,
+                .height = src->height,
+                .depth = src->depth,
+                .decoded_data = contents + data_offset,
+                .decoded_size = src->size,
+            };
+            data_offset += src->size;
+        }
+    }
+    if (data_offset != length) {
+        goto invalid;
+    }
+
+    return file;
+
+invalid:
+    g_mapped_file_unref(file);
+    qemu_unlink(path);
+    return NULL;
+}
+
+static void save_texture_to_disk(const TextureDiskCacheKey *key,
+                                 const TextureLayout *layout)
+{
+    const int num_layers = key->state.cubemap ? 6 : 1;
+    const size_t num_levels = num_layers * key->state.levels;
+
+    size_t length = sizeof(TextureCacheFileHeader) +
+                    num_levels * sizeof(TextureCacheFileLevel);
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        for (int level_idx = 0; level_idx < key->state.levels; level_idx++) {
+            length += layout->layers[layer_idx].levels[level_idx].decoded_size;
+        }
+    }
+
+    g_autofree uint8_t *contents = g_malloc(length);
+    init_texture_cache_file_header(key, (TextureCacheFileHeader *)contents);
+    TextureCacheFileLevel *dst_level =
+        (TextureCacheFileLevel *)(contents + sizeof(TextureCacheFileHeader));
+    uint8_t *dst_data = (uint8_t *)(dst_level + num_levels);
+
+    for (int layer_idx = 0; layer_idx < num_layers; layer_idx++) {
+        for (int level_idx = 0; level_idx < key->state.levels; level_idx++) {
+            const TextureLevel *level =
+                &layout->layers[layer_idx].levels[level_idx];
+            *dst_level++ = (TextureCacheFileLevel){
+                .width = level->width,
+                .height = level->height,
+                .depth = level->depth,
+                .size = level->decoded_size,
+            };
+            memcpy(dst_data, level->decoded_data, level->decoded_size);
+            dst_data += level->decoded_size;
+        }
+    }
+
+    g_autofree char *path = get_texture_cache_path(key);
+    g_autoptr(GError) err = NULL;
+    if (!g_file_set_contents(path, (gchar *)contents, length, &err)) {
+        fprintf(stderr, "nv2a: Failed to write texture cache: %s\n",
+                err->message);
+    }
+}
+
+/*
+ * Upload all levels of a newly created binding, going through the disk cache
+ * when it is enabled and the texture would be decoded on the CPU.
+ */
+static void upload_new_texture_image(PGRAPHState *pg, int texture_idx,
+                                     TextureBinding *binding)
+{
+    TextureShape *state = &binding->key.state;
+
+    if (!g_config.perf.cache_textures ||
+        binding->key.texture_length < TEXTURE_CACHE_MIN_TEXTURE_LENGTH ||
+        binding->mipmaps_generated ||
+        check_texture_gpu_decode_supported(pg, state)) {
+        upload_texture_image(pg, texture_idx, binding, NULL);
+        return;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
+
+    TextureDiskCacheKey key;
+    init_texture_disk_cache_key(pg, binding, &key);
+
+    g_autofree TextureLayout *cached_layout = g_malloc0(sizeof(TextureLayout));
+    GMappedFile *file = load_texture_from_disk(&key, cached_layout);
+    if (file) {
+        upload_texture_layout(pg, binding, cached_layout, NULL);
+        g_mapped_file_unref(file);
+        return;
+    }
+
+    TextureLayout *layout = get_texture_layout(pg, texture_idx, NULL);
+    upload_texture_layout(pg, binding, layout, NULL);
+    save_texture_to_disk(&key, layout);
+    free_texture_layout(state, layout);
+}
+
+static uint64_t hash_texture_page(NV2AState *d, TextureBinding *binding,
+                                  unsigned int page)
+{
+    hwaddr start = MAX(get_texture_page_base(&binding->key) +
+                           ((hwaddr)page << TARGET_PAGE_BITS),
+                       binding->key.texture_vram_offset);
+    hwaddr end = MIN(TARGET_PAGE_ALIGN(start + 1),
+                     binding->key.texture_vram_offset +
+                         binding->key.texture_length);
+
+    return fast_hash(d->vram_ptr + start, end - start);
+}
+
+/*
+ * Hash all of the texture data of a binding, so that later changes can be
+ * found by rehashing only the pages written to.
+ */
+static void hash_texture_pages(NV2AState *d, TextureBinding *binding)
+{
+    g_free(binding->dirty_pages);
+    g_free(binding->page_hashes);
+
+    binding->num_pages = get_texture_num_pages(&binding->key);
+    binding->dirty_pages = bitmap_new(binding->num_pages);
+    binding->page_hashes = g_malloc_n(binding->num_pages, sizeof(uint64_t));
+    for (unsigned int page = 0; page < binding->num_pages; page++) {
+        binding->page_hashes[page] = hash_texture_page(d, binding, page);
+    }
+
+    if (binding->key.palette_length) {
+        binding->palette_hash =
+            fast_hash(d->vram_ptr + binding->key.palette_vram_offset,
+                      binding->key.palette_length);
+    }
+    binding->possibly_dirty = false;
+}
+
+/*
+ * Rehash the pages of a binding that were written to, and upload the levels
+ * containing the ones that changed.
+ */
+static void update_texture_image(PGRAPHState *pg, int texture_idx,
+                                 TextureBinding *binding)
+{
+    NV2AState *d = container_of(pg, NV2AState, pgraph);
+
+    if (!binding->page_hashes) {
+        // Previously copied from a surface
+        hash_texture_pages(d, binding);
+        upload_texture_image(pg, texture_idx, binding, NULL);
+        return;
+    }
+
+    bool palette_changed = false;
+    if (binding->possibly_dirty) {
+        binding->possibly_dirty = false;
+        uint64_t palette_hash =
+            fast_hash(d->vram_ptr + binding->key.palette_vram_offset,
+                      binding->key.palette_length);
+        palette_changed = palette_hash != binding->palette_hash;
+        binding->palette_hash = palette_hash;
+    }
+
+    uint32_t level_masks[6] = { 0 };
+    bool changed = false;
+    hwaddr page_base = get_texture_page_base(&binding->key);
+
+    for (unsigned long page = find_first_bit(binding->dirty_pages,
+                                             binding->num_pages);
+         page < binding->num_pages;
+         page = find_next_bit(binding->dirty_pages, binding->num_pages,
+                              page + 1)) {
+        clear_bit(page, binding->dirty_pages);
+
+        uint64_t page_hash = hash_texture_page(d, binding, page);
+        if (page_hash == binding->page_hashes[page]) {
+            continue;
+        }
+        binding->page_hashes[page] = page_hash;
+        changed = true;
+
+        hwaddr start = page_base + (page << TARGET_PAGE_BITS);
+        hwaddr offset = binding->key.texture_vram_offset;
+        get_levels_in_range(pg, &binding->key.state,
+                            MAX(start, offset) - offset,
+                            start + TARGET_PAGE_SIZE - offset, level_masks);
+    }
+
+    if (palette_changed && !changed &&
+        binding->index_buffer != VK_NULL_HANDLE &&
+        check_texture_gpu_decode_supported(pg, &binding->key.state) &&
+        upload_texture_image_with_compute(pg, texture_idx, binding, true)) {
+        // Only the palette was uploaded
+        nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
+    } else if (palette_changed) {
+        upload_texture_image(pg, texture_idx, binding, NULL);
+    } else if (changed) {
+        upload_texture_image(pg, texture_idx, binding, level_masks);
+    }
+}
+
+static void copy_zeta_surface_to_texture(PGRAPHState *pg, SurfaceBinding *surface,
+                                       TextureBinding *texture)
+{
+    assert(!surface->color);
+
+    PGRAPHVkState *r = pg->vk_renderer_state;
+    TextureShape *state = &texture->key.state;
+    VkColorFormatInfo vkf = kelvin_color_format_vk_map[state->color_format];
+
+    bool use_compute_to_convert_depth_stencil =
+        surface->host_fmt.vk_format == VK_FORMAT_D24_UNORM_S8_UINT ||
+        surface->host_fmt.vk_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+
+    bool compute_needs_finish = use_compute_to_convert_depth_stencil &&
+                                pgraph_vk_compute_needs_finish(r);
+    if (compute_needs_finish) {
+        pgraph_vk_finish(pg, VK_FINISH_REASON_NEED_BUFFER_SPACE);
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_SURF_TO_TEX);
+
+    trace_nv2a_pgraph_surface_render_to_texture(
+        surface->vram_addr, surface->width, surface->height);
+
+    VkCommandBuffer cmd = pgraph_vk_begin_nondraw_commands(pg);
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_GREEN, __func__);
+
+    unsigned int scaled_width = surface->width,
+                 scaled_height = surface->height;
+    pgraph_vk_apply_surface_scale_factor(surface, &scaled_width,
+                                         &scaled_height);
+
+    size_t copied_image_size =
+        scaled_width * scaled_height * surface->host_fmt.host_bytes_per_pixel;
     size_t stencil_buffer_offset = 0;
     size_t stencil_buffer_size = 0;
 
@@ -786,134 +1969,465 @@ static void copy_zeta_surface_to_texture(PGRAPHState *pg, SurfaceBinding *surfac
     texture->draw_time = surface->draw_time;
 }
 
+/*
+ * Surface to texture copies are queued while the texture stages are bound and
+ * recorded together afterwards, so a draw sourcing several render targets
+ * ends the render pass once and the layout transitions of all the color
+ * copies are issued as one barrier on either side of the copies.
+ */
+static void queue_surface_to_texture_copy(PGRAPHVkState *r,
+                                          SurfaceBinding *surface,
+                                          TextureBinding *texture)
+{
+    for (int i = 0; i < r->num_pending_surface_copies; i++) {
+        if (r->pending_surface_copies[i].texture == texture) {
+            // Same texture bound to several stages
+            assert(r->pending_surface_copies[i].surface == surface);
+            return;
+        }
+    }
+
+    assert(r->num_pending_surface_copies <
+           ARRAY_SIZE(r->pending_surface_copies));
+    r->pending_surface_copies[r->num_pending_surface_copies++] =
+        (SurfaceToTextureCopy){ .surface = surface, .texture = texture };
+}
+
 // FIXME: Should be able to skip the copy and sample the original surface image
-static void copy_surface_to_texture(PGRAPHState *pg, SurfaceBinding *surface,
-                                    TextureBinding *texture)
+static void copy_color_surfaces_to_textures(PGRAPHState *pg,
+                                            SurfaceToTextureCopy *copies,
+                                            int num_copies)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    VkImageMemoryBarrier pre_barriers[2 * NV2A_MAX_TEXTURES],
+        post_barriers[2 * NV2A_MAX_TEXTURES];
+    VkPipelineStageFlags pre_src_stages = 0, pre_dst_stages = 0,
+                         post_src_stages = 0, post_dst_stages = 0;
+    int num_barriers = 0;
+
+    for (int i = 0; i < num_copies; i++) {
+        SurfaceBinding *surface = copies[i].surface;
+        TextureBinding *texture = copies[i].texture;
+        VkFormat texture_format =
+            kelvin_color_format_vk_map[texture->key.state.color_format]
+                .vk_format;
+        VkPipelineStageFlags src_stage, dst_stage;
+
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_TO_TEX);
+        trace_nv2a_pgraph_surface_render_to_texture(
+            surface->vram_addr, surface->width, surface->height);
+
+        // The same surface may be the source of several textures
+        bool surface_seen = false;
+        for (int j = 0; j < i; j++) {
+            if (copies[j].surface == surface) {
+                surface_seen = true;
+                break;
+            }
+        }
+
+        if (!surface_seen) {
+            pgraph_vk_init_image_layout_barrier(
+                surface->image, surface->host_fmt.vk_format,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                &pre_barriers[num_barriers], &src_stage, &dst_stage);
+            pre_src_stages |= src_stage;
+            pre_dst_stages |= dst_stage;
+
+            pgraph_vk_init_image_layout_barrier(
+                surface->image, surface->host_fmt.vk_format,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                &post_barriers[num_barriers], &src_stage, &dst_stage);
+            post_src_stages |= src_stage;
+            post_dst_stages |= dst_stage;
+            num_barriers++;
+        }
+
+        pgraph_vk_init_image_layout_barrier(
+            texture->image, texture_format, texture->current_layout,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &pre_barriers[num_barriers],
+            &src_stage, &dst_stage);
+        pre_src_stages |= src_stage;
+        pre_dst_stages |= dst_stage;
+
+        pgraph_vk_init_image_layout_barrier(
+            texture->image, texture_format,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            &post_barriers[num_barriers], &src_stage, &dst_stage);
+        post_src_stages |= src_stage;
+        post_dst_stages |= dst_stage;
+        num_barriers++;
+    }
+
+    VkCommandBuffer cmd = pgraph_vk_begin_nondraw_commands(pg);
+    pgraph_vk_begin_debug_marker(r, cmd, RGBA_GREEN, __func__);
+
+    vkCmdPipelineBarrier(cmd, pre_src_stages, pre_dst_stages, 0, 0, NULL, 0,
+                         NULL, num_barriers, pre_barriers);
+
+    pgraph_vk_begin_gpu_timer(r, cmd, NV2A_PROF_GPU_BLIT);
+    for (int i = 0; i < num_copies; i++) {
+        SurfaceBinding *surface = copies[i].surface;
+        TextureBinding *texture = copies[i].texture;
+
+        VkImageCopy region = {
+            .srcSubresource.aspectMask = surface->host_fmt.aspect,
+            .srcSubresource.layerCount = 1,
+            .dstSubresource.aspectMask = surface->host_fmt.aspect,
+            .dstSubresource.layerCount = 1,
+            .extent.width = surface->width,
+            .extent.height = surface->height,
+            .extent.depth = 1,
+        };
+        pgraph_vk_apply_surface_scale_factor(surface, &region.extent.width,
+                                             &region.extent.height);
+        vkCmdCopyImage(cmd, surface->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, texture->image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    }
+    pgraph_vk_end_gpu_timer(r, cmd);
+
+    vkCmdPipelineBarrier(cmd, post_src_stages, post_dst_stages, 0, 0, NULL,
+                         0, NULL, num_barriers, post_barriers);
+
+    pgraph_vk_end_debug_marker(r, cmd);
+    pgraph_vk_end_nondraw_commands(pg, cmd);
+
+    for (int i = 0; i < num_copies; i++) {
+        copies[i].texture->current_layout =
+            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        copies[i].texture->draw_time = copies[i].surface->draw_time;
+    }
+}
+
+static void copy_pending_surfaces_to_textures(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    SurfaceToTextureCopy color_copies[NV2A_MAX_TEXTURES];
+    int num_color_copies = 0;
+
+    for (int i = 0; i < r->num_pending_surface_copies; i++) {
+        SurfaceToTextureCopy *copy = &r->pending_surface_copies[i];
+        if (copy->surface->color) {
+            color_copies[num_color_copies++] = *copy;
+        } else {
+            copy_zeta_surface_to_texture(pg, copy->surface, copy->texture);
+        }
+    }
+    r->num_pending_surface_copies = 0;
+
+    if (num_color_copies > 0) {
+        copy_color_surfaces_to_textures(pg, color_copies, num_color_copies);
+    }
+}
+
+static bool check_surface_to_texture_compatiblity(const SurfaceBinding *surface,
+                                                  const TextureShape *shape)
 {
+    // FIXME: Better checks/handling on formats and surface-texture compat
+
+    if ((!surface->swizzle && surface->pitch != shape->pitch) ||
+        surface->width != shape->width ||
+        surface->height != shape->height) {
+        return false;
+    }
+
+    int surface_fmt = surface->shape.color_format;
+    int texture_fmt = shape->color_format;
+
     if (!surface->color) {
-        copy_zeta_surface_to_texture(pg, surface, texture);
-        return;
+        if (surface->shape.zeta_format == NV097_SET_SURFACE_FORMAT_ZETA_Z24S8) {
+            return true;
+        }
+        return false;
+    }
+
+    if (shape->cubemap) {
+        // FIXME: Support rendering surface to cubemap face
+        return false;
+    }
+
+    if (shape->levels > 1) {
+        // FIXME: Support rendering surface to mip levels
+        return false;
+    }
+
+    switch (surface_fmt) {
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_Z1R5G5B5: switch (texture_fmt) {
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5: return true;
+        default: break;
+        }
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5: switch (texture_fmt) {
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5: return true;
+        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5: return true;
+        default: break;
+        }
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8: switch(texture_fmt) {
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8: return true;
+        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8: return true;
+        default: break;
+        }
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8: switch (texture_fmt) {
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8B8G8R8: return true;
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R8G8B8A8: return true;
+        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8: return true;
+        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8: return true;
+        default: break;
+        }
+        break;
+    default:
+        break;
     }
 
+    trace_nv2a_pgraph_surface_texture_compat_failed(
+        surface_fmt, texture_fmt);
+    return false;
+}
+
+static bool is_linear_filter_supported_for_format(PGRAPHVkState *r,
+                                                  int kelvin_format)
+{
+    return r->texture_format_properties[kelvin_format].optimalTilingFeatures &
+           VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+}
+
+static void init_sampler_key(PGRAPHState *pg, const TextureShape *state,
+                             uint32_t filter, uint32_t address,
+                             uint32_t border_color_pack32,
+                             uint32_t max_anisotropy, SamplerKey *key)
+{
     PGRAPHVkState *r = pg->vk_renderer_state;
-    TextureShape *state = &texture->key.state;
+    BasicColorFormatInfo f_basic =
+        kelvin_color_format_info_map[state->color_format];
     VkColorFormatInfo vkf = kelvin_color_format_vk_map[state->color_format];
 
-    nv2a_profile_inc_counter(NV2A_PROF_SURF_TO_TEX);
+    memset(key, 0, sizeof(*key));
+
+    bool is_integer_type = vkf.vk_format == VK_FORMAT_R32_UINT;
+
+    if (r->custom_border_color_extension_enabled) {
+        key->border_color = is_integer_type ?
+                                VK_BORDER_COLOR_INT_CUSTOM_EXT :
+                                VK_BORDER_COLOR_FLOAT_CUSTOM_EXT;
+        key->custom_border_color_format = get_texture_vk_format(pg, state);
+        if (is_integer_type) {
+            float rgba[4];
+            pgraph_argb_pack32_to_rgba_float(border_color_pack32, rgba);
+            for (int i = 0; i < 4; i++) {
+                key->custom_border_color.uint32[i] =
+                    (uint32_t)((double)rgba[i] * (double)0xffffffff);
+            }
+        } else {
+            pgraph_argb_pack32_to_rgba_float(
+                border_color_pack32, key->custom_border_color.float32);
+        }
+    } else {
+        // FIXME: Handle custom color in shader
+        if (is_integer_type) {
+            key->border_color = VK_BORDER_COLOR_INT_TRANSPARENT_BLACK;
+        } else if (border_color_pack32 == 0x00000000) {
+            key->border_color = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+        } else if (border_color_pack32 == 0xff000000) {
+            key->border_color = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
+        } else {
+            key->border_color = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+        }
+    }
+
+    if (filter & NV_PGRAPH_TEXFILTER0_ASIGNED)
+        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_ASIGNED");
+    if (filter & NV_PGRAPH_TEXFILTER0_RSIGNED)
+        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_RSIGNED");
+    if (filter & NV_PGRAPH_TEXFILTER0_GSIGNED)
+        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_GSIGNED");
+    if (filter & NV_PGRAPH_TEXFILTER0_BSIGNED)
+        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_BSIGNED");
+
+    unsigned int mag_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MAG);
+    assert(mag_filter < ARRAY_SIZE(pgraph_texture_mag_filter_vk_map));
+
+    unsigned int min_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIN);
+    assert(min_filter < ARRAY_SIZE(pgraph_texture_min_filter_vk_map));
+
+    if (is_linear_filter_supported_for_format(r, state->color_format)) {
+        key->mag_filter = pgraph_texture_min_filter_vk_map[mag_filter];
+        key->min_filter = pgraph_texture_min_filter_vk_map[min_filter];
+    } else {
+        key->mag_filter = key->min_filter = VK_FILTER_NEAREST;
+    }
+
+    bool mipmap_en =
+        !f_basic.linear &&
+        !(min_filter == NV_PGRAPH_TEXFILTER0_MIN_BOX_LOD0 ||
+          min_filter == NV_PGRAPH_TEXFILTER0_MIN_TENT_LOD0 ||
+          min_filter == NV_PGRAPH_TEXFILTER0_MIN_CONVOLUTION_2D_LOD0);
+
+    bool mipmap_nearest =
+        f_basic.linear || state->levels == 1 ||
+        min_filter == NV_PGRAPH_TEXFILTER0_MIN_BOX_NEARESTLOD ||
+        min_filter == NV_PGRAPH_TEXFILTER0_MIN_TENT_NEARESTLOD;
+
+    float lod_bias = pgraph_convert_lod_bias_to_float(
+        GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIPMAP_LOD_BIAS));
+    if (lod_bias > r->device_props.limits.maxSamplerLodBias) {
+        lod_bias = r->device_props.limits.maxSamplerLodBias;
+    } else if (lod_bias < -r->device_props.limits.maxSamplerLodBias) {
+        lod_bias = -r->device_props.limits.maxSamplerLodBias;
+    }
 
-    trace_nv2a_pgraph_surface_render_to_texture(
-        surface->vram_addr, surface->width, surface->height);
+    key->address_mode_u = lookup_texture_address_mode(
+        GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRU));
+    key->address_mode_v = lookup_texture_address_mode(
+        GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRV));
+    key->address_mode_w = (state->dimensionality > 2) ?
+                              lookup_texture_address_mode(GET_MASK(
+                                  address, NV_PGRAPH_TEXADDRESS0_ADDRP)) :
+                              0;
+    key->mipmap_mode = mipmap_nearest ? VK_SAMPLER_MIPMAP_MODE_NEAREST :
+                                        VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    key->min_lod =
+        mipmap_en ? MIN(state->min_mipmap_level, state->levels - 1) : 0.0;
+    key->max_lod =
+        mipmap_en ? MIN(state->max_mipmap_level, state->levels - 1) : 0.0;
+    key->lod_bias = lod_bias;
+
+    key->max_anisotropy =
+        r->enabled_physical_device_features.samplerAnisotropy ?
+            MAX(MIN(r->device_props.limits.maxSamplerAnisotropy,
+                    max_anisotropy),
+                1) :
+            1;
+}
 
-    VkCommandBuffer cmd = pgraph_vk_begin_nondraw_commands(pg);
-    pgraph_vk_begin_debug_marker(r, cmd, RGBA_GREEN, __func__);
+/*
+ * Samplers are cached by their parameters and shared by every texture
+ * sampled the same way, independently of texture data.
+ */
+static SamplerBinding *get_sampler(PGRAPHVkState *r, const SamplerKey *key)
+{
+    uint64_t key_hash = fast_hash((void *)key, sizeof(*key));
+    LruNode *node = lru_lookup(&r->sampler_cache, key_hash, key);
+    return container_of(node, SamplerBinding, node);
+}
 
-    pgraph_vk_transition_image_layout(
-        pg, cmd, surface->image, surface->host_fmt.vk_format,
-        surface->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
-                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+static void sampler_cache_entry_init(Lru *lru, LruNode *node, const void *key)
+{
+    PGRAPHVkState *r = container_of(lru, PGRAPHVkState, sampler_cache);
+    SamplerBinding *snode = container_of(node, SamplerBinding, node);
 
-    pgraph_vk_transition_image_layout(pg, cmd, texture->image, vkf.vk_format,
-                                      texture->current_layout,
-                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    texture->current_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    memcpy(&snode->key, key, sizeof(SamplerKey));
+    snode->num_textures = 0;
+    snode->submit_time = 0;
 
-    VkImageCopy region = {
-        .srcSubresource.aspectMask = surface->host_fmt.aspect,
-        .srcSubresource.layerCount = 1,
-        .dstSubresource.aspectMask = surface->host_fmt.aspect,
-        .dstSubresource.layerCount = 1,
-        .extent.width = surface->width,
-        .extent.height = surface->height,
-        .extent.depth = 1,
+    VkSamplerCustomBorderColorCreateInfoEXT custom_border_color_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CUSTOM_BORDER_COLOR_CREATE_INFO_EXT,
+        .customBorderColor = snode->key.custom_border_color,
+        .format = snode->key.custom_border_color_format,
     };
-    pgraph_apply_scaling_factor(pg, &region.extent.width,
-                                &region.extent.height);
-    vkCmdCopyImage(cmd, surface->image,
-                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, texture->image,
-                   texture->current_layout, 1, &region);
-
-    pgraph_vk_transition_image_layout(
-        pg, cmd, surface->image, surface->host_fmt.vk_format,
-        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        surface->color ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
-                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
-
-    pgraph_vk_transition_image_layout(pg, cmd, texture->image, vkf.vk_format,
-                                      texture->current_layout,
-                                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    texture->current_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    bool custom_border_color =
+        snode->key.border_color == VK_BORDER_COLOR_INT_CUSTOM_EXT ||
+        snode->key.border_color == VK_BORDER_COLOR_FLOAT_CUSTOM_EXT;
 
-    pgraph_vk_end_debug_marker(r, cmd);
-    pgraph_vk_end_nondraw_commands(pg, cmd);
+    VkSamplerCreateInfo sampler_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = snode->key.mag_filter,
+        .minFilter = snode->key.min_filter,
+        .addressModeU = snode->key.address_mode_u,
+        .addressModeV = snode->key.address_mode_v,
+        .addressModeW = snode->key.address_mode_w,
+        .anisotropyEnable = snode->key.max_anisotropy > 1,
+        .maxAnisotropy = snode->key.max_anisotropy,
+        .borderColor = snode->key.border_color,
+        .compareEnable = VK_FALSE,
+        .compareOp = VK_COMPARE_OP_ALWAYS,
+        .mipmapMode = snode->key.mipmap_mode,
+        .minLod = snode->key.min_lod,
+        .maxLod = snode->key.max_lod,
+        .mipLodBias = snode->key.lod_bias,
+        .pNext = custom_border_color ? &custom_border_color_create_info : NULL,
+    };
 
-    texture->draw_time = surface->draw_time;
+    VK_CHECK(vkCreateSampler(r->device, &sampler_create_info, NULL,
+                             &snode->sampler));
 }
 
-static bool check_surface_to_texture_compatiblity(const SurfaceBinding *surface,
-                                                  const TextureShape *shape)
+static bool sampler_cache_entry_pre_evict(Lru *lru, LruNode *node)
 {
-    // FIXME: Better checks/handling on formats and surface-texture compat
+    PGRAPHVkState *r = container_of(lru, PGRAPHVkState, sampler_cache);
+    SamplerBinding *snode = container_of(node, SamplerBinding, node);
 
-    if ((!surface->swizzle && surface->pitch != shape->pitch) ||
-        surface->width != shape->width ||
-        surface->height != shape->height) {
+    if (snode->num_textures) {
         return false;
     }
 
-    int surface_fmt = surface->shape.color_format;
-    int texture_fmt = shape->color_format;
-
-    if (!surface->color) {
-        if (surface->shape.zeta_format == NV097_SET_SURFACE_FORMAT_ZETA_Z24S8) {
-            return true;
+    // Currently bound
+    for (int i = 0; i < ARRAY_SIZE(r->texture_samplers); i++) {
+        if (r->texture_samplers[i] == snode) {
+            return false;
         }
-        return false;
     }
 
-    if (shape->cubemap) {
-        // FIXME: Support rendering surface to cubemap face
+    // Used in command buffer
+    if (r->in_command_buffer && snode->submit_time == r->submit_count) {
         return false;
     }
 
-    if (shape->levels > 1) {
-        // FIXME: Support rendering surface to mip levels
-        return false;
+    // Used in a submitted command buffer that may still be executing
+    if (snode->submit_time >= r->completed_submit_count &&
+        snode->submit_time < r->submit_count) {
+        pgraph_vk_retire_completed_submits(r);
+        if (snode->submit_time >= r->completed_submit_count) {
+            return false;
+        }
     }
 
-    switch (surface_fmt) {
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_Z1R5G5B5: switch (texture_fmt) {
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5: return true;
-        default: break;
-        }
-        break;
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5: switch (texture_fmt) {
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5: return true;
-        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5: return true;
-        default: break;
-        }
-        break;
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8: switch(texture_fmt) {
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8: return true;
-        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8: return true;
-        default: break;
-        }
-        break;
-    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8: switch (texture_fmt) {
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8B8G8R8: return true;
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R8G8B8A8: return true;
-        case NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8: return true;
-        case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8: return true;
-        default: break;
-        }
-        break;
-    default:
-        break;
+    return true;
+}
+
+static void sampler_cache_entry_post_evict(Lru *lru, LruNode *node)
+{
+    PGRAPHVkState *r = container_of(lru, PGRAPHVkState, sampler_cache);
+    SamplerBinding *snode = container_of(node, SamplerBinding, node);
+
+    vkDestroySampler(r->device, snode->sampler, NULL);
+    snode->sampler = VK_NULL_HANDLE;
+}
+
+static bool sampler_cache_entry_compare(Lru *lru, LruNode *node,
+                                        const void *key)
+{
+    SamplerBinding *snode = container_of(node, SamplerBinding, node);
+    return memcmp(&snode->key, key, sizeof(SamplerKey));
+}
+
+static void sampler_cache_init(PGRAPHVkState *r)
+{
+    const size_t sampler_cache_size = NV2A_VK_SAMPLER_CACHE_SIZE;
+    lru_init(&r->sampler_cache);
+    r->sampler_cache_entries =
+        g_malloc_n(sampler_cache_size, sizeof(SamplerBinding));
+    for (int i = 0; i < sampler_cache_size; i++) {
+        lru_add_free(&r->sampler_cache, &r->sampler_cache_entries[i].node);
     }
+    r->sampler_cache.init_node = sampler_cache_entry_init;
+    r->sampler_cache.compare_nodes = sampler_cache_entry_compare;
+    r->sampler_cache.pre_node_evict = sampler_cache_entry_pre_evict;
+    r->sampler_cache.post_node_evict = sampler_cache_entry_post_evict;
+}
 
-    trace_nv2a_pgraph_surface_texture_compat_failed(
-        surface_fmt, texture_fmt);
-    return false;
+static void sampler_cache_finalize(PGRAPHVkState *r)
+{
+    lru_flush(&r->sampler_cache);
+    g_free(r->sampler_cache_entries);
+    r->sampler_cache_entries = NULL;
 }
 
 static void create_dummy_texture(PGRAPHState *pg)
@@ -967,24 +2481,19 @@ static void create_dummy_texture(PGRAPHState *pg)
     VK_CHECK(vkCreateImageView(r->device, &image_view_create_info, NULL,
                                &texture_image_view));
 
-    VkSamplerCreateInfo sampler_create_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-        .magFilter = VK_FILTER_NEAREST,
-        .minFilter = VK_FILTER_NEAREST,
-        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
-        .anisotropyEnable = VK_FALSE,
-        .borderColor = VK_BORDER_COLOR_INT_OPAQUE_WHITE,
-        .unnormalizedCoordinates = VK_FALSE,
-        .compareEnable = VK_FALSE,
-        .compareOp = VK_COMPARE_OP_ALWAYS,
-        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
-    };
+    SamplerKey sampler_key;
+    memset(&sampler_key, 0, sizeof(sampler_key));
+    sampler_key.mag_filter = VK_FILTER_NEAREST;
+    sampler_key.min_filter = VK_FILTER_NEAREST;
+    sampler_key.mipmap_mode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_key.address_mode_u = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_key.address_mode_v = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_key.address_mode_w = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_key.max_anisotropy = 1;
+    sampler_key.border_color = VK_BORDER_COLOR_INT_OPAQUE_WHITE;
 
-    VkSampler texture_sampler;
-    VK_CHECK(vkCreateSampler(r->device, &sampler_create_info, NULL,
-                             &texture_sampler));
+    SamplerBinding *texture_sampler = get_sampler(r, &sampler_key);
+    texture_sampler->num_textures++;
 
     // Copy texture data to mapped device buffer
     uint8_t *mapped_memory_ptr;
@@ -1041,7 +2550,12 @@ static void create_dummy_texture(PGRAPHState *pg)
         .allocation = texture_allocation,
         .image_view = texture_image_view,
         .sampler = texture_sampler,
+        .bindless_index = 0,
     };
+
+    if (r->bindless_textures_enabled) {
+        pgraph_vk_write_bindless_texture(r, &r->dummy_texture);
+    }
 }
 
 static void destroy_dummy_texture(PGRAPHVkState *r)
@@ -1072,13 +2586,6 @@ static void set_texture_label(PGRAPHState *pg, TextureBinding *texture)
     vmaSetAllocationName(r->allocator, texture->allocation, label);
 }
 
-static bool is_linear_filter_supported_for_format(PGRAPHVkState *r,
-                                                  int kelvin_format)
-{
-    return r->texture_format_properties[kelvin_format].optimalTilingFeatures &
-           VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
-}
-
 static void create_texture(PGRAPHState *pg, int texture_idx)
 {
     NV2A_VK_DGROUP_BEGIN("Creating texture %d", texture_idx);
@@ -1119,14 +2626,20 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
     }
     key.scale = 1;
 
-    // FIXME: Separate sampler from texture
-    key.filter = filter;
-    key.address = address;
-    key.border_color = border_color_pack32;
-    key.max_anisotropy = max_anisotropy;
+    SamplerKey sampler_key;
+    init_sampler_key(pg, &state, filter, address, border_color_pack32,
+                     max_anisotropy, &sampler_key);
+    SamplerBinding *sampler = get_sampler(r, &sampler_key);
+    r->texture_samplers[texture_idx] = sampler;
+
+    // Bindless descriptors combine the image with its sampler
+    if (r->bindless_textures_enabled) {
+        key.filter = filter;
+        key.address = address;
+        key.border_color = border_color_pack32;
+        key.max_anisotropy = max_anisotropy;
+    }
 
-    bool possibly_dirty = false;
-    bool possibly_dirty_checked = false;
     bool surface_to_texture = false;
 
     // Check active surfaces to see if this texture was a render target
@@ -1148,8 +2661,8 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
             pg, texture_vram_offset, texture_length);
     }
 
-    if (surface_to_texture && pg->surface_scale_factor > 1) {
-        key.scale = pg->surface_scale_factor;
+    if (surface_to_texture && surface->scale > 1) {
+        key.scale = surface->scale;
     }
 
     uint64_t key_hash = fast_hash((void*)&key, sizeof(key));
@@ -1160,40 +2673,24 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
     if (binding_found) {
         NV2A_VK_DPRINTF("Cache hit");
         r->texture_bindings[texture_idx] = snode;
-        possibly_dirty |= snode->possibly_dirty;
-    } else {
-        possibly_dirty = true;
-    }
-
-    if (!surface_to_texture && !possibly_dirty_checked) {
-        possibly_dirty |= check_texture_possibly_dirty(
-            d, texture_vram_offset, texture_length, texture_palette_vram_offset,
-            texture_palette_data_size);
     }
 
-    // Calculate hash of texture data, if necessary
-    void *texture_data = (char*)d->vram_ptr + texture_vram_offset;
-    void *palette_data = (char*)d->vram_ptr + texture_palette_vram_offset;
-
-    uint64_t content_hash = 0;
-    if (!surface_to_texture && possibly_dirty) {
-        content_hash = fast_hash(texture_data, texture_length);
-        if (is_indexed) {
-            content_hash ^= fast_hash(palette_data, texture_palette_data_size);
-        }
+    if (!surface_to_texture) {
+        check_texture_possibly_dirty(d, texture_vram_offset, texture_length,
+                                     texture_palette_vram_offset,
+                                     texture_palette_data_size);
     }
 
     if (binding_found) {
         if (surface_to_texture) {
             // FIXME: Add draw time tracking
             if (surface->draw_time != snode->draw_time) {
-                copy_surface_to_texture(pg, surface, snode);
+                queue_surface_to_texture_copy(r, surface, snode);
             }
         } else {
-            if (possibly_dirty && content_hash != snode->hash) {
-                upload_texture_image(pg, texture_idx, snode);
-                snode->hash = content_hash;
-            }
+            int64_t start = nv2a_profile_cpu_time_begin();
+            update_texture_image(pg, texture_idx, snode);
+            nv2a_profile_cpu_time_end(NV2A_PROF_CPU_TEX_UPLOAD, NULL, start);
         }
 
         NV2A_VK_DGROUP_END();
@@ -1205,10 +2702,14 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
     memcpy(&snode->key, &key, sizeof(key));
     snode->current_layout = VK_IMAGE_LAYOUT_UNDEFINED;
     snode->possibly_dirty = false;
-    snode->hash = content_hash;
+    snode->mipmaps_generated =
+        !surface_to_texture &&
+        !check_texture_gpu_decode_supported(pg, &state) &&
+        check_texture_mipmap_generation_supported(pg, &state);
 
     VkColorFormatInfo vkf = kelvin_color_format_vk_map[state.color_format];
-    assert(vkf.vk_format != 0);
+    VkFormat vk_format = get_texture_vk_format(pg, &state);
+    assert(vk_format != 0);
     assert(0 < state.dimensionality);
     assert(state.dimensionality < ARRAY_SIZE(dimensionality_to_vk_image_type));
     assert(state.dimensionality <
@@ -1222,7 +2723,7 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
         .extent.depth = state.depth,
         .mipLevels = f_basic.linear ? 1 : state.levels,
         .arrayLayers = state.cubemap ? 6 : 1,
-        .format = vkf.vk_format,
+        .format = vk_format,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
         .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -1232,17 +2733,30 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
     };
 
     if (surface_to_texture) {
-        pgraph_apply_scaling_factor(pg, &image_create_info.extent.width,
-                                        &image_create_info.extent.height);
+        pgraph_vk_apply_surface_scale_factor(
+            surface, &image_create_info.extent.width,
+            &image_create_info.extent.height);
     }
 
-    VmaAllocationCreateInfo alloc_create_info = {
-        .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-    };
+    if (snode->mipmaps_generated) {
+        image_create_info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
 
-    VK_CHECK(vmaCreateImage(r->allocator, &image_create_info,
-                            &alloc_create_info, &snode->image,
-                            &snode->allocation, NULL));
+    // Uploads are written by the transfer queue and sampled by draws
+    uint32_t queue_family_indices[] = { r->queue_family,
+                                        r->transfer_queue_family };
+    if (r->transfer_queue) {
+        image_create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        image_create_info.queueFamilyIndexCount =
+            ARRAY_SIZE(queue_family_indices);
+        image_create_info.pQueueFamilyIndices = queue_family_indices;
+    }
+
+    pgraph_vk_create_image(r, &image_create_info, &snode->image,
+                           &snode->allocation, &snode->memory_size);
+    snode->image_create_info = image_create_info;
+    snode->image_create_info.pQueueFamilyIndices = NULL;
+    r->residency.texture_bytes += snode->memory_size;
 
     VkImageViewCreateInfo image_view_create_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -1250,7 +2764,7 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
         .viewType = state.cubemap ?
             VK_IMAGE_VIEW_TYPE_CUBE :
             dimensionality_to_vk_image_view_type[state.dimensionality],
-        .format = vkf.vk_format,
+        .format = vk_format,
         .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .subresourceRange.baseMipLevel = 0,
         .subresourceRange.levelCount = image_create_info.mipLevels,
@@ -1262,130 +2776,24 @@ static void create_texture(PGRAPHState *pg, int texture_idx)
     VK_CHECK(vkCreateImageView(r->device, &image_view_create_info, NULL,
                                &snode->image_view));
 
-
-    void *sampler_next_struct = NULL;
-
-    VkSamplerCustomBorderColorCreateInfoEXT custom_border_color_create_info;
-    VkBorderColor vk_border_color;
-
-    bool is_integer_type = vkf.vk_format == VK_FORMAT_R32_UINT;
-
-    if (r->custom_border_color_extension_enabled) {
-        vk_border_color = is_integer_type ? VK_BORDER_COLOR_INT_CUSTOM_EXT :
-                                            VK_BORDER_COLOR_FLOAT_CUSTOM_EXT;
-        custom_border_color_create_info =
-            (VkSamplerCustomBorderColorCreateInfoEXT){
-                .sType =
-                    VK_STRUCTURE_TYPE_SAMPLER_CUSTOM_BORDER_COLOR_CREATE_INFO_EXT,
-                .format = image_view_create_info.format,
-                .pNext = sampler_next_struct
-            };
-        if (is_integer_type) {
-            float rgba[4];
-            pgraph_argb_pack32_to_rgba_float(border_color_pack32, rgba);
-            for (int i = 0; i < 4; i++) {
-                custom_border_color_create_info.customBorderColor.uint32[i] =
-                    (uint32_t)((double)rgba[i] * (double)0xffffffff);
-            }
-        } else {
-            pgraph_argb_pack32_to_rgba_float(
-                border_color_pack32,
-                custom_border_color_create_info.customBorderColor.float32);
-        }
-        sampler_next_struct = &custom_border_color_create_info;
-    } else {
-        // FIXME: Handle custom color in shader
-        if (is_integer_type) {
-            vk_border_color = VK_BORDER_COLOR_INT_TRANSPARENT_BLACK;
-        } else if (border_color_pack32 == 0x00000000) {
-            vk_border_color = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
-        } else if (border_color_pack32 == 0xff000000) {
-            vk_border_color = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
-        } else {
-            vk_border_color = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
-        }
-    }
-
-    if (filter & NV_PGRAPH_TEXFILTER0_ASIGNED)
-        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_ASIGNED");
-    if (filter & NV_PGRAPH_TEXFILTER0_RSIGNED)
-        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_RSIGNED");
-    if (filter & NV_PGRAPH_TEXFILTER0_GSIGNED)
-        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_GSIGNED");
-    if (filter & NV_PGRAPH_TEXFILTER0_BSIGNED)
-        NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_BSIGNED");
-
-    VkFilter vk_min_filter, vk_mag_filter;
-    unsigned int mag_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MAG);
-    assert(mag_filter < ARRAY_SIZE(pgraph_texture_mag_filter_vk_map));
-
-    unsigned int min_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIN);
-    assert(min_filter < ARRAY_SIZE(pgraph_texture_min_filter_vk_map));
-
-    if (is_linear_filter_supported_for_format(r, state.color_format)) {
-        vk_mag_filter = pgraph_texture_min_filter_vk_map[mag_filter];
-        vk_min_filter = pgraph_texture_min_filter_vk_map[min_filter];
-    } else {
-        vk_mag_filter = vk_min_filter = VK_FILTER_NEAREST;
-    }
-
-    bool mipmap_en =
-        !f_basic.linear &&
-        !(min_filter == NV_PGRAPH_TEXFILTER0_MIN_BOX_LOD0 ||
-          min_filter == NV_PGRAPH_TEXFILTER0_MIN_TENT_LOD0 ||
-          min_filter == NV_PGRAPH_TEXFILTER0_MIN_CONVOLUTION_2D_LOD0);
-
-    bool mipmap_nearest =
-        f_basic.linear || image_create_info.mipLevels == 1 ||
-        min_filter == NV_PGRAPH_TEXFILTER0_MIN_BOX_NEARESTLOD ||
-        min_filter == NV_PGRAPH_TEXFILTER0_MIN_TENT_NEARESTLOD;
-
-    float lod_bias = pgraph_convert_lod_bias_to_float(
-        GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIPMAP_LOD_BIAS));
-    if (lod_bias > r->device_props.limits.maxSamplerLodBias) {
-        lod_bias = r->device_props.limits.maxSamplerLodBias;
-    } else if (lod_bias < -r->device_props.limits.maxSamplerLodBias) {
-        lod_bias = -r->device_props.limits.maxSamplerLodBias;
+    if (r->bindless_textures_enabled) {
+        snode->sampler = sampler;
+        sampler->num_textures++;
+        pgraph_vk_write_bindless_texture(r, snode);
     }
-    uint32_t sampler_max_anisotropy =
-        MIN(r->device_props.limits.maxSamplerAnisotropy, max_anisotropy);
-
-    VkSamplerCreateInfo sampler_create_info = {
-        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-        .magFilter = vk_mag_filter,
-        .minFilter = vk_min_filter,
-        .addressModeU = lookup_texture_address_mode(
-            GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRU)),
-        .addressModeV = lookup_texture_address_mode(
-            GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRV)),
-        .addressModeW = (state.dimensionality > 2) ? lookup_texture_address_mode(
-            GET_MASK(address, NV_PGRAPH_TEXADDRESS0_ADDRP)) : 0,
-        .anisotropyEnable =
-            r->enabled_physical_device_features.samplerAnisotropy &&
-            sampler_max_anisotropy > 1,
-        .maxAnisotropy = sampler_max_anisotropy,
-        .borderColor = vk_border_color,
-        .compareEnable = VK_FALSE,
-        .compareOp = VK_COMPARE_OP_ALWAYS,
-        .mipmapMode = mipmap_nearest ? VK_SAMPLER_MIPMAP_MODE_NEAREST :
-                                       VK_SAMPLER_MIPMAP_MODE_LINEAR,
-        .minLod = mipmap_en ? MIN(state.min_mipmap_level, state.levels - 1) : 0.0,
-        .maxLod = mipmap_en ? MIN(state.max_mipmap_level, state.levels - 1) : 0.0,
-        .mipLodBias = lod_bias,
-        .pNext = sampler_next_struct,
-    };
-
-    VK_CHECK(vkCreateSampler(r->device, &sampler_create_info, NULL,
-                             &snode->sampler));
 
     set_texture_label(pg, snode);
+    insert_texture_ranges(r, snode);
 
     r->texture_bindings[texture_idx] = snode;
 
     if (surface_to_texture) {
-        copy_surface_to_texture(pg, surface, snode);
+        queue_surface_to_texture_copy(r, surface, snode);
     } else {
-        upload_texture_image(pg, texture_idx, snode);
+        int64_t start = nv2a_profile_cpu_time_begin();
+        hash_texture_pages(d, snode);
+        upload_new_texture_image(pg, texture_idx, snode);
+        nv2a_profile_cpu_time_end(NV2A_PROF_CPU_TEX_UPLOAD, NULL, start);
         snode->draw_time = 0;
     }
 
@@ -1410,6 +2818,9 @@ static void update_timestamps(PGRAPHVkState *r)
         if (r->texture_bindings[i]) {
             r->texture_bindings[i]->submit_time = r->submit_count;
         }
+        if (r->texture_samplers[i]) {
+            r->texture_samplers[i]->submit_time = r->submit_count;
+        }
     }
 }
 
@@ -1435,6 +2846,7 @@ void pgraph_vk_bind_textures(NV2AState *d)
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
         if (!pgraph_is_texture_enabled(pg, i)) {
             r->texture_bindings[i] = &r->dummy_texture;
+            r->texture_samplers[i] = r->dummy_texture.sampler;
             continue;
         }
 
@@ -1443,6 +2855,8 @@ void pgraph_vk_bind_textures(NV2AState *d)
         pg->texture_dirty[i] = false; // FIXME: Move to renderer?
     }
 
+    copy_pending_surfaces_to_textures(pg);
+
     r->texture_bindings_changed = true;
     update_timestamps(r);
     NV2A_VK_DGROUP_END();
@@ -1454,21 +2868,61 @@ static void texture_cache_entry_init(Lru *lru, LruNode *node, const void *state)
 
     snode->image = VK_NULL_HANDLE;
     snode->allocation = VK_NULL_HANDLE;
+    snode->memory_size = 0;
     snode->image_view = VK_NULL_HANDLE;
-    snode->sampler = VK_NULL_HANDLE;
+    snode->sampler = NULL;
+    snode->dirty_pages = NULL;
+    snode->page_hashes = NULL;
+    snode->num_pages = 0;
+    snode->mipmaps_generated = false;
+    snode->index_buffer = VK_NULL_HANDLE;
+    snode->index_allocation = VK_NULL_HANDLE;
+    snode->index_buffer_size = 0;
 }
 
 static void texture_cache_release_node_resources(PGRAPHVkState *r, TextureBinding *snode)
 {
-    vkDestroySampler(r->device, snode->sampler, NULL);
-    snode->sampler = VK_NULL_HANDLE;
+    if (snode != &r->dummy_texture && snode->image != VK_NULL_HANDLE) {
+        remove_texture_ranges(r, snode);
+    }
+
+    if (snode->sampler) {
+        assert(snode->sampler->num_textures > 0);
+        snode->sampler->num_textures--;
+        snode->sampler = NULL;
+    }
 
     vkDestroyImageView(r->device, snode->image_view, NULL);
     snode->image_view = VK_NULL_HANDLE;
 
-    vmaDestroyImage(r->allocator, snode->image, snode->allocation);
+    if (snode == &r->dummy_texture) {
+        vmaDestroyImage(r->allocator, snode->image, snode->allocation);
+    } else {
+        pgraph_vk_recycle_image(r, &snode->image_create_info, snode->image,
+                                snode->allocation);
+    }
     snode->image = VK_NULL_HANDLE;
     snode->allocation = VK_NULL_HANDLE;
+
+    assert(r->residency.texture_bytes >= snode->memory_size);
+    r->residency.texture_bytes -= snode->memory_size;
+    snode->memory_size = 0;
+
+    if (snode->index_buffer != VK_NULL_HANDLE) {
+        vmaDestroyBuffer(r->allocator, snode->index_buffer,
+                         snode->index_allocation);
+        snode->index_buffer = VK_NULL_HANDLE;
+        snode->index_allocation = VK_NULL_HANDLE;
+        assert(r->residency.texture_bytes >= snode->index_buffer_size);
+        r->residency.texture_bytes -= snode->index_buffer_size;
+        snode->index_buffer_size = 0;
+    }
+
+    g_free(snode->dirty_pages);
+    snode->dirty_pages = NULL;
+    g_free(snode->page_hashes);
+    snode->page_hashes = NULL;
+    snode->num_pages = 0;
 }
 
 static bool texture_cache_entry_pre_evict(Lru *lru, LruNode *node)
@@ -1491,6 +2945,15 @@ static bool texture_cache_entry_pre_evict(Lru *lru, LruNode *node)
         return false;
     }
 
+    // Used in a submitted command buffer that may still be executing
+    if (snode->submit_time >= r->completed_submit_count &&
+        snode->submit_time < r->submit_count) {
+        pgraph_vk_retire_completed_submits(r);
+        if (snode->submit_time >= r->completed_submit_count) {
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1510,11 +2973,13 @@ static bool texture_cache_entry_compare(Lru *lru, LruNode *node,
 
 static void texture_cache_init(PGRAPHVkState *r)
 {
-    const size_t texture_cache_size = 1024;
+    const size_t texture_cache_size = NV2A_VK_TEXTURE_CACHE_SIZE;
     lru_init(&r->texture_cache);
     r->texture_cache_entries = g_malloc_n(texture_cache_size, sizeof(TextureBinding));
     assert(r->texture_cache_entries != NULL);
     for (int i = 0; i < texture_cache_size; i++) {
+        // The dummy texture takes the first bindless descriptor
+        r->texture_cache_entries[i].bindless_index = i + 1;
         lru_add_free(&r->texture_cache, &r->texture_cache_entries[i].node);
     }
     r->texture_cache.init_node = texture_cache_entry_init;
@@ -1530,27 +2995,126 @@ static void texture_cache_finalize(PGRAPHVkState *r)
     r->texture_cache_entries = NULL;
 }
 
-void pgraph_vk_trim_texture_cache(PGRAPHState *pg)
+typedef struct TextureEvictionCandidate {
+    TextureBinding *texture;
+    uint64_t cost;
+} TextureEvictionCandidate;
+
+static int compare_texture_eviction_candidates(const void *a, const void *b)
+{
+    const TextureEvictionCandidate *ca = a, *cb = b;
+
+    // Most expensive to keep first
+    return (ca->cost < cb->cost) - (ca->cost > cb->cost);
+}
+
+/*
+ * Evict cached textures until images of at least `bytes` have been evicted,
+ * or no more textures can be evicted. Textures are ordered by the
+ * cost of keeping them resident: their size scaled by the number of submits
+ * since they were last bound, so that large textures which have not been used
+ * in a while go first. Evicted images go to the recycled image list. Returns
+ * the size of the evicted images.
+ */
+VkDeviceSize pgraph_vk_trim_texture_cache(PGRAPHState *pg, VkDeviceSize bytes)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
-    // FIXME: Allow specifying some amount to trim by
+    g_autofree TextureEvictionCandidate *candidates =
+        g_malloc_n(r->texture_cache.num_used, sizeof(TextureEvictionCandidate));
+    int num_candidates = 0;
+
+    LruNode *node;
+    QTAILQ_FOREACH(node, &r->texture_cache.global, next_global) {
+        if (!lru_is_node_in_use(&r->texture_cache, node)) {
+            continue;
+        }
+        TextureBinding *snode = container_of(node, TextureBinding, node);
+        uint32_t age = r->submit_count - snode->submit_time;
+        candidates[num_candidates++] = (TextureEvictionCandidate){
+            .texture = snode,
+            .cost = (uint64_t)snode->memory_size * (age + 1),
+        };
+    }
+    assert(num_candidates == r->texture_cache.num_used);
+
+    qsort(candidates, num_candidates, sizeof(TextureEvictionCandidate),
+          compare_texture_eviction_candidates);
 
-    int num_to_evict = r->texture_cache.num_used / 4;
+    VkDeviceSize freed = 0;
     int num_evicted = 0;
 
-    while (num_to_evict-- && lru_try_evict_one(&r->texture_cache)) {
+    for (int i = 0; i < num_candidates && freed < bytes; i++) {
+        TextureBinding *snode = candidates[i].texture;
+        if (!texture_cache_entry_pre_evict(&r->texture_cache, &snode->node)) {
+            continue;
+        }
+        freed += snode->memory_size;
+        lru_evict_node(&r->texture_cache, &snode->node);
+        nv2a_profile_inc_counter(NV2A_PROF_RESIDENCY_EVICT);
         num_evicted += 1;
     }
 
-    NV2A_VK_DPRINTF("Evicted %d textures, %d remain", num_evicted, r->texture_cache.num_used);
+    NV2A_VK_DPRINTF("Evicted %d textures (%" PRIu64 " KiB), %d remain",
+                    num_evicted, (uint64_t)freed / 1024,
+                    r->texture_cache.num_used);
+
+    return freed;
+}
+
+static void init_texture_compression_support(PGRAPHVkState *r)
+{
+    static const int formats[] = {
+        NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5,
+        NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT23_A8R8G8B8,
+        NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT45_A8R8G8B8,
+    };
+    const VkFormatFeatureFlags required_features =
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT |
+        VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+
+    r->texture_compression_bc =
+        r->enabled_physical_device_features.textureCompressionBC;
+    r->texture_compression_bc_3d = r->texture_compression_bc;
+
+    for (int i = 0; i < ARRAY_SIZE(formats); i++) {
+        VkFormat vk_format = kelvin_format_to_bc_format(formats[i]);
+
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(r->physical_device, vk_format,
+                                            &props);
+        if ((props.optimalTilingFeatures & required_features) !=
+            required_features) {
+            r->texture_compression_bc = false;
+        }
+
+        // Block compressed 3D images are not guaranteed
+        VkImageFormatProperties image_props;
+        if (vkGetPhysicalDeviceImageFormatProperties(
+                r->physical_device, vk_format, VK_IMAGE_TYPE_3D,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                0, &image_props) != VK_SUCCESS) {
+            r->texture_compression_bc_3d = false;
+        }
+    }
+    r->texture_compression_bc_3d &= r->texture_compression_bc;
+
+    if (!r->texture_compression_bc) {
+        fprintf(stderr, "Warning: Block compressed textures are not "
+                        "supported, DXT textures will be decompressed\n");
+    }
 }
 
 void pgraph_vk_init_textures(PGRAPHState *pg)
 {
     PGRAPHVkState *r = pg->vk_renderer_state;
 
+    r->texture_ranges = (IntervalTreeRoot){};
+    r->texture_palette_ranges = (IntervalTreeRoot){};
     texture_cache_init(r);
+    sampler_cache_init(r);
     create_dummy_texture(pg);
 
     r->texture_format_properties = g_malloc0_n(
@@ -1560,6 +3124,13 @@ void pgraph_vk_init_textures(PGRAPHState *pg)
             r->physical_device, kelvin_color_format_vk_map[i].vk_format,
             &r->texture_format_properties[i]);
     }
+
+    init_texture_compression_support(r);
+
+    if (g_config.perf.cache_textures) {
+        g_autofree char *texture_cache_dir = get_texture_cache_dir();
+        qemu_mkdir(texture_cache_dir);
+    }
 }
 
 void pgraph_vk_finalize_textures(PGRAPHState *pg)
@@ -1570,12 +3141,15 @@ void pgraph_vk_finalize_textures(PGRAPHState *pg)
 
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
         r->texture_bindings[i] = NULL;
+        r->texture_samplers[i] = NULL;
     }
 
     destroy_dummy_texture(r);
     texture_cache_finalize(r);
+    sampler_cache_finalize(r);
 
     assert(r->texture_cache.num_used == 0);
+    assert(r->sampler_cache.num_used == 0);
 
     g_free(r->texture_format_properties);
     r->texture_format_properties = NULL;
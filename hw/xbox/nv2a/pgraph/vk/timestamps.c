@@ -0,0 +1,220 @@
+/*
+ * Geforce NV2A PGRAPH Vulkan Renderer
+ *
+ * Copyright (c) 2024-2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ui/xemu-settings.h"
+#include "renderer.h"
+
+/*
+ * GPU time is measured with pairs of timestamps written around the work of
+ * interest. Each command buffer writes to its own pool of timers, the first
+ * of which covers the whole command buffer. Results are read back without
+ * waiting once the command buffer is known to have completed, so they are
+ * attributed to the frame being emulated at that time, which may be a few
+ * frames after the one that recorded them.
+ *
+ * Frames of the ring time their main command buffer. Single time commands
+ * share one pool which is resolved as soon as they have been waited for.
+ * Other command buffers are not timed.
+ */
+
+static void create_pool(PGRAPHVkState *r, GpuTimerPool *pool)
+{
+    VkQueryPoolCreateInfo pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2 * NV2A_VK_MAX_GPU_TIMERS,
+    };
+    VK_CHECK(vkCreateQueryPool(r->device, &pool_create_info, NULL,
+                               &pool->query_pool));
+    pool->num_timers = 0;
+    pool->depth = 0;
+}
+
+static void destroy_pool(PGRAPHVkState *r, GpuTimerPool *pool)
+{
+    vkDestroyQueryPool(r->device, pool->query_pool, NULL);
+    pool->query_pool = VK_NULL_HANDLE;
+}
+
+static GpuTimerPool *get_pool(PGRAPHVkState *r, VkCommandBuffer cmd)
+{
+    if (!r->gpu_timers_enabled) {
+        return NULL;
+    }
+    if (cmd == r->command_buffer) {
+        return &r->frame->gpu_timers;
+    }
+    if (cmd == r->aux_command_buffer && r->in_aux_command_buffer &&
+        r->single_time_gpu_timers.num_timers > 0) {
+        return &r->single_time_gpu_timers;
+    }
+    return NULL;
+}
+
+void pgraph_vk_begin_command_buffer_timer(PGRAPHVkState *r,
+                                          VkCommandBuffer cmd)
+{
+    if (!r->gpu_timers_enabled) {
+        return;
+    }
+
+    GpuTimerPool *pool = cmd == r->command_buffer ? &r->frame->gpu_timers :
+                                                    &r->single_time_gpu_timers;
+    assert(pool->num_timers == 0);
+
+    vkCmdResetQueryPool(cmd, pool->query_pool, 0, 2 * NV2A_VK_MAX_GPU_TIMERS);
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        pool->query_pool, 0);
+    pool->num_timers = 1;
+    pool->depth = 0;
+}
+
+void pgraph_vk_end_command_buffer_timer(PGRAPHVkState *r, VkCommandBuffer cmd,
+                                        enum NV2A_PROF_GPU_TIMERS_ENUM timer)
+{
+    GpuTimerPool *pool = get_pool(r, cmd);
+    if (!pool) {
+        return;
+    }
+
+    assert(pool->depth == 0);
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        pool->query_pool, 1);
+    pool->timers[0] = timer;
+}
+
+void pgraph_vk_begin_gpu_timer(PGRAPHVkState *r, VkCommandBuffer cmd,
+                               enum NV2A_PROF_GPU_TIMERS_ENUM timer)
+{
+    GpuTimerPool *pool = get_pool(r, cmd);
+    if (!pool) {
+        return;
+    }
+
+    if (pool->depth++ > 0 || pool->num_timers >= NV2A_VK_MAX_GPU_TIMERS) {
+        return;
+    }
+
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        pool->query_pool, 2 * pool->num_timers);
+    pool->timers[pool->num_timers] = timer;
+}
+
+void pgraph_vk_end_gpu_timer(PGRAPHVkState *r, VkCommandBuffer cmd)
+{
+    GpuTimerPool *pool = get_pool(r, cmd);
+    if (!pool) {
+        return;
+    }
+
+    assert(pool->depth > 0);
+    if (--pool->depth > 0 || pool->num_timers >= NV2A_VK_MAX_GPU_TIMERS) {
+        return;
+    }
+
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        pool->query_pool, 2 * pool->num_timers + 1);
+    pool->num_timers += 1;
+}
+
+/*
+ * Add the times measured by a pool to the profile of the current frame. The
+ * command buffer which wrote the pool must have completed.
+ */
+void pgraph_vk_resolve_gpu_timers(PGRAPHVkState *r, GpuTimerPool *pool)
+{
+    if (!r->gpu_timers_enabled || pool->num_timers == 0) {
+        return;
+    }
+
+    uint64_t timestamps[2 * NV2A_VK_MAX_GPU_TIMERS];
+    VkResult result = vkGetQueryPoolResults(
+        r->device, pool->query_pool, 0, 2 * pool->num_timers,
+        sizeof(timestamps), timestamps, sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT);
+    int num_timers = pool->num_timers;
+    pool->num_timers = 0;
+
+    if (result != VK_SUCCESS) {
+        // Dropped, e.g. device lost
+        return;
+    }
+
+    for (int i = 0; i < num_timers; i++) {
+        uint64_t ticks =
+            (timestamps[2 * i + 1] - timestamps[2 * i]) & r->timestamp_mask;
+        int us = (int)(ticks * r->timestamp_period / 1000.0f);
+        nv2a_profile_add_gpu_time(pool->timers[i], us);
+        if (i == 0) {
+            g_nv2a_stats.frame_working.gpu_us += us;
+        }
+    }
+}
+
+void pgraph_vk_init_timestamps(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    r->gpu_timers_enabled = false;
+
+    if (!g_config.display.vulkan.gpu_timers) {
+        return;
+    }
+
+    uint32_t num_queue_families;
+    vkGetPhysicalDeviceQueueFamilyProperties(r->physical_device,
+                                             &num_queue_families, NULL);
+    g_autofree VkQueueFamilyProperties *queue_families =
+        g_malloc_n(num_queue_families, sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        r->physical_device, &num_queue_families, queue_families);
+
+    uint32_t valid_bits = queue_families[r->queue_family].timestampValidBits;
+    if (valid_bits == 0) {
+        NV2A_VK_DPRINTF("GPU timers: not supported by the graphics queue");
+        return;
+    }
+
+    r->timestamp_period = r->device_props.limits.timestampPeriod;
+    r->timestamp_mask =
+        valid_bits >= 64 ? UINT64_MAX : ((uint64_t)1 << valid_bits) - 1;
+
+    for (int i = 0; i < r->num_frames; i++) {
+        create_pool(r, &r->frames[i].gpu_timers);
+    }
+    create_pool(r, &r->single_time_gpu_timers);
+
+    r->gpu_timers_enabled = true;
+}
+
+void pgraph_vk_finalize_timestamps(PGRAPHState *pg)
+{
+    PGRAPHVkState *r = pg->vk_renderer_state;
+
+    if (!r->gpu_timers_enabled) {
+        return;
+    }
+
+    for (int i = 0; i < r->num_frames; i++) {
+        destroy_pool(r, &r->frames[i].gpu_timers);
+    }
+    destroy_pool(r, &r->single_time_gpu_timers);
+
+    r->gpu_timers_enabled = false;
+}
@@ -49,6 +49,11 @@ void pgraph_vk_update_vertex_ram_buffer(PGRAPHState *pg, hwaddr offset,
 
     pgraph_vk_download_surfaces_in_range_if_dirty(pg, offset, size);
 
+    if (r->storage_buffers[BUFFER_VERTEX_RAM].imported_memory) {
+        // The GPU reads guest memory directly, there is nothing to copy
+        return;
+    }
+
     size_t start_bit = offset / TARGET_PAGE_SIZE;
     size_t end_bit = TARGET_PAGE_ALIGN(offset + size) / TARGET_PAGE_SIZE;
     size_t nbits = end_bit - start_bit;
@@ -60,6 +65,16 @@ void pgraph_vk_update_vertex_ram_buffer(PGRAPHState *pg, hwaddr offset,
         pgraph_vk_finish(pg, VK_FINISH_REASON_VERTEX_BUFFER_DIRTY);
     }
 
+    // Wait for any submitted frames still reading the old data
+    for (uint32_t i = r->submit_count; i > r->completed_submit_count; i--) {
+        CommandBufferFrame *frame = &r->frames[(i - 1) % r->num_frames];
+        if (find_next_bit(frame->vertex_ram_bitmap, end_bit, start_bit) <
+            end_bit) {
+            pgraph_vk_wait_for_submit(r, i - 1);
+            break;
+        }
+    }
+
     nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_1);
     memcpy(r->storage_buffers[BUFFER_VERTEX_RAM].mapped + offset, data, size);
 
@@ -287,7 +302,7 @@ void pgraph_vk_bind_vertex_attributes_inline(NV2AState *d)
 
     for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attr = &pg->vertex_attributes[i];
-        if (attr->inline_buffer_populated) {
+        if (pg->inline_buffer_attrs & (1 << i)) {
             r->vertex_attribute_to_description_location[i] =
                 r->num_active_vertex_binding_descriptions;
             r->vertex_binding_descriptions
@@ -0,0 +1,115 @@
+/*
+ * QEMU Geforce NV2A implementation
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hw/xbox/nv2a/nv2a_int.h"
+
+/*
+ * CPU writes to VRAM are tracked as a write generation per page, which is
+ * taken from the DIRTY_MEMORY_NV2A log at most once per PFIFO kick: data the
+ * guest wrote for its commands is in memory before it submits them. Each
+ * user of the tracking keeps the generation of every page it last saw, so
+ * vertex and surface checks no longer clear dirty state from each other,
+ * and checks themselves are plain reads of the PGRAPH thread's own arrays.
+ */
+
+void pgraph_vram_init(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pg->vram.num_pages = memory_region_size(d->vram) / TARGET_PAGE_SIZE;
+    pg->vram.page_gen = g_new0(uint32_t, pg->vram.num_pages);
+    pg->vram.gen = 0;
+    pg->vram.sync_pending = true;
+}
+
+void pgraph_vram_finalize(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    g_free(pg->vram.page_gen);
+    pg->vram.page_gen = NULL;
+}
+
+uint32_t *pgraph_vram_new_seen_gens(NV2AState *d)
+{
+    return g_new0(uint32_t, d->pgraph.vram.num_pages);
+}
+
+/* Called when the guest may have written VRAM the PGRAPH thread will read */
+void pgraph_vram_mark_sync_pending(NV2AState *d)
+{
+    qatomic_set(&d->pgraph.vram.sync_pending, true);
+}
+
+static void pgraph_vram_sync(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (!qatomic_xchg(&pg->vram.sync_pending, false)) {
+        return;
+    }
+
+    hwaddr size = memory_region_size(d->vram);
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+        d->vram, 0, size, DIRTY_MEMORY_NV2A);
+    const hwaddr chunk = TARGET_PAGE_SIZE * BITS_PER_LONG;
+    uint32_t gen = ++pg->vram.gen;
+
+    /* Most of VRAM is untouched, so look at it a bitmap word at a time */
+    for (hwaddr addr = 0; addr < size; addr += chunk) {
+        hwaddr len = MIN(chunk, size - addr);
+        if (!memory_region_snapshot_get_dirty(d->vram, snap, addr, len)) {
+            continue;
+        }
+        for (hwaddr page = addr; page < addr + len; page += TARGET_PAGE_SIZE) {
+            if (memory_region_snapshot_get_dirty(d->vram, snap, page,
+                                                 TARGET_PAGE_SIZE)) {
+                pg->vram.page_gen[page / TARGET_PAGE_SIZE] = gen;
+            }
+        }
+    }
+
+    g_free(snap);
+}
+
+/*
+ * Returns whether any page of the range was written since the caller last
+ * saw it, as recorded in its @seen generations, which are brought up to date.
+ */
+bool pgraph_vram_check_dirty(NV2AState *d, uint32_t *seen, hwaddr addr,
+                             hwaddr size)
+{
+    PGRAPHState *pg = &d->pgraph;
+    bool dirty = false;
+
+    pgraph_vram_sync(d);
+
+    hwaddr first = addr / TARGET_PAGE_SIZE;
+    hwaddr last = (addr + size - 1) / TARGET_PAGE_SIZE;
+    assert(last < pg->vram.num_pages);
+
+    for (hwaddr i = first; i <= last; i++) {
+        if (seen[i] != pg->vram.page_gen[i]) {
+            seen[i] = pg->vram.page_gen[i];
+            dirty = true;
+        }
+    }
+
+    return dirty;
+}
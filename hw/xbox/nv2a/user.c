@@ -67,6 +67,7 @@ uint64_t user_read(void *opaque, hwaddr addr, unsigned int size)
     qemu_mutex_unlock(&d->pfifo.lock);
 
     nv2a_reg_log_read(NV_USER, addr, size, r);
+    nv2a_poll_throttle(d, NV_USER, addr, r);
     return r;
 }
 
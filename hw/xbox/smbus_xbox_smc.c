@@ -38,6 +38,7 @@
 #include "system/runstate.h"
 #include "hw/qdev-properties.h"
 #include "block/block_int-io.h"
+#include "ui/xemu-fast-boot.h"
 
 #define TYPE_XBOX_SMC "smbus-xbox-smc"
 #define XBOX_SMC(obj) OBJECT_CHECK(SMBusSMCDevice, (obj), TYPE_XBOX_SMC)
@@ -177,6 +178,7 @@ static uint8_t smc_receive_byte(SMBusDevice *dev)
             smc->version_string_index++ % SMC_VERSION_LENGTH];
 
     case SMC_REG_TRAYSTATE:
+        xemu_fast_boot_checkpoint();
         return smc->traystate_reg;
 
     case SMC_REG_SCRATCH:
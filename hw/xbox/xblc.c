@@ -27,6 +27,7 @@
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
 #include "ui/xemu-input.h"
+#include "ui/xemu-settings.h"
 #include "qemu/audio.h"
 #include "qemu/fifo8.h"
 
@@ -51,6 +52,7 @@
 
 #define XBLC_MAX_PACKET 48
 #define XBLC_FIFO_SIZE (XBLC_MAX_PACKET * 100) //~100 ms worth of audio at 16bit 24kHz
+#define XBLC_LOW_LATENCY_MS 20
 
 static const uint8_t silence[256] = {0};
 
@@ -169,12 +171,40 @@ static void usb_xblc_handle_reset(USBDevice *dev)
     fifo8_reset(&s->out.fifo);
 }
 
+/*
+ * In low latency mode the FIFOs are kept to a few milliseconds of audio
+ * rather than being allowed to fill up. The guest and the host audio run
+ * off different clocks, so whatever builds up past the target is dropped,
+ * a sample per callback, or at once when well past it.
+ */
+static void xblc_trim_fifo(USBXBLCState *s, Fifo8 *fifo)
+{
+    uint32_t used = fifo8_num_used(fifo);
+    uint32_t target = s->sample_rate * XBLC_LOW_LATENCY_MS / 1000 *
+                      sizeof(int16_t);
+
+    if (used > 2 * target) {
+        fifo8_drop(fifo, (used - target) & ~1);
+    } else if (used > target) {
+        fifo8_drop(fifo, sizeof(int16_t));
+    }
+}
+
 static void output_callback(void *opaque, int avail)
 {
     USBXBLCState *s = (USBXBLCState *)opaque;
     const uint8_t *data;
     uint32_t processed, max_len;
 
+    if (g_config.audio.communicator_low_latency) {
+        xblc_trim_fifo(s, &s->out.fifo);
+
+        // Padding with silence would queue it ahead of the next words
+        if (fifo8_num_used(&s->out.fifo) < XBLC_MAX_PACKET) {
+            return;
+        }
+    }
+
     // Not enough data to send, wait a bit longer, fill with silence for now
     if (fifo8_num_used(&s->out.fifo) < XBLC_MAX_PACKET) {
         do {
@@ -205,7 +235,15 @@ static void input_callback(void *opaque, int avail)
         processed = AUD_read(s->in.voice, s->in.packet, max_len);
         avail    -= processed;
         fifo8_push_all(&s->in.fifo, s->in.packet, processed);
-        if (processed < max_len) return;
+        if (processed < max_len) break;
+    }
+
+    if (g_config.audio.communicator_low_latency) {
+        xblc_trim_fifo(s, &s->in.fifo);
+    }
+
+    if (avail > 0 && !fifo8_is_full(&s->in.fifo)) {
+        return;
     }
 
     // Flush excess/old data - this can happen if the user program stops the iso transfers after it
@@ -44,6 +44,7 @@
 
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "migration/vmstate.h"
 
 #include "hw/timer/i8254.h"
 #include "hw/audio/pcspk.h"
@@ -173,6 +174,92 @@ static void xbox_flash_init(MachineState *ms, MemoryRegion *rom_memory)
     g_free(bios_data); /* duplicated by `rom_add_blob_fixed` */
 }
 
+/*
+ * Guest RAM doubles as VRAM and is touched all over by the vCPU, the renderer
+ * and DMA, so backing it with 2 MiB pages saves a lot of host TLB misses.
+ * Explicit huge pages must have been made available by the user: reserved
+ * with vm.nr_hugepages on Linux, or the "Lock pages in memory" privilege
+ * granted on Windows. Returns NULL when they can't be had.
+ */
+static void *xbox_ram_alloc_huge(uint64_t size)
+{
+#if defined(CONFIG_LINUX) && defined(MAP_HUGETLB)
+    void *host = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return host == MAP_FAILED ? NULL : host;
+#elif defined(_WIN32)
+    SIZE_T page_size = GetLargePageMinimum();
+    HANDLE token;
+    TOKEN_PRIVILEGES tp = { .PrivilegeCount = 1 };
+
+    if (!page_size || size % page_size) {
+        return NULL;
+    }
+
+    /* Large pages can only be allocated with this privilege enabled */
+    if (!OpenProcessToken(GetCurrentProcess(),
+                          TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return NULL;
+    }
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled =
+        LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                             &tp.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+        GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    if (!enabled) {
+        return NULL;
+    }
+
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                        PAGE_READWRITE);
+#else
+    return NULL;
+#endif
+}
+
+/* Whether RAM that was not explicitly allocated with huge pages gets them */
+static bool xbox_ram_has_transparent_huge_pages(void)
+{
+#ifdef CONFIG_LINUX
+    g_autofree char *mode = NULL;
+
+    /* QEMU already advises huge pages for all of guest RAM */
+    if (!g_file_get_contents("/sys/kernel/mm/transparent_hugepage/enabled",
+                             &mode, NULL, NULL)) {
+        return false;
+    }
+    return !strstr(mode, "[never]");
+#else
+    return false;
+#endif
+}
+
+static void xbox_ram_init(MemoryRegion *ram, uint64_t size, bool huge_pages)
+{
+    void *host = huge_pages ? xbox_ram_alloc_huge(size) : NULL;
+
+    if (host) {
+        memory_region_init_ram_ptr(ram, NULL, "xbox.ram", size, host);
+        vmstate_register_ram_global(ram);
+        info_report("Guest RAM is backed by huge pages");
+        return;
+    }
+
+    memory_region_init_ram(ram, NULL, "xbox.ram", size, &error_fatal);
+
+    if (!huge_pages) {
+        return;
+    }
+    if (xbox_ram_has_transparent_huge_pages()) {
+        info_report("Huge pages for guest RAM are not available, "
+                    "using transparent huge pages");
+    } else {
+        warn_report("Huge pages for guest RAM are not available");
+    }
+}
+
 static void xbox_memory_init(PCMachineState *pcms,
                              MemoryRegion *system_memory,
                              MemoryRegion *rom_memory,
@@ -191,8 +278,11 @@ static void xbox_memory_init(PCMachineState *pcms,
      * with older qemus that used qemu_ram_alloc().
      */
     ram = g_malloc(sizeof(*ram));
-    memory_region_init_ram(ram, NULL, "xbox.ram",
-                           machine->ram_size, &error_fatal);
+    /* Chihiro is not an Xbox machine and has no such property */
+    bool huge_pages =
+        object_dynamic_cast(OBJECT(machine), TYPE_XBOX_MACHINE) &&
+        XBOX_MACHINE(machine)->huge_pages;
+    xbox_ram_init(ram, machine->ram_size, huge_pages);
 
     *ram_memory = ram;
     memory_region_add_subregion(system_memory, 0, ram);
@@ -396,6 +486,19 @@ static bool machine_get_short_animation(Object *obj, Error **errp)
     return ms->short_animation;
 }
 
+static void machine_set_huge_pages(Object *obj, bool value, Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+
+    ms->huge_pages = value;
+}
+
+static bool machine_get_huge_pages(Object *obj, Error **errp)
+{
+    XboxMachineState *ms = XBOX_MACHINE(obj);
+    return ms->huge_pages;
+}
+
 static char *machine_get_smc_version(Object *obj, Error **errp)
 {
     XboxMachineState *ms = XBOX_MACHINE(obj);
@@ -482,6 +585,11 @@ static void xbox_machine_options(MachineClass *m)
     object_class_property_set_description(oc, "short-animation",
                                           "Skip Xbox boot animation");
 
+    object_class_property_add_bool(oc, "huge-pages", machine_get_huge_pages,
+                                   machine_set_huge_pages);
+    object_class_property_set_description(oc, "huge-pages",
+                                          "Back RAM with huge pages");
+
     object_class_property_add_str(oc, "smc-version", machine_get_smc_version,
                                   machine_set_smc_version);
     object_class_property_set_description(
@@ -500,6 +608,7 @@ static inline void xbox_machine_initfn(Object *obj)
 {
     object_property_set_str(obj, "avpack", "hdtv", &error_fatal);
     object_property_set_bool(obj, "short-animation", false, &error_fatal);
+    object_property_set_bool(obj, "huge-pages", false, &error_fatal);
     object_property_set_str(obj, "smc-version", "P01", &error_fatal);
     object_property_set_str(obj, "video-encoder", "conexant", &error_fatal);
 }
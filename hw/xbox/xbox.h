@@ -47,6 +47,7 @@ typedef struct XboxMachineState {
     bool short_animation;
     char *smc_version;
     char *video_encoder;
+    bool huge_pages;
 } XboxMachineState;
 
 typedef struct XboxMachineClass {
@@ -0,0 +1,115 @@
+/*
+ * QEMU Xbox host memory accounting
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "hw/boards.h"
+#include "system/tcg.h"
+#ifdef CONFIG_TCG
+#include "tcg/tcg.h"
+#endif
+#include "xbox_mem.h"
+
+static const char *const xbox_mem_names[XBOX_MEM__COUNT] = {
+    #define _X(x, name) [x] = name,
+    XBOX_MEM_CATEGORIES_XMAC
+    #undef _X
+};
+
+static int64_t xbox_mem_bytes[XBOX_MEM__COUNT];
+static int64_t xbox_mem_peaks[XBOX_MEM__COUNT];
+static int64_t xbox_mem_total;
+static int64_t xbox_mem_total_peak;
+
+static void xbox_mem_raise_peak(int64_t *peak, int64_t value)
+{
+    int64_t old = qatomic_read(peak);
+    while (value > old) {
+        int64_t seen = qatomic_cmpxchg(peak, old, value);
+        if (seen == old) {
+            break;
+        }
+        old = seen;
+    }
+}
+
+void xbox_mem_add(XboxMemCategory cat, int64_t delta)
+{
+    assert(cat < XBOX_MEM__COUNT);
+    if (!delta) {
+        return;
+    }
+
+    int64_t bytes = qatomic_add_fetch(&xbox_mem_bytes[cat], delta);
+    int64_t total = qatomic_add_fetch(&xbox_mem_total, delta);
+    assert(bytes >= 0);
+    if (delta > 0) {
+        xbox_mem_raise_peak(&xbox_mem_peaks[cat], bytes);
+        xbox_mem_raise_peak(&xbox_mem_total_peak, total);
+    }
+}
+
+void xbox_mem_set(XboxMemCategory cat, uint64_t bytes)
+{
+    assert(cat < XBOX_MEM__COUNT);
+    int64_t old = qatomic_xchg(&xbox_mem_bytes[cat], (int64_t)bytes);
+    int64_t total = qatomic_add_fetch(&xbox_mem_total, (int64_t)bytes - old);
+    xbox_mem_raise_peak(&xbox_mem_peaks[cat], bytes);
+    xbox_mem_raise_peak(&xbox_mem_total_peak, total);
+}
+
+void xbox_mem_update(void)
+{
+#ifdef CONFIG_TCG
+    if (tcg_enabled()) {
+        xbox_mem_set(XBOX_MEM_TCG_CODE, tcg_code_size());
+    }
+#endif
+    if (current_machine) {
+        xbox_mem_set(XBOX_MEM_GUEST_RAM, current_machine->ram_size);
+    }
+}
+
+const char *xbox_mem_get_name(XboxMemCategory cat)
+{
+    assert(cat < XBOX_MEM__COUNT);
+    return xbox_mem_names[cat];
+}
+
+uint64_t xbox_mem_get(XboxMemCategory cat)
+{
+    assert(cat < XBOX_MEM__COUNT);
+    return qatomic_read(&xbox_mem_bytes[cat]);
+}
+
+uint64_t xbox_mem_get_peak(XboxMemCategory cat)
+{
+    assert(cat < XBOX_MEM__COUNT);
+    return qatomic_read(&xbox_mem_peaks[cat]);
+}
+
+uint64_t xbox_mem_get_total(void)
+{
+    return qatomic_read(&xbox_mem_total);
+}
+
+uint64_t xbox_mem_get_total_peak(void)
+{
+    return qatomic_read(&xbox_mem_total_peak);
+}
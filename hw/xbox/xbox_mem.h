@@ -0,0 +1,72 @@
+/*
+ * QEMU Xbox host memory accounting
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_XBOX_MEM_H
+#define HW_XBOX_XBOX_MEM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Host and GPU memory in use by each part of the emulator, with the most
+ * used at once. Owners report allocations as they make them, from any thread.
+ */
+#define XBOX_MEM_CATEGORIES_XMAC \
+    _X(XBOX_MEM_VK_TEXTURE, "vk_textures") \
+    _X(XBOX_MEM_VK_SURFACE, "vk_surfaces") \
+    _X(XBOX_MEM_VK_RECYCLED_IMAGE, "vk_recycled_images") \
+    _X(XBOX_MEM_VK_STAGING, "vk_staging_buffers") \
+    _X(XBOX_MEM_VK_VERTEX, "vk_vertex_buffers") \
+    _X(XBOX_MEM_VK_UNIFORM, "vk_uniform_buffers") \
+    _X(XBOX_MEM_VK_COMPUTE, "vk_compute_buffers") \
+    _X(XBOX_MEM_GL_TEXTURE, "gl_textures") \
+    _X(XBOX_MEM_GL_SURFACE, "gl_surfaces") \
+    _X(XBOX_MEM_GL_BUFFER, "gl_buffers") \
+    _X(XBOX_MEM_SHADER_CACHE, "shader_cache") \
+    _X(XBOX_MEM_APU, "apu") \
+    _X(XBOX_MEM_TCG_CODE, "tcg_code") \
+    _X(XBOX_MEM_GUEST_RAM, "guest_ram") \
+
+typedef enum XboxMemCategory {
+    #define _X(x, name) x,
+    XBOX_MEM_CATEGORIES_XMAC
+    #undef _X
+    XBOX_MEM__COUNT
+} XboxMemCategory;
+
+void xbox_mem_add(XboxMemCategory cat, int64_t delta);
+void xbox_mem_set(XboxMemCategory cat, uint64_t bytes);
+
+/* Refreshes the categories that are measured rather than reported */
+void xbox_mem_update(void);
+
+const char *xbox_mem_get_name(XboxMemCategory cat);
+uint64_t xbox_mem_get(XboxMemCategory cat);
+uint64_t xbox_mem_get_peak(XboxMemCategory cat);
+uint64_t xbox_mem_get_total(void);
+uint64_t xbox_mem_get_total_peak(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * QEMU Xbox performance telemetry
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc-i386.h"
+#include "qapi/qapi-events-misc-i386.h"
+#include "qapi/type-helpers.h"
+#include "monitor/monitor.h"
+#include "hw/xbox/nv2a/debug.h"
+#include "hw/xbox/mcpx/apu/apu_debug.h"
+#include "hw/xbox/xbox_mem.h"
+
+#define PERF_EVENT_DEFAULT_INTERVAL_MS 1000
+
+static QEMUTimer *perf_event_timer;
+static uint32_t perf_event_interval_ms;
+
+static XemuPerf *xbox_perf_collect(void)
+{
+    XemuPerf *perf = g_new0(XemuPerf, 1);
+
+    /*
+     * The renderer updates the statistics on its own thread, a frame may be
+     * torn but this is only telemetry.
+     */
+    int num_frames = MIN(g_nv2a_stats.frame_count, NV2A_PROF_NUM_FRAMES);
+    double counters[NV2A_PROF__COUNT] = { 0 };
+    double mspf = 0, gpu_us = 0;
+    for (int i = 0; i < num_frames; i++) {
+        const typeof(g_nv2a_stats.frame_history[0]) *frame =
+            &g_nv2a_stats.frame_history[i];
+        mspf += frame->mspf;
+        gpu_us += frame->gpu_us;
+        for (int j = 0; j < NV2A_PROF__COUNT; j++) {
+            counters[j] += frame->counters[j];
+        }
+    }
+
+    perf->frames = g_nv2a_stats.frame_count;
+    perf->fps = g_nv2a_stats.increment_fps;
+    if (num_frames) {
+        perf->frame_time = mspf / num_frames;
+        perf->gpu_time = gpu_us / num_frames;
+    }
+
+    for (int i = NV2A_PROF__COUNT - 1; i >= 0; i--) {
+        if (!counters[i]) {
+            continue;
+        }
+        XemuPerfCounter *counter = g_new0(XemuPerfCounter, 1);
+        counter->name = g_strdup(nv2a_profile_get_counter_name(i));
+        counter->value = counters[i] / num_frames;
+        QAPI_LIST_PREPEND(perf->counters, counter);
+    }
+
+    for (int i = NV2A_PROF_CACHE__COUNT - 1; i >= 0; i--) {
+        const typeof(g_nv2a_stats.caches[0]) *c = &g_nv2a_stats.caches[i];
+        if (!c->capacity) {
+            continue;
+        }
+        XemuPerfCache *cache = g_new0(XemuPerfCache, 1);
+        cache->name = g_strdup(nv2a_profile_get_cache_name(i));
+        cache->used = c->used;
+        cache->capacity = c->capacity;
+        cache->hits = c->hits;
+        cache->misses = c->misses;
+        cache->evictions = c->evictions;
+        if (c->hits + c->misses) {
+            cache->hit_rate = (double)c->hits / (c->hits + c->misses);
+        }
+        QAPI_LIST_PREPEND(perf->caches, cache);
+    }
+
+    perf->vram_budget = g_nv2a_stats.vram.budget;
+    perf->vram_usage = g_nv2a_stats.vram.usage;
+    perf->vram_textures = g_nv2a_stats.vram.texture_bytes;
+    perf->vram_surfaces = g_nv2a_stats.vram.surface_bytes;
+    perf->vram_allocations = g_nv2a_stats.vram.allocations;
+    perf->vram_allocation_bytes = g_nv2a_stats.vram.allocation_bytes;
+
+    xbox_mem_update();
+    for (int i = XBOX_MEM__COUNT - 1; i >= 0; i--) {
+        if (!xbox_mem_get_peak(i)) {
+            continue;
+        }
+        XemuPerfMemory *mem = g_new0(XemuPerfMemory, 1);
+        mem->name = g_strdup(xbox_mem_get_name(i));
+        mem->bytes = xbox_mem_get(i);
+        mem->peak = xbox_mem_get_peak(i);
+        QAPI_LIST_PREPEND(perf->memory, mem);
+    }
+    perf->memory_total = xbox_mem_get_total();
+    perf->memory_peak = xbox_mem_get_total_peak();
+
+    const struct McpxApuDebug *apu = mcpx_apu_get_debug_info();
+    perf->apu_utilization = apu->utilization;
+    perf->gp_cycles = apu->gp.cycles;
+    perf->ep_cycles = apu->ep.cycles;
+
+    return perf;
+}
+
+XemuPerf *qmp_x_query_xemu_perf(Error **errp)
+{
+    return xbox_perf_collect();
+}
+
+static void xbox_perf_event_tick(void *opaque)
+{
+    XemuPerf *perf = xbox_perf_collect();
+    qapi_event_send_xemu_perf(perf);
+    qapi_free_XemuPerf(perf);
+
+    timer_mod(perf_event_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                    perf_event_interval_ms);
+}
+
+void qmp_x_xemu_perf_events(bool enable, bool has_interval, uint32_t interval,
+                            Error **errp)
+{
+    if (!enable) {
+        if (perf_event_timer) {
+            timer_del(perf_event_timer);
+        }
+        return;
+    }
+
+    if (has_interval && !interval) {
+        error_setg(errp, "Parameter 'interval' must be positive");
+        return;
+    }
+
+    perf_event_interval_ms =
+        has_interval ? interval : PERF_EVENT_DEFAULT_INTERVAL_MS;
+    if (!perf_event_timer) {
+        perf_event_timer =
+            timer_new_ms(QEMU_CLOCK_REALTIME, xbox_perf_event_tick, NULL);
+    }
+    timer_mod(perf_event_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                    perf_event_interval_ms);
+}
+
+static HumanReadableText *xbox_perf_query_hrt(Error **errp)
+{
+    g_autoptr(XemuPerf) perf = xbox_perf_collect();
+    g_autoptr(GString) buf = g_string_new(NULL);
+
+    g_string_append_printf(buf,
+                           "Frames: %" PRIu64 ", %" PRId64 " FPS, "
+                           "%.2f ms/frame, GPU %.2f ms/frame\n",
+                           perf->frames, perf->fps, perf->frame_time,
+                           perf->gpu_time / 1000.0);
+
+    for (XemuPerfCacheList *l = perf->caches; l; l = l->next) {
+        XemuPerfCache *c = l->value;
+        g_string_append_printf(buf,
+                               "%s: %" PRId64 "/%" PRId64 " used, "
+                               "%" PRIu64 " hits, %" PRIu64 " misses "
+                               "(%.1f%% hit rate), %" PRIu64 " evictions\n",
+                               c->name, c->used, c->capacity, c->hits,
+                               c->misses, c->hit_rate * 100, c->evictions);
+    }
+
+    if (perf->vram_budget) {
+        const double mib = 1024.0 * 1024.0;
+        g_string_append_printf(buf,
+                               "VRAM: %.0f/%.0f MiB, textures %.0f MiB, "
+                               "surfaces %.0f MiB, %" PRIu64
+                               " allocations (%.0f MiB)\n",
+                               perf->vram_usage / mib,
+                               perf->vram_budget / mib,
+                               perf->vram_textures / mib,
+                               perf->vram_surfaces / mib,
+                               perf->vram_allocations,
+                               perf->vram_allocation_bytes / mib);
+    }
+
+    g_string_append_printf(buf,
+                           "Memory: %.1f MiB, peak %.1f MiB\n",
+                           perf->memory_total / (1024.0 * 1024.0),
+                           perf->memory_peak / (1024.0 * 1024.0));
+    for (XemuPerfMemoryList *l = perf->memory; l; l = l->next) {
+        g_string_append_printf(buf, "  %s: %.1f MiB, peak %.1f MiB\n",
+                               l->value->name,
+                               l->value->bytes / (1024.0 * 1024.0),
+                               l->value->peak / (1024.0 * 1024.0));
+    }
+
+    g_string_append_printf(buf,
+                           "APU: %.1f%% utilization, GP %" PRId64
+                           " cycles, EP %" PRId64 " cycles\n",
+                           perf->apu_utilization * 100, perf->gp_cycles,
+                           perf->ep_cycles);
+
+    g_string_append(buf, "Counters per frame:\n");
+    for (XemuPerfCounterList *l = perf->counters; l; l = l->next) {
+        g_string_append_printf(buf, "  %s: %.1f\n", l->value->name,
+                               l->value->value);
+    }
+
+    return human_readable_text_from_str(buf);
+}
+
+static void xbox_perf_register(void)
+{
+    monitor_register_hmp_info_hrt("xemu-perf", xbox_perf_query_hrt);
+}
+
+type_init(xbox_perf_register)
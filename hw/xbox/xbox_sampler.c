@@ -0,0 +1,795 @@
+/*
+ * QEMU Xbox sampling profiler
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/thread-stats.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "hw/core/cpu.h"
+#include "system/tcg.h"
+#ifdef CONFIG_TCG
+#include "exec/cpu-common.h"
+#include "exec/target_page.h"
+#include "exec/translation-block.h"
+#include "tcg/insn-start-words.h"
+#include "tcg/tcg.h"
+#endif
+#include "xemu-xbe.h"
+#include "xbox_sampler.h"
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+/* Most threads sampled at once */
+#define XBOX_SAMPLER_BATCH 64
+
+#define XBOX_SAMPLER_THREAD_NAME_LEN 32
+
+#define TRANSLATED_CODE_NAME "[translated code]"
+
+typedef struct Sample {
+    uintptr_t host_pc;
+    int64_t guest_pc; /* Linear address, -1 outside of translated code */
+    int tid;
+    char thread_name[XBOX_SAMPLER_THREAD_NAME_LEN];
+} Sample;
+
+typedef struct SampleBatch {
+    Sample samples[XBOX_SAMPLER_BATCH];
+    int num_samples;
+} SampleBatch;
+
+/* Samples are kept as counts of each distinct location */
+typedef struct SampleCount {
+    uintptr_t host_pc;
+    int64_t guest_pc;
+    int tid;
+    uint64_t count;
+} SampleCount;
+
+typedef struct HostSymbol {
+    char *name;   /* Function, or module+offset if not found */
+    char *module; /* NULL if unknown */
+    uintptr_t base;
+    bool found;
+} HostSymbol;
+
+static struct {
+    bool initialized;
+    bool running;
+    QemuThread thread;
+
+    /* Protects the samples, which are recorded by the sampler thread */
+    QemuMutex lock;
+    GHashTable *counts;       /* SampleCount -> itself */
+    GHashTable *thread_names; /* tid -> name */
+    uint64_t total_samples;
+    int64_t start_time_ns;
+
+    /* Only used for reports, so with the BQL held */
+    GHashTable *symbols; /* host pc -> HostSymbol */
+    uintptr_t exe_base;
+} sampler;
+
+static guint sample_count_hash(gconstpointer key)
+{
+    const SampleCount *c = key;
+    uint64_t h = c->host_pc ^ ((uint64_t)c->guest_pc << 20) ^ c->tid;
+    return h ^ (h >> 32);
+}
+
+static gboolean sample_count_equal(gconstpointer a, gconstpointer b)
+{
+    const SampleCount *ca = a, *cb = b;
+    return ca->host_pc == cb->host_pc && ca->guest_pc == cb->guest_pc &&
+           ca->tid == cb->tid;
+}
+
+static void host_symbol_free(gpointer data)
+{
+    HostSymbol *sym = data;
+    g_free(sym->name);
+    g_free(sym->module);
+    g_free(sym);
+}
+
+static void xbox_sampler_init(void)
+{
+    if (sampler.initialized) {
+        return;
+    }
+
+    qemu_mutex_init(&sampler.lock);
+    sampler.counts = g_hash_table_new_full(sample_count_hash,
+                                           sample_count_equal, g_free, NULL);
+    sampler.thread_names = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    sampler.symbols = g_hash_table_new_full(NULL, NULL, NULL,
+                                            host_symbol_free);
+#ifndef _WIN32
+    Dl_info info;
+    if (dladdr((void *)xbox_sampler_init, &info)) {
+        sampler.exe_base = (uintptr_t)info.dli_fbase;
+    }
+#endif
+    sampler.initialized = true;
+}
+
+#ifdef CONFIG_TCG
+/* Called in the vCPU thread's SIGPROF handler, or with the thread stopped */
+static uintptr_t xbox_sampler_get_guest_pc(void *opaque)
+{
+    CPUState *cpu = opaque;
+    return cpu->cc->get_pc(cpu);
+}
+#endif
+
+static void xbox_sampler_sample(const ThreadStatsThread *thread, uintptr_t pc,
+                                uintptr_t context, void *opaque)
+{
+    SampleBatch *batch = opaque;
+
+    if (!pc || batch->num_samples == XBOX_SAMPLER_BATCH) {
+        return;
+    }
+
+    Sample *s = &batch->samples[batch->num_samples++];
+    s->host_pc = pc;
+    s->guest_pc = -1;
+    s->tid = thread->tid;
+    pstrcpy(s->thread_name, sizeof(s->thread_name), thread->name);
+
+#ifdef CONFIG_TCG
+    CPUState *cpu = first_cpu;
+    if (tcg_enabled() && cpu && thread->tid == cpu->thread_id &&
+        in_code_gen_buffer((const void *)(pc - tcg_splitwx_diff))) {
+        s->guest_pc = context;
+    }
+#endif
+}
+
+#ifdef CONFIG_TCG
+/*
+ * The guest pc read when the sample was taken is only kept up to date
+ * where translated code needs it, the unwind data of the translation block
+ * gives the instruction. The block may have been flushed since, which is
+ * rare enough to ignore.
+ */
+static int64_t xbox_sampler_unwind(CPUState *cpu, uintptr_t host_pc,
+                                   int64_t guest_pc)
+{
+    uint64_t data[INSN_START_WORDS];
+
+    if (!cpu_unwind_state_data(cpu, host_pc, data)) {
+        return guest_pc;
+    }
+
+    /* Per x86_restore_state_to_opc, data[0] is a linear address */
+    if (tcg_cflags_has(cpu, CF_PCREL)) {
+        return (guest_pc & TARGET_PAGE_MASK) | data[0];
+    }
+    return data[0];
+}
+#endif
+
+static void xbox_sampler_record(SampleBatch *batch)
+{
+    for (int i = 0; i < batch->num_samples; i++) {
+        Sample *s = &batch->samples[i];
+#ifdef CONFIG_TCG
+        if (s->guest_pc >= 0) {
+            s->guest_pc = xbox_sampler_unwind(first_cpu, s->host_pc,
+                                              s->guest_pc);
+        }
+#endif
+        SampleCount key = {
+            .host_pc = s->guest_pc >= 0 ? 0 : s->host_pc,
+            .guest_pc = s->guest_pc,
+            .tid = s->tid,
+        };
+
+        qemu_mutex_lock(&sampler.lock);
+        SampleCount *c = g_hash_table_lookup(sampler.counts, &key);
+        if (!c) {
+            c = g_memdup2(&key, sizeof(key));
+            g_hash_table_add(sampler.counts, c);
+        }
+        c->count++;
+        if (!g_hash_table_contains(sampler.thread_names,
+                                   GINT_TO_POINTER(s->tid))) {
+            g_hash_table_insert(sampler.thread_names, GINT_TO_POINTER(s->tid),
+                                g_strdup(s->thread_name));
+        }
+        sampler.total_samples++;
+        qemu_mutex_unlock(&sampler.lock);
+    }
+}
+
+static void *xbox_sampler_thread(void *opaque)
+{
+    g_autofree SampleBatch *batch = g_new(SampleBatch, 1);
+
+    while (qatomic_read(&sampler.running)) {
+        batch->num_samples = 0;
+        if (!thread_stats_sample(xbox_sampler_sample, batch)) {
+            break;
+        }
+        xbox_sampler_record(batch);
+        g_usleep(G_USEC_PER_SEC / XBOX_SAMPLER_HZ);
+    }
+
+    return NULL;
+}
+
+void xbox_sampler_start(void)
+{
+    xbox_sampler_init();
+    if (sampler.running) {
+        return;
+    }
+
+    qemu_mutex_lock(&sampler.lock);
+    if (!sampler.start_time_ns) {
+        sampler.start_time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    qemu_mutex_unlock(&sampler.lock);
+
+#ifdef CONFIG_TCG
+    if (tcg_enabled() && first_cpu) {
+        thread_stats_set_sample_context(first_cpu->thread_id,
+                                        xbox_sampler_get_guest_pc, first_cpu);
+    }
+#endif
+
+    qatomic_set(&sampler.running, true);
+    qemu_thread_create(&sampler.thread, "xbox.sampler", xbox_sampler_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+void xbox_sampler_stop(void)
+{
+    if (!sampler.running) {
+        return;
+    }
+
+    qatomic_set(&sampler.running, false);
+    qemu_thread_join(&sampler.thread);
+
+#ifdef CONFIG_TCG
+    if (tcg_enabled() && first_cpu) {
+        thread_stats_set_sample_context(first_cpu->thread_id, NULL, NULL);
+    }
+#endif
+}
+
+bool xbox_sampler_is_running(void)
+{
+    return sampler.running;
+}
+
+void xbox_sampler_reset(void)
+{
+    xbox_sampler_init();
+
+    qemu_mutex_lock(&sampler.lock);
+    g_hash_table_remove_all(sampler.counts);
+    g_hash_table_remove_all(sampler.thread_names);
+    sampler.total_samples = 0;
+    sampler.start_time_ns = sampler.running ?
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) : 0;
+    qemu_mutex_unlock(&sampler.lock);
+
+    /* Libraries may have been unloaded since */
+    g_hash_table_remove_all(sampler.symbols);
+}
+
+/* Copies the samples, which are then symbolized without the lock */
+static SampleCount *xbox_sampler_get_counts(int *num_counts)
+{
+    GHashTableIter iter;
+    SampleCount *c;
+
+    qemu_mutex_lock(&sampler.lock);
+    *num_counts = g_hash_table_size(sampler.counts);
+    SampleCount *counts = g_new(SampleCount, *num_counts);
+    int i = 0;
+    g_hash_table_iter_init(&iter, sampler.counts);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&c, NULL)) {
+        counts[i++] = *c;
+    }
+    qemu_mutex_unlock(&sampler.lock);
+
+    return counts;
+}
+
+static HostSymbol *xbox_sampler_get_symbol(uintptr_t pc)
+{
+    HostSymbol *sym = g_hash_table_lookup(sampler.symbols,
+                                          GSIZE_TO_POINTER(pc));
+    if (sym) {
+        return sym;
+    }
+
+    sym = g_new0(HostSymbol, 1);
+#ifdef _WIN32
+    HMODULE module;
+    char path[MAX_PATH];
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                               GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           (LPCSTR)pc, &module) &&
+        GetModuleFileNameA(module, path, sizeof(path))) {
+        sym->module = g_strdup(path);
+        sym->base = (uintptr_t)module;
+    }
+#else
+    /*
+     * The executable does not export its functions, so the nearest dynamic
+     * symbol there is unrelated.
+     */
+    Dl_info info;
+    if (dladdr((void *)pc, &info) && info.dli_fname) {
+        sym->module = g_strdup(info.dli_fname);
+        sym->base = (uintptr_t)info.dli_fbase;
+        if (info.dli_sname && sym->base != sampler.exe_base) {
+            sym->name = g_strdup(info.dli_sname);
+            sym->found = true;
+        }
+    }
+#endif
+    if (!sym->name) {
+        if (sym->module) {
+            g_autofree char *module = g_path_get_basename(sym->module);
+            sym->name = g_strdup_printf("%s+0x%" PRIxPTR, module,
+                                        pc - sym->base);
+        } else {
+            sym->name = g_strdup_printf("0x%" PRIxPTR, pc);
+        }
+    }
+
+    g_hash_table_insert(sampler.symbols, GSIZE_TO_POINTER(pc), sym);
+    return sym;
+}
+
+static const char *xbox_sampler_get_section(struct xbe *xbe, int64_t pc)
+{
+    if (pc >= 0x80000000) {
+        return "kernel";
+    }
+
+    const char *name = xbe ? xemu_get_xbe_section_name(xbe, pc) : NULL;
+    return name ? name : "guest";
+}
+
+static void xbox_sampler_add_entry(GHashTable *entries, const char *name,
+                                   uint64_t samples)
+{
+    uint64_t *total = g_hash_table_lookup(entries, name);
+    if (!total) {
+        total = g_new0(uint64_t, 1);
+        g_hash_table_insert(entries, g_strdup(name), total);
+    }
+    *total += samples;
+}
+
+static int xbox_sampler_compare_entries(const void *a, const void *b)
+{
+    const XboxSamplerEntry *ea = a, *eb = b;
+    if (ea->samples != eb->samples) {
+        return ea->samples > eb->samples ? -1 : 1;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+static XboxSamplerEntry *xbox_sampler_sort_entries(GHashTable *entries,
+                                                   int *num_entries)
+{
+    GHashTableIter iter;
+    const char *name;
+    uint64_t *samples;
+
+    *num_entries = g_hash_table_size(entries);
+    XboxSamplerEntry *sorted = g_new(XboxSamplerEntry, *num_entries);
+    int i = 0;
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&name,
+                                  (gpointer *)&samples)) {
+        sorted[i++] = (XboxSamplerEntry){ g_strdup(name), *samples };
+    }
+    qsort(sorted, *num_entries, sizeof(*sorted),
+          xbox_sampler_compare_entries);
+
+    return sorted;
+}
+
+XboxSamplerProfile *xbox_sampler_get_profile(void)
+{
+    xbox_sampler_init();
+
+    int num_counts;
+    g_autofree SampleCount *counts = xbox_sampler_get_counts(&num_counts);
+    struct xbe *xbe = xemu_get_xbe_info();
+    g_autoptr(GHashTable) modules =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_autoptr(GHashTable) host =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_autoptr(GHashTable) sections =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_autoptr(GHashTable) guest =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    XboxSamplerProfile *profile = g_new0(XboxSamplerProfile, 1);
+
+    for (int i = 0; i < num_counts; i++) {
+        SampleCount *c = &counts[i];
+        profile->total_samples += c->count;
+
+        if (c->guest_pc < 0) {
+            HostSymbol *sym = xbox_sampler_get_symbol(c->host_pc);
+            g_autofree char *module =
+                sym->module ? g_path_get_basename(sym->module) :
+                              g_strdup("unknown");
+            xbox_sampler_add_entry(modules, module, c->count);
+            xbox_sampler_add_entry(host, sym->name, c->count);
+            continue;
+        }
+
+        const char *section = xbox_sampler_get_section(xbe, c->guest_pc);
+        g_autofree char *insn = g_strdup_printf("%s:0x%08" PRIx64, section,
+                                                c->guest_pc);
+        profile->guest_samples += c->count;
+        xbox_sampler_add_entry(modules, TRANSLATED_CODE_NAME, c->count);
+        xbox_sampler_add_entry(host, TRANSLATED_CODE_NAME, c->count);
+        xbox_sampler_add_entry(sections, section, c->count);
+        xbox_sampler_add_entry(guest, insn, c->count);
+    }
+
+    profile->modules = xbox_sampler_sort_entries(modules,
+                                                 &profile->num_modules);
+    profile->host = xbox_sampler_sort_entries(host, &profile->num_host);
+    profile->sections = xbox_sampler_sort_entries(sections,
+                                                  &profile->num_sections);
+    profile->guest = xbox_sampler_sort_entries(guest, &profile->num_guest);
+
+    return profile;
+}
+
+static void xbox_sampler_free_entries(XboxSamplerEntry *entries,
+                                      int num_entries)
+{
+    for (int i = 0; i < num_entries; i++) {
+        g_free(entries[i].name);
+    }
+    g_free(entries);
+}
+
+void xbox_sampler_free_profile(XboxSamplerProfile *profile)
+{
+    xbox_sampler_free_entries(profile->modules, profile->num_modules);
+    xbox_sampler_free_entries(profile->host, profile->num_host);
+    xbox_sampler_free_entries(profile->sections, profile->num_sections);
+    xbox_sampler_free_entries(profile->guest, profile->num_guest);
+    g_free(profile);
+}
+
+/*
+ * Just enough of the protobuf wire format to write a profile.proto, see
+ * https://github.com/google/pprof/blob/main/proto/profile.proto
+ */
+enum {
+    PPROF_PROFILE_SAMPLE_TYPE = 1,
+    PPROF_PROFILE_SAMPLE = 2,
+    PPROF_PROFILE_MAPPING = 3,
+    PPROF_PROFILE_LOCATION = 4,
+    PPROF_PROFILE_FUNCTION = 5,
+    PPROF_PROFILE_STRING_TABLE = 6,
+    PPROF_PROFILE_TIME_NANOS = 9,
+    PPROF_PROFILE_DURATION_NANOS = 10,
+    PPROF_PROFILE_PERIOD_TYPE = 11,
+    PPROF_PROFILE_PERIOD = 12,
+
+    PPROF_VALUE_TYPE_TYPE = 1,
+    PPROF_VALUE_TYPE_UNIT = 2,
+
+    PPROF_SAMPLE_LOCATION_ID = 1,
+    PPROF_SAMPLE_VALUE = 2,
+    PPROF_SAMPLE_LABEL = 3,
+
+    PPROF_LABEL_KEY = 1,
+    PPROF_LABEL_STR = 2,
+
+    PPROF_MAPPING_ID = 1,
+    PPROF_MAPPING_MEMORY_START = 2,
+    PPROF_MAPPING_MEMORY_LIMIT = 3,
+    PPROF_MAPPING_FILENAME = 5,
+
+    PPROF_LOCATION_ID = 1,
+    PPROF_LOCATION_MAPPING_ID = 2,
+    PPROF_LOCATION_ADDRESS = 3,
+    PPROF_LOCATION_LINE = 4,
+
+    PPROF_LINE_FUNCTION_ID = 1,
+
+    PPROF_FUNCTION_ID = 1,
+    PPROF_FUNCTION_NAME = 2,
+};
+
+static void pb_varint(GByteArray *buf, uint64_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        g_byte_array_append(buf, &byte, 1);
+    } while (value);
+}
+
+static void pb_uint(GByteArray *buf, int field, uint64_t value)
+{
+    pb_varint(buf, field << 3);
+    pb_varint(buf, value);
+}
+
+static void pb_bytes(GByteArray *buf, int field, const void *data, size_t len)
+{
+    pb_varint(buf, field << 3 | 2);
+    pb_varint(buf, len);
+    g_byte_array_append(buf, data, len);
+}
+
+/* Appends @msg as a field of @buf, then clears it for the next message */
+static void pb_message(GByteArray *buf, int field, GByteArray *msg)
+{
+    pb_bytes(buf, field, msg->data, msg->len);
+    g_byte_array_set_size(msg, 0);
+}
+
+typedef struct PprofWriter {
+    GByteArray *profile;
+    GByteArray *msg;
+    GByteArray *sub;
+    GHashTable *strings;   /* string -> index */
+    GPtrArray *string_table;
+    GHashTable *functions; /* name -> id */
+    GHashTable *mappings;  /* module -> PprofMapping */
+    GHashTable *host_locations;  /* host pc -> id */
+    GHashTable *guest_locations; /* guest pc -> id */
+    uint64_t next_location_id;
+} PprofWriter;
+
+typedef struct PprofMapping {
+    uint64_t id;
+    uintptr_t start;
+    uintptr_t limit;
+    const char *filename;
+} PprofMapping;
+
+static uint64_t pprof_string(PprofWriter *w, const char *str)
+{
+    gpointer index;
+    if (g_hash_table_lookup_extended(w->strings, str, NULL, &index)) {
+        return GPOINTER_TO_UINT(index);
+    }
+
+    char *copy = g_strdup(str);
+    g_hash_table_insert(w->strings, copy,
+                        GUINT_TO_POINTER(w->string_table->len));
+    g_ptr_array_add(w->string_table, copy);
+    return w->string_table->len - 1;
+}
+
+static void pprof_value_type(PprofWriter *w, int field, const char *type,
+                             const char *unit)
+{
+    pb_uint(w->msg, PPROF_VALUE_TYPE_TYPE, pprof_string(w, type));
+    pb_uint(w->msg, PPROF_VALUE_TYPE_UNIT, pprof_string(w, unit));
+    pb_message(w->profile, field, w->msg);
+}
+
+static uint64_t pprof_function(PprofWriter *w, const char *name)
+{
+    uint64_t id = GPOINTER_TO_UINT(g_hash_table_lookup(w->functions, name));
+    if (id) {
+        return id;
+    }
+
+    id = g_hash_table_size(w->functions) + 1;
+    g_hash_table_insert(w->functions, g_strdup(name), GUINT_TO_POINTER(id));
+    pb_uint(w->msg, PPROF_FUNCTION_ID, id);
+    pb_uint(w->msg, PPROF_FUNCTION_NAME, pprof_string(w, name));
+    pb_message(w->profile, PPROF_PROFILE_FUNCTION, w->msg);
+    return id;
+}
+
+/*
+ * Functions are only given where the symbol was found, pprof resolves the
+ * others from the mapping's file.
+ */
+static uint64_t pprof_host_location(PprofWriter *w, uintptr_t pc)
+{
+    uint64_t id = GPOINTER_TO_UINT(
+        g_hash_table_lookup(w->host_locations, GSIZE_TO_POINTER(pc)));
+    if (id) {
+        return id;
+    }
+
+    HostSymbol *sym = xbox_sampler_get_symbol(pc);
+    PprofMapping *mapping = NULL;
+    if (sym->module) {
+        mapping = g_hash_table_lookup(w->mappings, sym->module);
+        if (!mapping) {
+            mapping = g_new0(PprofMapping, 1);
+            mapping->id = g_hash_table_size(w->mappings) + 1;
+            mapping->start = sym->base;
+            mapping->filename = sym->module;
+            g_hash_table_insert(w->mappings, sym->module, mapping);
+        }
+        mapping->limit = MAX(mapping->limit, pc + 1);
+    }
+
+    uint64_t function_id = sym->found ? pprof_function(w, sym->name) : 0;
+
+    id = w->next_location_id++;
+    g_hash_table_insert(w->host_locations, GSIZE_TO_POINTER(pc),
+                        GUINT_TO_POINTER(id));
+    pb_uint(w->msg, PPROF_LOCATION_ID, id);
+    if (mapping) {
+        pb_uint(w->msg, PPROF_LOCATION_MAPPING_ID, mapping->id);
+    }
+    pb_uint(w->msg, PPROF_LOCATION_ADDRESS, pc);
+    if (function_id) {
+        pb_uint(w->sub, PPROF_LINE_FUNCTION_ID, function_id);
+        pb_message(w->msg, PPROF_LOCATION_LINE, w->sub);
+    }
+    pb_message(w->profile, PPROF_PROFILE_LOCATION, w->msg);
+    return id;
+}
+
+/* Guest code is attributed to a function per section */
+static uint64_t pprof_guest_location(PprofWriter *w, struct xbe *xbe,
+                                     int64_t pc)
+{
+    uint64_t id = GPOINTER_TO_UINT(
+        g_hash_table_lookup(w->guest_locations, GSIZE_TO_POINTER(pc)));
+    if (id) {
+        return id;
+    }
+
+    g_autofree char *name = g_strdup_printf(
+        "guest %s", xbox_sampler_get_section(xbe, pc));
+    uint64_t function_id = pprof_function(w, name);
+
+    id = w->next_location_id++;
+    g_hash_table_insert(w->guest_locations, GSIZE_TO_POINTER(pc),
+                        GUINT_TO_POINTER(id));
+    pb_uint(w->msg, PPROF_LOCATION_ID, id);
+    pb_uint(w->msg, PPROF_LOCATION_ADDRESS, pc);
+    pb_uint(w->sub, PPROF_LINE_FUNCTION_ID, function_id);
+    pb_message(w->msg, PPROF_LOCATION_LINE, w->sub);
+    pb_message(w->profile, PPROF_PROFILE_LOCATION, w->msg);
+    return id;
+}
+
+bool xbox_sampler_export_pprof(const char *path, Error **errp)
+{
+    xbox_sampler_init();
+
+    int num_counts;
+    g_autofree SampleCount *counts = xbox_sampler_get_counts(&num_counts);
+    struct xbe *xbe = xemu_get_xbe_info();
+    int64_t period = NANOSECONDS_PER_SECOND / XBOX_SAMPLER_HZ;
+    PprofWriter w = {
+        .profile = g_byte_array_new(),
+        .msg = g_byte_array_new(),
+        .sub = g_byte_array_new(),
+        .strings = g_hash_table_new(g_str_hash, g_str_equal),
+        .string_table = g_ptr_array_new_with_free_func(g_free),
+        .functions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL),
+        .mappings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                          g_free),
+        .host_locations = g_hash_table_new(NULL, NULL),
+        .guest_locations = g_hash_table_new(NULL, NULL),
+        .next_location_id = 1,
+    };
+    pprof_string(&w, "");
+
+    pprof_value_type(&w, PPROF_PROFILE_SAMPLE_TYPE, "samples", "count");
+    pprof_value_type(&w, PPROF_PROFILE_SAMPLE_TYPE, "cpu", "nanoseconds");
+    pprof_value_type(&w, PPROF_PROFILE_PERIOD_TYPE, "cpu", "nanoseconds");
+    pb_uint(w.profile, PPROF_PROFILE_PERIOD, period);
+
+    qemu_mutex_lock(&sampler.lock);
+    int64_t start_time_ns = sampler.start_time_ns;
+    qemu_mutex_unlock(&sampler.lock);
+    if (start_time_ns) {
+        pb_uint(w.profile, PPROF_PROFILE_TIME_NANOS, start_time_ns);
+        pb_uint(w.profile, PPROF_PROFILE_DURATION_NANOS,
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time_ns);
+    }
+
+    uint64_t thread_key = pprof_string(&w, "thread");
+    for (int i = 0; i < num_counts; i++) {
+        SampleCount *c = &counts[i];
+        uint64_t location_id = c->guest_pc < 0 ?
+                                   pprof_host_location(&w, c->host_pc) :
+                                   pprof_guest_location(&w, xbe, c->guest_pc);
+
+        qemu_mutex_lock(&sampler.lock);
+        const char *thread_name = g_hash_table_lookup(
+            sampler.thread_names, GINT_TO_POINTER(c->tid));
+        uint64_t thread_index = pprof_string(&w, thread_name ?: "unknown");
+        qemu_mutex_unlock(&sampler.lock);
+
+        pb_varint(w.sub, location_id);
+        pb_message(w.msg, PPROF_SAMPLE_LOCATION_ID, w.sub);
+        pb_varint(w.sub, c->count);
+        pb_varint(w.sub, c->count * period);
+        pb_message(w.msg, PPROF_SAMPLE_VALUE, w.sub);
+        pb_uint(w.sub, PPROF_LABEL_KEY, thread_key);
+        pb_uint(w.sub, PPROF_LABEL_STR, thread_index);
+        pb_message(w.msg, PPROF_SAMPLE_LABEL, w.sub);
+        pb_message(w.profile, PPROF_PROFILE_SAMPLE, w.msg);
+    }
+
+    GHashTableIter iter;
+    PprofMapping *mapping;
+    g_hash_table_iter_init(&iter, w.mappings);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&mapping)) {
+        pb_uint(w.msg, PPROF_MAPPING_ID, mapping->id);
+        pb_uint(w.msg, PPROF_MAPPING_MEMORY_START, mapping->start);
+        pb_uint(w.msg, PPROF_MAPPING_MEMORY_LIMIT, mapping->limit);
+        pb_uint(w.msg, PPROF_MAPPING_FILENAME,
+                pprof_string(&w, mapping->filename));
+        pb_message(w.profile, PPROF_PROFILE_MAPPING, w.msg);
+    }
+
+    for (int i = 0; i < w.string_table->len; i++) {
+        const char *str = g_ptr_array_index(w.string_table, i);
+        pb_bytes(w.profile, PPROF_PROFILE_STRING_TABLE, str, strlen(str));
+    }
+
+    bool ok = true;
+    FILE *f = qemu_fopen(path, "wb");
+    if (!f) {
+        error_setg_errno(errp, errno, "Failed to open %s for writing", path);
+        ok = false;
+    } else {
+        bool failed = fwrite(w.profile->data, 1, w.profile->len, f) !=
+                      w.profile->len;
+        if (fclose(f) || failed) {
+            error_setg(errp, "Failed to write %s", path);
+            ok = false;
+        }
+    }
+
+    g_byte_array_free(w.profile, true);
+    g_byte_array_free(w.msg, true);
+    g_byte_array_free(w.sub, true);
+    g_hash_table_destroy(w.strings);
+    g_ptr_array_free(w.string_table, true);
+    g_hash_table_destroy(w.functions);
+    g_hash_table_destroy(w.mappings);
+    g_hash_table_destroy(w.host_locations);
+    g_hash_table_destroy(w.guest_locations);
+
+    return ok;
+}
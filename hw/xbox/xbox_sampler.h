@@ -0,0 +1,79 @@
+/*
+ * QEMU Xbox sampling profiler
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_XBOX_SAMPLER_H
+#define HW_XBOX_XBOX_SAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Error Error;
+
+/*
+ * While running, every thread that is using the CPU is sampled about this
+ * many times a second and its program counter recorded. Samples in
+ * translated code are attributed to the guest instruction being executed.
+ */
+#define XBOX_SAMPLER_HZ 1000
+
+typedef struct XboxSamplerEntry {
+    char *name;
+    uint64_t samples;
+} XboxSamplerEntry;
+
+/*
+ * Flat profile of the samples so far, each list sorted by most samples.
+ * Host functions are named from the dynamic symbol table, which does not
+ * cover the emulator's own functions: those are given as module+offset, to
+ * be resolved with the exported profile.
+ */
+typedef struct XboxSamplerProfile {
+    uint64_t total_samples;
+    uint64_t guest_samples;
+    XboxSamplerEntry *modules; /* Host modules, translated code as one */
+    int num_modules;
+    XboxSamplerEntry *host;
+    int num_host;
+    XboxSamplerEntry *sections; /* XBE sections and the kernel */
+    int num_sections;
+    XboxSamplerEntry *guest;    /* Guest instructions */
+    int num_guest;
+} XboxSamplerProfile;
+
+/* All of these are called with the BQL held */
+void xbox_sampler_start(void);
+void xbox_sampler_stop(void);
+bool xbox_sampler_is_running(void);
+void xbox_sampler_reset(void);
+
+XboxSamplerProfile *xbox_sampler_get_profile(void);
+void xbox_sampler_free_profile(XboxSamplerProfile *profile);
+
+/* Writes the samples as an uncompressed pprof profile.proto */
+bool xbox_sampler_export_pprof(const char *path, Error **errp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
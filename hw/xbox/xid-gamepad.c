@@ -20,6 +20,7 @@
  */
 
 #include "xid.h"
+#include "ui/xemu-settings.h"
 
 // #define DEBUG_XID
 #ifdef DEBUG_XID
@@ -137,6 +138,15 @@ static void usb_xid_gamepad_handle_data(USBDevice *dev, USBPacket *p)
     case USB_TOKEN_IN:
         if (p->ep->nr == GAMEPAD_IN_ENDPOINT_ID) {
             update_input(s);
+            /* Like the real controller, only report changes */
+            if (g_config.perf.coalesce_usb_frames && s->in_state_sent_valid &&
+                !memcmp(&s->in_state, &s->in_state_sent,
+                        sizeof(s->in_state))) {
+                p->status = USB_RET_NAK;
+                break;
+            }
+            s->in_state_sent = s->in_state;
+            s->in_state_sent_valid = true;
             usb_packet_copy(p, &s->in_state, s->in_state.bLength);
         } else {
             assert(false);
@@ -220,10 +230,20 @@ static const Property xid_properties[] = {
     DEFINE_PROP_UINT8("index", USBXIDGamepadState, device_index, 0),
 };
 
+/* The report the guest last got is not part of the state */
+static int usb_xbox_gamepad_post_load(void *opaque, int version_id)
+{
+    USBXIDGamepadState *s = opaque;
+
+    s->in_state_sent_valid = false;
+    return 0;
+}
+
 static const VMStateDescription vmstate_usb_xbox = {
     .name = TYPE_USB_XID_GAMEPAD,
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = usb_xbox_gamepad_post_load,
     .fields = (VMStateField[]){ VMSTATE_USB_DEVICE(dev, USBXIDGamepadState),
                                 // FIXME
                                 VMSTATE_END_OF_LIST() },
@@ -233,6 +253,7 @@ static const VMStateDescription vmstate_usb_xbox_s = {
     .name = TYPE_USB_XID_GAMEPAD_S,
     .version_id = 0,
     .minimum_version_id = 0,
+    .post_load = usb_xbox_gamepad_post_load,
     .fields = (VMStateField[]){ VMSTATE_USB_DEVICE(dev, USBXIDGamepadState),
                                 // FIXME
                                 VMSTATE_END_OF_LIST() },
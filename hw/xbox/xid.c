@@ -105,7 +105,10 @@ void update_input(USBXIDGamepadState *s)
 
 void usb_xid_handle_reset(USBDevice *dev)
 {
+    USBXIDGamepadState *s = (USBXIDGamepadState *)dev;
+
     DPRINTF("xid reset\n");
+    s->in_state_sent_valid = false;
 }
 
 void usb_xid_handle_control(USBDevice *dev, USBPacket *p,
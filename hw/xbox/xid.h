@@ -117,6 +117,8 @@ typedef struct USBXIDGamepadState {
     USBEndpoint *intr;
     const XIDDesc *xid_desc;
     XIDGamepadReport in_state;
+    XIDGamepadReport in_state_sent; /* Last one the guest got, if valid */
+    bool in_state_sent_valid;
     XIDGamepadReport in_state_capabilities;
     XIDGamepadOutputReport out_state;
     XIDGamepadOutputReport out_state_capabilities;
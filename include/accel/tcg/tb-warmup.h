@@ -0,0 +1,64 @@
+/*
+ * Translation block warm-up
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACCEL_TCG_TB_WARMUP_H
+#define ACCEL_TCG_TB_WARMUP_H
+
+/*
+ * Records the guest code that was translated, so that a later run of the
+ * same code can translate all of it up front rather than as it is first
+ * executed. Host code is not kept: the blocks are translated again, with
+ * whatever settings are current, after checking that the guest code in
+ * memory is still the one that was recorded.
+ *
+ * Only blocks in RAM that do not cross a page are recorded.
+ */
+
+/* Kept on disk as is, so the layout must not change */
+typedef struct TBWarmupRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t code_hash; /* fast_hash() of the guest code */
+    uint32_t flags;
+    uint16_t code_size;
+    uint8_t misses;     /* Runs in which the code was not found in memory */
+    uint8_t reserved;
+} TBWarmupRecord;
+
+/*
+ * Forgets what was recorded so far and starts recording again. The blocks
+ * of @records are translated by the vCPU before it executes its next one.
+ */
+void tb_warmup_start(const TBWarmupRecord *records, size_t num_records);
+
+/*
+ * Stops recording and returns the records, including those that could not
+ * be translated because their code was not in memory yet (unless that was
+ * the case for too many runs). If there are too many, the blocks executed
+ * most often in this run are kept.
+ */
+TBWarmupRecord *tb_warmup_stop(size_t *num_records);
+
+/*
+ * Translates the likely targets of direct branches while the vCPU is halted,
+ * so that they are ready when it gets to them.
+ */
+void tb_speculate_set_enabled(bool enabled);
+
+#endif
@@ -145,6 +145,16 @@ struct TranslationBlock {
     uintptr_t jmp_list_head;
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_dest[2];
+
+#ifdef XBOX
+    /*
+     * For "info jit": the times the TB was entered from the main loop or
+     * through lookup_and_goto_ptr, as opposed to a chained direct jump, and
+     * the unconditional jumps its translation followed instead of ending.
+     */
+    uint32_t exec_count;
+    uint16_t followed_jumps;
+#endif
 };
 
 /* The alignment given to TranslationBlock during allocation. */
@@ -31,6 +31,7 @@
 #include "qapi/qapi-types-machine.h"
 #include "qapi/qapi-types-run-state.h"
 #include "qemu/bitmap.h"
+#include "qemu/interval-tree.h"
 #include "qemu/rcu_queue.h"
 #include "qemu/queue.h"
 #include "qemu/lockcnt.h"
@@ -356,12 +357,20 @@ typedef union IcountDecr {
 typedef void (*MemAccessCallbackFunc)(void *opaque, MemoryRegion *mr, hwaddr addr, hwaddr len, bool write);
 
 typedef struct MemAccessCallback {
+    CPUState *cpu;
     MemoryRegion *mr;
     hwaddr addr;
     hwaddr len;
     MemAccessCallbackFunc func;
     void *opaque;
-    QTAILQ_ENTRY(MemAccessCallback) entry;
+    IntervalTreeNode node; // In mem_access_callbacks, by ram address
+    QSIMPLEQ_ENTRY(MemAccessCallback) pending_entry;
+    bool pending; // Queued in mem_access_callbacks_pending
+    bool inserted;
+    bool removed;
+    bool rearm; // Without TCG, trap to be enabled again on the next update
+    MemoryRegion *trap; // Without TCG, I/O overlay of the pages in mr
+    struct rcu_head rcu;
 } MemAccessCallback;
 #endif
 
@@ -546,7 +555,15 @@ struct CPUState {
     QTAILQ_HEAD(, CPUWatchpoint) watchpoints;
     CPUWatchpoint *watchpoint_hit;
 
-    QTAILQ_HEAD(, MemAccessCallback) mem_access_callbacks;
+    /*
+     * Access callbacks are only looked up and changed by the vCPU thread.
+     * Other threads queue changes under mem_access_callbacks_lock, which are
+     * applied in batches as safe work.
+     */
+    IntervalTreeRoot mem_access_callbacks;
+    QemuMutex mem_access_callbacks_lock;
+    QSIMPLEQ_HEAD(, MemAccessCallback) mem_access_callbacks_pending;
+    bool mem_access_callbacks_update_scheduled;
 
     void *opaque;
 
@@ -1191,6 +1208,13 @@ static inline bool cpu_breakpoint_test(CPUState *cpu, vaddr pc, int mask)
  * Note: Access to this watched memory can be slow: each access results in a
  * callback. This can be made faster, but for now just accept that CPU blitting
  * to a surface will be slower.
+ *
+ * With TCG, accesses are caught through the softmmu TLB. Other accelerators
+ * map the pages of each callback as an I/O region on top of the RAM instead,
+ * which is disabled at the first access so that the next ones run at full
+ * speed: mem_access_callback_rearm() enables it again once the memory needs
+ * to be watched again. Writes made in between are only seen through the
+ * dirty memory log.
  */
 
 MemAccessCallback *mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
@@ -1198,6 +1222,7 @@ MemAccessCallback *mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
                                               MemAccessCallbackFunc func,
                                               void *opaque);
 void mem_access_callback_remove_by_ref(CPUState *cpu, MemAccessCallback *cb);
+void mem_access_callback_rearm(CPUState *cpu, MemAccessCallback *cb);
 int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len);
 void mem_check_access_callback_ramaddr(CPUState *cpu,
                                        hwaddr ram_addr, vaddr len, int flags);
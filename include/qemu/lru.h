@@ -27,14 +27,22 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include "qemu/host-utils.h"
 #include "qemu/queue.h"
 
 #define LRU_NUM_BINS (1<<16)
 
+/*
+ * Bucket 0 counts nodes evicted right after their last use, bucket i those
+ * evicted [2^(i-1), 2^i) lookups after it, and the last any older.
+ */
+#define LRU_EVICTION_AGE_BUCKETS 16
+
 typedef struct LruNode {
 	QTAILQ_ENTRY(LruNode) next_global;
 	QTAILQ_ENTRY(LruNode) next_bin;
 	uint64_t hash;
+	uint64_t last_use; /* Lookups made up to its last use */
 } LruNode;
 
 typedef struct Lru Lru;
@@ -45,6 +53,14 @@ struct Lru {
 	int num_used;
 	int num_free;
 
+	/* Lookups which found a node, and which initialized one */
+	uint64_t hits;
+	uint64_t misses;
+
+	/* Nodes evicted to make room, by lookups since their last use */
+	uint64_t evictions;
+	uint64_t eviction_age[LRU_EVICTION_AGE_BUCKETS];
+
 	/* Initialize a node. */
 	void (*init_node)(Lru *lru, LruNode *node, const void *key);
 
@@ -71,6 +87,10 @@ void lru_init(Lru *lru)
 	lru->post_node_evict = NULL;
 	lru->num_free = 0;
 	lru->num_used = 0;
+	lru->hits = 0;
+	lru->misses = 0;
+	lru->evictions = 0;
+	memset(lru->eviction_age, 0, sizeof(lru->eviction_age));
 }
 
 static inline
@@ -116,6 +136,16 @@ void lru_evict_node(Lru *lru, LruNode *node)
 	lru->num_free += 1;
 }
 
+static inline
+void lru_account_eviction(Lru *lru, LruNode *node)
+{
+	uint64_t age = lru->hits + lru->misses - node->last_use;
+	unsigned int bucket = age ? 64 - clz64(age) : 0;
+
+	lru->evictions += 1;
+	lru->eviction_age[MIN(bucket, LRU_EVICTION_AGE_BUCKETS - 1)] += 1;
+}
+
 static inline
 LruNode *lru_try_evict_one(Lru *lru)
 {
@@ -124,6 +154,7 @@ LruNode *lru_try_evict_one(Lru *lru)
 	QTAILQ_FOREACH_REVERSE(found, &lru->global, next_global) {
 		if (lru_is_node_in_use(lru, found)
 			&& (!lru->pre_node_evict || lru->pre_node_evict(lru, found))) {
+			lru_account_eviction(lru, found);
 			lru_evict_node(lru, found);
 			return found;
 		}
@@ -186,6 +217,7 @@ LruNode *lru_lookup(Lru *lru, uint64_t hash, const void *key)
 
 	if (found) {
 		QTAILQ_REMOVE(&lru->bins[bin], found, next_bin);
+		lru->hits += 1;
 	} else {
 		found = lru_get_one_free(lru);
 		found->hash = hash;
@@ -196,8 +228,10 @@ LruNode *lru_lookup(Lru *lru, uint64_t hash, const void *key)
 
 		lru->num_used += 1;
 		lru->num_free -= 1;
+		lru->misses += 1;
 	}
 
+	found->last_use = lru->hits + lru->misses;
 	QTAILQ_REMOVE(&lru->global, found, next_global);
 	QTAILQ_INSERT_HEAD(&lru->global, found, next_global);
 	QTAILQ_INSERT_HEAD(&lru->bins[bin], found, next_bin);
@@ -19,6 +19,12 @@ enum QSPSortBy {
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
 
+/*
+ * Acquisitions of @obj (a mutex or the BQL) and the time spent waiting for
+ * it since the last reset, in ns.
+ */
+void qsp_get_obj_stats(const void *obj, uint64_t *n_acqs, uint64_t *ns);
+
 bool qsp_is_enabled(void);
 void qsp_enable(void);
 void qsp_disable(void);
@@ -0,0 +1,97 @@
+/*
+ * Per-thread CPU time and lock contention statistics
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QEMU_THREAD_STATS_H
+#define QEMU_THREAD_STATS_H
+
+/*
+ * Threads created with qemu_thread_create() are registered automatically,
+ * others (such as the UI thread or library callbacks) register themselves
+ * with thread_stats_register_self(). A thread is forgotten when it exits.
+ *
+ * Lock contention is measured by the synchronization profiler (see
+ * qsp_enable()) and reported for the locks registered with
+ * thread_stats_register_lock().
+ */
+
+typedef struct ThreadStatsThread {
+    const char *name;
+    int tid;
+    int64_t cpu_ns;     /* Since the thread started */
+    double utilization; /* Of one host CPU, over the last update interval */
+} ThreadStatsThread;
+
+typedef struct ThreadStatsLock {
+    const char *name;
+    uint64_t acquisitions; /* Since the profiler was last reset */
+    uint64_t wait_ns;
+    double wait_fraction; /* Of real time, over the last update interval */
+} ThreadStatsLock;
+
+typedef void (*ThreadStatsThreadFunc)(const ThreadStatsThread *thread,
+                                      void *opaque);
+typedef void (*ThreadStatsLockFunc)(const ThreadStatsLock *lock,
+                                    void *opaque);
+
+/*
+ * Called for a sample of a thread taken at @pc (0 if it cannot be read on
+ * this host), with the value its context function returned at the time.
+ * The thread is not stopped while the callback runs.
+ */
+typedef void (*ThreadStatsSampleFunc)(const ThreadStatsThread *thread,
+                                      uintptr_t pc, uintptr_t context,
+                                      void *opaque);
+
+/*
+ * Gives a value to record along with each sample of a thread. It is called
+ * from a signal handler in the thread, or with the thread stopped, so it
+ * may only read memory.
+ */
+typedef uintptr_t (*ThreadStatsContextFunc)(void *opaque);
+
+/* Does nothing if the calling thread is already registered */
+void thread_stats_register_self(const char *name);
+
+/* @name must outlive the lock, which must be registered only once */
+void thread_stats_register_lock(const char *name, const void *lock);
+void thread_stats_unregister_lock(const void *lock);
+
+/* Samples the CPU time and waits, to update the rates */
+void thread_stats_update(void);
+
+void thread_stats_foreach_thread(ThreadStatsThreadFunc func, void *opaque);
+void thread_stats_foreach_lock(ThreadStatsLockFunc func, void *opaque);
+
+/*
+ * Samples each registered thread other than the caller that used CPU time
+ * since it was last sampled, and passes the samples to @func. On Linux the
+ * threads are not stopped: a sample is taken in a SIGPROF handler, which is
+ * reserved for this, and passed on the next call. Returns false if threads
+ * cannot be sampled on this host.
+ */
+bool thread_stats_sample(ThreadStatsSampleFunc func, void *opaque);
+
+/*
+ * Sets the context function for the samples of the registered thread @tid,
+ * or clears it if @func is NULL. @opaque must stay valid until cleared.
+ */
+void thread_stats_set_sample_context(int tid, ThreadStatsContextFunc func,
+                                     void *opaque);
+
+#endif /* QEMU_THREAD_STATS_H */
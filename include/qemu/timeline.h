@@ -0,0 +1,76 @@
+/*
+ * Cross-thread timeline tracer
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QEMU_TIMELINE_H
+#define QEMU_TIMELINE_H
+
+#include "qemu/atomic.h"
+
+/*
+ * Zones are recorded into a ring owned by the recording thread, so recording
+ * takes no locks. Names and details must be string literals (or otherwise
+ * outlive the recording), only their pointers are stored.
+ *
+ *     int64_t t = timeline_begin();
+ *     ...
+ *     timeline_end("zone", "detail", t);
+ *
+ * While the tracer is stopped timeline_begin() returns 0 and timeline_end()
+ * does nothing.
+ */
+
+extern bool timeline_active;
+
+int64_t timeline_clock(void);
+
+static inline int64_t timeline_begin(void)
+{
+    return unlikely(qatomic_read(&timeline_active)) ? timeline_clock() : 0;
+}
+
+void timeline_record(const char *name, const char *detail, int64_t start);
+
+static inline void timeline_end(const char *name, const char *detail,
+                                int64_t start)
+{
+    if (unlikely(start)) {
+        timeline_record(name, detail, start);
+    }
+}
+
+/*
+ * Names the calling thread in the trace, threads created with
+ * qemu_thread_create() are named automatically.
+ */
+void timeline_set_thread_name(const char *name);
+
+void timeline_start(void);
+
+/*
+ * Stops recording and writes the zones in Chrome trace event format, which
+ * Perfetto and chrome://tracing open.
+ */
+bool timeline_stop(const char *path, Error **errp);
+
+static inline bool timeline_is_active(void)
+{
+    return qatomic_read(&timeline_active);
+}
+
+#endif /* QEMU_TIMELINE_H */
@@ -33,6 +33,11 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+#ifdef CONFIG_LINUX
+/* Datagrams moved per sendmmsg()/recvmmsg() call */
+#define NET_SOCKET_DGRAM_BATCH 8
+#endif
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -43,10 +48,22 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_LINUX
+    /* Datagram batching, see net_socket_dgram_flush() */
+    QEMUBH *tx_bh;
+    uint8_t *tx_buf;              /* NET_BUFSIZE bytes of queued datagrams */
+    size_t tx_len;
+    struct iovec tx_iov[NET_SOCKET_DGRAM_BATCH];
+    unsigned int tx_count;
+    uint8_t *rx_bufs;             /* NET_SOCKET_DGRAM_BATCH * NET_BUFSIZE */
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
+#ifdef CONFIG_LINUX
+static void net_socket_dgram_flush(NetSocketState *s);
+#endif
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
@@ -74,6 +91,13 @@ static void net_socket_writable(void *opaque)
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_LINUX
+    net_socket_dgram_flush(s);
+    if (s->tx_count) {
+        return;
+    }
+#endif
+
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -112,11 +136,100 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+#ifdef CONFIG_LINUX
+/*
+ * Sends the queued datagrams with as few sendmmsg() calls as the socket
+ * allows. If it fills up, the rest stay queued until it is writable.
+ */
+static void net_socket_dgram_flush(NetSocketState *s)
+{
+    struct mmsghdr msgs[NET_SOCKET_DGRAM_BATCH];
+    unsigned int sent = 0;
+
+    if (!s->tx_count) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < s->tx_count; i++) {
+        msgs[i] = (struct mmsghdr){
+            .msg_hdr = {
+                .msg_iov = &s->tx_iov[i],
+                .msg_iovlen = 1,
+            },
+        };
+        if (s->dgram_dst.sin_family != AF_UNIX) {
+            msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        }
+    }
+
+    while (sent < s->tx_count) {
+        int ret = RETRY_ON_EINTR(
+            sendmmsg(s->fd, &msgs[sent], s->tx_count - sent, 0));
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                s->tx_count -= sent;
+                memmove(s->tx_iov, &s->tx_iov[sent],
+                        s->tx_count * sizeof(s->tx_iov[0]));
+                net_socket_write_poll(s, true);
+                return;
+            }
+            /* Drop the datagram, as a failed sendto() would */
+            sent++;
+            continue;
+        }
+        sent += ret;
+    }
+
+    s->tx_count = 0;
+    s->tx_len = 0;
+}
+
+static void net_socket_dgram_flush_bh(void *opaque)
+{
+    net_socket_dgram_flush(opaque);
+}
+
+/*
+ * Queues a datagram to go out with the others sent before the main loop
+ * next runs, e.g. all frames of one NIC TX ring kick.
+ */
+static ssize_t net_socket_dgram_queue(NetSocketState *s, const uint8_t *buf,
+                                      size_t size)
+{
+    if (s->tx_count == NET_SOCKET_DGRAM_BATCH ||
+        s->tx_len + size > NET_BUFSIZE) {
+        net_socket_dgram_flush(s);
+        if (s->tx_count) {
+            /* Socket is full, hold it in the net queue until writable */
+            return 0;
+        }
+    }
+
+    uint8_t *dst = s->tx_buf + s->tx_len;
+    memcpy(dst, buf, size);
+    s->tx_iov[s->tx_count++] = (struct iovec){
+        .iov_base = dst,
+        .iov_len = size,
+    };
+    s->tx_len += size;
+    qemu_bh_schedule(s->tx_bh);
+
+    return size;
+}
+#endif
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+#ifdef CONFIG_LINUX
+    if (s->tx_buf && size <= NET_BUFSIZE) {
+        return net_socket_dgram_queue(s, buf, size);
+    }
+#endif
+
     ret = RETRY_ON_EINTR(
         s->dgram_dst.sin_family != AF_UNIX ?
             sendto(s->fd, buf, size, 0,
@@ -190,11 +303,65 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_LINUX
+/* Reads every datagram that is ready, up to a batch, with one recvmmsg() */
+static void net_socket_send_dgram_batch(NetSocketState *s)
+{
+    struct mmsghdr msgs[NET_SOCKET_DGRAM_BATCH];
+    struct iovec iov[NET_SOCKET_DGRAM_BATCH];
+    bool queued = false;
+
+    for (int i = 0; i < NET_SOCKET_DGRAM_BATCH; i++) {
+        iov[i] = (struct iovec){
+            .iov_base = s->rx_bufs + i * NET_BUFSIZE,
+            .iov_len = NET_BUFSIZE,
+        };
+        msgs[i] = (struct mmsghdr){
+            .msg_hdr = {
+                .msg_iov = &iov[i],
+                .msg_iovlen = 1,
+            },
+        };
+    }
+
+    int count = RETRY_ON_EINTR(
+        recvmmsg(s->fd, msgs, NET_SOCKET_DGRAM_BATCH, MSG_DONTWAIT, NULL));
+    if (count <= 0) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (msgs[i].msg_len == 0) {
+            /* end of connection */
+            net_socket_read_poll(s, false);
+            net_socket_write_poll(s, false);
+            return;
+        }
+        /* A peer that cannot take it now queues a copy */
+        if (qemu_send_packet_async(&s->nc, iov[i].iov_base, msgs[i].msg_len,
+                                   net_socket_send_completed) == 0) {
+            queued = true;
+        }
+    }
+
+    if (queued) {
+        net_socket_read_poll(s, false);
+    }
+}
+#endif
+
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
     int size;
 
+#ifdef CONFIG_LINUX
+    if (s->rx_bufs) {
+        net_socket_send_dgram_batch(s);
+        return;
+    }
+#endif
+
     size = recv(s->fd, s->rs.buf, sizeof(s->rs.buf), 0);
     if (size < 0)
         return;
@@ -320,6 +487,16 @@ static void net_socket_cleanup(NetClientState *nc)
         close(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_LINUX
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        s->tx_bh = NULL;
+    }
+    g_free(s->tx_buf);
+    s->tx_buf = NULL;
+    g_free(s->rx_bufs);
+    s->rx_bufs = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -383,6 +560,11 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
     net_socket_rs_init(&s->rs, net_socket_rs_finalize, false);
+#ifdef CONFIG_LINUX
+    s->tx_bh = qemu_bh_new(net_socket_dgram_flush_bh, s);
+    s->tx_buf = g_malloc(NET_BUFSIZE);
+    s->rx_bufs = g_malloc(NET_SOCKET_DGRAM_BATCH * NET_BUFSIZE);
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc-i386.h"
+
+void qmp_x_dsp_profile(bool enable, Error **errp)
+{
+    error_setg(errp, "DSP profiling is not available for this machine");
+}
+
+HumanReadableText *qmp_x_query_dsp_profile(Error **errp)
+{
+    error_setg(errp, "DSP profiling is not available for this machine");
+    return NULL;
+}
+
+HumanReadableText *qmp_x_query_apu_timing(Error **errp)
+{
+    error_setg(errp, "Audio timing is not available for this machine");
+    return NULL;
+}
+
+HumanReadableText *qmp_x_query_nvnet_stats(Error **errp)
+{
+    error_setg(errp, "Network statistics are not available for this machine");
+    return NULL;
+}
+
+void qmp_x_nvnet_reset_stats(Error **errp)
+{
+    error_setg(errp, "Network statistics are not available for this machine");
+}
+
+XemuPerf *qmp_x_query_xemu_perf(Error **errp)
+{
+    error_setg(errp, "Telemetry is not available for this machine");
+    return NULL;
+}
+
+void qmp_x_xemu_perf_events(bool enable, bool has_interval, uint32_t interval,
+                            Error **errp)
+{
+    error_setg(errp, "Telemetry is not available for this machine");
+}
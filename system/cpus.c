@@ -35,6 +35,7 @@
 #include "system/hw_accel.h"
 #include "exec/cpu-common.h"
 #include "qemu/thread.h"
+#include "qemu/thread-stats.h"
 #include "qemu/main-loop.h"
 #include "qemu/plugin.h"
 #include "system/cpus.h"
@@ -430,6 +431,7 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_mutex_init(&bql);
+    thread_stats_register_lock("BQL", &bql);
 
     qemu_thread_get_self(&io_thread);
 }
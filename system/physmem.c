@@ -844,34 +844,183 @@ AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx)
 
 #ifdef XBOX
 
-static inline bool access_callback_address_matches(MemAccessCallback *cb,
-                                                   hwaddr addr, hwaddr len)
+int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len)
+{
+    return interval_tree_iter_first(&cpu->mem_access_callbacks, addr,
+                                    addr + len - 1) ?
+               BP_MEM_READ | BP_MEM_WRITE :
+               0;
+}
+
+/*
+ * Without TCG there is no TLB to catch accesses with, so the pages of each
+ * callback are overlaid with an I/O region, which makes any accelerator exit
+ * to QEMU on access. The access is then made on the RAM underneath.
+ */
+static void mem_access_trap_hit(MemAccessCallback *cb, hwaddr addr,
+                                unsigned size, bool write)
+{
+    CPUState *cpu = cb->cpu;
+    ram_addr_t ram_addr = cb->trap->addr + addr +
+                          memory_region_get_ram_addr(cb->mr);
+
+    /* Later accesses go to RAM directly, until the callback is rearmed */
+    qemu_mutex_lock(&cpu->mem_access_callbacks_lock);
+    IntervalTreeNode *node = interval_tree_iter_first(
+        &cpu->mem_access_callbacks, ram_addr, ram_addr + size - 1);
+    for (; node; node = interval_tree_iter_next(node, ram_addr,
+                                                ram_addr + size - 1)) {
+        MemAccessCallback *hit = container_of(node, MemAccessCallback, node);
+        memory_region_set_enabled(hit->trap, false);
+    }
+    memory_region_set_enabled(cb->trap, false);
+    qemu_mutex_unlock(&cpu->mem_access_callbacks_lock);
+
+    /* Callbacks may wait on threads which need the BQL to make progress */
+    bql_unlock();
+    mem_check_access_callback_ramaddr(cpu, ram_addr, size,
+                                      write ? BP_MEM_WRITE : BP_MEM_READ);
+    bql_lock();
+}
+
+static uint64_t mem_access_trap_read(void *opaque, hwaddr addr, unsigned size)
+{
+    MemAccessCallback *cb = opaque;
+    hwaddr offset = cb->trap->addr + addr;
+
+    mem_access_trap_hit(cb, addr, size, false);
+    return ldn_le_p(memory_region_get_ram_ptr(cb->mr) + offset, size);
+}
+
+static void mem_access_trap_write(void *opaque, hwaddr addr, uint64_t val,
+                                  unsigned size)
+{
+    MemAccessCallback *cb = opaque;
+    hwaddr offset = cb->trap->addr + addr;
+
+    mem_access_trap_hit(cb, addr, size, true);
+    stn_le_p(memory_region_get_ram_ptr(cb->mr) + offset, size, val);
+    memory_region_set_dirty(cb->mr, offset, size);
+}
+
+static const MemoryRegionOps mem_access_trap_ops = {
+    .read = mem_access_trap_read,
+    .write = mem_access_trap_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+        .unaligned = true,
+    },
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+        .unaligned = true,
+    },
+};
+
+static void mem_access_trap_insert(MemAccessCallback *cb)
 {
-    hwaddr watch_end = cb->addr + cb->len - 1;
-    hwaddr access_end = addr + len - 1;
+    /* Kept to whole pages, for accelerators to map the rest of RAM */
+    hwaddr offset = cb->addr - memory_region_get_ram_addr(cb->mr);
+    hwaddr start = QEMU_ALIGN_DOWN(offset, qemu_real_host_page_size());
+    hwaddr end = QEMU_ALIGN_UP(offset + cb->len, qemu_real_host_page_size());
 
-    return !(addr > watch_end || cb->addr > access_end);
+    end = MIN(end, memory_region_size(cb->mr));
+    cb->trap = g_new0(MemoryRegion, 1);
+    memory_region_init_io(cb->trap, memory_region_owner(cb->mr),
+                          &mem_access_trap_ops, cb, "mem-access-trap",
+                          end - start);
+    memory_region_add_subregion_overlap(cb->mr, start, cb->trap, 1);
 }
 
-int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len)
+static void mem_access_trap_remove(MemAccessCallback *cb)
 {
-    int ret = 0;
+    memory_region_del_subregion(cb->mr, cb->trap);
+    object_unparent(OBJECT(cb->trap));
+}
+
+/* Flat views being dispatched from may still point to the trap */
+static void mem_access_callback_free(MemAccessCallback *cb)
+{
+    g_free(cb->trap);
+    g_free(cb);
+}
+
+static void do_mem_access_callbacks_update(CPUState *cpu, run_on_cpu_data data)
+{
+    bool use_traps = !tcg_enabled();
+
+    /* Traps are regions, which are only changed with the BQL held */
+    if (use_traps) {
+        memory_region_transaction_begin();
+    }
+
+    qemu_mutex_lock(&cpu->mem_access_callbacks_lock);
 
     MemAccessCallback *cb;
-    QTAILQ_FOREACH(cb, &cpu->mem_access_callbacks, entry) {
-        if (access_callback_address_matches(cb, addr, len)) {
-            ret |= BP_MEM_READ | BP_MEM_WRITE;
+    while ((cb = QSIMPLEQ_FIRST(&cpu->mem_access_callbacks_pending))) {
+        QSIMPLEQ_REMOVE_HEAD(&cpu->mem_access_callbacks_pending, pending_entry);
+        bool rearm = cb->rearm;
+        cb->pending = false;
+        cb->rearm = false;
+
+        if (cb->removed) {
+            if (cb->inserted) {
+                interval_tree_remove(&cb->node, &cpu->mem_access_callbacks);
+                if (cb->trap) {
+                    mem_access_trap_remove(cb);
+                }
+            }
+            call_rcu(cb, mem_access_callback_free, rcu);
+        } else if (!cb->inserted) {
+            interval_tree_insert(&cb->node, &cpu->mem_access_callbacks);
+            cb->inserted = true;
+            if (use_traps) {
+                mem_access_trap_insert(cb);
+            }
+        } else if (rearm && cb->trap) {
+            memory_region_set_enabled(cb->trap, true);
         }
     }
+    cpu->mem_access_callbacks_update_scheduled = false;
 
-    return ret;
-}
+    qemu_mutex_unlock(&cpu->mem_access_callbacks_lock);
 
-static void do_mem_access_callback_insert(CPUState *cpu, run_on_cpu_data data)
+    if (use_traps) {
+        memory_region_transaction_commit();
+    } else {
+        // FIXME: flush only applicable pages
+        tlb_flush(cpu);
+    }
+}
 
+/*
+ * Queue a change to the callbacks of cpu. Changes made before the vCPU gets
+ * to run the update are applied together, with a single TLB flush, and a
+ * callback removed before it was ever inserted is simply dropped. Must be
+ * called with mem_access_callbacks_lock held.
+ */
+static void queue_mem_access_callback_update_locked(CPUState *cpu,
+                                                    MemAccessCallback *cb)
 {
-    MemAccessCallback *cb = (MemAccessCallback *)data.host_ptr;
-    QTAILQ_INSERT_TAIL(&cpu->mem_access_callbacks, cb, entry);
+    if (!cb->pending) {
+        QSIMPLEQ_INSERT_TAIL(&cpu->mem_access_callbacks_pending, cb,
+                             pending_entry);
+        cb->pending = true;
+    }
+
+    if (!cpu->mem_access_callbacks_update_scheduled) {
+        cpu->mem_access_callbacks_update_scheduled = true;
+        if (tcg_enabled()) {
+            async_safe_run_on_cpu(cpu, do_mem_access_callbacks_update,
+                                  RUN_ON_CPU_NULL);
+        } else {
+            /* Run with the BQL held, which safe work is not */
+            async_run_on_cpu(cpu, do_mem_access_callbacks_update,
+                             RUN_ON_CPU_NULL);
+        }
+    }
 }
 
 MemAccessCallback *mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
@@ -881,41 +1030,51 @@ MemAccessCallback *mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
 {
     assert(len > 0);
 
-    MemAccessCallback *cb = g_malloc(sizeof(*cb));
+    MemAccessCallback *cb = g_new0(MemAccessCallback, 1);
+    cb->cpu = cpu;
     cb->mr = mr;
     cb->addr = memory_region_get_ram_addr(mr) + offset;
     cb->len = len;
     cb->func = func;
     cb->opaque = opaque;
+    cb->node.start = cb->addr;
+    cb->node.last = cb->addr + len - 1;
 
-    async_safe_run_on_cpu(cpu, do_mem_access_callback_insert,
-                          RUN_ON_CPU_HOST_PTR(cb));
-
-    // FIXME: flush only applicable pages
-    tlb_flush_all_cpus_synced(cpu);
+    qemu_mutex_lock(&cpu->mem_access_callbacks_lock);
+    queue_mem_access_callback_update_locked(cpu, cb);
+    qemu_mutex_unlock(&cpu->mem_access_callbacks_lock);
 
     return cb;
 }
 
-static void do_mem_access_callback_remove_by_ref(CPUState *cpu,
-                                                 run_on_cpu_data data)
-{
-    MemAccessCallback *cb = (MemAccessCallback *)data.host_ptr;
-    QTAILQ_REMOVE(&cpu->mem_access_callbacks, cb, entry);
-    g_free(cb);
-}
-
 void mem_access_callback_remove_by_ref(CPUState *cpu, MemAccessCallback *cb)
 {
     if (!cb) {
         return;
     }
 
-    async_safe_run_on_cpu(cpu, do_mem_access_callback_remove_by_ref,
-                          RUN_ON_CPU_HOST_PTR(cb));
+    qemu_mutex_lock(&cpu->mem_access_callbacks_lock);
+    assert(!cb->removed);
+    cb->removed = true;
+    queue_mem_access_callback_update_locked(cpu, cb);
+    qemu_mutex_unlock(&cpu->mem_access_callbacks_lock);
+}
+
+/*
+ * Watches the memory of cb again after its trap was hit. Accesses are always
+ * caught with TCG, so there is nothing to do then.
+ */
+void mem_access_callback_rearm(CPUState *cpu, MemAccessCallback *cb)
+{
+    if (!cb || tcg_enabled()) {
+        return;
+    }
 
-    // FIXME: flush only applicable pages
-    tlb_flush_all_cpus_synced(cpu);
+    qemu_mutex_lock(&cpu->mem_access_callbacks_lock);
+    assert(!cb->removed);
+    cb->rearm = true;
+    queue_mem_access_callback_update_locked(cpu, cb);
+    qemu_mutex_unlock(&cpu->mem_access_callbacks_lock);
 }
 
 void mem_check_access_callback_vaddr(CPUState *cpu,
@@ -930,16 +1089,18 @@ void mem_check_access_callback_vaddr(CPUState *cpu,
 void mem_check_access_callback_ramaddr(CPUState *cpu,
                                        hwaddr ram_addr, vaddr len, int flags)
 {
-    MemAccessCallback *cb;
-    QTAILQ_FOREACH(cb, &cpu->mem_access_callbacks, entry) {
-        if (access_callback_address_matches(cb, ram_addr, len)) {
-            ram_addr_t ram_addr_base = memory_region_get_ram_addr(cb->mr);
-            assert(ram_addr_base != RAM_ADDR_INVALID);
-            ram_addr_t hit_addr = MAX(ram_addr, cb->addr);
-            hwaddr mr_offset = hit_addr - ram_addr_base;
-            bool is_write = (flags & BP_MEM_WRITE) != 0;
-            cb->func(cb->opaque, cb->mr, mr_offset, len, is_write);
-        }
+    hwaddr last = ram_addr + len - 1;
+    IntervalTreeNode *node =
+        interval_tree_iter_first(&cpu->mem_access_callbacks, ram_addr, last);
+
+    for (; node; node = interval_tree_iter_next(node, ram_addr, last)) {
+        MemAccessCallback *cb = container_of(node, MemAccessCallback, node);
+        ram_addr_t ram_addr_base = memory_region_get_ram_addr(cb->mr);
+        assert(ram_addr_base != RAM_ADDR_INVALID);
+        ram_addr_t hit_addr = MAX(ram_addr, cb->addr);
+        hwaddr mr_offset = hit_addr - ram_addr_base;
+        bool is_write = (flags & BP_MEM_WRITE) != 0;
+        cb->func(cb->opaque, cb->mr, mr_offset, len, is_write);
     }
 }
 
@@ -1063,7 +1224,11 @@ bool physical_memory_is_clean(ram_addr_t addr)
     bool code = physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(nv2a && nv2a_tex && vga && code && migration);
+    bool snapshot = physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_SNAPSHOT);
+    bool nv2a_capture =
+        physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_CAPTURE);
+    return !(nv2a && nv2a_tex && vga && code && migration && snapshot &&
+             nv2a_capture);
 }
 
 static bool physical_memory_all_dirty(ram_addr_t start, ram_addr_t length,
@@ -1131,6 +1296,14 @@ uint8_t physical_memory_range_includes_clean(ram_addr_t start,
         !physical_memory_all_dirty(start, length, DIRTY_MEMORY_MIGRATION)) {
         ret |= (1 << DIRTY_MEMORY_MIGRATION);
     }
+    if (mask & (1 << DIRTY_MEMORY_SNAPSHOT) &&
+        !physical_memory_all_dirty(start, length, DIRTY_MEMORY_SNAPSHOT)) {
+        ret |= (1 << DIRTY_MEMORY_SNAPSHOT);
+    }
+    if (mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE) &&
+        !physical_memory_all_dirty(start, length, DIRTY_MEMORY_NV2A_CAPTURE)) {
+        ret |= (1 << DIRTY_MEMORY_NV2A_CAPTURE);
+    }
     return ret;
 }
 
@@ -1198,6 +1371,15 @@ void physical_memory_set_dirty_range(ram_addr_t start, ram_addr_t length,
                 bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A_TEX]->blocks[idx],
                                   offset, next - page);
             }
+            if (unlikely(mask & (1 << DIRTY_MEMORY_SNAPSHOT))) {
+                bitmap_set_atomic(blocks[DIRTY_MEMORY_SNAPSHOT]->blocks[idx],
+                                  offset, next - page);
+            }
+            if (unlikely(mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE))) {
+                bitmap_set_atomic(
+                    blocks[DIRTY_MEMORY_NV2A_CAPTURE]->blocks[idx],
+                    offset, next - page);
+            }
 
             page = next;
             idx++;
@@ -1267,6 +1449,9 @@ static void physical_memory_clear_dirty_range(ram_addr_t addr, ram_addr_t length
     physical_memory_test_and_clear_dirty(addr, length, DIRTY_MEMORY_CODE);
     physical_memory_test_and_clear_dirty(addr, length, DIRTY_MEMORY_NV2A);
     physical_memory_test_and_clear_dirty(addr, length, DIRTY_MEMORY_NV2A_TEX);
+    physical_memory_test_and_clear_dirty(addr, length, DIRTY_MEMORY_SNAPSHOT);
+    physical_memory_test_and_clear_dirty(addr, length,
+                                         DIRTY_MEMORY_NV2A_CAPTURE);
 }
 
 DirtyBitmapSnapshot *physical_memory_snapshot_and_clear_dirty
@@ -1384,6 +1569,9 @@ uint64_t physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                     qatomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
                     qatomic_or(&blocks[DIRTY_MEMORY_NV2A][idx][offset], temp);
                     qatomic_or(&blocks[DIRTY_MEMORY_NV2A_TEX][idx][offset], temp);
+                    qatomic_or(&blocks[DIRTY_MEMORY_SNAPSHOT][idx][offset], temp);
+                    qatomic_or(&blocks[DIRTY_MEMORY_NV2A_CAPTURE][idx][offset],
+                               temp);
 
                     if (global_dirty_tracking) {
                         qatomic_or(
@@ -147,7 +147,12 @@
 #include "ui/xemu-notifications.h"
 #include "ui/xemu-net.h"
 #include "ui/xemu-input.h"
+#include "ui/xemu-benchmark.h"
+#include "ui/xemu-disc.h"
+#include "ui/xemu-hdd.h"
+#include "ui/xemu-fast-boot.h"
 #include "hw/xbox/eeprom_generation.h"
+#include "hw/xbox/nv2a/debug.h"
 
 #define MAX_VIRTIO_CONSOLES 1
 
@@ -2884,6 +2889,11 @@ void qmp_x_exit_preconfig(Error **errp)
         load_snapshot(loadvm, NULL, false, NULL, &error_fatal);
         load_snapshot_resume(state);
     }
+#ifdef XBOX
+    if (!loadvm && !incoming) {
+        xemu_fast_boot_init();
+    }
+#endif
     if (replay_mode != REPLAY_MODE_NONE) {
         replay_vmstate_init();
     }
@@ -3016,9 +3026,10 @@ void qemu_init(int argc, char **argv)
         "none",
     }[g_config.sys.avpack];
 
-    fake_argv[fake_argc++] = g_strdup_printf("xbox%s%s%s,avpack=%s",
+    fake_argv[fake_argc++] = g_strdup_printf("xbox%s%s%s%s,avpack=%s",
         (bootrom_arg != NULL) ? bootrom_arg : "",
         g_config.general.skip_boot_anim ? ",short-animation=on" : "",
+        g_config.perf.huge_pages ? ",huge-pages=on" : "",
         ",kernel-irqchip=off",
         avpack_str
         );
@@ -3066,10 +3077,12 @@ void qemu_init(int argc, char **argv)
         } else {
             fake_argv[fake_argc++] = strdup("-drive");
             char *escaped_hdd_path = strdup_double_commas(hdd_path);
-            fake_argv[fake_argc++] = g_strdup_printf("index=0,media=disk,file=%s%s",
+            fake_argv[fake_argc++] = g_strdup_printf("index=0,media=disk,file=%s%s%s",
                 escaped_hdd_path,
-                strlen(escaped_hdd_path) > 0 ? ",locked=on" : "");
+                strlen(escaped_hdd_path) > 0 ? ",locked=on" : "",
+                xemu_hdd_get_drive_options());
             free(escaped_hdd_path);
+            xemu_hdd_init(hdd_path);
         }
     }
 
@@ -3089,10 +3102,50 @@ void qemu_init(int argc, char **argv)
     // Always populate DVD drive. If disc path is the empty string, drive is
     // connected but no media present.
     fake_argv[fake_argc++] = strdup("-drive");
-    char *escaped_dvd_path = strdup_double_commas(dvd_path);
-    fake_argv[fake_argc++] = g_strdup_printf("index=1,media=cdrom,file=%s",
-        escaped_dvd_path);
-    free(escaped_dvd_path);
+    if (dvd_path[0]) {
+        const char *dvd_format;
+        g_autofree char *dvd_filename =
+            xemu_disc_get_filename(dvd_path, &dvd_format);
+        char *escaped_dvd_filename = strdup_double_commas(dvd_filename);
+        fake_argv[fake_argc++] = g_strdup_printf(
+            "index=1,media=cdrom,file=%s%s%s", escaped_dvd_filename,
+            dvd_format ? ",format=" : "", dvd_format ? dvd_format : "");
+        free(escaped_dvd_filename);
+    } else {
+        fake_argv[fake_argc++] = g_strdup("index=1,media=cdrom,file=");
+    }
+
+    // Replay an NV2A command capture instead of running the guest
+    for (int i = 1; i < argc; i++) {
+        if (argv[i] && strcmp(argv[i], "-nv2a_replay") == 0) {
+            argv[i] = NULL;
+            if (i < argc - 1 && argv[i+1]) {
+                nv2a_dbg_replay_path = argv[i+1];
+                argv[i+1] = NULL;
+            }
+        } else if (argv[i] && strcmp(argv[i], "-nv2a_replay_loops") == 0) {
+            argv[i] = NULL;
+            if (i < argc - 1 && argv[i+1]) {
+                nv2a_dbg_replay_loops = atoi(argv[i+1]);
+                argv[i+1] = NULL;
+            }
+        } else if (argv[i] && strcmp(argv[i], "-nv2a_shader_dump") == 0) {
+            argv[i] = NULL;
+            if (i < argc - 1 && argv[i+1]) {
+                nv2a_dbg_shader_dump_dir = argv[i+1];
+                argv[i+1] = NULL;
+            }
+        }
+    }
+    if (nv2a_dbg_replay_path) {
+        fake_argv[fake_argc++] = strdup("-S");
+    }
+
+    // Tie the guest clock to executed instructions for repeatable benchmarks
+    if (xemu_benchmark_enabled()) {
+        fake_argv[fake_argc++] = strdup("-icount");
+        fake_argv[fake_argc++] = strdup(xemu_benchmark_get_icount_option());
+    }
 
     fake_argv[fake_argc++] = strdup("-display");
     fake_argv[fake_argc++] = strdup("xemu");
@@ -98,6 +98,9 @@ DEF_HELPER_1(rdmsr, void, env)
 DEF_HELPER_1(wrmsr, void, env)
 DEF_HELPER_FLAGS_1(read_cr8, TCG_CALL_NO_RWG, tl, env)
 DEF_HELPER_FLAGS_3(write_crN, TCG_CALL_NO_RWG, void, env, int, tl)
+#ifdef XBOX
+DEF_HELPER_2(native_routine, void, env, i32)
+#endif
 #endif /* !CONFIG_USER_ONLY */
 
 /* x86 FPU */
@@ -125,6 +125,25 @@ static void glue(gen_fcom, PREC_SUFFIX)(DisasContext *s, PREC_TYPE arg1,
     /* FIXME: Exceptions */
 }
 
+static void glue(gen_fcomi_ST0_FT0, PREC_SUFFIX)(DisasContext *s)
+{
+    TCGv_i64 res = tcg_temp_new_i64();
+    TCGv t = tcg_temp_new();
+
+    /* May call a helper, so do it before loading the operands */
+    gen_compute_eflags(s);
+
+    /* Result is already in EFLAGS format, see gen_fcom */
+    glue(tcg_gen_com, PREC_SUFFIX)(res, get_st0(s), get_ft0(s));
+    tcg_gen_andi_i64(res, res, CC_Z | CC_P | CC_C);
+    tcg_gen_trunc_i64_tl(t, res);
+
+    tcg_gen_andi_tl(cpu_cc_src, cpu_cc_src, ~(CC_Z | CC_P | CC_C));
+    tcg_gen_or_tl(cpu_cc_src, cpu_cc_src, t);
+
+    /* FIXME: Exceptions */
+}
+
 /* FIXME: This decode logic should be shared with helper variant */
 
 static void glue(gen_helper_fp_arith_ST0_FT0, PREC_SUFFIX)(DisasContext *s,
@@ -252,6 +271,18 @@ static void glue(gen_fistll_ST0, PREC_SUFFIX)(DisasContext *s, TCGv_i64 arg)
     glue(glue(tcg_gen_cvt, PRECf), _i64)(arg, get_st0(s));
 }
 
+static void glue(gen_fist_ST0, PREC_SUFFIX)(DisasContext *s, TCGv_i32 arg)
+{
+    TCGv_i32 t = tcg_temp_new_i32();
+
+    glue(glue(tcg_gen_cvt, PRECf), _i32)(arg, get_st0(s));
+
+    /* Out of range values store the integer indefinite */
+    tcg_gen_ext16s_i32(t, arg);
+    tcg_gen_movcond_i32(TCG_COND_NE, arg, arg, t,
+                        tcg_constant_i32(-32768), arg);
+}
+
 static void glue(gen_fsts_ST0, PREC_SUFFIX)(DisasContext *s, TCGv_i32 arg)
 {
     glue(glue(gen_mov, PRECf), _i32)(arg, get_st0(s));
@@ -297,6 +328,15 @@ static void glue(gen_fld1_ST0, PREC_SUFFIX)(DisasContext *s)
     glue(gen_movi, PREC_SUFFIX)(s, get_st0(s), 1.0);
 }
 
+/*
+ * Rounded to nearest regardless of the rounding control, which only affects
+ * the last bit of the extended precision constants.
+ */
+static void glue(gen_fldc_ST0, PREC_SUFFIX)(DisasContext *s, double value)
+{
+    glue(gen_movi, PREC_SUFFIX)(s, get_st0(s), value);
+}
+
 static void glue(gen_fldz_ST0, PREC_SUFFIX)(DisasContext *s)
 {
     glue(gen_movi, PREC_SUFFIX)(s, get_st0(s), 0.0);
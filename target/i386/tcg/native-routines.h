@@ -0,0 +1,38 @@
+/*
+ * Native implementations of common guest library routines
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef I386_TCG_NATIVE_ROUTINES_H
+#define I386_TCG_NATIVE_ROUTINES_H
+
+/*
+ * Routines of the C runtime statically linked into titles (and the kernel)
+ * that are recognized by the code at their entry point. Translating a call
+ * to one of them calls helper_native_routine() instead, which performs it
+ * through the MMU like the guest code would and leaves its result in EAX;
+ * the translated code then returns to the caller.
+ *
+ * All of them are cdecl, with their arguments on the stack.
+ */
+typedef enum NativeRoutine {
+    NATIVE_ROUTINE_MEMMOVE, /* Also memcpy, which handles overlap the same */
+    NATIVE_ROUTINE_MEMSET,
+    NATIVE_ROUTINE__COUNT
+} NativeRoutine;
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Native implementations of common guest library routines
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "exec/target_page.h"
+#include "accel/tcg/cpu-ldst.h"
+#include "accel/tcg/probe.h"
+#include "tcg/helper-tcg.h"
+#include "tcg/native-routines.h"
+
+static target_ulong get_arg(CPUX86State *env, int n, uintptr_t ra)
+{
+    /* Above the return address */
+    return cpu_ldl_data_ra(env,
+                           env->segs[R_SS].base + env->regs[R_ESP] + 4 * (n + 1),
+                           ra);
+}
+
+static target_ulong page_remaining(target_ulong addr)
+{
+    return TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+}
+
+/*
+ * Faults are raised before anything is written, as the routine is run
+ * again from the start once they are handled.
+ */
+static void probe_range(CPUX86State *env, target_ulong addr, target_ulong len,
+                        MMUAccessType access_type, uintptr_t ra)
+{
+    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+
+    while (len) {
+        target_ulong n = MIN(len, page_remaining(addr));
+        probe_access(env, addr, n, access_type, mmu_idx, ra);
+        addr += n;
+        len -= n;
+    }
+}
+
+/* Copies within at most one page of each, NULL hosts are not RAM */
+static void move_chunk(CPUX86State *env, target_ulong dst, target_ulong src,
+                       target_ulong len, bool backward, uintptr_t ra)
+{
+    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+    void *hsrc = probe_access(env, src, len, MMU_DATA_LOAD, mmu_idx, ra);
+    void *hdst = probe_access(env, dst, len, MMU_DATA_STORE, mmu_idx, ra);
+
+    if (hsrc && hdst) {
+        memmove(hdst, hsrc, len);
+    } else if (backward) {
+        for (target_ulong i = len; i-- > 0;) {
+            cpu_stb_data_ra(env, dst + i, cpu_ldub_data_ra(env, src + i, ra),
+                            ra);
+        }
+    } else {
+        for (target_ulong i = 0; i < len; i++) {
+            cpu_stb_data_ra(env, dst + i, cpu_ldub_data_ra(env, src + i, ra),
+                            ra);
+        }
+    }
+}
+
+/* void *memmove(void *dst, const void *src, size_t len) */
+static void native_memmove(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong dst = get_arg(env, 0, ra);
+    target_ulong src = get_arg(env, 1, ra);
+    target_ulong len = get_arg(env, 2, ra);
+
+    probe_range(env, src, len, MMU_DATA_LOAD, ra);
+    probe_range(env, dst, len, MMU_DATA_STORE, ra);
+
+    if (dst > src && dst - src < len) {
+        /* Overlapping with the source before, copy from the end */
+        target_ulong end = len;
+        while (end) {
+            target_ulong n = MIN(end, ((src + end - 1) & ~TARGET_PAGE_MASK) + 1);
+            n = MIN(n, ((dst + end - 1) & ~TARGET_PAGE_MASK) + 1);
+            move_chunk(env, dst + end - n, src + end - n, n, true, ra);
+            end -= n;
+        }
+    } else {
+        target_ulong off = 0;
+        while (off < len) {
+            target_ulong n = MIN(len - off, page_remaining(src + off));
+            n = MIN(n, page_remaining(dst + off));
+            move_chunk(env, dst + off, src + off, n, false, ra);
+            off += n;
+        }
+    }
+
+    env->regs[R_EAX] = dst;
+}
+
+/* void *memset(void *dst, int c, size_t len) */
+static void native_memset(CPUX86State *env, uintptr_t ra)
+{
+    target_ulong dst = get_arg(env, 0, ra);
+    uint8_t c = get_arg(env, 1, ra);
+    target_ulong len = get_arg(env, 2, ra);
+    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+
+    probe_range(env, dst, len, MMU_DATA_STORE, ra);
+
+    for (target_ulong off = 0; off < len;) {
+        target_ulong n = MIN(len - off, page_remaining(dst + off));
+        void *host =
+            probe_access(env, dst + off, n, MMU_DATA_STORE, mmu_idx, ra);
+        if (host) {
+            memset(host, c, n);
+        } else {
+            for (target_ulong i = 0; i < n; i++) {
+                cpu_stb_data_ra(env, dst + off + i, c, ra);
+            }
+        }
+        off += n;
+    }
+
+    env->regs[R_EAX] = dst;
+}
+
+void helper_native_routine(CPUX86State *env, uint32_t routine)
+{
+    uintptr_t ra = GETPC();
+
+    switch (routine) {
+    case NATIVE_ROUTINE_MEMMOVE:
+        native_memmove(env, ra);
+        break;
+    case NATIVE_ROUTINE_MEMSET:
+        native_memset(env, ra);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
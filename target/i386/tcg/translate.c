@@ -123,6 +123,14 @@ static int g_use_hard_fpu;
 #define gen_helper_frstor         MAP_GEN_HELPER_SOFT_HARD(frstor)
 #endif /* defined(XBOX) && defined(__x86_64__) */
 
+#ifdef XBOX
+#include "ui/xemu-settings.h"
+#include "native-routines.h"
+
+static bool g_use_native_routines;
+static bool g_use_superblocks;
+#endif
+
 #define HELPER_H "helper.h"
 #include "exec/helper-info.c.inc"
 #undef  HELPER_H
@@ -2027,6 +2035,61 @@ static void gen_fldz_FT0(DisasContext *s)
     fp_pc_wrapper(gen_fldz_FT0)(s);
 }
 
+static void gen_fldl2t_ST0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fldl2t_ST0);
+    fp_pc_wrapper(gen_fldc_ST0)(s, M_LN10 / M_LN2);
+}
+
+static void gen_fldl2e_ST0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fldl2e_ST0);
+    fp_pc_wrapper(gen_fldc_ST0)(s, M_LOG2E);
+}
+
+static void gen_fldpi_ST0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fldpi_ST0);
+    fp_pc_wrapper(gen_fldc_ST0)(s, M_PI);
+}
+
+static void gen_fldlg2_ST0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fldlg2_ST0);
+    fp_pc_wrapper(gen_fldc_ST0)(s, M_LN2 / M_LN10);
+}
+
+static void gen_fldln2_ST0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fldln2_ST0);
+    fp_pc_wrapper(gen_fldc_ST0)(s, M_LN2);
+}
+
+static void gen_fist_ST0(DisasContext *s, TCGv_i32 arg)
+{
+    GEN_HELPER_FALLBACK_T_v(fist_ST0, arg);
+    fp_pc_wrapper(gen_fist_ST0)(s, arg);
+}
+
+/* Exceptions are not raised by the hard FPU, so these only differ in soft */
+static void gen_fucom_ST0_FT0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fucom_ST0_FT0);
+    gen_fcom_ST0_FT0(s);
+}
+
+static void gen_fcomi_ST0_FT0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fcomi_ST0_FT0);
+    fp_pc_wrapper(gen_fcomi_ST0_FT0)(s);
+}
+
+static void gen_fucomi_ST0_FT0(DisasContext *s)
+{
+    GEN_HELPER_FALLBACK_v_v(fucomi_ST0_FT0);
+    fp_pc_wrapper(gen_fcomi_ST0_FT0)(s);
+}
+
 static void gen_exception(DisasContext *s, int trapno)
 {
     gen_update_cc_op(s);
@@ -2855,6 +2918,30 @@ static void gen_jmp_rel(DisasContext *s, MemOp ot, int diff, int tb_num)
     }
 }
 
+#ifdef XBOX
+/*
+ * Continue translating at the target of an unconditional jump, rather than
+ * ending the block, so that the code on both sides of it is optimized and
+ * register allocated as one. The TB must still cover a contiguous range of
+ * guest code for invalidation, so only forward jumps within the page are
+ * followed: the bytes jumped over are part of the TB.
+ */
+static bool gen_jmp_follow(DisasContext *s, int diff)
+{
+    target_ulong new_pc = s->pc + diff;
+
+    if (!g_use_superblocks || !s->jmp_opt || s->base.plugin_enabled ||
+        s->dflag == MO_16 || diff <= 0 || new_pc <= s->pc ||
+        !translator_is_same_page(&s->base, new_pc)) {
+        return false;
+    }
+
+    s->pc = new_pc;
+    s->base.tb->followed_jumps++;
+    return true;
+}
+#endif
+
 /* Jump to eip+diff, truncating to the current code size. */
 static void gen_jmp_rel_csize(DisasContext *s, int diff, int tb_num)
 {
@@ -3068,7 +3155,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
                     break;
                 case 3:
                 default:
-                    gen_helper_fist_ST0(s->tmp2_i32, tcg_env);
+                    gen_fist_ST0(s, s->tmp2_i32);
                     tcg_gen_qemu_st_i32(s->tmp2_i32, s->A0,
                                         s->mem_index, MO_LEUW);
                     break;
@@ -3218,23 +3305,23 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
                     break;
                 case 1:
                     gen_fpush(s);
-                    gen_helper_fldl2t_ST0(tcg_env);
+                    gen_fldl2t_ST0(s);
                     break;
                 case 2:
                     gen_fpush(s);
-                    gen_helper_fldl2e_ST0(tcg_env);
+                    gen_fldl2e_ST0(s);
                     break;
                 case 3:
                     gen_fpush(s);
-                    gen_helper_fldpi_ST0(tcg_env);
+                    gen_fldpi_ST0(s);
                     break;
                 case 4:
                     gen_fpush(s);
-                    gen_helper_fldlg2_ST0(tcg_env);
+                    gen_fldlg2_ST0(s);
                     break;
                 case 5:
                     gen_fpush(s);
-                    gen_helper_fldln2_ST0(tcg_env);
+                    gen_fldln2_ST0(s);
                     break;
                 case 6:
                     gen_fpush(s);
@@ -3337,7 +3424,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             switch (rm) {
             case 1: /* fucompp */
                 gen_fmov_FT0_STN(s, 1);
-                gen_helper_fucom_ST0_FT0(tcg_env);
+                gen_fucom_ST0_FT0(s);
                 gen_fpop(s);
                 gen_fpop(s);
                 break;
@@ -3373,7 +3460,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             }
             gen_update_cc_op(s);
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fucomi_ST0_FT0(tcg_env);
+            gen_fucomi_ST0_FT0(s);
             assume_cc_op(s, CC_OP_EFLAGS);
             break;
         case 0x1e: /* fcomi */
@@ -3382,7 +3469,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             }
             gen_update_cc_op(s);
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fcomi_ST0_FT0(tcg_env);
+            gen_fcomi_ST0_FT0(s);
             assume_cc_op(s, CC_OP_EFLAGS);
             break;
         case 0x28: /* ffree sti */
@@ -3400,11 +3487,11 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             break;
         case 0x2c: /* fucom st(i) */
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fucom_ST0_FT0(tcg_env);
+            gen_fucom_ST0_FT0(s);
             break;
         case 0x2d: /* fucomp st(i) */
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fucom_ST0_FT0(tcg_env);
+            gen_fucom_ST0_FT0(s);
             gen_fpop(s);
             break;
         case 0x33: /* de/3 */
@@ -3440,7 +3527,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             }
             gen_update_cc_op(s);
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fucomi_ST0_FT0(tcg_env);
+            gen_fucomi_ST0_FT0(s);
             gen_fpop(s);
             assume_cc_op(s, CC_OP_EFLAGS);
             break;
@@ -3450,7 +3537,7 @@ static void gen_x87(DisasContext *s, X86DecodedInsn *decode)
             }
             gen_update_cc_op(s);
             gen_fmov_FT0_STN(s, opreg);
-            gen_helper_fcomi_ST0_FT0(tcg_env);
+            gen_fcomi_ST0_FT0(s);
             gen_fpop(s);
             assume_cc_op(s, CC_OP_EFLAGS);
             break;
@@ -4230,6 +4317,10 @@ void tcg_x86_init(void)
 #if defined(XBOX) && defined(__x86_64__)
     g_use_hard_fpu = g_config.perf.hard_fpu;
 #endif
+#ifdef XBOX
+    g_use_native_routines = g_config.perf.native_routines;
+    g_use_superblocks = g_config.perf.superblocks;
+#endif
 }
 
 static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
@@ -4310,6 +4401,101 @@ static void i386_tr_insn_start(DisasContextBase *dcbase, CPUState *cpu)
     tcg_gen_insn_start(pc_arg, dc->cc_op);
 }
 
+#ifdef XBOX
+#define NATIVE_ANY -1
+
+/*
+ * Entry points of the routines of native-routines.h, as built by the
+ * compilers of the XDK. NATIVE_ANY matches any byte.
+ */
+static const struct {
+    NativeRoutine routine;
+    int len;
+    int16_t code[32];
+} native_routine_signatures[] = {
+    /* memcpy.asm, also built as memmove */
+    { NATIVE_ROUTINE_MEMMOVE, 26, {
+        0x55,                   /* push ebp */
+        0x8b, 0xec,             /* mov ebp, esp */
+        0x57,                   /* push edi */
+        0x56,                   /* push esi */
+        0x8b, 0x75, 0x0c,       /* mov esi, [ebp + 0xc] */
+        0x8b, 0x4d, 0x10,       /* mov ecx, [ebp + 0x10] */
+        0x8b, 0x7d, 0x08,       /* mov edi, [ebp + 0x8] */
+        0x8b, 0xc1,             /* mov eax, ecx */
+        0x8b, 0xd1,             /* mov edx, ecx */
+        0x03, 0xc6,             /* add eax, esi */
+        0x3b, 0xfe,             /* cmp edi, esi */
+        0x76, NATIVE_ANY,       /* jbe CopyUp */
+        0x3b, 0xf8,             /* cmp edi, eax */
+    } },
+    /* memset.asm */
+    { NATIVE_ROUTINE_MEMSET, 18, {
+        0x8b, 0x54, 0x24, 0x0c, /* mov edx, [esp + 0xc] */
+        0x8b, 0x4c, 0x24, 0x04, /* mov ecx, [esp + 0x4] */
+        0x85, 0xd2,             /* test edx, edx */
+        0x74, NATIVE_ANY,       /* jz toend */
+        0x33, 0xc0,             /* xor eax, eax */
+        0x8a, 0x44, 0x24, 0x08, /* mov al, [esp + 0x8] */
+    } },
+};
+
+static int native_routine_match(DisasContext *s, CPUX86State *env)
+{
+    vaddr pc = s->base.pc_first;
+
+    for (int i = 0; i < ARRAY_SIZE(native_routine_signatures); i++) {
+        const int16_t *code = native_routine_signatures[i].code;
+        int len = native_routine_signatures[i].len;
+        int j;
+
+        /* Reading past the page could fault */
+        if (!translator_is_same_page(&s->base, pc + len - 1)) {
+            continue;
+        }
+        for (j = 0; j < len; j++) {
+            if (code[j] != NATIVE_ANY &&
+                translator_ldub(env, &s->base, pc + j) != code[j]) {
+                break;
+            }
+        }
+        if (j == len) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Replaces a block at the entry point of a known routine by a call to it */
+static bool gen_native_routine(DisasContext *s, CPUState *cpu)
+{
+    if (!CODE32(s) || !SS32(s) || (s->flags & HF_TF_MASK)) {
+        return false;
+    }
+
+    int i = native_routine_match(s, cpu_env(cpu));
+    if (i < 0) {
+        return false;
+    }
+
+    gen_helper_native_routine(
+        tcg_env, tcg_constant_i32(native_routine_signatures[i].routine));
+
+    /* Return to the caller, leaving the arguments to it */
+    MemOp ot = gen_pop_T0(s);
+    gen_stack_update(s, 1 << ot);
+    gen_op_jmp_v(s, s->T0);
+    s->base.is_jmp = DISAS_JUMP;
+
+    /* Covers the code that was matched, should it be overwritten */
+    s->pc = s->base.pc_first + native_routine_signatures[i].len;
+    s->base.pc_next = s->pc;
+
+    return true;
+}
+#endif
+
 static void i386_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
@@ -4317,6 +4503,13 @@ static void i386_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
     CCOp orig_cc_op = dc->cc_op;
     target_ulong orig_pc_save = dc->pc_save;
 
+#ifdef XBOX
+    if (g_use_native_routines && dc->base.num_insns == 1 &&
+        gen_native_routine(dc, cpu)) {
+        return;
+    }
+#endif
+
 #ifdef TARGET_VSYSCALL_PAGE
     /*
      * Detect entry into the vsyscall page and invoke the syscall.
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Builds text the way the NV2A shader generators do, out of many short lived
+ * MStrings per instruction, with and without an MString arena.
+ */
+#include "qemu/osdep.h"
+#include "qemu/mstring.h"
+#include "qemu/timer.h"
+
+#define NUM_PROGRAMS 256
+#define MAX_INSTRUCTIONS 136 /* NV2A vertex program limit */
+
+static const char *const opcodes[] = {
+    "MOV", "MUL", "ADD", "MAD", "DP3", "DPH", "DP4", "DST", "MIN", "MAX",
+    "SLT", "SGE", "ARL", "RCP", "RCC", "RSQ", "EXP", "LOG", "LIT",
+};
+
+static const char swizzle_chars[] = "xyzw";
+
+typedef struct Program {
+    int num_instructions;
+    uint32_t tokens[MAX_INSTRUCTIONS][4];
+} Program;
+
+static Program programs[NUM_PROGRAMS];
+static unsigned int duration = 1;
+
+static MString *gen_swizzle(uint32_t token)
+{
+    if ((token & 0xff) == 0x1b) {
+        return mstring_from_str("");
+    }
+    return mstring_from_str((char[]){
+        '.', swizzle_chars[token & 3], swizzle_chars[(token >> 2) & 3],
+        swizzle_chars[(token >> 4) & 3], swizzle_chars[(token >> 6) & 3], '\0'
+    });
+}
+
+static MString *gen_input(uint32_t token)
+{
+    MString *ret = mstring_new();
+    if (token & 0x100) {
+        mstring_append(ret, "-");
+    }
+    if (token & 0x200) {
+        mstring_append_fmt(ret, "c[%d]", (token >> 10) % 192);
+    } else {
+        mstring_append_fmt(ret, "R%d", (token >> 10) % 12);
+    }
+    MString *swizzle = gen_swizzle(token);
+    mstring_append(ret, mstring_get_str(swizzle));
+    mstring_unref(swizzle);
+    return ret;
+}
+
+static MString *gen_program(const Program *p)
+{
+    MString *body = mstring_new();
+
+    for (int i = 0; i < p->num_instructions; i++) {
+        const uint32_t *token = p->tokens[i];
+        MString *line = mstring_new();
+
+        mstring_append_fmt(line, "  %s(R%d.xyzw",
+                           opcodes[token[0] % ARRAY_SIZE(opcodes)],
+                           token[0] % 12);
+        for (int j = 1; j < 4; j++) {
+            MString *input = gen_input(token[j]);
+            mstring_append(line, ", ");
+            mstring_append(line, mstring_get_str(input));
+            mstring_unref(input);
+        }
+        mstring_append(line, ");\n");
+
+        mstring_append(body, mstring_get_str(line));
+        mstring_unref(line);
+    }
+
+    MString *code = mstring_from_fmt("#version 400\n\n"
+                                     "void main() {\n"
+                                     "%s"
+                                     "}\n",
+                                     mstring_get_str(body));
+    mstring_unref(body);
+
+    return code;
+}
+
+static void init_programs(void)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+
+    for (int i = 0; i < NUM_PROGRAMS; i++) {
+        Program *p = &programs[i];
+        p->num_instructions = g_rand_int_range(rand, 4, MAX_INSTRUCTIONS + 1);
+        for (int j = 0; j < p->num_instructions; j++) {
+            for (int k = 0; k < 4; k++) {
+                p->tokens[j][k] = g_rand_int(rand);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+static void run(const char *name, bool use_arena)
+{
+    int64_t start = get_clock();
+    int64_t deadline = start + duration * NANOSECONDS_PER_SECOND;
+    uint64_t count = 0;
+    size_t total_len = 0;
+
+    do {
+        for (int i = 0; i < NUM_PROGRAMS; i++) {
+            if (use_arena) {
+                mstring_arena_begin();
+            }
+            MString *code = gen_program(&programs[i]);
+            total_len += mstring_get_length(code);
+            mstring_unref(code);
+            if (use_arena) {
+                mstring_arena_end();
+            }
+        }
+        count += NUM_PROGRAMS;
+    } while (get_clock() < deadline);
+
+    int64_t elapsed = get_clock() - start;
+    printf("%-8s %10" PRIu64 " programs, %8.2f us/program (%zu bytes)\n",
+           name, count, (double)elapsed / count / 1000, total_len / count);
+}
+
+static void usage(const char *progname)
+{
+    printf("Usage: %s [-d duration]\n"
+           "  -d = duration in seconds of each run (default: 1)\n",
+           progname);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "hd:")) != -1) {
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    init_programs();
+    run("heap", false);
+    run("arena", true);
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Xbox hot kernel microbenchmarks.
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the texture upload and sample decoding kernels in isolation over
+ * fixed, pseudo-random data and reports their throughput in MB/s of input.
+ * The voice processor, DSP and shader generators have their own benchmarks
+ * in ../vp, ../dsp and ../shaders, all of which are in the xbox-bench suite:
+ *
+ *   meson test --benchmark --suite xbox-bench
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/fast-hash.h"
+#include "qemu/timer.h"
+#include "hw/xbox/nv2a/nv2a_int.h"
+#include "hw/xbox/nv2a/pgraph/s3tc.h"
+#include "hw/xbox/nv2a/pgraph/swizzle.h"
+#include "hw/xbox/nv2a/pgraph/texture.h"
+#include "hw/xbox/mcpx/apu/vp/adpcm.h"
+
+/* Each kernel is run until it processed about this much input */
+#define BENCH_BYTES (256 * MiB)
+
+#define ADPCM_BLOCK_SIZE 36
+#define ADPCM_SAMPLES_PER_BLOCK 65
+
+/* Textures are never read from guest memory here */
+void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
+{
+    g_assert_not_reached();
+}
+
+typedef struct TextureSize {
+    unsigned int width, height;
+} TextureSize;
+
+static const TextureSize texture_sizes[] = {
+    { 64, 64 },
+    { 256, 256 },
+    { 1024, 1024 },
+};
+
+static uint8_t *random_data(size_t size)
+{
+    uint8_t *data = g_malloc(size);
+    GRand *rand = g_rand_new_with_seed(1);
+
+    for (size_t i = 0; i < size; i++) {
+        data[i] = g_rand_int(rand);
+    }
+    g_rand_free(rand);
+
+    return data;
+}
+
+static int bench_iterations(size_t size)
+{
+    return MAX(BENCH_BYTES / size, 1);
+}
+
+static void report(const char *name, size_t size, int iterations,
+                   int64_t elapsed)
+{
+    g_test_message("%-24s %8zu bytes %10.2f MB/s", name, size,
+                   (double)size * iterations * NANOSECONDS_PER_SECOND /
+                       elapsed / MiB);
+}
+
+static void test_swizzle(gconstpointer opaque)
+{
+    const TextureSize *ts = opaque;
+    size_t pitch = ts->width * 4;
+    size_t size = pitch * ts->height;
+    g_autofree uint8_t *linear = random_data(size);
+    g_autofree uint8_t *swizzled = g_malloc(size);
+    g_autofree uint8_t *unswizzled = g_malloc(size);
+    int iterations = bench_iterations(size);
+
+    int64_t start = get_clock();
+    for (int i = 0; i < iterations; i++) {
+        swizzle_box(linear, ts->width, ts->height, 1, swizzled, pitch, size,
+                    4);
+    }
+    report("swizzle_box", size, iterations, get_clock() - start);
+
+    start = get_clock();
+    for (int i = 0; i < iterations; i++) {
+        unswizzle_box(swizzled, ts->width, ts->height, 1, unswizzled, pitch,
+                      size, 4);
+    }
+    report("unswizzle_box", size, iterations, get_clock() - start);
+
+    g_assert_cmpmem(linear, size, unswizzled, size);
+}
+
+static void test_s3tc(gconstpointer opaque)
+{
+    const TextureSize *ts = opaque;
+    static const struct {
+        const char *name;
+        enum S3TC_DECOMPRESS_FORMAT format;
+        unsigned int block_size;
+    } formats[] = {
+        { "s3tc_decompress_2d dxt1", S3TC_DECOMPRESS_FORMAT_DXT1, 8 },
+        { "s3tc_decompress_2d dxt3", S3TC_DECOMPRESS_FORMAT_DXT3, 16 },
+        { "s3tc_decompress_2d dxt5", S3TC_DECOMPRESS_FORMAT_DXT5, 16 },
+    };
+
+    for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+        size_t size =
+            (ts->width / 4) * (ts->height / 4) * formats[f].block_size;
+        g_autofree uint8_t *data = random_data(size);
+        int iterations = bench_iterations(size);
+
+        int64_t start = get_clock();
+        for (int i = 0; i < iterations; i++) {
+            g_free(s3tc_decompress_2d(formats[f].format, data, ts->width,
+                                      ts->height));
+        }
+        report(formats[f].name, size, iterations, get_clock() - start);
+    }
+}
+
+static void test_convert(gconstpointer opaque)
+{
+    const TextureSize *ts = opaque;
+    static const struct {
+        const char *name;
+        unsigned int color_format;
+        unsigned int bytes_per_pixel;
+    } formats[] = {
+        { "convert i8_a8r8g8b8", NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8,
+          1 },
+        { "convert cr8yb8cb8ya8",
+          NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8, 2 },
+        { "convert r6g5b5", NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5, 2 },
+    };
+    g_autofree uint8_t *palette = random_data(256 * 4);
+
+    for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+        unsigned int pitch = ts->width * formats[f].bytes_per_pixel;
+        size_t size = pitch * ts->height;
+        g_autofree uint8_t *data = random_data(size);
+        TextureShape shape = {
+            .dimensionality = 2,
+            .color_format = formats[f].color_format,
+            .levels = 1,
+            .width = ts->width,
+            .height = ts->height,
+            .depth = 1,
+            .pitch = pitch,
+        };
+        int iterations = bench_iterations(size);
+
+        int64_t start = get_clock();
+        for (int i = 0; i < iterations; i++) {
+            uint8_t *converted = pgraph_convert_texture_data(
+                shape, data, palette, ts->width, ts->height, 1, pitch, size,
+                NULL);
+            g_assert_nonnull(converted);
+            g_free(converted);
+        }
+        report(formats[f].name, size, iterations, get_clock() - start);
+    }
+}
+
+static void test_fast_hash(gconstpointer opaque)
+{
+    const TextureSize *ts = opaque;
+    size_t size = ts->width * ts->height * 4;
+    g_autofree uint8_t *data = random_data(size);
+    int iterations = bench_iterations(size);
+    uint64_t hash = 0;
+
+    int64_t start = get_clock();
+    for (int i = 0; i < iterations; i++) {
+        hash += fast_hash(data, size);
+    }
+    report("fast_hash", size, iterations, get_clock() - start);
+
+    g_assert_cmpuint(hash, ==, fast_hash(data, size) * iterations);
+}
+
+static void test_adpcm(gconstpointer opaque)
+{
+    int channels = GPOINTER_TO_INT(opaque);
+    int block_size = ADPCM_BLOCK_SIZE * channels;
+    int num_blocks = 1024;
+    size_t size = block_size * num_blocks;
+    g_autofree uint8_t *data = random_data(size);
+    int16_t decoded[ADPCM_SAMPLES_PER_BLOCK * 2];
+    int iterations = bench_iterations(size);
+
+    /* Make the headers valid, with the step index in range */
+    for (int b = 0; b < num_blocks; b++) {
+        for (int c = 0; c < channels; c++) {
+            uint8_t *header = &data[b * block_size + c * 4];
+            header[2] %= 89;
+            header[3] = 0;
+        }
+    }
+
+    int64_t start = get_clock();
+    for (int i = 0; i < iterations; i++) {
+        for (int b = 0; b < num_blocks; b++) {
+            int samples = adpcm_decode_block(decoded, &data[b * block_size],
+                                             block_size, channels);
+            g_assert_cmpint(samples, ==, ADPCM_SAMPLES_PER_BLOCK);
+        }
+    }
+    report(channels == 1 ? "adpcm_decode_block mono" :
+                           "adpcm_decode_block stereo",
+           size, iterations, get_clock() - start);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    for (int i = 0; i < ARRAY_SIZE(texture_sizes); i++) {
+        const TextureSize *ts = &texture_sizes[i];
+        g_autofree gchar *size = g_strdup_printf("%ux%u", ts->width,
+                                                 ts->height);
+        g_autofree gchar *path = NULL;
+
+        path = g_strdup_printf("/nv2a/swizzle/%s", size);
+        g_test_add_data_func(path, ts, test_swizzle);
+        g_free(path);
+        path = g_strdup_printf("/nv2a/s3tc/%s", size);
+        g_test_add_data_func(path, ts, test_s3tc);
+        g_free(path);
+        path = g_strdup_printf("/nv2a/convert/%s", size);
+        g_test_add_data_func(path, ts, test_convert);
+        g_free(path);
+        path = g_strdup_printf("/nv2a/fast_hash/%s", size);
+        g_test_add_data_func(path, ts, test_fast_hash);
+    }
+    g_test_add_data_func("/mcpx/adpcm/mono", GINT_TO_POINTER(1), test_adpcm);
+    g_test_add_data_func("/mcpx/adpcm/stereo", GINT_TO_POINTER(2), test_adpcm);
+
+    return g_test_run();
+}
@@ -18,7 +18,11 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/timer.h"
 #include "hw/xbox/mcpx/apu/dsp/dsp.h"
+#include "hw/xbox/mcpx/apu/dsp/dsp_state.h"
+
+#define BENCH_CYCLES 20000000
 
 static void scratch_rw(void *opaque, uint8_t *ptr, uint32_t addr, size_t len, bool dir)
 {
@@ -74,11 +78,37 @@ static void test_dsp_basic(void)
     dsp_destroy(s);
 }
 
+/* Runs a tight ALU loop and reports the interpreter's instruction rate */
+static void test_dsp_bench(void)
+{
+    g_autofree gchar *path = g_test_build_filename(G_TEST_DIST, "data", "bench", NULL);
+
+    DSPState *s = dsp_init(NULL, scratch_rw, fifo_rw);
+
+    load_prog(s, path);
+
+    int64_t start = get_clock();
+    for (int i = 0; i < BENCH_CYCLES / 1000; i++) {
+        dsp_run(s, 1000);
+    }
+    int64_t elapsed = get_clock() - start;
+
+    g_assert_cmpuint(s->core.pc, >=, 0x40);
+    g_assert_cmpuint(s->core.pc, <=, 0x44);
+    g_test_message("%u instructions, %.2f MIPS", s->core.cycle_count,
+                   (double)s->core.cycle_count * 1000 / elapsed);
+
+    dsp_destroy(s);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_func("/basic", test_dsp_basic);
+    if (g_test_perf()) {
+        g_test_add_func("/bench", test_dsp_bench);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,319 @@
+/*
+ * NV2A shader generation benchmark and regression test.
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Generates the GLSL of every shader state in a corpus written by
+ * `xemu -nv2a_shader_dump <dir>`, the way the OpenGL and Vulkan renderers
+ * would, and reports the time taken per stage.
+ *
+ * The corpus is read from the directory in NV2A_SHADER_CORPUS, the test is
+ * skipped if it is not set. A hash of each generated shader is checked
+ * against <corpus>/hashes.txt, so changes to the generators that should not
+ * alter their output can be verified. Run with NV2A_SHADER_CORPUS_UPDATE=1
+ * to (re)write the hashes from the current generators.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/fast-hash.h"
+#include "qemu/mstring.h"
+#include "qemu/timer.h"
+#include "hw/xbox/nv2a/pgraph/pgraph.h"
+#include "hw/xbox/nv2a/pgraph/glsl/shaders.h"
+
+#define HASHES_FILE "hashes.txt"
+
+typedef enum ShaderKind {
+    SHADER_VSH,
+    SHADER_GEOM,
+    SHADER_PSH,
+    SHADER_KIND_COUNT
+} ShaderKind;
+
+static const char *const shader_kind_names[SHADER_KIND_COUNT] = {
+    "vsh",
+    "geom",
+    "psh",
+};
+
+typedef struct Corpus {
+    char *path;
+    GPtrArray *names;  /* of the state files, sorted */
+    GArray *states;    /* ShaderState, in the same order */
+    GHashTable *hashes; /* "<name> <renderer> <kind>" -> hash string */
+    bool update;
+} Corpus;
+
+static Corpus corpus;
+
+static bool load_state(const char *path, ShaderState *state)
+{
+    g_autofree gchar *contents = NULL;
+    gsize length;
+    g_autoptr(GError) err = NULL;
+
+    if (!g_file_get_contents(path, &contents, &length, &err)) {
+        g_test_message("Failed to read %s: %s", path, err->message);
+        return false;
+    }
+
+    const ShaderStateDump *dump = (const ShaderStateDump *)contents;
+    if (length != sizeof(ShaderStateDump) ||
+        memcmp(dump->magic, SHADER_STATE_DUMP_MAGIC, sizeof(dump->magic)) ||
+        dump->version != SHADER_STATE_DUMP_VERSION ||
+        dump->state_size != sizeof(ShaderState)) {
+        g_test_message("Skipping %s, not a dump from this build", path);
+        return false;
+    }
+
+    memcpy(state, &dump->state, sizeof(ShaderState));
+    return true;
+}
+
+static void load_hashes(void)
+{
+    corpus.hashes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          g_free);
+
+    g_autofree gchar *path =
+        g_build_filename(corpus.path, HASHES_FILE, NULL);
+    g_autofree gchar *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i]; i++) {
+        char *sep = strrchr(lines[i], ' ');
+        if (!sep) {
+            continue;
+        }
+        g_hash_table_insert(corpus.hashes, g_strndup(lines[i], sep - lines[i]),
+                            g_strdup(sep + 1));
+    }
+}
+
+static void save_hashes(void)
+{
+    g_autoptr(GString) out = g_string_new(NULL);
+    g_autoptr(GList) keys = g_hash_table_get_keys(corpus.hashes);
+
+    keys = g_list_sort(keys, (GCompareFunc)strcmp);
+    for (GList *k = keys; k; k = k->next) {
+        g_string_append_printf(out, "%s %s\n", (const char *)k->data,
+                               (const char *)g_hash_table_lookup(
+                                   corpus.hashes, k->data));
+    }
+
+    g_autofree gchar *path =
+        g_build_filename(corpus.path, HASHES_FILE, NULL);
+    g_autoptr(GError) err = NULL;
+    if (!g_file_set_contents(path, out->str, out->len, &err)) {
+        g_test_message("Failed to write %s: %s", path, err->message);
+    }
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static bool load_corpus(void)
+{
+    const char *path = g_getenv("NV2A_SHADER_CORPUS");
+    if (!path) {
+        return false;
+    }
+
+    g_autoptr(GError) err = NULL;
+    g_autoptr(GDir) dir = g_dir_open(path, 0, &err);
+    if (!dir) {
+        g_test_message("Failed to open %s: %s", path, err->message);
+        return false;
+    }
+
+    corpus.path = g_strdup(path);
+    corpus.names = g_ptr_array_new_with_free_func(g_free);
+    corpus.states = g_array_new(false, false, sizeof(ShaderState));
+    corpus.update = g_getenv("NV2A_SHADER_CORPUS_UPDATE") != NULL;
+
+    const char *name;
+    while ((name = g_dir_read_name(dir))) {
+        if (g_str_has_suffix(name, SHADER_STATE_DUMP_SUFFIX)) {
+            g_ptr_array_add(corpus.names, g_strdup(name));
+        }
+    }
+    g_ptr_array_sort(corpus.names, compare_names);
+
+    for (int i = 0; i < corpus.names->len;) {
+        g_autofree gchar *file =
+            g_build_filename(path, g_ptr_array_index(corpus.names, i), NULL);
+        ShaderState state;
+        if (load_state(file, &state)) {
+            g_array_append_val(corpus.states, state);
+            i++;
+        } else {
+            g_ptr_array_remove_index(corpus.names, i);
+        }
+    }
+
+    load_hashes();
+
+    return corpus.states->len > 0;
+}
+
+/* Only used to set uniform values, which are not exercised here */
+void pgraph_get_inline_values(PGRAPHState *pg, uint16_t attrs,
+                               float values[NV2A_VERTEXSHADER_ATTRIBUTES][4],
+                               int *count)
+{
+    g_assert_not_reached();
+}
+
+/* Generates the shaders of a state with the options of the given renderer */
+static MString *generate(const ShaderState *state, ShaderKind kind,
+                         bool vulkan)
+{
+    bool need_geom = pgraph_glsl_need_geom(&state->geom);
+
+    switch (kind) {
+    case SHADER_VSH: {
+        VshState vsh = state->vsh;
+        GenVshGlslOptions opts = {
+            .vulkan = vulkan,
+            .prefix_outputs = need_geom,
+        };
+        if (vulkan) {
+            vsh.fog_mode = 0;
+            opts.use_spec_constants = true;
+            opts.ubo_binding = 0;
+        }
+        return pgraph_glsl_gen_vsh(&vsh, opts);
+    }
+    case SHADER_GEOM:
+        if (!need_geom) {
+            return NULL;
+        }
+        return pgraph_glsl_gen_geom(&state->geom,
+                                    (GenGeomGlslOptions){ .vulkan = vulkan });
+    case SHADER_PSH: {
+        PshState psh = state->psh;
+        GenPshGlslOptions opts = {
+            .vulkan = vulkan,
+        };
+        if (vulkan) {
+            psh.alpha_test = false;
+            psh.alpha_func = 0;
+            opts.use_spec_constants = true;
+            opts.ubo_binding = 1;
+            opts.tex_binding = 2;
+        }
+        return pgraph_glsl_gen_psh(&psh, opts);
+    }
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void check_hash(const char *name, bool vulkan, ShaderKind kind,
+                       MString *code)
+{
+    g_autofree gchar *key =
+        g_strdup_printf("%s %s %s", name, vulkan ? "vk" : "gl",
+                        shader_kind_names[kind]);
+    g_autofree gchar *hash = g_strdup_printf(
+        "%016" PRIx64, fast_hash((const uint8_t *)mstring_get_str(code),
+                                 mstring_get_length(code)));
+
+    if (corpus.update) {
+        g_hash_table_replace(corpus.hashes, g_steal_pointer(&key),
+                             g_steal_pointer(&hash));
+        return;
+    }
+
+    const char *expected = g_hash_table_lookup(corpus.hashes, key);
+    if (!expected) {
+        g_test_message("No hash recorded for %s", key);
+    } else if (strcmp(expected, hash)) {
+        g_test_message("%s: generated %s, expected %s", key, hash, expected);
+        g_test_fail();
+    }
+}
+
+static void test_generate(gconstpointer opaque)
+{
+    bool vulkan = GPOINTER_TO_INT(opaque);
+
+    if (!corpus.states) {
+        g_test_skip("Set NV2A_SHADER_CORPUS to a directory of shader states");
+        return;
+    }
+
+    int64_t elapsed[SHADER_KIND_COUNT] = { 0 };
+    size_t bytes[SHADER_KIND_COUNT] = { 0 };
+    unsigned int count[SHADER_KIND_COUNT] = { 0 };
+
+    for (int i = 0; i < corpus.states->len; i++) {
+        const ShaderState *state =
+            &g_array_index(corpus.states, ShaderState, i);
+        const char *name = g_ptr_array_index(corpus.names, i);
+
+        for (int kind = 0; kind < SHADER_KIND_COUNT; kind++) {
+            int64_t start = get_clock();
+            MString *code = generate(state, kind, vulkan);
+            elapsed[kind] += get_clock() - start;
+            if (!code) {
+                continue;
+            }
+
+            count[kind]++;
+            bytes[kind] += mstring_get_length(code);
+            check_hash(name, vulkan, kind, code);
+            mstring_unref(code);
+        }
+    }
+
+    for (int kind = 0; kind < SHADER_KIND_COUNT; kind++) {
+        if (!count[kind]) {
+            continue;
+        }
+        g_test_message("%s %-4s %6u shaders, %8.2f us/shader, %6zu bytes/shader",
+                       vulkan ? "vk" : "gl", shader_kind_names[kind],
+                       count[kind], (double)elapsed[kind] / count[kind] / 1000,
+                       bytes[kind] / count[kind]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    load_corpus();
+
+    g_test_add_data_func("/generate/gl", GINT_TO_POINTER(false),
+                         test_generate);
+    g_test_add_data_func("/generate/vk", GINT_TO_POINTER(true), test_generate);
+
+    int ret = g_test_run();
+
+    if (corpus.update && corpus.hashes) {
+        save_hashes();
+    }
+
+    return ret;
+}
@@ -17,6 +17,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -60,6 +61,59 @@ typedef struct Method {
 X_METHODS
 #undef X
 
+/*
+ * Straightforward texel by texel implementation that the methods under test
+ * are checked against.
+ */
+static uint32_t deposit_bits(uint32_t value, uint32_t mask)
+{
+    uint32_t result = 0;
+    for (uint32_t bit = 1; mask; bit <<= 1) {
+        if (value & bit) {
+            result |= mask & -mask;
+        }
+        mask &= mask - 1;
+    }
+    return result;
+}
+
+static void get_reference_masks(unsigned int width, unsigned int height,
+                                unsigned int depth, uint32_t *mask_x,
+                                uint32_t *mask_y, uint32_t *mask_z)
+{
+    uint32_t mask_bit = 1;
+    *mask_x = *mask_y = *mask_z = 0;
+    for (uint32_t bit = 1; bit < width || bit < height || bit < depth;
+         bit <<= 1) {
+        if (bit < width) { *mask_x |= mask_bit; mask_bit <<= 1; }
+        if (bit < height) { *mask_y |= mask_bit; mask_bit <<= 1; }
+        if (bit < depth) { *mask_z |= mask_bit; mask_bit <<= 1; }
+    }
+}
+
+static void swizzle_reference(const uint8_t *src_buf, unsigned int width,
+                              unsigned int height, unsigned int depth,
+                              uint8_t *dst_buf, unsigned int row_pitch,
+                              unsigned int slice_pitch, bool unswizzle,
+                              unsigned int bpp)
+{
+    uint32_t mask_x, mask_y, mask_z;
+    get_reference_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+
+    for (unsigned int z = 0; z < depth; z++)
+    for (unsigned int y = 0; y < height; y++)
+    for (unsigned int x = 0; x < width; x++) {
+        size_t linear = z * slice_pitch + y * row_pitch + x * bpp;
+        size_t swizzled = (deposit_bits(x, mask_x) | deposit_bits(y, mask_y) |
+                           deposit_bits(z, mask_z)) * bpp;
+        if (unswizzle) {
+            memcpy(dst_buf + linear, src_buf + swizzled, bpp);
+        } else {
+            memcpy(dst_buf + swizzled, src_buf + linear, bpp);
+        }
+    }
+}
+
 const Method methods[] = {
     #define X(m) { #m, swizzle_box_ ## m, unswizzle_box_ ## m},
     X_METHODS
@@ -68,10 +122,10 @@ const Method methods[] = {
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
-int widths[] = { 1, 2, 4, 8, 16, 32 };
-int heights[] = { 1, 2, 4, 8, 16, 32 };
+int widths[] = { 1, 2, 4, 8, 16, 32, 64 };
+int heights[] = { 1, 2, 4, 8, 16, 32, 64 };
 int depths[] = { 1, 2, 4, 8, 16, 32 };
-int bpps[] = { 1, 2, 3, 4 };
+int bpps[] = { 1, 2, 3, 4, 8, 16 };
 
 static void crosscheck(void)
 {
@@ -103,6 +157,14 @@ static void crosscheck(void)
         methods[0].swizzle(original_data, width, height, depth, swizzled_data_A,
                            row_pitch, slice_pitch, bpp);
 
+        void *swizzled_data_ref = malloc(size_bytes);
+        memcpy(swizzled_data_ref, original_data, size_bytes);
+        swizzle_reference(original_data, width, height, depth,
+                          swizzled_data_ref, row_pitch, slice_pitch, false,
+                          bpp);
+        assert(!memcmp(swizzled_data_ref, swizzled_data_A, size_bytes));
+        free(swizzled_data_ref);
+
         void *unswizzled_data_A = malloc(size_bytes);
         memcpy(unswizzled_data_A, original_data, size_bytes);
         methods[0].unswizzle(swizzled_data_A, width, height, depth,
@@ -147,15 +209,10 @@ static int compare_ints(const void *a, const void *b)
     return *(int*)a - *(int*)b;
 }
 
-static void bench(void)
+static void bench(int width, int height, int depth, int bpp)
 {
     fprintf(stderr, "%s...", __func__);
 
-    int width = 256;
-    int height = 256;
-    int depth = 256;
-    int bpp = 4;
-
     size_t row_pitch = width * bpp;
     size_t slice_pitch = row_pitch * height;
     size_t size_bytes = slice_pitch * depth;
@@ -173,7 +230,9 @@ static void bench(void)
 
     for (int method_idx = 0; method_idx < ARRAY_SIZE(methods); method_idx++) {
         const Method * const method = &methods[method_idx];
-        fprintf(stderr, "[%6s] ", method->name);
+        for (int unswizzle = 0; unswizzle < 2; unswizzle++) {
+        fprintf(stderr, "[%6s %9s] ", method->name,
+                unswizzle ? "unswizzle" : "swizzle");
 
         int samples[NUM_ITERATIONS];
         int sum = 0;
@@ -182,7 +241,11 @@ static void bench(void)
             struct timespec start, end;
 
             clock_gettime(CLOCK_MONOTONIC, &start);
-            method->swizzle(original_data, width, height, depth, swizzled_data, row_pitch, slice_pitch, bpp);
+            if (unswizzle) {
+                method->unswizzle(swizzled_data, width, height, depth, original_data, row_pitch, slice_pitch, bpp);
+            } else {
+                method->swizzle(original_data, width, height, depth, swizzled_data, row_pitch, slice_pitch, bpp);
+            }
             clock_gettime(CLOCK_MONOTONIC, &end);
 
             uint64_t start_ns = (uint64_t)start.tv_sec * (uint64_t)1000000000 + start.tv_nsec;
@@ -200,6 +263,7 @@ static void bench(void)
             med = samples[ARRAY_SIZE(samples) / 2];
         fprintf(stderr, "min: %6d us, max: %6d us, avg: %6d us, med: %6d us  -- %.2g GiB/s\n",
                 min, max, avg, med, (size_mib / 1024.0) / (med / 1000000.0));
+        }
     }
 
     free(swizzled_data);
@@ -210,8 +274,15 @@ int main(int argc, char const *argv[])
 {
     srand(1337);
 
-    crosscheck();
-    bench();
+    // Pass "bench" to skip the crosscheck
+    if (argc < 2 || strcmp(argv[1], "bench")) {
+        crosscheck();
+    }
+
+    bench(256, 256, 256, 4);
+    for (int bpp_idx = 0; bpp_idx < ARRAY_SIZE(bpps); bpp_idx++) {
+        bench(4096, 4096, 1, bpps[bpp_idx]);
+    }
 
     return 0;
 }
@@ -0,0 +1,167 @@
+/*
+ * MCPX APU voice processor benchmark.
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the per-voice filter and mixing stages of a VP frame over the voice
+ * state used by the emulator, for a number of active voices, and reports the
+ * time taken per frame. The first MCPX_HW_MAX_3D_VOICES voices are 3D voices
+ * and go through the HRTF filter, like in hardware.
+ *
+ * Samples are not fetched from guest memory or resampled, so this measures
+ * the filters and the layout of their state rather than a complete frame.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memalign.h"
+#include "qemu/timer.h"
+#include "hw/xbox/mcpx/apu/vp/vp.h"
+#include "hw/xbox/mcpx/apu/vp/mix.h"
+
+#define NUM_FRAMES 2000
+
+typedef struct VoiceBench {
+    MCPXAPUVoiceFilter *filters;
+    HrtfFilter *hrtf_filters;
+    float input[MCPX_HW_MAX_VOICES][NUM_SAMPLES_PER_FRAME][2];
+    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+} VoiceBench;
+
+static VoiceBench *bench_new(void)
+{
+    VoiceBench *b = g_new0(VoiceBench, 1);
+    size_t filters_size = MCPX_HW_MAX_VOICES * sizeof(MCPXAPUVoiceFilter);
+    size_t hrtf_size = MCPX_HW_MAX_3D_VOICES * sizeof(HrtfFilter);
+
+    b->filters = qemu_memalign(__alignof__(MCPXAPUVoiceFilter), filters_size);
+    memset(b->filters, 0, filters_size);
+    b->hrtf_filters = qemu_memalign(__alignof__(HrtfFilter), hrtf_size);
+
+    float hrir[2][HRTF_NUM_TAPS];
+    GRand *rand = g_rand_new_with_seed(1);
+    for (int v = 0; v < MCPX_HW_MAX_VOICES; v++) {
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            b->input[v][i][0] = g_rand_double_range(rand, -1.0, 1.0);
+            b->input[v][i][1] = g_rand_double_range(rand, -1.0, 1.0);
+        }
+        if (v < MCPX_HW_MAX_3D_VOICES) {
+            for (int k = 0; k < HRTF_NUM_TAPS; k++) {
+                hrir[0][k] = g_rand_double_range(rand, -1.0, 1.0);
+                hrir[1][k] = g_rand_double_range(rand, -1.0, 1.0);
+            }
+            hrtf_filter_init(&b->hrtf_filters[v]);
+            hrtf_filter_set_target_params(&b->hrtf_filters[v], hrir,
+                                          g_rand_double_range(rand, -20, 20));
+        }
+    }
+    g_rand_free(rand);
+
+    return b;
+}
+
+static void bench_free(VoiceBench *b)
+{
+    qemu_vfree(b->filters);
+    qemu_vfree(b->hrtf_filters);
+    g_free(b);
+}
+
+/* Mirrors the stages of voice_process() after the samples were fetched */
+static void process_voice(VoiceBench *b, int v)
+{
+    MCPXAPUVoiceFilter *filter = &b->filters[v];
+    float(*samples)[2] = (float(*)[2])filter->resample_buf;
+
+    memcpy(samples, b->input[v], sizeof(b->input[v]));
+
+    for (int ch = 0; ch < 2; ch++) {
+        sv_filter *svf = &filter->svf[ch];
+        setup_svf(svf, 0.5f, 0.7f, F_LP);
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            samples[i][ch] = run_svf(svf, samples[i][ch]);
+        }
+    }
+
+    if (v < MCPX_HW_MAX_3D_VOICES) {
+        hrtf_filter_process(&b->hrtf_filters[v], samples, samples);
+    }
+
+    float channel_samples[2][NUM_SAMPLES_PER_FRAME];
+    mix_deinterleave(samples, channel_samples[0], channel_samples[1],
+                     NUM_SAMPLES_PER_FRAME);
+    for (int bin = 0; bin < 8; bin++) {
+        mix_accumulate_scaled(b->mixbins[(v + bin) % NUM_MIXBINS],
+                              channel_samples[bin % 2], 1.0f / 8,
+                              NUM_SAMPLES_PER_FRAME);
+    }
+}
+
+static void run_frames(VoiceBench *b, int num_voices, int num_frames)
+{
+    for (int f = 0; f < num_frames; f++) {
+        memset(b->mixbins, 0, sizeof(b->mixbins));
+        for (int v = 0; v < num_voices; v++) {
+            process_voice(b, v);
+        }
+    }
+
+    for (int bin = 0; bin < NUM_MIXBINS; bin++) {
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            g_assert_true(isfinite(b->mixbins[bin][i]));
+        }
+    }
+}
+
+static void test_basic(void)
+{
+    VoiceBench *b = bench_new();
+    run_frames(b, 256, 4);
+    bench_free(b);
+}
+
+static void test_frame(gconstpointer opaque)
+{
+    int num_voices = GPOINTER_TO_INT(opaque);
+    VoiceBench *b = bench_new();
+
+    int64_t start = get_clock();
+    run_frames(b, num_voices, NUM_FRAMES);
+    int64_t elapsed = get_clock() - start;
+
+    g_test_message("%3d voices %8.2f us/frame, %6.3f us/voice", num_voices,
+                   (double)elapsed / NUM_FRAMES / 1000,
+                   (double)elapsed / NUM_FRAMES / num_voices / 1000);
+
+    bench_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/vp/basic", test_basic);
+    if (g_test_perf()) {
+        g_test_add_data_func("/vp/frame/64", GINT_TO_POINTER(64), test_frame);
+        g_test_add_data_func("/vp/frame/128", GINT_TO_POINTER(128),
+                             test_frame);
+        g_test_add_data_func("/vp/frame/256", GINT_TO_POINTER(256),
+                             test_frame);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,438 @@
+/*
+ * xemu benchmark mode
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qobject/qdict.h"
+#include "qobject/qjson.h"
+#include "qobject/qnum.h"
+#include "system/runstate.h"
+#include "hw/xbox/nv2a/debug.h"
+#include "hw/xbox/nv2a/nv2a.h"
+#include "xemu-benchmark.h"
+#include "xemu-frame-stats.h"
+#include "xemu-input.h"
+#include "xemu-snapshots.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define DEFAULT_FRAMES 3600
+#define NUM_PORTS 4
+
+typedef struct InputEvent {
+    unsigned int frame;
+    int port;
+    uint16_t buttons;
+    int16_t axis[CONTROLLER_AXIS__COUNT];
+} InputEvent;
+
+static const struct {
+    const char *name;
+    uint16_t mask;
+} button_names[] = {
+    { "A", CONTROLLER_BUTTON_A },
+    { "B", CONTROLLER_BUTTON_B },
+    { "X", CONTROLLER_BUTTON_X },
+    { "Y", CONTROLLER_BUTTON_Y },
+    { "LEFT", CONTROLLER_BUTTON_DPAD_LEFT },
+    { "UP", CONTROLLER_BUTTON_DPAD_UP },
+    { "RIGHT", CONTROLLER_BUTTON_DPAD_RIGHT },
+    { "DOWN", CONTROLLER_BUTTON_DPAD_DOWN },
+    { "BACK", CONTROLLER_BUTTON_BACK },
+    { "START", CONTROLLER_BUTTON_START },
+    { "WHITE", CONTROLLER_BUTTON_WHITE },
+    { "BLACK", CONTROLLER_BUTTON_BLACK },
+    { "LSTICK", CONTROLLER_BUTTON_LSTICK },
+    { "RSTICK", CONTROLLER_BUTTON_RSTICK },
+};
+
+static const char *axis_names[CONTROLLER_AXIS__COUNT] = {
+    [CONTROLLER_AXIS_LTRIG] = "LTRIG",
+    [CONTROLLER_AXIS_RTRIG] = "RTRIG",
+    [CONTROLLER_AXIS_LSTICK_X] = "LSTICK_X",
+    [CONTROLLER_AXIS_LSTICK_Y] = "LSTICK_Y",
+    [CONTROLLER_AXIS_RSTICK_X] = "RSTICK_X",
+    [CONTROLLER_AXIS_RSTICK_Y] = "RSTICK_Y",
+};
+
+static struct {
+    bool enabled;
+    char *report_path;
+    unsigned int frames;
+    char *snapshot;
+
+    GArray *script; // InputEvent, in frame order
+    unsigned int script_pos;
+    bool scripted_ports[NUM_PORTS];
+    InputEvent port_state[NUM_PORTS];
+
+    FILE *record;
+    InputEvent recorded[NUM_PORTS];
+
+    bool started;
+    unsigned int start_frame;
+    unsigned int last_frame_count;
+    int64_t start_time_ms;
+    uint64_t counters[NV2A_PROF__COUNT];
+    uint64_t peak_vram;
+} bench;
+
+void xemu_benchmark_init(const char *report_path)
+{
+    bench.enabled = true;
+    bench.report_path = g_strdup(report_path);
+    bench.frames = DEFAULT_FRAMES;
+}
+
+void xemu_benchmark_set_frames(unsigned int frames)
+{
+    bench.frames = MAX(frames, 1);
+}
+
+void xemu_benchmark_set_snapshot(const char *name)
+{
+    g_free(bench.snapshot);
+    bench.snapshot = g_strdup(name);
+}
+
+static bool parse_input_event(const char *line, InputEvent *ev, Error **errp)
+{
+    g_auto(GStrv) tokens = g_strsplit_set(line, " \t", -1);
+    int n = 0;
+
+    memset(ev, 0, sizeof(*ev));
+
+    for (int i = 0; tokens[i]; i++) {
+        const char *t = tokens[i];
+        if (!*t) {
+            continue;
+        }
+
+        if (n == 0) {
+            if (qemu_strtoui(t, NULL, 10, &ev->frame)) {
+                error_setg(errp, "Invalid frame '%s'", t);
+                return false;
+            }
+        } else if (n == 1) {
+            if (qemu_strtoi(t, NULL, 10, &ev->port) || ev->port < 0 ||
+                ev->port >= NUM_PORTS) {
+                error_setg(errp, "Invalid port '%s'", t);
+                return false;
+            }
+        } else if (strchr(t, '=')) {
+            const char *value = strchr(t, '=') + 1;
+            size_t len = value - 1 - t;
+            int axis = -1, v;
+            for (int j = 0; j < CONTROLLER_AXIS__COUNT; j++) {
+                if (strlen(axis_names[j]) == len &&
+                    !strncmp(t, axis_names[j], len)) {
+                    axis = j;
+                }
+            }
+            if (axis < 0 || qemu_strtoi(value, NULL, 10, &v) ||
+                v < INT16_MIN || v > INT16_MAX) {
+                error_setg(errp, "Invalid axis '%s'", t);
+                return false;
+            }
+            ev->axis[axis] = v;
+        } else {
+            int j;
+            for (j = 0; j < ARRAY_SIZE(button_names); j++) {
+                if (!strcmp(t, button_names[j].name)) {
+                    ev->buttons |= button_names[j].mask;
+                    break;
+                }
+            }
+            if (j == ARRAY_SIZE(button_names)) {
+                error_setg(errp, "Unknown button '%s'", t);
+                return false;
+            }
+        }
+        n++;
+    }
+
+    if (n < 2) {
+        error_setg(errp, "Expected a frame and a port");
+        return false;
+    }
+
+    return true;
+}
+
+void xemu_benchmark_set_input_path(const char *path)
+{
+    g_autofree char *contents = NULL;
+    GError *gerr = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, &gerr)) {
+        error_report("Failed to read %s: %s", path, gerr->message);
+        exit(1);
+    }
+
+    bench.script = g_array_new(false, false, sizeof(InputEvent));
+
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        if (!*line || *line == '#') {
+            continue;
+        }
+
+        InputEvent ev;
+        Error *err = NULL;
+        if (!parse_input_event(line, &ev, &err)) {
+            error_report("%s:%d: %s", path, i + 1, error_get_pretty(err));
+            exit(1);
+        }
+        if (bench.script->len &&
+            ev.frame < g_array_index(bench.script, InputEvent,
+                                     bench.script->len - 1).frame) {
+            error_report("%s:%d: Events must be in frame order", path, i + 1);
+            exit(1);
+        }
+
+        g_array_append_val(bench.script, ev);
+        bench.scripted_ports[ev.port] = true;
+    }
+}
+
+void xemu_benchmark_set_record_path(const char *path)
+{
+    bench.record = qemu_fopen(path, "w");
+    if (!bench.record) {
+        error_report("Failed to open %s for writing", path);
+        exit(1);
+    }
+    fprintf(bench.record, "# frame port buttons and axes\n");
+}
+
+bool xemu_benchmark_enabled(void)
+{
+    return bench.enabled;
+}
+
+const char *xemu_benchmark_get_icount_option(void)
+{
+    /* Recording is interactive, so the guest must not outrun real time */
+    return bench.record ? "shift=0,sleep=on" : "shift=0,sleep=off";
+}
+
+bool xemu_benchmark_override_input(ControllerState *state)
+{
+    int port = state->bound;
+    if (!bench.script || port < 0 || port >= NUM_PORTS ||
+        !bench.scripted_ports[port]) {
+        return false;
+    }
+
+    /* Until the benchmark starts scripted ports are left idle */
+    if (bench.started) {
+        unsigned int frame = nv2a_get_flip_count() - bench.start_frame;
+        while (bench.script_pos < bench.script->len) {
+            InputEvent *ev =
+                &g_array_index(bench.script, InputEvent, bench.script_pos);
+            if (ev->frame > frame) {
+                break;
+            }
+            bench.port_state[ev->port] = *ev;
+            bench.script_pos++;
+        }
+    }
+
+    state->buttons = bench.port_state[port].buttons;
+    memcpy(state->axis, bench.port_state[port].axis, sizeof(state->axis));
+    return true;
+}
+
+void xemu_benchmark_record_input(ControllerState *state)
+{
+    int port = state->bound;
+    if (!bench.record || !bench.started || port < 0 || port >= NUM_PORTS) {
+        return;
+    }
+
+    InputEvent *last = &bench.recorded[port];
+    if (state->buttons == last->buttons &&
+        !memcmp(state->axis, last->axis, sizeof(state->axis))) {
+        return;
+    }
+    last->buttons = state->buttons;
+    memcpy(last->axis, state->axis, sizeof(last->axis));
+
+    fprintf(bench.record, "%u %d", nv2a_get_flip_count() - bench.start_frame,
+            port);
+    for (int i = 0; i < ARRAY_SIZE(button_names); i++) {
+        if (state->buttons & button_names[i].mask) {
+            fprintf(bench.record, " %s", button_names[i].name);
+        }
+    }
+    for (int i = 0; i < CONTROLLER_AXIS__COUNT; i++) {
+        if (state->axis[i]) {
+            fprintf(bench.record, " %s=%d", axis_names[i], state->axis[i]);
+        }
+    }
+    fprintf(bench.record, "\n");
+}
+
+static uint64_t get_peak_rss(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return 0;
+    }
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+#ifdef CONFIG_DARWIN
+    return usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static void write_report(unsigned int frames, double wall_time_s)
+{
+    QDict *root = xemu_frame_stats_get_report();
+    qdict_put_int(root, "frames", frames);
+    qdict_put(root, "wall_time_s", qnum_from_double(wall_time_s));
+    qdict_put_str(root, "icount", xemu_benchmark_get_icount_option());
+    if (bench.snapshot) {
+        qdict_put_str(root, "snapshot", bench.snapshot);
+    }
+
+    QDict *counters = qdict_new();
+    for (int i = 0; i < NV2A_PROF__COUNT; i++) {
+        if (bench.counters[i]) {
+            qdict_put_int(counters, nv2a_profile_get_counter_name(i),
+                          bench.counters[i]);
+        }
+    }
+    qdict_put(root, "counters", counters);
+
+    QDict *caches = qdict_new();
+    for (int i = 0; i < NV2A_PROF_CACHE__COUNT; i++) {
+        const typeof(g_nv2a_stats.caches[0]) *c = &g_nv2a_stats.caches[i];
+        if (!c->capacity) {
+            continue;
+        }
+        QDict *cache = qdict_new();
+        qdict_put_int(cache, "used", c->used);
+        qdict_put_int(cache, "capacity", c->capacity);
+        qdict_put_int(cache, "hits", c->hits);
+        qdict_put_int(cache, "misses", c->misses);
+        qdict_put_int(cache, "evictions", c->evictions);
+        qdict_put(caches, nv2a_profile_get_cache_name(i), cache);
+    }
+    qdict_put(root, "caches", caches);
+
+    QDict *memory = qdict_new();
+    qdict_put_int(memory, "peak_vram_bytes", bench.peak_vram);
+    qdict_put_int(memory, "peak_rss_bytes", get_peak_rss());
+    qdict_put(root, "memory", memory);
+
+    GString *json = qobject_to_json_pretty(QOBJECT(root), true);
+    qobject_unref(root);
+
+    GError *gerr = NULL;
+    if (!g_file_set_contents(bench.report_path, json->str, json->len,
+                             &gerr)) {
+        error_report("Failed to write %s: %s", bench.report_path,
+                     gerr->message);
+        g_error_free(gerr);
+    }
+    g_string_free(json, true);
+}
+
+static void start(void)
+{
+    if (bench.snapshot) {
+        Error *err = NULL;
+        xemu_snapshots_load(bench.snapshot, &err);
+        if (err) {
+            error_report_err(err);
+            exit(1);
+        }
+    }
+
+    bench.started = true;
+    bench.start_frame = bench.last_frame_count = nv2a_get_flip_count();
+    bench.start_time_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    xemu_frame_stats_reset();
+}
+
+void xemu_benchmark_frame(void)
+{
+    if (!bench.enabled) {
+        return;
+    }
+
+    if (!bench.started) {
+        if (runstate_is_running()) {
+            start();
+        }
+        return;
+    }
+
+    unsigned int frame_count = nv2a_get_flip_count();
+    unsigned int new_frames =
+        MIN(frame_count - bench.last_frame_count, NV2A_PROF_NUM_FRAMES);
+    bench.last_frame_count = frame_count;
+
+    for (unsigned int i = new_frames; i > 0; i--) {
+        unsigned int idx = (g_nv2a_stats.frame_ptr + NV2A_PROF_NUM_FRAMES - i) %
+                           NV2A_PROF_NUM_FRAMES;
+        for (int j = 0; j < NV2A_PROF__COUNT; j++) {
+            bench.counters[j] += g_nv2a_stats.frame_history[idx].counters[j];
+        }
+    }
+    bench.peak_vram = MAX(bench.peak_vram, g_nv2a_stats.vram.usage);
+
+    unsigned int frames = frame_count - bench.start_frame;
+    if (frames < bench.frames) {
+        return;
+    }
+
+    double wall_time_s =
+        (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - bench.start_time_ms) / 1e3;
+    write_report(frames, wall_time_s);
+    if (bench.record) {
+        fclose(bench.record);
+    }
+
+    fprintf(stderr, "benchmark: %u frames in %.2f s, %.2f FPS\n", frames,
+            wall_time_s, frames / MAX(wall_time_s, 1e-3));
+    exit(0);
+}
@@ -0,0 +1,83 @@
+/*
+ * xemu benchmark mode
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef XEMU_BENCHMARK_H
+#define XEMU_BENCHMARK_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ControllerState;
+
+/*
+ * Runs a title for a number of guest frames, optionally starting from a
+ * snapshot and with the controllers driven by an input script, then writes a
+ * JSON report of the frame statistics, NV2A counters, cache statistics and
+ * peak memory use and exits.
+ *
+ * The guest runs with -icount, so its clock is tied to the instructions it
+ * executes rather than to how fast the host renders, and without sleeping
+ * so that frames are rendered as fast as the host can.
+ *
+ * Input scripts are text files with one line per change of a port's state,
+ * counted in guest frames from the start of the benchmark:
+ *
+ *     # frame port buttons and axes
+ *     120 0 START
+ *     126 0
+ *     300 0 A LSTICK_Y=32767 RTRIG=32767
+ *
+ * Buttons not listed are released and axes not listed are centered. Ports
+ * driven by the script ignore the host's controllers, and must have a
+ * controller bound for the guest to see them. Scripts are recorded by
+ * playing with xemu_benchmark_set_record_path(), which lets the guest sleep
+ * so that it runs in real time.
+ */
+void xemu_benchmark_init(const char *report_path);
+void xemu_benchmark_set_frames(unsigned int frames);
+void xemu_benchmark_set_snapshot(const char *name);
+void xemu_benchmark_set_input_path(const char *path);
+void xemu_benchmark_set_record_path(const char *path);
+bool xemu_benchmark_enabled(void);
+
+/* -icount option to run the guest with */
+const char *xemu_benchmark_get_icount_option(void);
+
+/* Called by the UI thread once per present with the BQL held */
+void xemu_benchmark_frame(void);
+
+/*
+ * Called with the BQL held when the guest polls a controller. Returns true
+ * if the script drives the port, having updated the state from it.
+ */
+bool xemu_benchmark_override_input(struct ControllerState *state);
+void xemu_benchmark_record_input(struct ControllerState *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
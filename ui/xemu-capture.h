@@ -0,0 +1,53 @@
+/*
+ * xemu gameplay recording
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef XEMU_CAPTURE_H
+#define XEMU_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Error Error;
+
+/*
+ * Records the guest video output and the APU monitor audio to
+ * <screenshot dir>/xemu-<date>.y4m and .wav. Frames are converted to YUV on
+ * the GPU and read back asynchronously, files are written by a thread of
+ * their own.
+ */
+bool xemu_capture_start(Error **errp);
+void xemu_capture_stop(void);
+bool xemu_capture_is_active(void);
+
+/* Called by the APU with each frame of 48 kHz stereo monitor output */
+void xemu_capture_audio(const int16_t samples[][2], int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * xemu disc images
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qobject/qdict.h"
+#include "qobject/qjson.h"
+#include "xemu-disc.h"
+#include "xemu-settings.h"
+
+#define QCOW2_MAGIC "QFI\xfb"
+
+static bool is_qcow2_image(const char *path)
+{
+    char magic[4];
+    bool ret = false;
+
+    FILE *f = qemu_fopen(path, "rb");
+    if (f) {
+        ret = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+              !memcmp(magic, QCOW2_MAGIC, sizeof(magic));
+        fclose(f);
+    }
+
+    return ret;
+}
+
+char *xemu_disc_get_filename(const char *path, const char **format)
+{
+    bool qcow2 = is_qcow2_image(path);
+
+    if (!g_config.perf.disc_read_ahead) {
+        *format = qcow2 ? "qcow2" : "raw";
+        return g_strdup(path);
+    }
+
+    if (!qcow2) {
+        *format = "xiso";
+        return g_strdup(path);
+    }
+
+    QDict *options = qdict_new();
+    qdict_put_str(options, "driver", "xiso");
+    qdict_put_str(options, "file.driver", "qcow2");
+    qdict_put_str(options, "file.file.driver", "file");
+    qdict_put_str(options, "file.file.filename", path);
+
+    g_autoptr(GString) json = qobject_to_json(QOBJECT(options));
+    qobject_unref(options);
+
+    *format = NULL;
+    return g_strdup_printf("json:%s", json->str);
+}
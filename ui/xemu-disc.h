@@ -0,0 +1,49 @@
+/*
+ * xemu disc images
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_DISC_H
+#define XEMU_DISC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns the file name and block driver to open the disc image at @path
+ * with. Besides plain images, these can be qcow2 images, which can have their
+ * clusters compressed with zstd:
+ *
+ *   qemu-img convert -c -O qcow2 -o compression_type=zstd game.iso game.qcow2
+ *
+ * When disc read-ahead is enabled, images are read through the "xiso" driver,
+ * and compressed ones through "qcow2" underneath it, which takes a "json:"
+ * file name. @format is NULL then.
+ */
+char *xemu_disc_get_filename(const char *path, const char **format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * xemu fast boot
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/units.h"
+#include "system/block-backend.h"
+#include "system/runstate.h"
+#include "xemu-fast-boot.h"
+#include "xemu-settings.h"
+#include "xemu-snapshots.h"
+#include "xemu-version.h"
+
+#include <glib/gstdio.h>
+
+#define FAST_BOOT_SLOT "xemu-fast-boot"
+
+/*
+ * The partition table, refurbishment and configuration sectors, which is
+ * what the kernel reads of the hard disk before it launches the disc
+ */
+#define FAST_BOOT_HDD_AREA (512 * KiB)
+
+static struct {
+    bool armed;
+    bool capturing;
+    VMChangeStateEntry *vmse;
+} fb;
+
+static char *get_key_path(void)
+{
+    return g_strdup_printf("%sfast-boot.key", xemu_settings_get_cache_path());
+}
+
+static void add_file(GChecksum *sum, const char *path)
+{
+    g_autofree char *data = NULL;
+    gsize size = 0;
+
+    g_checksum_update(sum, (const guchar *)path, strlen(path) + 1);
+    if (g_file_get_contents(path, &data, &size, NULL)) {
+        g_checksum_update(sum, (const guchar *)data, size);
+    }
+}
+
+/* Identifies everything the state depends on that is not restored with it */
+static char *get_key(void)
+{
+    BlockBackend *blk = blk_by_name("ide0-hd0");
+    if (!blk || !blk_is_inserted(blk)) {
+        return NULL;
+    }
+
+    g_autofree uint8_t *hdd_area = g_malloc(FAST_BOOT_HDD_AREA);
+    if (blk_pread(blk, 0, FAST_BOOT_HDD_AREA, hdd_area, 0) < 0) {
+        return NULL;
+    }
+
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    int settings[] = { g_config.sys.mem_limit, g_config.sys.avpack };
+
+    g_checksum_update(sum, (const guchar *)xemu_version,
+                      strlen(xemu_version) + 1);
+    g_checksum_update(sum, (const guchar *)settings, sizeof(settings));
+    add_file(sum, g_config.sys.files.bootrom_path);
+    add_file(sum, g_config.sys.files.flashrom_path);
+    add_file(sum, g_config.sys.files.eeprom_path);
+    /* Only the start of the disk, saves elsewhere must not change the key */
+    g_checksum_update(sum, (const guchar *)g_config.sys.files.hdd_path,
+                      strlen(g_config.sys.files.hdd_path) + 1);
+    g_checksum_update(sum, hdd_area, FAST_BOOT_HDD_AREA);
+
+    char *key = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return key;
+}
+
+static void capture(void *opaque)
+{
+    Error *err = NULL;
+    g_autofree char *key = get_key();
+    g_autofree char *key_path = get_key_path();
+
+    qemu_del_vm_change_state_handler(fb.vmse);
+    fb.vmse = NULL;
+
+    if (key) {
+        xemu_quicksave_save_machine(FAST_BOOT_SLOT, &err);
+        if (err) {
+            warn_reportf_err(err, "Failed to save the fast boot state: ");
+        } else {
+            g_file_set_contents(key_path, key, -1, NULL);
+        }
+    }
+
+    vm_start();
+}
+
+static void vm_state_changed(void *opaque, bool running, RunState state)
+{
+    if (fb.capturing && !running && state == RUN_STATE_SAVE_VM) {
+        fb.capturing = false;
+        aio_bh_schedule_oneshot(qemu_get_aio_context(), capture, NULL);
+    }
+}
+
+void xemu_fast_boot_init(void)
+{
+    BlockBackend *dvd = blk_by_name("ide0-cd1");
+
+    if (!g_config.general.fast_boot || !g_config.sys.files.hdd_path[0] ||
+        !dvd || !blk_is_inserted(dvd)) {
+        return;
+    }
+
+    g_autofree char *key = get_key();
+    g_autofree char *key_path = get_key_path();
+    g_autofree char *saved_key = NULL;
+    if (!key) {
+        return;
+    }
+
+    if (g_file_get_contents(key_path, &saved_key, NULL, NULL) &&
+        !strcmp(key, saved_key) && xemu_quicksave_exists(FAST_BOOT_SLOT)) {
+        Error *err = NULL;
+        if (xemu_quicksave_load_machine(FAST_BOOT_SLOT, &err)) {
+            return;
+        }
+        warn_reportf_err(err, "Failed to restore the fast boot state: ");
+        qemu_system_reset(SHUTDOWN_CAUSE_SNAPSHOT_LOAD);
+    }
+
+    /* Anything from an older setup is taken again on this boot */
+    g_unlink(key_path);
+    xemu_quicksave_delete(FAST_BOOT_SLOT);
+
+    fb.armed = true;
+    fb.vmse = qemu_add_vm_change_state_handler(vm_state_changed, NULL);
+}
+
+void xemu_fast_boot_checkpoint(void)
+{
+    if (!fb.armed) {
+        return;
+    }
+
+    /* Stops right after the read, the state is saved once it has stopped */
+    fb.armed = false;
+    fb.capturing = true;
+    vm_stop(RUN_STATE_SAVE_VM);
+}
+
+void xemu_fast_boot_cancel(void)
+{
+    fb.armed = false;
+}
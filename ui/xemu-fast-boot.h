@@ -0,0 +1,53 @@
+/*
+ * xemu fast boot
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_FAST_BOOT_H
+#define XEMU_FAST_BOOT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fast boot keeps the state of the machine as the kernel is about to launch
+ * the disc, the first time the kernel reads the tray state, and restores it
+ * when booting with a disc again instead of running the kernel boot. The
+ * state is taken again whenever the ROMs, the EEPROM, the machine settings
+ * or the configuration area of the hard disk change.
+ */
+
+/* Restores the state, or arms taking it, before the machine is started */
+void xemu_fast_boot_init(void);
+
+/* Called by the SMC, from the vCPU, when the tray state is read */
+void xemu_fast_boot_checkpoint(void);
+
+/* The boot is not the one the state would be taken from anymore */
+void xemu_fast_boot_cancel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
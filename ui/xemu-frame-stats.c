@@ -0,0 +1,424 @@
+/*
+ * xemu frame statistics
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qobject/qdict.h"
+#include "qobject/qjson.h"
+#include "qobject/qnum.h"
+#include "system/runstate.h"
+#include "hw/xbox/mcpx/apu/apu_debug.h"
+#include "xemu-frame-stats.h"
+#include "xemu-settings.h"
+#include "xemu-version.h"
+#include "xemu-xbe.h"
+
+/*
+ * Values below SUB_BUCKETS are counted exactly. Above that each power of two
+ * is split into HALF_SUB_BUCKETS buckets, keeping 6 significant bits.
+ */
+#define SUB_BUCKET_BITS 7
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HALF_SUB_BUCKETS (SUB_BUCKETS / 2)
+#define MAX_VALUE_BITS 40
+#define NUM_BUCKETS \
+    (SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * HALF_SUB_BUCKETS)
+
+#define SAMPLE_INTERVAL_MS 1000
+
+typedef struct Histogram {
+    uint64_t count;
+    int64_t total;
+    int64_t min, max;
+    uint64_t buckets[NUM_BUCKETS];
+} Histogram;
+
+static struct {
+    QemuSpin lock;
+    Histogram hist[XEMU_FRAME_STAT__COUNT];
+    time_t session_start;
+
+    /* Owned by the UI thread */
+    int64_t last_sample_ms;
+    uint32_t title_id;
+    char *title_name;
+} stats;
+
+static const char *stat_names[XEMU_FRAME_STAT__COUNT] = {
+    [XEMU_FRAME_STAT_FRAME_TIME] = "frame_time",
+    [XEMU_FRAME_STAT_PRESENT_INTERVAL] = "present_interval",
+    [XEMU_FRAME_STAT_CPU_TIME] = "cpu_time",
+    [XEMU_FRAME_STAT_GPU_TIME] = "gpu_time",
+    [XEMU_FRAME_STAT_APU_UTILIZATION] = "apu_utilization",
+};
+
+static const char *stat_units[XEMU_FRAME_STAT__COUNT] = {
+    [XEMU_FRAME_STAT_FRAME_TIME] = "us",
+    [XEMU_FRAME_STAT_PRESENT_INTERVAL] = "us",
+    [XEMU_FRAME_STAT_CPU_TIME] = "us",
+    [XEMU_FRAME_STAT_GPU_TIME] = "us",
+    [XEMU_FRAME_STAT_APU_UTILIZATION] = "permille",
+};
+
+static int bucket_index(int64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+
+    int shift = 63 - clz64(value) - (SUB_BUCKET_BITS - 1);
+    return SUB_BUCKETS + (shift - 1) * HALF_SUB_BUCKETS +
+           (int)(value >> shift) - HALF_SUB_BUCKETS;
+}
+
+/* Middle of the range of values counted by a bucket */
+static double bucket_value(int index)
+{
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+
+    int i = index - SUB_BUCKETS;
+    int shift = i / HALF_SUB_BUCKETS + 1;
+    int64_t low = (int64_t)(i % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS) << shift;
+    return low + ((1LL << shift) - 1) / 2.0;
+}
+
+void xemu_frame_stats_record(XemuFrameStat stat, int64_t value)
+{
+    assert(stat < XEMU_FRAME_STAT__COUNT);
+    value = MIN(MAX(value, 0), (1LL << MAX_VALUE_BITS) - 1);
+
+    qemu_spin_lock(&stats.lock);
+    Histogram *h = &stats.hist[stat];
+    if (!h->count || value < h->min) {
+        h->min = value;
+    }
+    if (!h->count || value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->total += value;
+    h->buckets[bucket_index(value)]++;
+    qemu_spin_unlock(&stats.lock);
+}
+
+static int64_t histogram_percentile(const Histogram *h, double q)
+{
+    uint64_t target = MAX((uint64_t)ceil(q * h->count), 1);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return MIN(MAX((int64_t)bucket_value(i), h->min), h->max);
+        }
+    }
+
+    return h->max;
+}
+
+/* Average of the largest fraction of the samples */
+static double histogram_low(const Histogram *h, double fraction)
+{
+    uint64_t n = MAX((uint64_t)ceil(fraction * h->count), 1);
+    uint64_t remaining = n;
+    double total = 0;
+
+    for (int i = NUM_BUCKETS - 1; i >= 0 && remaining; i--) {
+        uint64_t taken = MIN(h->buckets[i], remaining);
+        double value = MIN(bucket_value(i), h->max);
+        total += taken * value;
+        remaining -= taken;
+    }
+
+    return total / n;
+}
+
+const char *xemu_frame_stats_get_name(XemuFrameStat stat)
+{
+    assert(stat < XEMU_FRAME_STAT__COUNT);
+    return stat_names[stat];
+}
+
+void xemu_frame_stats_get_summary(XemuFrameStat stat,
+                                  XemuFrameStatSummary *summary)
+{
+    assert(stat < XEMU_FRAME_STAT__COUNT);
+    memset(summary, 0, sizeof(*summary));
+
+    qemu_spin_lock(&stats.lock);
+    const Histogram *h = &stats.hist[stat];
+    if (h->count) {
+        summary->count = h->count;
+        summary->avg = (double)h->total / h->count;
+        summary->min = h->min;
+        summary->max = h->max;
+        summary->p50 = histogram_percentile(h, 0.5);
+        summary->p99 = histogram_percentile(h, 0.99);
+        summary->p999 = histogram_percentile(h, 0.999);
+        summary->low_1 = histogram_low(h, 0.01);
+        summary->low_01 = histogram_low(h, 0.001);
+    }
+    qemu_spin_unlock(&stats.lock);
+}
+
+void xemu_frame_stats_reset(void)
+{
+    qemu_spin_lock(&stats.lock);
+    memset(stats.hist, 0, sizeof(stats.hist));
+    stats.session_start = time(NULL);
+    qemu_spin_unlock(&stats.lock);
+}
+
+void xemu_frame_stats_update(void)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (now - stats.last_sample_ms < SAMPLE_INTERVAL_MS) {
+        return;
+    }
+    stats.last_sample_ms = now;
+
+    if (!stats.session_start) {
+        stats.session_start = time(NULL);
+    }
+
+    if (!runstate_is_running()) {
+        return;
+    }
+
+    const struct McpxApuDebug *apu = mcpx_apu_get_debug_info();
+    xemu_frame_stats_record(XEMU_FRAME_STAT_APU_UTILIZATION,
+                            apu->utilization * 1000);
+
+    struct xbe *xbe = xemu_get_xbe_info();
+    if (!xbe || !xbe->cert || xbe->cert->m_titleid == stats.title_id) {
+        return;
+    }
+
+    /* Whatever ran before the first title was detected is not kept */
+    if (stats.title_id) {
+        xemu_frame_stats_auto_export();
+    }
+    xemu_frame_stats_reset();
+
+    stats.title_id = xbe->cert->m_titleid;
+    g_free(stats.title_name);
+    stats.title_name =
+        g_utf16_to_utf8(xbe->cert->m_title_name, 40, NULL, NULL, NULL);
+}
+
+static const char *get_renderer_name(void)
+{
+    switch (g_config.display.renderer) {
+    case CONFIG_DISPLAY_RENDERER_OPENGL:
+        return "opengl";
+    case CONFIG_DISPLAY_RENDERER_VULKAN:
+        return "vulkan";
+    default:
+        return "null";
+    }
+}
+
+static void write_csv_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"') {
+            fputc('"', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static bool write_csv(const char *path, XemuFrameStatSummary *summaries,
+                      Error **errp)
+{
+    FILE *f = qemu_fopen(path, "w");
+    if (!f) {
+        error_setg_errno(errp, errno, "Failed to open %s for writing", path);
+        return false;
+    }
+
+    fprintf(f, "xemu_version,title_id,title_name,metric,unit,count,avg,min,"
+               "max,p50,p99,p99_9,low_1pct,low_0_1pct\n");
+    for (int i = 0; i < XEMU_FRAME_STAT__COUNT; i++) {
+        XemuFrameStatSummary *s = &summaries[i];
+        write_csv_string(f, xemu_version);
+        fprintf(f, ",%08x,", stats.title_id);
+        write_csv_string(f, stats.title_name ?: "");
+        fprintf(f,
+                ",%s,%s,%" PRIu64 ",%.1f,%" PRId64 ",%" PRId64 ",%" PRId64
+                ",%" PRId64 ",%" PRId64 ",%.1f,%.1f\n",
+                stat_names[i], stat_units[i], s->count, s->avg, s->min,
+                s->max, s->p50, s->p99, s->p999, s->low_1, s->low_01);
+    }
+
+    bool failed = ferror(f);
+    if (fclose(f) || failed) {
+        error_setg(errp, "Failed to write %s", path);
+        return false;
+    }
+
+    return true;
+}
+
+static double frame_time_to_fps(double us)
+{
+    return us > 0 ? 1e6 / us : 0;
+}
+
+static QDict *build_report(XemuFrameStatSummary *summaries)
+{
+    QDict *root = qdict_new();
+    qdict_put_str(root, "xemu_version", xemu_version);
+    g_autofree char *title_id = g_strdup_printf("%08x", stats.title_id);
+    qdict_put_str(root, "title_id", title_id);
+    qdict_put_str(root, "title_name", stats.title_name ?: "");
+    qdict_put_str(root, "renderer", get_renderer_name());
+    qdict_put_int(root, "session_start", stats.session_start);
+    qdict_put_int(root, "session_duration_s",
+                  MAX(time(NULL) - stats.session_start, 0));
+
+    QDict *metrics = qdict_new();
+    for (int i = 0; i < XEMU_FRAME_STAT__COUNT; i++) {
+        XemuFrameStatSummary *s = &summaries[i];
+        QDict *m = qdict_new();
+        qdict_put_str(m, "unit", stat_units[i]);
+        qdict_put_int(m, "count", s->count);
+        qdict_put(m, "avg", qnum_from_double(s->avg));
+        qdict_put_int(m, "min", s->min);
+        qdict_put_int(m, "max", s->max);
+        qdict_put_int(m, "p50", s->p50);
+        qdict_put_int(m, "p99", s->p99);
+        qdict_put_int(m, "p99_9", s->p999);
+        qdict_put(m, "low_1pct", qnum_from_double(s->low_1));
+        qdict_put(m, "low_0_1pct", qnum_from_double(s->low_01));
+        qdict_put(metrics, stat_names[i], m);
+    }
+    qdict_put(root, "metrics", metrics);
+
+    XemuFrameStatSummary *ft = &summaries[XEMU_FRAME_STAT_FRAME_TIME];
+    QDict *fps = qdict_new();
+    qdict_put(fps, "avg", qnum_from_double(frame_time_to_fps(ft->avg)));
+    qdict_put(fps, "low_1pct",
+              qnum_from_double(frame_time_to_fps(ft->low_1)));
+    qdict_put(fps, "low_0_1pct",
+              qnum_from_double(frame_time_to_fps(ft->low_01)));
+    qdict_put(root, "fps", fps);
+
+    return root;
+}
+
+static void get_summaries(XemuFrameStatSummary *summaries)
+{
+    for (int i = 0; i < XEMU_FRAME_STAT__COUNT; i++) {
+        xemu_frame_stats_get_summary(i, &summaries[i]);
+    }
+}
+
+QDict *xemu_frame_stats_get_report(void)
+{
+    XemuFrameStatSummary summaries[XEMU_FRAME_STAT__COUNT];
+    get_summaries(summaries);
+    return build_report(summaries);
+}
+
+static bool write_json(const char *path, XemuFrameStatSummary *summaries,
+                       Error **errp)
+{
+    QDict *root = build_report(summaries);
+    GString *json = qobject_to_json_pretty(QOBJECT(root), true);
+    qobject_unref(root);
+
+    GError *gerr = NULL;
+    bool ok = g_file_set_contents(path, json->str, json->len, &gerr);
+    g_string_free(json, true);
+    if (!ok) {
+        error_setg(errp, "Failed to write %s: %s", path, gerr->message);
+        g_error_free(gerr);
+    }
+
+    return ok;
+}
+
+char *xemu_frame_stats_export(Error **errp)
+{
+    XemuFrameStatSummary summaries[XEMU_FRAME_STAT__COUNT];
+    get_summaries(summaries);
+
+    char fname[128];
+    time_t t = stats.session_start ?: time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S-stats", tmp);
+    } else {
+        strcpy(fname, "xemu-stats");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
+    }
+
+    g_autofree char *csv_path =
+        g_strdup_printf("%s/%s.csv", output_dir, fname);
+    char *json_path = g_strdup_printf("%s/%s.json", output_dir, fname);
+
+    if (!write_csv(csv_path, summaries, errp) ||
+        !write_json(json_path, summaries, errp)) {
+        g_free(json_path);
+        return NULL;
+    }
+
+    return json_path;
+}
+
+void xemu_frame_stats_auto_export(void)
+{
+    if (!g_config.display.debug.video.frame_stats_export) {
+        return;
+    }
+
+    XemuFrameStatSummary summary;
+    xemu_frame_stats_get_summary(XEMU_FRAME_STAT_FRAME_TIME, &summary);
+    if (!summary.count) {
+        return;
+    }
+
+    Error *err = NULL;
+    char *path = xemu_frame_stats_export(&err);
+    if (err) {
+        error_report_err(err);
+    } else {
+        info_report("Frame statistics saved to %s", path);
+        g_free(path);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * xemu frame statistics
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef XEMU_FRAME_STATS_H
+#define XEMU_FRAME_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Error Error;
+typedef struct QDict QDict;
+
+/*
+ * Keeps a log-linear histogram of each statistic over the session, so that
+ * percentiles are accurate to within 1% however long it runs. Larger values
+ * are worse for all of them, the "lows" are the averages of the largest 1%
+ * and 0.1% of the samples.
+ */
+typedef enum XemuFrameStat {
+    XEMU_FRAME_STAT_FRAME_TIME,       /* Guest flip to flip, us */
+    XEMU_FRAME_STAT_PRESENT_INTERVAL, /* Host present to present, us */
+    XEMU_FRAME_STAT_CPU_TIME,         /* Host renderer work per frame, us */
+    XEMU_FRAME_STAT_GPU_TIME,         /* GPU time per frame, us */
+    XEMU_FRAME_STAT_APU_UTILIZATION,  /* Sampled every second, per mille */
+    XEMU_FRAME_STAT__COUNT
+} XemuFrameStat;
+
+typedef struct XemuFrameStatSummary {
+    uint64_t count;
+    double avg;
+    int64_t min, max;
+    int64_t p50, p99, p999;
+    double low_1, low_01;
+} XemuFrameStatSummary;
+
+/* May be called from any thread */
+void xemu_frame_stats_record(XemuFrameStat stat, int64_t value);
+
+/*
+ * Called by the UI thread once per present with the BQL held, samples the
+ * APU and starts a new session when another title is launched.
+ */
+void xemu_frame_stats_update(void);
+
+const char *xemu_frame_stats_get_name(XemuFrameStat stat);
+void xemu_frame_stats_get_summary(XemuFrameStat stat,
+                                  XemuFrameStatSummary *summary);
+void xemu_frame_stats_reset(void);
+
+/*
+ * Writes the session's statistics to <screenshot dir>/xemu-<date>-stats.csv
+ * and .json, with the xemu version and title, returning the path of the
+ * JSON file.
+ */
+char *xemu_frame_stats_export(Error **errp);
+
+/* The session's statistics with the version and title, as exported */
+QDict *xemu_frame_stats_get_report(void);
+
+/* Exports the session if enabled, at exit and between titles */
+void xemu_frame_stats_auto_export(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * xemu hard disk image
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "xemu-hdd.h"
+#include "xemu-settings.h"
+
+#define SYNC_INTERVAL_US (5 * G_USEC_PER_SEC)
+
+static struct {
+    char *path;
+    QemuThread thread;
+} hdd;
+
+const char *xemu_hdd_get_drive_options(void)
+{
+    return g_config.perf.hdd_write_back ? ",cache.no-flush=on" : "";
+}
+
+void xemu_hdd_sync(void)
+{
+    if (!hdd.path) {
+        return;
+    }
+
+    /*
+     * Data written through the fd of the block layer is written out through
+     * any other, which leaves the block layer alone. On Windows the image is
+     * not shared for writing, which flushing needs, and it is left to the
+     * lazy writer, which writes it out within seconds anyway.
+     */
+#ifndef _WIN32
+    int fd = qemu_open_old(hdd.path, O_RDWR);
+    if (fd < 0) {
+        warn_report("Failed to open '%s' to write it out: %s", hdd.path,
+                    strerror(errno));
+    } else {
+        if (qemu_fdatasync(fd) < 0) {
+            warn_report("Failed to write out '%s': %s", hdd.path,
+                        strerror(errno));
+        }
+        close(fd);
+    }
+#endif
+}
+
+#ifndef _WIN32
+static void *sync_thread(void *opaque)
+{
+    for (;;) {
+        g_usleep(SYNC_INTERVAL_US);
+        xemu_hdd_sync();
+    }
+
+    return NULL;
+}
+#endif
+
+void xemu_hdd_init(const char *path)
+{
+    if (!g_config.perf.hdd_write_back) {
+        return;
+    }
+
+#ifndef _WIN32
+    hdd.path = g_strdup(path);
+    qemu_thread_create(&hdd.thread, "xemu_hdd_sync", sync_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+    atexit(xemu_hdd_sync);
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * xemu hard disk image
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_HDD_H
+#define XEMU_HDD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * With write-back caching, flushes of the guest to the hard disk image only
+ * hand its writes to the host OS, without waiting for them to reach the disk.
+ * Titles flush after every few writes to their cache partitions, which then
+ * no longer stall on the host disk. The image is written out to the disk
+ * every few seconds instead, when a snapshot is saved and at exit.
+ */
+
+/* Returns the -drive options of the image, applying the caching settings */
+const char *xemu_hdd_get_drive_options(void);
+
+/* Starts writing out the image at @path in the background, if enabled */
+void xemu_hdd_init(const char *path);
+
+/* Writes out the image to the host disk, if write-back caching is enabled */
+void xemu_hdd_sync(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * xemu headless mode
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include <epoxy/gl.h>
+#include "hw/xbox/nv2a/debug.h"
+#include "xemu-headless.h"
+
+static struct {
+    bool enabled;
+    char *out_dir;
+    unsigned int dump_interval;
+    unsigned int max_frames;
+    FILE *stats;
+    unsigned int last_frame_count;
+    unsigned int frames;
+    int64_t total_ms;
+} headless;
+
+void xemu_headless_init(const char *out_dir)
+{
+    headless.enabled = true;
+    headless.out_dir = g_strdup(out_dir);
+
+    /* Must be set before SDL is initialized */
+    g_setenv("SDL_VIDEODRIVER", "offscreen", true);
+
+    g_mkdir_with_parents(out_dir, 0755);
+    char *path = g_strdup_printf("%s/stats.csv", out_dir);
+    headless.stats = qemu_fopen(path, "w");
+    if (!headless.stats) {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+        exit(1);
+    }
+    g_free(path);
+
+    fprintf(headless.stats, "frame,mspf,gpu_us");
+    for (int i = 0; i < NV2A_PROF__COUNT; i++) {
+        fprintf(headless.stats, ",%s", nv2a_profile_get_counter_name(i));
+    }
+    for (int i = 0; i < NV2A_PROF_GPU__COUNT; i++) {
+        fprintf(headless.stats, ",gpu_%s", nv2a_profile_get_gpu_timer_name(i));
+    }
+    fprintf(headless.stats, "\n");
+}
+
+void xemu_headless_set_dump_interval(unsigned int dump_interval)
+{
+    headless.dump_interval = dump_interval;
+}
+
+void xemu_headless_set_max_frames(unsigned int max_frames)
+{
+    headless.max_frames = max_frames;
+}
+
+bool xemu_headless_enabled(void)
+{
+    return headless.enabled;
+}
+
+static void dump_frame(unsigned int tex, bool flip, unsigned int frame)
+{
+    GLint width, height;
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+    size_t row_size = width * 3;
+    uint8_t *pixels = g_malloc(row_size * height);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+    char *path = g_strdup_printf("%s/frame-%06u.ppm", headless.out_dir, frame);
+    FILE *f = qemu_fopen(path, "wb");
+    if (f) {
+        fprintf(f, "P6\n%d %d\n255\n", width, height);
+        /* Unless flipped, the texture is stored bottom row first */
+        for (int y = 0; y < height; y++) {
+            int src_y = flip ? y : height - 1 - y;
+            fwrite(pixels + src_y * row_size, row_size, 1, f);
+        }
+        fclose(f);
+    } else {
+        fprintf(stderr, "Failed to open %s for writing\n", path);
+    }
+
+    g_free(path);
+    g_free(pixels);
+}
+
+void xemu_headless_frame(unsigned int tex, bool flip)
+{
+    unsigned int frame_count = qatomic_read(&g_nv2a_stats.frame_count);
+    unsigned int new_frames =
+        MIN(frame_count - headless.last_frame_count, NV2A_PROF_NUM_FRAMES);
+    headless.last_frame_count = frame_count;
+    if (!new_frames) {
+        return;
+    }
+
+    for (unsigned int i = new_frames; i > 0; i--) {
+        unsigned int idx = (g_nv2a_stats.frame_ptr + NV2A_PROF_NUM_FRAMES - i) %
+                           NV2A_PROF_NUM_FRAMES;
+        int mspf = g_nv2a_stats.frame_history[idx].mspf;
+
+        fprintf(headless.stats, "%u,%d,%d", headless.frames, mspf,
+                g_nv2a_stats.frame_history[idx].gpu_us);
+        for (int j = 0; j < NV2A_PROF__COUNT; j++) {
+            fprintf(headless.stats, ",%d",
+                    g_nv2a_stats.frame_history[idx].counters[j]);
+        }
+        for (int j = 0; j < NV2A_PROF_GPU__COUNT; j++) {
+            fprintf(headless.stats, ",%d",
+                    g_nv2a_stats.frame_history[idx].gpu_timers[j]);
+        }
+        fprintf(headless.stats, "\n");
+
+        headless.frames++;
+        headless.total_ms += mspf;
+    }
+
+    unsigned int interval = headless.dump_interval;
+    if (interval && headless.frames / interval !=
+                        (headless.frames - new_frames) / interval) {
+        dump_frame(tex, flip, headless.frames);
+    }
+
+    if (headless.max_frames && headless.frames >= headless.max_frames) {
+        fprintf(stderr, "headless: %u frames, %.2f ms per frame\n",
+                headless.frames, (double)headless.total_ms / headless.frames);
+        fclose(headless.stats);
+        exit(0);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * xemu headless mode
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef XEMU_HEADLESS_H
+#define XEMU_HEADLESS_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Runs without a visible window, for benchmarking and regression testing on
+ * machines without a display. OpenGL goes through SDL's offscreen video
+ * driver (EGL) and Vulkan does not create a window or surface at all.
+ *
+ * The profile counters of every guest frame are written to
+ * <out_dir>/stats.csv and every dump_interval'th frame is written to
+ * <out_dir>/frame-<n>.ppm. xemu exits once max_frames guest frames have
+ * been rendered, if max_frames is non-zero.
+ */
+void xemu_headless_init(const char *out_dir);
+void xemu_headless_set_dump_interval(unsigned int dump_interval);
+void xemu_headless_set_max_frames(unsigned int max_frames);
+bool xemu_headless_enabled(void);
+
+/* Called with the UI GL context current, for each displayed frame */
+void xemu_headless_frame(unsigned int tex, bool flip);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
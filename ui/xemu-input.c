@@ -21,13 +21,16 @@
 #include "qemu/osdep.h"
 #include "hw/qdev-core.h"
 #include "hw/qdev-properties.h"
+#include "hw/usb/hcd-ohci.h"
 #include "qapi/error.h"
 #include "monitor/qdev.h"
 #include "qobject/qdict.h"
 #include "qemu/option.h"
+#include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
 
+#include "xemu-benchmark.h"
 #include "xemu-input.h"
 #include "xemu-notifications.h"
 #include "xemu-settings.h"
@@ -48,6 +51,20 @@
 
 #define XEMU_INPUT_MIN_INPUT_UPDATE_INTERVAL_US  2500
 #define XEMU_INPUT_MIN_RUMBLE_UPDATE_INTERVAL_US 2500
+#define XEMU_INPUT_POLL_INTERVAL_US 1000
+
+/*
+ * When game controllers are polled on a thread of their own, the state it
+ * reads is published for the USB devices, which no longer depend on the UI
+ * thread pumping SDL events once per frame. The lock keeps controllers from
+ * being added or removed while the thread polls them.
+ */
+static bool poll_thread_running;
+static QemuMutex poll_lock;
+static QemuThread poll_thread;
+
+static void xemu_input_read_polled_state(ControllerState *state);
+static void *poll_thread_func(void *opaque);
 
 #if 0
 static void xemu_input_print_controller_state(ControllerState *state)
@@ -308,6 +325,13 @@ void xemu_input_init(void)
     }
 
     QTAILQ_INSERT_TAIL(&available_controllers, new_con, entry);
+
+    qemu_mutex_init(&poll_lock);
+    if (g_config.input.poll_thread) {
+        qatomic_set(&poll_thread_running, true);
+        qemu_thread_create(&poll_thread, "xemu_input_poll", poll_thread_func,
+                           NULL, QEMU_THREAD_DETACHED);
+    }
 }
 
 int xemu_input_get_controller_default_bind_port(ControllerState *state, int start)
@@ -378,8 +402,11 @@ void xemu_input_process_sdl_events(const SDL_Event *event)
         SDL_JoystickGetGUIDString(new_con->sdl_joystick_guid, guid_buf, sizeof(guid_buf));
         DPRINTF("Opened %s (%s)\n", new_con->name, guid_buf);
 
-        QTAILQ_INSERT_TAIL(&available_controllers, new_con, entry);
+        // Mappings of the other controllers may move as this one's is added
+        qemu_mutex_lock(&poll_lock);
         xemu_input_bindings_reload_map(new_con);
+        QTAILQ_INSERT_TAIL(&available_controllers, new_con, entry);
+        qemu_mutex_unlock(&poll_lock);
 
         // Do not replace binding for a currently bound device. In the case that
         // the same GUID is specified multiple times, on different ports, allow
@@ -454,12 +481,14 @@ void xemu_input_process_sdl_events(const SDL_Event *event)
                 }
 
                 // Unlink
+                qemu_mutex_lock(&poll_lock);
                 QTAILQ_REMOVE(&available_controllers, iter, entry);
 
                 // Deallocate
                 if (iter->sdl_gamecontroller) {
                     SDL_GameControllerClose(iter->sdl_gamecontroller);
                 }
+                qemu_mutex_unlock(&poll_lock);
 
                 for (int i = 0; i < 2; i++) {
                     if (iter->peripherals[i])
@@ -481,6 +510,10 @@ void xemu_input_process_sdl_events(const SDL_Event *event)
 
 void xemu_input_update_controller(ControllerState *state)
 {
+    if (xemu_benchmark_override_input(state)) {
+        return;
+    }
+
     int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     if (ABS(now - state->last_input_updated_ts) <
         XEMU_INPUT_MIN_INPUT_UPDATE_INTERVAL_US) {
@@ -490,8 +523,13 @@ void xemu_input_update_controller(ControllerState *state)
     if (state->type == INPUT_DEVICE_SDL_KEYBOARD) {
         xemu_input_update_sdl_kbd_controller_state(state);
     } else if (state->type == INPUT_DEVICE_SDL_GAMECONTROLLER) {
-        xemu_input_update_sdl_controller_state(state);
+        if (qatomic_read(&poll_thread_running)) {
+            xemu_input_read_polled_state(state);
+        } else {
+            xemu_input_update_sdl_controller_state(state);
+        }
     }
+    xemu_benchmark_record_input(state);
 
     state->last_input_updated_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 }
@@ -558,10 +596,10 @@ void xemu_input_update_sdl_kbd_controller_state(ControllerState *state)
 #undef KBD_STATE
 }
 
-void xemu_input_update_sdl_controller_state(ControllerState *state)
+static void read_sdl_controller(ControllerState *state, uint16_t *buttons,
+                                int16_t *axis)
 {
-    state->buttons = 0;
-    memset(state->axis, 0, sizeof(state->axis));
+    *buttons = 0;
 
 #define SDL_MASK_BUTTON(state, btn, idx)                  \
     (SDL_GameControllerGetButton(                         \
@@ -569,21 +607,21 @@ void xemu_input_update_sdl_controller_state(ControllerState *state)
          (state)->controller_map->controller_mapping.btn) \
      << idx)
 
-    state->buttons |= SDL_MASK_BUTTON(state, a, 0);
-    state->buttons |= SDL_MASK_BUTTON(state, b, 1);
-    state->buttons |= SDL_MASK_BUTTON(state, x, 2);
-    state->buttons |= SDL_MASK_BUTTON(state, y, 3);
-    state->buttons |= SDL_MASK_BUTTON(state, dpad_left, 4);
-    state->buttons |= SDL_MASK_BUTTON(state, dpad_up, 5);
-    state->buttons |= SDL_MASK_BUTTON(state, dpad_right, 6);
-    state->buttons |= SDL_MASK_BUTTON(state, dpad_down, 7);
-    state->buttons |= SDL_MASK_BUTTON(state, back, 8);
-    state->buttons |= SDL_MASK_BUTTON(state, start, 9);
-    state->buttons |= SDL_MASK_BUTTON(state, lshoulder, 10);
-    state->buttons |= SDL_MASK_BUTTON(state, rshoulder, 11);
-    state->buttons |= SDL_MASK_BUTTON(state, lstick_btn, 12);
-    state->buttons |= SDL_MASK_BUTTON(state, rstick_btn, 13);
-    state->buttons |= SDL_MASK_BUTTON(state, guide, 14);
+    *buttons |= SDL_MASK_BUTTON(state, a, 0);
+    *buttons |= SDL_MASK_BUTTON(state, b, 1);
+    *buttons |= SDL_MASK_BUTTON(state, x, 2);
+    *buttons |= SDL_MASK_BUTTON(state, y, 3);
+    *buttons |= SDL_MASK_BUTTON(state, dpad_left, 4);
+    *buttons |= SDL_MASK_BUTTON(state, dpad_up, 5);
+    *buttons |= SDL_MASK_BUTTON(state, dpad_right, 6);
+    *buttons |= SDL_MASK_BUTTON(state, dpad_down, 7);
+    *buttons |= SDL_MASK_BUTTON(state, back, 8);
+    *buttons |= SDL_MASK_BUTTON(state, start, 9);
+    *buttons |= SDL_MASK_BUTTON(state, lshoulder, 10);
+    *buttons |= SDL_MASK_BUTTON(state, rshoulder, 11);
+    *buttons |= SDL_MASK_BUTTON(state, lstick_btn, 12);
+    *buttons |= SDL_MASK_BUTTON(state, rstick_btn, 13);
+    *buttons |= SDL_MASK_BUTTON(state, guide, 14);
 
 #undef SDL_MASK_BUTTON
 
@@ -592,18 +630,18 @@ void xemu_input_update_sdl_controller_state(ControllerState *state)
         (state)->sdl_gamecontroller, \
         (state)->controller_map->controller_mapping.axis)
 
-    state->axis[0] = SDL_GET_AXIS(state, axis_trigger_left);
-    state->axis[1] = SDL_GET_AXIS(state, axis_trigger_right);
-    state->axis[2] = SDL_GET_AXIS(state, axis_left_x);
-    state->axis[3] = SDL_GET_AXIS(state, axis_left_y);
-    state->axis[4] = SDL_GET_AXIS(state, axis_right_x);
-    state->axis[5] = SDL_GET_AXIS(state, axis_right_y);
+    axis[0] = SDL_GET_AXIS(state, axis_trigger_left);
+    axis[1] = SDL_GET_AXIS(state, axis_trigger_right);
+    axis[2] = SDL_GET_AXIS(state, axis_left_x);
+    axis[3] = SDL_GET_AXIS(state, axis_left_y);
+    axis[4] = SDL_GET_AXIS(state, axis_right_x);
+    axis[5] = SDL_GET_AXIS(state, axis_right_y);
 
 #undef SDL_GET_AXIS
 
 // FIXME: Check range
 #define INVERT_AXIS(controller_axis) \
-    state->axis[controller_axis] = -1 - state->axis[controller_axis]
+    axis[controller_axis] = -1 - axis[controller_axis]
 
     if (state->controller_map->controller_mapping.invert_axis_left_x) {
         INVERT_AXIS(CONTROLLER_AXIS_LSTICK_X);
@@ -623,9 +661,72 @@ void xemu_input_update_sdl_controller_state(ControllerState *state)
 
 #undef INVERT_AXIS
 
+}
+
+void xemu_input_update_sdl_controller_state(ControllerState *state)
+{
+    read_sdl_controller(state, &state->buttons, state->axis);
     // xemu_input_print_controller_state(state);
 }
 
+static void xemu_input_read_polled_state(ControllerState *state)
+{
+    unsigned int seq;
+
+    do {
+        seq = qatomic_load_acquire(&state->polled_seq);
+        state->buttons = qatomic_read(&state->polled_buttons);
+        for (int i = 0; i < CONTROLLER_AXIS__COUNT; i++) {
+            state->axis[i] = qatomic_read(&state->polled_axis[i]);
+        }
+        smp_rmb();
+    } while ((seq & 1) || qatomic_read(&state->polled_seq) != seq);
+}
+
+static void *poll_thread_func(void *opaque)
+{
+    for (;;) {
+        bool changed = false;
+
+        qemu_mutex_lock(&poll_lock);
+        SDL_GameControllerUpdate();
+
+        ControllerState *iter;
+        QTAILQ_FOREACH(iter, &available_controllers, entry) {
+            if (iter->type != INPUT_DEVICE_SDL_GAMECONTROLLER) {
+                continue;
+            }
+
+            uint16_t buttons;
+            int16_t axis[CONTROLLER_AXIS__COUNT];
+            read_sdl_controller(iter, &buttons, axis);
+            if (buttons == iter->polled_buttons &&
+                !memcmp(axis, iter->polled_axis, sizeof(axis))) {
+                continue;
+            }
+            changed = true;
+
+            qatomic_set(&iter->polled_seq, iter->polled_seq + 1);
+            smp_wmb();
+            qatomic_set(&iter->polled_buttons, buttons);
+            for (int i = 0; i < CONTROLLER_AXIS__COUNT; i++) {
+                qatomic_set(&iter->polled_axis[i], axis[i]);
+            }
+            qatomic_store_release(&iter->polled_seq, iter->polled_seq + 1);
+        }
+        qemu_mutex_unlock(&poll_lock);
+
+        /* Have the guest see the change now, not at the next coalesced frame */
+        if (changed) {
+            ohci_wake_all();
+        }
+
+        g_usleep(XEMU_INPUT_POLL_INTERVAL_US);
+    }
+
+    return NULL;
+}
+
 void xemu_input_update_rumble(ControllerState *state)
 {
     if (state->type != INPUT_DEVICE_SDL_GAMECONTROLLER) {
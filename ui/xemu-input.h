@@ -90,6 +90,12 @@ typedef struct ControllerState {
     uint16_t buttons;
     int16_t  axis[CONTROLLER_AXIS__COUNT];
 
+    // Input state published by the polling thread, under a sequence count
+    // that is odd while it is being written
+    unsigned int polled_seq;
+    uint16_t polled_buttons;
+    int16_t  polled_axis[CONTROLLER_AXIS__COUNT];
+
     // Rendering state hacked on here for convenience but needs to be moved (FIXME)
     uint32_t animate_guide_button_end;
     uint32_t animate_trigger_end;
@@ -0,0 +1,404 @@
+/*
+ * xemu game library
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/thread.h"
+#include "xemu-library.h"
+#include "xemu-settings.h"
+#include "xemu-xbe.h"
+
+#define INDEX_FILE_NAME "library.ini"
+
+#define XISO_SECTOR_SIZE 2048
+#define XISO_VOLUME_SECTOR 32
+#define XISO_MAGIC "MICROSOFT*XBOX*MEDIA"
+#define XISO_DIRENT_SIZE 14 /* Without the name */
+#define XISO_MAX_DIR_SIZE (1 * MiB)
+#define XBE_MAGIC 0x48454258 /* "XBEH" */
+#define XBE_MAX_HEADERS_SIZE (64 * KiB)
+#define XBE_FILE_NAME "default.xbe"
+
+/* As in block/xiso.c: none, then XGD1, XGD2 and XGD3 discs */
+static const uint64_t xiso_partition_offsets[] = {
+    0, 0x18300000, 0x0FD90000, 0x02080000,
+};
+
+typedef struct LibraryRecord {
+    XemuLibraryEntry entry;
+    int64_t size;
+    int64_t mtime;
+} LibraryRecord;
+
+static struct {
+    QemuMutex lock;
+    GHashTable *records; /* Path to LibraryRecord */
+    bool loaded;
+    bool scanning;
+} library;
+
+static void free_record(gpointer data)
+{
+    LibraryRecord *r = data;
+    g_free(r->entry.path);
+    g_free(r->entry.name);
+    g_free(r);
+}
+
+static void __attribute__((constructor)) library_init(void)
+{
+    qemu_mutex_init(&library.lock);
+    library.records =
+        g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_record);
+}
+
+static char *get_index_path(void)
+{
+    return g_build_filename(xemu_settings_get_cache_path(), INDEX_FILE_NAME,
+                            NULL);
+}
+
+static void load_index(void)
+{
+    g_autofree char *path = get_index_path();
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, NULL)) {
+        return;
+    }
+
+    /* Groups are numbered, as paths may contain brackets */
+    g_auto(GStrv) groups = g_key_file_get_groups(kf, NULL);
+    for (int i = 0; groups[i]; i++) {
+        char *image_path = g_key_file_get_string(kf, groups[i], "path", NULL);
+        char *name = g_key_file_get_string(kf, groups[i], "name", NULL);
+        if (!image_path || !name) {
+            g_free(image_path);
+            g_free(name);
+            continue;
+        }
+
+        LibraryRecord *r = g_new0(LibraryRecord, 1);
+        r->entry.path = image_path;
+        r->entry.name = name;
+        r->entry.title_id =
+            g_key_file_get_uint64(kf, groups[i], "title_id", NULL);
+        r->entry.version =
+            g_key_file_get_uint64(kf, groups[i], "version", NULL);
+        r->entry.region = g_key_file_get_uint64(kf, groups[i], "region", NULL);
+        r->size = g_key_file_get_int64(kf, groups[i], "size", NULL);
+        r->mtime = g_key_file_get_int64(kf, groups[i], "mtime", NULL);
+        g_hash_table_replace(library.records, r->entry.path, r);
+    }
+}
+
+/* Called with the lock held */
+static void save_index(void)
+{
+    g_autofree char *path = get_index_path();
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    GHashTableIter iter;
+    LibraryRecord *r;
+    int n = 0;
+
+    g_hash_table_iter_init(&iter, library.records);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&r)) {
+        g_autofree char *group = g_strdup_printf("image%d", n++);
+        g_key_file_set_string(kf, group, "path", r->entry.path);
+        g_key_file_set_string(kf, group, "name", r->entry.name);
+        g_key_file_set_uint64(kf, group, "title_id", r->entry.title_id);
+        g_key_file_set_uint64(kf, group, "version", r->entry.version);
+        g_key_file_set_uint64(kf, group, "region", r->entry.region);
+        g_key_file_set_int64(kf, group, "size", r->size);
+        g_key_file_set_int64(kf, group, "mtime", r->mtime);
+    }
+
+    g_autoptr(GError) err = NULL;
+    if (!g_key_file_save_to_file(kf, path, &err)) {
+        fprintf(stderr, "%s: failed to save %s: %s\n", __func__, path,
+                err->message);
+    }
+}
+
+static bool read_at(FILE *f, uint64_t offset, void *buf, size_t size)
+{
+    return !fseeko(f, offset, SEEK_SET) && fread(buf, 1, size, f) == size;
+}
+
+/* Finds default.xbe in the root directory of the filesystem of the image */
+static bool find_default_xbe(FILE *f, uint64_t *offset, uint32_t *size)
+{
+    uint8_t volume[XISO_SECTOR_SIZE];
+
+    for (int i = 0; i < ARRAY_SIZE(xiso_partition_offsets); i++) {
+        uint64_t part = xiso_partition_offsets[i];
+        if (!read_at(f, part + XISO_VOLUME_SECTOR * XISO_SECTOR_SIZE, volume,
+                     sizeof(volume)) ||
+            memcmp(volume, XISO_MAGIC, strlen(XISO_MAGIC))) {
+            continue;
+        }
+
+        uint32_t dir_sector = ldl_le_p(volume + 20);
+        uint32_t dir_size = ldl_le_p(volume + 24);
+        if (!dir_size || dir_size > XISO_MAX_DIR_SIZE) {
+            return false;
+        }
+
+        g_autofree uint8_t *dir = g_malloc(dir_size);
+        if (!read_at(f, part + (uint64_t)dir_sector * XISO_SECTOR_SIZE, dir,
+                     dir_size)) {
+            return false;
+        }
+
+        /* Entries are packed, with the rest of each sector padded with 0xff */
+        uint32_t pos = 0;
+        while (pos + XISO_DIRENT_SIZE <= dir_size) {
+            if (lduw_le_p(dir + pos) == 0xffff) {
+                pos = ROUND_UP(pos + 1, XISO_SECTOR_SIZE);
+                continue;
+            }
+
+            uint8_t name_len = dir[pos + 13];
+            if (pos + XISO_DIRENT_SIZE + name_len > dir_size) {
+                break;
+            }
+            if (name_len == strlen(XBE_FILE_NAME) &&
+                !g_ascii_strncasecmp((const char *)dir + pos + 14,
+                                     XBE_FILE_NAME, name_len)) {
+                *offset = part + (uint64_t)ldl_le_p(dir + pos + 4) *
+                                     XISO_SECTOR_SIZE;
+                *size = ldl_le_p(dir + pos + 8);
+                return true;
+            }
+            pos = ROUND_UP(pos + XISO_DIRENT_SIZE + name_len, 4);
+        }
+        return false;
+    }
+
+    return false;
+}
+
+/* Reads the certificate of the default.xbe of the image at @path */
+static void read_title_info(const char *path, XemuLibraryEntry *entry)
+{
+    FILE *f = qemu_fopen(path, "rb");
+    if (!f) {
+        return;
+    }
+
+    uint64_t xbe_offset;
+    uint32_t xbe_size;
+    struct xbe_header header;
+    if (!find_default_xbe(f, &xbe_offset, &xbe_size) ||
+        xbe_size < sizeof(header) ||
+        !read_at(f, xbe_offset, &header, sizeof(header)) ||
+        ldl_le_p(&header.m_magic) != XBE_MAGIC) {
+        fclose(f);
+        return;
+    }
+
+    uint32_t headers_size = MIN(MIN(ldl_le_p(&header.m_sizeof_headers),
+                                    xbe_size), XBE_MAX_HEADERS_SIZE);
+    uint32_t cert_offset = ldl_le_p(&header.m_certificate_addr) -
+                           ldl_le_p(&header.m_base);
+    const size_t cert_size = offsetof(struct xbe_certificate, m_lan_key);
+    g_autofree uint8_t *headers = g_malloc(headers_size);
+
+    if (cert_offset < headers_size && cert_size <= headers_size - cert_offset &&
+        read_at(f, xbe_offset, headers, headers_size)) {
+        const struct xbe_certificate *cert =
+            (const struct xbe_certificate *)(headers + cert_offset);
+        gunichar2 title_name[ARRAY_SIZE(cert->m_title_name)];
+
+        for (int i = 0; i < ARRAY_SIZE(title_name); i++) {
+            title_name[i] = lduw_le_p(&cert->m_title_name[i]);
+        }
+        char *name = g_utf16_to_utf8(title_name, ARRAY_SIZE(title_name), NULL,
+                                     NULL, NULL);
+        if (name && name[0]) {
+            g_free(entry->name);
+            entry->name = name;
+        } else {
+            g_free(name);
+        }
+        entry->title_id = ldl_le_p(&cert->m_titleid);
+        entry->version = ldl_le_p(&cert->m_version);
+        entry->region = ldl_le_p(&cert->m_game_region);
+    }
+
+    fclose(f);
+}
+
+static bool is_disc_image(const char *file_name)
+{
+    g_autofree char *name = g_ascii_strdown(file_name, -1);
+    return g_str_has_suffix(name, ".iso") || g_str_has_suffix(name, ".xiso") ||
+           g_str_has_suffix(name, ".qcow2");
+}
+
+static LibraryRecord *new_record(const char *path, const char *file_name,
+                                 const GStatBuf *st)
+{
+    LibraryRecord *r = g_new0(LibraryRecord, 1);
+    const char *ext = strrchr(file_name, '.');
+
+    r->entry.path = g_strdup(path);
+    r->entry.name = g_strndup(file_name, ext - file_name);
+    r->size = st->st_size;
+    r->mtime = st->st_mtime;
+
+    /* The contents of compressed images are not readable as is */
+    g_autofree char *lower_name = g_ascii_strdown(file_name, -1);
+    if (!g_str_has_suffix(lower_name, ".qcow2")) {
+        read_title_info(path, &r->entry);
+    }
+
+    return r;
+}
+
+static void *scan_thread(void *opaque)
+{
+    g_autofree char *dir_path = opaque;
+    g_autoptr(GHashTable) found =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    bool changed = false;
+
+    qemu_mutex_lock(&library.lock);
+    if (!library.loaded) {
+        load_index();
+        library.loaded = true;
+    }
+    qemu_mutex_unlock(&library.lock);
+
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const char *file_name;
+    while (dir && (file_name = g_dir_read_name(dir))) {
+        if (!is_disc_image(file_name)) {
+            continue;
+        }
+
+        g_autofree char *path = g_build_filename(dir_path, file_name, NULL);
+        GStatBuf st;
+        if (g_stat(path, &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        g_hash_table_add(found, g_strdup(path));
+
+        qemu_mutex_lock(&library.lock);
+        LibraryRecord *r = g_hash_table_lookup(library.records, path);
+        bool up_to_date = r && r->size == st.st_size && r->mtime == st.st_mtime;
+        qemu_mutex_unlock(&library.lock);
+        if (up_to_date) {
+            continue;
+        }
+
+        r = new_record(path, file_name, &st);
+        qemu_mutex_lock(&library.lock);
+        g_hash_table_replace(library.records, r->entry.path, r);
+        qemu_mutex_unlock(&library.lock);
+        changed = true;
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+
+    qemu_mutex_lock(&library.lock);
+    GHashTableIter iter;
+    const char *path;
+    g_hash_table_iter_init(&iter, library.records);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+        if (!g_hash_table_contains(found, path)) {
+            g_hash_table_iter_remove(&iter);
+            changed = true;
+        }
+    }
+    if (changed) {
+        save_index();
+    }
+    library.scanning = false;
+    qemu_mutex_unlock(&library.lock);
+
+    return NULL;
+}
+
+void xemu_library_refresh(void)
+{
+    QemuThread thread;
+
+    qemu_mutex_lock(&library.lock);
+    if (!library.scanning) {
+        library.scanning = true;
+        qemu_thread_create(&thread, "xemu_library", scan_thread,
+                           g_strdup(g_config.general.games_dir),
+                           QEMU_THREAD_DETACHED);
+    }
+    qemu_mutex_unlock(&library.lock);
+}
+
+bool xemu_library_is_scanning(void)
+{
+    qemu_mutex_lock(&library.lock);
+    bool scanning = library.scanning;
+    qemu_mutex_unlock(&library.lock);
+    return scanning;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const XemuLibraryEntry *ea = a, *eb = b;
+    int ret = g_ascii_strcasecmp(ea->name, eb->name);
+    return ret ? ret : strcmp(ea->path, eb->path);
+}
+
+XemuLibraryEntry *xemu_library_get_entries(size_t *num_entries)
+{
+    GHashTableIter iter;
+    LibraryRecord *r;
+    size_t n = 0;
+
+    qemu_mutex_lock(&library.lock);
+    XemuLibraryEntry *entries =
+        g_new(XemuLibraryEntry, g_hash_table_size(library.records));
+    g_hash_table_iter_init(&iter, library.records);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&r)) {
+        entries[n] = r->entry;
+        entries[n].path = g_strdup(r->entry.path);
+        entries[n].name = g_strdup(r->entry.name);
+        n++;
+    }
+    qemu_mutex_unlock(&library.lock);
+
+    qsort(entries, n, sizeof(*entries), compare_entries);
+    *num_entries = n;
+    return entries;
+}
+
+void xemu_library_free_entries(XemuLibraryEntry *entries, size_t num_entries)
+{
+    for (size_t i = 0; i < num_entries; i++) {
+        g_free(entries[i].path);
+        g_free(entries[i].name);
+    }
+    g_free(entries);
+}
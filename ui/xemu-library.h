@@ -0,0 +1,71 @@
+/*
+ * xemu game library
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_LIBRARY_H
+#define XEMU_LIBRARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The disc images of the games directory, with the title ID, name and
+ * version from the certificate of their default.xbe. These are read on a
+ * thread of their own and kept in <cache path>/library.ini, so that images
+ * are only read again when their size or modification time changes.
+ */
+
+typedef struct XemuLibraryEntry {
+    char *path;
+    char *name;        /* The file name, if the title name is unknown */
+    uint32_t title_id; /* 0 if unknown */
+    uint32_t version;
+    uint32_t region;
+} XemuLibraryEntry;
+
+/*
+ * Starts scanning the games directory in the background, unless it is
+ * being scanned already. The entries are updated as images are read.
+ */
+void xemu_library_refresh(void);
+
+/* Returns whether the scan started by the last refresh is still running */
+bool xemu_library_is_scanning(void);
+
+/*
+ * Returns a copy of the entries, sorted by name, to be freed with
+ * xemu_library_free_entries().
+ */
+XemuLibraryEntry *xemu_library_get_entries(size_t *num_entries);
+
+void xemu_library_free_entries(XemuLibraryEntry *entries, size_t num_entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * xemu frame pacing
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "hw/xbox/nv2a/nv2a.h"
+#include "system/runstate.h"
+#include "xemu-frame-stats.h"
+#include "xemu-pacing.h"
+
+#define VBLANK_PERIOD_NS 16666666
+
+/* Swap intervals further than this from the vblank period are not vsync */
+#define SWAP_INTERVAL_TOLERANCE_NS (VBLANK_PERIOD_NS / 20)
+
+/* How close the display must be to the guest refresh rate to lock to it */
+#define LOCK_TOLERANCE_NS (VBLANK_PERIOD_NS / 200)
+
+/* Consecutive vsync'd swaps needed before locking */
+#define LOCK_SWAPS 30
+
+/* Bounds of the time left between the deadline and the next display vsync */
+#define MIN_SLACK_NS 2000000
+#define MAX_SLACK_NS (VBLANK_PERIOD_NS / 2)
+
+static struct {
+    int64_t deadline;
+    int64_t refresh_start;
+    int64_t last_swap;
+    int64_t display_period;
+    int64_t max_refresh_time;
+    int stable_swaps;
+
+    float present_intervals[XEMU_PACING_PRESENT_HISTORY];
+    unsigned int present_ptr;
+
+    unsigned int last_flip_count;
+    int vblanks_since_flip;
+    float guest_vblanks;
+} pacing;
+
+static bool is_locked(void)
+{
+    return pacing.stable_swaps >= LOCK_SWAPS &&
+           ABS(pacing.display_period - VBLANK_PERIOD_NS) < LOCK_TOLERANCE_NS;
+}
+
+void xemu_pacing_refresh_begin(void)
+{
+    pacing.refresh_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+void xemu_pacing_swap_begin(void)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    /*
+     * Keep track of the longest recent refresh, from the deadline up to the
+     * swap, which is how early the deadline must be to make the next vsync.
+     */
+    int64_t refresh_time = now - pacing.refresh_start;
+    pacing.max_refresh_time -= pacing.max_refresh_time / 32;
+    pacing.max_refresh_time = MAX(pacing.max_refresh_time, refresh_time);
+}
+
+void xemu_pacing_swapped(bool vsync)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t interval = now - pacing.last_swap;
+    pacing.last_swap = now;
+
+    pacing.present_intervals[pacing.present_ptr] = interval / 1e6f;
+    pacing.present_ptr =
+        (pacing.present_ptr + 1) % XEMU_PACING_PRESENT_HISTORY;
+    if (runstate_is_running()) {
+        xemu_frame_stats_record(XEMU_FRAME_STAT_PRESENT_INTERVAL,
+                                interval / 1000);
+    }
+
+    if (!vsync || ABS(interval - VBLANK_PERIOD_NS) > SWAP_INTERVAL_TOLERANCE_NS) {
+        /* Not presenting with vsync, or a vsync was missed */
+        pacing.stable_swaps = 0;
+        return;
+    }
+
+    if (!pacing.display_period) {
+        pacing.display_period = interval;
+    } else {
+        pacing.display_period += (interval - pacing.display_period) / 16;
+    }
+    if (pacing.stable_swaps < LOCK_SWAPS) {
+        pacing.stable_swaps++;
+    }
+}
+
+void xemu_pacing_vblank(void)
+{
+    unsigned int flip_count = nv2a_get_flip_count();
+
+    pacing.vblanks_since_flip++;
+    if (flip_count != pacing.last_flip_count) {
+        int vblanks = MIN(pacing.vblanks_since_flip, 4);
+        if (!pacing.guest_vblanks) {
+            pacing.guest_vblanks = vblanks;
+        } else {
+            pacing.guest_vblanks += (vblanks - pacing.guest_vblanks) * 0.1f;
+        }
+        pacing.last_flip_count = flip_count;
+        pacing.vblanks_since_flip = 0;
+    }
+}
+
+int64_t xemu_pacing_next_vblank_deadline(void)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (is_locked()) {
+        /*
+         * Wake up just early enough to render and swap before the next
+         * display vsync, the swap then waits for it.
+         */
+        int64_t slack = MAX(MIN(pacing.max_refresh_time + 1000000,
+                                MAX_SLACK_NS), MIN_SLACK_NS);
+        pacing.deadline = pacing.last_swap + pacing.display_period - slack;
+        return pacing.deadline;
+    }
+
+    /*
+     * Each deadline follows on from the previous one rather than from when
+     * it was met, so that overshoot does not add up and vblanks keep a
+     * steady cadence, unless the loop has fallen behind by more than a frame.
+     */
+    pacing.deadline += VBLANK_PERIOD_NS;
+    if (now - pacing.deadline > VBLANK_PERIOD_NS) {
+        pacing.deadline = now;
+    }
+    return pacing.deadline;
+}
+
+void xemu_pacing_get_stats(XemuPacingStats *stats)
+{
+    stats->locked = is_locked();
+    stats->display_hz =
+        pacing.display_period ? 1e9f / pacing.display_period : 0;
+    stats->guest_vblanks = pacing.guest_vblanks;
+}
+
+void xemu_pacing_get_present_intervals(float ms[XEMU_PACING_PRESENT_HISTORY])
+{
+    for (int i = 0; i < XEMU_PACING_PRESENT_HISTORY; i++) {
+        ms[i] = pacing.present_intervals[(pacing.present_ptr + i) %
+                                         XEMU_PACING_PRESENT_HISTORY];
+    }
+}
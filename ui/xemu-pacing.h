@@ -0,0 +1,71 @@
+/*
+ * xemu frame pacing
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef XEMU_PACING_H
+#define XEMU_PACING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Paces guest vblanks against host presentation. While the host presents
+ * with vsync at (a multiple of) the guest refresh rate, guest vblanks are
+ * phase locked to the display instead of following a free running timer, so
+ * the two cannot drift apart and periodically repeat or drop a frame.
+ */
+
+#define XEMU_PACING_PRESENT_HISTORY 240
+
+typedef struct XemuPacingStats {
+    bool locked;               /* Guest vblanks follow the display */
+    float display_hz;          /* Measured, 0 until known */
+    float guest_vblanks;       /* Average vblanks per guest flip */
+} XemuPacingStats;
+
+/* Called when a refresh starts, after waiting for the vblank deadline */
+void xemu_pacing_refresh_begin(void);
+
+/* Called right before and after the frame of the refresh is swapped */
+void xemu_pacing_swap_begin(void);
+void xemu_pacing_swapped(bool vsync);
+
+/* Called when a guest vblank is raised */
+void xemu_pacing_vblank(void);
+
+/* Time at which the next guest vblank is due, QEMU_CLOCK_REALTIME */
+int64_t xemu_pacing_next_vblank_deadline(void);
+
+void xemu_pacing_get_stats(XemuPacingStats *stats);
+
+/* Time between the most recent presents in ms, oldest first, 0 if unknown */
+void xemu_pacing_get_present_intervals(float ms[XEMU_PACING_PRESENT_HISTORY]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1409 @@
+/*
+ * xemu incremental quick-save
+ *
+ * Copyright (C) 2025 Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A quick-save keeps the disk state in a qcow2 snapshot without VM state,
+ * and the VM state in two files in a directory next to the HDD image:
+ *
+ * - <id>.base holds every RAM block as it was when the base was taken;
+ * - <id>.delta holds the device state, and the pages that have been written
+ *   since the base was taken.
+ *
+ * Guest RAM writes are tracked with the DIRTY_MEMORY_SNAPSHOT client, so
+ * saving only has to write out the pages changed since the base. Once those
+ * are more than half of RAM, the save takes a new base instead.
+ *
+ * The guest is only stopped while the device state and pages are copied,
+ * the files are written out in the background while it runs.
+ *
+ * Machine-only quick-saves leave the disk out, for states that are to be
+ * restored over whatever the disk holds by then.
+ *
+ * The same tracking drives rewind, a ring of states kept in memory. Each
+ * state holds the XOR of the pages that changed until the next state, and
+ * a copy of RAM is kept at the newest one, so stepping back applies the
+ * newest patch to that copy and writes back only the pages that differ.
+ */
+
+#include "xemu-snapshots.h"
+#include "xemu-settings.h"
+
+#include <glib/gstdio.h>
+
+#include "block/block-global-state.h"
+#include "exec/target_page.h"
+#include "exec/tb-flush.h"
+#include "io/channel-buffer.h"
+#include "migration/global_state.h"
+#include "migration/migration.h"
+#include "migration/misc.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/yank.h"
+#include "system/memory.h"
+#include "system/physmem.h"
+#include "system/ramblock.h"
+#include "system/runstate.h"
+#include "system/tcg.h"
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#define QUICKSAVE_MAGIC 0x78717376 // 'xqsv'
+#define QUICKSAVE_VERSION 2
+
+/*
+ * The pages in a quick-save file are listed first, zero pages are flagged
+ * there and not stored. The others follow in chunks, each compressed on its
+ * own so they can be worked on in parallel.
+ */
+#define QUICKSAVE_PAGE_ZERO (1u << 31)
+#define QUICKSAVE_CHUNK_PAGES 256
+#define QUICKSAVE_CHUNK_RAW (1u << 31)
+
+typedef struct QuicksaveBlock {
+    RAMBlock *rb;
+    uint64_t first_page; // in the page bitmaps
+    uint64_t num_pages;
+} QuicksaveBlock;
+
+typedef struct QuicksaveDelta {
+    uint64_t base_id;
+    uint8_t *state;
+    uint64_t state_size;
+    unsigned long *pages; // present in data
+    uint8_t *data;        // of the pages, in order
+} QuicksaveDelta;
+
+typedef struct Quicksave {
+    char *base_path;
+    char *delta_path;
+
+    // Pages written since the base was taken, only valid if has_base
+    unsigned long *dirty;
+    bool has_base;
+    uint64_t base_id;
+
+    // Save being written out in the background
+    QemuThread write_thread;
+    bool writing;
+    uint8_t *staged_ram; // new base, if rebasing
+    QuicksaveDelta staged_delta;
+    Error *write_err;
+} Quicksave;
+
+typedef struct QuicksavePages {
+    uint64_t num_pages;
+    uint32_t *index; // with QUICKSAVE_PAGE_ZERO
+    uint64_t num_data_pages;
+    uint32_t *data_pages; // of the pages stored in the chunks, in order
+    uint32_t num_chunks;
+    uint8_t **chunks;
+    uint32_t *chunk_sizes; // with QUICKSAVE_CHUNK_RAW
+} QuicksavePages;
+
+static struct {
+    QuicksaveBlock *blocks;
+    int num_blocks;
+    uint64_t num_pages;
+    GHashTable *slots; // name -> Quicksave
+} qs;
+
+typedef struct RewindState {
+    uint8_t *state;
+    size_t state_size;
+
+    // Pages that differ from the next newer state, and their XOR with it
+    unsigned long *pages;
+    uint8_t *patch;
+    size_t patch_size;
+} RewindState;
+
+static struct {
+    GQueue states; // of RewindState, newest at the tail
+    size_t size;
+    uint8_t *ram;           // contents at the newest state
+    unsigned long *dirty;   // pages written since the newest state
+    int frames;             // since the newest state
+} rw;
+
+static int add_block(RAMBlock *rb, void *opaque)
+{
+    if (!qemu_ram_is_migratable(rb)) {
+        return 0;
+    }
+
+    qs.blocks = g_renew(QuicksaveBlock, qs.blocks, qs.num_blocks + 1);
+    QuicksaveBlock *b = &qs.blocks[qs.num_blocks++];
+    b->rb = rb;
+    b->first_page = qs.num_pages;
+    b->num_pages = qemu_ram_get_used_length(rb) >> qemu_target_page_bits();
+    qs.num_pages += b->num_pages;
+
+    memory_region_set_log(rb->mr, true, DIRTY_MEMORY_SNAPSHOT);
+
+    return 0;
+}
+
+static void quicksave_free(gpointer data)
+{
+    Quicksave *slot = data;
+
+    g_free(slot->base_path);
+    g_free(slot->delta_path);
+    g_free(slot->dirty);
+    g_free(slot);
+}
+
+static void init_tracking(void)
+{
+    if (qs.slots) {
+        return;
+    }
+
+    qs.slots =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, quicksave_free);
+    qemu_ram_foreach_block(add_block, NULL);
+}
+
+static char *get_quicksave_path(const char *vm_name, const char *suffix)
+{
+    g_autofree char *dir =
+        g_strdup_printf("%s.quicksave", g_config.sys.files.hdd_path);
+    g_autofree char *id =
+        g_compute_checksum_for_string(G_CHECKSUM_SHA1, vm_name, -1);
+    g_autofree char *file = g_strdup_printf("%s.%s", id, suffix);
+
+    return g_build_filename(dir, file, NULL);
+}
+
+static Quicksave *get_slot(const char *vm_name)
+{
+    init_tracking();
+
+    Quicksave *slot = g_hash_table_lookup(qs.slots, vm_name);
+    if (!slot) {
+        slot = g_new0(Quicksave, 1);
+        slot->base_path = get_quicksave_path(vm_name, "base");
+        slot->delta_path = get_quicksave_path(vm_name, "delta");
+        slot->dirty = bitmap_new(qs.num_pages);
+        g_hash_table_insert(qs.slots, g_strdup(vm_name), slot);
+    }
+
+    return slot;
+}
+
+static void free_delta(QuicksaveDelta *delta)
+{
+    g_free(delta->state);
+    g_free(delta->pages);
+    g_free(delta->data);
+}
+
+static void wait_for_write(Quicksave *slot)
+{
+    if (!slot->writing) {
+        return;
+    }
+
+    qemu_thread_join(&slot->write_thread);
+    slot->writing = false;
+
+    if (slot->write_err) {
+        warn_report_err(slot->write_err);
+        slot->write_err = NULL;
+        slot->has_base = false;
+    }
+}
+
+static void add_dirty(const unsigned long *pages)
+{
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, qs.slots);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        Quicksave *slot = value;
+        bitmap_or(slot->dirty, slot->dirty, pages, qs.num_pages);
+    }
+
+    if (rw.dirty) {
+        bitmap_or(rw.dirty, rw.dirty, pages, qs.num_pages);
+    }
+}
+
+/* Folds the pages written since the last call into every slot */
+static void sync_dirty(void)
+{
+    size_t page_size = qemu_target_page_size();
+    g_autofree unsigned long *written = bitmap_new(qs.num_pages);
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        QuicksaveBlock *b = &qs.blocks[i];
+        MemoryRegion *mr = b->rb->mr;
+        DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+            mr, 0, b->num_pages * page_size, DIRTY_MEMORY_SNAPSHOT);
+
+        for (uint64_t p = 0; p < b->num_pages; p++) {
+            if (memory_region_snapshot_get_dirty(mr, snap, p * page_size,
+                                                 page_size)) {
+                set_bit(b->first_page + p, written);
+            }
+        }
+        g_free(snap);
+    }
+
+    add_dirty(written);
+}
+
+static bool put_u32(FILE *f, uint32_t v)
+{
+    v = cpu_to_be32(v);
+    return fwrite(&v, sizeof(v), 1, f) == 1;
+}
+
+static bool put_u64(FILE *f, uint64_t v)
+{
+    v = cpu_to_be64(v);
+    return fwrite(&v, sizeof(v), 1, f) == 1;
+}
+
+static bool get_u32(FILE *f, uint32_t *v)
+{
+    if (fread(v, sizeof(*v), 1, f) != 1) {
+        return false;
+    }
+    *v = be32_to_cpu(*v);
+    return true;
+}
+
+static bool get_u64(FILE *f, uint64_t *v)
+{
+    if (fread(v, sizeof(*v), 1, f) != 1) {
+        return false;
+    }
+    *v = be64_to_cpu(*v);
+    return true;
+}
+
+static bool put_header(FILE *f, uint64_t base_id)
+{
+    return put_u32(f, QUICKSAVE_MAGIC) && put_u32(f, QUICKSAVE_VERSION) &&
+           put_u64(f, base_id);
+}
+
+static bool get_header(FILE *f, const char *path, uint64_t *base_id,
+                       Error **errp)
+{
+    uint32_t magic, version;
+
+    if (!get_u32(f, &magic) || !get_u32(f, &version) ||
+        !get_u64(f, base_id) || magic != QUICKSAVE_MAGIC) {
+        error_setg(errp, "%s is not a quick-save", path);
+        return false;
+    }
+    if (version != QUICKSAVE_VERSION) {
+        error_setg(errp, "%s is from an unsupported version of xemu", path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool put_block_table(FILE *f)
+{
+    if (!put_u32(f, qs.num_blocks)) {
+        return false;
+    }
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        const char *idstr = qemu_ram_get_idstr(qs.blocks[i].rb);
+        if (!put_u32(f, strlen(idstr)) ||
+            fwrite(idstr, strlen(idstr), 1, f) != 1 ||
+            !put_u64(f, qs.blocks[i].num_pages)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Checks the RAM blocks in a quick-save are the ones of this machine */
+static bool check_block_table(FILE *f, const char *path, Error **errp)
+{
+    uint32_t num_blocks;
+
+    if (!get_u32(f, &num_blocks) || num_blocks != qs.num_blocks) {
+        goto mismatch;
+    }
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        const char *idstr = qemu_ram_get_idstr(qs.blocks[i].rb);
+        char buf[256];
+        uint32_t len;
+        uint64_t num_pages;
+
+        if (!get_u32(f, &len) || len != strlen(idstr) ||
+            fread(buf, len, 1, f) != 1 || memcmp(buf, idstr, len) ||
+            !get_u64(f, &num_pages) || num_pages != qs.blocks[i].num_pages) {
+            goto mismatch;
+        }
+    }
+
+    return true;
+
+mismatch:
+    error_setg(errp, "%s was saved by a different machine configuration",
+               path);
+    return false;
+}
+
+static bool close_file(FILE *f, const char *path, Error **errp)
+{
+    bool ok = !ferror(f);
+
+    if (fclose(f) || !ok) {
+        error_setg_errno(errp, errno, "Failed to write %s", path);
+        return false;
+    }
+
+    return true;
+}
+
+/* Runs fn(opaque, 0..n-1) on as many threads as there are processors */
+typedef struct ParallelJob {
+    void (*fn)(void *opaque, int i);
+    void *opaque;
+    int n;
+    int next;
+} ParallelJob;
+
+static void *parallel_worker(void *opaque)
+{
+    ParallelJob *job = opaque;
+
+    for (int i = qatomic_fetch_inc(&job->next); i < job->n;
+         i = qatomic_fetch_inc(&job->next)) {
+        job->fn(job->opaque, i);
+    }
+
+    return NULL;
+}
+
+static void run_parallel(void (*fn)(void *opaque, int i), void *opaque, int n)
+{
+    ParallelJob job = { .fn = fn, .opaque = opaque, .n = n };
+    int num_threads = MIN(g_get_num_processors(), n);
+    g_autofree QemuThread *threads = g_new(QemuThread, MAX(num_threads, 1));
+
+    for (int i = 1; i < num_threads; i++) {
+        qemu_thread_create(&threads[i], "xemu-quicksave-worker",
+                           parallel_worker, &job, QEMU_THREAD_JOINABLE);
+    }
+    parallel_worker(&job);
+    for (int i = 1; i < num_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+typedef struct PageCompression {
+    const uint8_t **data; // of the pages stored in the chunks
+    uint64_t num_data_pages;
+    uint8_t **chunks;
+    uint32_t *chunk_sizes;
+} PageCompression;
+
+static void compress_chunk(void *opaque, int i)
+{
+    PageCompression *pc = opaque;
+    size_t page_size = qemu_target_page_size();
+    uint64_t first = (uint64_t)i * QUICKSAVE_CHUNK_PAGES;
+    uint64_t n = MIN(QUICKSAVE_CHUNK_PAGES, pc->num_data_pages - first);
+    size_t size = n * page_size;
+    uint8_t *raw = g_malloc(size);
+
+    for (uint64_t j = 0; j < n; j++) {
+        memcpy(raw + j * page_size, pc->data[first + j], page_size);
+    }
+
+#ifdef CONFIG_ZSTD
+    size_t bound = ZSTD_compressBound(size);
+    uint8_t *out = g_malloc(bound);
+    size_t out_size = ZSTD_compress(out, bound, raw, size, 1);
+    if (!ZSTD_isError(out_size) && out_size < size) {
+        g_free(raw);
+        pc->chunks[i] = g_realloc(out, out_size);
+        pc->chunk_sizes[i] = out_size;
+        return;
+    }
+    g_free(out);
+#endif
+
+    pc->chunks[i] = raw;
+    pc->chunk_sizes[i] = size | QUICKSAVE_CHUNK_RAW;
+}
+
+/* Writes the given pages, or all if pages is NULL, packed in data */
+static bool put_pages(FILE *f, const unsigned long *pages, const uint8_t *data)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t num_pages =
+        pages ? bitmap_count_one(pages, qs.num_pages) : qs.num_pages;
+    PageCompression pc = { .data = g_new(const uint8_t *, num_pages) };
+    bool ok = put_u64(f, num_pages);
+
+    uint64_t j = 0;
+    for (uint64_t p = pages ? find_first_bit(pages, qs.num_pages) : 0;
+         ok && p < qs.num_pages;
+         p = pages ? find_next_bit(pages, qs.num_pages, p + 1) : p + 1) {
+        const uint8_t *page = data + j++ * page_size;
+        if (buffer_is_zero(page, page_size)) {
+            ok = put_u32(f, p | QUICKSAVE_PAGE_ZERO);
+        } else {
+            pc.data[pc.num_data_pages++] = page;
+            ok = put_u32(f, p);
+        }
+    }
+
+    int num_chunks = DIV_ROUND_UP(pc.num_data_pages, QUICKSAVE_CHUNK_PAGES);
+    pc.chunks = g_new0(uint8_t *, num_chunks);
+    pc.chunk_sizes = g_new0(uint32_t, num_chunks);
+    if (ok) {
+        run_parallel(compress_chunk, &pc, num_chunks);
+        ok = put_u32(f, num_chunks);
+    }
+
+    for (int i = 0; i < num_chunks; i++) {
+        ok = ok && put_u32(f, pc.chunk_sizes[i]) &&
+             fwrite(pc.chunks[i], pc.chunk_sizes[i] & ~QUICKSAVE_CHUNK_RAW, 1,
+                    f) == 1;
+        g_free(pc.chunks[i]);
+    }
+
+    g_free(pc.data);
+    g_free(pc.chunks);
+    g_free(pc.chunk_sizes);
+
+    return ok;
+}
+
+static bool write_base(Quicksave *slot, const char *path, Error **errp)
+{
+    FILE *f = g_fopen(path, "wb");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        return false;
+    }
+
+    bool ok = put_header(f, slot->base_id) && put_block_table(f) &&
+              put_pages(f, NULL, slot->staged_ram);
+
+    if (!close_file(f, path, errp)) {
+        return false;
+    }
+    if (!ok) {
+        error_setg(errp, "Failed to write %s", path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_delta(const QuicksaveDelta *delta, const char *path,
+                        Error **errp)
+{
+    FILE *f = g_fopen(path, "wb");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        return false;
+    }
+
+    bool ok = put_header(f, delta->base_id) &&
+              put_u64(f, delta->state_size) &&
+              fwrite(delta->state, delta->state_size, 1, f) == 1 &&
+              put_block_table(f) && put_pages(f, delta->pages, delta->data);
+
+    if (!close_file(f, path, errp)) {
+        return false;
+    }
+    if (!ok) {
+        error_setg(errp, "Failed to write %s", path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool rename_file(const char *from, const char *to, Error **errp)
+{
+    if (g_rename(from, to)) {
+        error_setg_errno(errp, errno, "Failed to rename %s", from);
+        return false;
+    }
+
+    return true;
+}
+
+static void *write_thread(void *opaque)
+{
+    Quicksave *slot = opaque;
+    g_autofree char *base_tmp = g_strdup_printf("%s.tmp", slot->base_path);
+    g_autofree char *delta_tmp = g_strdup_printf("%s.tmp", slot->delta_path);
+
+    // The delta is only moved into place once its base is
+    if (write_delta(&slot->staged_delta, delta_tmp, &slot->write_err) &&
+        (!slot->staged_ram ||
+         (write_base(slot, base_tmp, &slot->write_err) &&
+          rename_file(base_tmp, slot->base_path, &slot->write_err)))) {
+        rename_file(delta_tmp, slot->delta_path, &slot->write_err);
+    }
+
+    g_free(slot->staged_ram);
+    slot->staged_ram = NULL;
+    free_delta(&slot->staged_delta);
+    xemu_snapshots_mark_dirty();
+
+    return NULL;
+}
+
+static bool save_device_state(bool extra_data, uint8_t **state,
+                              size_t *state_size, Error **errp)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(4096);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+
+    if (extra_data) {
+        xemu_snapshots_save_extra_data(f);
+    }
+    int ret = qemu_save_device_state(f);
+    if (!ret) {
+        ret = qemu_fflush(f);
+    }
+    if (!ret) {
+        *state = g_memdup2(bioc->data, bioc->usage);
+        *state_size = bioc->usage;
+    }
+
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    if (ret) {
+        error_setg_errno(errp, -ret, "Error while saving device state");
+        return false;
+    }
+
+    return true;
+}
+
+static bool load_device_state(const uint8_t *state, size_t state_size,
+                              Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(state_size);
+
+    memcpy(bioc->data, state, state_size);
+    bioc->usage = state_size;
+
+    QEMUFile *f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    xemu_snapshots_offset_extra_data(f);
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        qemu_fclose(f);
+        error_setg(errp, "Invalid device state");
+        return false;
+    }
+
+    mis->from_src_file = f;
+    if (!yank_register_instance(MIGRATION_YANK_INSTANCE, errp)) {
+        mis->from_src_file = NULL;
+        qemu_fclose(f);
+        return false;
+    }
+
+    int ret = qemu_load_device_state(f, errp);
+    migration_incoming_state_destroy();
+
+    return ret >= 0;
+}
+
+static bool save_disk_state(const char *vm_name, BlockDriverState *bs,
+                            Error **errp)
+{
+    QEMUSnapshotInfo sn = { 0 };
+    g_autoptr(GDateTime) now = g_date_time_new_now_local();
+
+    if (bdrv_all_delete_snapshot(vm_name, false, NULL, errp) < 0) {
+        return false;
+    }
+
+    sn.date_sec = g_date_time_to_unix(now);
+    sn.date_nsec = g_date_time_get_microsecond(now) * 1000;
+    sn.vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    sn.icount = -1ULL;
+    pstrcpy(sn.name, sizeof(sn.name), vm_name);
+
+    return bdrv_all_create_snapshot(&sn, bs, 0, false, NULL, errp) >= 0;
+}
+
+/*
+ * Copies everything the save needs while the guest is stopped, the files
+ * are written once it is running again.
+ */
+static bool stage_vm_state(Quicksave *slot, bool extra_data, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    QuicksaveDelta *delta = &slot->staged_delta;
+    size_t state_size;
+
+    memset(delta, 0, sizeof(*delta));
+    if (!save_device_state(extra_data, &delta->state, &state_size, errp)) {
+        return false;
+    }
+    delta->state_size = state_size;
+
+    sync_dirty();
+
+    if (!slot->has_base ||
+        bitmap_count_one(slot->dirty, qs.num_pages) > qs.num_pages / 2) {
+        slot->base_id = ((uint64_t)g_random_int() << 32) | g_random_int();
+        slot->has_base = true;
+        bitmap_zero(slot->dirty, qs.num_pages);
+
+        slot->staged_ram = g_malloc(qs.num_pages * page_size);
+        for (int i = 0; i < qs.num_blocks; i++) {
+            QuicksaveBlock *b = &qs.blocks[i];
+            memcpy(slot->staged_ram + b->first_page * page_size,
+                   qemu_ram_get_host_addr(b->rb), b->num_pages * page_size);
+        }
+    }
+
+    delta->base_id = slot->base_id;
+    delta->pages = bitmap_new(qs.num_pages);
+    bitmap_copy(delta->pages, slot->dirty, qs.num_pages);
+    delta->data =
+        g_malloc(bitmap_count_one(delta->pages, qs.num_pages) * page_size);
+
+    size_t num_staged = 0;
+    for (int i = 0; i < qs.num_blocks; i++) {
+        QuicksaveBlock *b = &qs.blocks[i];
+        uint8_t *host = qemu_ram_get_host_addr(b->rb);
+        uint64_t end = b->first_page + b->num_pages;
+
+        for (uint64_t p = find_next_bit(delta->pages, end, b->first_page);
+             p < end; p = find_next_bit(delta->pages, end, p + 1)) {
+            memcpy(delta->data + num_staged++ * page_size,
+                   host + (p - b->first_page) * page_size, page_size);
+        }
+    }
+
+    return true;
+}
+
+static void quicksave_save(const char *vm_name, bool with_disk, Error **errp)
+{
+    RunState saved_state = runstate_get();
+    BlockDriverState *bs = NULL;
+
+    assert(vm_name);
+
+    if (migration_is_running()) {
+        error_setg(errp, "There's a migration process in progress");
+        return;
+    }
+
+    if (with_disk) {
+        if (!bdrv_all_can_snapshot(false, NULL, errp)) {
+            return;
+        }
+
+        bs = bdrv_all_find_vmstate_bs(NULL, false, NULL, errp);
+        if (!bs) {
+            return;
+        }
+    }
+
+    Quicksave *slot = get_slot(vm_name);
+    wait_for_write(slot);
+
+    g_autofree char *dir = g_path_get_dirname(slot->delta_path);
+    if (g_mkdir_with_parents(dir, 0755)) {
+        error_setg_errno(errp, errno, "Failed to create %s", dir);
+        return;
+    }
+
+    global_state_store();
+    vm_stop(RUN_STATE_SAVE_VM);
+    bdrv_drain_all_begin();
+
+    bool staged = !with_disk || save_disk_state(vm_name, bs, errp);
+    if (staged) {
+        staged = stage_vm_state(slot, with_disk, errp);
+        if (!staged) {
+            free_delta(&slot->staged_delta);
+            if (with_disk) {
+                bdrv_all_delete_snapshot(vm_name, false, NULL, NULL);
+            }
+        }
+    }
+
+    bdrv_drain_all_end();
+    vm_resume(saved_state);
+
+    if (staged) {
+        slot->writing = true;
+        qemu_thread_create(&slot->write_thread, "xemu-quicksave",
+                           write_thread, slot, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void xemu_quicksave_save(const char *vm_name, Error **errp)
+{
+    quicksave_save(vm_name, true, errp);
+}
+
+void xemu_quicksave_save_machine(const char *vm_name, Error **errp)
+{
+    quicksave_save(vm_name, false, errp);
+}
+
+static void free_pages(QuicksavePages *qp)
+{
+    for (uint32_t i = 0; i < qp->num_chunks && qp->chunks; i++) {
+        g_free(qp->chunks[i]);
+    }
+    g_free(qp->chunks);
+    g_free(qp->chunk_sizes);
+    g_free(qp->index);
+    g_free(qp->data_pages);
+    memset(qp, 0, sizeof(*qp));
+}
+
+static bool get_pages(FILE *f, QuicksavePages *qp)
+{
+    size_t page_size = qemu_target_page_size();
+
+    memset(qp, 0, sizeof(*qp));
+
+    if (!get_u64(f, &qp->num_pages) || qp->num_pages > qs.num_pages) {
+        return false;
+    }
+
+    qp->index = g_new(uint32_t, qp->num_pages);
+    qp->data_pages = g_new(uint32_t, qp->num_pages);
+    for (uint64_t i = 0; i < qp->num_pages; i++) {
+        if (!get_u32(f, &qp->index[i]) ||
+            (qp->index[i] & ~QUICKSAVE_PAGE_ZERO) >= qs.num_pages) {
+            return false;
+        }
+        if (!(qp->index[i] & QUICKSAVE_PAGE_ZERO)) {
+            qp->data_pages[qp->num_data_pages++] = qp->index[i];
+        }
+    }
+
+    if (!get_u32(f, &qp->num_chunks) ||
+        qp->num_chunks !=
+            DIV_ROUND_UP(qp->num_data_pages, QUICKSAVE_CHUNK_PAGES)) {
+        return false;
+    }
+
+    qp->chunks = g_new0(uint8_t *, qp->num_chunks);
+    qp->chunk_sizes = g_new0(uint32_t, qp->num_chunks);
+    for (uint32_t i = 0; i < qp->num_chunks; i++) {
+        uint32_t size;
+        if (!get_u32(f, &qp->chunk_sizes[i])) {
+            return false;
+        }
+        size = qp->chunk_sizes[i] & ~QUICKSAVE_CHUNK_RAW;
+        if (size > QUICKSAVE_CHUNK_PAGES * page_size * 2) {
+            return false;
+        }
+        qp->chunks[i] = g_malloc(size);
+        if (fread(qp->chunks[i], size, 1, f) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint8_t *page_host_addr(uint64_t page)
+{
+    size_t page_size = qemu_target_page_size();
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        QuicksaveBlock *b = &qs.blocks[i];
+        if (page < b->first_page + b->num_pages) {
+            return (uint8_t *)qemu_ram_get_host_addr(b->rb) +
+                   (page - b->first_page) * page_size;
+        }
+    }
+
+    g_assert_not_reached();
+}
+
+typedef struct PageDecompression {
+    QuicksavePages *qp;
+    bool ok;
+} PageDecompression;
+
+static void decompress_chunk(void *opaque, int i)
+{
+    PageDecompression *pd = opaque;
+    QuicksavePages *qp = pd->qp;
+    size_t page_size = qemu_target_page_size();
+    uint64_t first = (uint64_t)i * QUICKSAVE_CHUNK_PAGES;
+    uint64_t n = MIN(QUICKSAVE_CHUNK_PAGES, qp->num_data_pages - first);
+    size_t size = n * page_size;
+    uint32_t chunk_size = qp->chunk_sizes[i] & ~QUICKSAVE_CHUNK_RAW;
+    g_autofree uint8_t *buf = NULL;
+    const uint8_t *raw = qp->chunks[i];
+
+    if (qp->chunk_sizes[i] & QUICKSAVE_CHUNK_RAW) {
+        if (chunk_size != size) {
+            qatomic_set(&pd->ok, false);
+            return;
+        }
+    } else {
+#ifdef CONFIG_ZSTD
+        buf = g_malloc(size);
+        if (ZSTD_decompress(buf, size, raw, chunk_size) != size) {
+            qatomic_set(&pd->ok, false);
+            return;
+        }
+        raw = buf;
+#else
+        qatomic_set(&pd->ok, false);
+        return;
+#endif
+    }
+
+    for (uint64_t j = 0; j < n; j++) {
+        memcpy(page_host_addr(qp->data_pages[first + j]), raw + j * page_size,
+               page_size);
+    }
+}
+
+/* Writes the pages into guest RAM */
+static bool apply_pages(QuicksavePages *qp)
+{
+    size_t page_size = qemu_target_page_size();
+    PageDecompression pd = { .qp = qp, .ok = true };
+
+    for (uint64_t i = 0; i < qp->num_pages; i++) {
+        if (qp->index[i] & QUICKSAVE_PAGE_ZERO) {
+            memset(page_host_addr(qp->index[i] & ~QUICKSAVE_PAGE_ZERO), 0,
+                   page_size);
+        }
+    }
+
+    run_parallel(decompress_chunk, &pd, qp->num_chunks);
+
+    return pd.ok;
+}
+
+/* Reads a base, or a delta and its device state if is_delta */
+static bool read_file(const char *path, bool is_delta, QuicksaveDelta *hdr,
+                      QuicksavePages *qp, Error **errp)
+{
+    bool ok = false;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memset(qp, 0, sizeof(*qp));
+
+    FILE *f = g_fopen(path, "rb");
+    if (!f) {
+        error_setg_file_open(errp, errno, path);
+        return false;
+    }
+
+    if (!get_header(f, path, &hdr->base_id, errp)) {
+        goto out;
+    }
+
+    if (is_delta) {
+        if (!get_u64(f, &hdr->state_size) || hdr->state_size > INT32_MAX) {
+            goto truncated;
+        }
+        hdr->state = g_malloc(hdr->state_size);
+        if (fread(hdr->state, hdr->state_size, 1, f) != 1) {
+            goto truncated;
+        }
+    }
+
+    if (!check_block_table(f, path, errp)) {
+        goto out;
+    }
+
+    if (!get_pages(f, qp)) {
+        goto truncated;
+    }
+
+    hdr->pages = bitmap_new(qs.num_pages);
+    for (uint64_t i = 0; i < qp->num_pages; i++) {
+        set_bit(qp->index[i] & ~QUICKSAVE_PAGE_ZERO, hdr->pages);
+    }
+
+    ok = true;
+    goto out;
+
+truncated:
+    error_setg(errp, "%s is truncated or corrupt", path);
+out:
+    fclose(f);
+    if (!ok) {
+        free_delta(hdr);
+        free_pages(qp);
+    }
+    return ok;
+}
+
+/*
+ * RAM was rewritten behind the back of the dirty tracking, let the other
+ * clients know and drop any code translated from it. Only the given pages
+ * are marked if there are any, so renderer caches over the others stay.
+ */
+static void ram_rewritten(const unsigned long *pages)
+{
+    size_t page_size = qemu_target_page_size();
+    uint8_t mask = DIRTY_CLIENTS_NOCODE & ~(1 << DIRTY_MEMORY_SNAPSHOT);
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        QuicksaveBlock *b = &qs.blocks[i];
+        uint64_t end = b->first_page + b->num_pages;
+
+        if (!pages) {
+            physical_memory_set_dirty_range(b->rb->offset,
+                                            b->num_pages * page_size, mask);
+            continue;
+        }
+
+        for (uint64_t p = find_next_bit(pages, end, b->first_page); p < end;
+             p = find_next_bit(pages, end, p)) {
+            uint64_t run_end = find_next_zero_bit(pages, end, p);
+            physical_memory_set_dirty_range(
+                b->rb->offset + (p - b->first_page) * page_size,
+                (run_end - p) * page_size, mask);
+            p = run_end;
+        }
+    }
+
+    if (tcg_enabled()) {
+        tb_flush__exclusive_or_serial();
+    }
+}
+
+static bool quicksave_load(const char *vm_name, bool with_disk, Error **errp)
+{
+    QuicksaveDelta base, delta;
+    QuicksavePages base_pages, delta_pages;
+    bool ok = false;
+
+    Quicksave *slot = get_slot(vm_name);
+    wait_for_write(slot);
+
+    if (!read_file(slot->delta_path, true, &delta, &delta_pages, errp)) {
+        return false;
+    }
+    if (!read_file(slot->base_path, false, &base, &base_pages, errp)) {
+        free_delta(&delta);
+        free_pages(&delta_pages);
+        return false;
+    }
+
+    if (base.base_id != delta.base_id) {
+        error_setg(errp, "Quick-save '%s' is incomplete", vm_name);
+        goto out;
+    }
+
+    bdrv_drain_all_begin();
+
+    if (with_disk && bdrv_all_goto_snapshot(vm_name, false, NULL, errp) < 0) {
+        bdrv_drain_all_end();
+        goto out;
+    }
+
+    qemu_system_reset(SHUTDOWN_CAUSE_SNAPSHOT_LOAD);
+
+    ok = apply_pages(&base_pages) && apply_pages(&delta_pages);
+    if (ok) {
+        ram_rewritten(NULL);
+        ok = load_device_state(delta.state, delta.state_size, errp);
+    } else {
+        error_setg(errp, "Quick-save '%s' is corrupt", vm_name);
+    }
+
+    bdrv_drain_all_end();
+
+    // Every other slot's base differs from RAM in unknown places now
+    xemu_quicksave_invalidate();
+    sync_dirty();
+    if (ok) {
+        bitmap_copy(slot->dirty, delta.pages, qs.num_pages);
+        slot->base_id = base.base_id;
+        slot->has_base = true;
+    }
+
+out:
+    free_delta(&base);
+    free_pages(&base_pages);
+    free_delta(&delta);
+    free_pages(&delta_pages);
+    return ok;
+}
+
+bool xemu_quicksave_load(const char *vm_name, Error **errp)
+{
+    return quicksave_load(vm_name, true, errp);
+}
+
+bool xemu_quicksave_load_machine(const char *vm_name, Error **errp)
+{
+    return quicksave_load(vm_name, false, errp);
+}
+
+bool xemu_quicksave_exists(const char *vm_name)
+{
+    Quicksave *slot = qs.slots ? g_hash_table_lookup(qs.slots, vm_name) : NULL;
+    if (slot && slot->writing) {
+        return true;
+    }
+
+    g_autofree char *path = get_quicksave_path(vm_name, "delta");
+    return g_file_test(path, G_FILE_TEST_EXISTS);
+}
+
+void xemu_quicksave_delete(const char *vm_name)
+{
+    if (qs.slots) {
+        Quicksave *slot = g_hash_table_lookup(qs.slots, vm_name);
+        if (slot) {
+            wait_for_write(slot);
+            g_hash_table_remove(qs.slots, vm_name);
+        }
+    }
+
+    static const char *const suffixes[] = {
+        "base", "delta", "base.tmp", "delta.tmp",
+    };
+    for (int i = 0; i < ARRAY_SIZE(suffixes); i++) {
+        g_autofree char *path = get_quicksave_path(vm_name, suffixes[i]);
+        g_unlink(path);
+    }
+}
+
+static void rewind_clear(void);
+
+void xemu_quicksave_invalidate(void)
+{
+    if (!qs.slots) {
+        return;
+    }
+
+    rewind_clear();
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, qs.slots);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ((Quicksave *)value)->has_base = false;
+    }
+}
+
+void *xemu_quicksave_read_extra_data(const char *vm_name, size_t *size)
+{
+    g_autofree char *path = get_quicksave_path(vm_name, "delta");
+    uint32_t magic, version, extra_size;
+    uint64_t base_id, state_size;
+    void *buf = NULL;
+
+    FILE *f = g_fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    if (get_header(f, path, &base_id, NULL) && get_u64(f, &state_size) &&
+        get_u32(f, &magic) && magic == XEMU_SNAPSHOT_DATA_MAGIC &&
+        get_u32(f, &version) && version == XEMU_SNAPSHOT_DATA_VERSION &&
+        get_u32(f, &extra_size) && extra_size <= state_size) {
+        buf = g_malloc(extra_size);
+        if (fread(buf, extra_size, 1, f) == 1) {
+            *size = extra_size;
+        } else {
+            g_free(buf);
+            buf = NULL;
+        }
+    }
+
+    fclose(f);
+    return buf;
+}
+
+static void rewind_free_state(gpointer data)
+{
+    RewindState *st = data;
+
+    g_free(st->state);
+    g_free(st->pages);
+    g_free(st->patch);
+    g_free(st);
+}
+
+static size_t rewind_state_size(RewindState *st)
+{
+    return st->state_size + st->patch_size +
+           (st->pages ? BITS_TO_LONGS(qs.num_pages) * sizeof(long) : 0);
+}
+
+static void rewind_clear(void)
+{
+    g_queue_clear_full(&rw.states, rewind_free_state);
+    rw.size = 0;
+    g_free(rw.ram);
+    rw.ram = NULL;
+    g_free(rw.dirty);
+    rw.dirty = NULL;
+    rw.frames = 0;
+}
+
+static void rewind_compress_patch(RewindState *st, uint8_t *xor, size_t size)
+{
+#ifdef CONFIG_ZSTD
+    size_t bound = ZSTD_compressBound(size);
+    st->patch = g_malloc(bound);
+    st->patch_size = ZSTD_compress(st->patch, bound, xor, size, 1);
+    assert(!ZSTD_isError(st->patch_size));
+    st->patch = g_realloc(st->patch, st->patch_size);
+    g_free(xor);
+#else
+    st->patch = xor;
+    st->patch_size = size;
+#endif
+}
+
+static uint8_t *rewind_decompress_patch(RewindState *st)
+{
+    size_t size = bitmap_count_one(st->pages, qs.num_pages) *
+                  qemu_target_page_size();
+#ifdef CONFIG_ZSTD
+    uint8_t *xor = g_malloc(size);
+    size_t ret = ZSTD_decompress(xor, size, st->patch, st->patch_size);
+    assert(ret == size);
+    return xor;
+#else
+    assert(st->patch_size == size);
+    return g_memdup2(st->patch, size);
+#endif
+}
+
+static void rewind_capture(void)
+{
+    size_t page_size = qemu_target_page_size();
+    RunState saved_state = runstate_get();
+    RewindState *st = g_new0(RewindState, 1);
+    RewindState *prev = g_queue_peek_tail(&rw.states);
+    uint8_t *xor = NULL;
+    size_t xor_size = 0;
+    Error *err = NULL;
+
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    if (!save_device_state(false, &st->state, &st->state_size, &err)) {
+        vm_resume(saved_state);
+        warn_report_err(err);
+        g_free(st);
+        return;
+    }
+
+    sync_dirty();
+
+    if (!rw.ram) {
+        rw.ram = g_malloc(qs.num_pages * page_size);
+        for (int i = 0; i < qs.num_blocks; i++) {
+            QuicksaveBlock *b = &qs.blocks[i];
+            memcpy(rw.ram + b->first_page * page_size,
+                   qemu_ram_get_host_addr(b->rb), b->num_pages * page_size);
+        }
+    } else {
+        rw.size -= rewind_state_size(prev);
+        prev->pages = bitmap_new(qs.num_pages);
+        xor = g_malloc(bitmap_count_one(rw.dirty, qs.num_pages) * page_size);
+
+        for (int i = 0; i < qs.num_blocks; i++) {
+            QuicksaveBlock *b = &qs.blocks[i];
+            uint8_t *host = qemu_ram_get_host_addr(b->rb);
+            uint64_t end = b->first_page + b->num_pages;
+
+            for (uint64_t p = find_next_bit(rw.dirty, end, b->first_page);
+                 p < end; p = find_next_bit(rw.dirty, end, p + 1)) {
+                uint8_t *cur = host + (p - b->first_page) * page_size;
+                uint8_t *old = rw.ram + p * page_size;
+                uint8_t *out = xor + xor_size;
+
+                if (!memcmp(cur, old, page_size)) {
+                    continue;
+                }
+                for (size_t j = 0; j < page_size; j++) {
+                    out[j] = cur[j] ^ old[j];
+                }
+                memcpy(old, cur, page_size);
+                set_bit(p, prev->pages);
+                xor_size += page_size;
+            }
+        }
+    }
+    bitmap_zero(rw.dirty, qs.num_pages);
+
+    vm_resume(saved_state);
+
+    if (prev) {
+        rewind_compress_patch(prev, xor, xor_size);
+        rw.size += rewind_state_size(prev);
+    }
+
+    g_queue_push_tail(&rw.states, st);
+    rw.size += rewind_state_size(st);
+
+    // The oldest state has the only patch nothing else depends on
+    size_t budget = (size_t)g_config.general.snapshots.rewind.budget_mb << 20;
+    while (rw.size > budget && g_queue_get_length(&rw.states) > 1) {
+        RewindState *oldest = g_queue_pop_head(&rw.states);
+        rw.size -= rewind_state_size(oldest);
+        rewind_free_state(oldest);
+    }
+}
+
+/* Moves rw.ram back to the state before the newest one, and drops that */
+static void rewind_drop_newest(unsigned long *changed)
+{
+    size_t page_size = qemu_target_page_size();
+    RewindState *newest = g_queue_pop_tail(&rw.states);
+    RewindState *prev = g_queue_peek_tail(&rw.states);
+    g_autofree uint8_t *xor = rewind_decompress_patch(prev);
+    size_t num_read = 0;
+
+    rw.size -= rewind_state_size(newest) + rewind_state_size(prev);
+    rewind_free_state(newest);
+
+    for (uint64_t p = find_first_bit(prev->pages, qs.num_pages);
+         p < qs.num_pages;
+         p = find_next_bit(prev->pages, qs.num_pages, p + 1)) {
+        uint8_t *page = rw.ram + p * page_size;
+        uint8_t *in = xor + num_read++ * page_size;
+        for (size_t j = 0; j < page_size; j++) {
+            page[j] ^= in[j];
+        }
+    }
+    bitmap_or(changed, changed, prev->pages, qs.num_pages);
+
+    g_free(prev->pages);
+    prev->pages = NULL;
+    g_free(prev->patch);
+    prev->patch = NULL;
+    prev->patch_size = 0;
+    rw.size += rewind_state_size(prev);
+}
+
+void xemu_rewind_frame(void)
+{
+    if (!g_config.general.snapshots.rewind.enabled) {
+        if (rw.ram) {
+            rewind_clear();
+        }
+        return;
+    }
+
+    if (!runstate_is_running() || migration_is_running()) {
+        return;
+    }
+
+    if (!rw.dirty) {
+        init_tracking();
+        rw.dirty = bitmap_new(qs.num_pages);
+        rw.frames = INT_MAX;
+    }
+
+    if (++rw.frames >= g_config.general.snapshots.rewind.interval) {
+        rewind_capture();
+        rw.frames = 0;
+    }
+}
+
+bool xemu_rewind_step(Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    bool vm_running = runstate_is_running();
+
+    if (g_queue_is_empty(&rw.states)) {
+        error_setg(errp, "Nothing to rewind to");
+        return false;
+    }
+
+    vm_stop(RUN_STATE_RESTORE_VM);
+    qemu_system_reset(SHUTDOWN_CAUSE_SNAPSHOT_LOAD);
+    sync_dirty();
+
+    // Pages to copy back: written since the newest state, or by the reset
+    g_autofree unsigned long *changed = bitmap_new(qs.num_pages);
+    bitmap_copy(changed, rw.dirty, qs.num_pages);
+
+    // Right after a capture or a rewind, go one state further back
+    if (rw.frames < g_config.general.snapshots.rewind.interval / 2 &&
+        g_queue_get_length(&rw.states) > 1) {
+        rewind_drop_newest(changed);
+    }
+
+    for (int i = 0; i < qs.num_blocks; i++) {
+        QuicksaveBlock *b = &qs.blocks[i];
+        uint8_t *host = qemu_ram_get_host_addr(b->rb);
+        uint64_t end = b->first_page + b->num_pages;
+
+        for (uint64_t p = find_next_bit(changed, end, b->first_page); p < end;
+             p = find_next_bit(changed, end, p + 1)) {
+            memcpy(host + (p - b->first_page) * page_size,
+                   rw.ram + p * page_size, page_size);
+        }
+    }
+
+    // The quick-save slots see the restored pages as written
+    add_dirty(changed);
+    bitmap_zero(rw.dirty, qs.num_pages);
+    ram_rewritten(changed);
+
+    RewindState *st = g_queue_peek_tail(&rw.states);
+    bool ok = load_device_state(st->state, st->state_size, errp);
+    if (!ok) {
+        rewind_clear();
+        return false;
+    }
+
+    rw.frames = 0;
+    if (vm_running) {
+        vm_start();
+    }
+
+    return true;
+}
@@ -33,6 +33,7 @@
 
 #include "xemu-controllers.h"
 #include "xemu-settings.h"
+#include "xemu-title-profiles.h"
 
 #define DEFINE_CONFIG_TREE
 #include "xemu-config.h"
@@ -87,6 +88,38 @@ const char *xemu_settings_get_base_path(void)
     return base_path;
 }
 
+/*
+ * Resolved once when the settings are loaded, before any thread that uses it
+ * is started, so it can be read without synchronization afterwards.
+ */
+static const char *cache_path = NULL;
+
+static void resolve_cache_path(void)
+{
+    const char *dir = g_config.sys.files.cache_path;
+    if (!dir || !dir[0]) {
+        cache_path = xemu_settings_get_base_path();
+        return;
+    }
+
+    if (g_mkdir_with_parents(dir, 0755)) {
+        fprintf(stderr, "%s: cannot create %s, using base path\n", __func__,
+                dir);
+        cache_path = xemu_settings_get_base_path();
+        return;
+    }
+
+    cache_path = g_str_has_suffix(dir, G_DIR_SEPARATOR_S)
+                     ? g_strdup(dir)
+                     : g_strconcat(dir, G_DIR_SEPARATOR_S, NULL);
+}
+
+const char *xemu_settings_get_cache_path(void)
+{
+    assert(cache_path != NULL);
+    return cache_path;
+}
+
 const char *xemu_settings_get_path(void)
 {
     if (settings_path != NULL) {
@@ -198,6 +231,7 @@ bool xemu_settings_load(void)
     }
 
     config_tree.store_to_struct(&g_config);
+    resolve_cache_path();
 
     return success;
 }
@@ -223,7 +257,10 @@ void xemu_settings_save(void)
     // controller, so we can set it to true (default) now to remove it from the user config.
     g_config.input.allow_vibration = true;
 
+    // Settings a title profile overrides are saved with the user's values
+    xemu_title_profiles_suspend();
     config_tree.update_from_struct(&g_config);
+    xemu_title_profiles_resume();
     fprintf(fd, "%s", config_tree.generate_delta_toml().c_str());
     fclose(fd);
 
@@ -48,6 +48,11 @@ void xemu_settings_set_path(const char *path);
 // Get the path of the base settings dir
 const char *xemu_settings_get_base_path(void);
 
+// Get the path of the dir holding shader, pipeline, texture and translation
+// caches. Instances of xemu on the same host can be pointed at the same one
+// to share them, it is the base settings dir by default.
+const char *xemu_settings_get_cache_path(void);
+
 // Get path of the config file on disk
 const char *xemu_settings_get_path(void);
 
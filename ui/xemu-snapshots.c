@@ -18,6 +18,8 @@
  */
 
 #include "xemu-snapshots.h"
+#include "xemu-fast-boot.h"
+#include "xemu-hdd.h"
 #include "xemu-settings.h"
 #include "xemu-xbe.h"
 
@@ -50,127 +52,245 @@ const char **g_snapshot_shortcut_index_key_map[] = {
     &g_config.general.snapshots.shortcuts.f8,
 };
 
-static void xemu_snapshots_load_data(BlockDriverState *bs_ro,
-                                     QEMUSnapshotInfo *info,
-                                     XemuSnapshotData *data, Error **err)
+/*
+ * The extra data of every snapshot is kept in a cache file next to the HDD
+ * image, keyed by snapshot ID and date, so listing snapshots only has to
+ * open the ones that are new.
+ */
+#define XEMU_SNAPSHOTS_CACHE_MAGIC 0x78736e63 // 'xsnc'
+
+static GHashTable *xemu_snapshots_cache = NULL; // key -> GBytes
+static char *xemu_snapshots_cache_path = NULL;
+
+static char *xemu_snapshots_cache_key(QEMUSnapshotInfo *info)
 {
-    data->disc_path = NULL;
-    data->xbe_title_name = NULL;
-    data->gl_thumbnail = 0;
+    return g_strdup_printf("%s:%s:%" PRId64 ":%" PRId64, info->id_str,
+                           info->name, info->date_sec, info->date_nsec);
+}
 
-    int res = bdrv_snapshot_load_tmp(bs_ro, info->id_str, info->name, err);
-    if (res < 0) {
+static void xemu_snapshots_cache_load(void)
+{
+    g_autofree char *path =
+        g_strdup_printf("%s.snapcache", g_config.sys.files.hdd_path);
+
+    if (xemu_snapshots_cache && !g_strcmp0(path, xemu_snapshots_cache_path)) {
         return;
     }
 
-    uint32_t header[3];
-    int64_t offset = 0;
-    res = bdrv_load_vmstate(bs_ro, (uint8_t *)&header, offset, sizeof(header));
-    if (res != sizeof(header)) {
+    if (xemu_snapshots_cache) {
+        g_hash_table_destroy(xemu_snapshots_cache);
+    }
+    xemu_snapshots_cache = g_hash_table_new_full(
+        g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref);
+    g_free(xemu_snapshots_cache_path);
+    xemu_snapshots_cache_path = g_steal_pointer(&path);
+
+    g_autofree uint8_t *buf = NULL;
+    size_t size, offset = 4;
+    if (!g_file_get_contents(xemu_snapshots_cache_path, (char **)&buf, &size,
+                             NULL) ||
+        size < 4 || ldl_be_p(buf) != XEMU_SNAPSHOTS_CACHE_MAGIC) {
         return;
     }
-    offset += res;
 
-    if (be32_to_cpu(header[0]) != XEMU_SNAPSHOT_DATA_MAGIC ||
-        be32_to_cpu(header[1]) != XEMU_SNAPSHOT_DATA_VERSION) {
-        return;
+    while (offset + 4 <= size) {
+        size_t key_size = ldl_be_p(&buf[offset]);
+        offset += 4;
+        if (offset + key_size + 4 > size) {
+            break;
+        }
+        char *key = g_strndup((char *)&buf[offset], key_size);
+        offset += key_size;
+
+        size_t data_size = ldl_be_p(&buf[offset]);
+        offset += 4;
+        if (offset + data_size > size) {
+            g_free(key);
+            break;
+        }
+        g_hash_table_replace(xemu_snapshots_cache, key,
+                             g_bytes_new(&buf[offset], data_size));
+        offset += data_size;
     }
+}
 
-    size_t size = be32_to_cpu(header[2]);
-    uint8_t *buf = g_malloc(size);
-    res = bdrv_load_vmstate(bs_ro, buf, offset, size);
-    if (res != size) {
-        g_free(buf);
-        return;
+/* Writes out the cache, keeping only the entries of current snapshots */
+static void xemu_snapshots_cache_store(QEMUSnapshotInfo *info,
+                                       int snapshots_len)
+{
+    GByteArray *out = g_byte_array_new();
+    uint8_t word[4];
+
+    stl_be_p(word, XEMU_SNAPSHOTS_CACHE_MAGIC);
+    g_byte_array_append(out, word, 4);
+
+    for (int i = 0; i < snapshots_len; ++i) {
+        g_autofree char *key = xemu_snapshots_cache_key(&info[i]);
+        GBytes *data = g_hash_table_lookup(xemu_snapshots_cache, key);
+        if (!data) {
+            continue;
+        }
+
+        stl_be_p(word, strlen(key));
+        g_byte_array_append(out, word, 4);
+        g_byte_array_append(out, (uint8_t *)key, strlen(key));
+        stl_be_p(word, g_bytes_get_size(data));
+        g_byte_array_append(out, word, 4);
+        g_byte_array_append(out, g_bytes_get_data(data, NULL),
+                            g_bytes_get_size(data));
     }
 
-    assert(size >= 9);
+    g_file_set_contents(xemu_snapshots_cache_path, (char *)out->data,
+                        out->len, NULL);
+    g_byte_array_unref(out);
+}
 
-    offset = 0;
+static void xemu_snapshots_parse_extra_data(XemuSnapshotData *data,
+                                            GBytes *bytes)
+{
+    size_t size;
+    const uint8_t *buf = g_bytes_get_data(bytes, &size);
+    size_t offset = 0;
+
+    if (size < 9) {
+        return;
+    }
 
-    const size_t disc_path_size = be32_to_cpu(*(uint32_t *)&buf[offset]);
+    const size_t disc_path_size = ldl_be_p(&buf[offset]);
     offset += 4;
 
     if (disc_path_size) {
-        data->disc_path = (char *)g_malloc(disc_path_size + 1);
-        assert(size >= (offset + disc_path_size));
-        memcpy(data->disc_path, &buf[offset], disc_path_size);
-        data->disc_path[disc_path_size] = 0;
+        if (size < offset + disc_path_size + 5) {
+            return;
+        }
+        data->disc_path = g_strndup((char *)&buf[offset], disc_path_size);
         offset += disc_path_size;
     }
 
-    assert(size >= (offset + 4));
     const size_t xbe_title_name_size = buf[offset];
     offset += 1;
 
     if (xbe_title_name_size) {
-        data->xbe_title_name = (char *)g_malloc(xbe_title_name_size + 1);
-        assert(size >= (offset + xbe_title_name_size));
-        memcpy(data->xbe_title_name, &buf[offset], xbe_title_name_size);
-        data->xbe_title_name[xbe_title_name_size] = 0;
+        if (size < offset + xbe_title_name_size + 4) {
+            return;
+        }
+        data->xbe_title_name =
+            g_strndup((char *)&buf[offset], xbe_title_name_size);
         offset += xbe_title_name_size;
     }
 
-    const size_t thumbnail_size = be32_to_cpu(*(uint32_t *)&buf[offset]);
+    const size_t thumbnail_size = ldl_be_p(&buf[offset]);
     offset += 4;
 
-    if (thumbnail_size) {
-        GLuint thumbnail;
-        glGenTextures(1, &thumbnail);
-        assert(size >= (offset + thumbnail_size));
-        if (xemu_snapshots_load_png_to_texture(thumbnail, &buf[offset],
-                                               thumbnail_size)) {
-            data->gl_thumbnail = thumbnail;
-        } else {
-            glDeleteTextures(1, &thumbnail);
+    /* Decoded once the snapshot is shown, see xemu_snapshots_get_thumbnail */
+    if (thumbnail_size && size >= offset + thumbnail_size) {
+        data->thumbnail_png = g_memdup2(&buf[offset], thumbnail_size);
+        data->thumbnail_png_size = thumbnail_size;
+    }
+}
+
+static GBytes *xemu_snapshots_read_extra_data(BlockDriverState **bs_ro,
+                                              QEMUSnapshotInfo *info,
+                                              Error **err)
+{
+    /* Quick-saves keep their VM state next to the disk image */
+    if (info->vm_state_size == 0) {
+        size_t size;
+        void *buf = xemu_quicksave_read_extra_data(info->name, &size);
+        return buf ? g_bytes_new_take(buf, size) : g_bytes_new(NULL, 0);
+    }
+
+    if (!*bs_ro) {
+        QDict *opts = qdict_new();
+        qdict_put_bool(opts, BDRV_OPT_READ_ONLY, true);
+        *bs_ro = bdrv_open(g_config.sys.files.hdd_path, NULL, opts,
+                           BDRV_O_RO_WRITE_SHARE | BDRV_O_AUTO_RDONLY, err);
+        if (!*bs_ro) {
+            return NULL;
         }
-        offset += thumbnail_size;
     }
 
-    g_free(buf);
+    int res = bdrv_snapshot_load_tmp(*bs_ro, info->id_str, info->name, err);
+    if (res < 0) {
+        return NULL;
+    }
+
+    uint32_t header[3];
+    int64_t offset = 0;
+    res = bdrv_load_vmstate(*bs_ro, (uint8_t *)&header, offset,
+                            sizeof(header));
+    if (res != sizeof(header)) {
+        return g_bytes_new(NULL, 0);
+    }
+    offset += res;
+
+    if (be32_to_cpu(header[0]) != XEMU_SNAPSHOT_DATA_MAGIC ||
+        be32_to_cpu(header[1]) != XEMU_SNAPSHOT_DATA_VERSION) {
+        return g_bytes_new(NULL, 0);
+    }
+
+    size_t size = be32_to_cpu(header[2]);
+    uint8_t *buf = g_malloc(size);
+    res = bdrv_load_vmstate(*bs_ro, buf, offset, size);
+    if (res != size) {
+        g_free(buf);
+        return g_bytes_new(NULL, 0);
+    }
+
+    return g_bytes_new_take(buf, size);
 }
 
 static void xemu_snapshots_all_load_data(QEMUSnapshotInfo **info,
                                          XemuSnapshotData **data,
                                          int snapshots_len, Error **err)
 {
-    BlockDriverState *bs_ro;
-    QDict *opts = qdict_new();
+    BlockDriverState *bs_ro = NULL;
+    bool cache_changed = false;
 
     assert(info && data);
 
     if (*data) {
         for (int i = 0; i < xemu_snapshots_len; ++i) {
+            g_free((*data)[i].disc_path);
             g_free((*data)[i].xbe_title_name);
-            if ((*data)[i].gl_thumbnail) {
-                glDeleteTextures(1, &((*data)[i].gl_thumbnail));
-            }
+            xemu_snapshots_free_thumbnail(&(*data)[i]);
         }
         g_free(*data);
     }
 
-    *data =
-        (XemuSnapshotData *)g_malloc(sizeof(XemuSnapshotData) * snapshots_len);
-    memset(*data, 0, sizeof(XemuSnapshotData) * snapshots_len);
+    *data = g_new0(XemuSnapshotData, snapshots_len);
 
-    qdict_put_bool(opts, BDRV_OPT_READ_ONLY, true);
-    bs_ro = bdrv_open(g_config.sys.files.hdd_path, NULL, opts,
-                      BDRV_O_RO_WRITE_SHARE | BDRV_O_AUTO_RDONLY, err);
-    if (!bs_ro) {
-        return;
-    }
+    xemu_snapshots_cache_load();
 
     for (int i = 0; i < snapshots_len; ++i) {
-        xemu_snapshots_load_data(bs_ro, (*info) + i, (*data) + i, err);
-        if (*err) {
-            break;
+        char *key = xemu_snapshots_cache_key((*info) + i);
+        GBytes *bytes = g_hash_table_lookup(xemu_snapshots_cache, key);
+        if (!bytes) {
+            bytes = xemu_snapshots_read_extra_data(&bs_ro, (*info) + i, err);
+            if (*err) {
+                g_free(key);
+                break;
+            }
+            g_hash_table_replace(xemu_snapshots_cache, g_strdup(key), bytes);
+            cache_changed = true;
         }
+        g_free(key);
+
+        xemu_snapshots_parse_extra_data((*data) + i, bytes);
+    }
+
+    if (bs_ro) {
+        bdrv_flush(bs_ro);
+        bdrv_drain(bs_ro);
+        bdrv_unref(bs_ro);
+        assert(bs_ro->refcnt == 0);
+    }
+
+    if (cache_changed ||
+        g_hash_table_size(xemu_snapshots_cache) != snapshots_len) {
+        xemu_snapshots_cache_store(*info, snapshots_len);
     }
 
-    bdrv_flush(bs_ro);
-    bdrv_drain(bs_ro);
-    bdrv_unref(bs_ro);
-    assert(bs_ro->refcnt == 0);
     if (!(*err))
         xemu_snapshots_dirty = false;
 }
@@ -241,20 +361,40 @@ char *xemu_get_currently_loaded_disc_path(void)
 void xemu_snapshots_load(const char *vm_name, Error **err)
 {
     bool vm_running = runstate_is_running();
+    bool loaded;
+
     vm_stop(RUN_STATE_RESTORE_VM);
-    if (load_snapshot(vm_name, NULL, false, NULL, err) && vm_running) {
+    xemu_fast_boot_cancel();
+    if (xemu_quicksave_exists(vm_name)) {
+        loaded = xemu_quicksave_load(vm_name, err);
+    } else {
+        xemu_quicksave_invalidate();
+        loaded = load_snapshot(vm_name, NULL, false, NULL, err);
+    }
+    if (loaded && vm_running) {
         vm_start();
     }
 }
 
 void xemu_snapshots_save(const char *vm_name, Error **err)
 {
-    save_snapshot(vm_name, true, NULL, false, NULL, err);
+    if (vm_name && g_config.general.snapshots.incremental_quicksave) {
+        xemu_quicksave_save(vm_name, err);
+        xemu_hdd_sync();
+        return;
+    }
+
+    if (save_snapshot(vm_name, true, NULL, false, NULL, err)) {
+        xemu_quicksave_delete(vm_name);
+        xemu_hdd_sync();
+    }
 }
 
 void xemu_snapshots_delete(const char *vm_name, Error **err)
 {
-    delete_snapshot(vm_name, false, NULL, err);
+    if (delete_snapshot(vm_name, false, NULL, err)) {
+        xemu_quicksave_delete(vm_name);
+    }
 }
 
 void xemu_snapshots_save_extra_data(QEMUFile *f)
@@ -316,13 +456,20 @@ bool xemu_snapshots_offset_extra_data(QEMUFile *f)
     version = qemu_get_be32(f);
     (void)version;
 
-    /* qemu_file_skip only works if you aren't skipping past internal buffer limit.
-     * Unfortunately, it's not usable here.
+    /*
+     * qemu_file_skip only works within the internal buffer, so skip in
+     * pieces of what has been buffered.
      */
     size = qemu_get_be32(f);
-    void *buf = g_malloc(size);
-    qemu_get_buffer(f, buf, size);
-    g_free(buf);
+    while (size) {
+        uint8_t *buf;
+        size_t n = qemu_peek_buffer(f, &buf, MIN(size, 4096), 0);
+        if (!n) {
+            return false;
+        }
+        qemu_file_skip(f, n);
+        size -= n;
+    }
 
     return true;
 }
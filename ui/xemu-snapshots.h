@@ -36,9 +36,14 @@ extern "C" {
 
 extern const char **g_snapshot_shortcut_index_key_map[];
 
+typedef struct XemuThumbnailDecode XemuThumbnailDecode;
+
 typedef struct XemuSnapshotData {
     char *disc_path;
     char *xbe_title_name;
+    void *thumbnail_png;
+    size_t thumbnail_png_size;
+    XemuThumbnailDecode *thumbnail_decode;
     GLuint gl_thumbnail;
 } XemuSnapshotData;
 
@@ -54,9 +59,24 @@ void xemu_snapshots_save_extra_data(QEMUFile *f);
 bool xemu_snapshots_offset_extra_data(QEMUFile *f);
 void xemu_snapshots_mark_dirty(void);
 
+// Implemented in xemu-quicksave.c
+bool xemu_quicksave_exists(const char *vm_name);
+void xemu_quicksave_save(const char *vm_name, Error **err);
+bool xemu_quicksave_load(const char *vm_name, Error **err);
+// Without the disk state, which is left as it is
+void xemu_quicksave_save_machine(const char *vm_name, Error **err);
+bool xemu_quicksave_load_machine(const char *vm_name, Error **err);
+void xemu_quicksave_delete(const char *vm_name);
+void xemu_quicksave_invalidate(void);
+void *xemu_quicksave_read_extra_data(const char *vm_name, size_t *size);
+void xemu_rewind_frame(void);
+bool xemu_rewind_step(Error **err);
+
 // Implemented in xemu-thumbnail.cc
 void xemu_snapshots_set_framebuffer_texture(GLuint tex, bool flip);
 bool xemu_snapshots_load_png_to_texture(GLuint tex, void *buf, size_t size);
+GLuint xemu_snapshots_get_thumbnail(XemuSnapshotData *data);
+void xemu_snapshots_free_thumbnail(XemuSnapshotData *data);
 void *xemu_snapshots_create_framebuffer_thumbnail_png(size_t *size);
 
 #ifdef __cplusplus
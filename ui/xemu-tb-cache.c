@@ -0,0 +1,164 @@
+/*
+ * xemu translated code cache
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/fast-hash.h"
+#include "qemu/timer.h"
+#include "accel/tcg/tb-warmup.h"
+#include "xemu-settings.h"
+#include "xemu-tb-cache.h"
+#include "xemu-version.h"
+#include "xemu-xbe.h"
+
+#define TB_CACHE_FILE_MAGIC "XTBCACHE"
+#define TB_CACHE_FILE_VERSION 1
+
+#define POLL_INTERVAL_MS 1000
+
+/* Followed by the records */
+typedef struct TBCacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    char xemu_version[64];
+    uint32_t title_id;
+    uint32_t title_version;
+    uint64_t sections_hash;
+} TBCacheFileHeader;
+
+/* Owned by the UI thread */
+static struct {
+    int64_t last_poll_ms;
+    TBCacheFileHeader header; /* Of the running title */
+    char *path;
+} cache;
+
+static void init_header(struct xbe *xbe, TBCacheFileHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, TB_CACHE_FILE_MAGIC, sizeof(header->magic));
+    header->version = TB_CACHE_FILE_VERSION;
+    header->record_size = sizeof(TBWarmupRecord);
+    g_strlcpy(header->xemu_version, xemu_version,
+              sizeof(header->xemu_version));
+    header->title_id = xbe->cert->m_titleid;
+    header->title_version = xbe->cert->m_version;
+
+    /* Patched executables keep the certificate, but not the digests */
+    uint64_t hash = 0;
+    for (uint32_t i = 0; i < xbe->num_sections; i++) {
+        hash = hash * 31 + fast_hash(xbe->sections[i].m_section_digest,
+                                     sizeof(xbe->sections[i].m_section_digest));
+    }
+    header->sections_hash = hash;
+}
+
+static char *get_cache_path(const TBCacheFileHeader *header)
+{
+    g_autofree char *name =
+        g_strdup_printf("%08x-%08x-%016" PRIx64 ".tbc", header->title_id,
+                        header->title_version, header->sections_hash);
+    return g_build_filename(xemu_settings_get_cache_path(), "tb_cache", name,
+                            NULL);
+}
+
+static void load(void)
+{
+    g_autoptr(GMappedFile) file = g_mapped_file_new(cache.path, false, NULL);
+    if (!file) {
+        tb_warmup_start(NULL, 0);
+        return;
+    }
+
+    size_t length = g_mapped_file_get_length(file);
+    const uint8_t *contents = (const uint8_t *)g_mapped_file_get_contents(file);
+    size_t num_records = 0;
+
+    /* Translations of another version may not have the same flags */
+    if (length >= sizeof(cache.header) &&
+        !memcmp(contents, &cache.header, sizeof(cache.header))) {
+        num_records = (length - sizeof(cache.header)) / sizeof(TBWarmupRecord);
+    }
+
+    tb_warmup_start((const TBWarmupRecord *)(contents + sizeof(cache.header)),
+                    num_records);
+}
+
+void xemu_tb_cache_save(void)
+{
+    if (!cache.path) {
+        return;
+    }
+
+    size_t num_records;
+    g_autofree TBWarmupRecord *records = tb_warmup_stop(&num_records);
+    size_t length = sizeof(cache.header) + num_records * sizeof(*records);
+    g_autofree uint8_t *contents = g_malloc(length);
+    memcpy(contents, &cache.header, sizeof(cache.header));
+    memcpy(contents + sizeof(cache.header), records,
+           num_records * sizeof(*records));
+
+    g_autofree char *dir = g_path_get_dirname(cache.path);
+    g_autoptr(GError) err = NULL;
+    if (g_mkdir_with_parents(dir, 0755) ||
+        !g_file_set_contents(cache.path, (gchar *)contents, length, &err)) {
+        error_report("Failed to write translated code cache %s: %s",
+                     cache.path, err ? err->message : g_strerror(errno));
+    }
+
+    g_free(cache.path);
+    cache.path = NULL;
+}
+
+void xemu_tb_cache_update(void)
+{
+    tb_speculate_set_enabled(g_config.perf.speculative_translation);
+
+    if (!g_config.perf.cache_translations) {
+        return;
+    }
+
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (now - cache.last_poll_ms < POLL_INTERVAL_MS) {
+        return;
+    }
+    cache.last_poll_ms = now;
+
+    struct xbe *xbe = xemu_get_xbe_info();
+    if (!xbe || !xbe->cert) {
+        return;
+    }
+
+    TBCacheFileHeader header;
+    init_header(xbe, &header);
+    if (cache.path && !memcmp(&header, &cache.header, sizeof(header))) {
+        return;
+    }
+
+    xemu_tb_cache_save();
+    cache.header = header;
+    cache.path = get_cache_path(&header);
+    load();
+}
@@ -0,0 +1,53 @@
+/*
+ * xemu translated code cache
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_TB_CACHE_H
+#define XEMU_TB_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * When enabled, the guest code translated while a title runs is listed in
+ * <base path>/tb_cache, in a file named by the title ID, version and the
+ * digests of its sections. The next time the title is launched all of it
+ * is translated again up front, instead of as it is first executed.
+ */
+
+/*
+ * Called by the UI thread once per present with the BQL held, switches the
+ * cache over when another title is launched and applies the speculative
+ * translation setting.
+ */
+void xemu_tb_cache_update(void);
+
+/* Saves the cache of the running title, at exit */
+void xemu_tb_cache_save(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
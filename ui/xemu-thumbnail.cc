@@ -55,6 +55,108 @@ bool xemu_snapshots_load_png_to_texture(GLuint tex, void *buf, size_t size)
     return true;
 }
 
+enum {
+    THUMBNAIL_DECODE_PENDING,
+    THUMBNAIL_DECODE_DONE,
+    THUMBNAIL_DECODE_FAILED,
+};
+
+struct XemuThumbnailDecode {
+    int refs; // held by the snapshot data and the worker
+    int state;
+    void *png;
+    size_t png_size;
+    std::vector<uint8_t> pixels;
+    unsigned int width, height;
+};
+
+static GThreadPool *thumbnail_pool;
+
+static void release_thumbnail_decode(XemuThumbnailDecode *decode)
+{
+    if (g_atomic_int_dec_and_test(&decode->refs)) {
+        g_free(decode->png);
+        delete decode;
+    }
+}
+
+static void decode_thumbnail(gpointer data, gpointer user_data)
+{
+    XemuThumbnailDecode *decode = (XemuThumbnailDecode *)data;
+    unsigned int channels;
+
+    bool ok = fpng::fpng_decode_memory(decode->png, decode->png_size,
+                                       decode->pixels, decode->width,
+                                       decode->height, channels,
+                                       3) == fpng::FPNG_DECODE_SUCCESS;
+    g_atomic_int_set(&decode->state,
+                     ok ? THUMBNAIL_DECODE_DONE : THUMBNAIL_DECODE_FAILED);
+    release_thumbnail_decode(decode);
+}
+
+GLuint xemu_snapshots_get_thumbnail(XemuSnapshotData *data)
+{
+    if (data->gl_thumbnail) {
+        return data->gl_thumbnail;
+    }
+
+    XemuThumbnailDecode *decode = data->thumbnail_decode;
+    if (!decode) {
+        if (!data->thumbnail_png) {
+            return 0;
+        }
+        if (!thumbnail_pool) {
+            thumbnail_pool =
+                g_thread_pool_new(decode_thumbnail, NULL, 2, FALSE, NULL);
+        }
+
+        decode = new XemuThumbnailDecode();
+        decode->refs = 2;
+        decode->state = THUMBNAIL_DECODE_PENDING;
+        decode->png = data->thumbnail_png;
+        decode->png_size = data->thumbnail_png_size;
+        data->thumbnail_png = NULL;
+        data->thumbnail_decode = decode;
+        g_thread_pool_push(thumbnail_pool, decode, NULL);
+        return 0;
+    }
+
+    int state = g_atomic_int_get(&decode->state);
+    if (state == THUMBNAIL_DECODE_PENDING) {
+        return 0;
+    }
+
+    if (state == THUMBNAIL_DECODE_DONE) {
+        glGenTextures(1, &data->gl_thumbnail);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, data->gl_thumbnail);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, decode->width, decode->height,
+                     0, GL_RGB, GL_UNSIGNED_BYTE, decode->pixels.data());
+    }
+
+    data->thumbnail_decode = NULL;
+    release_thumbnail_decode(decode);
+
+    return data->gl_thumbnail;
+}
+
+void xemu_snapshots_free_thumbnail(XemuSnapshotData *data)
+{
+    if (data->gl_thumbnail) {
+        glDeleteTextures(1, &data->gl_thumbnail);
+        data->gl_thumbnail = 0;
+    }
+    if (data->thumbnail_decode) {
+        release_thumbnail_decode(data->thumbnail_decode);
+        data->thumbnail_decode = NULL;
+    }
+    g_free(data->thumbnail_png);
+    data->thumbnail_png = NULL;
+}
+
 void *xemu_snapshots_create_framebuffer_thumbnail_png(size_t *size)
 {
     /*
@@ -0,0 +1,362 @@
+/*
+ * xemu per-title performance profiles
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "hw/xbox/nv2a/nv2a.h"
+#include "xemu-notifications.h"
+#include "xemu-settings.h"
+#include "xemu-title-profiles.h"
+#include "xemu-xbe.h"
+
+#define COMMUNITY_FILE_NAME "title-profiles.ini"
+#define USER_FILE_NAME "title-profiles-user.ini"
+
+#define POLL_INTERVAL_MS 1000
+
+typedef struct TitleProfileSettingInfo {
+    const char *key;
+    const char *const *value_names; /* Of an enum setting */
+    bool *bool_field;
+    int *int_fields[2];             /* Set together */
+    int min, max;
+    void (*apply)(int value);       /* Brings the running machine in line */
+} TitleProfileSettingInfo;
+
+static const char *const async_shaders_names[] = {
+    "disabled", "wait", "skip_draw", NULL,
+};
+
+static void apply_optimistic_zpass_reports(int value)
+{
+    nv2a_set_optimistic_zpass_reports(value);
+}
+
+static void apply_surface_scale(int value)
+{
+    if (nv2a_get_surface_scale_factor() != value) {
+        nv2a_set_surface_scale_factor(value);
+    }
+}
+
+/*
+ * Async shader policies take effect when the renderer is next started, the
+ * other settings right away.
+ */
+static const TitleProfileSettingInfo settings[TITLE_PROFILE__COUNT] = {
+    [TITLE_PROFILE_OPTIMISTIC_ZPASS_REPORTS] = {
+        .key = "optimistic_zpass_reports",
+        .bool_field = &g_config.perf.optimistic_zpass_reports,
+        .apply = apply_optimistic_zpass_reports,
+    },
+    [TITLE_PROFILE_ASYNC_SHADERS] = {
+        .key = "async_shaders",
+        .value_names = async_shaders_names,
+        .int_fields = { &g_config.display.opengl.async_shaders,
+                        &g_config.display.vulkan.async_shaders },
+    },
+    [TITLE_PROFILE_USE_DSP] = {
+        .key = "use_dsp",
+        .bool_field = &g_config.audio.use_dsp,
+    },
+    [TITLE_PROFILE_SURFACE_SCALE] = {
+        .key = "surface_scale",
+        .int_fields = { &g_config.display.quality.surface_scale },
+        .min = 1,
+        .max = 10,
+        .apply = apply_surface_scale,
+    },
+    [TITLE_PROFILE_SURFACE_SCALE_DISPLAY_ONLY] = {
+        .key = "surface_scale_display_only",
+        .bool_field = &g_config.display.quality.surface_scale_display_only,
+    },
+    [TITLE_PROFILE_FAST_DISC_READS] = {
+        .key = "fast_disc_reads",
+        .bool_field = &g_config.perf.fast_disc_reads,
+    },
+};
+
+/* Owned by the UI thread */
+static struct {
+    bool loaded;
+    GKeyFile *community;
+    GKeyFile *user;
+    int64_t last_poll_ms;
+    uint32_t title_id;
+    char *title_name;
+    bool overridden[TITLE_PROFILE__COUNT];
+    int user_values[TITLE_PROFILE__COUNT];
+    int profile_values[TITLE_PROFILE__COUNT];
+} profiles;
+
+static int get_value(const TitleProfileSettingInfo *s)
+{
+    return s->bool_field ? *s->bool_field : *s->int_fields[0];
+}
+
+static void set_value(const TitleProfileSettingInfo *s, int value)
+{
+    if (s->bool_field) {
+        *s->bool_field = value;
+        return;
+    }
+    for (int i = 0; i < ARRAY_SIZE(s->int_fields); i++) {
+        if (s->int_fields[i]) {
+            *s->int_fields[i] = value;
+        }
+    }
+}
+
+static char *get_file_path(const char *name)
+{
+    return g_build_filename(xemu_settings_get_base_path(), name, NULL);
+}
+
+static GKeyFile *load_file(const char *name)
+{
+    g_autofree char *path = get_file_path(name);
+    g_autoptr(GError) err = NULL;
+    GKeyFile *kf = g_key_file_new();
+
+    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, &err) &&
+        !g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        warn_report("failed to load title profiles from %s: %s", path,
+                    err->message);
+    }
+
+    return kf;
+}
+
+static void ensure_loaded(void)
+{
+    if (!profiles.loaded) {
+        profiles.community = load_file(COMMUNITY_FILE_NAME);
+        profiles.user = load_file(USER_FILE_NAME);
+        profiles.loaded = true;
+    }
+}
+
+static bool parse_value(GKeyFile *kf, const char *group,
+                        const TitleProfileSettingInfo *s, int *value)
+{
+    g_autoptr(GError) err = NULL;
+
+    if (!g_key_file_has_key(kf, group, s->key, NULL)) {
+        return false;
+    }
+
+    if (s->value_names) {
+        g_autofree char *str = g_key_file_get_string(kf, group, s->key, NULL);
+        for (int i = 0; s->value_names[i]; i++) {
+            if (!g_strcmp0(str, s->value_names[i])) {
+                *value = i;
+                return true;
+            }
+        }
+        warn_report("title profile %s: unknown %s value '%s'", group, s->key,
+                    str);
+        return false;
+    }
+
+    if (s->bool_field) {
+        *value = g_key_file_get_boolean(kf, group, s->key, &err);
+    } else {
+        *value = g_key_file_get_integer(kf, group, s->key, &err);
+        *value = MAX(s->min, MIN(*value, s->max));
+    }
+    if (err) {
+        warn_report("title profile %s: invalid %s: %s", group, s->key,
+                    err->message);
+        return false;
+    }
+
+    return true;
+}
+
+int xemu_title_profiles_get(uint32_t title_id, TitleProfileSetting setting)
+{
+    g_autofree char *group = g_strdup_printf("%08x", title_id);
+    int value;
+
+    ensure_loaded();
+
+    if (parse_value(profiles.user, group, &settings[setting], &value) ||
+        parse_value(profiles.community, group, &settings[setting], &value)) {
+        return value;
+    }
+
+    return TITLE_PROFILE_UNSET;
+}
+
+static void apply_profile(void)
+{
+    int num_applied = 0;
+
+    for (int i = 0; i < TITLE_PROFILE__COUNT; i++) {
+        const TitleProfileSettingInfo *s = &settings[i];
+        int value = xemu_title_profiles_get(profiles.title_id, i);
+        if (value == TITLE_PROFILE_UNSET) {
+            continue;
+        }
+
+        profiles.user_values[i] = get_value(s);
+        profiles.profile_values[i] = value;
+        profiles.overridden[i] = true;
+        set_value(s, value);
+        if (s->apply) {
+            s->apply(value);
+        }
+        num_applied++;
+    }
+
+    if (num_applied) {
+        g_autofree char *msg = g_strdup_printf(
+            "Applied title profile for %s", profiles.title_name);
+        xemu_queue_notification(msg);
+    }
+}
+
+static void restore_user_settings(void)
+{
+    for (int i = 0; i < TITLE_PROFILE__COUNT; i++) {
+        const TitleProfileSettingInfo *s = &settings[i];
+        if (!profiles.overridden[i]) {
+            continue;
+        }
+        profiles.overridden[i] = false;
+
+        /* Unless the user changed it since */
+        if (get_value(s) == profiles.profile_values[i]) {
+            set_value(s, profiles.user_values[i]);
+            if (s->apply) {
+                s->apply(profiles.user_values[i]);
+            }
+        }
+    }
+}
+
+void xemu_title_profiles_update(void)
+{
+    if (!g_config.perf.title_profiles) {
+        if (profiles.title_id) {
+            restore_user_settings();
+            profiles.title_id = 0;
+        }
+        return;
+    }
+
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (now - profiles.last_poll_ms < POLL_INTERVAL_MS) {
+        return;
+    }
+    profiles.last_poll_ms = now;
+
+    struct xbe *xbe = xemu_get_xbe_info();
+    if (!xbe || !xbe->cert || xbe->cert->m_titleid == profiles.title_id) {
+        return;
+    }
+
+    restore_user_settings();
+    profiles.title_id = xbe->cert->m_titleid;
+    g_free(profiles.title_name);
+    profiles.title_name =
+        g_utf16_to_utf8(xbe->cert->m_title_name, 40, NULL, NULL, NULL);
+    if (!profiles.title_name) {
+        profiles.title_name = g_strdup_printf("%08x", profiles.title_id);
+    }
+    apply_profile();
+}
+
+uint32_t xemu_title_profiles_get_title_id(void)
+{
+    return profiles.title_id;
+}
+
+const char *xemu_title_profiles_get_title_name(void)
+{
+    return profiles.title_name;
+}
+
+void xemu_title_profiles_set(uint32_t title_id, TitleProfileSetting setting,
+                             int value)
+{
+    const TitleProfileSettingInfo *s = &settings[setting];
+    g_autofree char *group = g_strdup_printf("%08x", title_id);
+
+    ensure_loaded();
+
+    if (value == TITLE_PROFILE_UNSET) {
+        g_key_file_remove_key(profiles.user, group, s->key, NULL);
+    } else if (s->value_names) {
+        g_key_file_set_string(profiles.user, group, s->key,
+                              s->value_names[value]);
+    } else if (s->bool_field) {
+        g_key_file_set_boolean(profiles.user, group, s->key, value);
+    } else {
+        g_key_file_set_integer(profiles.user, group, s->key, value);
+    }
+    if (title_id == profiles.title_id && profiles.title_name) {
+        g_key_file_set_string(profiles.user, group, "name",
+                              profiles.title_name);
+    }
+
+    g_autofree char *path = get_file_path(USER_FILE_NAME);
+    g_autoptr(GError) err = NULL;
+    if (!g_key_file_save_to_file(profiles.user, path, &err)) {
+        error_report("failed to save title profiles to %s: %s", path,
+                     err->message);
+    }
+
+    if (title_id == profiles.title_id && g_config.perf.title_profiles) {
+        restore_user_settings();
+        apply_profile();
+    }
+}
+
+void xemu_title_profiles_suspend(void)
+{
+    for (int i = 0; i < TITLE_PROFILE__COUNT; i++) {
+        const TitleProfileSettingInfo *s = &settings[i];
+        if (!profiles.overridden[i]) {
+            continue;
+        }
+
+        if (get_value(s) == profiles.profile_values[i]) {
+            set_value(s, profiles.user_values[i]);
+        } else {
+            /* Changed by the user, whose choice it now is */
+            profiles.overridden[i] = false;
+        }
+    }
+}
+
+void xemu_title_profiles_resume(void)
+{
+    for (int i = 0; i < TITLE_PROFILE__COUNT; i++) {
+        if (profiles.overridden[i]) {
+            set_value(&settings[i], profiles.profile_values[i]);
+        }
+    }
+}
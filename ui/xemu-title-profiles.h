@@ -0,0 +1,97 @@
+/*
+ * xemu per-title performance profiles
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef XEMU_TITLE_PROFILES_H
+#define XEMU_TITLE_PROFILES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Profiles set some settings for the title they are for while it runs,
+ * looked up by the title ID in the XBE certificate. They are read from
+ * <base path>/title-profiles.ini, a file maintained by the community, and
+ * from <base path>/title-profiles-user.ini, which holds the changes made in
+ * the UI and takes precedence. Each title is a group named by its ID:
+ *
+ *   [4d530004]
+ *   name=Halo
+ *   optimistic_zpass_reports=true
+ *   async_shaders=wait
+ *
+ * The settings overridden are restored when another title is launched, and
+ * are not written to the config file.
+ */
+
+typedef enum TitleProfileSetting {
+    TITLE_PROFILE_OPTIMISTIC_ZPASS_REPORTS,
+    TITLE_PROFILE_ASYNC_SHADERS,
+    TITLE_PROFILE_USE_DSP,
+    TITLE_PROFILE_SURFACE_SCALE,
+    TITLE_PROFILE_SURFACE_SCALE_DISPLAY_ONLY,
+    TITLE_PROFILE_FAST_DISC_READS,
+    TITLE_PROFILE__COUNT,
+} TitleProfileSetting;
+
+/* Value of a setting a profile leaves alone */
+#define TITLE_PROFILE_UNSET (-1)
+
+/*
+ * Called by the UI thread once per present with the BQL held, applies the
+ * profile of a title when it is launched.
+ */
+void xemu_title_profiles_update(void);
+
+/* The running title, 0 if none was detected yet */
+uint32_t xemu_title_profiles_get_title_id(void);
+const char *xemu_title_profiles_get_title_name(void);
+
+/*
+ * Value of a setting in the profile of a title (booleans are 0 or 1, async
+ * shaders the index of the policy), or TITLE_PROFILE_UNSET.
+ */
+int xemu_title_profiles_get(uint32_t title_id, TitleProfileSetting setting);
+
+/*
+ * Changes a setting in the user profile of a title and saves it, applying
+ * it right away if the title is running. TITLE_PROFILE_UNSET goes back to
+ * the community profile, if any.
+ */
+void xemu_title_profiles_set(uint32_t title_id, TitleProfileSetting setting,
+                             int value);
+
+/*
+ * Put back and take over again the settings of the user while the config
+ * is being saved. Changes the user made to an overridden setting while the
+ * title runs are kept.
+ */
+void xemu_title_profiles_suspend(void);
+void xemu_title_profiles_resume(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
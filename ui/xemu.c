@@ -32,6 +32,8 @@
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
 #include "qemu/rcu.h"
+#include "qemu/thread-stats.h"
+#include "qemu/timeline.h"
 #include "qemu-version.h"
 #include "qemu-main.h"
 #include "qapi/error.h"
@@ -47,7 +49,14 @@
 #include "xemu-input.h"
 #include "xemu-settings.h"
 // #include "xemu-shaders.h"
+#include "xemu-benchmark.h"
+#include "xemu-disc.h"
+#include "xemu-frame-stats.h"
+#include "xemu-pacing.h"
+#include "xemu-headless.h"
 #include "xemu-snapshots.h"
+#include "xemu-tb-cache.h"
+#include "xemu-title-profiles.h"
 #include "xemu-version.h"
 #include "xemu-os-utils.h"
 
@@ -836,7 +845,6 @@ static void sdl2_display_early_init(DisplayOptions *o)
     display_opengl = 1;
 
     SDL_GL_MakeCurrent(m_window, m_context);
-    SDL_GL_SetSwapInterval(g_config.display.window.vsync ? 1 : 0);
     xemu_hud_init(m_window, m_context);
     // blit = create_decal_shader(SHADER_TYPE_BLIT_GAMMA);
 }
@@ -969,6 +977,22 @@ void xb_surface_gl_create_texture(DisplaySurface *surface)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 }
 
+void xb_surface_gl_update_texture(DisplaySurface *surface,
+                                  int x, int y, int w, int h)
+{
+    uint8_t *data = (void *)surface_data(surface);
+
+    assert(surface->texture);
+    glBindTexture(GL_TEXTURE_2D, surface->texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
+                  surface_stride(surface) / surface_bytes_per_pixel(surface));
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h,
+                    surface->glformat, surface->gltype,
+                    data + surface_stride(surface) * y
+                    + surface_bytes_per_pixel(surface) * x);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+}
+
 void xb_surface_gl_destroy_texture(DisplaySurface *surface)
 {
     if (!surface || !surface->texture) {
@@ -978,6 +1002,15 @@ void xb_surface_gl_destroy_texture(DisplaySurface *surface)
     surface->texture = 0;
 }
 
+/*
+ * Scanlines of the VGA surface which changed since its texture was last
+ * updated, as reported from the VGA dirty log. Only these are uploaded, and
+ * nothing at all while the display is static.
+ */
+static struct {
+    int y1, y2;
+} vga_dirty;
+
 void sdl2_gl_update(DisplayChangeListener *dcl,
                     int x, int y, int w, int h)
 {
@@ -985,6 +1018,34 @@ void sdl2_gl_update(DisplayChangeListener *dcl,
     assert(scon->opengl);
 
     SDL_GL_MakeCurrent(scon->real_window, scon->winctx);
+
+    if (vga_dirty.y1 >= vga_dirty.y2) {
+        vga_dirty.y1 = y;
+        vga_dirty.y2 = y + h;
+    } else {
+        vga_dirty.y1 = MIN(vga_dirty.y1, y);
+        vga_dirty.y2 = MAX(vga_dirty.y2, y + h);
+    }
+}
+
+static void update_vga_texture(struct sdl2_console *scon)
+{
+    DisplaySurface *surface = scon->surface;
+
+    if (!surface->texture) {
+        xb_surface_gl_create_texture(surface);
+        scon->updates++;
+    } else if (vga_dirty.y1 < vga_dirty.y2) {
+        int y1 = MAX(vga_dirty.y1, 0);
+        int y2 = MIN(vga_dirty.y2, surface_height(surface));
+        if (y1 < y2) {
+            xb_surface_gl_update_texture(surface, 0, y1,
+                                         surface_width(surface), y2 - y1);
+            scon->updates++;
+        }
+    }
+
+    vga_dirty.y1 = vga_dirty.y2 = 0;
 }
 
 void sdl2_gl_switch(DisplayChangeListener *dcl,
@@ -1021,13 +1082,42 @@ static void update_fps(void)
     fps = 1000.0/avg;
 }
 
-void sdl2_gl_refresh(DisplayChangeListener *dcl)
+/*
+ * With variable refresh, present once per guest frame so the display refreshes
+ * in step with the guest instead of repeating frames at its own rate. The UI,
+ * and output which does not go through guest flips, is still presented at a
+ * lower rate when nothing else is.
+ */
+#define VARIABLE_REFRESH_MAX_INTERVAL_NS 50000000
+
+static bool should_present(void)
+{
+    static unsigned int last_flip_count;
+    static int64_t last_present;
+
+    if (g_config.display.window.present_mode !=
+        CONFIG_DISPLAY_WINDOW_PRESENT_MODE_VARIABLE) {
+        return true;
+    }
+
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    unsigned int flip_count = nv2a_get_flip_count();
+    if (flip_count == last_flip_count && vga_dirty.y1 >= vga_dirty.y2 &&
+        !xemu_hud_needs_render() &&
+        now - last_present < VARIABLE_REFRESH_MAX_INTERVAL_NS) {
+        return false;
+    }
+
+    last_flip_count = flip_count;
+    last_present = now;
+    return true;
+}
+
+static void sdl2_gl_present(struct sdl2_console *scon)
 {
-    struct sdl2_console *scon = container_of(dcl, struct sdl2_console, dcl);
-    assert(scon->opengl);
     bool flip_required = false;
+    int64_t zone_start = timeline_begin();
 
-    SDL_GL_MakeCurrent(scon->real_window, scon->winctx);
     update_fps();
 
     /* XXX: Note that this bypasses the usual VGA path in order to quickly
@@ -1042,9 +1132,7 @@ void sdl2_gl_refresh(DisplayChangeListener *dcl)
      */
     GLuint tex = nv2a_get_framebuffer_surface();
     if (tex == 0) {
-        // FIXME: Don't upload if notdirty
-        xb_surface_gl_create_texture(scon->surface);
-        scon->updates++;
+        update_vga_texture(scon);
         tex = scon->surface->texture;
         flip_required = true;
     }
@@ -1062,7 +1150,16 @@ void sdl2_gl_refresh(DisplayChangeListener *dcl)
     glClear(GL_COLOR_BUFFER_BIT);
     xemu_snapshots_set_framebuffer_texture(tex, flip_required);
     xemu_hud_set_framebuffer_texture(tex, flip_required);
-    xemu_hud_render();
+    if (xemu_headless_enabled()) {
+        xemu_headless_frame(tex, flip_required);
+    } else {
+        xemu_hud_render();
+    }
+    xemu_rewind_frame();
+    xemu_frame_stats_update();
+    xemu_tb_cache_update();
+    xemu_title_profiles_update();
+    xemu_benchmark_frame();
 
     // Release BQL before swapping (which may sleep if swap interval is not immediate)
     bql_unlock();
@@ -1070,12 +1167,45 @@ void sdl2_gl_refresh(DisplayChangeListener *dcl)
 
     glFinish();
     nv2a_release_framebuffer_surface();
+    xemu_pacing_swap_begin();
+    int64_t swap_start = timeline_begin();
     SDL_GL_SwapWindow(scon->real_window);
+    timeline_end("swap", NULL, swap_start);
+    xemu_pacing_swapped(g_config.display.window.present_mode ==
+                            CONFIG_DISPLAY_WINDOW_PRESENT_MODE_FIFO ||
+                        g_config.display.window.present_mode ==
+                            CONFIG_DISPLAY_WINDOW_PRESENT_MODE_FIFO_RELAXED);
+    timeline_end("present", NULL, zone_start);
+}
+
+void sdl2_gl_refresh(DisplayChangeListener *dcl)
+{
+    struct sdl2_console *scon = container_of(dcl, struct sdl2_console, dcl);
+    assert(scon->opengl);
+
+    SDL_GL_MakeCurrent(scon->real_window, scon->winctx);
+    xemu_pacing_refresh_begin();
+
+    if (should_present()) {
+        sdl2_gl_present(scon);
+    } else {
+        qemu_mutex_lock_main_loop();
+        bql_lock();
+        sdl2_poll_events(scon);
+        bql_unlock();
+        qemu_mutex_unlock_main_loop();
+    }
 
     /* VGA update (see note above) + vblank */
     qemu_mutex_lock_main_loop();
     bql_lock();
+    if (g_config.display.window.low_latency_input) {
+        /* The guest may read input as soon as its next frame starts */
+        SDL_PumpEvents();
+        xemu_input_update_controllers();
+    }
     graphic_hw_update(scon->dcl.con);
+    xemu_pacing_vblank();
     if (scon->updates && scon->surface) {
         scon->updates = 0;
     }
@@ -1083,10 +1213,10 @@ void sdl2_gl_refresh(DisplayChangeListener *dcl)
     qemu_mutex_unlock_main_loop();
 
     /*
-     * Throttle to make sure swaps happen at 60Hz
+     * Throttle to make sure swaps, and with them guest vblanks, happen at
+     * 60Hz, in step with the display when possible.
      */
-    static int64_t last_update = 0;
-    int64_t deadline = last_update + 16666666;
+    int64_t deadline = xemu_pacing_next_vblank_deadline();
 
 #ifdef DEBUG_XEMU_C
     int64_t sleep_acc = 0;
@@ -1119,7 +1249,6 @@ void sdl2_gl_refresh(DisplayChangeListener *dcl)
             }
         } else {
             DPRINTF("zzZz %g %ld\n", (double)sleep_acc/1000000.0, spin_acc);
-            last_update = now;
             break;
         }
     }
@@ -1318,6 +1447,8 @@ int main(int argc, char **argv)
     QemuThread thread;
 
     setlocale(LC_NUMERIC, "C");
+    timeline_set_thread_name("xemu_ui");
+    thread_stats_register_self("xemu_ui");
 
 #ifdef _WIN32
     if (AttachConsole(ATTACH_PARENT_PROCESS)) {
@@ -1351,6 +1482,33 @@ int main(int argc, char **argv)
     gArgc = argc;
     gArgv = argv;
 
+    for (int i = 1; i < argc - 1; i++) {
+        if (!argv[i]) {
+            continue;
+        }
+        if (strcmp(argv[i], "-headless") == 0) {
+            xemu_headless_init(argv[i+1]);
+        } else if (strcmp(argv[i], "-headless_dump_interval") == 0) {
+            xemu_headless_set_dump_interval(atoi(argv[i+1]));
+        } else if (strcmp(argv[i], "-headless_frames") == 0) {
+            xemu_headless_set_max_frames(atoi(argv[i+1]));
+        } else if (strcmp(argv[i], "-benchmark") == 0) {
+            xemu_benchmark_init(argv[i+1]);
+        } else if (strcmp(argv[i], "-benchmark_frames") == 0) {
+            xemu_benchmark_set_frames(atoi(argv[i+1]));
+        } else if (strcmp(argv[i], "-benchmark_snapshot") == 0) {
+            xemu_benchmark_set_snapshot(argv[i+1]);
+        } else if (strcmp(argv[i], "-benchmark_input") == 0) {
+            xemu_benchmark_set_input_path(argv[i+1]);
+        } else if (strcmp(argv[i], "-benchmark_record") == 0) {
+            xemu_benchmark_set_record_path(argv[i+1]);
+        } else {
+            continue;
+        }
+        argv[i] = argv[i+1] = NULL;
+        i++;
+    }
+
     for (int i = 1; i < argc; i++) {
         if (argv[i] && strcmp(argv[i], "-config_path") == 0) {
             argv[i] = NULL;
@@ -1372,6 +1530,8 @@ int main(int argc, char **argv)
         exit(1);
     }
     atexit(xemu_settings_save);
+    atexit(xemu_frame_stats_auto_export);
+    atexit(xemu_tb_cache_save);
 
 #ifdef _WIN32
     if (g_config.display.setup_nvidia_profile) {
@@ -1442,8 +1602,10 @@ void xemu_load_disc(const char *path, Error **errp)
     xbox_smc_eject_button();
     xemu_settings_set_string(&g_config.sys.files.dvd_path, "");
 
-    qmp_blockdev_change_medium("ide0-cd1", NULL, path, "raw", false, false,
-                               false, 0, &error);
+    const char *format;
+    g_autofree char *filename = xemu_disc_get_filename(path, &format);
+    qmp_blockdev_change_medium("ide0-cd1", NULL, filename, format,
+                               false, false, false, 0, &error);
     if (error) {
         error_propagate(errp, error);
     } else {
@@ -22,7 +22,9 @@
 #include "xemu-hud.h"
 #include "../xemu-snapshots.h"
 #include "../xemu-notifications.h"
+#include "../xemu-capture.h"
 #include "snapshot-manager.hh"
+#include "hw/xbox/xbox_sampler.h"
 
 void ActionEjectDisc(void)
 {
@@ -37,7 +39,8 @@ void ActionEjectDisc(void)
 void ActionLoadDisc(void)
 {
     const char *iso_file_filters =
-        "Disc Image Files (*.iso, *.xiso)\0*.iso;*.xiso\0All Files\0*.*\0";
+        "Disc Image Files (*.iso, *.xiso, *.qcow2)\0*.iso;*.xiso;*.qcow2\0"
+        "All Files\0*.*\0";
     const char *new_disc_path =
         PausedFileOpen(NOC_FILE_DIALOG_OPEN, iso_file_filters,
                        g_config.sys.files.dvd_path, NULL);
@@ -84,6 +87,133 @@ void ActionScreenshot(void)
 	g_screenshot_pending = true;
 }
 
+void ActionToggleRecording(void)
+{
+    if (xemu_capture_is_active()) {
+        xemu_capture_stop();
+        return;
+    }
+
+    Error *err = NULL;
+    if (xemu_capture_start(&err)) {
+        xemu_queue_notification("Recording started");
+    } else {
+        xemu_queue_error_message(error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void ActionToggleCommandCapture(void)
+{
+    if (nv2a_dbg_capture_active()) {
+        nv2a_dbg_capture_stop();
+        xemu_queue_notification("NV2A capture will stop at end of frame");
+        return;
+    }
+
+    char fname[128];
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S.nv2acap", tmp);
+    } else {
+        strcpy(fname, "xemu.nv2acap");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
+    }
+    char *path = g_strdup_printf("%s/%s", output_dir, fname);
+
+    Error *err = NULL;
+    nv2a_dbg_capture_start(path, &err);
+    if (err) {
+        xemu_queue_error_message(error_get_pretty(err));
+        error_free(err);
+    } else {
+        char *msg = g_strdup_printf("Capturing NV2A commands to %s", fname);
+        xemu_queue_notification(msg);
+        g_free(msg);
+    }
+    g_free(path);
+}
+
+void ActionToggleTimeline(void)
+{
+    if (!timeline_is_active()) {
+        timeline_start();
+        xemu_queue_notification("Recording timeline");
+        return;
+    }
+
+    char fname[128];
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S-timeline.json",
+                 tmp);
+    } else {
+        strcpy(fname, "xemu-timeline.json");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
+    }
+    char *path = g_strdup_printf("%s/%s", output_dir, fname);
+
+    Error *err = NULL;
+    if (timeline_stop(path, &err)) {
+        char *msg = g_strdup_printf("Timeline saved to %s", path);
+        xemu_queue_notification(msg);
+        g_free(msg);
+    } else {
+        xemu_queue_error_message(error_get_pretty(err));
+        error_free(err);
+    }
+    g_free(path);
+}
+
+void ActionToggleProfiler(void)
+{
+    if (!xbox_sampler_is_running()) {
+        xbox_sampler_reset();
+        xbox_sampler_start();
+        xemu_queue_notification("Recording profile");
+        return;
+    }
+
+    xbox_sampler_stop();
+
+    char fname[128];
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S-profile.pb",
+                 tmp);
+    } else {
+        strcpy(fname, "xemu-profile.pb");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
+    }
+    char *path = g_strdup_printf("%s/%s", output_dir, fname);
+
+    Error *err = NULL;
+    if (xbox_sampler_export_pprof(path, &err)) {
+        char *msg = g_strdup_printf("Profile saved to %s", path);
+        xemu_queue_notification(msg);
+        g_free(msg);
+    } else {
+        xemu_queue_error_message(error_get_pretty(err));
+        error_free(err);
+    }
+    g_free(path);
+}
+
 void ActionActivateBoundSnapshot(int slot, bool save)
 {
     assert(slot < 4 && slot >= 0);
@@ -108,6 +238,15 @@ void ActionActivateBoundSnapshot(int slot, bool save)
     }
 }
 
+void ActionRewind()
+{
+    Error *err = NULL;
+    if (!xemu_rewind_step(&err)) {
+        xemu_queue_notification(error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void ActionLoadSnapshotChecked(const char *name)
 {
     g_snapshot_mgr.LoadSnapshotChecked(name);
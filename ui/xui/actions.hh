@@ -25,5 +25,10 @@ void ActionTogglePause();
 void ActionReset();
 void ActionShutdown();
 void ActionScreenshot();
+void ActionToggleRecording();
+void ActionToggleCommandCapture();
+void ActionToggleTimeline();
+void ActionToggleProfiler();
 void ActionActivateBoundSnapshot(int slot, bool save);
 void ActionLoadSnapshotChecked(const char *name);
+void ActionRewind();
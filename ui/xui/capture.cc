@@ -0,0 +1,441 @@
+//
+// xemu User Interface
+//
+// Copyright (C) 2025 Matt Borgerson
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <atomic>
+#include "common.hh"
+#include "capture.hh"
+#include "gl-helpers.hh"
+#include "../xemu-capture.h"
+#include "../xemu-notifications.h"
+
+extern "C" {
+#include "qemu/thread.h"
+}
+
+// Frames are read back this many frames after they were rendered, by which
+// time the GPU is done with them and mapping the buffer does not stall
+#define NUM_READBACK_BUFFERS 3
+
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_CHANNELS 2
+#define WAV_HEADER_SIZE 44
+
+enum CaptureStream {
+    CAPTURE_STREAM_VIDEO,
+    CAPTURE_STREAM_AUDIO,
+};
+
+struct CaptureChunk {
+    CaptureStream stream;
+    size_t len;
+    uint8_t data[];
+};
+
+static struct {
+    std::atomic<bool> active;
+
+    // Writer thread, fed with CaptureChunks
+    QemuThread writer;
+    GAsyncQueue *queue;
+    FILE *video_file;
+    FILE *audio_file;
+    char *video_path;
+
+    // Serializes audio from the APU thread against stopping
+    QemuMutex audio_lock;
+    bool audio_lock_initialized;
+    uint32_t audio_bytes;
+
+    // GL state, only touched on the UI thread
+    int width, height;
+    Fbo *rgb_fbo;
+    Fbo *yuv_fbo;
+    GLuint prog, vao;
+    GLint tex_loc, size_loc;
+    GLuint pbo[NUM_READBACK_BUFFERS];
+    GLsync fence[NUM_READBACK_BUFFERS];
+    unsigned int frame;
+} capture;
+
+static CaptureChunk capture_stop_chunk;
+
+static const char *yuv_vert_src = R"(
+#version 150 core
+void main()
+{
+    vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Packs the frame into I420, 4 bytes of the Y, U and V planes per texel, so
+// that reading back the texture yields the planes in file order. Uses BT.601
+// limited range coefficients, chroma is the average of each 2x2 block.
+static const char *yuv_frag_src = R"(
+#version 150 core
+uniform sampler2D tex;
+uniform ivec2 size;
+out vec4 out_Color;
+
+vec3 rgb_at(ivec2 pos)
+{
+    return texelFetch(tex, pos, 0).rgb;
+}
+
+float plane_byte(int i)
+{
+    int luma_size = size.x * size.y;
+    if (i < luma_size) {
+        vec3 c = rgb_at(ivec2(i % size.x, i / size.x));
+        return (16.0 + dot(c, vec3(65.481, 128.553, 24.966))) / 255.0;
+    }
+
+    i -= luma_size;
+    int chroma_width = size.x / 2;
+    int chroma_size = chroma_width * (size.y / 2);
+    bool is_v = i >= chroma_size;
+    if (is_v) {
+        i -= chroma_size;
+    }
+
+    ivec2 pos = 2 * ivec2(i % chroma_width, i / chroma_width);
+    vec3 c = (rgb_at(pos) + rgb_at(pos + ivec2(1, 0)) +
+              rgb_at(pos + ivec2(0, 1)) + rgb_at(pos + ivec2(1, 1))) / 4.0;
+    float v = is_v ? dot(c, vec3(112.0, -93.786, -18.214)) :
+                     dot(c, vec3(-37.797, -74.203, 112.0));
+    return (128.0 + v) / 255.0;
+}
+
+void main()
+{
+    ivec2 t = ivec2(gl_FragCoord.xy);
+    int i = (t.y * size.x / 4 + t.x) * 4;
+    out_Color = vec4(plane_byte(i), plane_byte(i + 1), plane_byte(i + 2),
+                     plane_byte(i + 3));
+}
+)";
+
+static CaptureChunk *NewChunk(CaptureStream stream, size_t len)
+{
+    CaptureChunk *chunk = (CaptureChunk *)g_malloc(sizeof(CaptureChunk) + len);
+    chunk->stream = stream;
+    chunk->len = len;
+    return chunk;
+}
+
+static void *WriterThread(void *opaque)
+{
+    while (true) {
+        CaptureChunk *chunk = (CaptureChunk *)g_async_queue_pop(capture.queue);
+        if (chunk == &capture_stop_chunk) {
+            break;
+        }
+        FILE *f = chunk->stream == CAPTURE_STREAM_VIDEO ? capture.video_file :
+                                                          capture.audio_file;
+        if (fwrite(chunk->data, chunk->len, 1, f) != 1) {
+            fprintf(stderr, "Failed to write recording\n");
+        }
+        g_free(chunk);
+    }
+    return NULL;
+}
+
+static void WriteLe32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void WriteWavHeader(FILE *f, uint32_t data_bytes)
+{
+    const uint32_t block_align = AUDIO_CHANNELS * sizeof(int16_t);
+    uint8_t hdr[WAV_HEADER_SIZE] = {
+        'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+        'f', 'm', 't', ' ', 16, 0, 0, 0,
+        1, 0, AUDIO_CHANNELS, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        block_align, 0, 16, 0,
+        'd', 'a', 't', 'a', 0, 0, 0, 0,
+    };
+    WriteLe32(&hdr[4], WAV_HEADER_SIZE - 8 + data_bytes);
+    WriteLe32(&hdr[24], AUDIO_SAMPLE_RATE);
+    WriteLe32(&hdr[28], AUDIO_SAMPLE_RATE * block_align);
+    WriteLe32(&hdr[40], data_bytes);
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(hdr, sizeof(hdr), 1, f);
+}
+
+static void InitVideo(GLuint tex)
+{
+    int tw, th;
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tw);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &th);
+
+    // The frame size is fixed for the whole recording, later frames of a
+    // different size are scaled to it
+    capture.height = ROUND_UP(th, 2);
+    capture.width = ROUND_UP((int)(th * GetDisplayAspectRatio(tw, th)), 8);
+    capture.rgb_fbo = new Fbo(capture.width, capture.height);
+    capture.yuv_fbo = new Fbo(capture.width / 4, capture.height * 3 / 2);
+
+    GLuint vert = Shader(GL_VERTEX_SHADER, yuv_vert_src);
+    GLuint frag = Shader(GL_FRAGMENT_SHADER, yuv_frag_src);
+    capture.prog = glCreateProgram();
+    glAttachShader(capture.prog, vert);
+    glAttachShader(capture.prog, frag);
+    glBindFragDataLocation(capture.prog, 0, "out_Color");
+    glLinkProgram(capture.prog);
+    glDeleteShader(vert);
+    glDeleteShader(frag);
+    capture.tex_loc = glGetUniformLocation(capture.prog, "tex");
+    capture.size_loc = glGetUniformLocation(capture.prog, "size");
+    glGenVertexArrays(1, &capture.vao);
+
+    size_t frame_size = capture.width * capture.height * 3 / 2;
+    glGenBuffers(NUM_READBACK_BUFFERS, capture.pbo);
+    for (int i = 0; i < NUM_READBACK_BUFFERS; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    char *header = g_strdup_printf("YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg "
+                                   "XCOLORRANGE=LIMITED\n",
+                                   capture.width, capture.height);
+    size_t len = strlen(header);
+    CaptureChunk *chunk = NewChunk(CAPTURE_STREAM_VIDEO, len);
+    memcpy(chunk->data, header, len);
+    g_free(header);
+    g_async_queue_push(capture.queue, chunk);
+}
+
+static void FinalizeVideo(void)
+{
+    if (capture.rgb_fbo == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < NUM_READBACK_BUFFERS; i++) {
+        if (capture.fence[i]) {
+            glDeleteSync(capture.fence[i]);
+            capture.fence[i] = 0;
+        }
+    }
+    glDeleteBuffers(NUM_READBACK_BUFFERS, capture.pbo);
+    glDeleteVertexArrays(1, &capture.vao);
+    glDeleteProgram(capture.prog);
+    delete capture.rgb_fbo;
+    delete capture.yuv_fbo;
+    capture.rgb_fbo = NULL;
+    capture.yuv_fbo = NULL;
+}
+
+// Moves a finished readback to the writer thread
+static void CollectFrame(int index)
+{
+    glClientWaitSync(capture.fence[index], GL_SYNC_FLUSH_COMMANDS_BIT,
+                     1000000000);
+    glDeleteSync(capture.fence[index]);
+    capture.fence[index] = 0;
+
+    static const char frame_tag[] = "FRAME\n";
+    size_t frame_size = capture.width * capture.height * 3 / 2;
+    CaptureChunk *chunk = NewChunk(CAPTURE_STREAM_VIDEO,
+                                   sizeof(frame_tag) - 1 + frame_size);
+    memcpy(chunk->data, frame_tag, sizeof(frame_tag) - 1);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[index]);
+    void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_size,
+                                    GL_MAP_READ_BIT);
+    if (pixels) {
+        memcpy(chunk->data + sizeof(frame_tag) - 1, pixels, frame_size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        memset(chunk->data + sizeof(frame_tag) - 1, 0, frame_size);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    g_async_queue_push(capture.queue, chunk);
+}
+
+void CaptureVideoFrame(GLuint tex, bool flip)
+{
+    if (!capture.active) {
+        return;
+    }
+
+    if (capture.rgb_fbo == NULL) {
+        InitVideo(tex);
+    }
+
+    int index = capture.frame % NUM_READBACK_BUFFERS;
+    if (capture.fence[index]) {
+        CollectFrame(index);
+    }
+
+    // Fbo::Target() enables blending, Fbo::Restore() puts it back
+    capture.rgb_fbo->Target();
+    glDisable(GL_BLEND);
+    float scale[2] = {1.0, 1.0};
+    RenderFramebuffer(tex, capture.width, capture.height, !flip, scale);
+    glEnable(GL_BLEND);
+    capture.rgb_fbo->Restore();
+
+    capture.yuv_fbo->Target();
+    glDisable(GL_BLEND);
+    glUseProgram(capture.prog);
+    glBindVertexArray(capture.vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, capture.rgb_fbo->Texture());
+    glUniform1i(capture.tex_loc, 0);
+    glUniform2i(capture.size_loc, capture.width, capture.height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[index]);
+    glReadPixels(0, 0, capture.width / 4, capture.height * 3 / 2, GL_RGBA,
+                 GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture.fence[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glEnable(GL_BLEND);
+    capture.yuv_fbo->Restore();
+
+    capture.frame++;
+}
+
+bool xemu_capture_start(Error **errp)
+{
+    if (capture.active) {
+        return true;
+    }
+
+    char fname[128];
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S", tmp);
+    } else {
+        strcpy(fname, "xemu");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
+    }
+
+    char *video_path = g_strdup_printf("%s/%s.y4m", output_dir, fname);
+    char *audio_path = g_strdup_printf("%s/%s.wav", output_dir, fname);
+    FILE *video_file = qemu_fopen(video_path, "wb");
+    FILE *audio_file = qemu_fopen(audio_path, "wb");
+    if (!video_file || !audio_file) {
+        error_setg(errp, "Failed to open %s for writing",
+                   video_file ? audio_path : video_path);
+        if (video_file) fclose(video_file);
+        if (audio_file) fclose(audio_file);
+        g_free(video_path);
+        g_free(audio_path);
+        return false;
+    }
+    g_free(audio_path);
+
+    WriteWavHeader(audio_file, 0);
+
+    if (!capture.audio_lock_initialized) {
+        qemu_mutex_init(&capture.audio_lock);
+        capture.audio_lock_initialized = true;
+    }
+
+    capture.video_file = video_file;
+    capture.audio_file = audio_file;
+    capture.video_path = video_path;
+    capture.audio_bytes = 0;
+    capture.frame = 0;
+    capture.queue = g_async_queue_new();
+    qemu_thread_create(&capture.writer, "xemu_capture", WriterThread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    capture.active = true;
+
+    return true;
+}
+
+void xemu_capture_stop(void)
+{
+    if (!capture.active) {
+        return;
+    }
+
+    if (capture.rgb_fbo) {
+        for (int i = 0; i < NUM_READBACK_BUFFERS; i++) {
+            int index = (capture.frame + i) % NUM_READBACK_BUFFERS;
+            if (capture.fence[index]) {
+                CollectFrame(index);
+            }
+        }
+    }
+
+    qemu_mutex_lock(&capture.audio_lock);
+    capture.active = false;
+    qemu_mutex_unlock(&capture.audio_lock);
+
+    g_async_queue_push(capture.queue, &capture_stop_chunk);
+    qemu_thread_join(&capture.writer);
+    g_async_queue_unref(capture.queue);
+    capture.queue = NULL;
+
+    FinalizeVideo();
+
+    WriteWavHeader(capture.audio_file, capture.audio_bytes);
+    fclose(capture.audio_file);
+    fclose(capture.video_file);
+    capture.audio_file = NULL;
+    capture.video_file = NULL;
+
+    char *msg = g_strdup_printf("Recording saved to %s", capture.video_path);
+    xemu_queue_notification(msg);
+    g_free(msg);
+    g_free(capture.video_path);
+    capture.video_path = NULL;
+}
+
+bool xemu_capture_is_active(void)
+{
+    return capture.active;
+}
+
+void xemu_capture_audio(const int16_t samples[][2], int count)
+{
+    if (!capture.active) {
+        return;
+    }
+
+    size_t len = count * AUDIO_CHANNELS * sizeof(int16_t);
+
+    qemu_mutex_lock(&capture.audio_lock);
+    if (capture.active) {
+        CaptureChunk *chunk = NewChunk(CAPTURE_STREAM_AUDIO, len);
+        memcpy(chunk->data, samples, len);
+        g_async_queue_push(capture.queue, chunk);
+        capture.audio_bytes += len;
+    }
+    qemu_mutex_unlock(&capture.audio_lock);
+}
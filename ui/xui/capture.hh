@@ -0,0 +1,24 @@
+//
+// xemu User Interface
+//
+// Copyright (C) 2025 Matt Borgerson
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+#include <epoxy/gl.h>
+
+// Queues the guest frame in tex for recording, if a recording is active. Must
+// be called with the UI GL context current.
+void CaptureVideoFrame(GLuint tex, bool flip);
@@ -37,8 +37,11 @@ extern "C" {
 // Include necessary QEMU headers
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/thread-stats.h"
+#include "qemu/timeline.h"
 #include "system/runstate.h"
 #include "hw/xbox/mcpx/apu/apu_debug.h"
+#include "hw/xbox/mcpx/nvnet/nvnet_debug.h"
 #include "hw/xbox/nv2a/debug.h"
 #include "hw/xbox/nv2a/nv2a.h"
 
@@ -16,11 +16,20 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "debug.hh"
 #include "common.hh"
 #include "misc.hh"
 #include "font-manager.hh"
 #include "viewport-manager.hh"
+#include "widgets.hh"
+#include "hw/xbox/xbox_mem.h"
+#include "hw/xbox/xbox_sampler.h"
+#include "ui/xemu-frame-stats.h"
+#include "ui/xemu-notifications.h"
+#include "ui/xemu-pacing.h"
 
 #define MAX_VOICES 256
 
@@ -218,7 +227,23 @@ void DebugApuWindow::Draw()
         mcpx_apu_debug_set_ep_realtime_enabled(ep_realtime);
     }
 
+    static bool dsp_profiling;
+    dsp_profiling = mcpx_apu_debug_is_dsp_profiling();
+    if (ImGui::Checkbox("Profile DSP\n", &dsp_profiling)) {
+        mcpx_apu_debug_set_dsp_profiling(dsp_profiling);
+    }
+    if (dsp_profiling) {
+        ImGui::SameLine();
+        if (ImGui::Button("Copy Profile")) {
+            char *profile = mcpx_apu_debug_get_dsp_profile();
+            ImGui::SetClipboardText(profile);
+            g_free(profile);
+        }
+    }
+
     ImGui::Checkbox("HRTF Filtering\n", &g_config.audio.hrtf);
+    ImGui::Combo("Resampler", &g_config.audio.vp.resampler,
+                 "Linear\0Hermite\0Sinc\0");
 
     ImGui::PushFont(g_font_mgr.m_fixed_width_font);
 
@@ -242,6 +267,65 @@ void DebugApuWindow::Draw()
     }
     ImGui::Text("GP Cycles:   %04d", dbg->gp.cycles);
     ImGui::Text("EP Cycles:   %04d", dbg->ep.cycles);
+    ImGui::Text("GP Image:    %016" PRIx64, dbg->gp.image_hash);
+    ImGui::Text("EP Image:    %016" PRIx64, dbg->ep.image_hash);
+
+    if (ImGui::TreeNode("Frame Timing")) {
+        const struct McpxApuDebugTiming *timing = &dbg->timing;
+        ImGui::Text("Over budget: %" PRIu64 "/%" PRIu64, timing->over_budget,
+                    timing->frames);
+        ImGui::Text("Underruns:   %" PRIu64, timing->underruns);
+        ImGui::Text("Overruns:    %" PRIu64, timing->overruns);
+        if (ImGui::SmallButton("Reset")) {
+            mcpx_apu_debug_reset_timing();
+        }
+        HelpMarker("A frame must take under 0.67 ms. Blamed counts the "
+                   "frames over that in which the stage took longest. The "
+                   "histograms go from under 50 us to over 8 ms, as shown "
+                   "by the apu-timing monitor command.");
+
+        ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg;
+        if (ImGui::BeginTable("apu_timing_tbl", 5, flags)) {
+            ImGui::TableSetupColumn("Stage");
+            ImGui::TableSetupColumn("Avg us");
+            ImGui::TableSetupColumn("Max us");
+            ImGui::TableSetupColumn("Blamed");
+            ImGui::TableSetupColumn("Histogram");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i < MCPX_APU_DEBUG_STAGE__COUNT; i++) {
+                const struct McpxApuDebugStageTiming *stage =
+                    &timing->stages[i];
+                float histogram[MCPX_APU_DEBUG_TIMING_BUCKETS];
+                for (int b = 0; b < MCPX_APU_DEBUG_TIMING_BUCKETS; b++) {
+                    histogram[b] = stage->frames ? (float)stage->histogram[b] /
+                                                       stage->frames :
+                                                   0;
+                }
+                ImGui::TableNextRow();
+                ImGui::TableSetColumnIndex(0);
+                ImGui::TextUnformatted(mcpx_apu_debug_get_stage_name(
+                    (McpxApuDebugStage)i));
+                ImGui::TableSetColumnIndex(1);
+                ImGui::Text("%.1f", stage->frames ? stage->total_ns / 1e3 /
+                                                        stage->frames :
+                                                    0.0);
+                ImGui::TableSetColumnIndex(2);
+                ImGui::Text("%.1f", stage->max_ns / 1e3);
+                ImGui::TableSetColumnIndex(3);
+                ImGui::Text("%" PRIu64, stage->blamed);
+                ImGui::TableSetColumnIndex(4);
+                ImGui::PushID(i);
+                ImGui::PlotHistogram("##histogram", histogram,
+                                     MCPX_APU_DEBUG_TIMING_BUCKETS, 0, NULL,
+                                     0.0f, 1.0f,
+                                     ImVec2(100 * g_viewport_mgr.m_scale,
+                                            ImGui::GetTextLineHeight()));
+                ImGui::PopID();
+            }
+            ImGui::EndTable();
+        }
+        ImGui::TreePop();
+    }
 
     ImGui::PopFont();
     ImGui::Columns(1);
@@ -354,6 +438,245 @@ void DebugVideoWindow::Draw()
         }
         ImPlot::PopStyleColor();
 
+        XemuPacingStats pacing;
+        xemu_pacing_get_stats(&pacing);
+        if (pacing.display_hz) {
+            ImGui::Text("Display: %.2f Hz%s, guest %.1f vblanks/frame",
+                        pacing.display_hz, pacing.locked ? " (locked)" : "",
+                        pacing.guest_vblanks);
+        }
+
+        // Present-to-present intervals, in 1 ms bins, last one is 50+ ms
+        float intervals[XEMU_PACING_PRESENT_HISTORY];
+        float bins[51] = { 0 };
+        xemu_pacing_get_present_intervals(intervals);
+        for (int i = 0; i < XEMU_PACING_PRESENT_HISTORY; i++) {
+            if (intervals[i] > 0) {
+                bins[MIN((int)intervals[i], 50)]++;
+            }
+        }
+        ImGui::SetNextWindowBgAlpha(alpha);
+        if (ImPlot::BeginPlot("##PresentIntervals",
+                              ImVec2(-1, 75 * g_viewport_mgr.m_scale))) {
+            ImPlot::SetupAxes(NULL, NULL, ImPlotAxisFlags_None,
+                              rt_axis | ImPlotAxisFlags_AutoFit);
+            ImPlot::SetupAxisLimits(ImAxis_X1, 0, 51, ImPlotCond_Always);
+            ImPlot::PlotBars("##present", bins, 51, 0.8, 0.5);
+            ImPlot::Annotation(0, ImPlot::GetPlotLimits().Y.Max,
+                               ImPlot::GetLastItemColor(), ImVec2(0, 0), true,
+                               "Present interval (ms)");
+            ImPlot::EndPlot();
+        }
+
+        if (g_nv2a_stats.vram.budget) {
+            const double mib = 1024.0 * 1024.0;
+            ImGui::Text("VRAM: %.0f / %.0f MiB, textures %.0f MiB, "
+                        "surfaces %.0f MiB (%.0f MiB invalid)",
+                        g_nv2a_stats.vram.usage / mib,
+                        g_nv2a_stats.vram.budget / mib,
+                        g_nv2a_stats.vram.texture_bytes / mib,
+                        g_nv2a_stats.vram.surface_bytes / mib,
+                        g_nv2a_stats.vram.invalid_surface_bytes / mib);
+        }
+
+        int last_frame = (g_nv2a_stats.frame_ptr + NV2A_PROF_NUM_FRAMES - 1) %
+                         NV2A_PROF_NUM_FRAMES;
+        if (g_nv2a_stats.frame_history[last_frame].gpu_us) {
+            ImGui::Text("GPU: %.2f ms",
+                        g_nv2a_stats.frame_history[last_frame].gpu_us / 1000.0);
+            for (int i = 0; i < NV2A_PROF_GPU__COUNT; i++) {
+                int us = nv2a_profile_get_gpu_timer_value(i);
+                if (us) {
+                    ImGui::SameLine();
+                    ImGui::Text("%s: %.2f", nv2a_profile_get_gpu_timer_name(i),
+                                us / 1000.0);
+                }
+            }
+        }
+
+        bool cpu_timers_header = false;
+        for (int i = 0; i < NV2A_PROF_CPU__COUNT; i++) {
+            int us = nv2a_profile_get_cpu_timer_value(i);
+            if (us) {
+                if (cpu_timers_header) {
+                    ImGui::SameLine();
+                } else {
+                    ImGui::Text("CPU:");
+                    ImGui::SameLine();
+                    cpu_timers_header = true;
+                }
+                ImGui::Text("%s: %.2f", nv2a_profile_get_cpu_timer_name(i),
+                            us / 1000.0);
+            }
+        }
+
+        ImGui::Checkbox("Detect hitches",
+                        &g_config.display.debug.video.hitch_detection);
+        if (g_config.display.debug.video.hitch_detection) {
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(120 * g_viewport_mgr.m_scale);
+            float threshold = g_config.display.debug.video.hitch_threshold_ms;
+            if (ImGui::SliderFloat("Threshold (ms)", &threshold, 17, 500,
+                                   "%.0f")) {
+                g_config.display.debug.video.hitch_threshold_ms = threshold;
+            }
+#ifdef CONFIG_RENDERDOC
+            if (nv2a_dbg_renderdoc_available()) {
+                ImGui::SameLine();
+                ImGui::Checkbox(
+                    "RenderDoc capture",
+                    &g_config.display.debug.video.hitch_renderdoc_capture);
+            }
+#endif
+        }
+
+        XemuFrameStatSummary frame_time;
+        xemu_frame_stats_get_summary(XEMU_FRAME_STAT_FRAME_TIME, &frame_time);
+        if (frame_time.count) {
+            ImGui::Text("Session: %.2f ms avg, 99th %.2f ms, "
+                        "1%% low %.1f FPS, 0.1%% low %.1f FPS",
+                        frame_time.avg / 1000.0, frame_time.p99 / 1000.0,
+                        1e6 / MAX(frame_time.low_1, 1.0),
+                        1e6 / MAX(frame_time.low_01, 1.0));
+        }
+        if (ImGui::Button("Export statistics")) {
+            Error *err = NULL;
+            char *path = xemu_frame_stats_export(&err);
+            if (err) {
+                xemu_queue_error_message(error_get_pretty(err));
+                error_free(err);
+            } else {
+                char *msg = g_strdup_printf("Statistics saved to %s", path);
+                xemu_queue_notification(msg);
+                g_free(msg);
+                g_free(path);
+            }
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Reset statistics")) {
+            xemu_frame_stats_reset();
+        }
+        ImGui::SameLine();
+        ImGui::Checkbox("Export on exit",
+                        &g_config.display.debug.video.frame_stats_export);
+
+        if (ImGui::TreeNode("Caches")) {
+            ImGui::PushFont(g_font_mgr.m_fixed_width_font);
+            for (int i = 0; i < NV2A_PROF_CACHE__COUNT; i++) {
+                const auto &c = g_nv2a_stats.caches[i];
+                if (!c.capacity) {
+                    continue;
+                }
+                uint64_t lookups = c.hits + c.misses;
+                ImGui::Text("%-22s %5d/%-5d %5.1f%% hits, %" PRIu64
+                            " evictions",
+                            nv2a_profile_get_cache_name(i), c.used,
+                            c.capacity,
+                            lookups ? c.hits * 100.0 / lookups : 0.0,
+                            c.evictions);
+                if (c.evictions && ImGui::IsItemHovered()) {
+                    float age[NV2A_PROF_CACHE_AGE_BUCKETS];
+                    for (int j = 0; j < NV2A_PROF_CACHE_AGE_BUCKETS; j++) {
+                        age[j] = c.eviction_age[j];
+                    }
+                    ImGui::BeginTooltip();
+                    ImGui::Text("Lookups between last use and eviction, "
+                                "log2 buckets. Evictions on the left are "
+                                "thrashing.");
+                    ImGui::PlotHistogram(
+                        "##age", age, NV2A_PROF_CACHE_AGE_BUCKETS, 0, NULL,
+                        0, FLT_MAX,
+                        ImVec2(300 * g_viewport_mgr.m_scale,
+                               80 * g_viewport_mgr.m_scale));
+                    ImGui::EndTooltip();
+                }
+            }
+            ImGui::PopFont();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Memory")) {
+            const double mib = 1024.0 * 1024.0;
+            xbox_mem_update();
+            ImGui::PushFont(g_font_mgr.m_fixed_width_font);
+            for (int i = 0; i < XBOX_MEM__COUNT; i++) {
+                XboxMemCategory cat = (XboxMemCategory)i;
+                if (!xbox_mem_get_peak(cat)) {
+                    continue;
+                }
+                ImGui::Text("%-22s %9.1f MiB, peak %9.1f MiB",
+                            xbox_mem_get_name(cat), xbox_mem_get(cat) / mib,
+                            xbox_mem_get_peak(cat) / mib);
+            }
+            ImGui::Text("%-22s %9.1f MiB, peak %9.1f MiB", "total",
+                        xbox_mem_get_total() / mib,
+                        xbox_mem_get_total_peak() / mib);
+            ImGui::PopFont();
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Command stream")) {
+            const auto &stream =
+                g_nv2a_stats.frame_history[last_frame].stream;
+            ImGui::PushFont(g_font_mgr.m_fixed_width_font);
+            ImGui::Text("%d method words, %.1f KiB of pushbuffer",
+                        stream.methods, stream.pushbuffer_bytes / 1024.0);
+            for (int i = 0; i < NV2A_PROF_DRAW_KIND__COUNT; i++) {
+                ImGui::Text("%-16s %6d draws %8d vertices",
+                            nv2a_profile_get_draw_kind_name(i),
+                            stream.draws[i], stream.draw_vertices[i]);
+            }
+            ImGui::Separator();
+            for (int i = 0; i < NV2A_PROF_PRIM_TYPES; i++) {
+                if (stream.prim_draws[i]) {
+                    ImGui::Text("%-16s %6d draws %8d vertices",
+                                nv2a_profile_get_prim_type_name(i),
+                                stream.prim_draws[i], stream.prim_vertices[i]);
+                }
+            }
+            ImGui::Separator();
+            for (int i = 0; i < NV2A_PROF_STATE__COUNT; i++) {
+                ImGui::Text("%-16s %6d changes", nv2a_profile_get_state_name(i),
+                            stream.state_changes[i]);
+            }
+            ImGui::PopFont();
+
+            NV2AProfMethod methods[16];
+            int num_methods =
+                nv2a_profile_get_top_methods(methods, IM_ARRAYSIZE(methods));
+            ImGuiTableFlags flags =
+                ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg;
+            if (ImGui::BeginTable("methods_tbl", 4, flags)) {
+                ImGui::TableSetupColumn("Method");
+                ImGui::TableSetupColumn("Class");
+                ImGui::TableSetupColumn("Calls");
+                ImGui::TableSetupColumn("Words");
+                ImGui::TableHeadersRow();
+                for (int i = 0; i < num_methods; i++) {
+                    const NV2AProfMethod &m = methods[i];
+                    ImGui::TableNextRow();
+                    ImGui::TableSetColumnIndex(0);
+                    if (m.name) {
+                        ImGui::TextUnformatted(m.name);
+                    } else {
+                        ImGui::Text("0x%04x", m.method);
+                    }
+                    ImGui::TableSetColumnIndex(1);
+                    if (m.graphics_class) {
+                        ImGui::Text("0x%02x", m.graphics_class);
+                    } else {
+                        ImGui::TextUnformatted("other");
+                    }
+                    ImGui::TableSetColumnIndex(2);
+                    ImGui::Text("%u", m.calls);
+                    ImGui::TableSetColumnIndex(3);
+                    ImGui::Text("%u", m.words);
+                }
+                ImGui::EndTable();
+            }
+            ImGui::TreePop();
+        }
+
         ImGui::SetNextItemOpen(g_config.display.debug.video.advanced_tree_state,
                                ImGuiCond_Once);
         g_config.display.debug.video.advanced_tree_state =
@@ -414,5 +737,291 @@ void DebugVideoWindow::Draw()
     ImGui::PopStyleColor(5);
 }
 
+DebugNetworkWindow::DebugNetworkWindow() : m_is_open(false)
+{
+}
+
+static void PlotNetworkHistogram(const char *label, const char *unit,
+                                 const NvNetHistogram *h)
+{
+    float bins[NVNET_HIST_BUCKETS];
+    for (int i = 0; i < NVNET_HIST_BUCKETS; i++) {
+        bins[i] = h->buckets[i];
+    }
+
+    ImGui::Text("%s: avg %.1f %s, max %llu %s", label,
+                h->count ? (double)h->total / h->count : 0.0, unit,
+                (unsigned long long)h->max, unit);
+
+    // Bin i holds values in [2^(i-1), 2^i)
+    ImGui::PushID(label);
+    if (ImPlot::BeginPlot("##hist", ImVec2(-1, 75 * g_viewport_mgr.m_scale))) {
+        ImPlot::SetupAxes(NULL, NULL, ImPlotAxisFlags_None,
+                          ImPlotAxisFlags_NoTickLabels |
+                              ImPlotAxisFlags_AutoFit);
+        ImPlot::SetupAxisLimits(ImAxis_X1, -1, NVNET_HIST_BUCKETS,
+                                ImPlotCond_Always);
+        ImPlot::PlotBars("##bins", bins, NVNET_HIST_BUCKETS, 0.8);
+        ImPlot::EndPlot();
+    }
+    ImGui::PopID();
+}
+
+void DebugNetworkWindow::Draw()
+{
+    if (!m_is_open)
+        return;
+
+    ImGui::SetNextWindowContentSize(ImVec2(500.0f*g_viewport_mgr.m_scale, 0.0f));
+    if (!ImGui::Begin("Network Debug", &m_is_open,
+                      ImGuiWindowFlags_NoCollapse |
+                          ImGuiWindowFlags_AlwaysAutoResize)) {
+        ImGui::End();
+        return;
+    }
+
+    NvNetStats stats;
+    if (!nvnet_get_stats(&stats)) {
+        ImGui::Text("No network controller present");
+        ImGui::End();
+        return;
+    }
+
+    // Rates over the last second
+    static NvNetStats prev;
+    static Uint32 prev_ticks;
+    static float tx_pps, tx_kbps, rx_pps, rx_kbps;
+    Uint32 ticks = SDL_GetTicks();
+    if (ticks - prev_ticks >= 1000) {
+        float secs = (ticks - prev_ticks) / 1000.0f;
+        tx_pps = (stats.tx_packets - prev.tx_packets) / secs;
+        tx_kbps = (stats.tx_bytes - prev.tx_bytes) * 8 / 1000.0f / secs;
+        rx_pps = (stats.rx_packets - prev.rx_packets) / secs;
+        rx_kbps = (stats.rx_bytes - prev.rx_bytes) * 8 / 1000.0f / secs;
+        prev = stats;
+        prev_ticks = ticks;
+    }
+
+    ImGui::Text("TX: %llu packets, %llu bytes (%.0f pkt/s, %.0f kbit/s)",
+                (unsigned long long)stats.tx_packets,
+                (unsigned long long)stats.tx_bytes, tx_pps, tx_kbps);
+    ImGui::Text("    %llu kicks, %llu bounced",
+                (unsigned long long)stats.tx_kicks,
+                (unsigned long long)stats.tx_bounced);
+    ImGui::Text("RX: %llu packets, %llu bytes (%.0f pkt/s, %.0f kbit/s)",
+                (unsigned long long)stats.rx_packets,
+                (unsigned long long)stats.rx_bytes, rx_pps, rx_kbps);
+    ImGui::Text("    %llu irqs, %llu filtered, %llu oversized, "
+                "%llu ring full",
+                (unsigned long long)stats.rx_irqs,
+                (unsigned long long)stats.rx_filter_dropped,
+                (unsigned long long)stats.rx_oversized,
+                (unsigned long long)stats.rx_ring_full);
+    ImGui::Text("TX ring: %d/%d pending, RX ring: %d/%d free",
+                stats.tx_ring_pending, stats.tx_ring_size, stats.rx_ring_free,
+                stats.rx_ring_size);
+
+    PlotNetworkHistogram("TX kick to send", "us", &stats.tx_delay_us);
+    PlotNetworkHistogram("RX receive to DMA", "us", &stats.rx_delay_us);
+    PlotNetworkHistogram("TX packets per kick", "pkts", &stats.tx_batch);
+
+    if (ImGui::Button("Reset")) {
+        nvnet_reset_stats();
+        memset(&prev, 0, sizeof(prev));
+    }
+
+    ImGui::End();
+}
+
+DebugThreadsWindow::DebugThreadsWindow() : m_is_open(false)
+{
+}
+
+struct ThreadRow {
+    std::string name; // Only valid during the callback, so copied
+    int tid;
+    int64_t cpu_ns;
+    double utilization;
+};
+
+static void CollectThread(const ThreadStatsThread *thread, void *opaque)
+{
+    static_cast<std::vector<ThreadRow> *>(opaque)->push_back(
+        { thread->name, thread->tid, thread->cpu_ns, thread->utilization });
+}
+
+static void CollectLock(const ThreadStatsLock *lock, void *opaque)
+{
+    static_cast<std::vector<ThreadStatsLock> *>(opaque)->push_back(*lock);
+}
+
+static void DrawSamplerTable(const char *id, const char *column,
+                             const XboxSamplerEntry *entries, int num_entries,
+                             uint64_t total_samples)
+{
+    ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg;
+    if (!ImGui::BeginTable(id, 3, flags)) {
+        return;
+    }
+
+    ImGui::TableSetupColumn(column);
+    ImGui::TableSetupColumn("Samples");
+    ImGui::TableSetupColumn("Share");
+    ImGui::TableHeadersRow();
+    for (int i = 0; i < std::min(num_entries, 16); i++) {
+        ImGui::TableNextRow();
+        ImGui::TableSetColumnIndex(0);
+        ImGui::TextUnformatted(entries[i].name);
+        ImGui::TableSetColumnIndex(1);
+        ImGui::Text("%" PRIu64, entries[i].samples);
+        ImGui::TableSetColumnIndex(2);
+        ImGui::Text("%.1f%%", 100.0 * entries[i].samples / total_samples);
+    }
+    ImGui::EndTable();
+}
+
+void DebugThreadsWindow::Draw()
+{
+    if (!m_is_open)
+        return;
+
+    ImGui::SetNextWindowContentSize(ImVec2(500.0f*g_viewport_mgr.m_scale, 0.0f));
+    if (!ImGui::Begin("Threads Debug", &m_is_open,
+                      ImGuiWindowFlags_NoCollapse |
+                          ImGuiWindowFlags_AlwaysAutoResize)) {
+        ImGui::End();
+        return;
+    }
+
+    // Rates over the last second
+    static Uint32 prev_ticks;
+    Uint32 ticks = SDL_GetTicks();
+    if (ticks - prev_ticks >= 1000) {
+        thread_stats_update();
+        prev_ticks = ticks;
+    }
+
+    std::vector<ThreadRow> threads;
+    thread_stats_foreach_thread(CollectThread, &threads);
+    std::sort(threads.begin(), threads.end(),
+              [](const ThreadRow &a, const ThreadRow &b) {
+                  return a.utilization > b.utilization;
+              });
+
+    ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg;
+    if (ImGui::BeginTable("threads_tbl", 4, flags)) {
+        ImGui::TableSetupColumn("Thread");
+        ImGui::TableSetupColumn("TID");
+        ImGui::TableSetupColumn("CPU");
+        ImGui::TableSetupColumn("CPU time");
+        ImGui::TableHeadersRow();
+        for (auto &t : threads) {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::TextUnformatted(t.name.c_str());
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%d", t.tid);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%.1f%%", t.utilization * 100);
+            ImGui::TableSetColumnIndex(3);
+            ImGui::Text("%.2f s", t.cpu_ns / 1e9);
+        }
+        ImGui::EndTable();
+    }
+
+    ImGui::Spacing();
+    bool profiling = qsp_is_enabled();
+    if (ImGui::Checkbox("Profile lock contention", &profiling)) {
+        if (profiling) {
+            qsp_enable();
+        } else {
+            qsp_disable();
+        }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Reset")) {
+        qsp_reset();
+    }
+    HelpMarker("Measures the time spent waiting for every lock, which slows "
+               "down emulation somewhat. Also available with -enable-sync-"
+               "profile and the sync-profile monitor command.");
+
+    std::vector<ThreadStatsLock> locks;
+    thread_stats_foreach_lock(CollectLock, &locks);
+    if (ImGui::BeginTable("locks_tbl", 4, flags)) {
+        ImGui::TableSetupColumn("Lock");
+        ImGui::TableSetupColumn("Acquisitions");
+        ImGui::TableSetupColumn("Waited");
+        ImGui::TableSetupColumn("Waiting");
+        ImGui::TableHeadersRow();
+        for (auto &l : locks) {
+            ImGui::TableNextRow();
+            ImGui::TableSetColumnIndex(0);
+            ImGui::TextUnformatted(l.name);
+            ImGui::TableSetColumnIndex(1);
+            ImGui::Text("%" PRIu64, l.acquisitions);
+            ImGui::TableSetColumnIndex(2);
+            ImGui::Text("%.1f ms", l.wait_ns / 1e6);
+            ImGui::TableSetColumnIndex(3);
+            ImGui::Text("%.1f%%", l.wait_fraction * 100);
+        }
+        ImGui::EndTable();
+    }
+
+    ImGui::Spacing();
+    bool sampling = xbox_sampler_is_running();
+    if (ImGui::Checkbox("Sample threads", &sampling)) {
+        if (sampling) {
+            xbox_sampler_start();
+        } else {
+            xbox_sampler_stop();
+        }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Reset##sampler")) {
+        xbox_sampler_reset();
+    }
+    HelpMarker("Stops each busy thread 1000 times a second to see what it "
+               "is running, with translated code attributed to the guest "
+               "instruction and XBE section. The emulator's own functions "
+               "are shown by address, Debug > Record Profile saves a pprof "
+               "profile which resolves them.");
+
+    // The profile is symbolized, so only refreshed every second
+    static XboxSamplerProfile *profile;
+    static Uint32 prev_profile_ticks;
+    if (!profile || ticks - prev_profile_ticks >= 1000) {
+        if (profile) {
+            xbox_sampler_free_profile(profile);
+        }
+        profile = xbox_sampler_get_profile();
+        prev_profile_ticks = ticks;
+    }
+
+    if (profile->total_samples) {
+        ImGui::Text("%" PRIu64 " samples, %.1f%% in guest code",
+                    profile->total_samples,
+                    100.0 * profile->guest_samples / profile->total_samples);
+        if (ImGui::TreeNode("Host code")) {
+            DrawSamplerTable("modules_tbl", "Module", profile->modules,
+                             profile->num_modules, profile->total_samples);
+            DrawSamplerTable("host_tbl", "Function", profile->host,
+                             profile->num_host, profile->total_samples);
+            ImGui::TreePop();
+        }
+        if (ImGui::TreeNode("Guest code")) {
+            DrawSamplerTable("sections_tbl", "Section", profile->sections,
+                             profile->num_sections, profile->total_samples);
+            DrawSamplerTable("guest_tbl", "Instruction", profile->guest,
+                             profile->num_guest, profile->total_samples);
+            ImGui::TreePop();
+        }
+    }
+
+    ImGui::End();
+}
+
 DebugApuWindow apu_window;
 DebugVideoWindow video_window;
+DebugNetworkWindow network_window;
+DebugThreadsWindow threads_window;
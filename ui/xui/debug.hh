@@ -39,5 +39,23 @@ public:
     void Draw();
 };
 
+class DebugNetworkWindow
+{
+public:
+    bool m_is_open;
+    DebugNetworkWindow();
+    void Draw();
+};
+
+class DebugThreadsWindow
+{
+public:
+    bool m_is_open;
+    DebugThreadsWindow();
+    void Draw();
+};
+
 extern DebugApuWindow apu_window;
 extern DebugVideoWindow video_window;
+extern DebugNetworkWindow network_window;
+extern DebugThreadsWindow threads_window;
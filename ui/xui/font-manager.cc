@@ -18,6 +18,7 @@
 //
 #include "font-manager.hh"
 #include "viewport-manager.hh"
+#include <vector>
 
 #include "data/Roboto-Medium.ttf.h"
 #include "data/RobotoCondensed-Regular.ttf.h"
@@ -26,6 +27,190 @@
 
 FontManager g_font_mgr;
 
+// Built atlases are kept on disk, one per set of font sizes, so that fonts
+// are not rasterized again at startup or when the UI scale changes
+#define FONT_CACHE_MAGIC 0x53544e46 // "FNTS"
+#define FONT_CACHE_VERSION 1
+
+struct FontCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t imgui_version;
+    uint32_t key;
+    uint32_t tex_width;
+    uint32_t tex_height;
+    uint32_t num_fonts;
+    ImVec2 tex_uv_scale;
+    ImVec2 tex_uv_white_pixel;
+    ImVec4 tex_uv_lines[IM_DRAWLIST_TEX_LINES_WIDTH_MAX + 1];
+};
+
+struct FontCacheFont {
+    float ascent;
+    float descent;
+    uint32_t num_glyphs;
+};
+
+struct FontCacheGlyph {
+    uint32_t codepoint;
+    float advance_x;
+    float x0, y0, x1, y1;
+    float u0, v0, u1, v1;
+};
+
+// Identifies the fonts added to the atlas, and the sizes they are built at
+static uint32_t GetFontCacheKey(ImFontAtlas *atlas)
+{
+    GString *desc = g_string_new(NULL);
+
+    for (const ImFontConfig &cfg : atlas->ConfigData) {
+        g_string_append_printf(desc, "%d,%g,%d,%d,%d,%d,%g,%g,%g,%g;",
+                               cfg.FontDataSize, cfg.SizePixels, cfg.MergeMode,
+                               cfg.OversampleH, cfg.OversampleV, cfg.PixelSnapH,
+                               cfg.GlyphOffset.x, cfg.GlyphOffset.y,
+                               cfg.GlyphMinAdvanceX, cfg.GlyphMaxAdvanceX);
+        for (const ImWchar *r = cfg.GlyphRanges; r && *r; r++) {
+            g_string_append_printf(desc, "%x,", *r);
+        }
+    }
+
+    uint32_t key = g_str_hash(desc->str);
+    g_string_free(desc, true);
+    return key;
+}
+
+static char *GetFontCachePath(uint32_t key)
+{
+    g_autofree char *name = g_strdup_printf("atlas-%08x.bin", key);
+    return g_build_filename(xemu_settings_get_cache_path(), "font_cache", name,
+                            NULL);
+}
+
+static bool LoadFontCache(ImFontAtlas *atlas, uint32_t key)
+{
+    g_autofree char *path = GetFontCachePath(key);
+    g_autofree char *buf = NULL;
+    gsize size;
+
+    if (!g_file_get_contents(path, &buf, &size, NULL)) {
+        return false;
+    }
+
+    const char *p = buf, *end = buf + size;
+    FontCacheHeader hdr;
+    if (size < sizeof(hdr)) {
+        return false;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+    if (hdr.magic != FONT_CACHE_MAGIC || hdr.version != FONT_CACHE_VERSION ||
+        hdr.imgui_version != IMGUI_VERSION_NUM || hdr.key != key ||
+        hdr.num_fonts != (uint32_t)atlas->Fonts.Size) {
+        return false;
+    }
+
+    // Check that everything is there before touching the atlas
+    std::vector<FontCacheFont> fonts(hdr.num_fonts);
+    std::vector<const char *> glyphs(hdr.num_fonts);
+    for (uint32_t i = 0; i < hdr.num_fonts; i++) {
+        if (end - p < (ptrdiff_t)sizeof(FontCacheFont)) {
+            return false;
+        }
+        memcpy(&fonts[i], p, sizeof(FontCacheFont));
+        p += sizeof(FontCacheFont);
+        glyphs[i] = p;
+        if ((size_t)(end - p) / sizeof(FontCacheGlyph) < fonts[i].num_glyphs) {
+            return false;
+        }
+        p += fonts[i].num_glyphs * sizeof(FontCacheGlyph);
+    }
+    size_t tex_size = (size_t)hdr.tex_width * hdr.tex_height;
+    if (tex_size == 0 || (size_t)(end - p) != tex_size) {
+        return false;
+    }
+
+    atlas->ClearTexData();
+    atlas->TexWidth = hdr.tex_width;
+    atlas->TexHeight = hdr.tex_height;
+    atlas->TexUvScale = hdr.tex_uv_scale;
+    atlas->TexUvWhitePixel = hdr.tex_uv_white_pixel;
+    memcpy(atlas->TexUvLines, hdr.tex_uv_lines, sizeof(atlas->TexUvLines));
+    atlas->TexPixelsAlpha8 = (unsigned char *)IM_ALLOC(tex_size);
+    memcpy(atlas->TexPixelsAlpha8, p, tex_size);
+
+    for (ImFontConfig &cfg : atlas->ConfigData) {
+        int i = atlas->Fonts.index_from_ptr(atlas->Fonts.find(cfg.DstFont));
+        ImFontAtlasBuildSetupFont(atlas, cfg.DstFont, &cfg, fonts[i].ascent,
+                                  fonts[i].descent);
+    }
+    for (uint32_t i = 0; i < hdr.num_fonts; i++) {
+        ImFont *font = atlas->Fonts[i];
+        for (uint32_t j = 0; j < fonts[i].num_glyphs; j++) {
+            FontCacheGlyph g;
+            memcpy(&g, glyphs[i] + j * sizeof(g), sizeof(g));
+            // Offsets and advance limits were applied when it was built
+            font->AddGlyph(NULL, (ImWchar)g.codepoint, g.x0, g.y0, g.x1, g.y1,
+                           g.u0, g.v0, g.u1, g.v1, g.advance_x);
+        }
+        font->BuildLookupTable();
+    }
+    atlas->TexReady = true;
+
+    return true;
+}
+
+static void SaveFontCache(ImFontAtlas *atlas, uint32_t key)
+{
+    if (!atlas->TexPixelsAlpha8) {
+        return;
+    }
+
+    FontCacheHeader hdr = {};
+    hdr.magic = FONT_CACHE_MAGIC;
+    hdr.version = FONT_CACHE_VERSION;
+    hdr.imgui_version = IMGUI_VERSION_NUM;
+    hdr.key = key;
+    hdr.tex_width = atlas->TexWidth;
+    hdr.tex_height = atlas->TexHeight;
+    hdr.num_fonts = atlas->Fonts.Size;
+    hdr.tex_uv_scale = atlas->TexUvScale;
+    hdr.tex_uv_white_pixel = atlas->TexUvWhitePixel;
+    memcpy(hdr.tex_uv_lines, atlas->TexUvLines, sizeof(hdr.tex_uv_lines));
+
+    GByteArray *out = g_byte_array_new();
+    g_byte_array_append(out, (const guint8 *)&hdr, sizeof(hdr));
+    for (ImFont *font : atlas->Fonts) {
+        FontCacheFont f = {};
+        f.ascent = font->Ascent;
+        f.descent = font->Descent;
+        f.num_glyphs = font->Glyphs.Size;
+        g_byte_array_append(out, (const guint8 *)&f, sizeof(f));
+        for (const ImFontGlyph &glyph : font->Glyphs) {
+            FontCacheGlyph g = {};
+            g.codepoint = glyph.Codepoint;
+            g.advance_x = glyph.AdvanceX;
+            g.x0 = glyph.X0;
+            g.y0 = glyph.Y0;
+            g.x1 = glyph.X1;
+            g.y1 = glyph.Y1;
+            g.u0 = glyph.U0;
+            g.v0 = glyph.V0;
+            g.u1 = glyph.U1;
+            g.v1 = glyph.V1;
+            g_byte_array_append(out, (const guint8 *)&g, sizeof(g));
+        }
+    }
+    g_byte_array_append(out, atlas->TexPixelsAlpha8,
+                        atlas->TexWidth * atlas->TexHeight);
+
+    g_autofree char *path = GetFontCachePath(key);
+    g_autofree char *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0755) == 0) {
+        g_file_set_contents(path, (const char *)out->data, out->len, NULL);
+    }
+    g_byte_array_free(out, true);
+}
+
 FontManager::FontManager()
 {
     m_last_viewport_scale = 1;
@@ -106,6 +291,12 @@ void FontManager::Rebuild()
         m_fixed_width_font = io.Fonts->AddFontDefault(&config);
     }
 
+    uint32_t key = GetFontCacheKey(io.Fonts);
+    if (!LoadFontCache(io.Fonts, key)) {
+        io.Fonts->Build();
+        SaveFontCache(io.Fonts, key);
+    }
+
     ImGui_ImplOpenGL3_CreateFontsTexture();
 }
 
@@ -29,16 +29,23 @@
 #include <fpng.h>
 #include <math.h>
 #include <stdio.h>
+#include <atomic>
+#include <string>
 #include <vector>
 
 #include "ui/shader/xemu-logo-frag.h"
 
+extern "C" {
+#include "qemu/thread.h"
+}
+
 Fbo *controller_fbo, *xmu_fbo, *logo_fbo;
 GLuint g_controller_duke_tex, g_controller_s_tex, g_logo_tex, g_icon_tex, g_xmu_tex;
 
 enum class ShaderType {
     Blit,
     BlitGamma, // FIMXE: Move to nv2a_get_framebuffer_surface
+    BlitGammaSharp,
     Mask,
     Logo,
 };
@@ -58,12 +65,15 @@ typedef struct DecalShader_
     GLint color_fill_loc;
     GLint time_loc;
     GLint scale_loc;
+    GLint sharpness_loc;
     GLint palette_loc[256];
 } DecalShader;
 
 static DecalShader *g_decal_shader,
                    *g_logo_shader,
-                   *g_framebuffer_shader;
+                   *g_framebuffer_shader,
+                   *g_sharp_framebuffer_shader,
+                   *g_overlay_shader;
 
 GLint Fbo::vp[4];
 GLint Fbo::original_fbo;
@@ -173,7 +183,7 @@ static GLuint LoadTextureFromMemory(const unsigned char *buf, unsigned int size,
     return tex;
 }
 
-static GLuint Shader(GLenum type, const char *src)
+GLuint Shader(GLenum type, const char *src)
 {
     char err_buf[512];
     GLuint shader = glCreateShader(type);
@@ -224,15 +234,15 @@ void main() {
     GLuint vert = Shader(GL_VERTEX_SHADER, vert_src);
     assert(vert != 0);
 
-    //     const char *image_frag_src = R"(
-    // #version 150 core
-    // uniform sampler2D tex;
-    // in  vec2 Texcoord;
-    // out vec4 out_Color;
-    // void main() {
-    //     out_Color.rgba = texture(tex, Texcoord);
-    // }
-    // )";
+    const char *image_frag_src = R"(
+#version 150 core
+uniform sampler2D tex;
+in  vec2 Texcoord;
+out vec4 out_Color;
+void main() {
+    out_Color.rgba = texture(tex, Texcoord);
+}
+)";
 
     const char *image_gamma_frag_src = R"(
 #version 400 core
@@ -252,6 +262,43 @@ out vec4 out_Color;
 void main() {
     out_Color.rgba = gamma(texture(tex, Texcoord));
 }
+)";
+
+    // Upscales with bilinear filtering, then sharpens with weights that back
+    // off where the local contrast is already high, so edges do not ring.
+    // Much cheaper than rendering at a higher surface scale.
+    const char *image_gamma_sharp_frag_src = R"(
+#version 400 core
+uniform sampler2D tex;
+uniform uint palette[256];
+uniform float sharpness;
+float gamma_ch(int ch, float col)
+{
+    return float(bitfieldExtract(palette[uint(col * 255.0)], ch*8, 8)) / 255.0;
+}
+
+vec4 gamma(vec4 col)
+{
+    return vec4(gamma_ch(0, col.r), gamma_ch(1, col.g), gamma_ch(2, col.b), col.a);
+}
+in  vec2 Texcoord;
+out vec4 out_Color;
+void main() {
+    vec2 texel = 1.0 / vec2(textureSize(tex, 0));
+    vec4 c = texture(tex, Texcoord);
+    vec3 n = texture(tex, Texcoord - vec2(0.0, texel.y)).rgb;
+    vec3 s = texture(tex, Texcoord + vec2(0.0, texel.y)).rgb;
+    vec3 e = texture(tex, Texcoord + vec2(texel.x, 0.0)).rgb;
+    vec3 w = texture(tex, Texcoord - vec2(texel.x, 0.0)).rgb;
+
+    vec3 mn = min(c.rgb, min(min(n, s), min(e, w)));
+    vec3 mx = max(c.rgb, max(max(n, s), max(e, w)));
+    vec3 amp = sqrt(clamp(min(mn, 1.0 - mx) / max(mx, 1.0 / 255.0), 0.0, 1.0));
+    vec3 wt = -amp / mix(8.0, 5.0, clamp(sharpness, 0.0, 1.0));
+    vec3 rgb = (c.rgb + (n + s + e + w) * wt) / (1.0 + 4.0 * wt);
+
+    out_Color.rgba = gamma(vec4(clamp(rgb, 0.0, 1.0), c.a));
+}
 )";
 
     // Simple 2-color decal shader
@@ -279,8 +326,9 @@ void main() {
     const char *frag_src = NULL;
     switch (type) {
     case ShaderType::Mask: frag_src = mask_frag_src; break;
-    // case ShaderType::Blit: frag_src = image_frag_src; break;
+    case ShaderType::Blit: frag_src = image_frag_src; break;
     case ShaderType::BlitGamma: frag_src = image_gamma_frag_src; break;
+    case ShaderType::BlitGammaSharp: frag_src = image_gamma_sharp_frag_src; break;
     case ShaderType::Logo: frag_src = xemu_logo_frag_src; break;
     default: assert(0);
     }
@@ -309,6 +357,7 @@ void main() {
     s->color_fill_loc = glGetUniformLocation(s->prog, "in_ColorFill");
     s->time_loc = glGetUniformLocation(s->prog, "iTime");
     s->scale_loc = glGetUniformLocation(s->prog, "scale");
+    s->sharpness_loc = glGetUniformLocation(s->prog, "sharpness");
     for (int i = 0; i < 256; i++) {
         char name[64];
         snprintf(name, sizeof(name), "palette[%d]", i);
@@ -439,6 +488,22 @@ enum tex_item_names {
 
 void InitCustomRendering(void)
 {
+    g_framebuffer_shader = NewDecalShader(ShaderType::BlitGamma);
+    g_sharp_framebuffer_shader = NewDecalShader(ShaderType::BlitGammaSharp);
+    g_overlay_shader = NewDecalShader(ShaderType::Blit);
+}
+
+// Textures, shaders and targets only the menus draw with are set up the first
+// time one of them is shown, rather than at startup
+void InitMenuRendering(void)
+{
+    static bool initialized = false;
+
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
     glActiveTexture(GL_TEXTURE0);
     g_controller_duke_tex =
         LoadTextureFromMemory(controller_mask_data, controller_mask_size);
@@ -455,8 +520,6 @@ void InitCustomRendering(void)
     logo_fbo = new Fbo(512, 512);
 
     g_icon_tex = LoadTextureFromMemory(xemu_64x64_data, xemu_64x64_size, false);
-
-    g_framebuffer_shader = NewDecalShader(ShaderType::BlitGamma);
 }
 
 static void RenderMeter(DecalShader *s, float x, float y, float width,
@@ -889,7 +952,12 @@ void RenderFramebuffer(GLint tex, int width, int height, bool flip, float scale[
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, tex);
     
+    DecalShader *s = g_framebuffer_shader;
+
     switch (g_config.display.filtering) {
+    case CONFIG_DISPLAY_FILTERING_SHARP:
+        s = g_sharp_framebuffer_shader;
+        /* fallthrough */
     case CONFIG_DISPLAY_FILTERING_LINEAR:
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -900,7 +968,6 @@ void RenderFramebuffer(GLint tex, int width, int height, bool flip, float scale[
     break;
     }
 
-    DecalShader *s = g_framebuffer_shader;
     s->flip = flip;
     glViewport(0, 0, width, height);
     glUseProgram(s->prog);
@@ -909,6 +976,7 @@ void RenderFramebuffer(GLint tex, int width, int height, bool flip, float scale[
     glUniform4f(s->scale_offset_loc, scale[0], scale[1], 0, 0);
     glUniform4f(s->tex_scale_offset_loc, 1.0, 1.0, 0, 0);
     glUniform1i(s->tex_loc, 0);
+    glUniform1f(s->sharpness_loc, g_config.display.sharpness);
 
     const uint8_t *palette = nv2a_get_dac_palette();
     for (int i = 0; i < 256; i++) {
@@ -925,7 +993,32 @@ void RenderFramebuffer(GLint tex, int width, int height, bool flip, float scale[
     }
 }
 
-static float GetDisplayAspectRatio(int width, int height)
+// Draws a texture holding premultiplied alpha over the whole viewport
+void RenderOverlay(GLuint tex, int width, int height)
+{
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex);
+
+    DecalShader *s = g_overlay_shader;
+    glViewport(0, 0, width, height);
+    glUseProgram(s->prog);
+    glBindVertexArray(s->vao);
+    glUniform1i(s->flipy_loc, 0);
+    glUniform4f(s->scale_offset_loc, 1.0, 1.0, 0, 0);
+    glUniform4f(s->tex_scale_offset_loc, 1.0, 1.0, 0, 0);
+    glUniform1i(s->tex_loc, 0);
+
+    bool blend = glIsEnabled(GL_BLEND);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawElements(GL_TRIANGLE_FAN, 4, GL_UNSIGNED_INT, NULL);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (!blend) {
+        glDisable(GL_BLEND);
+    }
+}
+
+float GetDisplayAspectRatio(int width, int height)
 {
     switch (g_config.display.ui.aspect_ratio) {
     case CONFIG_DISPLAY_UI_ASPECT_RATIO_NATIVE:
@@ -975,24 +1068,28 @@ void RenderFramebuffer(GLint tex, int width, int height, bool flip)
     RenderFramebuffer(tex, width, height, flip, scale);
 }
 
-bool RenderFramebufferToPng(GLuint tex, bool flip, std::vector<uint8_t> &png, int max_width, int max_height)
+static void GetReadbackSize(GLuint tex, int max_width, int max_height,
+                            int *width, int *height)
 {
-    int width, height;
+    int w, h;
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
-    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
 
-    width = height * GetDisplayAspectRatio(width, height);
+    w = h * GetDisplayAspectRatio(w, h);
 
-    if (!max_width) max_width = width;
-    if (!max_height) max_height = height;
-    ScaleDimensions(width, height, max_width, max_height, &width, &height);
-
-    std::vector<uint8_t> pixels;
-    pixels.resize(width * height * 3);
+    if (!max_width) max_width = w;
+    if (!max_height) max_height = h;
+    ScaleDimensions(w, h, max_width, max_height, width, height);
+}
 
+// Reads back tex as RGB into pixels, or at that offset into the bound
+// GL_PIXEL_PACK_BUFFER
+static void ReadFramebufferPixels(GLuint tex, bool flip, int width, int height,
+                                  void *pixels)
+{
     Fbo fbo(width, height);
     fbo.Target();
     bool blend = glIsEnabled(GL_BLEND);
@@ -1003,54 +1100,164 @@ bool RenderFramebufferToPng(GLuint tex, bool flip, std::vector<uint8_t> &png, in
     glPixelStorei(GL_PACK_ROW_LENGTH, width);
     glPixelStorei(GL_PACK_IMAGE_HEIGHT, height);
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
     fbo.Restore();
+}
+
+bool RenderFramebufferToPng(GLuint tex, bool flip, std::vector<uint8_t> &png, int max_width, int max_height)
+{
+    int width, height;
+    GetReadbackSize(tex, max_width, max_height, &width, &height);
+
+    std::vector<uint8_t> pixels;
+    pixels.resize(width * height * 3);
+    ReadFramebufferPixels(tex, flip, width, height, pixels.data());
 
     return fpng::fpng_encode_image_to_memory(pixels.data(), width, height, 3, png);
 }
 
-void SaveScreenshot(GLuint tex, bool flip)
-{
-    Error *err = NULL;
-    char fname[128];
+struct PngReadback {
+    GLuint pbo;
+    GLsync fence;
+    int width, height;
+    std::vector<uint8_t> pixels;
     std::vector<uint8_t> png;
+    bool encoded;
+    std::atomic<bool> done;
+    QemuThread thread;
+    PngCallback on_complete;
+};
 
-    if (RenderFramebufferToPng(tex, flip, png)) {
-        time_t t = time(NULL);
-        struct tm *tmp = localtime(&t);
-        if (tmp) {
-            strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S.png", tmp);
-        } else {
-            strcpy(fname, "xemu.png");
+static std::vector<PngReadback *> g_png_readbacks;
+
+static void *EncodePngThread(void *opaque)
+{
+    PngReadback *r = (PngReadback *)opaque;
+    r->encoded = fpng::fpng_encode_image_to_memory(r->pixels.data(), r->width,
+                                                   r->height, 3, r->png);
+    r->done = true;
+    return NULL;
+}
+
+void RenderFramebufferToPngAsync(GLuint tex, bool flip, PngCallback on_complete,
+                                 int max_width, int max_height)
+{
+    PngReadback *r = new PngReadback;
+    GetReadbackSize(tex, max_width, max_height, &r->width, &r->height);
+    r->encoded = false;
+    r->done = false;
+    r->on_complete = on_complete;
+
+    glGenBuffers(1, &r->pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, r->width * r->height * 3, NULL,
+                 GL_STREAM_READ);
+    ReadFramebufferPixels(tex, flip, r->width, r->height, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    g_png_readbacks.push_back(r);
+}
+
+void ProcessPngReadbacks(void)
+{
+    for (auto it = g_png_readbacks.begin(); it != g_png_readbacks.end();) {
+        PngReadback *r = *it;
+
+        if (r->fence) {
+            if (glClientWaitSync(r->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) ==
+                GL_TIMEOUT_EXPIRED) {
+                it++;
+                continue;
+            }
+            glDeleteSync(r->fence);
+            r->fence = 0;
+
+            size_t size = r->width * r->height * 3;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo);
+            void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+                                            GL_MAP_READ_BIT);
+            if (pixels) {
+                r->pixels.assign((uint8_t *)pixels, (uint8_t *)pixels + size);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            glDeleteBuffers(1, &r->pbo);
+
+            if (pixels) {
+                qemu_thread_create(&r->thread, "png_encode", EncodePngThread,
+                                   r, QEMU_THREAD_JOINABLE);
+            } else {
+                r->done = true;
+            }
+            it++;
+            continue;
         }
 
-        const char *output_dir = g_config.general.screenshot_dir;
-        if (!strlen(output_dir)) {
-            output_dir = ".";
+        if (!r->done) {
+            it++;
+            continue;
         }
-        // FIXME: Check for existing path
-        char *path = g_strdup_printf("%s/%s", output_dir, fname);
-        FILE *fd = qemu_fopen(path, "wb");
-        if (fd) {
-            int s = fwrite(png.data(), png.size(), 1, fd);
-            if (s != 1) {
-                error_setg(&err, "Failed to write %s", path);
-            }
-            fclose(fd);
-        } else {
-            error_setg(&err, "Failed to open %s for writing", path);
+
+        if (!r->pixels.empty()) {
+            qemu_thread_join(&r->thread);
         }
-        g_free(path);
-    } else {
-        error_setg(&err, "Failed to encode PNG image");
+        r->on_complete(r->encoded, r->png);
+        delete r;
+        it = g_png_readbacks.erase(it);
     }
+}
 
-    if (err) {
-        xemu_queue_error_message(error_get_pretty(err));
-        error_report_err(err);
+bool PngReadbacksPending(void)
+{
+    return !g_png_readbacks.empty();
+}
+
+void SaveScreenshot(GLuint tex, bool flip)
+{
+    char fname[128];
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp) {
+        strftime(fname, sizeof(fname), "xemu-%Y-%m-%d-%H-%M-%S.png", tmp);
     } else {
-        char *msg = g_strdup_printf("Screenshot Saved: %s", fname);
-        xemu_queue_notification(msg);
-        free(msg);
+        strcpy(fname, "xemu.png");
+    }
+
+    const char *output_dir = g_config.general.screenshot_dir;
+    if (!strlen(output_dir)) {
+        output_dir = ".";
     }
+    // FIXME: Check for existing path
+    std::string path = std::string(output_dir) + "/" + fname;
+    std::string name = fname;
+
+    RenderFramebufferToPngAsync(tex, flip, [path, name](bool success,
+                                                        std::vector<uint8_t> &png) {
+        Error *err = NULL;
+
+        if (success) {
+            FILE *fd = qemu_fopen(path.c_str(), "wb");
+            if (fd) {
+                int s = fwrite(png.data(), png.size(), 1, fd);
+                if (s != 1) {
+                    error_setg(&err, "Failed to write %s", path.c_str());
+                }
+                fclose(fd);
+            } else {
+                error_setg(&err, "Failed to open %s for writing", path.c_str());
+            }
+        } else {
+            error_setg(&err, "Failed to encode PNG image");
+        }
+
+        if (err) {
+            xemu_queue_error_message(error_get_pretty(err));
+            error_report_err(err);
+        } else {
+            char *msg = g_strdup_printf("Screenshot Saved: %s", name.c_str());
+            xemu_queue_notification(msg);
+            free(msg);
+        }
+    });
 }
@@ -17,6 +17,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #pragma once
+#include <functional>
 #include <vector>
 #include "common.hh"
 #include "../xemu-input.h"
@@ -41,7 +42,9 @@ public:
 extern Fbo *controller_fbo, *xmu_fbo, *logo_fbo;
 extern GLuint g_icon_tex;
 
+GLuint Shader(GLenum type, const char *src);
 void InitCustomRendering(void);
+void InitMenuRendering(void);
 void RenderLogo(uint32_t time);
 void RenderController(float frame_x, float frame_y, uint32_t primary_color,
                       uint32_t secondary_color, ControllerState *state);
@@ -51,6 +54,16 @@ void RenderXmu(float frame_x, float frame_y, uint32_t primary_color,
                uint32_t secondary_color);
 void RenderFramebuffer(GLint tex, int width, int height, bool flip);
 void RenderFramebuffer(GLint tex, int width, int height, bool flip, float scale[2]);
+void RenderOverlay(GLuint tex, int width, int height);
 bool RenderFramebufferToPng(GLuint tex, bool flip, std::vector<uint8_t> &png, int max_width = 0, int max_height = 0);
+
+// Like RenderFramebufferToPng, but reads back through a pixel buffer and
+// encodes on a worker thread. on_complete is called on the UI thread by
+// ProcessPngReadbacks once the PNG is ready.
+typedef std::function<void(bool success, std::vector<uint8_t> &png)> PngCallback;
+void RenderFramebufferToPngAsync(GLuint tex, bool flip, PngCallback on_complete, int max_width = 0, int max_height = 0);
+void ProcessPngReadbacks(void);
+bool PngReadbacksPending(void);
 void SaveScreenshot(GLuint tex, bool flip);
+float GetDisplayAspectRatio(int width, int height);
 void ScaleDimensions(int src_width, int src_height, int max_width, int max_height, int *out_width, int *out_height);
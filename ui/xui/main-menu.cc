@@ -34,6 +34,7 @@
 #include "../xemu-input.h"
 #include "../xemu-notifications.h"
 #include "../xemu-settings.h"
+#include "../xemu-title-profiles.h"
 #include "../xemu-monitor.h"
 #include "../xemu-version.h"
 #include "../xemu-net.h"
@@ -68,6 +69,13 @@ void MainMenuGeneralView::Draw()
     Toggle("Cache shaders to disk", &g_config.perf.cache_shaders,
            "Reduce stutter in games by caching previously generated shaders");
 
+    Toggle("Pipelined GPU command processing", &g_config.perf.pipeline_pfifo,
+           "Parse GPU command buffers on a separate thread (requires restart)");
+
+    Toggle("Title profiles", &g_config.perf.title_profiles,
+           "Apply the settings of the profile of each title while it runs");
+    DrawTitleProfile();
+
     SectionTitle("Miscellaneous");
     Toggle("Skip startup animation", &g_config.general.skip_boot_anim,
            "Skip the full Xbox boot animation sequence");
@@ -78,6 +86,61 @@ void MainMenuGeneralView::Draw()
     //        "Limit DVD/HDD throughput to approximate Xbox load times");
 }
 
+void MainMenuGeneralView::DrawTitleProfile()
+{
+    uint32_t title_id = xemu_title_profiles_get_title_id();
+    if (!g_config.perf.title_profiles || !title_id) {
+        return;
+    }
+
+    // Item 0 leaves the setting unset, the others are first_value onwards
+    static const struct {
+        TitleProfileSetting setting;
+        int first_value;
+        const char *label;
+        const char *items;
+        const char *description;
+    } rows[] = {
+        { TITLE_PROFILE_OPTIMISTIC_ZPASS_REPORTS, 0,
+          "Optimistic occlusion queries", "Default\0Off\0On\0",
+          "Answer occlusion queries with the last known result instead of "
+          "waiting for the GPU" },
+        { TITLE_PROFILE_ASYNC_SHADERS, 0, "Asynchronous shaders",
+          "Default\0Disabled\0Wait\0Skip draw\0",
+          "Shader compilation policy (applies when the renderer is next "
+          "started)" },
+        { TITLE_PROFILE_USE_DSP, 0, "Real-time DSP processing",
+          "Default\0Off\0On\0", "Run the audio DSP instead of its high level "
+          "emulation" },
+        { TITLE_PROFILE_SURFACE_SCALE, 1, "Internal resolution scale",
+          "Default\0" "1x\0" "2x\0" "3x\0" "4x\0" "5x\0" "6x\0" "7x\0"
+          "8x\0" "9x\0" "10x\0",
+          "Surface scaling factor used while this title runs" },
+        { TITLE_PROFILE_SURFACE_SCALE_DISPLAY_ONLY, 0,
+          "Scale displayed surfaces only", "Default\0Off\0On\0",
+          "Render offscreen targets at native resolution" },
+        { TITLE_PROFILE_FAST_DISC_READS, 0, "Fast disc reads",
+          "Default\0Off\0On\0",
+          "Read each disc command at once instead of in chunks" },
+    };
+
+    g_autofree char *title = g_strdup_printf(
+        "Title Profile: %s", xemu_title_profiles_get_title_name());
+    SectionTitle(title);
+
+    for (const auto &row : rows) {
+        int value = xemu_title_profiles_get(title_id, row.setting);
+        int item = value == TITLE_PROFILE_UNSET ?
+                       0 :
+                       value - row.first_value + 1;
+        if (ChevronCombo(row.label, &item, row.items, row.description)) {
+            xemu_title_profiles_set(title_id, row.setting,
+                                    item == 0 ? TITLE_PROFILE_UNSET :
+                                                item - 1 + row.first_value);
+        }
+    }
+}
+
 bool MainMenuInputView::ConsumeRebindEvent(SDL_Event *event)
 {
     if (!m_rebinding) {
@@ -99,6 +162,8 @@ bool MainMenuInputView::IsInputRebinding()
 
 void MainMenuInputView::Draw()
 {
+    InitMenuRendering();
+
     SectionTitle("Controllers");
     ImGui::PushFont(g_font_mgr.m_menu_font_small);
 
@@ -787,8 +852,19 @@ void MainMenuDisplayView::Draw()
                      "3840x2160\0",
                      "Select preferred startup window size")) {
     }
-    Toggle("Vertical refresh sync", &g_config.display.window.vsync,
-           "Sync to screen vertical refresh to reduce tearing artifacts");
+    ChevronCombo("Vertical refresh sync",
+                 &g_config.display.window.present_mode,
+                 "On\0"
+                 "Adaptive\0"
+                 "Off\0"
+                 "Variable Refresh\0",
+                 "Sync to screen vertical refresh to reduce tearing "
+                 "artifacts. Adaptive sync does not wait for late frames, "
+                 "for lower latency at the cost of occasional tearing. "
+                 "Variable refresh presents once per guest frame, for "
+                 "G-Sync/FreeSync displays");
+    Toggle("Low latency input", &g_config.display.window.low_latency_input,
+           "Read input again right before each guest frame starts");
 
     SectionTitle("Interface");
     Toggle("Show main menu bar", &g_config.display.ui.show_menubar,
@@ -1186,7 +1262,12 @@ bool MainMenuSnapshotsView::BigSnapshotButton(QEMUSnapshotInfo *snapshot,
     draw_list->PushClipRect(p0, p1, true);
 
     // Snapshot thumbnail
-    GLuint thumbnail = data->gl_thumbnail ? data->gl_thumbnail : g_icon_tex;
+    GLuint thumbnail =
+        ImGui::IsItemVisible() ? xemu_snapshots_get_thumbnail(data) : 0;
+    if (!thumbnail) {
+        InitMenuRendering();
+        thumbnail = g_icon_tex;
+    }
     int thumbnail_width, thumbnail_height;
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, thumbnail);
@@ -1294,6 +1375,12 @@ void MainMenuSnapshotsView::Draw()
            &g_config.general.snapshots.filter_current_game,
            "Only display snapshots created while running the currently running "
            "XBE");
+    Toggle("Background saving",
+           &g_config.general.snapshots.incremental_quicksave,
+           "Save only the memory changed since the last save, and write it "
+           "out while the game keeps running");
+    Toggle("Rewind", &g_config.general.snapshots.rewind.enabled,
+           "Keep recent states in memory, press F9 to step back");
 
     if (g_config.general.snapshots.filter_current_game) {
         struct xbe *xbe = xemu_get_xbe_info();
@@ -45,6 +45,9 @@ public:
 
 class MainMenuGeneralView : public virtual MainMenuTabView
 {
+protected:
+    void DrawTitleProfile();
+
 public:
     void Draw() override;
 };
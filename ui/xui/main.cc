@@ -32,8 +32,10 @@
 #include <memory>
 
 #include "actions.hh"
+#include "capture.hh"
 #include "common.hh"
 #include "xemu-hud.h"
+#include "../xemu-capture.h"
 #include "misc.hh"
 #include "gl-helpers.hh"
 #include "input-manager.hh"
@@ -62,10 +64,20 @@ float g_main_menu_height;
 static ImGuiStyle g_base_style;
 static SDL_Window *g_sdl_window;
 static float g_last_scale;
-static int g_vsync;
+static int g_present_mode;
 static GLuint g_tex;
 static bool g_flip_req;
 
+// The UI is drawn into its own framebuffer, at its own rate, and composited
+// over the guest frame on every refresh. It is redrawn right away when input
+// arrives, and rarely while it has nothing on screen.
+#define UI_FRAME_INTERVAL_MS 16
+#define UI_IDLE_FRAME_INTERVAL_MS 100
+static Fbo *g_ui_fbo;
+static bool g_ui_dirty = true;
+static bool g_ui_visible;
+static uint32_t g_ui_last_frame;
+
 
 static void InitializeStyle()
 {
@@ -129,10 +141,32 @@ static void InitializeStyle()
     g_base_style = s;
 }
 
+static void UpdateSwapInterval()
+{
+    g_present_mode = g_config.display.window.present_mode;
+
+    switch (g_present_mode) {
+    case CONFIG_DISPLAY_WINDOW_PRESENT_MODE_FIFO_RELAXED:
+        // Adaptive sync, fall back to regular sync if unsupported
+        if (SDL_GL_SetSwapInterval(-1) == 0) {
+            break;
+        }
+        /* fall through */
+    case CONFIG_DISPLAY_WINDOW_PRESENT_MODE_FIFO:
+        SDL_GL_SetSwapInterval(1);
+        break;
+    case CONFIG_DISPLAY_WINDOW_PRESENT_MODE_IMMEDIATE:
+    case CONFIG_DISPLAY_WINDOW_PRESENT_MODE_VARIABLE:
+    default:
+        SDL_GL_SetSwapInterval(0);
+        break;
+    }
+}
+
 void xemu_hud_init(SDL_Window* window, void* sdl_gl_context)
 {
     xemu_monitor_init();
-    g_vsync = g_config.display.window.vsync;
+    UpdateSwapInterval();
 
     InitCustomRendering();
 
@@ -163,6 +197,10 @@ void xemu_hud_init(SDL_Window* window, void* sdl_gl_context)
 
 void xemu_hud_cleanup(void)
 {
+    xemu_capture_stop();
+    delete g_ui_fbo;
+    g_ui_fbo = NULL;
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -176,6 +214,7 @@ void xemu_hud_process_sdl_events(SDL_Event *event)
     }
 
     ImGui_ImplSDL2_ProcessEvent(event);
+    g_ui_dirty = true;
 }
 
 void xemu_hud_should_capture_kbd_mouse(int *kbd, int *mouse)
@@ -191,10 +230,9 @@ void xemu_hud_set_framebuffer_texture(GLuint tex, bool flip)
     g_flip_req = flip;
 }
 
-void xemu_hud_render(void)
+static void RenderUi(uint32_t now)
 {
     ImGuiIO& io = ImGui::GetIO();
-    uint32_t now = SDL_GetTicks();
 
     g_viewport_mgr.Update();
     g_font_mgr.Update();
@@ -205,12 +243,6 @@ void xemu_hud_render(void)
         g_last_scale = g_viewport_mgr.m_scale;
     }
 
-    if (!first_boot_window.is_open) {
-        int ww, wh;
-        SDL_GL_GetDrawableSize(g_sdl_window, &ww, &wh);
-        RenderFramebuffer(g_tex, ww, wh, g_flip_req);
-    }
-
     ImGui_ImplOpenGL3_NewFrame();
     io.ConfigFlags &= ~ImGuiConfigFlags_NavEnableGamepad;
     ImGui_ImplSDL2_NewFrame();
@@ -221,6 +253,12 @@ void xemu_hud_render(void)
     ImGui::NewFrame();
     ProcessKeyboardShortcuts();
 
+    char *hitch_summary = nv2a_profile_take_hitch_summary();
+    if (hitch_summary) {
+        notification_manager.QueueNotification(hitch_summary);
+        g_free(hitch_summary);
+    }
+
 #if defined(CONFIG_RENDERDOC)
     if (g_capture_renderdoc_frame) {
         nv2a_dbg_renderdoc_capture_frames(1, false);
@@ -306,12 +344,19 @@ void xemu_hud_render(void)
                 break;
             }
         }
+
+        if (g_config.general.snapshots.rewind.enabled &&
+            ImGui::IsKeyPressed(ImGuiKey_F9)) {
+            ActionRewind();
+        }
     }
 
     first_boot_window.Draw();
     monitor_window.Draw();
     apu_window.Draw();
     video_window.Draw();
+    network_window.Draw();
+    threads_window.Draw();
     compatibility_reporter_window.Draw();
 #if defined(_WIN32)
     update_window.Draw();
@@ -324,15 +369,68 @@ void xemu_hud_render(void)
     // if (show_demo) ImGui::ShowDemoWindow(&show_demo);
 
     ImGui::Render();
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    ImDrawData *draw_data = ImGui::GetDrawData();
+    ImGui_ImplOpenGL3_RenderDrawData(draw_data);
+    g_ui_visible = draw_data->TotalVtxCount > 0;
+}
+
+static bool IsUiFrameDue(uint32_t now)
+{
+    uint32_t interval =
+        g_ui_visible ? UI_FRAME_INTERVAL_MS : UI_IDLE_FRAME_INTERVAL_MS;
+    return g_ui_dirty || (now - g_ui_last_frame) >= interval;
+}
+
+bool xemu_hud_needs_render(void)
+{
+    return g_ui_dirty || PngReadbacksPending() ||
+           (g_ui_visible && IsUiFrameDue(SDL_GetTicks()));
+}
 
-    if (g_vsync != g_config.display.window.vsync) {
-        g_vsync = g_config.display.window.vsync;
-        SDL_GL_SetSwapInterval(g_vsync ? 1 : 0);
+void xemu_hud_render(void)
+{
+    uint32_t now = SDL_GetTicks();
+    int ww, wh;
+    SDL_GL_GetDrawableSize(g_sdl_window, &ww, &wh);
+
+    if (!first_boot_window.is_open) {
+        RenderFramebuffer(g_tex, ww, wh, g_flip_req);
+    }
+
+    if (!g_ui_fbo || g_ui_fbo->w != ww || g_ui_fbo->h != wh) {
+        delete g_ui_fbo;
+        g_ui_fbo = new Fbo(ww, wh);
+        g_ui_dirty = true;
+    }
+
+    if (IsUiFrameDue(now)) {
+        // Not Fbo::Target(), which does not nest with the FBOs used while
+        // drawing the UI
+        glBindFramebuffer(GL_FRAMEBUFFER, g_ui_fbo->fbo);
+        glViewport(0, 0, ww, wh);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        RenderUi(now);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        g_ui_last_frame = now;
+        g_ui_dirty = false;
+    }
+
+    if (g_ui_visible) {
+        RenderOverlay(g_ui_fbo->Texture(), ww, wh);
+    }
+
+    if (g_present_mode != g_config.display.window.present_mode) {
+        UpdateSwapInterval();
     }
 
     if (g_screenshot_pending) {
         SaveScreenshot(g_tex, g_flip_req);
         g_screenshot_pending = false;
     }
+    ProcessPngReadbacks();
+
+    if (!first_boot_window.is_open) {
+        CaptureVideoFrame(g_tex, g_flip_req);
+    }
 }
@@ -17,6 +17,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include "ui/xemu-notifications.h"
+#include "ui/xemu-capture.h"
 #include "common.hh"
 #include "main-menu.hh"
 #include "menubar.hh"
@@ -28,6 +29,7 @@
 #include "compat.hh"
 #include "update.hh"
 #include "../xemu-os-utils.h"
+#include "hw/xbox/xbox_sampler.h"
 
 extern float g_main_menu_height; // FIXME
 
@@ -94,6 +96,10 @@ void ShowMainMenu()
         {
             if (ImGui::MenuItem(running ? "Pause" : "Resume", SHORTCUT_MENU_TEXT(P))) ActionTogglePause();
             if (ImGui::MenuItem("Screenshot", "F12")) ActionScreenshot();
+            if (ImGui::MenuItem(xemu_capture_is_active() ? "Stop Recording" :
+                                                           "Start Recording")) {
+                ActionToggleRecording();
+            }
 
             if (ImGui::BeginMenu("Snapshot")) {
                 if (ImGui::MenuItem("Create Snapshot")) {
@@ -204,7 +210,15 @@ void ShowMainMenu()
             HelpMarker("Controls how the rendered content should be scaled "
                        "into the window");
             ImGui::Combo("Filter Method", &g_config.display.filtering,
-                         "Linear\0Nearest\0");
+                         "Linear\0Nearest\0Sharp\0");
+            ImGui::SameLine();
+            HelpMarker("Sharp upscales with a contrast adaptive sharpening "
+                       "filter, a cheaper alternative to a higher internal "
+                       "resolution scale");
+            if (g_config.display.filtering == CONFIG_DISPLAY_FILTERING_SHARP) {
+                ImGui::SliderFloat("Sharpness", &g_config.display.sharpness,
+                                   0.0f, 1.0f);
+            }
             ImGui::Combo("Aspect Ratio", &g_config.display.ui.aspect_ratio,
                          "Native\0Auto\0""4:3\0""16:9\0");
             if (ImGui::MenuItem("Fullscreen", "F11",
@@ -220,6 +234,20 @@ void ShowMainMenu()
             ImGui::MenuItem("Monitor", "~", &monitor_window.is_open);
             ImGui::MenuItem("Audio", NULL, &apu_window.m_is_open);
             ImGui::MenuItem("Video", NULL, &video_window.m_is_open);
+            ImGui::MenuItem("Network", NULL, &network_window.m_is_open);
+            ImGui::MenuItem("Threads", NULL, &threads_window.m_is_open);
+            if (ImGui::MenuItem("NV2A: Capture Commands", NULL,
+                                nv2a_dbg_capture_active())) {
+                ActionToggleCommandCapture();
+            }
+            if (ImGui::MenuItem("Record Timeline", NULL,
+                                timeline_is_active())) {
+                ActionToggleTimeline();
+            }
+            if (ImGui::MenuItem("Record Profile", NULL,
+                                xbox_sampler_is_running())) {
+                ActionToggleProfiler();
+            }
 #ifdef CONFIG_RENDERDOC
             if (nv2a_dbg_renderdoc_available()) {
                 ImGui::MenuItem("RenderDoc: Capture", NULL, &g_capture_renderdoc_frame);
@@ -17,9 +17,9 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include "ui/xemu-notifications.h"
+#include "ui/xemu-library.h"
 #include <string>
 #include <vector>
-#include <filesystem>
 #include <map>
 #include "misc.hh"
 #include "actions.hh"
@@ -342,12 +342,14 @@ public:
 
 class GamesPopupMenu : public virtual PopupMenu {
 protected:
-    std::multimap<std::string, std::string> sorted_file_names;
+    std::vector<std::pair<std::string, std::string>> games;
+    bool scanning = false;
 
 public:
     void Show(const ImVec2 &direction) override
     {
         PopupMenu::Show(direction);
+        xemu_library_refresh();
         PopulateGameList();
     }
 
@@ -359,7 +361,12 @@ public:
             ImGui::SetKeyboardFocusHere();
         }
 
-        for (const auto &[label, file_path] : sorted_file_names) {
+        // Pick up the images read since, until the scan is done
+        if (scanning) {
+            PopulateGameList();
+        }
+
+        for (const auto &[label, file_path] : games) {
             if (PopupMenuButton(label, ICON_FA_COMPACT_DISC)) {
                 ActionLoadDiscFile(file_path.c_str());
                 nav.ClearMenuStack();
@@ -367,8 +374,10 @@ public:
             }
         }
 
-        if (sorted_file_names.size() == 0) {
-            if (PopupMenuButton("No games found", ICON_FA_SLIDERS)) {
+        if (games.size() == 0) {
+            if (scanning) {
+                PopupMenuButton("Looking for games...", ICON_FA_HOURGLASS);
+            } else if (PopupMenuButton("No games found", ICON_FA_SLIDERS)) {
                 nav.ClearMenuStack();
                 g_scene_mgr.PushScene(g_main_menu);
             }
@@ -381,22 +390,15 @@ public:
     }
 
     void PopulateGameList() {
-        const char *games_dir = g_config.general.games_dir;
-
-        sorted_file_names.clear();
-        std::filesystem::path directory(games_dir);
-        if (std::filesystem::is_directory(directory)) {
-            for (const auto &file :
-                 std::filesystem::directory_iterator(directory)) {
-                const auto &file_path = file.path();
-                if (std::filesystem::is_regular_file(file_path) &&
-                    (file_path.extension() == ".iso" ||
-                     file_path.extension() == ".xiso")) {
-                    sorted_file_names.insert(
-                        { file_path.stem().string(), file_path.string() });
-                }
-            }
+        scanning = xemu_library_is_scanning();
+
+        size_t num_entries;
+        XemuLibraryEntry *entries = xemu_library_get_entries(&num_entries);
+        games.clear();
+        for (size_t i = 0; i < num_entries; i++) {
+            games.emplace_back(entries[i].name, entries[i].path);
         }
+        xemu_library_free_entries(entries, num_entries);
     }
 };
 
@@ -536,6 +536,8 @@ void HelpMarker(const char* desc)
 
 void Logo()
 {
+    InitMenuRendering();
+
     ImGui::SetCursorPosY(ImGui::GetCursorPosY()-25*g_viewport_mgr.m_scale);
     ImGui::SetCursorPosX((ImGui::GetWindowWidth()-256*g_viewport_mgr.m_scale)/2);
 
@@ -0,0 +1,218 @@
+/*
+ * Reference counted string builder
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/mstring.h"
+
+#define ARENA_CHUNK_SIZE (64 * KiB)
+#define ARENA_ALIGN sizeof(void *)
+#define MSTRING_MIN_ALLOC 32
+
+typedef struct MStringArenaChunk {
+    struct MStringArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} MStringArenaChunk;
+
+struct MStringArena {
+    MStringArenaChunk *chunks; /* Most recent first, allocated from */
+    int depth;
+};
+
+static __thread MStringArena *current_arena;
+
+void mstring_arena_begin(void)
+{
+    if (!current_arena) {
+        current_arena = g_new0(MStringArena, 1);
+    }
+    current_arena->depth++;
+}
+
+void mstring_arena_end(void)
+{
+    MStringArena *arena = current_arena;
+    assert(arena && arena->depth > 0);
+
+    if (--arena->depth) {
+        return;
+    }
+
+    while (arena->chunks) {
+        MStringArenaChunk *next = arena->chunks->next;
+        g_free(arena->chunks);
+        arena->chunks = next;
+    }
+    g_free(arena);
+    current_arena = NULL;
+}
+
+static void *arena_alloc(MStringArena *arena, size_t size)
+{
+    size = ROUND_UP(size, ARENA_ALIGN);
+
+    MStringArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = MAX(size, ARENA_CHUNK_SIZE);
+        chunk = g_malloc(sizeof(MStringArenaChunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/* Grows the most recent allocation in place, if there is room after it */
+static bool arena_try_extend(MStringArena *arena, void *ptr, size_t old_size,
+                             size_t new_size)
+{
+    MStringArenaChunk *chunk = arena->chunks;
+    if (!chunk || (char *)ptr + old_size != chunk->data + chunk->used ||
+        chunk->size - chunk->used < new_size - old_size) {
+        return false;
+    }
+
+    chunk->used += new_size - old_size;
+    return true;
+}
+
+static MString *mstring_alloc(size_t alloc)
+{
+    MStringArena *arena = current_arena;
+    MString *mstr;
+
+    alloc = MAX(alloc, MSTRING_MIN_ALLOC);
+    if (arena) {
+        alloc = ROUND_UP(alloc, ARENA_ALIGN);
+        mstr = arena_alloc(arena, sizeof(MString));
+        mstr->str = arena_alloc(arena, alloc);
+    } else {
+        mstr = g_new(MString, 1);
+        mstr->str = g_malloc(alloc);
+    }
+
+    mstr->str[0] = '\0';
+    mstr->len = 0;
+    mstr->alloc = alloc;
+    mstr->refcnt = 1;
+    mstr->arena = arena;
+
+    return mstr;
+}
+
+static void mstring_reserve(MString *mstr, size_t extra)
+{
+    size_t needed = mstr->len + extra + 1;
+    if (needed <= mstr->alloc) {
+        return;
+    }
+
+    size_t alloc = MAX(needed, mstr->alloc * 2);
+    if (!mstr->arena) {
+        mstr->str = g_realloc(mstr->str, alloc);
+    } else {
+        alloc = ROUND_UP(alloc, ARENA_ALIGN);
+        if (!arena_try_extend(mstr->arena, mstr->str, mstr->alloc, alloc)) {
+            char *str = arena_alloc(mstr->arena, alloc);
+            memcpy(str, mstr->str, mstr->len + 1);
+            mstr->str = str;
+        }
+    }
+    mstr->alloc = alloc;
+}
+
+static void mstring_append_len(MString *mstr, const char *str, size_t len)
+{
+    mstring_reserve(mstr, len);
+    memcpy(mstr->str + mstr->len, str, len);
+    mstr->len += len;
+    mstr->str[mstr->len] = '\0';
+}
+
+static void G_GNUC_PRINTF(2, 0)
+mstring_append_vfmt(MString *mstr, const char *fmt, va_list args)
+{
+    va_list args2;
+    va_copy(args2, args);
+
+    size_t avail = mstr->alloc - mstr->len;
+    int len = vsnprintf(mstr->str + mstr->len, avail, fmt, args);
+    assert(len >= 0);
+
+    if ((size_t)len >= avail) {
+        mstring_reserve(mstr, len);
+        vsnprintf(mstr->str + mstr->len, len + 1, fmt, args2);
+    }
+    mstr->len += len;
+
+    va_end(args2);
+}
+
+MString *mstring_new(void)
+{
+    return mstring_alloc(0);
+}
+
+MString *mstring_from_str(const char *str)
+{
+    size_t len = strlen(str);
+    MString *mstr = mstring_alloc(len + 1);
+    mstring_append_len(mstr, str, len);
+    return mstr;
+}
+
+MString *mstring_from_fmt(const char *fmt, ...)
+{
+    MString *mstr = mstring_alloc(0);
+
+    va_list args;
+    va_start(args, fmt);
+    mstring_append_vfmt(mstr, fmt, args);
+    va_end(args);
+
+    return mstr;
+}
+
+void mstring_append(MString *mstr, const char *str)
+{
+    mstring_append_len(mstr, str, strlen(str));
+}
+
+void mstring_append_fmt(MString *mstr, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    mstring_append_vfmt(mstr, fmt, args);
+    va_end(args);
+}
+
+void mstring_unref(MString *mstr)
+{
+    mstr->refcnt--;
+    if (mstr->refcnt == 0 && !mstr->arena) {
+        g_free(mstr->str);
+        g_free(mstr);
+    }
+}
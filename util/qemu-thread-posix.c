@@ -17,6 +17,8 @@
 #include "qemu-thread-common.h"
 #include "qemu/tsan.h"
 #include "qemu/bitmap.h"
+#include "qemu/thread-stats.h"
+#include "qemu/timeline.h"
 
 #ifdef CONFIG_PTHREAD_SET_NAME_NP
 #include <pthread_np.h>
@@ -371,6 +373,10 @@ static void *qemu_thread_start(void *args)
 # endif
     }
     QEMU_TSAN_ANNOTATE_THREAD_NAME(qemu_thread_args->name);
+    if (qemu_thread_args->name) {
+        timeline_set_thread_name(qemu_thread_args->name);
+        thread_stats_register_self(qemu_thread_args->name);
+    }
     g_free(qemu_thread_args->name);
     g_free(qemu_thread_args);
 
@@ -422,6 +428,8 @@ void qemu_thread_create(QemuThread *thread, const char *name,
     sigdelset(&set, SIGSEGV);
     sigdelset(&set, SIGFPE);
     sigdelset(&set, SIGILL);
+    /* Reserved for sampling threads, see thread_stats_sample() */
+    sigdelset(&set, SIGPROF);
     /* TODO avoid SIGBUS loss on macOS */
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
 
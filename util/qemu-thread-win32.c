@@ -14,6 +14,8 @@
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/thread-stats.h"
+#include "qemu/timeline.h"
 #include "qemu-thread-common.h"
 #include <process.h>
 
@@ -235,6 +237,7 @@ struct QemuThreadData {
     /* Passed to win32_start_routine.  */
     void             *(*start_routine)(void *);
     void             *arg;
+    char             *name;
     short             mode;
     NotifierList      exit;
 
@@ -279,6 +282,12 @@ static unsigned __stdcall win32_start_routine(void *arg)
     void *thread_arg = data->arg;
 
     qemu_thread_data = data;
+    if (data->name) {
+        timeline_set_thread_name(data->name);
+        thread_stats_register_self(data->name);
+        g_free(data->name);
+        data->name = NULL;
+    }
     qemu_thread_exit(start_routine(thread_arg));
     abort();
 }
@@ -357,6 +366,7 @@ void qemu_thread_create(QemuThread *thread, const char *name,
     data = g_malloc(sizeof *data);
     data->start_routine = start_routine;
     data->arg = arg;
+    data->name = g_strdup(name);
     data->mode = mode;
     data->exited = false;
     notifier_list_init(&data->exit);
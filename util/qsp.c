@@ -642,6 +642,44 @@ static void qsp_mktree(GTree *tree, bool callsite_coalesce)
     qht_destroy(htp);
 }
 
+typedef struct QSPObjStats {
+    const void *obj;
+    uint64_t n_acqs;
+    uint64_t ns;
+} QSPObjStats;
+
+static void qsp_iter_obj(void *p, uint32_t h, void *up)
+{
+    const QSPEntry *e = p;
+    QSPObjStats *stats = up;
+
+    if (e->callsite->obj == stats->obj) {
+        stats->n_acqs += qatomic_read_u64(&e->n_acqs);
+        stats->ns += qatomic_read_u64(&e->ns);
+    }
+}
+
+void qsp_get_obj_stats(const void *obj, uint64_t *n_acqs, uint64_t *ns)
+{
+    QSPObjStats total = { .obj = obj };
+    QSPObjStats base = { .obj = obj };
+
+    qsp_init();
+
+    /* As in qsp_mktree(), read the snapshot first */
+    WITH_RCU_READ_LOCK_GUARD() {
+        QSPSnapshot *snap = qatomic_rcu_read(&qsp_snapshot);
+
+        if (snap) {
+            qht_iter(&snap->ht, qsp_iter_obj, &base);
+        }
+        qht_iter(&qsp_ht, qsp_iter_obj, &total);
+    }
+
+    *n_acqs = total.n_acqs - base.n_acqs;
+    *ns = total.ns - base.ns;
+}
+
 /* free string with g_free */
 static char *qsp_at(const QSPCallSite *callsite)
 {
@@ -0,0 +1,570 @@
+/*
+ * Per-thread CPU time and lock contention statistics
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread-stats.h"
+#include "qemu/atomic.h"
+#include "qemu/notify.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#elif defined(__linux__)
+#include <ucontext.h>
+#endif
+
+#define THREAD_STATS_NAME_LEN 32
+
+/* Samples of a thread not yet drained by the sampler, more are dropped */
+#define THREAD_STATS_SAMPLE_RING 8
+
+typedef struct ThreadSample {
+    uintptr_t pc;
+    uintptr_t context;
+} ThreadSample;
+
+typedef struct ThreadEntry {
+    QLIST_ENTRY(ThreadEntry) next;
+    Notifier exit_notifier;
+    char name[THREAD_STATS_NAME_LEN];
+    int tid;
+#if defined(_WIN32)
+    HANDLE handle;
+#elif defined(__APPLE__)
+    mach_port_t port;
+#else
+    clockid_t clock;
+    pthread_t thread;
+#endif
+    int64_t prev_cpu_ns;
+    int64_t sample_cpu_ns;
+    double utilization;
+    ThreadStatsContextFunc context_func;
+    void *context_opaque;
+#if defined(__linux__)
+    /* Written by the thread's SIGPROF handler, drained by the sampler */
+    ThreadSample samples[THREAD_STATS_SAMPLE_RING];
+    unsigned int samples_head;
+    unsigned int samples_tail;
+#endif
+} ThreadEntry;
+
+typedef struct LockEntry {
+    QLIST_ENTRY(LockEntry) next;
+    const char *name;
+    const void *lock;
+    uint64_t prev_wait_ns;
+    double wait_fraction;
+} LockEntry;
+
+/*
+ * Not a QemuMutex, which the synchronization profiler would measure. Only
+ * held briefly, callbacks of thread_stats_foreach_thread() must not block.
+ * Sampling holds it while stopping each thread, typically for microseconds.
+ */
+static QemuSpin thread_stats_lock;
+static QLIST_HEAD(, ThreadEntry) thread_stats_threads;
+static QLIST_HEAD(, LockEntry) thread_stats_locks;
+static int64_t thread_stats_prev_update;
+
+static __thread ThreadEntry *thread_stats_self;
+
+/* CPU time of a registered thread, -1 if it cannot be read */
+static int64_t thread_stats_get_cpu_ns(ThreadEntry *t)
+{
+#if defined(_WIN32)
+    FILETIME creation, exit_time, kernel, user;
+    if (!GetThreadTimes(t->handle, &creation, &exit_time, &kernel, &user)) {
+        return -1;
+    }
+    uint64_t ticks = ((uint64_t)kernel.dwHighDateTime << 32 |
+                      kernel.dwLowDateTime) +
+                     ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    return ticks * 100;
+#elif defined(__APPLE__)
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(t->port, THREAD_BASIC_INFO, (thread_info_t)&info,
+                    &count) != KERN_SUCCESS) {
+        return -1;
+    }
+    return (info.user_time.seconds + info.system_time.seconds) *
+               NANOSECONDS_PER_SECOND +
+           (info.user_time.microseconds + info.system_time.microseconds) *
+               SCALE_US;
+#else
+    struct timespec ts;
+    if (clock_gettime(t->clock, &ts)) {
+        return -1;
+    }
+    return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Threads not created by QEMU are forgotten when the process exits, possibly
+ * from another thread.
+ */
+static void thread_stats_unregister(Notifier *n, void *data)
+{
+    ThreadEntry *t = container_of(n, ThreadEntry, exit_notifier);
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_REMOVE(t, next);
+    qemu_spin_unlock(&thread_stats_lock);
+
+#ifdef _WIN32
+    CloseHandle(t->handle);
+#endif
+    if (thread_stats_self == t) {
+        thread_stats_self = NULL;
+    }
+    g_free(t);
+}
+
+void thread_stats_register_self(const char *name)
+{
+    if (thread_stats_self) {
+        return;
+    }
+
+    ThreadEntry *t = g_new0(ThreadEntry, 1);
+    pstrcpy(t->name, sizeof(t->name), name);
+    t->tid = qemu_get_thread_id();
+#if defined(_WIN32)
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                         GetCurrentProcess(), &t->handle,
+                         THREAD_QUERY_LIMITED_INFORMATION |
+                             THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT,
+                         FALSE, 0)) {
+        g_free(t);
+        return;
+    }
+#elif defined(__APPLE__)
+    t->port = pthread_mach_thread_np(pthread_self());
+#else
+    t->thread = pthread_self();
+    if (pthread_getcpuclockid(t->thread, &t->clock)) {
+        g_free(t);
+        return;
+    }
+#endif
+    t->prev_cpu_ns = thread_stats_get_cpu_ns(t);
+    t->sample_cpu_ns = t->prev_cpu_ns;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_INSERT_HEAD(&thread_stats_threads, t, next);
+    qemu_spin_unlock(&thread_stats_lock);
+
+    thread_stats_self = t;
+    t->exit_notifier.notify = thread_stats_unregister;
+    qemu_thread_atexit_add(&t->exit_notifier);
+}
+
+void thread_stats_register_lock(const char *name, const void *lock)
+{
+    LockEntry *l = g_new0(LockEntry, 1);
+    l->name = name;
+    l->lock = lock;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_INSERT_HEAD(&thread_stats_locks, l, next);
+    qemu_spin_unlock(&thread_stats_lock);
+}
+
+void thread_stats_unregister_lock(const void *lock)
+{
+    LockEntry *l;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_FOREACH(l, &thread_stats_locks, next) {
+        if (l->lock == lock) {
+            QLIST_REMOVE(l, next);
+            g_free(l);
+            break;
+        }
+    }
+    qemu_spin_unlock(&thread_stats_lock);
+}
+
+/* Copies the registered locks, whose totals are read without the spinlock */
+static int thread_stats_get_locks(LockEntry **locks)
+{
+    LockEntry *l;
+    int num_locks = 0;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_FOREACH(l, &thread_stats_locks, next) {
+        num_locks++;
+    }
+    *locks = g_new(LockEntry, num_locks);
+    num_locks = 0;
+    QLIST_FOREACH(l, &thread_stats_locks, next) {
+        (*locks)[num_locks++] = *l;
+    }
+    qemu_spin_unlock(&thread_stats_lock);
+
+    return num_locks;
+}
+
+void thread_stats_update(void)
+{
+    int64_t now = get_clock();
+    double interval = now - thread_stats_prev_update;
+    g_autofree LockEntry *locks = NULL;
+    int num_locks = thread_stats_get_locks(&locks);
+    ThreadEntry *t;
+    LockEntry *l;
+
+    g_autofree uint64_t *wait_ns = g_new(uint64_t, num_locks);
+    for (int i = 0; i < num_locks; i++) {
+        uint64_t n_acqs;
+        qsp_get_obj_stats(locks[i].lock, &n_acqs, &wait_ns[i]);
+    }
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_FOREACH(t, &thread_stats_threads, next) {
+        int64_t cpu_ns = thread_stats_get_cpu_ns(t);
+        if (cpu_ns < 0) {
+            continue;
+        }
+        if (thread_stats_prev_update && t->prev_cpu_ns >= 0) {
+            t->utilization = (cpu_ns - t->prev_cpu_ns) / interval;
+        }
+        t->prev_cpu_ns = cpu_ns;
+    }
+    QLIST_FOREACH(l, &thread_stats_locks, next) {
+        for (int i = 0; i < num_locks; i++) {
+            if (locks[i].lock != l->lock) {
+                continue;
+            }
+            /* Waits go backwards when the profiler is reset */
+            if (thread_stats_prev_update && wait_ns[i] >= l->prev_wait_ns) {
+                l->wait_fraction = (wait_ns[i] - l->prev_wait_ns) / interval;
+            } else {
+                l->wait_fraction = 0;
+            }
+            l->prev_wait_ns = wait_ns[i];
+            break;
+        }
+    }
+    thread_stats_prev_update = now;
+    qemu_spin_unlock(&thread_stats_lock);
+}
+
+void thread_stats_foreach_thread(ThreadStatsThreadFunc func, void *opaque)
+{
+    ThreadEntry *t;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_FOREACH(t, &thread_stats_threads, next) {
+        ThreadStatsThread thread = {
+            .name = t->name,
+            .tid = t->tid,
+            .cpu_ns = MAX(t->prev_cpu_ns, 0),
+            .utilization = t->utilization,
+        };
+        func(&thread, opaque);
+    }
+    qemu_spin_unlock(&thread_stats_lock);
+}
+
+void thread_stats_foreach_lock(ThreadStatsLockFunc func, void *opaque)
+{
+    g_autofree LockEntry *locks = NULL;
+    int num_locks = thread_stats_get_locks(&locks);
+
+    for (int i = 0; i < num_locks; i++) {
+        ThreadStatsLock lock = {
+            .name = locks[i].name,
+            .wait_fraction = locks[i].wait_fraction,
+        };
+        qsp_get_obj_stats(locks[i].lock, &lock.acquisitions, &lock.wait_ns);
+        func(&lock, opaque);
+    }
+}
+
+void thread_stats_set_sample_context(int tid, ThreadStatsContextFunc func,
+                                     void *opaque)
+{
+    ThreadEntry *t;
+
+    qemu_spin_lock(&thread_stats_lock);
+    QLIST_FOREACH(t, &thread_stats_threads, next) {
+        if (t->tid == tid) {
+            /* The handler reads the function first, see below */
+            if (func) {
+                qatomic_set(&t->context_opaque, opaque);
+            }
+            qatomic_store_release(&t->context_func, func);
+            break;
+        }
+    }
+    qemu_spin_unlock(&thread_stats_lock);
+}
+
+/* Called in the thread's signal handler, or with the thread stopped */
+static uintptr_t thread_stats_get_context(ThreadEntry *t)
+{
+    ThreadStatsContextFunc func = qatomic_load_acquire(&t->context_func);
+    return func ? func(qatomic_read(&t->context_opaque)) : 0;
+}
+
+#if defined(__linux__)
+/*
+ * A thread is sampled by sending it SIGPROF, whose handler records the
+ * interrupted program counter in the thread's own ring and returns, without
+ * waiting for the sampler. The sampler drains the rings on its next round,
+ * so a sample is reported about one sampling period after it was taken.
+ *
+ * SIGPROF is reserved for this: it is left unblocked in QEMU's threads
+ * (see qemu_thread_create()) and nothing else may install a handler for it.
+ * A thread that has it blocked is simply sampled once it unblocks it.
+ */
+static uintptr_t thread_stats_get_context_pc(void *ctx)
+{
+    ucontext_t *uc = ctx;
+#if defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+    return uc->uc_mcontext.pc;
+#else
+    return 0;
+#endif
+}
+
+static void thread_stats_sample_handler(int sig, siginfo_t *info, void *ctx)
+{
+    ThreadEntry *t = thread_stats_self;
+
+    if (!t) {
+        return;
+    }
+
+    /* Single producer, the handler is not reentered while it runs */
+    unsigned int head = t->samples_head;
+    if (head - qatomic_load_acquire(&t->samples_tail) <
+        THREAD_STATS_SAMPLE_RING) {
+        ThreadSample *sample = &t->samples[head % THREAD_STATS_SAMPLE_RING];
+        sample->pc = thread_stats_get_context_pc(ctx);
+        sample->context = thread_stats_get_context(t);
+        qatomic_store_release(&t->samples_head, head + 1);
+    }
+}
+
+static bool thread_stats_sample_init(void)
+{
+    static bool initialized;
+    struct sigaction act = {
+        .sa_sigaction = thread_stats_sample_handler,
+        .sa_flags = SA_SIGINFO | SA_RESTART,
+    };
+
+    if (!initialized) {
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGPROF, &act, NULL)) {
+            return false;
+        }
+        initialized = true;
+    }
+    return true;
+}
+
+static void thread_stats_drain_samples(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+    unsigned int head = qatomic_load_acquire(&t->samples_head);
+
+    for (unsigned int i = t->samples_tail; i != head; i++) {
+        ThreadSample *sample = &t->samples[i % THREAD_STATS_SAMPLE_RING];
+        func(thread, sample->pc, sample->context, opaque);
+    }
+    qatomic_store_release(&t->samples_tail, head);
+}
+
+static bool thread_stats_sample_thread(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+    /* Reported by thread_stats_drain_samples() on the next round */
+    return !pthread_kill(t->thread, SIGPROF);
+}
+#elif defined(_WIN32)
+static bool thread_stats_sample_init(void)
+{
+    return true;
+}
+
+static void thread_stats_drain_samples(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+}
+
+static bool thread_stats_sample_thread(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+    ThreadSample sample = { 0 };
+
+    if (SuspendThread(t->handle) == (DWORD)-1) {
+        return false;
+    }
+
+    /* Also waits for the thread to actually be suspended */
+    CONTEXT ctx = { .ContextFlags = CONTEXT_CONTROL };
+    bool ok = GetThreadContext(t->handle, &ctx);
+    if (ok) {
+#if defined(__x86_64__)
+        sample.pc = ctx.Rip;
+#elif defined(__aarch64__)
+        sample.pc = ctx.Pc;
+#endif
+        sample.context = thread_stats_get_context(t);
+    }
+
+    ResumeThread(t->handle);
+
+    if (ok) {
+        func(thread, sample.pc, sample.context, opaque);
+    }
+    return ok;
+}
+#elif defined(__APPLE__)
+static bool thread_stats_sample_init(void)
+{
+    return true;
+}
+
+static void thread_stats_drain_samples(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+}
+
+static bool thread_stats_sample_thread(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+    ThreadSample sample = { 0 };
+
+    if (thread_suspend(t->port) != KERN_SUCCESS) {
+        return false;
+    }
+
+#if defined(__x86_64__)
+    x86_thread_state64_t state;
+    mach_msg_type_number_t count = x86_THREAD_STATE64_COUNT;
+    bool ok = thread_get_state(t->port, x86_THREAD_STATE64,
+                               (thread_state_t)&state, &count) ==
+              KERN_SUCCESS;
+    if (ok) {
+        sample.pc = state.__rip;
+    }
+#elif defined(__aarch64__)
+    arm_thread_state64_t state;
+    mach_msg_type_number_t count = ARM_THREAD_STATE64_COUNT;
+    bool ok = thread_get_state(t->port, ARM_THREAD_STATE64,
+                               (thread_state_t)&state, &count) ==
+              KERN_SUCCESS;
+    if (ok) {
+        sample.pc = arm_thread_state64_get_pc(state);
+    }
+#else
+    bool ok = true;
+#endif
+    if (ok) {
+        sample.context = thread_stats_get_context(t);
+    }
+
+    thread_resume(t->port);
+
+    if (ok) {
+        func(thread, sample.pc, sample.context, opaque);
+    }
+    return ok;
+}
+#else
+static bool thread_stats_sample_init(void)
+{
+    return false;
+}
+
+static void thread_stats_drain_samples(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+}
+
+static bool thread_stats_sample_thread(ThreadEntry *t,
+                                       ThreadStatsSampleFunc func,
+                                       const ThreadStatsThread *thread,
+                                       void *opaque)
+{
+    return false;
+}
+#endif
+
+bool thread_stats_sample(ThreadStatsSampleFunc func, void *opaque)
+{
+    ThreadEntry *t;
+
+    /* Also keeps the threads from exiting while they are sampled */
+    qemu_spin_lock(&thread_stats_lock);
+    if (!thread_stats_sample_init()) {
+        qemu_spin_unlock(&thread_stats_lock);
+        return false;
+    }
+    QLIST_FOREACH(t, &thread_stats_threads, next) {
+        if (t == thread_stats_self) {
+            continue;
+        }
+
+        int64_t cpu_ns = thread_stats_get_cpu_ns(t);
+        ThreadStatsThread thread = {
+            .name = t->name,
+            .tid = t->tid,
+            .cpu_ns = MAX(cpu_ns, 0),
+            .utilization = t->utilization,
+        };
+
+        /* Taken on earlier rounds, even if the thread has gone idle since */
+        thread_stats_drain_samples(t, func, &thread, opaque);
+
+        /* Like a CPU time profiler, threads that are waiting are skipped */
+        if (cpu_ns < 0 || cpu_ns == t->sample_cpu_ns) {
+            continue;
+        }
+        t->sample_cpu_ns = cpu_ns;
+
+        thread_stats_sample_thread(t, func, &thread, opaque);
+    }
+    qemu_spin_unlock(&thread_stats_lock);
+
+    return true;
+}
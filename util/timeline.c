@@ -0,0 +1,231 @@
+/*
+ * Cross-thread timeline tracer
+ *
+ * Copyright (c) 2025 Matt Borgerson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timeline.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+/* Per thread, only the most recent events are kept once a ring is full */
+#define TIMELINE_BUFFER_EVENTS (1 << 16)
+#define TIMELINE_THREAD_NAME_LEN 32
+
+typedef struct TimelineEvent {
+    const char *name;
+    const char *detail;
+    int64_t start;
+    int64_t end;
+} TimelineEvent;
+
+typedef struct TimelineBuffer {
+    QSLIST_ENTRY(TimelineBuffer) next;
+    int tid;
+    char name[TIMELINE_THREAD_NAME_LEN];
+
+    /*
+     * Only the owning thread writes the events and head. A buffer last
+     * written in an earlier recording is reset when its thread next records.
+     */
+    unsigned int generation;
+    uint32_t head;
+    TimelineEvent events[TIMELINE_BUFFER_EVENTS];
+} TimelineBuffer;
+
+bool timeline_active;
+
+static unsigned int timeline_generation;
+static int64_t timeline_start_time;
+static QSLIST_HEAD(, TimelineBuffer) timeline_buffers;
+
+static __thread TimelineBuffer *timeline_buffer;
+static __thread char timeline_thread_name[TIMELINE_THREAD_NAME_LEN];
+
+int64_t timeline_clock(void)
+{
+    return get_clock();
+}
+
+static TimelineBuffer *timeline_register_thread(void)
+{
+    TimelineBuffer *buf = g_malloc0(sizeof(*buf));
+    buf->tid = qemu_get_thread_id();
+    if (timeline_thread_name[0]) {
+        pstrcpy(buf->name, sizeof(buf->name), timeline_thread_name);
+    } else {
+        snprintf(buf->name, sizeof(buf->name), "thread %d", buf->tid);
+    }
+
+    /* Buffers outlive their threads so the trace can still be written */
+    QSLIST_INSERT_HEAD_ATOMIC(&timeline_buffers, buf, next);
+    timeline_buffer = buf;
+
+    return buf;
+}
+
+void timeline_record(const char *name, const char *detail, int64_t start)
+{
+    if (!qatomic_read(&timeline_active)) {
+        return;
+    }
+
+    TimelineBuffer *buf = timeline_buffer;
+    if (!buf) {
+        buf = timeline_register_thread();
+    }
+
+    unsigned int generation = qatomic_read(&timeline_generation);
+    if (buf->generation != generation) {
+        qatomic_set(&buf->head, 0);
+        qatomic_store_release(&buf->generation, generation);
+    }
+
+    uint32_t head = buf->head;
+    TimelineEvent *ev = &buf->events[head % TIMELINE_BUFFER_EVENTS];
+    ev->name = name;
+    ev->detail = detail;
+    ev->start = start;
+    ev->end = get_clock();
+    qatomic_store_release(&buf->head, head + 1);
+}
+
+void timeline_set_thread_name(const char *name)
+{
+    pstrcpy(timeline_thread_name, sizeof(timeline_thread_name), name);
+    if (timeline_buffer) {
+        pstrcpy(timeline_buffer->name, sizeof(timeline_buffer->name), name);
+    }
+}
+
+void timeline_start(void)
+{
+    if (qatomic_read(&timeline_active)) {
+        return;
+    }
+
+    timeline_start_time = get_clock();
+    qatomic_inc(&timeline_generation);
+    qatomic_store_release(&timeline_active, true);
+}
+
+static void timeline_write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static double timeline_to_us(int64_t t)
+{
+    return MAX(t - timeline_start_time, 0) / 1000.0;
+}
+
+static void timeline_write_buffer(FILE *f, TimelineBuffer *buf, int pid,
+                                  bool *first)
+{
+    unsigned int generation = qatomic_read(&timeline_generation);
+    if (qatomic_load_acquire(&buf->generation) != generation) {
+        return;
+    }
+
+    /*
+     * A thread that saw the tracer active just before it was stopped may
+     * still be writing the slot after head, which is the oldest event once
+     * the ring has wrapped, so that one is skipped.
+     */
+    uint32_t head = qatomic_load_acquire(&buf->head);
+    uint32_t tail = 0;
+    if (head >= TIMELINE_BUFFER_EVENTS) {
+        tail = head - TIMELINE_BUFFER_EVENTS + 1;
+    }
+    if (head == tail) {
+        return;
+    }
+
+    fprintf(f, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":", *first ? "" : ",", pid,
+            buf->tid);
+    timeline_write_string(f, buf->name);
+    fprintf(f, "}}");
+    *first = false;
+
+    for (uint32_t i = tail; i != head; i++) {
+        TimelineEvent *ev = &buf->events[i % TIMELINE_BUFFER_EVENTS];
+        if (ev->end < timeline_start_time) {
+            continue;
+        }
+
+        double start_us = timeline_to_us(ev->start);
+        fprintf(f, ",\n{\"ph\":\"X\",\"name\":");
+        timeline_write_string(f, ev->name);
+        fprintf(f, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", pid,
+                buf->tid, start_us, timeline_to_us(ev->end) - start_us);
+        if (ev->detail) {
+            fprintf(f, ",\"args\":{\"detail\":");
+            timeline_write_string(f, ev->detail);
+            fputc('}', f);
+        }
+        fputc('}', f);
+    }
+}
+
+bool timeline_stop(const char *path, Error **errp)
+{
+    if (!qatomic_read(&timeline_active)) {
+        error_setg(errp, "The timeline is not being recorded");
+        return false;
+    }
+
+    qatomic_set(&timeline_active, false);
+    smp_mb();
+
+    FILE *f = qemu_fopen(path, "w");
+    if (!f) {
+        error_setg_errno(errp, errno, "Failed to open %s for writing", path);
+        return false;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    TimelineBuffer *buf;
+    QSLIST_FOREACH(buf, &timeline_buffers, next) {
+        timeline_write_buffer(f, buf, pid, &first);
+    }
+
+    fprintf(f, "\n]}\n");
+
+    bool failed = ferror(f);
+    if (fclose(f) || failed) {
+        error_setg(errp, "Failed to write %s", path);
+        return false;
+    }
+
+    return true;
+}
@@ -89,6 +89,8 @@ struct xbe *xemu_get_xbe_info(void)
         free(xbe.headers);
         xbe.headers = NULL;
     }
+    xbe.sections = NULL;
+    xbe.num_sections = 0;
 
     // Get physical page of headers
     hwaddr hdr_addr_phys = 0;
@@ -133,5 +135,41 @@ struct xbe *xemu_get_xbe_info(void)
     }
     xbe.cert = (struct xbe_certificate *)(xbe.headers + cert_addr_virt - hdr_addr_virt);
 
+    // Get section headers, which are only used for diagnostics
+    uint32_t num_sections = ldl_le_p(&xbe.header->m_sections);
+    vaddr sections_addr_virt = ldl_le_p(&xbe.header->m_section_headers_addr);
+    if ((sections_addr_virt >= hdr_addr_virt) && ((sections_addr_virt + (uint64_t)num_sections * sizeof(struct xbe_section_header)) <= (hdr_addr_virt + xbe.headers_len))) {
+        xbe.sections = (struct xbe_section_header *)(xbe.headers + sections_addr_virt - hdr_addr_virt);
+        xbe.num_sections = num_sections;
+    }
+
     return &xbe;
 }
+
+const char *xemu_get_xbe_section_name(struct xbe *xbe, uint32_t addr)
+{
+    vaddr hdr_addr_virt = 0x10000;
+
+    for (uint32_t i = 0; i < xbe->num_sections; i++) {
+        struct xbe_section_header *section = &xbe->sections[i];
+        uint32_t start = ldl_le_p(&section->m_virtual_addr);
+        uint32_t size = ldl_le_p(&section->m_virtual_size);
+        if (addr < start || (addr - start) >= size) {
+            continue;
+        }
+
+        // Names are kept with the headers, but may not be terminated there
+        vaddr name_addr_virt = ldl_le_p(&section->m_section_name_addr);
+        if ((name_addr_virt < hdr_addr_virt) || (name_addr_virt >= (hdr_addr_virt + xbe->headers_len))) {
+            return NULL;
+        }
+        const char *name = (const char *)(xbe->headers + name_addr_virt - hdr_addr_virt);
+        size_t max_len = xbe->headers_len - (name_addr_virt - hdr_addr_virt);
+        if (strnlen(name, max_len) == max_len) {
+            return NULL;
+        }
+        return name;
+    }
+
+    return NULL;
+}
@@ -89,6 +89,20 @@ struct xbe_certificate
     uint8_t  m_sig_key[16];                   // signature key
     uint8_t  m_title_alt_sig_key[16][16];     // alternate signature keys
 };
+
+struct xbe_section_header
+{
+    uint32_t m_flags;                         // section flags
+    uint32_t m_virtual_addr;                  // virtual address
+    uint32_t m_virtual_size;                  // virtual size
+    uint32_t m_raw_addr;                      // file offset to raw data
+    uint32_t m_sizeof_raw;                    // size of raw data
+    uint32_t m_section_name_addr;             // section name address
+    uint32_t m_section_reference_count;       // section reference count
+    uint32_t m_head_shared_ref_count_addr;    // head shared page reference count address
+    uint32_t m_tail_shared_ref_count_addr;    // tail shared page reference count address
+    uint8_t  m_section_digest[20];            // section digest
+};
 #pragma pack()
 
 struct xbe {
@@ -99,6 +113,8 @@ struct xbe {
 	// Pointers into `headers` (note: little-endian!)
 	struct xbe_header *header;
 	struct xbe_certificate *cert;
+	struct xbe_section_header *sections;
+	uint32_t num_sections;
 };
 
 #ifdef __cplusplus
@@ -108,6 +124,9 @@ extern "C" {
 // Get current XBE info
 struct xbe *xemu_get_xbe_info(void);
 
+// Get the name of the section containing `addr`, or NULL
+const char *xemu_get_xbe_section_name(struct xbe *xbe, uint32_t addr);
+
 #ifdef __cplusplus
 }
 #endif